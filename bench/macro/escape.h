@@ -0,0 +1,71 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The calls the instrumentation inserts, written out by hand for the macro
+// workloads as in test/benchmark.c.  Built with -DCAMP_RUNTIME they call
+// into safe_tcmalloc; without it they compile away, for runs against
+// allocators that do not provide them.
+
+#ifndef BENCH_MACRO_ESCAPE_H_
+#define BENCH_MACRO_ESCAPE_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#ifdef CAMP_RUNTIME
+int __gep_check_boundary(void *, void *, size_t);
+int __escape(void **, void *);
+#endif
+
+static inline __attribute__((always_inline)) void
+macro_escape(void **loc, void *ptr) {
+#ifdef CAMP_RUNTIME
+  __escape(loc, ptr);
+#else
+  (void)loc;
+  (void)ptr;
+#endif
+}
+
+static inline __attribute__((always_inline)) void
+macro_check(void *base, void *ptr, size_t size) {
+#ifdef CAMP_RUNTIME
+  __gep_check_boundary(base, ptr, size);
+#else
+  (void)base;
+  (void)ptr;
+  (void)size;
+#endif
+}
+
+// Stores the pointer v into the pointer lvalue loc, escaping it first.
+#define SET(loc, v)                        \
+  do {                                     \
+    void *set_v_ = (v);                    \
+    macro_escape((void **)&(loc), set_v_); \
+    (loc) = set_v_;                        \
+  } while (0)
+
+// Checks the access to *p before it is made, as instrumented code does for
+// pointer arithmetic off a heap base.
+#define CHECK_FIELD(base, p) \
+  macro_check((void *)(base), (void *)(p), sizeof(*(p)))
+
+static inline double macro_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#endif  // BENCH_MACRO_ESCAPE_H_
@@ -0,0 +1,214 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// JSON parsing: generates a document of `records` nested records, then
+// `rounds` times parses it into a tree of nodes and strings, walks the tree
+// and frees it.  Links between nodes and to their strings are stored
+// through SET() and field accesses checked with CHECK_FIELD(), the calls an
+// instrumented DOM parser makes.
+//
+// usage: json [records [rounds]]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "escape.h"
+
+enum type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT };
+
+struct value {
+  enum type type;
+  double number;
+  char *string;          // STRING, or the key of an object member
+  struct value *child;   // first element of an ARRAY or OBJECT
+  struct value *next;    // next sibling
+};
+
+struct buffer {
+  char *data;
+  size_t len, cap;
+};
+
+static void append(struct buffer *b, const char *s) {
+  const size_t n = strlen(s);
+  if (b->len + n + 1 > b->cap) {
+    b->cap = (b->len + n + 1) * 2;
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, s, n + 1);
+  b->len += n;
+}
+
+static void generate_record(struct buffer *b, int i, int depth) {
+  char tmp[64];
+  snprintf(tmp, sizeof(tmp), "{\"id\":%d,\"name\":\"record-%d\",", i, i);
+  append(b, tmp);
+  append(b, "\"active\":true,\"score\":");
+  snprintf(tmp, sizeof(tmp), "%d.%d", i % 1000, i % 7);
+  append(b, tmp);
+  append(b, ",\"tags\":[\"alpha\",\"beta\",\"gamma\",null],\"child\":");
+  if (depth > 0) {
+    generate_record(b, i * 31 + depth, depth - 1);
+  } else {
+    append(b, "{}");
+  }
+  append(b, "}");
+}
+
+static char *generate(int records) {
+  struct buffer b = {NULL, 0, 0};
+  append(&b, "[");
+  for (int i = 0; i < records; ++i) {
+    if (i > 0) append(&b, ",");
+    generate_record(&b, i, i % 4);
+  }
+  append(&b, "]");
+  return b.data;
+}
+
+static void skip_space(const char **p) {
+  while (**p == ' ' || **p == '\n' || **p == '\t' || **p == '\r') ++*p;
+}
+
+static char *parse_string(const char **p) {
+  const char *start = ++*p;
+  while (**p != '"') ++*p;
+  const size_t n = *p - start;
+  ++*p;
+  char *s = malloc(n + 1);
+  macro_check(s, s + n, 1);
+  memcpy(s, start, n);
+  s[n] = '\0';
+  return s;
+}
+
+static struct value *parse(const char **p);
+
+// Parses the elements of an array or the members of an object up to
+// `close`, linking them as children of v.
+static void parse_children(const char **p, struct value *v, char close) {
+  struct value *last = NULL;
+  ++*p;
+  skip_space(p);
+  while (**p != close) {
+    char *key = NULL;
+    if (close == '}') {
+      key = parse_string(p);
+      skip_space(p);
+      ++*p;  // ':'
+    }
+    struct value *child = parse(p);
+    if (key != NULL) SET(child->string, key);
+    if (last == NULL) {
+      SET(v->child, child);
+    } else {
+      CHECK_FIELD(last, &last->next);
+      SET(last->next, child);
+    }
+    last = child;
+    skip_space(p);
+    if (**p == ',') {
+      ++*p;
+      skip_space(p);
+    }
+  }
+  ++*p;
+}
+
+static struct value *parse(const char **p) {
+  skip_space(p);
+  struct value *v = calloc(1, sizeof(*v));
+  switch (**p) {
+    case '{':
+      v->type = OBJECT;
+      parse_children(p, v, '}');
+      break;
+    case '[':
+      v->type = ARRAY;
+      parse_children(p, v, ']');
+      break;
+    case '"': {
+      v->type = STRING;
+      // An object member keeps its key in string, so a string value goes
+      // into a child.
+      struct value *s = calloc(1, sizeof(*s));
+      s->type = STRING;
+      SET(s->string, parse_string(p));
+      SET(v->child, s);
+      break;
+    }
+    case 't':
+    case 'f':
+      v->type = BOOL;
+      v->number = **p == 't';
+      *p += **p == 't' ? 4 : 5;
+      break;
+    case 'n':
+      v->type = NUL;
+      *p += 4;
+      break;
+    default: {
+      char *end;
+      v->type = NUMBER;
+      v->number = strtod(*p, &end);
+      *p = end;
+      break;
+    }
+  }
+  return v;
+}
+
+// Sums what the tree holds, touching every node.
+static double walk(const struct value *v) {
+  double sum = 0;
+  for (; v != NULL; v = v->next) {
+    CHECK_FIELD(v, &v->number);
+    sum += v->number + (v->string != NULL ? strlen(v->string) : 0);
+    sum += walk(v->child);
+  }
+  return sum;
+}
+
+static void release(struct value *v) {
+  while (v != NULL) {
+    struct value *next = v->next;
+    release(v->child);
+    free(v->string);
+    free(v);
+    v = next;
+  }
+}
+
+int main(int argc, char **argv) {
+  const int records = argc > 1 ? atoi(argv[1]) : 1 << 16;
+  const int rounds = argc > 2 ? atoi(argv[2]) : 8;
+  char *doc = generate(records);
+
+  double sum = 0;
+  const double start = macro_seconds();
+  for (int i = 0; i < rounds; ++i) {
+    const char *p = doc;
+    struct value *root = parse(&p);
+    sum += walk(root);
+    release(root);
+  }
+  const double elapsed = macro_seconds() - start;
+
+  printf("json: %d records of %zu bytes, %d rounds, checksum %.0f, %.3f s\n",
+         records, strlen(doc), rounds, sum, elapsed);
+  free(doc);
+  return 0;
+}
@@ -0,0 +1,52 @@
+-- Copyright 2019 The TCMalloc Authors
+--
+-- Licensed under the Apache License, Version 2.0 (the "License");
+-- you may not use this file except in compliance with the License.
+-- You may obtain a copy of the License at
+--
+--     https://www.apache.org/licenses/LICENSE-2.0
+--
+-- Unless required by applicable law or agreed to in writing, software
+-- distributed under the License is distributed on an "AS IS" BASIS,
+-- WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+-- See the License for the specific language governing permissions and
+-- limitations under the License.
+--
+-- An interpreter loop heavy on the allocator: builds tables of records and
+-- strings, rewrites and drops them, so the collector frees what the loop
+-- allocated.
+--
+-- usage: lua churn.lua [rounds]
+
+local rounds = tonumber(arg[1]) or 200
+local live = {}
+local slots = 4096
+local sum = 0
+
+local start = os.clock()
+for round = 1, rounds do
+  for i = 1, slots do
+    local key = (i * 7919 + round) % slots + 1
+    local old = live[key]
+    if old ~= nil then
+      sum = sum + #old.name + #old.items
+    end
+    local items = {}
+    for j = 1, (i % 16) + 1 do
+      items[j] = { index = j, label = "item" .. j .. ":" .. round }
+    end
+    live[key] = {
+      name = string.rep("x", i % 64) .. round,
+      items = items,
+      parent = live[(key % slots) + 1],
+    }
+  end
+  local words = {}
+  for i = 1, 1024 do
+    words[#words + 1] = tostring(i * round)
+  end
+  sum = sum + #table.concat(words, ",")
+end
+
+print(string.format("lua churn: %d rounds, checksum %d, %.3f s", rounds, sum,
+                    os.clock() - start))
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 The TCMalloc Authors.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Runs macro workloads and reports them.
+
+  macro.py measure --csv FILE --workload W --config C --repeat N -- CMD...
+      runs CMD N times and appends the median wall time and the largest
+      peak RSS of the runs to FILE.
+  macro.py summarize FILE
+      prints the results of FILE with each configuration's slowdown and
+      RSS relative to the glibc run of the same workload.
+"""
+
+import argparse
+import csv
+import os
+import statistics
+import subprocess
+import sys
+import time
+
+FIELDS = ["workload", "config", "runs", "median_seconds", "max_rss_kb"]
+
+
+def high_water_mark_kb(pid):
+  """Returns the peak RSS of process pid, or 0 once it is gone."""
+  try:
+    with open("/proc/%d/status" % pid) as f:
+      for line in f:
+        if line.startswith("VmHWM:"):
+          return int(line.split()[1])
+  except OSError:
+    pass
+  return 0
+
+
+def measure(args):
+  times = []
+  max_rss = 0
+  for _ in range(args.repeat):
+    start = time.monotonic()
+    child = subprocess.Popen(args.command, stdout=subprocess.DEVNULL)
+    # The child's ru_maxrss would include this process, which it was forked
+    # from, so poll the high-water mark of its own address space instead.
+    # Growth in its last poll interval is missed.
+    hwm = 0
+    while child.poll() is None:
+      hwm = max(hwm, high_water_mark_kb(child.pid))
+      time.sleep(0.01)
+    times.append(time.monotonic() - start)
+    if child.returncode != 0:
+      sys.exit("%s failed with status %d" % (args.command[0],
+                                             child.returncode))
+    max_rss = max(max_rss, hwm)
+  new = not os.path.exists(args.csv)
+  with open(args.csv, "a", newline="") as f:
+    writer = csv.DictWriter(f, fieldnames=FIELDS)
+    if new:
+      writer.writeheader()
+    writer.writerow({
+        "workload": args.workload,
+        "config": args.config,
+        "runs": args.repeat,
+        "median_seconds": "%.3f" % statistics.median(times),
+        "max_rss_kb": max_rss,
+    })
+  return 0
+
+
+def summarize(args):
+  with open(args.csv, newline="") as f:
+    rows = list(csv.DictReader(f))
+  base = {r["workload"]: r for r in rows if r["config"] == "glibc"}
+  print("%-10s %-14s %10s %8s %12s %8s" % ("workload", "config", "seconds",
+                                           "slowdown", "max RSS KiB", "RSS"))
+  for r in rows:
+    b = base.get(r["workload"])
+    seconds = float(r["median_seconds"])
+    rss = int(r["max_rss_kb"])
+    slowdown = seconds / float(b["median_seconds"]) if b else float("nan")
+    rss_ratio = rss / int(b["max_rss_kb"]) if b else float("nan")
+    print("%-10s %-14s %10.3f %7.2fx %12d %7.2fx" % (
+        r["workload"], r["config"], seconds, slowdown, rss, rss_ratio))
+  return 0
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+  sub = parser.add_subparsers(dest="mode", required=True)
+  m = sub.add_parser("measure")
+  m.add_argument("--csv", required=True)
+  m.add_argument("--workload", required=True)
+  m.add_argument("--config", required=True)
+  m.add_argument("--repeat", type=int, default=5)
+  m.add_argument("command", nargs="+")
+  s = sub.add_parser("summarize")
+  s.add_argument("csv")
+  args = parser.parse_args()
+  return measure(args) if args.mode == "measure" else summarize(args)
+
+
+if __name__ == "__main__":
+  sys.exit(main())
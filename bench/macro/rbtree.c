@@ -0,0 +1,279 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Red-black tree churn: looks up random keys in a tree of about `size`
+// nodes, deleting the node when the key is there and inserting one when it
+// is not, for `ops` operations.  Every link is stored through SET(), so
+// rotations issue the escapes an instrumented std::map would.
+//
+// usage: rbtree [size [ops]]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "escape.h"
+
+enum color { RED, BLACK };
+
+struct node {
+  struct node *left, *right, *parent;
+  uint64_t key;
+  enum color color;
+  // Payload, so nodes land in a size class of their own.
+  char value[24];
+};
+
+// The sentinel every leaf and the root's parent point to.
+static struct node nil_node = {&nil_node, &nil_node, &nil_node, 0, BLACK, {0}};
+#define NIL (&nil_node)
+
+static struct node *root = NIL;
+
+static void rotate_left(struct node *x) {
+  struct node *y = x->right;
+  SET(x->right, y->left);
+  if (y->left != NIL) SET(y->left->parent, x);
+  SET(y->parent, x->parent);
+  if (x->parent == NIL) {
+    SET(root, y);
+  } else if (x == x->parent->left) {
+    SET(x->parent->left, y);
+  } else {
+    SET(x->parent->right, y);
+  }
+  SET(y->left, x);
+  SET(x->parent, y);
+}
+
+static void rotate_right(struct node *x) {
+  struct node *y = x->left;
+  SET(x->left, y->right);
+  if (y->right != NIL) SET(y->right->parent, x);
+  SET(y->parent, x->parent);
+  if (x->parent == NIL) {
+    SET(root, y);
+  } else if (x == x->parent->right) {
+    SET(x->parent->right, y);
+  } else {
+    SET(x->parent->left, y);
+  }
+  SET(y->right, x);
+  SET(x->parent, y);
+}
+
+static void insert_fixup(struct node *z) {
+  while (z->parent->color == RED) {
+    struct node *g = z->parent->parent;
+    if (z->parent == g->left) {
+      struct node *y = g->right;
+      if (y->color == RED) {
+        z->parent->color = BLACK;
+        y->color = BLACK;
+        g->color = RED;
+        z = g;
+      } else {
+        if (z == z->parent->right) {
+          z = z->parent;
+          rotate_left(z);
+        }
+        z->parent->color = BLACK;
+        z->parent->parent->color = RED;
+        rotate_right(z->parent->parent);
+      }
+    } else {
+      struct node *y = g->left;
+      if (y->color == RED) {
+        z->parent->color = BLACK;
+        y->color = BLACK;
+        g->color = RED;
+        z = g;
+      } else {
+        if (z == z->parent->left) {
+          z = z->parent;
+          rotate_right(z);
+        }
+        z->parent->color = BLACK;
+        z->parent->parent->color = RED;
+        rotate_left(z->parent->parent);
+      }
+    }
+  }
+  root->color = BLACK;
+}
+
+static void insert(uint64_t key) {
+  struct node *z = malloc(sizeof(*z));
+  struct node *y = NIL;
+  struct node *x = root;
+  while (x != NIL) {
+    CHECK_FIELD(x, &x->key);
+    y = x;
+    x = key < x->key ? x->left : x->right;
+  }
+  z->key = key;
+  z->color = RED;
+  z->value[0] = (char)key;
+  SET(z->left, NIL);
+  SET(z->right, NIL);
+  SET(z->parent, y);
+  if (y == NIL) {
+    SET(root, z);
+  } else if (key < y->key) {
+    SET(y->left, z);
+  } else {
+    SET(y->right, z);
+  }
+  insert_fixup(z);
+}
+
+static void transplant(struct node *u, struct node *v) {
+  if (u->parent == NIL) {
+    SET(root, v);
+  } else if (u == u->parent->left) {
+    SET(u->parent->left, v);
+  } else {
+    SET(u->parent->right, v);
+  }
+  SET(v->parent, u->parent);
+}
+
+static void delete_fixup(struct node *x) {
+  while (x != root && x->color == BLACK) {
+    if (x == x->parent->left) {
+      struct node *w = x->parent->right;
+      if (w->color == RED) {
+        w->color = BLACK;
+        x->parent->color = RED;
+        rotate_left(x->parent);
+        w = x->parent->right;
+      }
+      if (w->left->color == BLACK && w->right->color == BLACK) {
+        w->color = RED;
+        x = x->parent;
+      } else {
+        if (w->right->color == BLACK) {
+          w->left->color = BLACK;
+          w->color = RED;
+          rotate_right(w);
+          w = x->parent->right;
+        }
+        w->color = x->parent->color;
+        x->parent->color = BLACK;
+        w->right->color = BLACK;
+        rotate_left(x->parent);
+        x = root;
+      }
+    } else {
+      struct node *w = x->parent->left;
+      if (w->color == RED) {
+        w->color = BLACK;
+        x->parent->color = RED;
+        rotate_right(x->parent);
+        w = x->parent->left;
+      }
+      if (w->right->color == BLACK && w->left->color == BLACK) {
+        w->color = RED;
+        x = x->parent;
+      } else {
+        if (w->left->color == BLACK) {
+          w->right->color = BLACK;
+          w->color = RED;
+          rotate_left(w);
+          w = x->parent->left;
+        }
+        w->color = x->parent->color;
+        x->parent->color = BLACK;
+        w->left->color = BLACK;
+        rotate_right(x->parent);
+        x = root;
+      }
+    }
+  }
+  x->color = BLACK;
+}
+
+static void delete(struct node *z) {
+  struct node *y = z;
+  struct node *x;
+  enum color y_color = y->color;
+  if (z->left == NIL) {
+    x = z->right;
+    transplant(z, z->right);
+  } else if (z->right == NIL) {
+    x = z->left;
+    transplant(z, z->left);
+  } else {
+    y = z->right;
+    while (y->left != NIL) y = y->left;
+    y_color = y->color;
+    x = y->right;
+    if (y->parent == z) {
+      SET(x->parent, y);
+    } else {
+      transplant(y, y->right);
+      SET(y->right, z->right);
+      SET(y->right->parent, y);
+    }
+    transplant(z, y);
+    SET(y->left, z->left);
+    SET(y->left->parent, y);
+    y->color = z->color;
+  }
+  if (y_color == BLACK) delete_fixup(x);
+  free(z);
+}
+
+static struct node *find(uint64_t key) {
+  struct node *x = root;
+  while (x != NIL && x->key != key) {
+    CHECK_FIELD(x, &x->key);
+    x = key < x->key ? x->left : x->right;
+  }
+  return x;
+}
+
+static uint64_t next_random(uint64_t *state) {
+  *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+  return *state >> 33;
+}
+
+int main(int argc, char **argv) {
+  const uint64_t size = argc > 1 ? strtoull(argv[1], NULL, 0) : 1 << 18;
+  const uint64_t ops = argc > 2 ? strtoull(argv[2], NULL, 0) : 1 << 22;
+  uint64_t rng = 1;
+  uint64_t live = 0, inserts = 0;
+
+  const double start = macro_seconds();
+  for (uint64_t i = 0; i < ops; ++i) {
+    // Keys from twice the target size keep the tree at about that size.
+    const uint64_t key = next_random(&rng) % (2 * size);
+    struct node *n = find(key);
+    if (n != NIL) {
+      delete(n);
+      live--;
+    } else {
+      insert(key);
+      live++;
+      inserts++;
+    }
+  }
+  const double elapsed = macro_seconds() - start;
+
+  while (root != NIL) delete(root);
+  printf("rbtree: %llu ops, %llu inserts, %llu live at the end, %.3f s\n",
+         (unsigned long long)ops, (unsigned long long)inserts,
+         (unsigned long long)live, elapsed);
+  return 0;
+}
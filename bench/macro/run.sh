@@ -0,0 +1,108 @@
+#!/bin/bash
+#
+# Copyright 2019 The TCMalloc Authors.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# This script builds the macro workloads and runs each of them with glibc
+# malloc, with safe_tcmalloc with protection disabled and with protection
+# on, then prints their times and peak RSS relative to glibc.  See
+# README.md.
+
+set -euo pipefail
+
+MACRO_DIR="$(realpath $(dirname ${0}))"
+TCMALLOC_LIB="${TCMALLOC_LIB:-/usr/local/lib/libtcmalloc_tcmalloc.so}"
+OUT="${OUT:-${MACRO_DIR}/out}"
+REPEAT="${REPEAT:-5}"
+CC="${CC:-cc}"
+CFLAGS="${CFLAGS:--O2}"
+WORKLOADS="${WORKLOADS:-rbtree json lua}"
+LUA_VERSION="${LUA_VERSION:-5.4.6}"
+
+if [ ! -f "${TCMALLOC_LIB}" ]; then
+  echo "${TCMALLOC_LIB} not found; build and install tcmalloc or set" \
+       "TCMALLOC_LIB" >&2
+  exit 1
+fi
+
+mkdir -p "${OUT}"
+readonly RESULTS="${OUT}/results.csv"
+rm -f "${RESULTS}"
+
+measure() {
+  local workload="$1" config="$2"
+  shift 2
+  python3 "${MACRO_DIR}/macro.py" measure --csv="${RESULTS}" \
+    --workload="${workload}" --config="${config}" --repeat="${REPEAT}" -- "$@"
+}
+
+# Runs `binary` built without the protection calls against glibc, and
+# `instrumented` built with them against safe_tcmalloc in both modes.
+run_configs() {
+  local workload="$1" binary="$2" instrumented="$3"
+  shift 3
+  echo "running ${workload}"
+  measure "${workload}" glibc "${binary}" "$@"
+  TCMALLOC_PROTECTION_POLICY=disabled \
+    measure "${workload}" protection_off "${instrumented}" "$@"
+  TCMALLOC_PROTECTION_POLICY=crash \
+    measure "${workload}" protection_on "${instrumented}" "$@"
+}
+
+build_c() {
+  local name="$1"
+  "${CC}" ${CFLAGS} -o "${OUT}/${name}" "${MACRO_DIR}/${name}.c"
+  "${CC}" ${CFLAGS} -DCAMP_RUNTIME -o "${OUT}/${name}_camp" \
+    "${MACRO_DIR}/${name}.c" "${TCMALLOC_LIB}" \
+    -Wl,-rpath,"$(dirname ${TCMALLOC_LIB})"
+}
+
+# Lua is not instrumented, so its runs with safe_tcmalloc only see the
+# allocator's own costs; it is preloaded rather than linked.
+build_lua() {
+  local src="${OUT}/lua-${LUA_VERSION}"
+  if [ ! -x "${src}/src/lua" ]; then
+    curl -fsSL "https://www.lua.org/ftp/lua-${LUA_VERSION}.tar.gz" |
+      tar -xz -C "${OUT}"
+    make -C "${src}" posix MYCFLAGS="${CFLAGS}" > /dev/null
+  fi
+}
+
+for workload in ${WORKLOADS}; do
+  case "${workload}" in
+    rbtree|json)
+      build_c "${workload}"
+      run_configs "${workload}" "${OUT}/${workload}" \
+        "${OUT}/${workload}_camp"
+      ;;
+    lua)
+      build_lua
+      lua="${OUT}/lua-${LUA_VERSION}/src/lua"
+      echo "running lua"
+      measure lua glibc "${lua}" "${MACRO_DIR}/lua/churn.lua"
+      measure lua protection_off env LD_PRELOAD="${TCMALLOC_LIB}" \
+        TCMALLOC_PROTECTION_POLICY=disabled "${lua}" \
+        "${MACRO_DIR}/lua/churn.lua"
+      measure lua protection_on env LD_PRELOAD="${TCMALLOC_LIB}" \
+        TCMALLOC_PROTECTION_POLICY=crash "${lua}" \
+        "${MACRO_DIR}/lua/churn.lua"
+      ;;
+    *)
+      echo "unknown workload ${workload}" >&2
+      exit 1
+      ;;
+  esac
+done
+
+python3 "${MACRO_DIR}/macro.py" summarize "${RESULTS}"
@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# Copyright 2019 The TCMalloc Authors.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# This script runs the allocator and protection benchmarks pinned to CPUS
+# and compares them against the results stored in BASELINE, failing if any
+# benchmark got slower than THRESHOLD allows (see compare_benchmarks.py).
+# Every benchmark runs REPETITIONS times for MIN_TIME seconds each and is
+# compared by its median.  With UPDATE=1, or when there is no baseline yet,
+# the results are stored as the new baseline instead.  The benchmarks are
+# built with Bazel.
+
+set -euo pipefail
+
+if [ -z ${TCMALLOC_ROOT:-} ]; then
+  TCMALLOC_ROOT="$(realpath $(dirname ${0})/..)"
+fi
+
+BASELINE="${BASELINE:-${TCMALLOC_ROOT}/ci/benchmark_baseline.json}"
+CPUS="${CPUS:-2}"
+THRESHOLD="${THRESHOLD:-0.05}"
+MIN_TIME="${MIN_TIME:-0.5}"
+REPETITIONS="${REPETITIONS:-5}"
+OUT="${OUT:-$(mktemp -d)}"
+BAZEL="${BAZEL:-bazel}"
+
+readonly BENCHMARKS=(
+  //tcmalloc/testing:tcmalloc_benchmark
+  //tcmalloc:check_benchmark
+  //tcmalloc:escape_benchmark
+  //tcmalloc:latency_benchmark
+)
+
+cd "${TCMALLOC_ROOT}"
+"${BAZEL}" build --compilation_mode=opt ${BAZEL_EXTRA_ARGS:-} \
+  "${BENCHMARKS[@]}"
+
+mkdir -p "${OUT}"
+results=()
+for target in "${BENCHMARKS[@]}"; do
+  package="${target#//}"
+  package="${package%%:*}"
+  name="${target##*:}"
+  echo "running ${target} on CPUs ${CPUS}"
+  taskset --cpu-list "${CPUS}" "bazel-bin/${package}/${name}" \
+    --benchmark_min_time="${MIN_TIME}" \
+    --benchmark_repetitions="${REPETITIONS}" \
+    --benchmark_report_aggregates_only=true \
+    --benchmark_out_format=json \
+    --benchmark_out="${OUT}/${name}.json" \
+    ${BENCHMARK_EXTRA_ARGS:-} > /dev/null
+  results+=("${OUT}/${name}.json")
+done
+
+update=()
+if [[ ${UPDATE:-0} -ne 0 ]]; then
+  update=(--update)
+fi
+python3 "${TCMALLOC_ROOT}/ci/compare_benchmarks.py" \
+  --baseline="${BASELINE}" \
+  --threshold="${THRESHOLD}" \
+  ${update[@]+"${update[@]}"} \
+  "${results[@]}"
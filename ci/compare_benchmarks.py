@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 The TCMalloc Authors.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Compares benchmark results against a baseline.
+
+Reads the --benchmark_format=json output of one or more benchmark binaries,
+takes the median of each benchmark when it was repeated, and compares its
+time with the baseline.  A benchmark that got slower by more than its
+threshold is a regression, and any regression makes the exit status 1.
+
+The baseline is the merged output of an earlier run.  Besides the
+benchmarks it may hold a "thresholds" object mapping benchmark names to the
+fraction they may slow down by, for benchmarks noisier than --threshold
+allows.  With --update the current results replace the baseline, keeping
+its thresholds.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load_results(paths):
+  """Returns the merged benchmarks of the files, keyed by name."""
+  medians = {}
+  runs = {}
+  context = None
+  for path in paths:
+    with open(path) as f:
+      data = json.load(f)
+    context = context or data.get("context")
+    for b in data.get("benchmarks", []):
+      if b.get("run_type") == "aggregate":
+        if b.get("aggregate_name") == "median":
+          medians[b["run_name"]] = b
+      elif b.get("error_occurred"):
+        continue
+      else:
+        runs.setdefault(b.get("run_name", b["name"]), b)
+  # Medians of repeated runs take precedence over their single runs.
+  runs.update(medians)
+  return context, runs
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+  parser.add_argument("--baseline", required=True,
+                      help="merged results to compare against")
+  parser.add_argument("--threshold", type=float, default=0.05,
+                      help="fraction a benchmark may slow down by")
+  parser.add_argument("--metric", default="cpu_time",
+                      choices=["cpu_time", "real_time"])
+  parser.add_argument("--update", action="store_true",
+                      help="write the results as the new baseline")
+  parser.add_argument("results", nargs="+",
+                      help="--benchmark_format=json outputs of this run")
+  args = parser.parse_args()
+
+  context, current = load_results(args.results)
+
+  try:
+    with open(args.baseline) as f:
+      baseline = json.load(f)
+  except FileNotFoundError:
+    baseline = None
+  thresholds = baseline.get("thresholds", {}) if baseline else {}
+
+  if args.update or baseline is None:
+    with open(args.baseline, "w") as f:
+      json.dump({"context": context, "thresholds": thresholds,
+                 "benchmarks": [current[k] for k in sorted(current)]},
+                f, indent=2)
+    print("wrote %d benchmarks to %s" % (len(current), args.baseline))
+    return 0
+
+  _, base = load_results([args.baseline])
+  regressions = []
+  width = max([len(name) for name in current] + [10])
+  print("%-*s %14s %14s %8s" % (width, "benchmark", "baseline",
+                                "current", "change"))
+  for name in sorted(current):
+    if name not in base:
+      print("%-*s %14s %14.1f %8s" % (width, name, "-",
+                                      current[name][args.metric], "new"))
+      continue
+    old = base[name][args.metric]
+    new = current[name][args.metric]
+    change = (new - old) / old if old else 0.0
+    limit = thresholds.get(name, args.threshold)
+    mark = ""
+    if change > limit:
+      mark = "  REGRESSION (limit %+.1f%%)" % (limit * 100)
+      regressions.append(name)
+    print("%-*s %14.1f %14.1f %+7.1f%%%s" % (width, name, old, new,
+                                             change * 100, mark))
+  for name in sorted(set(base) - set(current)):
+    print("%-*s missing from this run" % (width, name))
+
+  if regressions:
+    print("%d of %d benchmarks regressed" % (len(regressions), len(current)))
+    return 1
+  return 0
+
+
+if __name__ == "__main__":
+  sys.exit(main())
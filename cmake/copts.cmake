@@ -38,9 +38,29 @@ else ()
 set(TCMALLOC_GPROF "")
 endif()
 
+# The frame pointer walk of FRAME_POINTER_UNWIND needs tcmalloc's own frames
+# to keep theirs.
+if (FRAME_POINTER_UNWIND)
+set(TCMALLOC_FRAME_POINTER -fno-omit-frame-pointer)
+else ()
+set(TCMALLOC_FRAME_POINTER "")
+endif()
+
+# LTO_ARCHIVE emits bitcode for the application's link to optimize across.
+# Clang gets ThinLTO; GCC keeps the machine code as well, so an application
+# linked without -flto still links.
+if (LTO_ARCHIVE AND CMAKE_CXX_COMPILER_ID STREQUAL "Clang")
+set(TCMALLOC_LTO -flto=thin)
+elseif (LTO_ARCHIVE AND CMAKE_CXX_COMPILER_ID STREQUAL "GNU")
+set(TCMALLOC_LTO -flto -ffat-lto-objects)
+else ()
+set(TCMALLOC_LTO "")
+endif()
 
 if (CMAKE_CXX_COMPILER_ID STREQUAL "Clang")
-set(TCMALLOC_DEFAULT_COPTS ${TCMALLOC_LLVM_FLAGS} ${TCMALLOC_GPROF})
+set(TCMALLOC_DEFAULT_COPTS ${TCMALLOC_LLVM_FLAGS} ${TCMALLOC_GPROF}
+    ${TCMALLOC_FRAME_POINTER} ${TCMALLOC_LTO})
 elseif (CMAKE_CXX_COMPILER_ID STREQUAL "GNU")
-set(TCMALLOC_DEFAULT_COPTS ${TCMALLOC_GCC_FLAGS} ${TCMALLOC_GPROF})
+set(TCMALLOC_DEFAULT_COPTS ${TCMALLOC_GCC_FLAGS} ${TCMALLOC_GPROF}
+    ${TCMALLOC_FRAME_POINTER} ${TCMALLOC_LTO})
 endif()
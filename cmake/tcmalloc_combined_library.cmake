@@ -0,0 +1,98 @@
+#
+# Copyright 2019 The TCMalloc Authors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# tcmalloc_combined_library()
+#
+# CMake function to bundle a static library and every static library it
+# links, transitively, into one archive lib${NAME}.a in the current binary
+# directory, built by the custom target ${NAME}.
+#
+# Parameters:
+# NAME: name of the custom target and of the archive
+# ROOT: the static library target to start from
+#
+# The archives are merged with an ar MRI script, which copies their members
+# as they are, so members of the same name in different archives (such as
+# the two escaping.cc.o of abseil) are all kept.  The compiler's own ar
+# (llvm-ar, gcc-ar) is used when there is one, so the symbol table also
+# covers members that are LTO bitcode.
+#
+# Must be called after every target ROOT depends on has been defined.
+function(tcmalloc_combined_library)
+  cmake_parse_arguments(TCMALLOC_COMBINED "" "NAME;ROOT" "" ${ARGN})
+
+  set(_pending "${TCMALLOC_COMBINED_ROOT}")
+  set(_seen "")
+  set(_archives "")
+  while(_pending)
+    list(POP_FRONT _pending _dep)
+    # Dependencies of a static library are listed as $<LINK_ONLY:dep>.
+    string(REGEX REPLACE "^\\$<LINK_ONLY:(.*)>$" "\\1" _dep "${_dep}")
+    # Skip link flags and system libraries.
+    if(NOT TARGET "${_dep}")
+      continue()
+    endif()
+    get_target_property(_aliased "${_dep}" ALIASED_TARGET)
+    if(_aliased)
+      set(_dep "${_aliased}")
+    endif()
+    if("${_dep}" IN_LIST _seen)
+      continue()
+    endif()
+    list(APPEND _seen "${_dep}")
+
+    get_target_property(_type "${_dep}" TYPE)
+    get_target_property(_imported "${_dep}" IMPORTED)
+    if(_type STREQUAL "STATIC_LIBRARY")
+      list(APPEND _archives "${_dep}")
+    endif()
+    set(_links "")
+    if(NOT _imported AND NOT _type STREQUAL "INTERFACE_LIBRARY")
+      get_target_property(_links "${_dep}" LINK_LIBRARIES)
+    endif()
+    get_target_property(_interface_links "${_dep}" INTERFACE_LINK_LIBRARIES)
+    foreach(_link IN LISTS _links _interface_links)
+      if(_link)
+        list(APPEND _pending "${_link}")
+      endif()
+    endforeach()
+  endwhile()
+
+  set(_output "${CMAKE_CURRENT_BINARY_DIR}/lib${TCMALLOC_COMBINED_NAME}.a")
+  set(_script_file "${CMAKE_CURRENT_BINARY_DIR}/${TCMALLOC_COMBINED_NAME}.mri")
+  set(_script "create ${_output}\n")
+  foreach(_archive IN LISTS _archives)
+    string(APPEND _script "addlib $<TARGET_FILE:${_archive}>\n")
+  endforeach()
+  string(APPEND _script "save\nend\n")
+  file(GENERATE OUTPUT "${_script_file}" CONTENT "${_script}")
+
+  if(CMAKE_CXX_COMPILER_AR)
+    set(_ar "${CMAKE_CXX_COMPILER_AR}")
+  else()
+    set(_ar "${CMAKE_AR}")
+  endif()
+
+  # Not VERBATIM, so that the script is fed to ar through the shell.
+  add_custom_command(
+    OUTPUT "${_output}"
+    COMMAND ${CMAKE_COMMAND} -E rm -f "${_output}"
+    COMMAND "${_ar}" -M < "${_script_file}"
+    DEPENDS ${_archives} "${_script_file}"
+    COMMENT "Combining ${TCMALLOC_COMBINED_ROOT} and its static dependencies into ${_output}"
+  )
+  add_custom_target(${TCMALLOC_COMBINED_NAME} DEPENDS "${_output}")
+endfunction()
@@ -6,12 +6,159 @@ add_compile_definitions(CRASH_ON_CORRUPTION=1)
 
 set(PROTECTION_DEBUG FALSE)
 
+set(ESCAPE_CACHE_L2 TRUE)
+add_compile_definitions(ESCAPE_CACHE_L2=1)
+
+set(CHUNK_CACHE TRUE)
+add_compile_definitions(CHUNK_CACHE=1)
+
+set(HEAP_RANGE_FILTER TRUE)
+add_compile_definitions(HEAP_RANGE_FILTER=1)
+
+set(PAGEMAP_HUGE_LEAVES FALSE)
+
+set(ESCAPE_HUGEPAGE_METADATA FALSE)
+
+set(FLAT_PAGE_INFO FALSE)
+
+set(CHUNK_START_TABLE FALSE)
+
+set(FREE_QUARANTINE FALSE)
+
+set(REMOTE_FREE_QUEUE FALSE)
+
+set(POINTER_TAGGING FALSE)
+
+set(POW2_SIZE_CLASSES FALSE)
+
+set(PROTECTION_SIZE_CLASSES FALSE)
+
+set(POINTER_FREE_CLASSES FALSE)
+
+set(COLD_SKIP_ESCAPES FALSE)
+
+set(LIFETIME_PROTECTION FALSE)
+
+set(ESCAPE_FREE_SPANS_FIRST FALSE)
+
+set(ESCAPE_AWARE_RECLAIM FALSE)
+
+set(LLC_SHARED_REFILL FALSE)
+
+set(ADAPTIVE_BATCH_SIZE FALSE)
+
+set(TIERED_RELEASE FALSE)
+
+set(CLASS_COLOCATED_SPANS FALSE)
+
+set(NUMA_HUGE_CACHE FALSE)
+
+set(SPAN_CACHE FALSE)
+
+set(OUTGOING_ESCAPE_INDEX FALSE)
+
+set(ESCAPE_CHAIN_SWEEP FALSE)
+
+set(ESCAPE_LOCATION_CLASSES FALSE)
+
+set(DEFERRED_ESCAPE_POISON FALSE)
+
+set(COMPRESSED_ESCAPE_CHUNKS FALSE)
+
+set(SORTED_ESCAPE_FLUSH FALSE)
+
+set(PIPELINED_ESCAPE_PREFETCH FALSE)
+
+set(ESCAPE_REFCOUNTS FALSE)
+
+set(SAMPLED_ESCAPE_SPANS FALSE)
+
+set(STATS_SNAPSHOT FALSE)
+
+set(CONTINUOUS_PROFILE FALSE)
+
+set(STATS_PAGE FALSE)
+
+set(FRAME_POINTER_UNWIND FALSE)
+
+set(THREAD_ALLOCATION_STATS FALSE)
+
+set(CALLOC_KNOWN_ZERO FALSE)
+
+set(REALLOC_IN_PLACE FALSE)
+
+set(REALLOC_MREMAP FALSE)
+
+set(LTO_ARCHIVE FALSE)
+
+set(HEAP_PARTITIONS FALSE)
+
+set(FILLER_COLLAPSE FALSE)
+
+set(SCALABLE_GUARDED_PAGES FALSE)
+
+set(LARGE_FREE_OFFLOAD FALSE)
+
+set(DEFERRED_TOPOLOGY FALSE)
+
+set(MEMORY_TAGGING FALSE)
+
+set(SPARSE_ESCAPE_TABLES FALSE)
+
+set(MEMORY_PRESSURE_RELEASE FALSE)
+
+set(RSEQ_MM_CID FALSE)
+
+set(CLASS_REGIONS FALSE)
+
+set(DEFERRED_PEAK_HEAP FALSE)
+
+set(TRACE_CAPTURE FALSE)
+
+set(SCRUB_ON_FREE FALSE)
+
+set(FORTIFY_CHK FALSE)
+
+set(COLD_TIER_BIND FALSE)
+
+set(ADAPTIVE_ESCAPE_BUFFER FALSE)
+
+set(DETERMINISTIC_MODE FALSE)
+
+set(PROFILED_SIZE_CLASSES FALSE)
+
+set(PREFETCH_FOR_WRITE FALSE)
+
+set(SAMPLING_AUTOTUNE FALSE)
+
+set(LLC_REMOTE_FREES FALSE)
+
+set(FORK_AWARE_PROTECTION FALSE)
+
+set(EXTERNAL_REGIONS FALSE)
+
+set(HEAP_COMPACTION FALSE)
+
+set(CENTRAL_FREELIST_SHARDS FALSE)
+
+set(HUGE_ADDRESS_BTREE FALSE)
+
+set(PAGE_ESCAPE_CHAINS FALSE)
+
+set(ESCAPE_SPAN_CACHE FALSE)
+
 set(ENABLE_STATISTIC TRUE)
 add_compile_definitions(ENABLE_STATISTIC=1)
 
+set(PROTECTION_TIMING FALSE)
+
+set(CALLSITE_PROFILE FALSE)
+
+set(ALLOCATION_TRACE FALSE)
+
 set(ENABLE_ERROR_REPORT TRUE)
 add_compile_definitions(ENABLE_ERROR_REPORT=1)
 
 set(ENABLE_GPROF FALSE)
 
-set(CONFIG_ENABLED_OPTIONS ENABLE_PROTECTION CRASH_ON_CORRUPTION ENABLE_STATISTIC ENABLE_ERROR_REPORT)
+set(CONFIG_ENABLED_OPTIONS ENABLE_PROTECTION CRASH_ON_CORRUPTION ESCAPE_CACHE_L2 CHUNK_CACHE HEAP_RANGE_FILTER ENABLE_STATISTIC ENABLE_ERROR_REPORT)
@@ -0,0 +1,145 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/allocation_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+using malloc_tracing_extension::TraceEvent;
+using malloc_tracing_extension::TraceHeader;
+
+namespace {
+
+// Value of next_ while no trace runs, above any capacity, so threads that
+// raced with Stop() get no slot.
+constexpr size_t kStopped = size_t{1} << 62;
+
+// Serializes Start() and Stop().
+ABSL_CONST_INIT absl::base_internal::SpinLock trace_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+int trace_fd ABSL_GUARDED_BY(trace_lock) = -1;
+TraceHeader* trace_header ABSL_GUARDED_BY(trace_lock) = nullptr;
+size_t trace_bytes ABSL_GUARDED_BY(trace_lock) = 0;
+
+}  // namespace
+
+ABSL_CONST_INIT std::atomic<TraceEvent*> AllocationTrace::events_{nullptr};
+ABSL_CONST_INIT std::atomic<size_t> AllocationTrace::next_{kStopped};
+ABSL_CONST_INIT std::atomic<size_t> AllocationTrace::written_{0};
+ABSL_CONST_INIT std::atomic<size_t> AllocationTrace::capacity_{0};
+
+int AllocationTrace::Start(const char* path, size_t max_events) {
+  if (max_events == 0 || max_events >= kStopped / sizeof(TraceEvent)) {
+    return EINVAL;
+  }
+  absl::base_internal::SpinLockHolder h(&trace_lock);
+  if (trace_fd >= 0) return EBUSY;
+
+  const size_t bytes = sizeof(TraceHeader) + max_events * sizeof(TraceEvent);
+  const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return errno;
+  // The file stays sparse until events land in it.
+  if (ftruncate(fd, bytes) != 0) {
+    const int err = errno;
+    close(fd);
+    return err;
+  }
+  void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    const int err = errno;
+    close(fd);
+    return err;
+  }
+
+  TraceHeader* header = static_cast<TraceHeader*>(mem);
+  header->magic = TraceHeader::kMagic;
+  header->version = TraceHeader::kVersion;
+  header->event_size = sizeof(TraceEvent);
+  header->events = 0;
+  header->cycles_per_second = absl::base_internal::CycleClock::Frequency();
+  trace_fd = fd;
+  trace_header = header;
+  trace_bytes = bytes;
+
+  capacity_.store(max_events, std::memory_order_relaxed);
+  written_.store(0, std::memory_order_relaxed);
+  events_.store(reinterpret_cast<TraceEvent*>(header + 1),
+                std::memory_order_release);
+  // Hands out slots from here on; pairs with the fetch_add of RecordSlow().
+  next_.store(0, std::memory_order_release);
+  return 0;
+}
+
+int AllocationTrace::Stop(size_t* events) {
+  absl::base_internal::SpinLockHolder h(&trace_lock);
+  if (trace_fd < 0) return ENOENT;
+
+  const size_t reserved = next_.exchange(kStopped, std::memory_order_acq_rel);
+  events_.store(nullptr, std::memory_order_relaxed);
+  const size_t n =
+      std::min(reserved, capacity_.load(std::memory_order_relaxed));
+  // Threads that got a slot before the exchange may still be filling it.
+  while (written_.load(std::memory_order_acquire) < n) {
+    sched_yield();
+  }
+
+  trace_header->events = n;
+  int err = 0;
+  if (munmap(trace_header, trace_bytes) != 0) err = errno;
+  if (ftruncate(trace_fd, sizeof(TraceHeader) + n * sizeof(TraceEvent)) !=
+          0 &&
+      err == 0) {
+    err = errno;
+  }
+  if (close(trace_fd) != 0 && err == 0) err = errno;
+  trace_fd = -1;
+  trace_header = nullptr;
+  trace_bytes = 0;
+  *events = n;
+  return err;
+}
+
+void AllocationTrace::RecordSlow(EventType type, const void* address,
+                                 const void* value, size_t size) {
+  const size_t slot = next_.fetch_add(1, std::memory_order_acq_rel);
+  if (slot >= capacity_.load(std::memory_order_relaxed)) return;
+  TraceEvent* events = events_.load(std::memory_order_acquire);
+  if (events != nullptr) {
+    TraceEvent& e = events[slot];
+    e.cycles = absl::base_internal::CycleClock::Now();
+    e.address = reinterpret_cast<uintptr_t>(address);
+    e.value = reinterpret_cast<uintptr_t>(value);
+    e.size = static_cast<uint32_t>(std::min<size_t>(size, UINT32_MAX));
+    e.type = type;
+  }
+  written_.fetch_add(1, std::memory_order_release);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,89 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Recording of allocation traces (ALLOCATION_TRACE).
+//
+// While a trace runs, the trace file is mapped shared and every event takes
+// the next slot of it with one fetch_add, so events land in the file in the
+// order the threads reached the allocator and nothing has to be merged or
+// written out afterwards.  A second counter of the slots written lets Stop()
+// wait for the threads still filling theirs before it unmaps the file.
+// Without a running trace recording an event is one load of a global.
+
+#ifndef TCMALLOC_ALLOCATION_TRACE_H_
+#define TCMALLOC_ALLOCATION_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/malloc_tracing_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+class AllocationTrace {
+ public:
+  using EventType = malloc_tracing_extension::TraceEventType;
+
+  // Creates the trace file at `path` and starts recording into it.  Returns
+  // 0 or an errno value; EBUSY if a trace is already running.
+  static int Start(const char* path, size_t max_events);
+
+  // Stops recording and truncates the file to the events recorded, whose
+  // number is stored in *events.  Returns 0 or an errno value; ENOENT if no
+  // trace is running.
+  static int Stop(size_t* events);
+
+  static void Record(EventType type, const void* address, const void* value,
+                     size_t size) {
+    if (ABSL_PREDICT_TRUE(events_.load(std::memory_order_relaxed) ==
+                          nullptr)) {
+      return;
+    }
+    RecordSlow(type, address, value, size);
+  }
+
+ private:
+  static void RecordSlow(EventType type, const void* address,
+                         const void* value, size_t size);
+
+  // Events of the running trace, or nullptr.
+  ABSL_CONST_INIT static std::atomic<malloc_tracing_extension::TraceEvent*>
+      events_;
+  // Slots handed out and slots filled (or given up) by the recording threads.
+  ABSL_CONST_INIT static std::atomic<size_t> next_;
+  ABSL_CONST_INIT static std::atomic<size_t> written_;
+  ABSL_CONST_INIT static std::atomic<size_t> capacity_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#ifdef ALLOCATION_TRACE
+#define TCMALLOC_TRACE_EVENT(type, address, value, size)            \
+  ::tcmalloc::tcmalloc_internal::AllocationTrace::Record(           \
+      ::tcmalloc::tcmalloc_internal::AllocationTrace::EventType::type, \
+      (address), (value), (size))
+#else
+#define TCMALLOC_TRACE_EVENT(type, address, value, size)
+#endif
+
+#endif  // TCMALLOC_ALLOCATION_TRACE_H_
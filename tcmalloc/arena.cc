@@ -14,6 +14,8 @@
 
 #include "tcmalloc/arena.h"
 
+#include <sys/mman.h>
+
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/system-alloc.h"
@@ -35,40 +37,7 @@ void* Arena::Alloc(size_t bytes, int alignment) {
   }
   char* result;
   if (free_avail_ < bytes) {
-    size_t ask = bytes > kAllocIncrement ? bytes : kAllocIncrement;
-    // TODO(b/171081864): Arena allocations should be made relatively
-    // infrequently.  Consider tagging this memory with sampled objects which
-    // are also infrequently allocated.
-    //
-    // In the meantime it is important that we use the current NUMA partition
-    // rather than always using a particular one because it's possible that any
-    // single partition we choose might only contain nodes that the process is
-    // unable to allocate from due to cgroup restrictions.
-    MemoryTag tag;
-    const auto& numa_topology = tc_globals.numa_topology();
-    if (numa_topology.numa_aware()) {
-      tag = NumaNormalTag(numa_topology.GetCurrentPartition());
-    } else {
-      tag = MemoryTag::kNormal;
-    }
-
-    auto [ptr, actual_size] = SystemAlloc(ask, kPageSize, tag);
-    free_area_ = reinterpret_cast<char*>(ptr);
-    if (ABSL_PREDICT_FALSE(free_area_ == nullptr)) {
-      Crash(kCrash, __FILE__, __LINE__,
-            "FATAL ERROR: Out of memory trying to allocate internal tcmalloc "
-            "data (bytes, object-size); is something preventing mmap from "
-            "succeeding (sandbox, VSS limitations)?",
-            kAllocIncrement, bytes);
-    }
-    SystemBack(free_area_, actual_size);
-
-    // We've discarded the previous free_area_, so any bytes that were
-    // unallocated are effectively inaccessible to future allocations.
-    bytes_unavailable_ += free_avail_;
-    blocks_++;
-
-    free_avail_ = actual_size;
+    NewBlock(bytes);
   }
 
   ASSERT(reinterpret_cast<uintptr_t>(free_area_) % alignment == 0);
@@ -79,6 +48,54 @@ void* Arena::Alloc(size_t bytes, int alignment) {
   return reinterpret_cast<void*>(result);
 }
 
+void Arena::Prefault(size_t bytes) {
+  if (free_avail_ >= bytes) return;
+  NewBlock(bytes);
+  SystemPopulate(free_area_, free_avail_);
+}
+
+void Arena::NewBlock(size_t bytes) {
+  size_t ask = bytes > kAllocIncrement ? bytes : kAllocIncrement;
+  if (huge_pages_) {
+    ask = (ask + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  }
+  // TODO(b/171081864): Arena allocations should be made relatively
+  // infrequently.  Consider tagging this memory with sampled objects which
+  // are also infrequently allocated.
+  //
+  // In the meantime it is important that we use the current NUMA partition
+  // rather than always using a particular one because it's possible that any
+  // single partition we choose might only contain nodes that the process is
+  // unable to allocate from due to cgroup restrictions.
+  MemoryTag tag;
+  const auto& numa_topology = tc_globals.numa_topology();
+  if (numa_topology.numa_aware()) {
+    tag = NumaNormalTag(numa_topology.GetCurrentPartition());
+  } else {
+    tag = MemoryTag::kNormal;
+  }
+
+  auto [ptr, actual_size] =
+      SystemAlloc(ask, huge_pages_ ? kHugePageSize : kPageSize, tag);
+  free_area_ = reinterpret_cast<char*>(ptr);
+  if (ABSL_PREDICT_FALSE(free_area_ == nullptr)) {
+    Crash(kCrash, __FILE__, __LINE__,
+          "FATAL ERROR: Out of memory trying to allocate internal tcmalloc "
+          "data (bytes, object-size); is something preventing mmap from "
+          "succeeding (sandbox, VSS limitations)?",
+          kAllocIncrement, bytes);
+  }
+  if (huge_pages_) madvise(free_area_, actual_size, MADV_HUGEPAGE);
+  SystemBack(free_area_, actual_size);
+
+  // We've discarded the previous free_area_, so any bytes that were
+  // unallocated are effectively inaccessible to future allocations.
+  bytes_unavailable_ += free_avail_;
+  blocks_++;
+
+  free_avail_ = actual_size;
+}
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
@@ -48,6 +48,10 @@ struct ArenaStats {
 class Arena {
  public:
   constexpr Arena() {}
+  // With huge_pages, blocks are whole huge pages, huge page aligned and
+  // advised onto huge pages, so the metadata carved from them is covered by
+  // few TLB entries.
+  constexpr explicit Arena(bool huge_pages) : huge_pages_(huge_pages) {}
 
   // Returns a properly aligned byte array of length "bytes".  Crashes if
   // allocation fails.  Requires pageheap_lock is held.
@@ -55,6 +59,11 @@ class Arena {
                                              int alignment = kAlignment)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Starts a new block of at least "bytes" unless the current one has that
+  // much left, and faults its free part in, so that the next "bytes" of
+  // allocations do not take page faults.  Requires pageheap_lock is held.
+  void Prefault(size_t bytes) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Reports that bytes previously in use by the arena have become non-resident
   // and/or that bytes that were previously non-resident have become reused.
   void ReportNonresident(size_t unused_bytes, size_t reused_bytes)
@@ -82,6 +91,12 @@ class Arena {
   // How much to allocate from system at a time
   static constexpr int kAllocIncrement = 128 << 10;
 
+  // Replaces the free area with a block from the system of at least
+  // "bytes", discarding what was left of the old one.
+  void NewBlock(size_t bytes) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  const bool huge_pages_ = false;
+
   // Free area from which to carve new objects
   char* free_area_ ABSL_GUARDED_BY(pageheap_lock) = nullptr;
   size_t free_avail_ ABSL_GUARDED_BY(pageheap_lock) = 0;
@@ -16,6 +16,8 @@
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "tcmalloc/page_heap_allocator.h"
+#include "tcmalloc/span.h"
 
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -33,6 +35,38 @@ TEST(Arena, AlignedAlloc) {
   }
 }
 
+TEST(Arena, SpansFillTheirLine) {
+  Arena arena;
+  PageHeapAllocator<Span> allocator;
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  allocator.Init(&arena);
+  arena.Alloc(7);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(allocator.New()) % kSpanAlignment,
+              0);
+  }
+}
+
+TEST(Arena, HugePages) {
+  Arena arena(/*huge_pages=*/true);
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  void* first = arena.Alloc(64);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(first) % kHugePageSize, 0);
+  ArenaStats stats = arena.stats();
+  EXPECT_EQ((stats.bytes_allocated + stats.bytes_unallocated) % kHugePageSize,
+            0);
+
+  // A request larger than a block still gets whole huge pages.
+  void* large = arena.Alloc(kHugePageSize + 1);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(large) % kHugePageSize, 0);
+  stats = arena.stats();
+  EXPECT_EQ(stats.blocks, 2);
+  EXPECT_EQ((stats.bytes_allocated + stats.bytes_unallocated +
+             stats.bytes_unavailable) %
+                kHugePageSize,
+            0);
+}
+
 TEST(Arena, Stats) {
   Arena arena;
 
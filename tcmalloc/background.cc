@@ -14,16 +14,26 @@
 
 #include <errno.h>
 
+#include "absl/base/internal/spinlock.h"
 #include "absl/base/internal/sysinfo.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/escape_buffer.h"
+#include "tcmalloc/escape_table.h"
+#include "tcmalloc/continuous_profile.h"
+#include "tcmalloc/global_stats.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/percpu.h"
 #include "tcmalloc/internal_malloc_extension.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/memory_pressure.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/protection_report.h"
+#include "tcmalloc/quarantine.h"
+#include "tcmalloc/sampling_autotune.h"
 #include "tcmalloc/static_vars.h"
+#include "tcmalloc/trace_capture.h"
 
 // Release memory to the system at a constant rate.
 void MallocExtension_Internal_ProcessBackgroundActions() {
@@ -54,6 +64,53 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
   constexpr absl::Duration kCpuCacheSlabResizePeriod = absl::Seconds(7);
   absl::Time last_slab_resize_check = absl::Now();
 
+#ifdef ADAPTIVE_BATCH_SIZE
+  // Adapt the batches of the per-cpu caches once per kCpuCacheBatchPeriod.
+  constexpr absl::Duration kCpuCacheBatchPeriod = absl::Seconds(1);
+  absl::Time last_batch_adapt = absl::Now();
+#endif
+
+#ifdef ESCAPE_CHAIN_SWEEP
+  // CPU spent each tick dropping dead records from escape chains.
+  constexpr absl::Duration kEscapeSweepBudget = absl::Milliseconds(1);
+#endif
+#ifdef ESCAPE_REFCOUNTS
+  // CPU spent each tick halving escape counts.
+  constexpr absl::Duration kEscapeDecayBudget = absl::Milliseconds(1);
+#endif
+
+#ifdef CONTINUOUS_PROFILE
+  absl::Time last_continuous_profile = absl::Now();
+#endif
+
+#ifdef DEFERRED_PEAK_HEAP
+  // Peaks of the sampled heap are copied here, once a tick, from now on.
+  tc_globals.peak_heap_tracker().SetDeferred(true);
+#endif
+
+#ifdef FILLER_COLLAPSE
+  // Collapse up to kCollapsesPerPass dense broken hugepages of each page heap
+  // once per kCollapsePeriod.  A collapse may copy a hugepage, so few are
+  // made at a time.
+  constexpr absl::Duration kCollapsePeriod = absl::Seconds(10);
+  constexpr tcmalloc::tcmalloc_internal::HugeLength kCollapsesPerPass =
+      tcmalloc::tcmalloc_internal::NHugePages(4);
+  absl::Time last_collapse = absl::Now();
+#endif
+
+#ifdef STATS_PAGE
+  // Mirror key counters into the shared stats page once per
+  // kStatsPagePeriod.
+  constexpr absl::Duration kStatsPagePeriod = absl::Seconds(1);
+  absl::Time last_stats_page = absl::InfinitePast();
+#endif
+
+#ifdef STATS_SNAPSHOT
+  // Render the stats GetStats() serves once per kStatsSnapshotPeriod.
+  constexpr absl::Duration kStatsSnapshotPeriod = absl::Seconds(5);
+  absl::Time last_stats_snapshot = absl::InfinitePast();
+#endif
+
 #ifndef TCMALLOC_SMALL_BUT_SLOW
   // Resize transfer caches once per kTransferCacheResizePeriod.
   constexpr absl::Duration kTransferCacheResizePeriod = absl::Seconds(2);
@@ -62,12 +119,47 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
 
   while (true) {
     absl::Time now = absl::Now();
+#ifdef DETERMINISTIC_MODE
+    // Nothing runs on a timer while a benchmark measures the caches; what
+    // is due runs once the mode is turned off.
+    if (Parameters::deterministic_mode()) {
+      prev_time = now;
+      absl::SleepFor(kSleepTime);
+      continue;
+    }
+#endif
     const ssize_t bytes_to_release =
         static_cast<size_t>(Parameters::background_release_rate()) *
         absl::ToDoubleSeconds(now - prev_time);
     if (bytes_to_release > 0) {  // may be negative if time goes backwards
       tcmalloc::MallocExtension::ReleaseMemoryToSystem(bytes_to_release);
     }
+#ifdef MEMORY_PRESSURE_RELEASE
+    // Sheds more on top of the fixed rate while the cgroup is under pressure.
+    tcmalloc::tcmalloc_internal::MemoryPressureMonitor::Tick(now - prev_time);
+#endif
+#ifdef SAMPLING_AUTOTUNE
+    // Keeps the CPU sampled allocations take under sampling_cpu_budget.
+    tcmalloc::tcmalloc_internal::SamplingAutotuner::Tick();
+#endif
+
+#ifdef TIERED_RELEASE
+    // Free memory not yet due for release is advised as it idles.
+    {
+      absl::base_internal::SpinLockHolder h(
+          &tcmalloc::tcmalloc_internal::pageheap_lock);
+      tc_globals.page_allocator().AdviseIdle();
+    }
+#endif
+
+#ifdef FILLER_COLLAPSE
+    if (now - last_collapse >= kCollapsePeriod) {
+      absl::base_internal::SpinLockHolder h(
+          &tcmalloc::tcmalloc_internal::pageheap_lock);
+      tc_globals.page_allocator().CollapseDense(kCollapsesPerPass);
+      last_collapse = now;
+    }
+#endif
 
     if (tcmalloc::MallocExtension::PerCpuCachesActive()) {
       // Accelerate fences as part of this operation by registering this thread
@@ -96,6 +188,13 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
         tc_globals.cpu_cache().ResizeSlabIfNeeded();
         last_slab_resize_check = now;
       }
+
+#ifdef ADAPTIVE_BATCH_SIZE
+      if (now - last_batch_adapt >= kCpuCacheBatchPeriod) {
+        tc_globals.cpu_cache().AdaptBatchLengths();
+        last_batch_adapt = now;
+      }
+#endif
     }
 
 #ifndef TCMALLOC_SMALL_BUT_SLOW
@@ -106,7 +205,94 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
 #endif
 
     tc_globals.sharded_transfer_cache().Plunder();
+    // Escapes staged by threads that rarely fill their buffers are committed
+    // within a tick of being recorded, as long as the threads keep escaping.
+    tcmalloc::tcmalloc_internal::RequestEscapeFlush();
+#ifdef ESCAPE_CHAIN_SWEEP
+    tcmalloc::tcmalloc_internal::SweepEscapeChains(kEscapeSweepBudget);
+#endif
+#ifdef ESCAPE_REFCOUNTS
+    tcmalloc::tcmalloc_internal::DecayEscapeRefs(kEscapeDecayBudget);
+#endif
+#ifdef ENABLE_ERROR_REPORT
+    tcmalloc::tcmalloc_internal::ProtectionReports::Emit();
+#endif
+#ifdef DEFERRED_PEAK_HEAP
+    tc_globals.peak_heap_tracker().SaveDeferredSample();
+#endif
+#ifdef TRACE_CAPTURE
+    tcmalloc::tcmalloc_internal::TraceCapture::Drain();
+#endif
+#ifdef STATS_SNAPSHOT
+    if (now - last_stats_snapshot >= kStatsSnapshotPeriod) {
+      tcmalloc::tcmalloc_internal::RefreshStatsSnapshot();
+      last_stats_snapshot = now;
+    }
+#endif
+#ifdef CONTINUOUS_PROFILE
+    if (now - last_continuous_profile >=
+        tcmalloc::tcmalloc_internal::ContinuousProfiler::kPeriod) {
+      tcmalloc::tcmalloc_internal::EmitContinuousProfile();
+      last_continuous_profile = now;
+    }
+#endif
+#ifdef STATS_PAGE
+    if (now - last_stats_page >= kStatsPagePeriod) {
+      tcmalloc::tcmalloc_internal::RefreshStatsPage();
+      last_stats_page = now;
+    }
+#endif
     prev_time = now;
     absl::SleepFor(kSleepTime);
   }
 }
+
+// Commit escape buffers handed off by application threads and release the
+// objects they quarantined.
+void MallocExtension_Internal_ProcessBackgroundEscapes() {
+  using ::tcmalloc::tcmalloc_internal::CommitPendingEscapes;
+  using ::tcmalloc::tcmalloc_internal::DrainQuarantine;
+  using ::tcmalloc::tcmalloc_internal::Parameters;
+
+  tcmalloc::MallocExtension::MarkThreadIdle();
+
+  // Threads only hand their full buffers off while a flusher is running;
+  // until then they keep committing inline.
+  Parameters::set_background_escape_flush(true);
+
+  // The queue is bounded, so an idle poll interval well below the time it
+  // takes to fill it keeps application threads from falling back to inline
+  // commits.
+  constexpr absl::Duration kIdleSleepTime = absl::Microseconds(100);
+
+  while (true) {
+    const size_t committed = CommitPendingEscapes();
+    if (committed + DrainQuarantine() == 0) {
+      absl::SleepFor(kIdleSleepTime);
+    }
+  }
+}
+
+// Unback the hugepages the page heaps evict on free, in coalesced batches.
+void MallocExtension_Internal_ProcessBackgroundReleases() {
+  using ::tcmalloc::tcmalloc_internal::pageheap_lock;
+  using ::tcmalloc::tcmalloc_internal::tc_globals;
+
+  tcmalloc::MallocExtension::MarkThreadIdle();
+
+  // Frees only queue evicted hugepages once this thread runs to unback them.
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    tc_globals.page_allocator().SetDeferredRelease(true);
+  }
+
+  // Long enough for adjacent evictions to be merged into one range, short
+  // enough that the queue does not hold much more than the cache limit.
+  constexpr absl::Duration kBatchTime = absl::Milliseconds(10);
+
+  while (true) {
+    absl::SleepFor(kBatchTime);
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    tc_globals.page_allocator().ReleasePending();
+  }
+}
@@ -0,0 +1,314 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/callsite_profile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <link.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/debugging/symbolize.h"
+#include "tcmalloc/internal/percpu.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT thread_local int CallSiteProfile::countdown_ = 0;
+ABSL_CONST_INIT thread_local CallSiteProfile::Slot*
+    CallSiteProfile::escape_site_ = nullptr;
+CallSiteProfile::Shard CallSiteProfile::shards_[kShards];
+CallSiteProfile::Entry CallSiteProfile::merged_[kShards * kSlots];
+
+namespace {
+
+ABSL_CONST_INIT absl::base_internal::SpinLock print_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+
+constexpr const char* kNames[] = {"gep_check", "bc_check", "escape"};
+
+constexpr int kKindBits = 2;
+static_assert(static_cast<int>(CallSiteKind::kNumKinds) <= 1 << kKindBits,
+              "kinds must fit below the return address");
+
+uintptr_t MakeKey(CallSiteKind kind, const void* pc) {
+  return reinterpret_cast<uintptr_t>(pc) << kKindBits |
+         static_cast<uintptr_t>(kind);
+}
+
+const char* KindName(uintptr_t key) {
+  return kNames[key & ((uintptr_t{1} << kKindBits) - 1)];
+}
+
+// Room for a line with a module name of PATH_MAX bytes.
+constexpr size_t kMaxLine = 4096 + 256;
+
+// Scratch space of Write(), which must not allocate.
+char write_buffer[4 * kMaxLine] ABSL_GUARDED_BY(print_lock);
+
+// Buffers the lines of Write() in write_buffer.
+class FileWriter {
+ public:
+  explicit FileWriter(int fd) : fd_(fd), len_(0), err_(0) {}
+
+  void Printf(const char* format, ...) ABSL_PRINTF_ATTRIBUTE(2, 3) {
+    if (sizeof(write_buffer) - len_ < kMaxLine) Flush();
+    va_list ap;
+    va_start(ap, format);
+    const int n = vsnprintf(write_buffer + len_, sizeof(write_buffer) - len_,
+                            format, ap);
+    va_end(ap);
+    if (n > 0) len_ += std::min<size_t>(n, sizeof(write_buffer) - len_ - 1);
+  }
+
+  // Writes out the buffered lines.  Returns 0 or the first errno value.
+  int Flush() {
+    const char* p = write_buffer;
+    while (len_ > 0 && err_ == 0) {
+      const ssize_t n = write(fd_, p, len_);
+      if (n < 0) {
+        if (errno != EINTR) err_ = errno;
+        continue;
+      }
+      p += n;
+      len_ -= n;
+    }
+    len_ = 0;
+    return err_;
+  }
+
+ private:
+  int fd_;
+  size_t len_;
+  int err_;
+};
+
+// Stores the hex of the GNU build-id note of the module in `out`, or "-".
+// Follows GetBuildId() of internal/profile_builder.cc, which allocates and
+// comes with the profile proto.
+void FormatBuildId(const dl_phdr_info* info, char (&out)[129]) {
+  strcpy(out, "-");
+  for (int i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type != PT_NOTE) continue;
+    const char* note =
+        reinterpret_cast<const char*>(info->dlpi_addr + phdr.p_vaddr);
+    const char* const last = note + phdr.p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= last) {
+      const ElfW(Nhdr)* nhdr = reinterpret_cast<const ElfW(Nhdr)*>(note);
+      const size_t name_size = (size_t{nhdr->n_namesz} + 3) & ~size_t{3};
+      const size_t desc_size = (size_t{nhdr->n_descsz} + 3) & ~size_t{3};
+      const char* name = note + sizeof(*nhdr);
+      if (name_size > static_cast<size_t>(last - name) ||
+          desc_size > static_cast<size_t>(last - name) - name_size) {
+        break;
+      }
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          memcmp(name, "GNU\0", 4) == 0 && nhdr->n_descsz > 0 &&
+          nhdr->n_descsz <= 64) {
+        const unsigned char* desc =
+            reinterpret_cast<const unsigned char*>(name + name_size);
+        for (size_t j = 0; j < nhdr->n_descsz; ++j) {
+          snprintf(out + 2 * j, 3, "%02x", desc[j]);
+        }
+        return;
+      }
+      note = name + name_size + desc_size;
+    }
+  }
+}
+
+}  // namespace
+
+struct CallSiteProfile::WriteContext {
+  FileWriter* out;
+  const Entry* entries;
+  size_t n;
+};
+
+CallSiteProfile::Slot* CallSiteProfile::Find(uintptr_t key) {
+  const int cpu = subtle::percpu::GetCurrentCpu();
+  Shard& s = shards_[cpu < 0 ? 0 : static_cast<size_t>(cpu) % kShards];
+  size_t i = (key * 0x9E3779B97F4A7C15ull) >> 32;
+  for (size_t probe = 0; probe < kMaxProbes; ++probe, ++i) {
+    Slot& slot = s.slots[i % kSlots];
+    uintptr_t cur = slot.key.load(std::memory_order_relaxed);
+    if (cur == 0 &&
+        slot.key.compare_exchange_strong(cur, key, std::memory_order_relaxed)) {
+      cur = key;
+    }
+    if (cur == key) return &slot;
+  }
+  s.dropped.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+void CallSiteProfile::RecordSlow(CallSiteKind kind, const void* pc) {
+  Slot* slot = Find(MakeKey(kind, pc));
+  if (slot == nullptr) return;
+  slot->count.fetch_add(1, std::memory_order_relaxed);
+  if (kind == CallSiteKind::kEscape) escape_site_ = slot;
+}
+
+void CallSiteProfile::RecordFailure(CallSiteKind kind, const void* pc) {
+  Slot* slot = Find(MakeKey(kind, pc));
+  if (slot == nullptr) return;
+  slot->failed.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t CallSiteProfile::Merge(uint64_t* dropped) {
+  size_t n = 0;
+  *dropped = 0;
+  for (const Shard& s : shards_) {
+    for (const Slot& slot : s.slots) {
+      const uint64_t count = slot.count.load(std::memory_order_relaxed);
+      const uint64_t failed = slot.failed.load(std::memory_order_relaxed);
+      if (count == 0 && failed == 0) continue;
+      merged_[n++] = {slot.key.load(std::memory_order_relaxed), count, failed,
+                      slot.skipped.load(std::memory_order_relaxed)};
+    }
+    *dropped += s.dropped.load(std::memory_order_relaxed);
+  }
+
+  // The same call site may sit in the tables of several CPUs.
+  std::sort(merged_, merged_ + n,
+            [](const Entry& a, const Entry& b) { return a.key < b.key; });
+  size_t unique = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (unique > 0 && merged_[unique - 1].key == merged_[i].key) {
+      merged_[unique - 1].count += merged_[i].count;
+      merged_[unique - 1].failed += merged_[i].failed;
+      merged_[unique - 1].skipped += merged_[i].skipped;
+    } else {
+      merged_[unique++] = merged_[i];
+    }
+  }
+  return unique;
+}
+
+size_t CallSiteProfile::MergeTop(size_t* top, uint64_t* dropped) {
+  const size_t unique = Merge(dropped);
+  *top = std::min(unique, kTopN);
+  std::partial_sort(
+      merged_, merged_ + *top, merged_ + unique,
+      [](const Entry& a, const Entry& b) { return a.count > b.count; });
+  return unique;
+}
+
+void CallSiteProfile::Print(Printer* out) {
+  absl::base_internal::SpinLockHolder h(&print_lock);
+  size_t top;
+  uint64_t dropped;
+  const size_t unique = MergeTop(&top, &dropped);
+
+  out->printf("------------------------------------------------\n");
+  out->printf(
+      "Top %u of %u call sites, 1 in %d calls per thread sampled "
+      "(%u samples dropped)\n",
+      top, unique, kSamplePeriod, dropped);
+  out->printf("------------------------------------------------\n");
+  for (size_t i = 0; i < top; ++i) {
+    const Entry& e = merged_[i];
+    void* pc = reinterpret_cast<void*>(e.key >> kKindBits);
+    char symbol[256];
+    // Symbolize the call instruction rather than the one after it.
+    if (!absl::Symbolize(static_cast<char*>(pc) - 1, symbol, sizeof(symbol))) {
+      symbol[0] = '\0';
+    }
+    out->printf("CALLSITE %12u calls %-9s %p %s\n", e.count * kSamplePeriod,
+                KindName(e.key), pc, symbol);
+  }
+}
+
+void CallSiteProfile::PrintInPbtxt(PbtxtRegion* region) {
+  absl::base_internal::SpinLockHolder h(&print_lock);
+  size_t top;
+  uint64_t dropped;
+  const size_t unique = MergeTop(&top, &dropped);
+
+  region->PrintI64("sample_period", kSamplePeriod);
+  region->PrintI64("num_call_sites", unique);
+  region->PrintI64("dropped_samples", dropped);
+  for (size_t i = 0; i < top; ++i) {
+    const Entry& e = merged_[i];
+    PbtxtRegion site = region->CreateSubRegion("call_site");
+    site.PrintI64("pc", e.key >> kKindBits);
+    site.PrintRaw("kind", KindName(e.key));
+    site.PrintI64("calls", e.count * kSamplePeriod);
+    site.PrintI64("failed", e.failed);
+    site.PrintI64("skipped", e.skipped * kSamplePeriod);
+  }
+}
+
+// Writes the lines of the call sites in the executable segments of one
+// module.  merged_ is sorted by key, and so by return address.
+int CallSiteProfile::WriteModule(dl_phdr_info* info, size_t, void* arg) {
+  const WriteContext& ctx = *static_cast<const WriteContext*>(arg);
+  char build_id[129];
+  bool have_build_id = false;
+  for (int i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type != PT_LOAD || (phdr.p_flags & PF_X) == 0) continue;
+    const uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+    const uintptr_t end = start + phdr.p_memsz;
+    const Entry* e = std::lower_bound(
+        ctx.entries, ctx.entries + ctx.n, start << kKindBits,
+        [](const Entry& a, uintptr_t key) { return a.key < key; });
+    for (; e != ctx.entries + ctx.n && (e->key >> kKindBits) < end; ++e) {
+      if (!have_build_id) {
+        FormatBuildId(info, build_id);
+        have_build_id = true;
+      }
+      ctx.out->Printf(
+          "%s 0x%" PRIxPTR " %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n",
+          build_id, (e->key >> kKindBits) - info->dlpi_addr, KindName(e->key),
+          e->count * kSamplePeriod, e->failed, e->skipped * kSamplePeriod,
+          info->dlpi_name[0] != '\0' ? info->dlpi_name : "-");
+    }
+  }
+  return 0;
+}
+
+int CallSiteProfile::Write(const char* path) {
+  absl::base_internal::SpinLockHolder h(&print_lock);
+  uint64_t dropped;
+  const size_t unique = Merge(&dropped);
+
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return errno;
+  FileWriter out(fd);
+  out.Printf("# tcmalloc call site profile\n");
+  out.Printf("# sample_period %d\n", kSamplePeriod);
+  out.Printf("# dropped_samples %" PRIu64 "\n", dropped);
+  out.Printf("# build_id offset kind calls failed skipped module\n");
+  WriteContext ctx = {&out, merged_, unique};
+  dl_iterate_phdr(WriteModule, &ctx);
+  int err = out.Flush();
+  if (close(fd) != 0 && err == 0) err = errno;
+  return err;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
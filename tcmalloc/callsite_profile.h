@@ -0,0 +1,175 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Sampled counts of checks and escapes per call site (CALLSITE_PROFILE).
+//
+// The global counters of ENABLE_STATISTIC do not tell which of the checks the
+// compiler inserted are hot.  With CALLSITE_PROFILE each thread samples one
+// in kSamplePeriod calls of __gep_check_boundary(), __bc_check_boundary() and
+// __escape(), and counts the sample under its return address in a fixed
+// size open addressing table of the current CPU.  GetStats() merges the
+// tables and prints the top call sites, symbolized with absl::Symbolize().
+// Samples that find no free slot within kMaxProbes are only counted as
+// dropped.
+//
+// Each call site also counts the checks that failed, every one of them rather
+// than a sample, and how many of the sampled escapes were skipped because
+// the location already pointed into the same object.  Write() saves the
+// counts of every call site to a file keyed by build-id and offset into the
+// module, for the instrumentation to read back when it decides which checks
+// and escapes to keep; it runs at exit when TCMALLOC_CALLSITE_PROFILE_FILE
+// names the file.
+
+#ifndef TCMALLOC_CALLSITE_PROFILE_H_
+#define TCMALLOC_CALLSITE_PROFILE_H_
+
+#include <link.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+enum class CallSiteKind {
+  kGepCheck,
+  kBcCheck,
+  kEscape,
+  kNumKinds,
+};
+
+class CallSiteProfile {
+ public:
+  static constexpr int kSamplePeriod = 64;
+  static constexpr size_t kShards = 64;
+  static constexpr size_t kSlots = 128;
+  static constexpr size_t kMaxProbes = 8;
+  static constexpr size_t kTopN = 32;
+
+  static void Record(CallSiteKind kind, const void* pc) {
+    if (ABSL_PREDICT_TRUE(--countdown_ > 0)) return;
+    countdown_ = kSamplePeriod;
+    RecordSlow(kind, pc);
+  }
+
+  // Counts a check of `kind` at pc that found result != 0; returns result.
+  static int Checked(CallSiteKind kind, const void* pc, int result) {
+    if (ABSL_PREDICT_FALSE(result != 0)) RecordFailure(kind, pc);
+    return result;
+  }
+
+  // Counts a skipped escape against the call site of the sampled escape the
+  // thread is recording, if any.  Called where do_escape() finds the
+  // location already pointing into the object.
+  static void Skipped() {
+    Slot* site = escape_site_;
+    if (ABSL_PREDICT_FALSE(site != nullptr)) {
+      site->skipped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Ends the escape whose skip Skipped() counts; returns result.
+  static int Escaped(int result) {
+    escape_site_ = nullptr;
+    return result;
+  }
+
+  // Prints the kTopN most frequently sampled call sites.
+  static void Print(Printer* out);
+  static void PrintInPbtxt(PbtxtRegion* region);
+
+  // Writes every call site to a new file at `path`.  Returns 0 or an errno
+  // value.
+  static int Write(const char* path);
+
+ private:
+  // key is the return address shifted left by two, or'ed with the kind; 0
+  // marks a free slot.
+  struct Slot {
+    std::atomic<uintptr_t> key;
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> skipped;
+  };
+  struct alignas(ABSL_CACHELINE_SIZE) Shard {
+    Slot slots[kSlots];
+    std::atomic<uint64_t> dropped;
+  };
+  struct Entry {
+    uintptr_t key;
+    uint64_t count;
+    uint64_t failed;
+    uint64_t skipped;
+  };
+
+  struct WriteContext;
+
+  static void RecordSlow(CallSiteKind kind, const void* pc);
+  static void RecordFailure(CallSiteKind kind, const void* pc);
+
+  // Returns the slot of key in the table of the current CPU, claiming a free
+  // one if needed, or counts a dropped sample and returns nullptr.
+  static Slot* Find(uintptr_t key);
+
+  // Merges the tables of all shards into merged_, sorted by key.  Returns how
+  // many call sites there are.  Requires print_lock.
+  static size_t Merge(uint64_t* dropped);
+
+  // Like Merge(), then sorts merged_ by count down to the kTopN-th, whose
+  // number is stored in `top`.
+  static size_t MergeTop(size_t* top, uint64_t* dropped);
+
+  // dl_iterate_phdr() callback of Write().
+  static int WriteModule(dl_phdr_info* info, size_t size, void* arg);
+
+  ABSL_CONST_INIT static thread_local int countdown_;
+  // Slot of the sampled escape the calling thread is recording, or nullptr.
+  ABSL_CONST_INIT static thread_local Slot* escape_site_;
+  static Shard shards_[kShards];
+  // Scratch space of Print(), which must not allocate.
+  static Entry merged_[kShards * kSlots];
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#ifdef CALLSITE_PROFILE
+#define TCMALLOC_RECORD_CALLSITE(kind)                   \
+  ::tcmalloc::tcmalloc_internal::CallSiteProfile::Record( \
+      ::tcmalloc::tcmalloc_internal::CallSiteKind::kind,  \
+      __builtin_return_address(0))
+#define TCMALLOC_CALLSITE_CHECKED(kind, result)            \
+  ::tcmalloc::tcmalloc_internal::CallSiteProfile::Checked( \
+      ::tcmalloc::tcmalloc_internal::CallSiteKind::kind,   \
+      __builtin_return_address(0), (result))
+#define TCMALLOC_CALLSITE_SKIPPED() \
+  ::tcmalloc::tcmalloc_internal::CallSiteProfile::Skipped()
+#define TCMALLOC_CALLSITE_ESCAPED(result) \
+  ::tcmalloc::tcmalloc_internal::CallSiteProfile::Escaped(result)
+#else
+#define TCMALLOC_RECORD_CALLSITE(kind)
+#define TCMALLOC_CALLSITE_CHECKED(kind, result) (result)
+#define TCMALLOC_CALLSITE_SKIPPED()
+#define TCMALLOC_CALLSITE_ESCAPED(result) (result)
+#endif
+
+#endif  // TCMALLOC_CALLSITE_PROFILE_H_
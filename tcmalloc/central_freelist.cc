@@ -14,8 +14,12 @@
 
 #include "tcmalloc/central_freelist.h"
 
+#include <sched.h>
 #include <stdint.h>
 
+#include <algorithm>
+
+#include "tcmalloc/internal/cache_topology.h"
 #include "tcmalloc/internal/linked_list.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/optimization.h"
@@ -33,6 +37,9 @@ static MemoryTag MemoryTagFromSizeClass(size_t size_class) {
   if (IsExpandedSizeClass(size_class)) {
     return MemoryTag::kCold;
   }
+  if (IsPointerFreeSizeClass(size_class)) {
+    return MemoryTag::kNormal;
+  }
   if (!tc_globals.numa_topology().numa_aware()) {
     return MemoryTag::kNormal;
   }
@@ -57,7 +64,8 @@ Span* StaticForwarder::AllocateSpan(int size_class, size_t objects_per_span,
                                     Length pages_per_span) {
   const MemoryTag tag = MemoryTagFromSizeClass(size_class);
   Span* span =
-      tc_globals.page_allocator().New(pages_per_span, objects_per_span, tag);
+      tc_globals.page_allocator().New(pages_per_span, objects_per_span, tag,
+                                      size_class);
   if (ABSL_PREDICT_FALSE(span == nullptr)) {
     return nullptr;
   }
@@ -85,6 +93,9 @@ void StaticForwarder::DeallocateSpans(int size_class, size_t objects_per_span,
     ASSERT(IsNormalMemory(free_span->start_address()) ||
            IsColdMemory(free_span->start_address()));
     tc_globals.pagemap().UnregisterSizeClass(free_span);
+    // Release the escape tables now, so that the page heap finds none left
+    // to walk under pageheap_lock.
+    free_span->DestroyEscape();
 
     // Before taking pageheap_lock, prefetch the PageTrackers these spans are
     // on.
@@ -111,6 +122,196 @@ void StaticForwarder::DeallocateSpans(int size_class, size_t objects_per_span,
 }
 
 }  // namespace central_freelist_internal
+
+#ifdef CENTRAL_FREELIST_SHARDS
+ABSL_CONST_INIT size_t ShardedCentralFreeList::num_shards_ = 1;
+ABSL_CONST_INIT bool ShardedCentralFreeList::topology_initialized_ = false;
+
+namespace {
+
+// The shard of each CPU, set once by the first Init().
+ABSL_CONST_INIT uint8_t shard_of_cpu[CPU_SETSIZE] = {0};
+
+}  // namespace
+
+void ShardedCentralFreeList::InitTopology() {
+  if (topology_initialized_) return;
+  topology_initialized_ = true;
+  uint8_t l3_cache_index[CPU_SETSIZE] = {0};
+  const int caches = BuildCpuToL3CacheMap(l3_cache_index);
+  num_shards_ = std::clamp<size_t>(caches, 1, kMaxCentralFreeListShards);
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    shard_of_cpu[cpu] = l3_cache_index[cpu] % num_shards_;
+  }
+}
+
+size_t ShardedCentralFreeList::CurrentShard() {
+  if (num_shards_ == 1) return 0;
+  const int cpu = sched_getcpu();
+  if (cpu < 0 || cpu >= CPU_SETSIZE) return 0;
+  return shard_of_cpu[cpu];
+}
+
+void ShardedCentralFreeList::Init(size_t size_class) {
+  InitTopology();
+  size_class_ = size_class;
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    shards_[shard].set_shard(shard);
+    shards_[shard].Init(size_class);
+  }
+}
+
+void ShardedCentralFreeList::InsertRange(absl::Span<void*> batch) {
+  if (num_shards_ == 1) {
+    shards_[0].InsertRange(batch);
+    return;
+  }
+  CHECK_CONDITION(!batch.empty() && batch.size() <= kMaxObjectsToMove);
+  uint8_t shard_of[kMaxObjectsToMove];
+  size_t count[kMaxCentralFreeListShards] = {0};
+  bool mixed = false;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    shard_of[i] = Shard::Forwarder::MapObjectToSpan(batch[i])->central_shard;
+    ++count[shard_of[i]];
+    mixed |= shard_of[i] != shard_of[0];
+  }
+  // Most batches are freed on the socket that allocated them.
+  if (!mixed) {
+    shards_[shard_of[0]].InsertRange(batch);
+    return;
+  }
+
+  void* sorted[kMaxObjectsToMove];
+  size_t next[kMaxCentralFreeListShards];
+  for (size_t shard = 0, start = 0; shard < num_shards_; ++shard) {
+    next[shard] = start;
+    start += count[shard];
+  }
+  for (size_t i = 0; i < batch.size(); ++i) {
+    sorted[next[shard_of[i]]++] = batch[i];
+  }
+  for (size_t shard = 0, start = 0; shard < num_shards_; ++shard) {
+    if (count[shard] == 0) continue;
+    shards_[shard].InsertRange({sorted + start, count[shard]});
+    start += count[shard];
+  }
+}
+
+int ShardedCentralFreeList::RemoveRange(void** batch, int N) {
+  const size_t home = CurrentShard();
+  if (num_shards_ > 1 && shards_[home].length() == 0) {
+    for (size_t i = 1; i < num_shards_; ++i) {
+      Shard& other = shards_[(home + i) % num_shards_];
+      const size_t free = other.length();
+      if (free == 0) continue;
+      // Asking for no more than it has keeps it from allocating a span.
+      const int got =
+          other.RemoveRange(batch, std::min(static_cast<size_t>(N), free));
+      if (got > 0) {
+        stolen_.fetch_add(got, std::memory_order_relaxed);
+        return got;
+      }
+    }
+  }
+  return shards_[home].RemoveRange(batch, N);
+}
+
+size_t ShardedCentralFreeList::length() const {
+  size_t length = 0;
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    length += shards_[shard].length();
+  }
+  return length;
+}
+
+size_t ShardedCentralFreeList::OverheadBytes() const {
+  size_t bytes = 0;
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    bytes += shards_[shard].OverheadBytes();
+  }
+  return bytes;
+}
+
+size_t ShardedCentralFreeList::NumSpansInList(int n) {
+  size_t spans = 0;
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    spans += shards_[shard].NumSpansInList(n);
+  }
+  return spans;
+}
+
+SpanStats ShardedCentralFreeList::GetSpanStats() const {
+  SpanStats stats;
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    const SpanStats s = shards_[shard].GetSpanStats();
+    stats.num_spans_requested += s.num_spans_requested;
+    stats.num_spans_returned += s.num_spans_returned;
+    stats.obj_capacity += s.obj_capacity;
+  }
+  return stats;
+}
+
+size_t ShardedCentralFreeList::NumSpansWith(uint16_t bitwidth) const {
+  size_t spans = 0;
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    spans += shards_[shard].NumSpansWith(bitwidth);
+  }
+  return spans;
+}
+
+void ShardedCentralFreeList::PrintSpanUtilStats(Printer* out) const {
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    shards_[shard].PrintSpanUtilStats(out);
+  }
+}
+
+void ShardedCentralFreeList::PrintSpanUtilStatsInPbtxt(
+    PbtxtRegion* region) const {
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    PbtxtRegion entry = region->CreateSubRegion("central_shard");
+    entry.PrintI64("shard", shard);
+    shards_[shard].PrintSpanUtilStatsInPbtxt(&entry);
+  }
+}
+
+void ShardedCentralFreeList::PrintSpanOccupancyStats(Printer* out) {
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    shards_[shard].PrintSpanOccupancyStats(out);
+  }
+}
+
+void ShardedCentralFreeList::PrintSpanOccupancyStatsInPbtxt(
+    PbtxtRegion* region) {
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    PbtxtRegion entry = region->CreateSubRegion("central_shard");
+    entry.PrintI64("shard", shard);
+    shards_[shard].PrintSpanOccupancyStatsInPbtxt(&entry);
+  }
+}
+
+void ShardedCentralFreeList::PrintShardStats(Printer* out) const {
+  out->printf("class %3zu [ %8zu bytes ] : %8zu stolen;", size_class_,
+              Shard::Forwarder::class_to_size(size_class_),
+              stolen_.load(std::memory_order_relaxed));
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    const size_t holds = shards_[shard].lock_holds();
+    out->printf(" %zu: %10zu holds %6.0f cycles", shard, holds,
+                holds ? 1.0 * shards_[shard].lock_cycles() / holds : 0.0);
+    if (shard + 1 < num_shards_) out->printf(",");
+  }
+  out->printf("\n");
+}
+
+void ShardedCentralFreeList::PrintShardStatsInPbtxt(PbtxtRegion* region) const {
+  region->PrintI64("objects_stolen", stolen_.load(std::memory_order_relaxed));
+  for (size_t shard = 0; shard < num_shards_; ++shard) {
+    PbtxtRegion entry = region->CreateSubRegion("central_shard_lock");
+    entry.PrintI64("shard", shard);
+    entry.PrintI64("holds", shards_[shard].lock_holds());
+    entry.PrintI64("cycles", shards_[shard].lock_cycles());
+  }
+}
+#endif
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
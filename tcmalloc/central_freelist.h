@@ -18,10 +18,12 @@
 #include <stddef.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 
 #include "absl/base/attributes.h"
 #include "absl/base/const_init.h"
+#include "absl/base/internal/cycleclock.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/macros.h"
 #include "absl/base/thread_annotations.h"
@@ -65,6 +67,17 @@ class StaticForwarder {
 // Specifies number of nonempty_ lists when span prioritization is enabled.
 static constexpr size_t kNumLists = 8;
 
+#ifdef ESCAPE_FREE_SPANS_FIRST
+// Spans with an escape table are kept in a second set of kNumLists nonempty_
+// lists, after the lists of escape-free spans, so that objects are allocated
+// from spans without escapes first.
+static constexpr size_t kNumEscapeSets = 2;
+#else
+static constexpr size_t kNumEscapeSets = 1;
+#endif
+// Span::nonempty_index_ is four bits wide.
+static_assert(kNumLists * kNumEscapeSets <= 16);
+
 // Data kept per size-class in central cache.
 template <typename ForwarderT>
 class CentralFreeList {
@@ -114,6 +127,14 @@ class CentralFreeList {
   void PrintSpanUtilStats(Printer* out) const;
   void PrintSpanUtilStatsInPbtxt(PbtxtRegion* region) const;
 
+  // Reports a histogram of the spans in the nonempty_ lists by allocated
+  // objects, with how many of each bucket have an escape table.  Full spans
+  // are in no list, so only their number is known.  Walks the lists under
+  // lock_.
+  void PrintSpanOccupancyStats(Printer* out) ABSL_LOCKS_EXCLUDED(lock_);
+  void PrintSpanOccupancyStatsInPbtxt(PbtxtRegion* region)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
   // Get number of spans in the histogram bucket. We record spans in the
   // histogram indexed by absl::bit_width(allocated). So, instead of using the
   // absolute number of allocated objects, it uses absl::bit_width(allocated),
@@ -121,9 +142,57 @@ class CentralFreeList {
   // histogram.
   size_t NumSpansWith(uint16_t bitwidth) const;
 
+#if defined(HEAP_COMPACTION) && !defined(TCMALLOC_SMALL_BUT_SLOW)
+  // Takes the span of the nonempty_ lists with the fewest allocated objects
+  // for MallocExtension::CompactHeap(), if it has at most max_allocated of
+  // them and the free objects of the other spans can hold them.  Pops every
+  // free object of the span and passes it to f, called under lock_, which
+  // leaves the span full and out of the lists until its objects come back
+  // through InsertRange().  Returns nullptr if no span qualifies.
+  template <typename F>
+  Span* TakeSparsestSpan(size_t max_allocated, F f) ABSL_LOCKS_EXCLUDED(lock_);
+#endif
+
   Forwarder& forwarder() { return forwarder_; }
 
+#ifdef CENTRAL_FREELIST_SHARDS
+  // The shard of its size class this list is, see ShardedCentralFreeList.
+  // Stamped into the spans it allocates.  Set before Init().
+  void set_shard(uint8_t shard) { shard_ = shard; }
+
+  // Holds of lock_ by InsertRange() and RemoveRange(), and the cycles they
+  // held it for, not counting the page heap calls of Populate().
+  size_t lock_holds() const { return lock_holds_.value(); }
+  size_t lock_cycles() const { return lock_cycles_.value(); }
+#endif
+
  private:
+#ifdef CENTRAL_FREELIST_SHARDS
+  // Holds lock_ like SpinLockHolder and times the hold.
+  class ABSL_SCOPED_LOCKABLE TimedLockHolder {
+   public:
+    explicit TimedLockHolder(CentralFreeList* list)
+        ABSL_EXCLUSIVE_LOCK_FUNCTION(list->lock_)
+        : list_(list) {
+      list_->lock_.Lock();
+      list_->lock_holds_.LossyAdd(1);
+      list_->lock_start_ = absl::base_internal::CycleClock::Now();
+    }
+    ~TimedLockHolder() ABSL_UNLOCK_FUNCTION() {
+      list_->ChargeLockHold();
+      list_->lock_.Unlock();
+    }
+
+   private:
+    CentralFreeList* const list_;
+  };
+
+  void ChargeLockHold() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+    lock_cycles_.LossyAdd(absl::base_internal::CycleClock::Now() -
+                          lock_start_);
+  }
+#endif
+
   // Release an object to spans.
   // Returns object's span if it become completely free.
   Span* ReleaseToSpans(void* object, Span* span, size_t object_size)
@@ -153,6 +222,19 @@ class CentralFreeList {
   // index.
   uint8_t IndexFor(uint8_t bitwidth);
 
+  // Returns the offset of the set of nonempty_ lists <span> belongs in:
+  // kNumLists once it has an escape table with ESCAPE_FREE_SPANS_FIRST, else
+  // 0.
+  static uint8_t EscapeSetFor(const Span* span);
+
+#ifdef ESCAPE_FREE_SPANS_FIRST
+  // A span gets its escape table from the first escape into one of its
+  // objects, which does not take lock_.  Moves <span>, filed at <index>, to
+  // the lists of spans with escapes if it got one since.
+  void RefileIfEscaped(Span* span, uint8_t index)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+#endif
+
   // Records span utilization in objects_to_span_ map. Instead of using the
   // absolute number of allocated objects, it uses
   // absl::bit_width(allocated), passed as <bitwidth>, to index this map.
@@ -238,6 +320,15 @@ class CentralFreeList {
   static constexpr size_t kSpanUtilBucketCapacity = 16;
   StatsCounter objects_to_spans_[kSpanUtilBucketCapacity];
 
+  // Spans of the nonempty_ lists by absl::bit_width(allocated), and those of
+  // them with an escape table.  Bucket 0 holds spans with nothing allocated.
+  struct SpanOccupancy {
+    size_t spans[kSpanUtilBucketCapacity + 1] = {};
+    size_t escaped[kSpanUtilBucketCapacity + 1] = {};
+    size_t tracked = 0;
+  };
+  SpanOccupancy GetSpanOccupancy() ABSL_LOCKS_EXCLUDED(lock_);
+
   // Non-empty lists that distinguish spans based on the number of objects
   // allocated from them. When span prioritization is enabled, spans may be
   // added to any of the kNumLists nonempty_ lists based on their allocated
@@ -249,7 +340,16 @@ class CentralFreeList {
 #ifdef TCMALLOC_SMALL_BUT_SLOW
   SpanList nonempty_ ABSL_GUARDED_BY(lock_);
 #else
-  HintedTrackerLists<Span, kNumLists> nonempty_ ABSL_GUARDED_BY(lock_);
+  HintedTrackerLists<Span, kNumLists * kNumEscapeSets> nonempty_
+      ABSL_GUARDED_BY(lock_);
+#endif
+
+#ifdef CENTRAL_FREELIST_SHARDS
+  uint8_t shard_ = 0;
+  StatsCounter lock_holds_;
+  StatsCounter lock_cycles_;
+  // When the current hold of lock_ started.
+  int64_t lock_start_ ABSL_GUARDED_BY(lock_) = 0;
 #endif
 
   TCMALLOC_NO_UNIQUE_ADDRESS Forwarder forwarder_;
@@ -283,7 +383,7 @@ inline Span* CentralFreeList<Forwarder>::ReleaseToSpans(void* object,
 #ifdef TCMALLOC_SMALL_BUT_SLOW
     nonempty_.prepend(span);
 #else
-    const uint8_t index = GetFirstNonEmptyIndex();
+    const uint8_t index = GetFirstNonEmptyIndex() + EscapeSetFor(span);
     nonempty_.Add(span, index);
     span->set_nonempty_index(index);
 #endif
@@ -317,13 +417,18 @@ inline Span* CentralFreeList<Forwarder>::ReleaseToSpans(void* object,
     // If span allocation changes so that it moved to a different nonempty_
     // list, we remove it from the previous list and add it to the desired
     // list indexed by cur_index.
-    const uint8_t cur_index = IndexFor(cur_bitwidth);
+    const uint8_t cur_index = IndexFor(cur_bitwidth) + EscapeSetFor(span);
     if (cur_index != prev_index) {
       nonempty_.Remove(span, prev_index);
       nonempty_.Add(span, cur_index);
       span->set_nonempty_index(cur_index);
     }
   }
+#ifdef ESCAPE_FREE_SPANS_FIRST
+  else {
+    RefileIfEscaped(span, prev_index);
+  }
+#endif
   return nullptr;
 #endif
 }
@@ -346,6 +451,28 @@ inline Span* CentralFreeList<Forwarder>::FirstNonEmptySpan() {
 #endif
 }
 
+template <class Forwarder>
+inline uint8_t CentralFreeList<Forwarder>::EscapeSetFor(const Span* span) {
+#ifdef ESCAPE_FREE_SPANS_FIRST
+  if (span->escape_list.load(std::memory_order_relaxed) != nullptr) {
+    return kNumLists;
+  }
+#endif
+  return 0;
+}
+
+#ifdef ESCAPE_FREE_SPANS_FIRST
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::RefileIfEscaped(Span* span,
+                                                        uint8_t index) {
+  // Escape tables stay until the span is freed, so a span never moves back.
+  if (index >= kNumLists || EscapeSetFor(span) == 0) return;
+  nonempty_.Remove(span, index);
+  nonempty_.Add(span, index + kNumLists);
+  span->set_nonempty_index(index + kNumLists);
+}
+#endif
+
 template <class Forwarder>
 inline uint8_t CentralFreeList<Forwarder>::GetFirstNonEmptyIndex() {
   return forwarder_.PrioritizeSpans() ? first_nonempty_index_ : kNumLists - 1;
@@ -389,7 +516,11 @@ inline size_t CentralFreeList<Forwarder>::NumSpansInList(int n) {
 #ifdef TCMALLOC_SMALL_BUT_SLOW
   return nonempty_.length();
 #else
-  return nonempty_.SizeOfList(n);
+  size_t spans = 0;
+  for (size_t set = 0; set < kNumEscapeSets; ++set) {
+    spans += nonempty_.SizeOfList(n + set * kNumLists);
+  }
+  return spans;
 #endif
 }
 
@@ -414,7 +545,11 @@ inline void CentralFreeList<Forwarder>::InsertRange(absl::Span<void*> batch) {
   {
     // Use local copy of variable to ensure that it is not reloaded.
     size_t object_size = object_size_;
+#ifdef CENTRAL_FREELIST_SHARDS
+    TimedLockHolder h(this);
+#else
     absl::base_internal::SpinLockHolder h(&lock_);
+#endif
     for (int i = 0; i < batch.size(); ++i) {
       Span* span = ReleaseToSpans(batch[i], spans[i], object_size);
       if (ABSL_PREDICT_FALSE(span)) {
@@ -444,7 +579,11 @@ inline int CentralFreeList<Forwarder>::RemoveRange(void** batch, int N) {
   // Use local copy of variable to ensure that it is not reloaded.
   size_t object_size = object_size_;
   int result = 0;
+#ifdef CENTRAL_FREELIST_SHARDS
+  TimedLockHolder h(this);
+#else
   absl::base_internal::SpinLockHolder h(&lock_);
+#endif
 
   do {
     Span* span = FirstNonEmptySpan();
@@ -453,7 +592,16 @@ inline int CentralFreeList<Forwarder>::RemoveRange(void** batch, int N) {
       break;
     }
 
+    // When this span cannot fill the rest of the batch it is about to
+    // leave the nonempty_ lists: prefetch the span the next iteration takes
+    // while this one is drained.
+    const bool drains_span =
+        span->Allocated() + (N - result) >= objects_per_span_;
+
 #ifdef TCMALLOC_SMALL_BUT_SLOW
+    if (drains_span) {
+      if (Span* next = nonempty_.next(span)) next->Prefetch();
+    }
     // We do not collect histogram stats for small-but-slow.
     int here = span->FreelistPopBatch(batch + result, N - result, object_size);
     ASSERT(here > 0);
@@ -463,6 +611,9 @@ inline int CentralFreeList<Forwarder>::RemoveRange(void** batch, int N) {
 #else
     const uint8_t prev_bitwidth = absl::bit_width(span->Allocated());
     const uint8_t prev_index = span->nonempty_index();
+    if (drains_span) {
+      if (Span* next = nonempty_.PeekNext(span, prev_index)) next->Prefetch();
+    }
     int here = span->FreelistPopBatch(batch + result, N - result, object_size);
     ASSERT(here > 0);
     // As the objects are being popped from the span, its utilization might
@@ -479,13 +630,18 @@ inline int CentralFreeList<Forwarder>::RemoveRange(void** batch, int N) {
       // If span allocation changes so that it must be moved to a different
       // nonempty_ list, we remove it from the previous list and add it to the
       // desired list indexed by cur_index.
-      const uint8_t cur_index = IndexFor(cur_bitwidth);
+      const uint8_t cur_index = IndexFor(cur_bitwidth) + EscapeSetFor(span);
       if (cur_index != prev_index) {
         nonempty_.Remove(span, prev_index);
         nonempty_.Add(span, cur_index);
         span->set_nonempty_index(cur_index);
       }
     }
+#ifdef ESCAPE_FREE_SPANS_FIRST
+    else {
+      RefileIfEscaped(span, prev_index);
+    }
+#endif
 #endif
     result += here;
   } while (result < N);
@@ -500,6 +656,9 @@ inline int CentralFreeList<Forwarder>::Populate(void** batch, int N)
   // Release central list lock while operating on pageheap
   // Note, this could result in multiple calls to populate each allocating
   // a new span and the pushing those partially full spans onto nonempty.
+#ifdef CENTRAL_FREELIST_SHARDS
+  ChargeLockHold();
+#endif
   lock_.Unlock();
   size_t objects_per_span = 1;
   if (ABSL_PREDICT_FALSE(forwarder_.PassSpanObjectCountToPageheap())) {
@@ -512,8 +671,14 @@ inline int CentralFreeList<Forwarder>::Populate(void** batch, int N)
         pages_per_span_.in_bytes());
 
     lock_.Lock();
+#ifdef CENTRAL_FREELIST_SHARDS
+    lock_start_ = absl::base_internal::CycleClock::Now();
+#endif
     return 0;
   }
+#ifdef CENTRAL_FREELIST_SHARDS
+  span->central_shard = shard_;
+#endif
 
   objects_per_span = objects_per_span_;
   int result = span->BuildFreelist(object_size_, objects_per_span, batch, N);
@@ -522,6 +687,9 @@ inline int CentralFreeList<Forwarder>::Populate(void** batch, int N)
   bool span_empty = result == objects_per_span;
 
   lock_.Lock();
+#ifdef CENTRAL_FREELIST_SHARDS
+  lock_start_ = absl::base_internal::CycleClock::Now();
+#endif
 
 #ifdef TCMALLOC_SMALL_BUT_SLOW
   // We do not collect histogram stats for small-but-slow. Moreover, we maintain
@@ -534,7 +702,7 @@ inline int CentralFreeList<Forwarder>::Populate(void** batch, int N)
   const uint8_t bitwidth = absl::bit_width(span->Allocated());
   RecordSpanUtil(bitwidth, /*increase=*/true);
   if (!span_empty) {
-    const uint8_t index = IndexFor(bitwidth);
+    const uint8_t index = IndexFor(bitwidth) + EscapeSetFor(span);
     nonempty_.Add(span, index);
     span->set_nonempty_index(index);
   }
@@ -595,10 +763,188 @@ inline void CentralFreeList<Forwarder>::PrintSpanUtilStatsInPbtxt(
   }
 }
 
+#if defined(HEAP_COMPACTION) && !defined(TCMALLOC_SMALL_BUT_SLOW)
+template <class Forwarder>
+template <typename F>
+inline Span* CentralFreeList<Forwarder>::TakeSparsestSpan(size_t max_allocated,
+                                                          F f) {
+  // Use local copy of variable to ensure that it is not reloaded.
+  size_t object_size = object_size_;
+  absl::base_internal::SpinLockHolder h(&lock_);
+  // The others hold length() minus the free objects of the span, which is
+  // at least its allocated ones if length() is at least a span's worth.
+  if (length() < objects_per_span_) return nullptr;
+  Span* best = nullptr;
+  for (Span* span = nonempty_.PeekLeast(0); span != nullptr;
+       span = nonempty_.PeekNext(span, span->nonempty_index())) {
+    if (best == nullptr || span->Allocated() < best->Allocated()) {
+      best = span;
+      if (best->Allocated() <= 1) break;
+    }
+  }
+  if (best == nullptr || best->Allocated() > max_allocated) return nullptr;
+
+  const uint8_t prev_bitwidth = absl::bit_width(best->Allocated());
+  nonempty_.Remove(best, best->nonempty_index());
+  void* batch[kMaxObjectsToMove];
+  int popped = 0;
+  while (!best->FreelistEmpty(object_size)) {
+    const int here =
+        best->FreelistPopBatch(batch, kMaxObjectsToMove, object_size);
+    ASSERT(here > 0);
+    for (int i = 0; i < here; ++i) f(batch[i]);
+    popped += here;
+  }
+  // The span is full now, as if RemoveRange() had drained it.
+  const uint8_t cur_bitwidth = absl::bit_width(best->Allocated());
+  if (cur_bitwidth != prev_bitwidth) {
+    RecordSpanUtil(prev_bitwidth, /*increase=*/false);
+    RecordSpanUtil(cur_bitwidth, /*increase=*/true);
+  }
+  UpdateObjectCounts(-popped);
+  return best;
+}
+#endif
+
+template <class Forwarder>
+inline typename CentralFreeList<Forwarder>::SpanOccupancy
+CentralFreeList<Forwarder>::GetSpanOccupancy() {
+  SpanOccupancy o;
+#ifndef TCMALLOC_SMALL_BUT_SLOW
+  absl::base_internal::SpinLockHolder h(&lock_);
+  for (Span* span = nonempty_.PeekLeast(0); span != nullptr;
+       span = nonempty_.PeekNext(span, span->nonempty_index())) {
+    const size_t bucket = std::min<size_t>(absl::bit_width(span->Allocated()),
+                                           kSpanUtilBucketCapacity);
+    ++o.spans[bucket];
+    if (span->escape_list.load(std::memory_order_relaxed) != nullptr) {
+      ++o.escaped[bucket];
+    }
+    ++o.tracked;
+  }
+#endif
+  return o;
+}
+
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::PrintSpanOccupancyStats(Printer* out) {
+  const SpanOccupancy o = GetSpanOccupancy();
+  const size_t spans = num_spans();
+  out->printf("class %3d [ %8zu bytes ] : %6zu full;", size_class_,
+              object_size_, spans > o.tracked ? spans - o.tracked : 0);
+  const size_t buckets = absl::bit_width(objects_per_span_);
+  for (size_t i = 0; i <= buckets && i <= kSpanUtilBucketCapacity; ++i) {
+    out->printf(" %zu/%zu < %zu", o.spans[i], o.escaped[i], size_t{1} << i);
+    if (i < buckets) out->printf(",");
+  }
+  out->printf("\n");
+}
+
+template <class Forwarder>
+inline void CentralFreeList<Forwarder>::PrintSpanOccupancyStatsInPbtxt(
+    PbtxtRegion* region) {
+  const SpanOccupancy o = GetSpanOccupancy();
+  const size_t spans = num_spans();
+  region->PrintI64("full_spans", spans > o.tracked ? spans - o.tracked : 0);
+  const size_t buckets = absl::bit_width(objects_per_span_);
+  for (size_t i = 0; i <= buckets && i <= kSpanUtilBucketCapacity; ++i) {
+    PbtxtRegion histogram = region->CreateSubRegion("span_occupancy_histogram");
+    histogram.PrintI64("lower_bound", i == 0 ? 0 : size_t{1} << (i - 1));
+    histogram.PrintI64("upper_bound", size_t{1} << i);
+    histogram.PrintI64("spans", o.spans[i]);
+    histogram.PrintI64("spans_with_escapes", o.escaped[i]);
+  }
+}
+
 }  // namespace central_freelist_internal
 
+#ifdef CENTRAL_FREELIST_SHARDS
+// Central free lists sharded by last level cache (CENTRAL_FREELIST_SHARDS).
+//
+// With one CentralFreeList per size class, every refill and overflow of the
+// caches above it contends on one lock_, from all the sockets of the
+// machine.  This keeps a list per L3 cache for each size class instead,
+// folded into kMaxCentralFreeListShards of them.  A CPU allocates from the
+// shard of its L3 cache, which allocates its own spans; objects go back to
+// the shard their span records wherever they are freed.  A shard out of
+// free objects takes them from another before it allocates a span.
+inline constexpr size_t kMaxCentralFreeListShards = 8;
+
+class ShardedCentralFreeList {
+ public:
+  using Shard = central_freelist_internal::CentralFreeList<
+      central_freelist_internal::StaticForwarder>;
+
+  constexpr ShardedCentralFreeList() : shards_() {}
+
+  ShardedCentralFreeList(const ShardedCentralFreeList&) = delete;
+  ShardedCentralFreeList& operator=(const ShardedCentralFreeList&) = delete;
+
+  // The first call reads the cache topology of the machine.
+  void Init(size_t size_class);
+
+  // Returns each object of batch to the shard of its span.
+  // REQUIRES: batch.size() > 0 && batch.size() <= kMaxObjectsToMove.
+  void InsertRange(absl::Span<void*> batch);
+
+  // Removes up to N objects from the shard of the current CPU, or from
+  // another shard if it has none free.
+  ABSL_MUST_USE_RESULT int RemoveRange(void** batch, int N);
+
+  // The methods of CentralFreeList, summed over the shards.
+  size_t length() const;
+  size_t OverheadBytes() const;
+  size_t NumSpansInList(int n);
+  SpanStats GetSpanStats() const;
+  size_t NumSpansWith(uint16_t bitwidth) const;
+
+  // Report the histograms of CentralFreeList, one line or region per shard.
+  void PrintSpanUtilStats(Printer* out) const;
+  void PrintSpanUtilStatsInPbtxt(PbtxtRegion* region) const;
+  void PrintSpanOccupancyStats(Printer* out);
+  void PrintSpanOccupancyStatsInPbtxt(PbtxtRegion* region);
+
+  // Reports the objects taken from other shards, and the lock holds of each
+  // shard with the mean cycles they held it.
+  void PrintShardStats(Printer* out) const;
+  void PrintShardStatsInPbtxt(PbtxtRegion* region) const;
+
+#ifdef HEAP_COMPACTION
+  // CentralFreeList::TakeSparsestSpan() of the first shard with a span that
+  // qualifies.
+  template <typename F>
+  Span* TakeSparsestSpan(size_t max_allocated, F f) {
+    for (size_t shard = 0; shard < num_shards_; ++shard) {
+      if (Span* span = shards_[shard].TakeSparsestSpan(max_allocated, f)) {
+        return span;
+      }
+    }
+    return nullptr;
+  }
+#endif
+
+  static size_t num_shards() { return num_shards_; }
+
+ private:
+  // Maps each CPU to the shard of its L3 cache.
+  static void InitTopology();
+  // The shard of the CPU this runs on.
+  static size_t CurrentShard();
+
+  ABSL_CONST_INIT static size_t num_shards_;
+  ABSL_CONST_INIT static bool topology_initialized_;
+
+  size_t size_class_ = 0;
+  // Objects RemoveRange() took from a shard other than that of its CPU.
+  std::atomic<size_t> stolen_{0};
+  Shard shards_[kMaxCentralFreeListShards];
+};
+
+using CentralFreeList = ShardedCentralFreeList;
+#else
 using CentralFreeList = central_freelist_internal::CentralFreeList<
     central_freelist_internal::StaticForwarder>;
+#endif
 
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
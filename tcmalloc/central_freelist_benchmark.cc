@@ -18,6 +18,7 @@
 #include <vector>
 
 #include "absl/algorithm/container.h"
+#include "absl/base/internal/cycleclock.h"
 #include "absl/random/random.h"
 #include "benchmark/benchmark.h"
 #include "tcmalloc/central_freelist.h"
@@ -196,6 +197,66 @@ BENCHMARK(BM_SpanReuse)
     ->DenseRange(64, 1024, 64)
     ->DenseRange(1024, 4096, 512);
 
+// This benchmark times bursts of refills, each taking kBurstBatches batches
+// in a row, as a per-CPU cache that runs empty repeatedly would.  Like
+// BM_SpanReuse, it holds every other object so that the spans stay partially
+// used and a burst drains several of them.  Reports the median and the 99th
+// percentile of the burst latency in cycles.
+void BM_RefillBurst(benchmark::State& state) {
+  constexpr int kBurstBatches = 8;
+  size_t object_size = state.range(0);
+  size_t size_class = tc_globals.sizemap().SizeClass(CppPolicy(), object_size);
+  int batch_size = tc_globals.sizemap().num_objects_to_move(size_class);
+  int num_objects = 16 * 1024 * 1024 / object_size;
+  CentralFreeList cfl;
+  cfl.Init(size_class);
+
+  std::vector<void*> held_objects(2 * num_objects);
+  for (int index = 0; index < 2 * num_objects;) {
+    int count = std::min(batch_size, 2 * num_objects - index);
+    index += cfl.RemoveRange(&held_objects[index], count);
+  }
+  for (int index = 0; index < 2 * num_objects; index += 2) {
+    cfl.InsertRange({&held_objects[index], 1});
+  }
+
+  absl::BitGen rnd;
+  std::vector<void*> buffer(kBurstBatches * batch_size);
+  std::vector<int64_t> cycles;
+  for (auto _ : state) {
+    const int64_t start = absl::base_internal::CycleClock::Now();
+    int index = 0;
+    while (index < kBurstBatches * batch_size) {
+      int count = std::min<int>(batch_size, buffer.size() - index);
+      index += cfl.RemoveRange(&buffer[index], count);
+    }
+    cycles.push_back(absl::base_internal::CycleClock::Now() - start);
+
+    state.PauseTiming();
+    // Return the burst in random order, so that the next one finds them
+    // spread over many spans.
+    absl::c_shuffle(buffer, rnd);
+    for (void* ptr : buffer) {
+      cfl.InsertRange({&ptr, 1});
+    }
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * kBurstBatches * batch_size);
+  if (!cycles.empty()) {
+    absl::c_sort(cycles);
+    state.counters["p50_cycles"] = cycles[cycles.size() / 2];
+    state.counters["p99_cycles"] = cycles[cycles.size() * 99 / 100];
+  }
+
+  for (int index = 1; index < 2 * num_objects; index += 2) {
+    cfl.InsertRange({&held_objects[index], 1});
+  }
+}
+BENCHMARK(BM_RefillBurst)
+    ->DenseRange(8, 64, 16)
+    ->DenseRange(64, 1024, 64)
+    ->DenseRange(1024, 4096, 512);
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -14,7 +14,10 @@
 
 #include "tcmalloc/central_freelist.h"
 
+#include <string.h>
+
 #include <algorithm>
+#include <string>
 #include <utility>
 
 #include "benchmark/benchmark.h"
@@ -22,6 +25,7 @@
 #include "gtest/gtest.h"
 #include "absl/container/fixed_array.h"
 #include "absl/random/random.h"
+#include "absl/strings/str_format.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/mock_static_forwarder.h"
 #include "tcmalloc/pagemap.h"
@@ -684,6 +688,167 @@ TYPED_TEST_P(CentralFreeListTest, SpanPriority) {
   }
 }
 
+// Escape-free spans are allocated from before a span with an escape table even
+// if the latter has more allocated objects.
+TYPED_TEST_P(CentralFreeListTest, EscapeFreeSpansFirst) {
+#ifndef ESCAPE_FREE_SPANS_FIRST
+  GTEST_SKIP() << "ESCAPE_FREE_SPANS_FIRST is not set";
+#endif
+  TypeParam e;
+  e.central_freelist().forwarder().SetPrioritizeSpans(true);
+
+  const int objects_per_span = TypeParam::kObjectsPerSpan;
+  if (objects_per_span < 3) return;
+
+  constexpr int kNumSpans = 2;
+  absl::FixedArray<std::vector<void*>> objects(kNumSpans);
+  void* batch[kMaxObjectsToMove];
+  Span* spans[kNumSpans];
+  for (int span = 0; span < kNumSpans; ++span) {
+    while (objects[span].size() < objects_per_span) {
+      const size_t n = objects_per_span - objects[span].size();
+      int got = e.central_freelist().RemoveRange(
+          batch, std::min(n, TypeParam::kBatchSize));
+      objects[span].insert(objects[span].end(), batch, batch + got);
+    }
+    spans[span] = e.central_freelist().forwarder().MapObjectToSpan(
+        objects[span][0]);
+  }
+  ASSERT_NE(spans[0], spans[1]);
+
+  // The first span, which would be preferred with one object free, gets an
+  // escape table; the second keeps only one object allocated.
+  alignas(void*) static char table[64];
+  spans[0]->escape_list.store(reinterpret_cast<EscapeHead*>(table),
+                              std::memory_order_relaxed);
+  e.central_freelist().InsertRange({&objects[0].back(), 1});
+  objects[0].pop_back();
+  while (objects[1].size() > 1) {
+    e.central_freelist().InsertRange({&objects[1].back(), 1});
+    objects[1].pop_back();
+  }
+
+  ASSERT_EQ(e.central_freelist().RemoveRange(batch, 1), 1);
+  EXPECT_EQ(e.central_freelist().forwarder().MapObjectToSpan(batch[0]),
+            spans[1]);
+  e.central_freelist().InsertRange({batch, 1});
+
+  spans[0]->escape_list.store(nullptr, std::memory_order_relaxed);
+  for (int span = 0; span < kNumSpans; ++span) {
+    for (void*& object : objects[span]) {
+      e.central_freelist().InsertRange({&object, 1});
+    }
+  }
+}
+
+TYPED_TEST_P(CentralFreeListTest, SpanOccupancyHistogram) {
+#ifdef TCMALLOC_SMALL_BUT_SLOW
+  GTEST_SKIP() << "span occupancy is not tracked";
+#endif
+  TypeParam e;
+  const int objects_per_span = TypeParam::kObjectsPerSpan;
+  if (objects_per_span < 3) return;
+
+  auto print = [&]() {
+    std::string buffer(4096, '\0');
+    Printer printer(&buffer[0], buffer.size());
+    e.central_freelist().PrintSpanOccupancyStats(&printer);
+    buffer.resize(strlen(buffer.c_str()));
+    return buffer;
+  };
+
+  constexpr int kNumSpans = 2;
+  absl::FixedArray<std::vector<void*>> objects(kNumSpans);
+  void* batch[kMaxObjectsToMove];
+  for (int span = 0; span < kNumSpans; ++span) {
+    while (objects[span].size() < objects_per_span) {
+      const size_t n = objects_per_span - objects[span].size();
+      int got = e.central_freelist().RemoveRange(
+          batch, std::min(n, TypeParam::kBatchSize));
+      objects[span].insert(objects[span].end(), batch, batch + got);
+    }
+  }
+  EXPECT_THAT(print(), testing::HasSubstr(absl::StrFormat(
+                           ": %6d full; 0/0 < 1,", kNumSpans)));
+
+  // Returning an object moves its span back into a nonempty_ list, into the
+  // bucket of its remaining objects.
+  e.central_freelist().InsertRange({&objects[0].back(), 1});
+  objects[0].pop_back();
+  const int bucket = absl::bit_width(objects[0].size());
+  EXPECT_THAT(print(),
+              testing::HasSubstr(absl::StrFormat(": %6d full;", kNumSpans - 1)));
+  EXPECT_THAT(print(),
+              testing::HasSubstr(absl::StrFormat(" 1/0 < %d", 1 << bucket)));
+
+  for (int span = 0; span < kNumSpans; ++span) {
+    for (void*& object : objects[span]) {
+      e.central_freelist().InsertRange({&object, 1});
+    }
+  }
+}
+
+TYPED_TEST_P(CentralFreeListTest, TakeSparsestSpan) {
+#if !defined(HEAP_COMPACTION) || defined(TCMALLOC_SMALL_BUT_SLOW)
+  GTEST_SKIP() << "HEAP_COMPACTION is not set";
+#else
+  TypeParam e;
+  const int objects_per_span = TypeParam::kObjectsPerSpan;
+  if (objects_per_span < 3) return;
+
+  constexpr int kNumSpans = 2;
+  absl::FixedArray<std::vector<void*>> objects(kNumSpans);
+  void* batch[kMaxObjectsToMove];
+  for (int span = 0; span < kNumSpans; ++span) {
+    while (objects[span].size() < objects_per_span) {
+      const size_t n = objects_per_span - objects[span].size();
+      int got = e.central_freelist().RemoveRange(
+          batch, std::min(n, TypeParam::kBatchSize));
+      objects[span].insert(objects[span].end(), batch, batch + got);
+    }
+  }
+  auto take = [&](size_t max_allocated, std::vector<void*>* popped) {
+    return e.central_freelist().TakeSparsestSpan(
+        max_allocated, [&](void* object) { popped->push_back(object); });
+  };
+  std::vector<void*> popped;
+  // Full spans are in no nonempty_ list.
+  EXPECT_EQ(take(objects_per_span, &popped), nullptr);
+
+  // Keep one object of span 0 and two of span 1.
+  for (int span = 0; span < kNumSpans; ++span) {
+    while (objects[span].size() > span + 1) {
+      e.central_freelist().InsertRange({&objects[span].back(), 1});
+      objects[span].pop_back();
+    }
+  }
+  EXPECT_EQ(take(0, &popped), nullptr);
+  EXPECT_TRUE(popped.empty());
+
+  Span* span = take(1, &popped);
+  ASSERT_NE(span, nullptr);
+  EXPECT_EQ(span, e.forwarder().MapObjectToSpan(objects[0][0]));
+  EXPECT_EQ(popped.size(), objects_per_span - 1);
+  EXPECT_EQ(e.central_freelist().length(), objects_per_span - 2);
+  // Span 1 is left, and its objects would have nowhere to go.
+  std::vector<void*> rest;
+  EXPECT_EQ(take(objects_per_span, &rest), nullptr);
+
+  // Returning the taken objects and the one left frees span 0, then the
+  // rest frees span 1.
+  popped.push_back(objects[0][0]);
+  objects[0].clear();
+  EXPECT_CALL(e.forwarder(), DeallocateSpans).Times(2);
+  for (void*& object : popped) {
+    e.central_freelist().InsertRange({&object, 1});
+  }
+  EXPECT_EQ(e.central_freelist().length(), objects_per_span - 2);
+  for (void*& object : objects[1]) {
+    e.central_freelist().InsertRange({&object, 1});
+  }
+#endif
+}
+
 TYPED_TEST_P(CentralFreeListTest, MultipleSpans) {
   TypeParam e;
   std::vector<void*> all_objects;
@@ -886,10 +1051,11 @@ TYPED_TEST_P(CentralFreeListTest, SpanFragmentation) {
 
 REGISTER_TYPED_TEST_SUITE_P(CentralFreeListTest, IsolatedSmoke,
                             SingleNonEmptyList, MultiNonEmptyLists,
-                            SpanPriority, SpanUtilizationHistogram,
-                            MultipleSpans, ToggleSpanPrioritization,
-                            SinglePopulate, PassSpanObjectCountToPageheap,
-                            SpanFragmentation);
+                            SpanPriority, EscapeFreeSpansFirst,
+                            SpanUtilizationHistogram, SpanOccupancyHistogram,
+                            TakeSparsestSpan, MultipleSpans,
+                            ToggleSpanPrioritization, SinglePopulate,
+                            PassSpanObjectCountToPageheap, SpanFragmentation);
 
 namespace unit_tests {
 
@@ -0,0 +1,148 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Benchmarks of the out-of-line bounds checks: __gep_check_boundary() and
+// __bc_check_boundary() on small and large objects, under sampling and on
+// pointers outside the heap, and the checked str* and mem* functions.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/tcmalloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr int kLastClass = kNumClasses - 1;
+
+void SizeClasses(benchmark::internal::Benchmark* b) {
+  for (int size_class : {1, 2, 4, 8, 16, 32, kLastClass}) {
+    b->Arg(size_class);
+  }
+}
+
+size_t ClassSize(const benchmark::State& state) {
+  // The first allocation sets up tc_globals for the size map.
+  free(malloc(1));
+  return tc_globals.sizemap().class_to_size(state.range(0));
+}
+
+// Runs the checks of a benchmark under `policy`, restoring the previous
+// policy when done.  Threads of a multi-threaded run share one switch.
+class ScopedProtectionPolicy {
+ public:
+  ScopedProtectionPolicy(const benchmark::State& state,
+                         MallocExtension::ProtectionPolicy policy,
+                         int64_t period)
+      : state_(state) {
+    if (state_.thread_index() != 0) return;
+    policy_ = MallocExtension::GetProtectionPolicy();
+    period_ = MallocExtension::GetProtectionSamplePeriod();
+    MallocExtension::SetProtectionPolicy(policy);
+    MallocExtension::SetProtectionSamplePeriod(period);
+  }
+
+  ~ScopedProtectionPolicy() {
+    if (state_.thread_index() != 0) return;
+    MallocExtension::SetProtectionPolicy(policy_);
+    MallocExtension::SetProtectionSamplePeriod(period_);
+  }
+
+ private:
+  const benchmark::State& state_;
+  MallocExtension::ProtectionPolicy policy_;
+  int64_t period_;
+};
+
+// Checks of a pointer to the middle of `base` and of an access there, sized
+// to stay in bounds so no error is reported.
+void CheckLoop(benchmark::State& state, char* base, size_t size) {
+  char* ptr = base + size / 2;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(TCMallocInternalGepCheckBoundary(base, ptr, 1));
+    benchmark::DoNotOptimize(TCMallocInternalBcCheckBoundary(ptr, 1));
+  }
+  state.SetItemsProcessed(2 * state.iterations());
+}
+
+void BM_CheckSmall(benchmark::State& state) {
+  const size_t size = ClassSize(state);
+  char* base = static_cast<char*>(malloc(size));
+  CheckLoop(state, base, size);
+  free(base);
+}
+
+// range(0) bytes, beyond the size classes, so the checks find a large span.
+void BM_CheckLarge(benchmark::State& state) {
+  const size_t size = state.range(0);
+  char* base = static_cast<char*>(malloc(size));
+  CheckLoop(state, base, size);
+  free(base);
+}
+
+// Checks of a small object with one in range(0) of them run.
+void BM_CheckSampled(benchmark::State& state) {
+  ScopedProtectionPolicy policy(
+      state, MallocExtension::ProtectionPolicy::kSampled, state.range(0));
+  char* base = static_cast<char*>(malloc(64));
+  CheckLoop(state, base, 64);
+  free(base);
+}
+
+// Checks of a stack buffer, which the page map does not know about.
+void BM_CheckNonHeap(benchmark::State& state) {
+  char buf[64];
+  CheckLoop(state, buf, sizeof(buf));
+}
+
+// The checked string functions on heap buffers of range(0) bytes.
+void BM_StringCheck(benchmark::State& state) {
+  const size_t size = state.range(0);
+  char* src = static_cast<char*>(malloc(size));
+  char* dst = static_cast<char*>(malloc(size));
+  memset(src, 'x', size - 1);
+  src[size - 1] = '\0';
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(TCMallocInternalStrlenCheck(src));
+    benchmark::DoNotOptimize(TCMallocInternalStrcpyCheck(dst, src));
+    benchmark::DoNotOptimize(TCMallocInternalStrncpyCheck(dst, src, size));
+    benchmark::DoNotOptimize(TCMallocInternalMemcpyCheck(dst, src, size));
+    benchmark::DoNotOptimize(TCMallocInternalMemmoveCheck(dst, src, size));
+    benchmark::DoNotOptimize(TCMallocInternalMemsetCheck(dst, 0, size));
+  }
+  state.SetItemsProcessed(6 * state.iterations());
+  state.SetBytesProcessed(6 * state.iterations() * size);
+  free(src);
+  free(dst);
+}
+
+BENCHMARK(BM_CheckSmall)->Apply(SizeClasses)->ThreadRange(1, 8);
+BENCHMARK(BM_CheckLarge)->Range(kMaxSize * 2, 64 << 20)->ThreadRange(1, 8);
+BENCHMARK(BM_CheckSampled)->Range(1, 1024)->ThreadRange(1, 8);
+BENCHMARK(BM_CheckNonHeap)->ThreadRange(1, 8);
+BENCHMARK(BM_StringCheck)->Range(16, 64 << 10)->ThreadRange(1, 8);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
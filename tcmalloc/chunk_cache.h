@@ -0,0 +1,125 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Per-thread cache of recent chunk lookups made by bounds checks.
+
+#ifndef TCMALLOC_CHUNK_CACHE_H_
+#define TCMALLOC_CHUNK_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Instrumented code tends to check the same object over and over (loop
+// bodies, accesses to the fields of one struct), so each thread remembers the
+// last few chunks it resolved and answers checks inside them without reading
+// the page map.
+//
+// Entries are only valid while the page map info they were computed from is.
+// The address space is split by hugepage into kShards shards, each with its
+// own epoch: PageMap::UnregisterSizeClass(), UnregisterObjectSize() and the
+// other callers of Invalidate() bump those of the hugepages they change, and
+// an entry whose shard's epoch moved since its lookup is dropped when it is
+// next matched.  Freeing one span thus leaves the chunks cached elsewhere
+// alone.  Only heap chunks are cached.
+class ChunkCache {
+ public:
+  static constexpr size_t kEntries = 4;
+  static constexpr size_t kShards = 64;
+
+  constexpr ChunkCache() : next_(0), entries_{} {}
+
+  // Sets [*start, *end) and returns true if addr lies in a cached chunk that
+  // is still valid.
+  bool ABSL_ATTRIBUTE_ALWAYS_INLINE Lookup(uintptr_t addr, uintptr_t* start,
+                                           uintptr_t* end) {
+    for (Entry& e : entries_) {
+      // Empty entries have start == end and never match.
+      if (addr - e.start < e.end - e.start) {
+        if (ABSL_PREDICT_FALSE(
+                epochs_[e.shard].value.load(std::memory_order_acquire) !=
+                e.epoch)) {
+          e = {};
+          return false;
+        }
+        *start = e.start;
+        *end = e.end;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The epoch of the shard of addr, to be read before the page map lookup
+  // whose result is passed to Insert(), so that a chunk resolved across an
+  // invalidation is dropped by the next Lookup().
+  static uint64_t ABSL_ATTRIBUTE_ALWAYS_INLINE Epoch(uintptr_t addr) {
+    return epochs_[Shard(addr)].value.load(std::memory_order_acquire);
+  }
+
+  // Caches the chunk [start, end), which addr lies in and was resolved in
+  // epoch, replacing the oldest entry.
+  void ABSL_ATTRIBUTE_ALWAYS_INLINE Insert(uintptr_t addr, uintptr_t start,
+                                           uintptr_t end, uint64_t epoch) {
+    entries_[next_] = {start, end, Shard(addr), epoch};
+    next_ = (next_ + 1) % kEntries;
+  }
+
+  // Invalidates the entries of every thread for chunks in [start, end).
+  static void Invalidate(uintptr_t start, uintptr_t end) {
+    const uintptr_t first = start >> kHugePageShift;
+    const uintptr_t last = (end - 1) >> kHugePageShift;
+    const uintptr_t n = last - first + 1;
+    for (uintptr_t i = 0; i < n && i < kShards; ++i) {
+      epochs_[(first + i) % kShards].value.fetch_add(
+          1, std::memory_order_release);
+    }
+  }
+
+ private:
+  struct Entry {
+    uintptr_t start;
+    uintptr_t end;
+    size_t shard;
+    uint64_t epoch;
+  };
+
+  struct alignas(ABSL_CACHELINE_SIZE) ShardEpoch {
+    std::atomic<uint64_t> value;
+  };
+
+  static size_t ABSL_ATTRIBUTE_ALWAYS_INLINE Shard(uintptr_t addr) {
+    return (addr >> kHugePageShift) % kShards;
+  }
+
+  size_t next_;
+  Entry entries_[kEntries];
+
+  ABSL_CONST_INIT static ShardEpoch epochs_[kShards];
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_CHUNK_CACHE_H_
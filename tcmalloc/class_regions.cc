@@ -0,0 +1,218 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/class_regions.h"
+
+#include <new>
+
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/system-alloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT std::atomic<uintptr_t> ClassRegions::base_{uintptr_t{1}
+                                                           << 63};
+ABSL_CONST_INIT std::atomic<bool> ClassRegions::claimed_{false};
+ABSL_CONST_INIT ClassRegions::Layout ClassRegions::layout_[kRegions] = {};
+
+bool ClassRegions::Init() {
+  if (claimed_.exchange(true, std::memory_order_relaxed)) return false;
+  void* base = SystemReserve(kBytes, kRegionBytes);
+  if (base == nullptr) return false;
+
+  SizeMap& sizemap = tc_globals.sizemap();
+  for (size_t size_class = 1; size_class < kRegions; ++size_class) {
+    const size_t size = sizemap.class_to_size(size_class);
+    const size_t span_bytes =
+        Length(sizemap.class_to_pages(size_class)).in_bytes();
+    if (size == 0 || span_bytes == 0 || span_bytes > kHugePageSize) continue;
+    const size_t spans = kHugePageSize / span_bytes;
+    // A slot pattern that strands more than an eighth of every hugepage is
+    // worse than the filler's packing.
+    if (kHugePageSize - spans * span_bytes > kHugePageSize / 8) continue;
+    Layout& l = layout_[size_class];
+    l.size = size;
+    l.objects = span_bytes / size;
+    l.span_bytes = span_bytes;
+    l.spans = spans;
+    l.size_magic = ~uint64_t{0} / size + 1;
+    l.span_magic = ~uint64_t{0} / span_bytes + 1;
+  }
+  base_.store(reinterpret_cast<uintptr_t>(base), std::memory_order_release);
+  return true;
+}
+
+void ClassRegionAllocator::Init(Arena* arena) {
+  tracker_allocator_.Init(arena);
+  enabled_ = ClassRegions::Init();
+}
+
+ClassRegionAllocator::Region* ClassRegionAllocator::GetRegion(
+    size_t size_class) {
+  Region*& r = regions_[size_class];
+  if (ABSL_PREDICT_TRUE(r != nullptr)) return r;
+  r = new (meta_(sizeof(Region))) Region(meta_);
+  r->free.Insert(
+      HugeRange::Make(FirstHugePage(size_class),
+                      NHugePages(ClassRegions::kHugePagesPerRegion)));
+  return r;
+}
+
+PageId ClassRegionAllocator::Get(size_t size_class, Length n,
+                                 bool* from_released) {
+  if (!enabled_ || size_class >= ClassRegions::kRegions) return PageId{0};
+  const ClassRegions::Layout& l = ClassRegions::layout(size_class);
+  if (l.spans == 0 || n.in_bytes() != l.span_bytes) return PageId{0};
+
+  Region* r = GetRegion(size_class);
+  Tracker* t;
+  *from_released = false;
+  if (!r->partial.empty()) {
+    t = r->partial.first();
+  } else if (r->spare != nullptr) {
+    t = r->spare;
+    r->spare = nullptr;
+    r->partial.prepend(t);
+  } else {
+    HugeAddressMap::Node* node = r->free.first();
+    if (node == nullptr) return PageId{0};
+    const HugeRange range = node->range();
+    r->free.Remove(node);
+    if (range.len() > NHugePages(1)) {
+      r->free.Insert(HugeRange::Make(range.start() + NHugePages(1),
+                                     range.len() - NHugePages(1)));
+    }
+    t = tracker_allocator_.New();
+    new (t) Tracker();
+    t->location = range.start();
+    t->nused = 0;
+    r->trackers[(t->location - FirstHugePage(size_class)).raw_num()] = t;
+    ++r->hugepages;
+    r->partial.prepend(t);
+    tc_globals.pagemap().Ensure(t->location.first_page(), kPagesPerHugePage);
+    *from_released = true;
+  }
+
+  const size_t slot = t->used.FindClear(0);
+  ASSERT(slot < l.spans);
+  t->used.SetBit(slot);
+  if (++t->nused == l.spans) r->partial.remove(t);
+  ++r->spans;
+  return PageIdContaining(static_cast<char*>(t->location.start_addr()) +
+                          slot * l.span_bytes);
+}
+
+bool ClassRegionAllocator::MaybePut(PageId p, Length n) {
+  if (!enabled_) return false;
+  const uintptr_t addr = p.start_uintptr();
+  const size_t size_class = ClassRegions::SizeClass(addr);
+  if (size_class == 0) return false;
+  const ClassRegions::Layout& l = ClassRegions::layout(size_class);
+  ASSERT(n.in_bytes() == l.span_bytes);
+  (void)n;
+
+  Region* r = regions_[size_class];
+  const HugePage hp = HugePageContaining(p);
+  Tracker* t = r->trackers[(hp - FirstHugePage(size_class)).raw_num()];
+  ASSERT(t != nullptr);
+  const size_t slot = (p - hp.first_page()).in_bytes() / l.span_bytes;
+  ASSERT(t->used.GetBit(slot));
+  t->used.ClearBit(slot);
+  if (t->nused-- == l.spans) r->partial.prepend(t);
+  --r->spans;
+  if (t->nused != 0) return true;
+
+  r->partial.remove(t);
+  if (r->spare == nullptr) {
+    r->spare = t;
+  } else {
+    Release(size_class, r, t);
+  }
+  return true;
+}
+
+void ClassRegionAllocator::Release(size_t size_class, Region* r, Tracker* t) {
+  const HugePage hp = t->location;
+  r->trackers[(hp - FirstHugePage(size_class)).raw_num()] = nullptr;
+  --r->hugepages;
+  tracker_allocator_.Delete(t);
+  // Nothing can take the hugepage while it is in no list, so it goes back
+  // to the free map only once it is unbacked.
+  unback_(hp.start_addr(), kHugePageSize);
+  r->free.Insert(HugeRange::Make(hp, NHugePages(1)));
+}
+
+Length ClassRegionAllocator::ReleaseSpares() {
+  Length released;
+  for (size_t size_class = 1; size_class < ClassRegions::kRegions;
+       ++size_class) {
+    Region* r = regions_[size_class];
+    if (r == nullptr || r->spare == nullptr) continue;
+    Tracker* t = r->spare;
+    r->spare = nullptr;
+    Release(size_class, r, t);
+    released += kPagesPerHugePage;
+  }
+  return released;
+}
+
+BackingStats ClassRegionAllocator::stats() const {
+  BackingStats s;
+  for (size_t size_class = 1; size_class < ClassRegions::kRegions;
+       ++size_class) {
+    const Region* r = regions_[size_class];
+    if (r == nullptr) continue;
+    const size_t backed = r->hugepages * kHugePageSize;
+    s.system_bytes += backed;
+    s.free_bytes +=
+        backed - r->spans * ClassRegions::layout(size_class).span_bytes;
+  }
+  return s;
+}
+
+void ClassRegionAllocator::Print(Printer* out) const {
+  if (!enabled_) return;
+  out->printf("HugePageAware: class regions at %p\n",
+              reinterpret_cast<void*>(ClassRegions::base()));
+  for (size_t size_class = 1; size_class < ClassRegions::kRegions;
+       ++size_class) {
+    const Region* r = regions_[size_class];
+    if (r == nullptr) continue;
+    out->printf(
+        "HugePageAware: class %3zu region: %6zu spans on %6zu hugepages, "
+        "spare %d\n",
+        size_class, r->spans, r->hugepages, r->spare != nullptr ? 1 : 0);
+  }
+}
+
+void ClassRegionAllocator::PrintInPbtxt(PbtxtRegion* hpaa) const {
+  if (!enabled_) return;
+  for (size_t size_class = 1; size_class < ClassRegions::kRegions;
+       ++size_class) {
+    const Region* r = regions_[size_class];
+    if (r == nullptr) continue;
+    auto c = hpaa->CreateSubRegion("class_region");
+    c.PrintI64("sizeclass", size_class);
+    c.PrintI64("spans", r->spans);
+    c.PrintI64("hugepages", r->hugepages);
+    c.PrintBool("spare", r->spare != nullptr);
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
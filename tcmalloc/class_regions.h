@@ -0,0 +1,232 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Size-class-segregated address ranges for the small spans of normal memory
+// (CLASS_REGIONS).
+
+#ifndef TCMALLOC_CLASS_REGIONS_H_
+#define TCMALLOC_CLASS_REGIONS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/numeric/bits.h"
+#include "absl/numeric/int128.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/huge_address_map.h"
+#include "tcmalloc/huge_pages.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/linked_list.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/range_tracker.h"
+#include "tcmalloc/page_heap_allocator.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/stats.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// With CLASS_REGIONS, the system allocator reserves kBytes of normal tagged
+// address space up front, and every base size class owns the kRegionBytes
+// of it at base + size_class * kRegionBytes.  A class's spans are laid out
+// at fixed slots of the hugepages of its region: slot i of a hugepage starts
+// i * span_bytes into it, and its objects follow from the slot start.  The
+// size class and the chunk of an address are then pure functions of its
+// offset in the reservation: a subtract and a shift pick the class, and two
+// multiply-high divides by constants of the class find the slot and the
+// object.  The only memory read is the class's Layout, which never changes
+// once the reservation is published, so a bounds check reads neither the
+// page map nor a Span.
+//
+// The address bits cannot tell a live span from a free slot, so a free of
+// an address in a region still checks its page map size class.  Classes
+// whose spans leave too much of a hugepage unused get no slots, and their
+// addresses, like those outside the reservation, miss here.
+class ClassRegions {
+ public:
+  static constexpr int kRegionShift = 31;
+  static constexpr size_t kRegionBytes = size_t{1} << kRegionShift;
+  static constexpr size_t kRegions = kNumBaseClasses;
+  static constexpr size_t kBytes = kRegionBytes * kRegions;
+  static constexpr size_t kHugePagesPerRegion = kRegionBytes / kHugePageSize;
+  static_assert(absl::bit_width(kBytes - 1) < kTagShift,
+                "the reservation must have one tag");
+
+  // The geometry of the spans of one class; spans is 0 for a class without
+  // slots.  The magics are ceil(2^64 / divisor), as in SizeMap.
+  struct Layout {
+    uint32_t size;
+    uint32_t objects;
+    uint32_t span_bytes;
+    uint32_t spans;
+    uint64_t size_magic;
+    uint64_t span_magic;
+  };
+
+  // Returns the region of addr, kRegions or more outside the reservation.
+  // No locks required.
+  static size_t ABSL_ATTRIBUTE_ALWAYS_INLINE Region(uintptr_t addr) {
+    return (addr - base_.load(std::memory_order_relaxed)) >> kRegionShift;
+  }
+
+  // Returns the size class of the region of addr, 0 outside the reservation.
+  static size_t ABSL_ATTRIBUTE_ALWAYS_INLINE SizeClass(uintptr_t addr) {
+    const size_t region = Region(addr);
+    return region < kRegions ? region : 0;
+  }
+
+  // Sets [*start, *end) to the chunk of the slot addr falls in, where addr
+  // lies in region < kRegions.  Returns false for the unused tail of a slot
+  // or of a hugepage, and for classes without slots.  The chunk need not be
+  // allocated.
+  static bool ABSL_ATTRIBUTE_ALWAYS_INLINE ChunkRange(uintptr_t addr,
+                                                      size_t region,
+                                                      uintptr_t* start,
+                                                      uintptr_t* end) {
+    ASSERT(region < kRegions);
+    const Layout& l = layout_[region];
+    const uintptr_t in_hugepage = addr & (kHugePageSize - 1);
+    const uintptr_t slot = Divide(in_hugepage, l.span_magic);
+    const uintptr_t in_span = in_hugepage - slot * l.span_bytes;
+    const uintptr_t object = Divide(in_span, l.size_magic);
+    if (ABSL_PREDICT_FALSE(slot >= l.spans || object >= l.objects)) {
+      return false;
+    }
+    *start = addr - in_span + object * l.size;
+    *end = *start + l.size;
+    return true;
+  }
+
+  static const Layout& layout(size_t size_class) {
+    ASSERT(size_class < kRegions);
+    return layout_[size_class];
+  }
+
+  // Reserves the regions and sets the layouts from the size map.  Returns
+  // true for the one caller whose allocator hands the regions out, and false
+  // for every other one or if the reservation failed.
+  // REQUIRES: the size map is initialized.
+  static bool Init();
+
+  // First byte of the reservation; a non-canonical address if there is none,
+  // so every lookup misses.
+  static uintptr_t base() { return base_.load(std::memory_order_relaxed); }
+
+ private:
+  // x / d for the magic of d, exact for x and d below 2^32.
+  static uintptr_t ABSL_ATTRIBUTE_ALWAYS_INLINE Divide(uintptr_t x,
+                                                       uint64_t magic) {
+    return absl::Uint128High64(absl::uint128(magic) * x);
+  }
+
+  ABSL_CONST_INIT static std::atomic<uintptr_t> base_;
+  ABSL_CONST_INIT static std::atomic<bool> claimed_;
+  // Written before base_ is published, and only read for regions in range.
+  ABSL_CONST_INIT static Layout layout_[kRegions];
+};
+
+// Hands out the slots of the class regions to the page heap of normal
+// memory.  A region's hugepages are taken lowest first from a
+// HugeAddressMap of the ones not in use, each with a Tracker of its used
+// slots; a hugepage whose last span is freed stays backed as the class's
+// spare while it has none, and is released back to the map otherwise.
+class ClassRegionAllocator {
+ public:
+  using UnbackFunction = void (*)(void* start, size_t length);
+  using MetadataFunction = void* (*)(size_t bytes);
+
+  ClassRegionAllocator(UnbackFunction unback, MetadataFunction meta)
+      : unback_(unback), meta_(meta) {}
+
+  // Claims the regions, if this is the first allocator to ask.
+  // REQUIRES: pageheap_lock is held.
+  void Init(Arena* arena) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  bool enabled() const { return enabled_; }
+
+  // Returns the first page of a free slot of size_class for a span of n
+  // pages, or PageId{0} if the class has no slots or its region is full.
+  // Sets *from_released if the slot's hugepage was not backed.
+  PageId Get(size_t size_class, Length n, bool* from_released)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Returns the slot of the span [p, p + n) and true if it came from Get(),
+  // false otherwise.  May drop pageheap_lock to release a hugepage.
+  bool MaybePut(PageId p, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Releases the spare hugepages and returns how many pages that was.
+  Length ReleaseSpares() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  BackingStats stats() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  void Print(Printer* out) const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  void PrintInPbtxt(PbtxtRegion* hpaa) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+ private:
+  static constexpr size_t kMaxSlots = kPagesPerHugePage.raw_num();
+
+  struct Tracker : public TList<Tracker>::Elem {
+    HugePage location;
+    Bitmap<kMaxSlots> used;
+    size_t nused;
+  };
+
+  struct Region {
+    explicit Region(MetadataFunction meta) : free(meta) {}
+
+    HugeAddressMap free;
+    // Hugepages with both used and free slots.
+    TList<Tracker> partial;
+    // An empty hugepage kept backed, or nullptr.
+    Tracker* spare = nullptr;
+    // One per hugepage of the region, nullptr for those in free.
+    Tracker* trackers[ClassRegions::kHugePagesPerRegion] = {};
+    size_t spans = 0;
+    size_t hugepages = 0;
+  };
+
+  static HugePage FirstHugePage(size_t size_class) {
+    return HugePageContaining(reinterpret_cast<void*>(
+        ClassRegions::base() + size_class * ClassRegions::kRegionBytes));
+  }
+
+  // Returns the region of size_class, set up on first use.
+  Region* GetRegion(size_t size_class)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Unbacks the empty hugepage of t, which must not be the spare, and
+  // returns it to the free map.
+  void Release(size_t size_class, Region* r, Tracker* t)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  UnbackFunction unback_;
+  MetadataFunction meta_;
+  bool enabled_ = false;
+  PageHeapAllocator<Tracker> tracker_allocator_;
+  Region* regions_[ClassRegions::kRegions] = {};
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_CLASS_REGIONS_H_
@@ -16,6 +16,8 @@
 
 #include <algorithm>
 
+#include "absl/numeric/bits.h"
+
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/optimization.h"
@@ -103,12 +105,15 @@ void SizeMap::SetSizeClasses(int num_classes, const SizeClassInfo* parsed) {
   CHECK_CONDITION(ValidSizeClasses(num_classes, parsed));
 
   class_to_size_[0] = 0;
+  class_to_magic_[0] = 0;
   class_to_pages_[0] = 0;
   num_objects_to_move_[0] = 0;
 
   int curr = 1;
   for (int c = 1; c < num_classes; c++) {
     class_to_size_[curr] = parsed[c].size;
+    // ceil(2^64 / size); sizes are at least 8, so this does not overflow.
+    class_to_magic_[curr] = ~uint64_t{0} / parsed[c].size + 1;
     class_to_pages_[curr] = parsed[c].pages;
     num_objects_to_move_[curr] = parsed[c].num_to_move;
     ++curr;
@@ -117,18 +122,38 @@ void SizeMap::SetSizeClasses(int num_classes, const SizeClassInfo* parsed) {
   // Fill any unspecified size classes with 0.
   for (int x = curr; x < kNumBaseClasses; x++) {
     class_to_size_[x] = 0;
+    class_to_magic_[x] = 0;
     class_to_pages_[x] = 0;
     num_objects_to_move_[x] = 0;
   }
 
-  // Copy selected size classes into the upper registers.
-  for (int i = 1; i < (kNumClasses / kNumBaseClasses); i++) {
-    std::copy(&class_to_size_[0], &class_to_size_[kNumBaseClasses],
-              &class_to_size_[kNumBaseClasses * i]);
-    std::copy(&class_to_pages_[0], &class_to_pages_[kNumBaseClasses],
-              &class_to_pages_[kNumBaseClasses * i]);
-    std::copy(&num_objects_to_move_[0], &num_objects_to_move_[kNumBaseClasses],
-              &num_objects_to_move_[kNumBaseClasses * i]);
+  // Copy selected size classes into the upper registers.  The pointer-free
+  // register may hold only the first kNumPointerFreeClasses of them.
+  for (size_t start = kNumBaseClasses; start < kNumClasses;
+       start += kNumBaseClasses) {
+    const size_t n = std::min(kNumBaseClasses, kNumClasses - start);
+    std::copy(&class_to_size_[0], &class_to_size_[n], &class_to_size_[start]);
+    std::copy(&class_to_magic_[0], &class_to_magic_[n],
+              &class_to_magic_[start]);
+    std::copy(&class_to_pages_[0], &class_to_pages_[n],
+              &class_to_pages_[start]);
+    std::copy(&num_objects_to_move_[0], &num_objects_to_move_[n],
+              &num_objects_to_move_[start]);
+  }
+
+  for (size_t c = 0; c < kNumClasses; c++) {
+    const uint32_t size = class_to_size_[c];
+    ClassCheckInfo& info = class_check_info_[c];
+    info = {};
+    info.size = size;
+    info.reciprocal = class_to_magic_[c];
+    if (size != 0 && absl::has_single_bit(size)) {
+      info.shift = absl::countr_zero(size);
+      info.flags |= ClassCheckInfo::kPow2;
+    }
+    if (IsPointerFreeSizeClass(c)) {
+      info.flags |= ClassCheckInfo::kPointerFree;
+    }
   }
 }
 
@@ -183,7 +208,22 @@ void SizeMap::Init() {
   }
 
   static_assert(kAlignment <= 16, "kAlignment is too large");
-
+  static_assert(FlatClassIndex(kMaxSmallSize) == 128 &&
+                    FlatClassIndex(kMaxSmallSize + 1) == 129,
+                "class_array_ halves do not meet at kMaxSmallSize");
+  static_assert(FlatClassIndex(kMaxSize) == kClassArraySize - 1,
+                "class_array_ does not end at kMaxSize");
+
+#ifdef POW2_SIZE_CLASSES
+  // Bounds checks find the chunk with a mask instead of a multiply, see
+  // InlineChunkRange().
+  SetSizeClasses(kExperimentalPow2SizeClassesCount,
+                 kExperimentalPow2SizeClasses);
+  for (int c = 1; c < kNumClasses; c++) {
+    CHECK_CONDITION(absl::has_single_bit(class_to_size_[c]) ||
+                    class_to_size_[c] == 0);
+  }
+#else
   if (IsExperimentActive(Experiment::TEST_ONLY_TCMALLOC_POW2_SIZECLASS)) {
     SetSizeClasses(kExperimentalPow2SizeClassesCount,
                    kExperimentalPow2SizeClasses);
@@ -198,8 +238,18 @@ void SizeMap::Init() {
     SetSizeClasses(kExperimentalCFLAwareSizeClassesCount,
                    kExperimentalCFLAwareSizeClasses);
   } else {
+#if defined(PROFILED_SIZE_CLASSES)
+    // Classes fitted to a heap profile, see size_class_generator.h.
+    SetSizeClasses(kProfiledSizeClassesCount, kProfiledSizeClasses);
+#elif defined(PROTECTION_SIZE_CLASSES)
+    // Classes that a power of two still fits in with the padding byte, see
+    // protection_size_classes.cc.
+    SetSizeClasses(kProtectionSizeClassesCount, kProtectionSizeClasses);
+#else
     SetSizeClasses(kSizeClassesCount, kSizeClasses);
+#endif
   }
+#endif
 
   int next_size = 0;
   for (int c = 1; c < kNumClasses; c++) {
@@ -30,6 +30,7 @@
 #include "absl/base/macros.h"
 #include "absl/base/optimization.h"
 #include "absl/numeric/bits.h"
+#include "absl/numeric/int128.h"
 #include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 #include "tcmalloc/experiment.h"
@@ -84,6 +85,7 @@ static_assert(sizeof(void*) == 8);
 //
 //   kPageShift - Shift amount used to compute the page size.
 //   kNumBaseClasses - Number of size classes serviced by bucket allocators
+//     (PROTECTION_SIZE_CLASSES adds the classes of protection_size_classes.cc)
 //   kMaxSize - Maximum size serviced by bucket allocators (thread/cpu/central)
 //   kMinThreadCacheSize - The minimum size in bytes of each ThreadCache.
 //   kMaxThreadCacheSize - The maximum size in bytes of each ThreadCache.
@@ -113,7 +115,11 @@ static_assert(sizeof(void*) == 8);
 
 #if TCMALLOC_PAGE_SHIFT == 12
 inline constexpr size_t kPageShift = 12;
+#ifdef PROTECTION_SIZE_CLASSES
+inline constexpr size_t kNumBaseClasses = 47;
+#else
 inline constexpr size_t kNumBaseClasses = 46;
+#endif
 inline constexpr bool kHasExpandedClasses = false;
 inline constexpr size_t kMaxSize = 8 << 10;
 inline constexpr size_t kMinThreadCacheSize = 4 * 1024;
@@ -125,7 +131,11 @@ inline constexpr size_t kDefaultProfileSamplingRate = 1 << 19;
 inline constexpr size_t kMinPages = 2;
 #elif TCMALLOC_PAGE_SHIFT == 15
 inline constexpr size_t kPageShift = 15;
+#ifdef PROTECTION_SIZE_CLASSES
+inline constexpr size_t kNumBaseClasses = 80;
+#else
 inline constexpr size_t kNumBaseClasses = 78;
+#endif
 inline constexpr bool kHasExpandedClasses = true;
 inline constexpr size_t kMaxSize = 256 * 1024;
 inline constexpr size_t kMinThreadCacheSize = kMaxSize * 2;
@@ -138,7 +148,11 @@ inline constexpr size_t kDefaultProfileSamplingRate = 1 << 21;
 inline constexpr size_t kMinPages = 8;
 #elif TCMALLOC_PAGE_SHIFT == 18
 inline constexpr size_t kPageShift = 18;
+#ifdef PROTECTION_SIZE_CLASSES
+inline constexpr size_t kNumBaseClasses = 92;
+#else
 inline constexpr size_t kNumBaseClasses = 89;
+#endif
 inline constexpr bool kHasExpandedClasses = true;
 inline constexpr size_t kMaxSize = 256 * 1024;
 inline constexpr size_t kMinThreadCacheSize = kMaxSize * 2;
@@ -151,7 +165,11 @@ inline constexpr size_t kDefaultProfileSamplingRate = 1 << 21;
 inline constexpr size_t kMinPages = 8;
 #elif TCMALLOC_PAGE_SHIFT == 13
 inline constexpr size_t kPageShift = 13;
+#ifdef PROTECTION_SIZE_CLASSES
+inline constexpr size_t kNumBaseClasses = 89;
+#else
 inline constexpr size_t kNumBaseClasses = 86;
+#endif
 inline constexpr bool kHasExpandedClasses = true;
 inline constexpr size_t kMaxSize = 256 * 1024;
 inline constexpr size_t kMinThreadCacheSize = kMaxSize * 2;
@@ -177,11 +195,25 @@ inline constexpr size_t kNumaPartitions = 1;
 #endif
 
 // We have copies of kNumBaseClasses size classes for each NUMA node, followed
-// by any expanded classes.
+// by any expanded classes, then by the pointer-free classes.
 inline constexpr size_t kExpandedClassesStart =
     kNumBaseClasses * kNumaPartitions;
-inline constexpr size_t kNumClasses =
+inline constexpr size_t kPointerFreeClassesStart =
     kExpandedClassesStart + (kHasExpandedClasses ? kNumBaseClasses : 0);
+// Pointer-free classes copy the base classes, as many of them as a
+// CompactSizeClass of one byte can still tell apart; the PageMap packs a
+// size class in the low byte of a page's word.  Their spans are marked
+// Span::pointer_free(), and escapes into them are not tracked.
+#ifdef POINTER_FREE_CLASSES
+inline constexpr size_t kNumPointerFreeClasses =
+    kPointerFreeClassesStart < 255
+        ? std::min<size_t>(kNumBaseClasses, 255 - kPointerFreeClassesStart)
+        : 0;
+#else
+inline constexpr size_t kNumPointerFreeClasses = 0;
+#endif
+inline constexpr size_t kNumClasses =
+    kPointerFreeClassesStart + kNumPointerFreeClasses;
 
 // Size classes are often stored as uint32_t values, but there are some
 // situations where we need to store a size class with as compact a
@@ -196,6 +228,17 @@ using CompactSizeClass =
 // ~64K classes ought to be enough for anybody, but let's be sure.
 static_assert(kMaxClass <= std::numeric_limits<CompactSizeClass>::max());
 
+// The byte ENABLE_PROTECTION adds to every request, which the caller must not
+// use.  Every size reported back, from nallocx(), malloc_usable_size(),
+// GetAllocatedSize() and size-returning operator new alike, leaves it out, and
+// sized frees add it back, so a container may use and free the whole
+// capacity it is given.
+#ifdef ENABLE_PROTECTION
+inline constexpr size_t kPaddingBytes = 1;
+#else
+inline constexpr size_t kPaddingBytes = 0;
+#endif
+
 // Minimum/maximum number of batches in TransferCache per size class.
 // Actual numbers depends on a number of factors, see TransferCache::Init
 // for details.
@@ -293,7 +336,12 @@ inline MemoryTag GetMemoryTag(const void* ptr) {
 absl::string_view MemoryTagToLabel(MemoryTag tag);
 
 inline constexpr bool IsExpandedSizeClass(unsigned size_class) {
-  return kHasExpandedClasses && (size_class >= kExpandedClassesStart);
+  return kHasExpandedClasses && (size_class >= kExpandedClassesStart) &&
+         (size_class < kPointerFreeClassesStart);
+}
+
+inline constexpr bool IsPointerFreeSizeClass(unsigned size_class) {
+  return kNumPointerFreeClasses > 0 && size_class >= kPointerFreeClassesStart;
 }
 
 #if !defined(TCMALLOC_SMALL_BUT_SLOW) && __SIZEOF_POINTER__ != 4
@@ -357,6 +405,26 @@ inline size_t NumaPartitionFromPointer(void* ptr) {
   }
 }
 
+// What an inlined bounds check needs to know about one size class, in a
+// single 16 byte record so a check loads one struct instead of indexing two
+// SizeMap tables.  TCMallocClassCheckInfo in inline_check.h is the same
+// layout for C callers.
+struct ClassCheckInfo {
+  // The class has objects of a power of two size.
+  static constexpr uint8_t kPow2 = 1;
+  // The class is a pointer-free copy, see IsPointerFreeSizeClass().
+  static constexpr uint8_t kPointerFree = 2;
+
+  uint32_t size;
+  // log2(size) for kPow2 classes, 0 otherwise.
+  uint8_t shift;
+  uint8_t flags;
+  uint16_t reserved;
+  // ceil(2^64 / size), like SizeMap::DivideBySizeClass().
+  uint64_t reciprocal;
+};
+static_assert(sizeof(ClassCheckInfo) == 16);
+
 // Size-class information + mapping
 class SizeMap {
  public:
@@ -412,19 +480,26 @@ class SizeMap {
   // per-thread free list until the scavenger cleans up the list.
   BatchSize num_objects_to_move_[kNumClasses] = {0};
 
+  // Index of the class_array_ entry for a size s <= kMaxSize.  Both halves
+  // of the table share one expression whose bias and shift are selected by
+  // the comparison, which compiles to conditional moves, so a mix of small
+  // and large requests (and the padding byte of ENABLE_PROTECTION pushing an
+  // exact 1024 over the boundary) costs no mispredicted branch.
+  static constexpr uint32_t FlatClassIndex(uint32_t s) {
+    const bool small = s <= kMaxSmallSize;
+    return (s + (small ? 7 : 127 + (120 << 7))) >> (small ? 3 : 7);
+  }
+
   // If size is no more than kMaxSize, compute index of the
   // class_array[] entry for it, putting the class index in output
   // parameter idx and returning true. Otherwise return false.
   static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE
   ClassIndexMaybe(size_t s, uint32_t* idx) {
-    if (ABSL_PREDICT_TRUE(s <= kMaxSmallSize)) {
-      *idx = (static_cast<uint32_t>(s) + 7) >> 3;
-      return true;
-    } else if (s <= kMaxSize) {
-      *idx = (static_cast<uint32_t>(s) + 127 + (120 << 7)) >> 7;
-      return true;
+    if (ABSL_PREDICT_FALSE(s > kMaxSize)) {
+      return false;
     }
-    return false;
+    *idx = FlatClassIndex(static_cast<uint32_t>(s));
+    return true;
   }
 
   static inline size_t ClassIndex(size_t s) {
@@ -439,6 +514,15 @@ class SizeMap {
   // Mapping from size class to max size storable in that class
   uint32_t class_to_size_[kNumClasses] = {0};
 
+  // Mapping from size class to ceil(2^64 / class_to_size_), see
+  // DivideBySizeClass().
+  uint64_t class_to_magic_[kNumClasses] = {0};
+
+  // The three tables above folded per class for generated check code.
+  ABSL_CACHELINE_ALIGNED ClassCheckInfo class_check_info_[kNumClasses] = {};
+
+  friend struct InlineCheckLayout;
+
  protected:
   // Set the give size classes to be used by TCMalloc.
   void SetSizeClasses(int num_classes, const SizeClassInfo* parsed);
@@ -456,10 +540,21 @@ class SizeMap {
   static const SizeClassInfo kExperimentalPow2SizeClasses[];
   static const int kExperimentalPow2SizeClassesCount;
 
+  // Definition of size class that is set in protection_size_classes.cc
+  static const SizeClassInfo kProtectionSizeClasses[];
+  static const int kProtectionSizeClassesCount;
+
   // kExperimentalCFLAwareSizeClassesCount
   static const SizeClassInfo kExperimentalCFLAwareSizeClasses[];
   static const int kExperimentalCFLAwareSizeClassesCount;
 
+#ifdef PROFILED_SIZE_CLASSES
+  // Definition of size class that size_class_generator writes to
+  // profiled_size_classes.cc
+  static const SizeClassInfo kProfiledSizeClasses[];
+  static const int kProfiledSizeClassesCount;
+#endif
+
   size_t cold_sizes_[12] = {0};
   size_t cold_sizes_count_ = 0;
 
@@ -543,6 +638,23 @@ class SizeMap {
     return class_to_size_[size_class];
   }
 
+  // Returns offset / class_to_size(size_class) without a divide, using the
+  // multiply-high trick of Lemire et al., "Faster Remainder by Direct
+  // Computation": for 32-bit offset and size, the high half of
+  // offset * ceil(2^64 / size) is the exact quotient.  Offsets into a span
+  // of small objects are far below 2^32, so no extra shift is needed.
+  // REQUIRES: size_class != 0, offset < 2^32.
+  inline size_t ABSL_ATTRIBUTE_ALWAYS_INLINE
+  DivideBySizeClass(size_t offset, size_t size_class) {
+    ASSERT(size_class != 0 && size_class < kNumClasses);
+    ASSERT(offset <= std::numeric_limits<uint32_t>::max());
+    return absl::Uint128High64(absl::uint128(class_to_magic_[size_class]) *
+                               offset);
+  }
+
+  // One record per size class, kNumClasses of them, for inlined checks.
+  const ClassCheckInfo* class_check_info() const { return class_check_info_; }
+
   // Mapping from size class to number of pages to allocate at a time
   inline size_t class_to_pages(size_t size_class) {
     ASSERT(size_class < kNumClasses);
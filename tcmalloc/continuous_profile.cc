@@ -0,0 +1,187 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/continuous_profile.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/time/clock.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT std::atomic<bool> ContinuousProfiler::active_(false);
+ABSL_CONST_INIT std::atomic<int> ContinuousProfiler::current_(0);
+ContinuousProfiler::Interval ContinuousProfiler::intervals_[2];
+
+namespace {
+
+// Guards the sink and the start of the current interval.  Held while the
+// sink runs, so Stop() returns only once the sink is done with its last
+// profile.
+ABSL_CONST_INIT absl::base_internal::SpinLock sink_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+MallocExtension::ContinuousProfileSink* sink ABSL_GUARDED_BY(sink_lock);
+absl::Time interval_start ABSL_GUARDED_BY(sink_lock);
+absl::Time retired_start ABSL_GUARDED_BY(sink_lock);
+
+}  // namespace
+
+uint64_t ContinuousProfiler::StackId(const StackTrace& t) {
+  uint64_t h = t.depth;
+  for (int i = 0; i < t.depth; ++i) {
+    h = (h ^ reinterpret_cast<uintptr_t>(t.stack[i])) * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+ContinuousProfiler::Slot* ContinuousProfiler::FindSlot(Interval& interval,
+                                                       const StackTrace& t) {
+  const uint64_t key = StackId(t) | 1;
+  size_t i = key >> 32;
+  for (size_t probe = 0; probe < kMaxProbes; ++probe, ++i) {
+    Slot& slot = interval.slots[i % kSlots];
+    uint64_t cur = slot.key.load(std::memory_order_relaxed);
+    if (cur == 0 &&
+        slot.key.compare_exchange_strong(cur, key, std::memory_order_relaxed)) {
+      const int depth = std::min<int>(t.depth, kMaxFrames);
+      memcpy(slot.stack, t.stack, depth * sizeof(slot.stack[0]));
+      slot.depth.store(depth, std::memory_order_release);
+      return &slot;
+    }
+    if (cur == key) return &slot;
+  }
+  interval.dropped.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+void ContinuousProfiler::RecordSlow(const StackTrace& t, double estimate,
+                                    bool is_free) {
+  Interval& interval = intervals_[current_.load(std::memory_order_relaxed)];
+  Slot* slot = FindSlot(interval, t);
+  if (slot == nullptr) return;
+  const uint64_t count = estimate * kCountScale + 0.5;
+  const uint64_t bytes = estimate * t.requested_size + 0.5;
+  if (is_free) {
+    slot->frees.fetch_add(count, std::memory_order_relaxed);
+    slot->free_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  } else {
+    slot->allocs.fetch_add(count, std::memory_order_relaxed);
+    slot->alloc_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+}
+
+void ContinuousProfiler::Clear(Interval& interval) {
+  for (Slot& slot : interval.slots) {
+    slot.allocs.store(0, std::memory_order_relaxed);
+    slot.frees.store(0, std::memory_order_relaxed);
+    slot.alloc_bytes.store(0, std::memory_order_relaxed);
+    slot.free_bytes.store(0, std::memory_order_relaxed);
+    slot.escapes.store(0, std::memory_order_relaxed);
+    slot.depth.store(0, std::memory_order_relaxed);
+    slot.key.store(0, std::memory_order_relaxed);
+  }
+  interval.dropped.store(0, std::memory_order_relaxed);
+}
+
+bool ContinuousProfiler::Rotate() {
+  if (!active()) return false;
+  absl::base_internal::SpinLockHolder h(&sink_lock);
+  if (sink == nullptr) return false;
+  current_.store(1 - current_.load(std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+  retired_start = interval_start;
+  interval_start = absl::Now();
+  return true;
+}
+
+void ContinuousProfiler::RecordEscapes(const StackTrace& t, uint64_t escapes) {
+  Interval& interval =
+      intervals_[1 - current_.load(std::memory_order_relaxed)];
+  if (Slot* slot = FindSlot(interval, t)) {
+    slot->escapes.fetch_add(escapes, std::memory_order_relaxed);
+  }
+}
+
+void ContinuousProfiler::Emit() {
+  Interval& interval =
+      intervals_[1 - current_.load(std::memory_order_relaxed)];
+  MallocExtension::ContinuousProfile profile;
+  // Samples still being added by threads that read current_ before Rotate()
+  // may be cleared below without being counted; the next interval is not
+  // affected.
+  for (Slot& slot : interval.slots) {
+    const uint64_t key = slot.key.load(std::memory_order_relaxed);
+    if (key == 0) continue;
+    MallocExtension::ContinuousProfile::Entry e;
+    e.stack_id = key;
+    const int depth = slot.depth.load(std::memory_order_acquire);
+    e.stack.assign(slot.stack, slot.stack + depth);
+    e.allocs = slot.allocs.load(std::memory_order_relaxed) / kCountScale;
+    e.frees = slot.frees.load(std::memory_order_relaxed) / kCountScale;
+    e.alloc_bytes = slot.alloc_bytes.load(std::memory_order_relaxed);
+    e.free_bytes = slot.free_bytes.load(std::memory_order_relaxed);
+    e.escapes = slot.escapes.load(std::memory_order_relaxed);
+    profile.entries.push_back(std::move(e));
+  }
+  profile.dropped = interval.dropped.load(std::memory_order_relaxed);
+  Clear(interval);
+
+  absl::base_internal::SpinLockHolder h(&sink_lock);
+  if (sink == nullptr) return;
+  profile.start = retired_start;
+  profile.duration = interval_start - retired_start;
+  (*sink)(profile);
+}
+
+void ContinuousProfiler::Start(MallocExtension::ContinuousProfileSink s) {
+  auto* fresh = new MallocExtension::ContinuousProfileSink(std::move(s));
+  MallocExtension::ContinuousProfileSink* old;
+  {
+    absl::base_internal::SpinLockHolder h(&sink_lock);
+    old = sink;
+    sink = fresh;
+    if (old == nullptr) {
+      // Drop what the tables kept from before the last Stop().
+      Clear(intervals_[0]);
+      Clear(intervals_[1]);
+      interval_start = absl::Now();
+    }
+    active_.store(true, std::memory_order_relaxed);
+  }
+  delete old;
+}
+
+void ContinuousProfiler::Stop() {
+  MallocExtension::ContinuousProfileSink* old;
+  {
+    absl::base_internal::SpinLockHolder h(&sink_lock);
+    active_.store(false, std::memory_order_relaxed);
+    old = sink;
+    sink = nullptr;
+  }
+  delete old;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,123 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Per-second deltas of the sampled allocations and frees, per allocation
+// stack (CONTINUOUS_PROFILE).
+//
+// The heap and allocation profiles answer for a window chosen up front.  With
+// CONTINUOUS_PROFILE the sampled allocations and frees also land in one of
+// two fixed size interval tables, keyed by a hash of the allocation stack.
+// Every kPeriod the background thread retires the current table, switches
+// recording to the other one, and hands what the retired table holds to the
+// sink installed by MallocExtension::StartContinuousProfile().  Recording
+// takes no lock: a stack claims a slot with a compare-and-swap on its key and
+// then only adds to its counters.  Samples whose stack finds no free slot
+// within kMaxProbes are only counted as dropped.
+
+#ifndef TCMALLOC_CONTINUOUS_PROFILE_H_
+#define TCMALLOC_CONTINUOUS_PROFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+class ContinuousProfiler {
+ public:
+  static constexpr absl::Duration kPeriod = absl::Seconds(1);
+  static constexpr size_t kSlots = 512;
+  static constexpr size_t kMaxProbes = 16;
+  // Frames kept per stack; the stack id still covers all of them.
+  static constexpr int kMaxFrames = 32;
+
+  // Whether a sink is installed.  Nothing is recorded otherwise.
+  static bool active() { return active_.load(std::memory_order_relaxed); }
+
+  // Hash of t's frames, the stack id of its entries.
+  static uint64_t StackId(const StackTrace& t);
+
+  // Counts a sampled allocation or free standing for `estimate` objects of
+  // t.requested_size bytes, under the stack that allocated it.
+  static void RecordAlloc(const StackTrace& t, double estimate) {
+    Record(t, estimate, /*is_free=*/false);
+  }
+  static void RecordFree(const StackTrace& t, double estimate) {
+    Record(t, estimate, /*is_free=*/true);
+  }
+
+  // Switches recording to the other table.  Returns false, and switches
+  // nothing, if no sink is installed.
+  static bool Rotate();
+  // Adds the escapes recorded into a live sampled object of t to the table
+  // Rotate() just retired.
+  static void RecordEscapes(const StackTrace& t, uint64_t escapes);
+  // Hands the retired table to the sink and clears it for the next Rotate().
+  static void Emit();
+
+  static void Start(MallocExtension::ContinuousProfileSink sink);
+  static void Stop();
+
+ private:
+  // Counts are kept in 1/kCountScale of an object, since a sample of a large
+  // allocation stands for less than one.
+  static constexpr double kCountScale = 1 << 10;
+
+  // key is the stack id, or'ed with 1 so that 0 marks a free slot.  depth is
+  // stored with release once stack is written, and is 0 until then.
+  struct Slot {
+    std::atomic<uint64_t> key;
+    std::atomic<int> depth;
+    void* stack[kMaxFrames];
+    std::atomic<uint64_t> allocs;
+    std::atomic<uint64_t> frees;
+    std::atomic<uint64_t> alloc_bytes;
+    std::atomic<uint64_t> free_bytes;
+    std::atomic<uint64_t> escapes;
+  };
+  struct Interval {
+    Slot slots[kSlots];
+    std::atomic<uint64_t> dropped;
+  };
+
+  static void Record(const StackTrace& t, double estimate, bool is_free) {
+    if (ABSL_PREDICT_TRUE(!active())) return;
+    RecordSlow(t, estimate, is_free);
+  }
+  static void RecordSlow(const StackTrace& t, double estimate, bool is_free);
+  // Returns the slot of t in `interval`, claiming one if t has none yet, or
+  // nullptr if every slot it may use is taken.
+  static Slot* FindSlot(Interval& interval, const StackTrace& t);
+  static void Clear(Interval& interval);
+
+  ABSL_CONST_INIT static std::atomic<bool> active_;
+  ABSL_CONST_INIT static std::atomic<int> current_;
+  static Interval intervals_[2];
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_CONTINUOUS_PROFILE_H_
@@ -44,6 +44,9 @@ static void ActivatePerCpuCaches() {
 
   if (Parameters::per_cpu_caches() && subtle::percpu::IsFast()) {
     tc_globals.InitIfNecessary();
+#ifdef DEFERRED_TOPOLOGY
+    tc_globals.InitTopologyIfNecessary();
+#endif
     tc_globals.cpu_cache().Activate();
     tc_globals.ActivateCpuCache();
     // no need for this thread cache anymore, I guess.
@@ -33,6 +33,7 @@
 #include "absl/base/thread_annotations.h"
 #include "absl/container/fixed_array.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/escape_table.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/optimization.h"
 #include "tcmalloc/internal/percpu.h"
@@ -128,6 +129,41 @@ class StaticForwarder {
   static TransferCacheManager& transfer_cache() {
     return tc_globals.transfer_cache();
   }
+
+#ifdef ESCAPE_AWARE_RECLAIM
+  // Escape table bytes that the spans of <size_class> with fewer than four
+  // live objects would hold if all of them had a table: an upper bound, as
+  // the span utilization histogram does not tell spans with tables apart.
+  static size_t sparse_span_escape_bytes(int size_class) {
+    const size_t size = tc_globals.sizemap().class_to_size(size_class);
+    if (size == 0) return 0;
+    const size_t objects =
+        Length(tc_globals.sizemap().class_to_pages(size_class)).in_bytes() /
+        size;
+    const CentralFreeList& central_freelist =
+        tc_globals.transfer_cache().central_freelist(size_class);
+    const size_t spans =
+        central_freelist.NumSpansWith(1) + central_freelist.NumSpansWith(2);
+#ifdef SPARSE_ESCAPE_TABLES
+    // Spans this sparse start with a sparse table, and seldom overflow it.
+    if (objects > kSparseEscapeMinObjects) {
+      return spans * EscapeTableClassSize(EscapeTableClass(
+                         kSparseEscapeTableWords)) *
+             sizeof(EscapeHead);
+    }
+#endif
+    return spans * EscapeTableClassSize(EscapeTableClass(objects)) *
+           sizeof(EscapeHead);
+  }
+
+  // Returns <batch> to the spans it came from, passing over the transfer
+  // cache, which would keep the spans alive as well.
+  static void release_to_central_freelist(int size_class,
+                                          absl::Span<void*> batch) {
+    tc_globals.transfer_cache().central_freelist(size_class).InsertRange(
+        batch);
+  }
+#endif
 };
 
 template <typename NumaTopology>
@@ -228,6 +264,25 @@ class CpuCache {
   // Free an object of the given class.
   void Deallocate(void* ptr, size_t size_class);
 
+  // Allocates n objects of the given size class into batch.  As many as the
+  // current cpu's slab holds are popped in one restartable sequence, and the
+  // rest come from Allocate().  Returns the number of objects allocated,
+  // which is less than n only if OOMHandler returned nullptr.
+  template <void* OOMHandler(size_t)>
+  size_t AllocateBatch(size_t size_class, void** batch, size_t n);
+
+  // Frees the n objects of the given size class in batch.  As many as fit on
+  // the current cpu's slab are pushed in one restartable sequence, and the
+  // rest go through Deallocate().  The order of batch is not preserved.
+  void DeallocateBatch(size_t size_class, void** batch, size_t n);
+
+  // Stores in batch up to n objects the next Allocate()s of size_class on
+  // the current cpu would return, without taking them, and returns how many
+  // it stored.  They are hints for prefetching only.
+  size_t PeekAllocations(size_t size_class, void** batch, size_t n) {
+    return freelist_.PeekTop(size_class, batch, n);
+  }
+
   // Give the number of bytes in <cpu>'s cache
   uint64_t UsedBytes(int cpu) const;
 
@@ -267,10 +322,29 @@ class CpuCache {
   // ShuffleCpuCaches.
   void ShuffleCpuCaches();
 
+#ifdef ADAPTIVE_BATCH_SIZE
+  // Adapts the number of objects Refill() and Overflow() move per batch for
+  // every size class to the misses of the last interval: a class whose
+  // per-CPU caches keep underflowing and overflowing while the transfer cache
+  // serves them moves more objects per batch, and one whose batches mostly
+  // miss the transfer cache, so that they wait on the central free list,
+  // moves fewer.  Batches stay between a quarter of num_objects_to_move()
+  // and num_objects_to_move(), which is all the transfer cache takes at once.
+  // May be called from any processor.
+  void AdaptBatchLengths();
+#endif
+
+  // Returns the number of objects Refill() and Overflow() move per batch of
+  // <size_class>.
+  size_t BatchLength(size_t size_class) const;
+
   // Tries to reclaim inactive per-CPU caches. It iterates through the set of
   // populated cpu caches and reclaims the caches that:
   // (1) had same number of used bytes since the last interval,
   // (2) had no change in the number of misses since the last interval.
+  // With ESCAPE_AWARE_RECLAIM, a cache whose used bytes did not grow but that
+  // still missed is not reclaimed whole. Its size classes whose sparse spans
+  // may hold many escape table bytes are drained to the central freelist.
   void TryReclaimingCaches();
 
   // Empty out the cache on <cpu>; move all objects to the central
@@ -286,6 +360,14 @@ class CpuCache {
   // Reports total number of times any CPU has been reclaimed.
   uint64_t GetNumReclaims() const;
 
+#ifdef ESCAPE_AWARE_RECLAIM
+  // Reports the bytes TryReclaimingCaches() drained from size classes under
+  // escape metadata pressure.
+  uint64_t GetEscapeDrainedBytes() const {
+    return escape_drained_bytes_.load(std::memory_order_relaxed);
+  }
+#endif
+
   // When dynamic slab size is enabled, checks if there is a need to resize
   // the slab based on miss-counts and resizes if so.
   void ResizeSlabIfNeeded();
@@ -399,7 +481,21 @@ class CpuCache {
     std::atomic<uint64_t> reclaim_used_bytes;
     // Tracks number of times this CPU has been reclaimed.
     std::atomic<size_t> num_reclaims;
+#ifdef ADAPTIVE_BATCH_SIZE
+    // Tracks underflows and overflows by size class, for AdaptBatchLengths().
+    std::atomic<uint32_t> class_misses[kNumClasses];
+#endif
+  };
+
+#ifdef ADAPTIVE_BATCH_SIZE
+  struct BatchLengthInfo {
+    // 0 until AdaptBatchLengths() first changes it: num_objects_to_move().
+    std::atomic<uint32_t> batch_length;
+    // Misses as of the last AdaptBatchLengths(), which alone uses these.
+    uint32_t cpu_misses;
+    uint64_t transfer_cache_misses;
   };
+#endif
 
   struct DynamicSlabInfo {
     std::atomic<size_t> grow_count[kNumPossiblePerCpuShifts];
@@ -423,6 +519,14 @@ class CpuCache {
   // which CPU's list was full.  Returns 1.
   int Overflow(void* ptr, size_t size_class, int cpu);
 
+  // Move batches of <size_class> between the per-CPU caches and the transfer
+  // cache behind them: the L3 shard of the sharded transfer cache for the
+  // classes it shares_batches() of, so that a CPU refills from what its
+  // siblings overflowed without taking a global lock, else the global
+  // transfer cache.
+  int RemoveFromTransferCache(size_t size_class, void** batch, size_t n);
+  void InsertToTransferCache(size_t size_class, absl::Span<void*> batch);
+
   // Called on <size_class> freelist overflow/underflow on <cpu> to balance
   // cache capacity between size classes. Returns number of objects to
   // return/request from transfer cache. <to_return> will contain objects that
@@ -484,6 +588,18 @@ class CpuCache {
   TCMALLOC_NO_UNIQUE_ADDRESS Forwarder forwarder_;
 
   DynamicSlabInfo dynamic_slab_info_{};
+
+#ifdef ADAPTIVE_BATCH_SIZE
+  BatchLengthInfo batch_length_info_[kNumClasses] = {};
+#endif
+
+#ifdef ESCAPE_AWARE_RECLAIM
+  // Drains the size classes marked in <pressured> from <cpu>'s cache straight
+  // to the central freelist.
+  void DrainEscapePressure(int cpu, const bool* pressured);
+
+  std::atomic<uint64_t> escape_drained_bytes_{0};
+#endif
 };
 
 template <class Forwarder>
@@ -533,13 +649,40 @@ CpuCache<Forwarder>::Deallocate(void* ptr, size_t size_class) {
   freelist_.Push(size_class, ptr, Helper::Overflow, this);
 }
 
+template <class Forwarder>
+template <void* OOMHandler(size_t)>
+inline size_t CpuCache<Forwarder>::AllocateBatch(size_t size_class,
+                                                 void** batch, size_t n) {
+  ASSERT(size_class > 0);
+  if (n == 0) return 0;
+  size_t got = freelist_.PopBatch(size_class, batch, n);
+  for (; got < n; ++got) {
+    void* ret = Allocate<OOMHandler>(size_class);
+    if (ABSL_PREDICT_FALSE(ret == nullptr)) break;
+    batch[got] = ret;
+  }
+  return got;
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::DeallocateBatch(size_t size_class,
+                                                 void** batch, size_t n) {
+  ASSERT(size_class > 0);
+  if (n == 0) return;
+  // Objects the slab had no room for are left at the start of batch.
+  size_t left = n - freelist_.PushBatch(size_class, batch, n);
+  for (size_t i = 0; i < left; ++i) {
+    Deallocate(batch[i], size_class);
+  }
+}
+
 static cpu_set_t FillActiveCpuMask() {
   cpu_set_t allowed_cpus;
   if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) != 0) {
     CPU_ZERO(&allowed_cpus);
   }
 
-#ifdef PERCPU_USE_RSEQ
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
   const bool real_cpus = !subtle::percpu::UsingFlatVirtualCpus();
 #else
   const bool real_cpus = true;
@@ -590,6 +733,11 @@ inline size_t CpuCache<Forwarder>::MaxCapacity(size_t size_class) const {
 #endif
   if (size_class == 0 || size_class >= kNumClasses) return 0;
 
+  // There is no room left in the slab for the pointer-free classes; their
+  // objects are allocated from the transfer cache, and a free overflows
+  // straight back to it.
+  if (IsPointerFreeSizeClass(size_class)) return 0;
+
   if (forwarder_.sharded_transfer_cache().should_use(size_class)) {
     return 0;
   }
@@ -745,7 +893,11 @@ inline void CpuCache<Forwarder>::Deactivate() {
 // return memory to the correct CPU.)
 template <class Forwarder>
 inline void* CpuCache<Forwarder>::Refill(int cpu, size_t size_class) {
-  const size_t batch_length = forwarder_.num_objects_to_move(size_class);
+  const size_t batch_length = BatchLength(size_class);
+#ifdef ADAPTIVE_BATCH_SIZE
+  resize_[cpu].class_misses[size_class].fetch_add(1,
+                                                  std::memory_order_relaxed);
+#endif
 
   // UpdateCapacity can evict objects from other size classes as it tries to
   // increase capacity of this size class. The objects are returned in
@@ -765,7 +917,7 @@ inline void* CpuCache<Forwarder>::Refill(int cpu, size_t size_class) {
 
   do {
     const size_t want = std::min(batch_length, target - total);
-    got = forwarder_.transfer_cache().RemoveRange(size_class, batch, want);
+    got = RemoveFromTransferCache(size_class, batch, want);
     if (got == 0) {
       break;
     }
@@ -780,21 +932,41 @@ inline void* CpuCache<Forwarder>::Refill(int cpu, size_t size_class) {
       if (i != 0) {
         static_assert(ABSL_ARRAYSIZE(batch) >= kMaxObjectsToMove,
                       "not enough space in batch");
-        forwarder_.transfer_cache().InsertRange(size_class,
-                                                absl::Span<void*>(batch, i));
+        InsertToTransferCache(size_class, absl::Span<void*>(batch, i));
       }
     }
   } while (got == batch_length && i == 0 && total < target &&
            cpu == freelist_.GetCurrentVirtualCpuUnsafe());
 
   for (int i = to_return.count; i < kMaxToReturn; ++i) {
-    forwarder_.transfer_cache().InsertRange(
-        to_return.size_class[i], absl::Span<void*>(&(to_return.obj[i]), 1));
+    InsertToTransferCache(to_return.size_class[i],
+                          absl::Span<void*>(&(to_return.obj[i]), 1));
   }
 
   return result;
 }
 
+template <class Forwarder>
+inline int CpuCache<Forwarder>::RemoveFromTransferCache(size_t size_class,
+                                                        void** batch,
+                                                        size_t n) {
+  if (forwarder_.sharded_transfer_cache().shares_batches(size_class)) {
+    return forwarder_.sharded_transfer_cache().RemoveRange(size_class, batch,
+                                                           n);
+  }
+  return forwarder_.transfer_cache().RemoveRange(size_class, batch, n);
+}
+
+template <class Forwarder>
+inline void CpuCache<Forwarder>::InsertToTransferCache(
+    size_t size_class, absl::Span<void*> batch) {
+  if (forwarder_.sharded_transfer_cache().shares_batches(size_class)) {
+    forwarder_.sharded_transfer_cache().InsertRange(size_class, batch);
+    return;
+  }
+  forwarder_.transfer_cache().InsertRange(size_class, batch);
+}
+
 template <class Forwarder>
 inline size_t CpuCache<Forwarder>::UpdateCapacity(int cpu, size_t size_class,
                                                   size_t batch_length,
@@ -925,6 +1097,20 @@ template <class Forwarder>
 inline void CpuCache<Forwarder>::TryReclaimingCaches() {
   const int num_cpus = absl::base_internal::NumCPUs();
 
+#ifdef ESCAPE_AWARE_RECLAIM
+  // Objects cached per CPU keep their spans, and the spans' escape tables,
+  // alive.  A size class is drained once its spans with few live objects may
+  // hold this many table bytes.
+  static constexpr size_t kEscapePressureBytes = 64 << 10;
+  bool pressured[kNumClasses] = {};
+  bool any_pressured = false;
+  for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+    pressured[size_class] = forwarder_.sparse_span_escape_bytes(size_class) >=
+                            kEscapePressureBytes;
+    any_pressured |= pressured[size_class];
+  }
+#endif
+
   for (int cpu = 0; cpu < num_cpus; ++cpu) {
     // Nothing to reclaim if the cpu is not populated.
     if (!HasPopulated(cpu)) {
@@ -947,6 +1133,13 @@ inline void CpuCache<Forwarder>::TryReclaimingCaches() {
     if (used_bytes != 0 && used_bytes == prev_used_bytes && misses == 0) {
       Reclaim(cpu);
     }
+#ifdef ESCAPE_AWARE_RECLAIM
+    else if (any_pressured && used_bytes != 0 &&
+             used_bytes <= prev_used_bytes) {
+      DrainEscapePressure(cpu, pressured);
+      used_bytes = UsedBytes(cpu);
+    }
+#endif
 
     // Takes a snapshot of used bytes in the cache at the end of this interval
     // so that we can calculate if cache usage changed in the next interval.
@@ -1310,7 +1503,11 @@ inline size_t CpuCache<Forwarder>::Steal(int cpu, size_t dest_size_class,
 template <class Forwarder>
 inline int CpuCache<Forwarder>::Overflow(void* ptr, size_t size_class,
                                          int cpu) {
-  const size_t batch_length = forwarder_.num_objects_to_move(size_class);
+  const size_t batch_length = BatchLength(size_class);
+#ifdef ADAPTIVE_BATCH_SIZE
+  resize_[cpu].class_misses[size_class].fetch_add(1,
+                                                  std::memory_order_relaxed);
+#endif
   const size_t target =
       UpdateCapacity(cpu, size_class, batch_length, true, nullptr);
   // Return target objects in batch_length batches.
@@ -1328,8 +1525,7 @@ inline int CpuCache<Forwarder>::Overflow(void* ptr, size_t size_class,
     total += count;
     static_assert(ABSL_ARRAYSIZE(batch) >= kMaxObjectsToMove,
                   "not enough space in batch");
-    forwarder_.transfer_cache().InsertRange(size_class,
-                                            absl::Span<void*>(batch, count));
+    InsertToTransferCache(size_class, absl::Span<void*>(batch, count));
     if (count != batch_length) break;
     count = 0;
   } while (total < target && cpu == freelist_.GetCurrentVirtualCpuUnsafe());
@@ -1463,6 +1659,41 @@ inline uint64_t CpuCache<Forwarder>::Reclaim(int cpu) {
   return bytes;
 }
 
+#ifdef ESCAPE_AWARE_RECLAIM
+template <class Forwarder>
+inline void CpuCache<Forwarder>::DrainEscapePressure(int cpu,
+                                                     const bool* pressured) {
+  AllocationGuardSpinLockHolder h(&resize_[cpu].lock);
+  if (!HasPopulated(cpu)) return;
+
+  uint64_t drained = 0;
+  for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+    if (!pressured[size_class]) continue;
+    if (freelist_.Length(cpu, size_class) == 0) continue;
+    const size_t size = forwarder_.class_to_size(size_class);
+    // Shrinking the whole capacity pops every object first.  The list grows
+    // back on its next misses.
+    const size_t shrunk = freelist_.ShrinkOtherCache(
+        cpu, size_class, freelist_.Capacity(cpu, size_class),
+        [this, size, &drained](size_t size_class, void** batch,
+                               size_t count) {
+          drained += count * size;
+          const size_t batch_length =
+              forwarder_.num_objects_to_move(size_class);
+          for (size_t i = 0; i < count; i += batch_length) {
+            size_t n = std::min(batch_length, count - i);
+            forwarder_.release_to_central_freelist(
+                size_class, absl::Span<void*>(batch + i, n));
+          }
+        });
+    // As in Drain(), the capacity given up goes back to the CPU's slack.
+    resize_[cpu].available.fetch_add(shrunk * size,
+                                     std::memory_order_relaxed);
+  }
+  escape_drained_bytes_.fetch_add(drained, std::memory_order_relaxed);
+}
+#endif
+
 template <class Forwarder>
 inline uint64_t CpuCache<Forwarder>::GetNumReclaims(int cpu) const {
   return resize_[cpu].num_reclaims.load(std::memory_order_relaxed);
@@ -1546,6 +1777,60 @@ inline void CpuCache<Forwarder>::RecordCacheMissStat(const int cpu,
   misses[MissCount::kTotal].fetch_add(1, std::memory_order_relaxed);
 }
 
+template <class Forwarder>
+inline size_t CpuCache<Forwarder>::BatchLength(size_t size_class) const {
+#ifdef ADAPTIVE_BATCH_SIZE
+  const uint32_t batch_length =
+      batch_length_info_[size_class].batch_length.load(
+          std::memory_order_relaxed);
+  if (batch_length != 0) return batch_length;
+#endif
+  return forwarder_.num_objects_to_move(size_class);
+}
+
+#ifdef ADAPTIVE_BATCH_SIZE
+template <class Forwarder>
+inline void CpuCache<Forwarder>::AdaptBatchLengths() {
+  // Fewer misses than this in an interval say nothing about a size class.
+  static constexpr uint32_t kMinIntervalMisses = 64;
+  const int num_cpus = absl::base_internal::NumCPUs();
+
+  for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+    const size_t max_length = forwarder_.num_objects_to_move(size_class);
+    if (max_length == 0) continue;
+    BatchLengthInfo& info = batch_length_info_[size_class];
+
+    uint32_t cpu_misses = 0;
+    for (int cpu = 0; cpu < num_cpus; ++cpu) {
+      if (!HasPopulated(cpu)) continue;
+      cpu_misses += resize_[cpu].class_misses[size_class].load(
+          std::memory_order_relaxed);
+    }
+    const TransferCacheStats stats =
+        forwarder_.transfer_cache().GetStats(size_class);
+    const uint64_t transfer_cache_misses =
+        stats.insert_misses + stats.remove_misses;
+    const uint32_t interval_cpu_misses = cpu_misses - info.cpu_misses;
+    const uint64_t interval_transfer_cache_misses =
+        transfer_cache_misses - info.transfer_cache_misses;
+    info.cpu_misses = cpu_misses;
+    info.transfer_cache_misses = transfer_cache_misses;
+    if (interval_cpu_misses < kMinIntervalMisses) continue;
+
+    const size_t min_length = std::max<size_t>(1, max_length / 4);
+    size_t length = BatchLength(size_class);
+    if (2 * interval_transfer_cache_misses > interval_cpu_misses) {
+      // Most batches go to or come from the central free list.
+      length = std::max(min_length, length / 2);
+    } else if (8 * interval_transfer_cache_misses < interval_cpu_misses) {
+      // The transfer cache keeps up; spend fewer trips to it.
+      length = std::min(max_length, 2 * length);
+    }
+    info.batch_length.store(length, std::memory_order_relaxed);
+  }
+}
+#endif
+
 template <class Forwarder>
 inline typename CpuCache<Forwarder>::CpuCacheMissStats
 CpuCache<Forwarder>::GetTotalCacheMissStats(int cpu) const {
@@ -1684,6 +1969,19 @@ inline void CpuCache<Forwarder>::Print(Printer* out) const {
         GetMaxCapacity(size_class, freelist_.GetShift()));
   }
 
+#ifdef ADAPTIVE_BATCH_SIZE
+  out->printf("------------------------------------------------\n");
+  out->printf("Objects per refill or overflow batch, adapted by size class\n");
+  out->printf("------------------------------------------------\n");
+  for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+    if (forwarder_.num_objects_to_move(size_class) == 0) continue;
+    out->printf("class %3d [ %8zu bytes ] : %4zu of %4zu objects\n",
+                size_class, forwarder_.class_to_size(size_class),
+                BatchLength(size_class),
+                forwarder_.num_objects_to_move(size_class));
+  }
+#endif
+
   out->printf("------------------------------------------------\n");
   out->printf("Number of per-CPU cache underflows, overflows, and reclaims\n");
   out->printf("------------------------------------------------\n");
@@ -1702,6 +2000,10 @@ inline void CpuCache<Forwarder>::Print(Printer* out) const {
     out->printf("cpu %3d:", cpu);
     print_miss_stats(GetTotalCacheMissStats(cpu), GetNumReclaims(cpu));
   }
+#ifdef ESCAPE_AWARE_RECLAIM
+  out->printf("%12u bytes drained under escape metadata pressure\n",
+              GetEscapeDrainedBytes());
+#endif
 
   out->printf("------------------------------------------------\n");
   out->printf("Per-CPU cache slab resizing info:\n");
@@ -1739,6 +2041,9 @@ inline void CpuCache<Forwarder>::PrintInPbtxt(PbtxtRegion* region) const {
     entry.PrintI64("overflows", miss_stats.overflows);
     entry.PrintI64("reclaims", reclaims);
   }
+#ifdef ESCAPE_AWARE_RECLAIM
+  region->PrintI64("escape_drained_bytes", GetEscapeDrainedBytes());
+#endif
 
   // Record size class capacity statistics.
   for (int size_class = 0; size_class < kNumClasses; ++size_class) {
@@ -1749,6 +2054,7 @@ inline void CpuCache<Forwarder>::PrintInPbtxt(PbtxtRegion* region) const {
     entry.PrintI64("max_capacity", stats.max_capacity);
     entry.PrintI64("max_allowed_capacity",
                    GetMaxCapacity(size_class, freelist_.GetShift()));
+    entry.PrintI64("batch_length", BatchLength(size_class));
   }
 
   // Record dynamic slab statistics.
@@ -144,6 +144,22 @@ class TestStaticForwarder {
     return transfer_cache_;
   }
 
+#ifdef ESCAPE_AWARE_RECLAIM
+  size_t sparse_span_escape_bytes(int size_class) const {
+    return size_class == escape_pressured_size_class_
+               ? std::numeric_limits<size_t>::max()
+               : 0;
+  }
+
+  void release_to_central_freelist(int size_class, absl::Span<void*> batch) {
+    released_to_central_freelist_ += batch.size();
+    transfer_cache_.InsertRange(size_class, batch);
+  }
+
+  int escape_pressured_size_class_ = 0;
+  size_t released_to_central_freelist_ = 0;
+#endif
+
   size_t arena_reported_nonresident_bytes_ = 0;
   bool dynamic_slab_enabled_ = false;
   DynamicSlab dynamic_slab_ = DynamicSlab::kNoop;
@@ -200,9 +216,7 @@ TEST(CpuCacheTest, Metadata) {
   int allowed_cpu_id;
   const size_t kSizeClass = 2;
   const size_t num_to_move = cache.forwarder().num_objects_to_move(kSizeClass);
-  const size_t virtual_cpu_id_offset = subtle::percpu::UsingFlatVirtualCpus()
-                                           ? offsetof(kernel_rseq, vcpu_id)
-                                           : offsetof(kernel_rseq, cpu_id);
+  const size_t virtual_cpu_id_offset = subtle::percpu::VirtualCpuIdOffset();
   void* ptr;
   {
     // Restrict this thread to a single core while allocating and processing the
@@ -328,9 +342,7 @@ TEST(CpuCacheTest, CacheMissStats) {
 
   int allowed_cpu_id;
   const size_t kSizeClass = 2;
-  const size_t virtual_cpu_id_offset = subtle::percpu::UsingFlatVirtualCpus()
-                                           ? offsetof(kernel_rseq, vcpu_id)
-                                           : offsetof(kernel_rseq, cpu_id);
+  const size_t virtual_cpu_id_offset = subtle::percpu::VirtualCpuIdOffset();
   void* ptr;
   {
     // Restrict this thread to a single core while allocating and processing the
@@ -374,6 +386,49 @@ TEST(CpuCacheTest, CacheMissStats) {
   cache.Deactivate();
 }
 
+#ifdef ADAPTIVE_BATCH_SIZE
+TEST(CpuCacheTest, AdaptBatchLengths) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+
+  CpuCache cache;
+  cache.Activate();
+
+  const size_t kSizeClass = 2;
+  const size_t num_to_move = cache.forwarder().num_objects_to_move(kSizeClass);
+  EXPECT_EQ(cache.BatchLength(kSizeClass), num_to_move);
+
+  // Every refill of a cache that is only allocated from misses the empty
+  // transfer cache, so the batches shrink.
+  std::vector<void*> objects;
+  {
+    tcmalloc_internal::ScopedAffinityMask mask(
+        tcmalloc_internal::AllowedCpus()[0]);
+    const size_t virtual_cpu_id_offset = subtle::percpu::VirtualCpuIdOffset();
+    const int cpu =
+        subtle::percpu::GetCurrentVirtualCpuUnsafe(virtual_cpu_id_offset);
+    while (cache.GetTotalCacheMissStats(cpu).underflows < 128 &&
+           objects.size() < 1 << 20) {
+      objects.push_back(cache.Allocate<OOMHandler>(kSizeClass));
+    }
+    if (mask.Tampered()) {
+      for (void* ptr : objects) cache.Deallocate(ptr, kSizeClass);
+      return;
+    }
+  }
+  cache.AdaptBatchLengths();
+  if (num_to_move > 1) {
+    EXPECT_LT(cache.BatchLength(kSizeClass), num_to_move);
+  }
+  EXPECT_GE(cache.BatchLength(kSizeClass),
+            std::max<size_t>(1, num_to_move / 4));
+
+  for (void* ptr : objects) cache.Deallocate(ptr, kSizeClass);
+  cache.Deactivate();
+}
+#endif
+
 static void ShuffleThread(CpuCache& cache, const std::atomic<bool>& stop) {
   if (!subtle::percpu::IsFast()) {
     return;
@@ -823,6 +878,62 @@ TEST(CpuCacheTest, ReclaimCpuCache) {
   cache.Deactivate();
 }
 
+#ifdef ESCAPE_AWARE_RECLAIM
+// A cache that keeps missing is not reclaimed, but once its used bytes stop
+// growing, a size class under escape metadata pressure is drained from it.
+TEST(CpuCacheTest, DrainEscapePressure) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+
+  CpuCache cache;
+  cache.Activate();
+
+  const size_t kSizeClass = 2;
+  cache.forwarder().escape_pressured_size_class_ = kSizeClass;
+  const size_t batch = cache.forwarder().num_objects_to_move(kSizeClass);
+
+  tcmalloc_internal::ScopedAffinityMask mask(
+      tcmalloc_internal::AllowedCpus()[0]);
+  const size_t virtual_cpu_id_offset = subtle::percpu::VirtualCpuIdOffset();
+  const int cpu =
+      subtle::percpu::GetCurrentVirtualCpuUnsafe(virtual_cpu_id_offset);
+
+  std::vector<void*> objects;
+  for (size_t i = 0; i < 4 * batch; ++i) {
+    objects.push_back(cache.Allocate<OOMHandler>(kSizeClass));
+  }
+  for (void* ptr : objects) cache.Deallocate(ptr, kSizeClass);
+  objects.clear();
+  // Used bytes grew since the last interval: nothing is drained.
+  cache.TryReclaimingCaches();
+  const uint64_t cached = cache.UsedBytes(cpu);
+  EXPECT_GT(cached, 0);
+
+  // Take everything cached and miss once more, leaving less cached behind
+  // than the last interval saw.
+  const uint32_t underflows = cache.GetTotalCacheMissStats(cpu).underflows;
+  while (cache.GetTotalCacheMissStats(cpu).underflows == underflows &&
+         objects.size() < 1 << 20) {
+    objects.push_back(cache.Allocate<OOMHandler>(kSizeClass));
+  }
+  if (mask.Tampered() || cache.UsedBytes(cpu) > cached) {
+    for (void* ptr : objects) cache.Deallocate(ptr, kSizeClass);
+    cache.Deactivate();
+    return;
+  }
+
+  cache.TryReclaimingCaches();
+  EXPECT_EQ(cache.GetNumReclaims(cpu), 0);
+  EXPECT_EQ(cache.UsedBytes(cpu), 0);
+  EXPECT_GT(cache.forwarder().released_to_central_freelist_, 0);
+  EXPECT_GT(cache.GetEscapeDrainedBytes(), 0);
+
+  for (void* ptr : objects) cache.Deallocate(ptr, kSizeClass);
+  cache.Deactivate();
+}
+#endif
+
 TEST(CpuCacheTest, SizeClassCapacityTest) {
   if (!subtle::percpu::IsFast()) {
     return;
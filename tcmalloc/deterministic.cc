@@ -0,0 +1,113 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/deterministic.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "tcmalloc/internal/environment.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/parameters.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// Samplers are seeded with kSeedBase plus the order they started in.
+constexpr uint64_t kSeedBase = 0x9e3779b97f4a7c15;
+ABSL_CONST_INIT std::atomic<uint64_t> sampler_seeds{0};
+
+// Serializes Enable() and Disable().
+ABSL_CONST_INIT absl::base_internal::SpinLock pin_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+// The pinned thread, or 0, and the CPUs it could run on before.
+pid_t pinned_tid ABSL_GUARDED_BY(pin_lock) = 0;
+cpu_set_t pinned_affinity ABSL_GUARDED_BY(pin_lock);
+
+void Unpin() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pin_lock) {
+  if (pinned_tid == 0) return;
+  if (sched_setaffinity(pinned_tid, sizeof(pinned_affinity),
+                        &pinned_affinity) != 0 &&
+      errno != ESRCH) {
+    Log(kLog, __FILE__, __LINE__, "sched_setaffinity failed", errno);
+  }
+  pinned_tid = 0;
+}
+
+}  // namespace
+
+void DeterministicMode::Enable() {
+  absl::base_internal::SpinLockHolder h(&pin_lock);
+  // A second Enable() moves the pin to the calling thread.
+  Unpin();
+  const pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+  const int cpu = sched_getcpu();
+  if (cpu < 0 ||
+      sched_getaffinity(tid, sizeof(pinned_affinity), &pinned_affinity) !=
+          0) {
+    Log(kLog, __FILE__, __LINE__, "Could not read the CPU to pin to", errno);
+  } else {
+    cpu_set_t pin;
+    CPU_ZERO(&pin);
+    CPU_SET(cpu, &pin);
+    if (sched_setaffinity(tid, sizeof(pin), &pin) == 0) {
+      pinned_tid = tid;
+    } else {
+      Log(kLog, __FILE__, __LINE__, "sched_setaffinity failed", errno);
+    }
+  }
+  sampler_seeds.store(0, std::memory_order_relaxed);
+  Parameters::set_deterministic_mode(true);
+}
+
+void DeterministicMode::Disable() {
+  absl::base_internal::SpinLockHolder h(&pin_lock);
+  Parameters::set_deterministic_mode(false);
+  Unpin();
+}
+
+uint64_t DeterministicMode::NextSamplerSeed() {
+  const uint64_t seed =
+      kSeedBase + sampler_seeds.fetch_add(1, std::memory_order_relaxed);
+  return seed != 0 ? seed : kSeedBase;
+}
+
+void DeterministicMode::InitFromEnvironment() {
+  const char* e = thread_safe_getenv("TCMALLOC_DETERMINISTIC");
+  if (e == nullptr) return;
+  const absl::string_view v(e);
+  if (v == "1") {
+    Enable();
+  } else if (v == "nosample") {
+    Parameters::set_profile_sampling_rate(0);
+    Enable();
+  } else if (v != "0") {
+    Log(kLog, __FILE__, __LINE__,
+        "Unknown TCMALLOC_DETERMINISTIC (0, 1 or nosample)", e);
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
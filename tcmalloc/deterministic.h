@@ -0,0 +1,56 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Deterministic mode for allocator benchmarks (DETERMINISTIC_MODE).
+//
+// While it is on, the background thread releases, shuffles, reclaims and
+// resizes nothing, samplers draw their sampling points from fixed seeds
+// rather than from their addresses, and the thread that turned it on is
+// pinned to the CPU it ran on, so that it keeps the per-cpu cache it warmed.
+// None of this touches the allocation fast path.
+
+#ifndef TCMALLOC_DETERMINISTIC_H_
+#define TCMALLOC_DETERMINISTIC_H_
+
+#include <stdint.h>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+class DeterministicMode {
+ public:
+  // Turns the mode on and pins the calling thread to its current CPU.
+  // Samplers initialized from now on are seeded in the order they start.
+  static void Enable();
+
+  // Turns the mode off and gives the pinned thread back the CPUs it could
+  // run on before.
+  static void Disable();
+
+  // Seed of the next sampler to start, nonzero.
+  static uint64_t NextSamplerSeed();
+
+  // Enables the mode under TCMALLOC_DETERMINISTIC=1, or under
+  // TCMALLOC_DETERMINISTIC=nosample with profile sampling off as well.
+  static void InitFromEnvironment();
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_DETERMINISTIC_H_
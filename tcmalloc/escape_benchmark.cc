@@ -0,0 +1,210 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Benchmarks of escape tracking: __escape() into a location that already
+// points into the object, into one staged before, into fresh locations that
+// fill and flush the thread's escape buffer, and free() of an object with a
+// number of escapes to poison.  The Scattered variants spread their
+// locations over a cache line each, visited in random order, and their
+// objects over many spans, so that every record misses the cache the way a
+// real heap does and the prefetching of PIPELINED_ESCAPE_PREFETCH shows.
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/escape_buffer.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/tcmalloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr int kLastClass = kNumClasses - 1;
+
+// Size classes the benchmarks are run for, from the smallest to the largest.
+void SizeClasses(benchmark::internal::Benchmark* b) {
+  for (int size_class : {1, 2, 4, 8, 16, 32, kLastClass}) {
+    b->Arg(size_class);
+  }
+}
+
+// Size classes crossed with the number of escapes poisoned per free().
+void SizeClassesAndEscapes(benchmark::internal::Benchmark* b) {
+  for (int size_class : {1, 8, 32, kLastClass}) {
+    for (int escapes : {0, 1, 10, 1000}) {
+      b->Args({size_class, escapes});
+    }
+  }
+}
+
+// Small size classes crossed with the number of escapes poisoned per free().
+void SmallClassesAndEscapes(benchmark::internal::Benchmark* b) {
+  for (int size_class : {1, 8, 32}) {
+    for (int escapes : {10, 1000}) {
+      b->Args({size_class, escapes});
+    }
+  }
+}
+
+// Objects the Scattered benchmarks escape, enough to cover many spans.
+constexpr size_t kScatteredObjects = 4096;
+// Pointer slots per location, so that each location has a line of its own.
+constexpr size_t kSlotStride = 64 / sizeof(void*);
+
+// Returns `count` locations, each in its own cache line of `slots`, in
+// random order.
+std::vector<void**> ScatteredLocations(std::vector<void*>& slots,
+                                       size_t count) {
+  slots.assign(count * kSlotStride, nullptr);
+  std::vector<void**> locs(count);
+  for (size_t i = 0; i < count; ++i) locs[i] = &slots[i * kSlotStride];
+  std::shuffle(locs.begin(), locs.end(), std::mt19937(count));
+  return locs;
+}
+
+size_t ClassSize(const benchmark::State& state) {
+  // The first allocation sets up tc_globals for the size map.
+  free(malloc(1));
+  return tc_globals.sizemap().class_to_size(state.range(0));
+}
+
+// __escape() of a pointer into the object the location already points to,
+// which returns before anything is staged.
+void BM_EscapeHit(benchmark::State& state) {
+  const size_t size = ClassSize(state);
+  void* obj = malloc(size);
+  void* slot = obj;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(TCMallocInternalEscape(&slot, obj));
+  }
+  free(obj);
+  state.SetItemsProcessed(state.iterations());
+}
+
+// __escape() into one location that alternates between two objects, so
+// every call stages a record and replaces the previous one in the buffer.
+void BM_EscapeMiss(benchmark::State& state) {
+  const size_t size = ClassSize(state);
+  void* objs[2] = {malloc(size), malloc(size)};
+  void* slot = objs[0];
+  int i = 0;
+  for (auto _ : state) {
+    i ^= 1;
+    benchmark::DoNotOptimize(TCMallocInternalEscape(&slot, objs[i]));
+    slot = objs[i];
+  }
+  free(objs[0]);
+  free(objs[1]);
+  state.SetItemsProcessed(state.iterations());
+}
+
+// __escape() into distinct locations, so the escape buffer fills up and is
+// flushed to the span escape lists every EscapeBuffer::kCapacity calls.
+void BM_EscapeFlush(benchmark::State& state) {
+  const size_t size = ClassSize(state);
+  void* objs[2] = {malloc(size), malloc(size)};
+  std::vector<void*> locs(4 * EscapeBuffer::kCapacity, nullptr);
+  int pass = 0;
+  while (state.KeepRunningBatch(locs.size())) {
+    pass ^= 1;
+    for (void*& loc : locs) {
+      benchmark::DoNotOptimize(TCMallocInternalEscape(&loc, objs[pass]));
+      loc = objs[pass];
+    }
+  }
+  free(objs[0]);
+  free(objs[1]);
+  state.SetItemsProcessed(state.iterations());
+}
+
+// BM_EscapeFlush with every location in a cache line of its own, visited in
+// random order, each escaping a random one of kScatteredObjects objects.
+void BM_EscapeFlushScattered(benchmark::State& state) {
+  const size_t size = ClassSize(state);
+  std::vector<void*> objs(kScatteredObjects);
+  for (void*& obj : objs) obj = malloc(size);
+  std::vector<void*> slots;
+  std::vector<void**> locs =
+      ScatteredLocations(slots, 4 * EscapeBuffer::kCapacity);
+  std::vector<size_t> targets(locs.size());
+  std::mt19937 rng(0);
+  for (size_t& t : targets) t = rng() % objs.size();
+  size_t pass = 0;
+  while (state.KeepRunningBatch(locs.size())) {
+    pass++;
+    for (size_t i = 0; i < locs.size(); ++i) {
+      void* obj = objs[(targets[i] + pass) % objs.size()];
+      benchmark::DoNotOptimize(TCMallocInternalEscape(locs[i], obj));
+      *locs[i] = obj;
+    }
+  }
+  for (void** loc : locs) *loc = nullptr;
+  for (void* obj : objs) free(obj);
+  state.SetItemsProcessed(state.iterations());
+}
+
+// malloc(), range(1) escapes of the object and free(), which poisons them.
+// The run with no escapes is the baseline for the others.
+void BM_PoisonEscapes(benchmark::State& state) {
+  const size_t size = ClassSize(state);
+  std::vector<void*> locs(state.range(1), nullptr);
+  for (auto _ : state) {
+    void* obj = malloc(size);
+    for (void*& loc : locs) {
+      TCMallocInternalEscape(&loc, obj);
+      loc = obj;
+    }
+    free(obj);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// BM_PoisonEscapes with every location in a cache line of its own, escaped
+// in random order.
+void BM_PoisonScattered(benchmark::State& state) {
+  const size_t size = ClassSize(state);
+  std::vector<void*> slots;
+  std::vector<void**> locs = ScatteredLocations(slots, state.range(1));
+  for (auto _ : state) {
+    void* obj = malloc(size);
+    for (void** loc : locs) {
+      TCMallocInternalEscape(loc, obj);
+      *loc = obj;
+    }
+    free(obj);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_EscapeHit)->Apply(SizeClasses)->ThreadRange(1, 8);
+BENCHMARK(BM_EscapeMiss)->Apply(SizeClasses)->ThreadRange(1, 8);
+BENCHMARK(BM_EscapeFlush)->Apply(SizeClasses)->ThreadRange(1, 8);
+BENCHMARK(BM_EscapeFlushScattered)->Arg(1)->Arg(8)->Arg(32);
+BENCHMARK(BM_PoisonEscapes)
+    ->Apply(SizeClassesAndEscapes)
+    ->ThreadRange(1, 8);
+BENCHMARK(BM_PoisonScattered)->Apply(SmallClassesAndEscapes);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
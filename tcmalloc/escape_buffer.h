@@ -0,0 +1,504 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Per-thread staging buffer for escapes recorded by __escape().
+
+#ifndef TCMALLOC_ESCAPE_BUFFER_H_
+#define TCMALLOC_ESCAPE_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/numeric/bits.h"
+#include "tcmalloc/arena.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/page_heap_allocator.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Number of escapes staged per thread before they are committed to the
+// per-span escape lists.
+#define CACHE_SIZE (1024)
+
+struct escape_cache {
+  void **loc; size_t ptr; // void *old_ptr;
+};
+
+// An EscapeBuffer is owned by exactly one thread, so records are appended
+// without any synchronization.  When the buffer fills up (or the thread
+// exits) the records are committed to the span escape lists by
+// flush_escape(), either inline or, when
+// Parameters::background_escape_flush() is set, by the background flusher
+// after the owner hands the full buffer off and takes a fresh one.
+//
+// Records are deduplicated by location: an open-addressed index maps each
+// staged loc to its record, and a later store to the same loc overwrites the
+// earlier record instead of appending a new one.  A flush therefore commits
+// each location at most once, and a loop storing into the same slot costs one
+// record no matter how often it runs.  Records themselves stay dense, so
+// iteration only visits live entries.
+//
+// Records are also chained by the object they point to (a second index keyed
+// by OBJ_START() of the record), so freeing an object only visits the records
+// staged for objects that hash alike instead of the whole buffer.  Record
+// pointers must therefore only change through Push(), Retarget() and Poison().
+//
+// A free only sees the records of the freeing thread's own buffer and of the
+// buffers handed off to the flusher.  Records another live thread staged
+// stay invisible until it commits them: a location holding a pointer to an
+// object freed meanwhile is then filtered if the object's slot is free, or
+// committed against the object that reuses it, and is not poisoned by the
+// original free.  RequestEscapeFlush() bounds this window: the background
+// thread calls it once a tick, and every thread commits its buffer on its
+// first escape after that, full or not.
+//
+// Buffers are carved from Static::escape_buffer_allocator(), which reuses the
+// first word of a free object as its freelist link, so Init() must be called
+// on every buffer handed out by the allocator.
+//
+// Under ADAPTIVE_ESCAPE_BUFFER the capacity is set by Init(), a power of two
+// in [kMinCapacity, kMaxCapacity], with the arrays following the buffer in
+// the same allocation.  A buffer counts, while it fills, how the pushes into
+// it fared and what the frees' scans of it cost, and NextCapacity() picks the
+// capacity of the buffer that replaces it from them.
+class EscapeBuffer {
+ public:
+  // The capacity of every buffer, or of a thread's first one under
+  // ADAPTIVE_ESCAPE_BUFFER.
+  static constexpr size_t kCapacity = CACHE_SIZE;
+
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+  static constexpr size_t kMinCapacity = 64;
+  static constexpr size_t kMaxCapacity = 16384;
+  static_assert(kMinCapacity <= kCapacity && kCapacity <= kMaxCapacity,
+                "CACHE_SIZE out of the adaptive range");
+
+  // Bytes of a buffer of `capacity` records, its arrays included.
+  static constexpr size_t BytesFor(size_t capacity) {
+    return HeaderBytes() +
+           capacity * (sizeof(escape_cache) + 2 * sizeof(uint16_t) +
+                       sizeof(uint16_t) + sizeof(Links)
+#ifdef SORTED_ESCAPE_FLUSH
+                       + 2 * sizeof(uint16_t)
+#endif
+                      );
+  }
+
+  // REQUIRES: the allocation holds BytesFor(capacity) bytes.
+  void Init(size_t capacity) {
+    ASSERT(absl::has_single_bit(capacity));
+    ASSERT(kMinCapacity <= capacity && capacity <= kMaxCapacity);
+    next_ = nullptr;
+    capacity_ = capacity;
+    index_shift_ = 64 - absl::bit_width(2 * capacity - 1);
+    obj_shift_ = 64 - absl::bit_width(capacity - 1);
+    char* p = reinterpret_cast<char*>(this) + HeaderBytes();
+    entries_ = reinterpret_cast<escape_cache*>(p);
+    p += capacity * sizeof(escape_cache);
+    links_ = reinterpret_cast<Links*>(p);
+    p += capacity * sizeof(Links);
+    index_ = reinterpret_cast<uint16_t*>(p);
+    p += 2 * capacity * sizeof(uint16_t);
+    obj_index_ = reinterpret_cast<uint16_t*>(p);
+#ifdef SORTED_ESCAPE_FLUSH
+    p += capacity * sizeof(uint16_t);
+    flush_order_ = reinterpret_cast<uint16_t*>(p);
+    p += capacity * sizeof(uint16_t);
+    flush_tmp_ = reinterpret_cast<uint16_t*>(p);
+#endif
+    Clear();
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  // The capacity for the buffer that replaces this one once it is full.
+  //
+  // A push that replaces a record staged for its location, and a record
+  // poisoned by the free of its object, are work no flush does: the longer
+  // the buffer, the more pushes end that way.  It doubles while at least a
+  // quarter of its pushes do, and halves when fewer than one in 32 do, as
+  // well as when the frees' scans visit more than 4 records each on
+  // average, objects whose records a shorter buffer would have committed.
+  size_t NextCapacity() const {
+    if (pushes_ == 0) return capacity_;
+    if (scan_visits_ > 4 * scans_ || 32 * absorbed_ < pushes_) {
+      return capacity_ > kMinCapacity ? capacity_ / 2 : capacity_;
+    }
+    if (4 * absorbed_ >= pushes_) {
+      return capacity_ < kMaxCapacity ? capacity_ * 2 : capacity_;
+    }
+    return capacity_;
+  }
+#else
+  void Init() {
+    next_ = nullptr;
+    Clear();
+  }
+
+  static constexpr size_t capacity() { return kCapacity; }
+  static constexpr size_t NextCapacity() { return kCapacity; }
+#endif
+
+  size_t size() const { return pos_; }
+  bool empty() const { return pos_ == 0; }
+  bool full() const { return pos_ == capacity(); }
+
+  // Record pointer of an escape whose object was freed; flush_escape() skips
+  // it.
+  static constexpr size_t kPoisoned = ~size_t{0};
+
+  // Stages `ptr_info` for `loc`, replacing a record already staged for the
+  // same loc.  Returns false if an existing record was replaced.
+  // REQUIRES: !full()
+  bool ABSL_ATTRIBUTE_ALWAYS_INLINE Push(void** loc, size_t ptr_info) {
+    ASSERT(!full());
+    ASSERT(ptr_info != kPoisoned);
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+    pushes_++;
+#endif
+    size_t slot = Hash(loc);
+    while (index_[slot] != 0) {
+      escape_cache& e = entries_[index_[slot] - 1];
+      if (e.loc == loc) {
+        if (ObjectKey(e.ptr) == ObjectKey(ptr_info)) {
+          e.ptr = ptr_info;
+        } else {
+          Retarget(&e, ptr_info);
+        }
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+        absorbed_++;
+#endif
+        return false;
+      }
+      slot = (slot + 1) & (index_size() - 1);
+    }
+    entries_[pos_].loc = loc;
+    entries_[pos_].ptr = ptr_info;
+    pos_++;
+    index_[slot] = pos_;
+    Link(pos_);
+    return true;
+  }
+
+  // Calls f(e) for every live record whose OBJ_START() is `obj_key`.  f may
+  // Retarget() or Poison() e.
+  template <typename F>
+  void ABSL_ATTRIBUTE_ALWAYS_INLINE ForEachOfObject(uint64_t obj_key, F f) {
+    uint16_t i = obj_index_[ObjectHash(obj_key)];
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+    scans_++;
+#endif
+    while (i != 0) {
+      escape_cache& e = entries_[i - 1];
+      const uint16_t next = links_[i - 1].next;
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+      scan_visits_++;
+#endif
+      if (ObjectKey(e.ptr) == obj_key) f(&e);
+      i = next;
+    }
+  }
+
+  // Points e at another object.
+  void Retarget(escape_cache* e, size_t ptr_info) {
+    ASSERT(ptr_info != kPoisoned);
+    const uint16_t i = Position(e);
+    if (e->ptr != kPoisoned) Unlink(i);
+    e->ptr = ptr_info;
+    Link(i);
+  }
+
+  // Marks e as pointing to a freed object.
+  void Poison(escape_cache* e) {
+    if (e->ptr == kPoisoned) return;
+    Unlink(Position(e));
+    e->ptr = kPoisoned;
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+    absorbed_++;
+#endif
+  }
+
+  void Clear() {
+    pos_ = 0;
+    memset(index_, 0, index_size() * sizeof(*index_));
+    memset(obj_index_, 0, obj_index_size() * sizeof(*obj_index_));
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+    pushes_ = 0;
+    absorbed_ = 0;
+    scans_ = 0;
+    scan_visits_ = 0;
+#endif
+  }
+
+  escape_cache* begin() { return entries_; }
+  escape_cache* end() { return entries_ + pos_; }
+
+  // Stably sorts the 0-based positions order[0, n) of `entries` by the 16-bit
+  // key(e) of their records, two 8-bit radix passes through tmp[0, n).
+  template <typename Key>
+  static void SortByKey(const escape_cache* entries, uint16_t* order,
+                        uint16_t* tmp, size_t n, Key key) {
+    for (int shift = 0; shift < 16; shift += 8) {
+      uint16_t count[257] = {};
+      for (size_t i = 0; i < n; ++i) {
+        count[((key(entries[order[i]]) >> shift) & 0xff) + 1]++;
+      }
+      for (size_t d = 1; d < 257; ++d) count[d] += count[d - 1];
+      for (size_t i = 0; i < n; ++i) {
+        tmp[count[(key(entries[order[i]]) >> shift) & 0xff]++] = order[i];
+      }
+      memcpy(order, tmp, n * sizeof(*order));
+    }
+  }
+
+#ifdef SORTED_ESCAPE_FLUSH
+  // Scratch space for flush_escape() to order the records it commits.
+  uint16_t* flush_order() { return flush_order_; }
+  uint16_t* flush_tmp() { return flush_tmp_; }
+#endif
+
+  // Link used while the buffer sits on the background flush queue.
+  EscapeBuffer* next() const { return next_; }
+  void set_next(EscapeBuffer* next) { next_ = next; }
+
+ private:
+  struct Links {
+    uint16_t prev;
+    uint16_t next;
+  };
+
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+  static_assert(kMaxCapacity < (1 << 16), "index entries are 16 bits wide");
+
+  // Twice the capacity keeps the index at most half full, so probe sequences
+  // stay short.  One object chain per bucket on average when the buffer is
+  // full.
+  size_t index_size() const { return 2 * capacity_; }
+  size_t obj_index_size() const { return capacity_; }
+  int index_shift() const { return index_shift_; }
+  int obj_shift() const { return obj_shift_; }
+#else
+  // Twice the capacity keeps the index at most half full, so probe sequences
+  // stay short.
+  static constexpr size_t kIndexSize = 2 * kCapacity;
+  static_assert((kIndexSize & (kIndexSize - 1)) == 0,
+                "kIndexSize must be a power of two");
+  static_assert(kCapacity < (1 << 16), "index entries are 16 bits wide");
+
+  // One object chain per bucket on average when the buffer is full.
+  static constexpr size_t kObjIndexSize = kCapacity;
+  static_assert((kObjIndexSize & (kObjIndexSize - 1)) == 0,
+                "kObjIndexSize must be a power of two");
+
+  static constexpr size_t index_size() { return kIndexSize; }
+  static constexpr size_t obj_index_size() { return kObjIndexSize; }
+  static constexpr int index_shift() {
+    return 64 - absl::bit_width(kIndexSize - 1);
+  }
+  static constexpr int obj_shift() {
+    return 64 - absl::bit_width(kObjIndexSize - 1);
+  }
+#endif
+
+  size_t Hash(void** loc) const {
+    // locs are pointer aligned; multiplicative hashing spreads the rest.
+    return ((reinterpret_cast<uintptr_t>(loc) >> 3) * 0x9E3779B97F4A7C15ull) >>
+           index_shift();
+  }
+
+  // OBJ_START() of a record pointer.
+  static uint64_t ObjectKey(size_t ptr_info) { return ptr_info >> 24; }
+
+  size_t ObjectHash(uint64_t obj_key) const {
+    // Object starts are 8 byte aligned as well.
+    return ((obj_key >> 3) * 0x9E3779B97F4A7C15ull) >> obj_shift();
+  }
+
+  uint16_t Position(const escape_cache* e) const {
+    ASSERT(e >= entries_ && e < entries_ + pos_);
+    return static_cast<uint16_t>(e - entries_ + 1);
+  }
+
+  // Pushes the record at 1-based position i onto the chain of its object.
+  void Link(uint16_t i) {
+    uint16_t& head = obj_index_[ObjectHash(ObjectKey(entries_[i - 1].ptr))];
+    links_[i - 1] = {0, head};
+    if (head != 0) links_[head - 1].prev = i;
+    head = i;
+  }
+
+  // Removes the record at 1-based position i from the chain of its object.
+  void Unlink(uint16_t i) {
+    const Links l = links_[i - 1];
+    if (l.prev != 0) {
+      links_[l.prev - 1].next = l.next;
+    } else {
+      obj_index_[ObjectHash(ObjectKey(entries_[i - 1].ptr))] = l.next;
+    }
+    if (l.next != 0) links_[l.next - 1].prev = l.prev;
+  }
+
+  size_t pos_;
+  EscapeBuffer* next_;
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+  size_t capacity_;
+  int index_shift_;
+  int obj_shift_;
+  // Pushes since the last Clear(), those that replaced a staged record or
+  // whose record was poisoned since, ForEachOfObject() calls and the records
+  // they visited.
+  uint32_t pushes_;
+  uint32_t absorbed_;
+  uint32_t scans_;
+  uint32_t scan_visits_;
+  // The arrays below, in the allocation after the buffer.
+  escape_cache* entries_;
+  Links* links_;
+  uint16_t* index_;
+  uint16_t* obj_index_;
+#ifdef SORTED_ESCAPE_FLUSH
+  uint16_t* flush_order_;
+  uint16_t* flush_tmp_;
+#endif
+
+  static constexpr size_t HeaderBytes() {
+    return (sizeof(EscapeBuffer) + alignof(escape_cache) - 1) &
+           ~(alignof(escape_cache) - 1);
+  }
+#else
+  escape_cache entries_[kCapacity];
+  // 1-based positions into entries_, 0 marks an empty slot.
+  uint16_t index_[kIndexSize];
+  // Heads of the per-object chains, 1-based positions as in index_.
+  uint16_t obj_index_[kObjIndexSize];
+  // Chain links of entries_[i], 1-based positions with 0 ending the chain.
+  Links links_[kCapacity];
+#ifdef SORTED_ESCAPE_FLUSH
+  uint16_t flush_order_[kCapacity];
+  uint16_t flush_tmp_[kCapacity];
+#endif
+#endif  // ADAPTIVE_ESCAPE_BUFFER
+};
+
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+// Allocator of EscapeBuffers of every capacity: a PageHeapAllocator per
+// power of two, sharing one arena.  New() hands out a buffer to Init() with
+// the same capacity.
+class EscapeBufferAllocator {
+ public:
+  static constexpr size_t kClasses =
+      absl::bit_width(EscapeBuffer::kMaxCapacity) -
+      absl::bit_width(EscapeBuffer::kMinCapacity) + 1;
+
+  static constexpr size_t ClassCapacity(size_t cls) {
+    return EscapeBuffer::kMinCapacity << cls;
+  }
+
+  constexpr EscapeBufferAllocator() = default;
+
+  void Init(Arena* arena) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    arena_ = arena;
+  }
+
+  ABSL_ATTRIBUTE_RETURNS_NONNULL EscapeBuffer* New(size_t capacity)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    Class& c = classes_[ClassOf(capacity)];
+    void* result = c.free_list;
+    c.stats.in_use++;
+    if (ABSL_PREDICT_FALSE(result == nullptr)) {
+      c.stats.total++;
+      return static_cast<EscapeBuffer*>(
+          arena_->Alloc(EscapeBuffer::BytesFor(capacity)));
+    }
+    c.free_list = *static_cast<void**>(result);
+    return static_cast<EscapeBuffer*>(result);
+  }
+
+  void Delete(EscapeBuffer* p) ABSL_ATTRIBUTE_NONNULL()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    Class& c = classes_[ClassOf(p->capacity())];
+    *reinterpret_cast<void**>(p) = c.free_list;
+    c.free_list = p;
+    c.stats.in_use--;
+  }
+
+  AllocatorStats stats() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    AllocatorStats s = {0, 0};
+    for (const Class& c : classes_) {
+      s.in_use += c.stats.in_use;
+      s.total += c.stats.total;
+    }
+    return s;
+  }
+
+  AllocatorStats class_stats(size_t cls) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return classes_[cls].stats;
+  }
+
+  // Bytes carved from the arena.
+  size_t bytes() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    size_t bytes = 0;
+    for (size_t cls = 0; cls < kClasses; ++cls) {
+      bytes += classes_[cls].stats.total *
+               EscapeBuffer::BytesFor(ClassCapacity(cls));
+    }
+    return bytes;
+  }
+
+ private:
+  struct Class {
+    void* free_list = nullptr;
+    AllocatorStats stats = {0, 0};
+  };
+
+  static size_t ClassOf(size_t capacity) {
+    ASSERT(absl::has_single_bit(capacity));
+    return absl::bit_width(capacity) -
+           absl::bit_width(EscapeBuffer::kMinCapacity);
+  }
+
+  Arena* arena_ = nullptr;
+  Class classes_[kClasses] ABSL_GUARDED_BY(pageheap_lock);
+};
+#else
+using EscapeBufferAllocator = PageHeapAllocator<EscapeBuffer>;
+#endif
+
+// Commits every buffer that was handed off to the background flusher and
+// returns how many were committed.  Defined in tcmalloc.cc; driven by
+// MallocExtension::ProcessBackgroundEscapes().
+size_t CommitPendingEscapes();
+
+// Asks every thread to commit the escapes it has staged, which each does on
+// its next escape.  Defined in tcmalloc.cc; called by the background thread
+// once a tick.
+void RequestEscapeFlush();
+
+// Commits the escapes the calling thread has staged in its own buffer.
+// Defined in tcmalloc.cc; called when the thread's ThreadCache is deleted,
+// on thread exit or MallocExtension::MarkThreadIdle().
+void FlushThreadEscapes();
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ESCAPE_BUFFER_H_
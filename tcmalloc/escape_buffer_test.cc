@@ -0,0 +1,134 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/escape_buffer.h"
+
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+uint16_t KeyOf(const escape_cache& e) { return e.ptr & 0xffff; }
+
+TEST(EscapeBufferSort, GroupsByKeyAndKeepsOrderWithinGroups) {
+  std::mt19937 rng(1);
+  std::vector<escape_cache> entries(EscapeBuffer::kCapacity);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    // Few enough keys for groups, with bits in both radix digits.
+    entries[i].loc = nullptr;
+    entries[i].ptr = (rng() % 37) * 0x0301;
+  }
+  std::vector<uint16_t> order(entries.size()), tmp(entries.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  EscapeBuffer::SortByKey(entries.data(), order.data(), tmp.data(),
+                          order.size(), KeyOf);
+
+  std::vector<bool> seen(entries.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    ASSERT_LT(order[i], entries.size());
+    EXPECT_FALSE(seen[order[i]]);
+    seen[order[i]] = true;
+    if (i == 0) continue;
+    const uint16_t prev = KeyOf(entries[order[i - 1]]);
+    const uint16_t cur = KeyOf(entries[order[i]]);
+    EXPECT_LE(prev, cur);
+    if (prev == cur) EXPECT_LT(order[i - 1], order[i]);
+  }
+}
+
+TEST(EscapeBufferSort, SortsPrefix) {
+  escape_cache entries[4] = {{nullptr, 9}, {nullptr, 3}, {nullptr, 0x100},
+                             {nullptr, 1}};
+  uint16_t order[4] = {2, 0, 3, 1};
+  uint16_t tmp[4];
+  EscapeBuffer::SortByKey(entries, order, tmp, 3, KeyOf);
+  EXPECT_EQ(order[0], 3);
+  EXPECT_EQ(order[1], 0);
+  EXPECT_EQ(order[2], 2);
+  EXPECT_EQ(order[3], 1);
+}
+
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+// A buffer of `capacity` records on the heap.
+class SizedBuffer {
+ public:
+  explicit SizedBuffer(size_t capacity)
+      : storage_(EscapeBuffer::BytesFor(capacity) / sizeof(uint64_t) + 1) {
+    buffer()->Init(capacity);
+  }
+
+  EscapeBuffer* buffer() {
+    return reinterpret_cast<EscapeBuffer*>(storage_.data());
+  }
+
+ private:
+  std::vector<uint64_t> storage_;
+};
+
+// A record pointer to the 64 byte object number i.
+size_t ObjectInfo(size_t i) { return ((0x10000 + i * 64) << 24) | 64; }
+
+TEST(AdaptiveEscapeBuffer, HoldsItsCapacity) {
+  SizedBuffer b(EscapeBuffer::kMinCapacity);
+  std::vector<void*> slots(EscapeBuffer::kMinCapacity);
+  for (size_t i = 0; i < slots.size(); ++i) {
+    ASSERT_FALSE(b.buffer()->full());
+    EXPECT_TRUE(b.buffer()->Push(&slots[i], ObjectInfo(i)));
+  }
+  EXPECT_TRUE(b.buffer()->full());
+  EXPECT_EQ(b.buffer()->size(), EscapeBuffer::kMinCapacity);
+  // Nothing was absorbed, but the buffer is as small as it gets.
+  EXPECT_EQ(b.buffer()->NextCapacity(), EscapeBuffer::kMinCapacity);
+}
+
+TEST(AdaptiveEscapeBuffer, ShrinksWhenNothingIsAbsorbed) {
+  SizedBuffer b(EscapeBuffer::kCapacity);
+  std::vector<void*> slots(EscapeBuffer::kCapacity);
+  for (size_t i = 0; i < slots.size(); ++i) {
+    b.buffer()->Push(&slots[i], ObjectInfo(i));
+  }
+  EXPECT_EQ(b.buffer()->NextCapacity(), EscapeBuffer::kCapacity / 2);
+}
+
+TEST(AdaptiveEscapeBuffer, GrowsWhenPushesAreAbsorbed) {
+  SizedBuffer b(EscapeBuffer::kCapacity);
+  std::vector<void*> slots(EscapeBuffer::kCapacity / 2);
+  // Every location is stored to twice, and half the objects are freed.
+  for (int round = 0; round < 2; ++round) {
+    for (size_t i = 0; i < slots.size(); ++i) {
+      b.buffer()->Push(&slots[i], ObjectInfo(i));
+    }
+  }
+  for (size_t i = 0; i < slots.size(); i += 2) {
+    EscapeBuffer* buffer = b.buffer();
+    buffer->ForEachOfObject(ObjectInfo(i) >> 24,
+                            [&](escape_cache* e) { buffer->Poison(e); });
+  }
+  EXPECT_EQ(b.buffer()->NextCapacity(), 2 * EscapeBuffer::kCapacity);
+
+  b.buffer()->Clear();
+  EXPECT_TRUE(b.buffer()->empty());
+  EXPECT_EQ(b.buffer()->NextCapacity(), EscapeBuffer::kCapacity);
+}
+#endif
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,283 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/escape_chunk_allocator.h"
+
+#include <sys/mman.h>
+
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/system-alloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+void EscapeChunkAllocator::DeleteList(EscapeChunk* first, EscapeChunk* last,
+                                      size_t n) {
+#ifdef FORK_AWARE_PROTECTION
+  if (ABSL_PREDICT_FALSE(frozen_slabs_ != 0)) {
+    void* head = first;
+    void* tail = last;
+    n = DropInherited(*this, &head, &tail, n);
+    if (n == 0) return;
+    first = static_cast<EscapeChunk*>(head);
+    last = static_cast<EscapeChunk*>(tail);
+  }
+#endif
+  void* spill;
+  size_t spilled;
+  {
+    Shard& s = shards_[ShardIndex()];
+    absl::base_internal::SpinLockHolder h(&s.lock);
+    Next(last) = s.head;
+    s.head = first;
+    s.count += n;
+    if (ABSL_PREDICT_TRUE(s.count <= kMaxCached)) return;
+
+    // Keep the kBatch most recently freed chunks and spill the rest.
+    void* keep = s.head;
+    for (size_t i = 1; i < kBatch; ++i) keep = Next(keep);
+    spill = Next(keep);
+    Next(keep) = nullptr;
+    spilled = s.count - kBatch;
+    s.count = kBatch;
+  }
+  ReturnToSlabs(spill, spilled);
+}
+
+#ifdef FORK_AWARE_PROTECTION
+size_t EscapeChunkAllocator::DropInherited(const EscapeChunkAllocator& a,
+                                           void** first, void** last,
+                                           size_t n) {
+  void* head = nullptr;
+  void* tail = nullptr;
+  size_t kept = 0;
+  void* chunk = *first;
+  for (size_t i = 0; i < n; ++i) {
+    // last's link is not part of the list
+    void* next = i + 1 < n ? Next(chunk) : nullptr;
+    if (!a.Inherited(chunk)) {
+      if (tail == nullptr) {
+        head = chunk;
+      } else {
+        Next(tail) = chunk;
+      }
+      tail = chunk;
+      kept++;
+    }
+    chunk = next;
+  }
+  *first = head;
+  *last = tail;
+  return kept;
+}
+
+void EscapeChunkAllocator::LockForFork() {
+  for (Shard& s : shards_) s.lock.Lock();
+  lock_.Lock();
+}
+
+void EscapeChunkAllocator::UnlockForFork() {
+  lock_.Unlock();
+  for (Shard& s : shards_) s.lock.Unlock();
+}
+
+void EscapeChunkAllocator::FreezeForChild() {
+  frozen_slabs_ = next_slab_;
+  partial_ = nullptr;
+  empty_ = nullptr;
+  released_ = nullptr;
+  num_empty_ = 0;
+  // The chunks the shards cached stay counted as in use, like the inherited
+  // ones the child frees.
+  for (Shard& s : shards_) {
+    s.head = nullptr;
+    s.count = 0;
+  }
+}
+#endif
+
+AllocatorStats EscapeChunkAllocator::stats() const {
+  absl::base_internal::SpinLockHolder h(&lock_);
+  const size_t total = (touched_slabs_.load(std::memory_order_relaxed) -
+                        released_slabs_.load(std::memory_order_relaxed)) *
+                       kChunksPerSlab;
+  return {stats_.in_use, total};
+}
+
+size_t EscapeChunkAllocator::cached() const {
+  size_t n = 0;
+  for (const Shard& s : shards_) {
+    absl::base_internal::SpinLockHolder h(&s.lock);
+    n += s.count;
+  }
+  return n;
+}
+
+size_t EscapeChunkAllocator::ReleaseEmptySlabs() {
+  absl::base_internal::SpinLockHolder h(&lock_);
+  size_t released = 0;
+  while (empty_ != nullptr) {
+    Slab* slab = empty_;
+    Remove(slab);
+    num_empty_--;
+    ReleaseSlabLocked(slab);
+    released += kSlabSize;
+  }
+  return released;
+}
+
+void EscapeChunkAllocator::Refill(Shard* s) {
+  ASSERT(s->head == nullptr);
+  absl::base_internal::SpinLockHolder h(&lock_);
+  for (size_t i = 0; i < kBatch; ++i) {
+    void* chunk = AllocLocked();
+    Next(chunk) = s->head;
+    s->head = chunk;
+  }
+  s->count = kBatch;
+}
+
+void EscapeChunkAllocator::ReturnToSlabs(void* first, size_t n) {
+  absl::base_internal::SpinLockHolder h(&lock_);
+  while (n-- > 0) {
+    void* next = Next(first);
+    FreeLocked(first);
+    first = next;
+  }
+}
+
+void* EscapeChunkAllocator::AllocLocked() {
+  Slab* slab = partial_;
+  if (ABSL_PREDICT_FALSE(slab == nullptr)) {
+    if (empty_ != nullptr) {
+      slab = empty_;
+      num_empty_--;
+    } else if (released_ != nullptr) {
+      slab = released_;
+      released_slabs_.fetch_sub(1, std::memory_order_relaxed);
+    } else {
+      slab = NewSlabLocked();
+    }
+    Remove(slab);
+    Push(&partial_, slab);
+  }
+
+  void* chunk = slab->free;
+  if (chunk != nullptr) {
+    slab->free = Next(chunk);
+  } else {
+    ASSERT(slab->bump < kChunksPerSlab);
+    chunk = SlabBase(slab) + size_t{slab->bump++} * kChunkSize;
+  }
+  slab->in_use++;
+  stats_.in_use++;
+  if (slab->free == nullptr && slab->bump == kChunksPerSlab) Remove(slab);
+  return chunk;
+}
+
+void EscapeChunkAllocator::FreeLocked(void* chunk) {
+  Slab* slab = SlabOf(chunk);
+  ASSERT(slab->in_use > 0);
+  Next(chunk) = slab->free;
+  slab->free = chunk;
+  stats_.in_use--;
+  if (--slab->in_use == 0) {
+    Remove(slab);
+    if (num_empty_ < kMaxEmptySlabs) {
+      Push(&empty_, slab);
+      num_empty_++;
+    } else {
+      ReleaseSlabLocked(slab);
+    }
+  } else if (slab->list == nullptr) {
+    Push(&partial_, slab);
+  }
+}
+
+EscapeChunkAllocator::Slab* EscapeChunkAllocator::NewSlabLocked() {
+  if (ABSL_PREDICT_FALSE(region_ == nullptr)) {
+    // The slab headers follow the chunks in the same reservation.  Both are
+    // only backed as they are touched.
+    const size_t bytes = kRegionSize + kNumSlabs * sizeof(Slab);
+#ifdef ESCAPE_HUGEPAGE_METADATA
+    // Reserve a huge page more to align the region, so that its slabs (32
+    // to a huge page) and their headers can sit on huge pages.
+    const size_t reserve = bytes + kHugePageSize;
+#else
+    const size_t reserve = bytes;
+#endif
+    void* mem = mmap(nullptr, reserve, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      Crash(kCrash, __FILE__, __LINE__,
+            "failed to reserve the escape chunk region (bytes)", reserve);
+    }
+#ifdef ESCAPE_HUGEPAGE_METADATA
+    mem = reinterpret_cast<void*>(
+        (reinterpret_cast<uintptr_t>(mem) + kHugePageSize - 1) &
+        ~(kHugePageSize - 1));
+    madvise(mem, bytes, MADV_HUGEPAGE);
+#endif
+    if (kNumaPartitions > 1) BindMemory(mem, bytes, partition_);
+#ifdef COLD_TIER_BIND
+    // Replaces the partition's binding: the chunks are rarely walked.
+    if (ColdTierEscapes()) BindColdTier(mem, bytes);
+#endif
+    region_ = static_cast<char*>(mem);
+    slabs_ = reinterpret_cast<Slab*>(region_ + kRegionSize);
+    region_begin_.store(reinterpret_cast<uintptr_t>(region_),
+                        std::memory_order_relaxed);
+  }
+  if (ABSL_PREDICT_FALSE(next_slab_ == kNumSlabs)) {
+    Crash(kCrash, __FILE__, __LINE__, "escape chunk region exhausted");
+  }
+  Slab* slab = &slabs_[next_slab_++];
+  *slab = Slab{};
+  touched_slabs_.fetch_add(1, std::memory_order_relaxed);
+  return slab;
+}
+
+void EscapeChunkAllocator::ReleaseSlabLocked(Slab* slab) {
+  ASSERT(slab->in_use == 0);
+  slab->free = nullptr;
+  slab->bump = 0;
+  Push(&released_, slab);
+  released_slabs_.fetch_add(1, std::memory_order_relaxed);
+  SystemRelease(SlabBase(slab), kSlabSize);
+}
+
+void EscapeChunkAllocator::Push(Slab** list, Slab* slab) {
+  ASSERT(slab->list == nullptr);
+  slab->prev = nullptr;
+  slab->next = *list;
+  if (*list != nullptr) (*list)->prev = slab;
+  *list = slab;
+  slab->list = list;
+}
+
+void EscapeChunkAllocator::Remove(Slab* slab) {
+  if (slab->list == nullptr) return;
+  if (slab->prev != nullptr) {
+    slab->prev->next = slab->next;
+  } else {
+    *slab->list = slab->next;
+  }
+  if (slab->next != nullptr) slab->next->prev = slab->prev;
+  slab->list = nullptr;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,247 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Allocator for the chunks of escape chains.
+
+#ifndef TCMALLOC_ESCAPE_CHUNK_ALLOCATOR_H_
+#define TCMALLOC_ESCAPE_CHUNK_ALLOCATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/page_heap_allocator.h"
+#include "tcmalloc/span.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Escape chunks churn with every commit and poison, so they do not come from
+// the pageheap_lock protected PageHeapAllocators.  Chunks are carved from
+// kSlabSize slabs of one reserved region, and each slab counts its chunks in
+// use.  A slab whose chunks are all free is given back with SystemRelease()
+// once more than kMaxEmptySlabs slabs sit empty, so the metadata of an
+// escape spike does not stay resident for the life of the process.
+//
+// In front of the slabs sit kShards freelists, one per CPU (as in the free
+// quarantine) or, with RSEQ_MM_CID, per concurrency id, each holding at most
+// kMaxCached chunks.  A shard that runs dry or overflows moves kBatch chunks
+// from or to the slabs at once, so the slab lock is only taken once per
+// kBatch operations.
+//
+// Free chunks are linked through their first word, like the freelists of
+// PageHeapAllocator, which is also where struct escape keeps its next
+// pointer.
+//
+// With NUMA awareness there is one allocator per partition, and its region
+// is bound to the nodes of that partition like the heap memory whose
+// escapes it holds.
+class EscapeChunkAllocator {
+ public:
+  static constexpr size_t kSlabShift = 16;
+  static constexpr size_t kSlabSize = size_t{1} << kSlabShift;
+  static constexpr size_t kChunkSize = sizeof(EscapeChunk);
+  static constexpr size_t kChunksPerSlab = kSlabSize / kChunkSize;
+  // Address space reserved on first use; slabs are only backed once touched.
+  static constexpr size_t kRegionSize = size_t{1} << 34;
+  static constexpr size_t kNumSlabs = kRegionSize / kSlabSize;
+  static constexpr size_t kMaxEmptySlabs = 4;
+  static constexpr size_t kShards = 64;
+  static constexpr size_t kBatch = 32;
+  static constexpr size_t kMaxCached = 2 * kBatch;
+
+  constexpr EscapeChunkAllocator()
+      : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY),
+        region_(nullptr),
+        slabs_(nullptr),
+        next_slab_(0),
+        partial_(nullptr),
+        empty_(nullptr),
+        released_(nullptr),
+        num_empty_(0),
+        stats_{0, 0},
+        touched_slabs_(0),
+        released_slabs_(0),
+        region_begin_(0),
+        partition_(0),
+        shards_{} {}
+
+  // Sets the NUMA partition whose nodes the region is bound to.  Must be
+  // called before the first New().
+  void Init(size_t partition) { partition_ = partition; }
+
+  // Whether chunk was carved from this allocator's region.
+  bool Owns(const void* chunk) const {
+    const uintptr_t begin = region_begin_.load(std::memory_order_relaxed);
+    return begin != 0 &&
+           reinterpret_cast<uintptr_t>(chunk) - begin < kRegionSize;
+  }
+
+  // Returns an uninitialized chunk.  Crashes if the region is exhausted.
+  ABSL_ATTRIBUTE_RETURNS_NONNULL EscapeChunk* New()
+      ABSL_LOCKS_EXCLUDED(lock_) {
+    Shard& s = shards_[ShardIndex()];
+    absl::base_internal::SpinLockHolder h(&s.lock);
+    if (ABSL_PREDICT_FALSE(s.head == nullptr)) Refill(&s);
+    void* result = s.head;
+    s.head = Next(result);
+    s.count--;
+    return static_cast<EscapeChunk*>(result);
+  }
+
+  void Delete(EscapeChunk* p) ABSL_ATTRIBUTE_NONNULL()
+      ABSL_LOCKS_EXCLUDED(lock_) {
+    DeleteList(p, p, 1);
+  }
+
+  // Returns n chunks at once.  They must already be linked through their
+  // first words from first to last; last's link is overwritten.
+  void DeleteList(EscapeChunk* first, EscapeChunk* last, size_t n)
+      ABSL_ATTRIBUTE_NONNULL() ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Chunks handed out, including the ones cached by the shards.
+  AllocatorStats stats() const ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Chunks cached by the shards, free but counted as in use by stats().
+  size_t cached() const;
+
+  // Releases every empty slab kept for reuse, regardless of kMaxEmptySlabs.
+  // Returns the number of bytes released.
+  size_t ReleaseEmptySlabs() ABSL_LOCKS_EXCLUDED(lock_);
+
+#ifdef FORK_AWARE_PROTECTION
+  // Whether chunk was handed out before the process forked, in a child
+  // after FreezeForChild().  Such chunks are shared with the parent until
+  // written, so the child neither adds escapes to them nor reuses them.
+  bool Inherited(const void* chunk) const {
+    if (ABSL_PREDICT_TRUE(frozen_slabs_ == 0) || !Owns(chunk)) return false;
+    const uintptr_t offset = reinterpret_cast<uintptr_t>(chunk) -
+                             region_begin_.load(std::memory_order_relaxed);
+    return (offset >> kSlabShift) < frozen_slabs_;
+  }
+
+  // Held by the fork handlers across fork(), so that the child inherits the
+  // allocator in a consistent state and no lock held by a thread it lacks.
+  void LockForFork() ABSL_NO_THREAD_SAFETY_ANALYSIS;
+  void UnlockForFork() ABSL_NO_THREAD_SAFETY_ANALYSIS;
+
+  // In a child, under LockForFork(): forgets the free chunks and slabs it
+  // inherited, so that it only carves chunks from slabs of its own, and
+  // marks every slab touched so far as Inherited().
+  void FreezeForChild() ABSL_NO_THREAD_SAFETY_ANALYSIS;
+#endif
+
+  // Bytes of slabs ever touched, and of those currently released.
+  size_t touched_bytes() const {
+    return touched_slabs_.load(std::memory_order_relaxed) * kSlabSize;
+  }
+  size_t released_bytes() const {
+    return released_slabs_.load(std::memory_order_relaxed) * kSlabSize;
+  }
+
+ private:
+  struct Shard {
+    mutable absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    void* head ABSL_GUARDED_BY(lock) = nullptr;
+    size_t count ABSL_GUARDED_BY(lock) = 0;
+  };
+
+  // Bookkeeping of one slab, kept outside of it so that released slabs can
+  // be zeroed by the OS.
+  struct Slab {
+    void* free;       // freed chunks
+    uint32_t bump;    // chunks at or above bump were never handed out
+    uint32_t in_use;  // chunks handed out to the shards
+    Slab* prev;
+    Slab* next;
+    Slab** list;      // list the slab is on, nullptr if it is full
+  };
+
+  static void*& Next(void* chunk) { return *static_cast<void**>(chunk); }
+
+  static size_t ShardIndex() {
+    const int id = subtle::percpu::GetCurrentConcurrencyId();
+    return id < 0 ? 0 : static_cast<size_t>(id) % kShards;
+  }
+
+  char* SlabBase(const Slab* slab) const {
+    return region_ + (slab - slabs_) * kSlabSize;
+  }
+  Slab* SlabOf(const void* chunk) const {
+    const char* p = static_cast<const char*>(chunk);
+    return slabs_ + ((p - region_) >> kSlabShift);
+  }
+
+  // Moves kBatch chunks from the slabs into s.
+  void Refill(Shard* s) ABSL_EXCLUSIVE_LOCKS_REQUIRED(s->lock)
+      ABSL_LOCKS_EXCLUDED(lock_);
+#ifdef FORK_AWARE_PROTECTION
+  // Unlinks the Inherited() chunks from the n linked from *first, updating
+  // *first and *last, and returns how many are left.
+  static size_t DropInherited(const EscapeChunkAllocator& a, void** first,
+                              void** last, size_t n);
+#endif
+  // Returns the n chunks linked from first to their slabs.
+  void ReturnToSlabs(void* first, size_t n) ABSL_LOCKS_EXCLUDED(lock_);
+
+  void* AllocLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void FreeLocked(void* chunk) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  Slab* NewSlabLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void ReleaseSlabLocked(Slab* slab) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  static void Push(Slab** list, Slab* slab);
+  static void Remove(Slab* slab);
+
+  mutable absl::base_internal::SpinLock lock_;
+  // Written once under lock_ before any chunk is handed out.
+  char* region_;
+  Slab* slabs_;
+  size_t next_slab_ ABSL_GUARDED_BY(lock_);
+  // Slabs with free chunks and some in use.
+  Slab* partial_ ABSL_GUARDED_BY(lock_);
+  // Backed slabs without chunks in use.
+  Slab* empty_ ABSL_GUARDED_BY(lock_);
+  // Released slabs; their chunks are handed out from bump again.
+  Slab* released_ ABSL_GUARDED_BY(lock_);
+  size_t num_empty_ ABSL_GUARDED_BY(lock_);
+  AllocatorStats stats_ ABSL_GUARDED_BY(lock_);
+  std::atomic<size_t> touched_slabs_;
+  std::atomic<size_t> released_slabs_;
+  // region_ for Owns(), which runs without lock_.
+  std::atomic<uintptr_t> region_begin_;
+  size_t partition_;
+#ifdef FORK_AWARE_PROTECTION
+  // Slabs touched before the last fork; written by the child's fork handler
+  // before it has other threads.
+  size_t frozen_slabs_ = 0;
+#endif
+  Shard shards_[kShards];
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ESCAPE_CHUNK_ALLOCATOR_H_
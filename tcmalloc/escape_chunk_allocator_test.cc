@@ -0,0 +1,110 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/escape_chunk_allocator.h"
+
+#include <set>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using Allocator = EscapeChunkAllocator;
+
+// Upper bound of the chunks the per-CPU shards may keep.
+constexpr size_t kMaxShardChunks = Allocator::kShards * Allocator::kMaxCached;
+
+TEST(EscapeChunkAllocator, DistinctChunks) {
+  Allocator alloc;
+  std::set<EscapeChunk*> seen;
+  std::vector<EscapeChunk*> chunks;
+  for (int i = 0; i < 10000; ++i) {
+    EscapeChunk* c = alloc.New();
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(c) % sizeof(EscapeChunk), 0);
+    EXPECT_TRUE(seen.insert(c).second);
+    chunks.push_back(c);
+  }
+  EXPECT_GE(alloc.stats().in_use, chunks.size());
+  for (EscapeChunk* c : chunks) alloc.Delete(c);
+  EXPECT_LE(alloc.stats().in_use, kMaxShardChunks);
+}
+
+TEST(EscapeChunkAllocator, ReleasesEmptySlabs) {
+  Allocator alloc;
+  constexpr size_t kChunks = 64 * Allocator::kChunksPerSlab;
+  std::vector<EscapeChunk*> chunks;
+  for (size_t i = 0; i < kChunks; ++i) chunks.push_back(alloc.New());
+  EXPECT_GE(alloc.touched_bytes(), kChunks * sizeof(EscapeChunk));
+  EXPECT_EQ(alloc.released_bytes(), 0);
+
+  // Hand everything back as one list, like a span teardown does.
+  for (size_t i = 0; i + 1 < kChunks; ++i) {
+    *reinterpret_cast<EscapeChunk**>(chunks[i]) = chunks[i + 1];
+  }
+  alloc.DeleteList(chunks.front(), chunks.back(), kChunks);
+  EXPECT_LE(alloc.stats().in_use, kMaxShardChunks);
+  EXPECT_GE(alloc.released_bytes(),
+            alloc.touched_bytes() -
+                (Allocator::kMaxEmptySlabs + 1) * Allocator::kSlabSize -
+                kMaxShardChunks * sizeof(EscapeChunk));
+
+  // Released slabs are reused before new ones are touched.  Chunks cached
+  // by the shards of other CPUs may cost one more slab.
+  const size_t touched = alloc.touched_bytes();
+  for (size_t i = 0; i < kChunks; ++i) chunks[i] = alloc.New();
+  EXPECT_LE(alloc.touched_bytes(), touched + Allocator::kSlabSize);
+  EXPECT_LT(alloc.released_bytes(), touched);
+}
+
+#ifdef FORK_AWARE_PROTECTION
+TEST(EscapeChunkAllocator, ChildLeavesInheritedChunks) {
+  Allocator alloc;
+  std::vector<EscapeChunk*> inherited;
+  for (int i = 0; i < 100; ++i) inherited.push_back(alloc.New());
+  EscapeChunk* freed = inherited.back();
+  inherited.pop_back();
+  alloc.Delete(freed);
+
+  // What the fork handlers do in the child.
+  alloc.LockForFork();
+  alloc.FreezeForChild();
+  alloc.UnlockForFork();
+  for (EscapeChunk* c : inherited) EXPECT_TRUE(alloc.Inherited(c));
+  EXPECT_TRUE(alloc.Inherited(freed));
+
+  // Freeing an inherited chunk does not write to it.
+  EscapeChunk* c = inherited.front();
+  void* const kMarker = &inherited;
+  *reinterpret_cast<void**>(c) = kMarker;
+  alloc.Delete(c);
+  EXPECT_EQ(*reinterpret_cast<void**>(c), kMarker);
+
+  // New chunks come from slabs of the child's own.
+  const std::set<EscapeChunk*> old(inherited.begin(), inherited.end());
+  for (int i = 0; i < 1000; ++i) {
+    EscapeChunk* fresh = alloc.New();
+    EXPECT_FALSE(alloc.Inherited(fresh));
+    EXPECT_EQ(old.count(fresh), 0);
+    EXPECT_NE(fresh, freed);
+  }
+}
+#endif
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,68 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/escape_filter.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "absl/numeric/bits.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/parameters.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Smallest table worth mapping: 64 sets, a few cache lines.
+static constexpr size_t kMinEscapeFilterSets = 64;
+
+std::atomic<uint64_t>* EscapeFilter::SlowInit() {
+  if (disabled_.load(std::memory_order_relaxed)) return nullptr;
+
+  absl::base_internal::SpinLockHolder h(&lock_);
+  std::atomic<uint64_t>* table = table_.load(std::memory_order_acquire);
+  if (table != nullptr) return table;
+
+  const int64_t requested = Parameters::escape_l2_cache_size();
+  if (requested <= 0) {
+    disabled_.store(true, std::memory_order_relaxed);
+    return nullptr;
+  }
+  const size_t sets =
+      std::max(absl::bit_floor(static_cast<uint64_t>(requested) / kWays),
+               static_cast<uint64_t>(kMinEscapeFilterSets));
+  const size_t bytes = sets * kWays * sizeof(uint64_t);
+  // Anonymous memory is zero filled, and zero is the empty entry.  Pages are
+  // only backed once the filter touches them.
+  void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    Log(kLog, __FILE__, __LINE__,
+        "failed to map the escape filter, disabling it (bytes)", bytes);
+    disabled_.store(true, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  num_sets_ = sets;
+  set_shift_ = 64 - absl::bit_width(sets - 1);
+  table = reinterpret_cast<std::atomic<uint64_t>*>(mem);
+  table_.store(table, std::memory_order_release);
+  return table;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,146 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Process-wide filter of escapes that were already committed (the "L2"
+// escape cache behind the per-thread escape buffers).
+
+#ifndef TCMALLOC_ESCAPE_FILTER_H_
+#define TCMALLOC_ESCAPE_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Remembers (loc, object) pairs whose escape has been committed, so that
+// flush_escape() can skip the descriptor lookup and commit when the same
+// location escapes the same object again.
+//
+// The table is set-associative with kWays entries per set and FIFO
+// replacement within a set.  Each entry packs the low 32 bits of the location
+// and of the object start into one word, so lookups race with inserts from
+// other threads without ever observing a torn entry.  The table is mmapped
+// on first use with Parameters::escape_l2_cache_size() entries; a size of
+// zero disables the filter, and later changes of the parameter have no
+// effect.
+//
+// poison_escapes() erases the entries of every location it poisons: the slot
+// of a freed object is reused at the same address, and a stale entry would
+// otherwise hide the first escape to the new object.
+class EscapeFilter {
+ public:
+  static constexpr size_t kWays = 4;
+
+  constexpr EscapeFilter()
+      : table_(nullptr),
+        set_shift_(0),
+        num_sets_(0),
+        disabled_(false),
+        lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY) {}
+
+  // Returns true if loc -> obj_start was recently committed.
+  bool ABSL_ATTRIBUTE_ALWAYS_INLINE Contains(uintptr_t loc,
+                                             uintptr_t obj_start) {
+    std::atomic<uint64_t>* set = Set(loc);
+    if (ABSL_PREDICT_FALSE(set == nullptr)) return false;
+    const uint64_t key = Key(loc, obj_start);
+    for (size_t i = 0; i < kWays; ++i) {
+      if (set[i].load(std::memory_order_relaxed) == key) return true;
+    }
+    return false;
+  }
+
+  // Records that loc -> obj_start was committed, evicting the oldest entry of
+  // its set.
+  void Insert(uintptr_t loc, uintptr_t obj_start) {
+    std::atomic<uint64_t>* set = Set(loc);
+    if (ABSL_PREDICT_FALSE(set == nullptr)) return;
+    for (size_t i = kWays - 1; i > 0; --i) {
+      set[i].store(set[i - 1].load(std::memory_order_relaxed),
+                   std::memory_order_relaxed);
+    }
+    set[0].store(Key(loc, obj_start), std::memory_order_relaxed);
+  }
+
+  // Prefetches the set of loc, for a Contains(), Insert() or Erase() of it
+  // shortly after.  Does nothing before the table is mapped.
+  void ABSL_ATTRIBUTE_ALWAYS_INLINE Prefetch(uintptr_t loc) const {
+    std::atomic<uint64_t>* table = table_.load(std::memory_order_relaxed);
+    if (table == nullptr) return;
+    __builtin_prefetch(table + SetIndex(loc) * kWays, 0, 3);
+  }
+
+  // Forgets loc -> obj_start, if present.
+  void Erase(uintptr_t loc, uintptr_t obj_start) {
+    std::atomic<uint64_t>* table = table_.load(std::memory_order_acquire);
+    if (table == nullptr) return;
+    std::atomic<uint64_t>* set = table + SetIndex(loc) * kWays;
+    uint64_t key = Key(loc, obj_start);
+    for (size_t i = 0; i < kWays; ++i) {
+      uint64_t expected = key;
+      set[i].compare_exchange_strong(expected, 0, std::memory_order_relaxed);
+    }
+  }
+
+  // Number of entries of the mapped table (0 if not mapped yet or disabled).
+  size_t entries() const { return num_sets_ * kWays; }
+  size_t mapped_bytes() const { return entries() * sizeof(uint64_t); }
+
+ private:
+  static uint64_t Key(uintptr_t loc, uintptr_t obj_start) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(loc)) << 32) |
+           static_cast<uint32_t>(obj_start);
+  }
+
+  size_t SetIndex(uintptr_t loc) const {
+    // locs are pointer aligned; multiplicative hashing spreads the rest.
+    return ((loc >> 3) * 0x9E3779B97F4A7C15ull) >> set_shift_;
+  }
+
+  std::atomic<uint64_t>* ABSL_ATTRIBUTE_ALWAYS_INLINE Set(uintptr_t loc) {
+    std::atomic<uint64_t>* table = table_.load(std::memory_order_acquire);
+    if (ABSL_PREDICT_FALSE(table == nullptr)) {
+      table = SlowInit();
+      if (table == nullptr) return nullptr;
+    }
+    return table + SetIndex(loc) * kWays;
+  }
+
+  // Maps the table on first use; returns nullptr if the filter is disabled or
+  // the mapping failed.
+  ABSL_ATTRIBUTE_NOINLINE std::atomic<uint64_t>* SlowInit();
+
+  std::atomic<std::atomic<uint64_t>*> table_;
+  // Written before table_ is published, read only after it is.
+  int set_shift_;
+  size_t num_sets_;
+  std::atomic<bool> disabled_;
+  absl::base_internal::SpinLock lock_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ESCAPE_FILTER_H_
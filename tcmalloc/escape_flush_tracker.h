@@ -0,0 +1,191 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Time series of escape buffer flushes.
+
+#ifndef TCMALLOC_ESCAPE_FLUSH_TRACKER_H_
+#define TCMALLOC_ESCAPE_FLUSH_TRACKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/timeseries_tracker.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Counts the flushes of escape buffers per epoch: how many records they
+// committed to the escape lists, how many they dropped because the escaped
+// location no longer pointed into the recorded object (or the object was
+// freed while staged), and the longest flush.  Flush storms line up with
+// latency spikes of the threads that run them, so GetStats() prints the
+// epochs next to each other to tell whether a larger buffer would help.
+//
+// Flushes run on many threads at once, so reports are serialized by a lock
+// of their own; it is taken once per flush of up to EscapeBuffer::kCapacity
+// records.
+template <size_t kEpochs = 60>
+class EscapeFlushTracker {
+ public:
+  struct Flush {
+    size_t records = 0;
+    size_t committed = 0;
+    size_t stale = 0;
+    // Records skipped because EscapeFilter already had them committed; not
+    // tracked per epoch.
+    size_t filtered = 0;
+    int64_t cycles = 0;
+  };
+
+  // Sums of all flushes since start, for MallocExtension::GetProperties().
+  struct Totals {
+    size_t flushes = 0;
+    size_t records = 0;
+    size_t committed = 0;
+    size_t stale = 0;
+    int64_t cycles = 0;
+  };
+
+  explicit EscapeFlushTracker(Clock clock, absl::Duration w)
+      : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY),
+        clock_(clock),
+        epoch_length_(w / kEpochs),
+        tracker_(clock, w) {}
+
+  // Not copyable or movable
+  EscapeFlushTracker(const EscapeFlushTracker&) = delete;
+  EscapeFlushTracker& operator=(const EscapeFlushTracker&) = delete;
+
+  void Report(const Flush& flush) ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    tracker_.Report(flush);
+    totals_.flushes++;
+    totals_.records += flush.records;
+    totals_.committed += flush.committed;
+    totals_.stale += flush.stale;
+    totals_.cycles += flush.cycles;
+  }
+
+  Totals totals() ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    return totals_;
+  }
+
+  void Print(Printer* out) ABSL_LOCKS_EXCLUDED(lock_);
+  void PrintInPbtxt(PbtxtRegion* region) ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  struct FlushEntry {
+    size_t flushes = 0;
+    size_t records = 0;
+    size_t committed = 0;
+    size_t stale = 0;
+    int64_t max_cycles = 0;
+
+    static FlushEntry Nil() { return FlushEntry(); }
+
+    void Report(const Flush& f) {
+      flushes++;
+      records += f.records;
+      committed += f.committed;
+      stale += f.stale;
+      max_cycles = std::max(max_cycles, f.cycles);
+    }
+
+    bool empty() const { return flushes == 0; }
+
+    void Add(const FlushEntry& e) {
+      flushes += e.flushes;
+      records += e.records;
+      committed += e.committed;
+      stale += e.stale;
+      max_cycles = std::max(max_cycles, e.max_cycles);
+    }
+  };
+
+  double ToMicroseconds(int64_t cycles) const {
+    return cycles * 1e6 / clock_.freq();
+  }
+
+  absl::base_internal::SpinLock lock_;
+  const Clock clock_;
+  const absl::Duration epoch_length_;
+  TimeSeriesTracker<FlushEntry, Flush, kEpochs> tracker_ ABSL_GUARDED_BY(lock_);
+  Totals totals_ ABSL_GUARDED_BY(lock_);
+};
+
+template <size_t kEpochs>
+void EscapeFlushTracker<kEpochs>::Print(Printer* out) {
+  absl::base_internal::SpinLockHolder h(&lock_);
+  tracker_.UpdateTimeBase();
+
+  FlushEntry total;
+  tracker_.Iter([&](size_t, int64_t, const FlushEntry& e) { total.Add(e); },
+                tracker_.kSkipEmptyEntries);
+  out->printf(
+      "ESCAPE FLUSHES: %u flushes, %u records, %u committed, %u stale, "
+      "max %.1f us in the last %.0f s\n",
+      total.flushes, total.records, total.committed, total.stale,
+      ToMicroseconds(total.max_cycles),
+      absl::ToDoubleSeconds(epoch_length_ * kEpochs));
+
+  const double epoch_seconds = absl::ToDoubleSeconds(epoch_length_);
+  tracker_.IterBackwards(
+      [&](size_t offset, int64_t, const FlushEntry& e) {
+        if (e.empty()) return;
+        out->printf(
+            "ESCAPE FLUSHES: at t-%.0fs: %6u flushes, %9u records, "
+            "%9u committed, %9u stale, max %9.1f us\n",
+            offset * epoch_seconds, e.flushes, e.records, e.committed,
+            e.stale, ToMicroseconds(e.max_cycles));
+      },
+      -1);
+}
+
+template <size_t kEpochs>
+void EscapeFlushTracker<kEpochs>::PrintInPbtxt(PbtxtRegion* region) {
+  absl::base_internal::SpinLockHolder h(&lock_);
+  tracker_.UpdateTimeBase();
+
+  const int64_t epoch_ms = absl::ToInt64Milliseconds(epoch_length_);
+  region->PrintI64("epoch_length_ms", epoch_ms);
+  tracker_.IterBackwards(
+      [&](size_t offset, int64_t, const FlushEntry& e) {
+        if (e.empty()) return;
+        auto epoch = region->CreateSubRegion("epoch");
+        epoch.PrintI64("age_ms", offset * epoch_ms);
+        epoch.PrintI64("flushes", e.flushes);
+        epoch.PrintI64("records", e.records);
+        epoch.PrintI64("committed", e.committed);
+        epoch.PrintI64("stale", e.stale);
+        epoch.PrintDouble("max_flush_us", ToMicroseconds(e.max_cycles));
+      },
+      -1);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ESCAPE_FLUSH_TRACKER_H_
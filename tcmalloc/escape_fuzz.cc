@@ -0,0 +1,224 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Drives random interleavings of malloc, __escape, plain stores, free,
+// realloc and bounds checks, and checks after every step that:
+//   * escaping a pointer into a live object is tracked (returns 0);
+//   * no escaped slot changes while its object is live;
+//   * freeing an object poisons exactly the slots that still point into it;
+//   * realloc() either hands the slots over to the new object or poisons
+//     them;
+//   * checks inside an object pass and checks past its chunk fail.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tcmalloc/inline_check.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/poison.h"
+#include "tcmalloc/tcmalloc.h"
+
+namespace {
+
+using tcmalloc::MallocExtension;
+using tcmalloc::tcmalloc_internal::IsPoisoned;
+using tcmalloc::tcmalloc_internal::kPoisonAddressMask;
+using tcmalloc::tcmalloc_internal::PoisonedAddress;
+
+constexpr size_t kObjects = 16;
+constexpr size_t kSlots = 64;
+
+// Frees poison the slots of the object right away, rather than when the
+// object leaves a queue, or leave stale pointers to their tags.
+#if defined(FREE_QUARANTINE) || defined(REMOTE_FREE_QUEUE) || \
+    defined(POINTER_TAGGING)
+constexpr bool kPoisonsOnFree = false;
+#else
+constexpr bool kPoisonsOnFree = true;
+#endif
+
+enum Op { kMalloc, kEscape, kStore, kFree, kRealloc, kCheck, kNumOps };
+
+struct Object {
+  char* ptr = nullptr;
+  size_t size = 0;
+};
+
+// What an escaped slot must hold: objects[object].ptr + offset.
+struct Slot {
+  int object = -1;
+  size_t offset = 0;
+};
+
+class Fuzzer {
+ public:
+  Fuzzer() {
+    slots_ =
+        static_cast<void**>(TCMallocInternalCalloc(kSlots, sizeof(void*)));
+    CHECK_CONDITION(slots_ != nullptr);
+  }
+
+  ~Fuzzer() {
+    for (size_t i = 0; i < kObjects; ++i) Free(i);
+    TCMallocInternalFree(slots_);
+  }
+
+  void Step(const uint8_t* d) {
+    const size_t i = d[1] % kObjects;
+    const size_t value = (size_t{d[2]} << 8 | d[3]);
+    switch (d[0] % kNumOps) {
+      case kMalloc: {
+        Free(i);
+        // Up to 4 MiB, so large spans are escaped into too.
+        const size_t size = (value + 1) << (d[1] & 0x80 ? 6 : 0);
+        objects_[i].ptr = static_cast<char*>(TCMallocInternalMalloc(size));
+        CHECK_CONDITION(objects_[i].ptr != nullptr);
+        objects_[i].size = size;
+        break;
+      }
+      case kEscape: {
+        if (objects_[i].ptr == nullptr) break;
+        const size_t s = d[2] % kSlots;
+        const size_t offset = d[3] % objects_[i].size;
+        char* p = objects_[i].ptr + offset;
+        // The slot loses its old escape by being overwritten.
+        CHECK_CONDITION(TCMallocInternalEscape(&slots_[s], p) == 0);
+        slots_[s] = p;
+        slot_state_[s] = {static_cast<int>(i), offset};
+        break;
+      }
+      case kStore: {
+        // Overwrites a slot without escaping, with nullptr or a pointer
+        // outside the heap.
+        const size_t s = d[2] % kSlots;
+        void* p = d[3] & 1 ? static_cast<void*>(&outside_) : nullptr;
+        if (p != nullptr) TCMallocInternalEscape(&slots_[s], p);
+        slots_[s] = p;
+        slot_state_[s] = {};
+        break;
+      }
+      case kFree:
+        Free(i);
+        break;
+      case kRealloc:
+        Realloc(i, value + 1);
+        break;
+      case kCheck:
+        Check(i, value);
+        break;
+    }
+    Verify();
+  }
+
+ private:
+  // Every escaped slot still holds what was stored into it.
+  void Verify() const {
+    for (size_t s = 0; s < kSlots; ++s) {
+      const Slot& slot = slot_state_[s];
+      if (slot.object < 0) continue;
+      CHECK_CONDITION(slots_[s] ==
+                      objects_[slot.object].ptr + slot.offset);
+    }
+  }
+
+  void Free(size_t i) {
+    Object& obj = objects_[i];
+    if (obj.ptr == nullptr) return;
+    TCMallocInternalFree(obj.ptr);
+    for (size_t s = 0; s < kSlots; ++s) {
+      Slot& slot = slot_state_[s];
+      if (slot.object != static_cast<int>(i)) continue;
+      ExpectPoisoned(s, obj.ptr + slot.offset);
+      slot = {};
+    }
+    obj = {};
+  }
+
+  void Realloc(size_t i, size_t size) {
+    Object& obj = objects_[i];
+    if (obj.ptr == nullptr) return;
+    char* old_ptr = obj.ptr;
+    char* new_ptr = static_cast<char*>(TCMallocInternalRealloc(old_ptr, size));
+    CHECK_CONDITION(new_ptr != nullptr);
+    obj = {new_ptr, size};
+    if (new_ptr == old_ptr) return;
+    for (size_t s = 0; s < kSlots; ++s) {
+      Slot& slot = slot_state_[s];
+      if (slot.object != static_cast<int>(i)) continue;
+      if (slot.offset < size && slots_[s] == new_ptr + slot.offset) {
+        continue;  // Handed over to the new object.
+      }
+      ExpectPoisoned(s, old_ptr + slot.offset);
+      slot = {};
+    }
+  }
+
+  void ExpectPoisoned(size_t s, const char* was) const {
+    const uintptr_t v = reinterpret_cast<uintptr_t>(slots_[s]);
+    if (kPoisonsOnFree &&
+        MallocExtension::GetProtectionPolicy() ==
+            MallocExtension::ProtectionPolicy::kCrash) {
+      CHECK_CONDITION(IsPoisoned(v));
+    }
+    if (IsPoisoned(v)) {
+      CHECK_CONDITION(PoisonedAddress(v) ==
+                      (reinterpret_cast<uintptr_t>(was) & kPoisonAddressMask));
+    } else {
+      CHECK_CONDITION(slots_[s] == was);
+    }
+  }
+
+  void Check(size_t i, size_t value) {
+    Object& obj = objects_[i];
+    if (obj.ptr == nullptr) return;
+    const size_t offset = value % obj.size;
+    char* p = obj.ptr + offset;
+    CHECK_CONDITION(TCMallocInternalGepCheckBoundary(obj.ptr, p, 1) == 0);
+    CHECK_CONDITION(TCMallocInternalBcCheckBoundary(p, obj.size - offset) ==
+                    0);
+    const TCMallocChunkRange range = TCMallocInternalChunkRange(p);
+    CHECK_CONDITION(range.start <= reinterpret_cast<uintptr_t>(obj.ptr));
+    CHECK_CONDITION(reinterpret_cast<uintptr_t>(obj.ptr) + obj.size <=
+                    range.end);
+
+    // Past the chunk, with the error reported rather than fatal.
+    const MallocExtension::ProtectionPolicy policy =
+        MallocExtension::GetProtectionPolicy();
+    MallocExtension::SetProtectionPolicy(
+        MallocExtension::ProtectionPolicy::kReportOnly);
+    char* end = reinterpret_cast<char*>(range.end);
+    CHECK_CONDITION(TCMallocInternalGepCheckBoundary(obj.ptr, end, 1) != 0);
+    CHECK_CONDITION(TCMallocInternalBcCheckBoundary(
+                        reinterpret_cast<void*>(range.start),
+                        range.end - range.start + 1) != 0);
+    MallocExtension::SetProtectionPolicy(policy);
+  }
+
+  Object objects_[kObjects];
+  void** slots_;
+  Slot slot_state_[kSlots];
+  char outside_ = 0;
+};
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* d, size_t size) {
+  Fuzzer fuzzer;
+  for (; size >= 4; d += 4, size -= 4) {
+    fuzzer.Step(d);
+  }
+  return 0;
+}
@@ -0,0 +1,98 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/escape_location.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/proc_maps.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Stack size assumed for the main thread when its limit is unlimited.
+static constexpr uintptr_t kDefaultMainStackSize = uintptr_t{8} << 20;
+
+void GlobalRanges::Add(uintptr_t start, uintptr_t end) {
+  const size_t n = num_ranges_.load(std::memory_order_relaxed);
+  if (n > 0 && ranges_[n - 1].end == start) {
+    ranges_[n - 1].end = end;
+    return;
+  }
+  if (n == kMaxRanges) return;
+  ranges_[n] = {start, end};
+  num_ranges_.store(n + 1, std::memory_order_release);
+}
+
+void GlobalRanges::Init() {
+  ProcMapsIterator::Buffer buffer;
+  ProcMapsIterator it(0, &buffer);
+  if (!it.Valid()) return;
+
+  uint64_t start, end, offset;
+  int64_t inode;
+  char *flags, *filename;
+  dev_t dev;
+  // End of the last writable mapping of a file, where its .bss may follow.
+  uint64_t file_data_end = 0;
+  while (it.NextExt(&start, &end, &flags, &offset, &inode, &filename, &dev)) {
+    if (strcmp(filename, "[stack]") == 0) {
+      struct rlimit limit;
+      uintptr_t size = kDefaultMainStackSize;
+      if (getrlimit(RLIMIT_STACK, &limit) == 0 &&
+          limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < end) {
+        size = limit.rlim_cur;
+      }
+      main_stack_hi_ = end;
+      main_stack_lo_ = end - size < start ? end - size : start;
+    }
+    const bool writable = flags[0] == 'r' && flags[1] == 'w';
+    if (writable && inode != 0) {
+      Add(start, end);
+      file_data_end = end;
+    } else if (writable && filename[0] == '\0' && start == file_data_end) {
+      Add(start, end);
+    }
+    if (!writable || inode == 0) file_data_end = 0;
+  }
+}
+
+bool LookupThreadStack(const GlobalRanges& globals, uintptr_t* lo,
+                       uintptr_t* hi) {
+  if (syscall(SYS_gettid) == getpid()) {
+    *lo = globals.main_stack_lo();
+    *hi = globals.main_stack_hi();
+    return *lo < *hi;
+  }
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) return false;
+  void* addr;
+  size_t size;
+  const bool found = pthread_attr_getstack(&attr, &addr, &size) == 0;
+  pthread_attr_destroy(&attr);
+  if (!found) return false;
+  *lo = reinterpret_cast<uintptr_t>(addr);
+  *hi = *lo + size;
+  return true;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
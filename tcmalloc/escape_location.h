@@ -0,0 +1,170 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Classification of the locations escapes are recorded through, and the
+// per-thread buffer that stages escapes through the thread's own stack.
+
+#ifndef TCMALLOC_ESCAPE_LOCATION_H_
+#define TCMALLOC_ESCAPE_LOCATION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Where the location of an escape lives.  Each kind has its own policy in
+// do_escape(): stack locations are staged in the thread's
+// StackEscapeBuffer, the others in its EscapeBuffer.
+enum class EscapeLocation : uint8_t {
+  kHeap,    // memory covered by the page map
+  kStack,   // the calling thread's stack
+  kGlobal,  // the writable data of the program or a library
+  kOther,   // anything else, such as another thread's stack
+};
+
+// Address ranges of the writable data of the program and its libraries: the
+// writable mappings of files and the anonymous mapping right after each,
+// which holds its .bss.  Read from /proc/self/maps once by Init(), which also
+// records the main thread's stack; lookups are lock-free.
+class GlobalRanges {
+ public:
+  static constexpr size_t kMaxRanges = 64;
+
+  constexpr GlobalRanges()
+      : ranges_{}, num_ranges_(0), main_stack_lo_(0), main_stack_hi_(0) {}
+
+  // Must not run concurrently with itself.  Ranges past kMaxRanges are
+  // dropped, and their locations classified as kOther.
+  void Init();
+
+  bool Contains(uintptr_t addr) const {
+    const size_t n = num_ranges_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; ++i) {
+      if (addr - ranges_[i].start < ranges_[i].end - ranges_[i].start) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t num_ranges() const {
+    return num_ranges_.load(std::memory_order_relaxed);
+  }
+
+  // Bounds of the main thread's stack, up to its size limit below the top
+  // of its mapping; [0, 0) if unknown.
+  uintptr_t main_stack_lo() const { return main_stack_lo_; }
+  uintptr_t main_stack_hi() const { return main_stack_hi_; }
+
+ private:
+  struct Range {
+    uintptr_t start;
+    uintptr_t end;
+  };
+
+  // Appends [start, end), merging it into the last range if they touch.
+  void Add(uintptr_t start, uintptr_t end);
+
+  Range ranges_[kMaxRanges];
+  std::atomic<size_t> num_ranges_;
+  uintptr_t main_stack_lo_;
+  uintptr_t main_stack_hi_;
+};
+
+// Looks up the bounds of the calling thread's stack.  The main thread's come
+// from `globals`, since pthread_getattr_np() would read /proc and allocate
+// for it.  Returns false if they are unknown.
+bool LookupThreadStack(const GlobalRanges& globals, uintptr_t* lo,
+                       uintptr_t* hi);
+
+// Escapes staged through slots of the owning thread's stack.  A slot below
+// the stack pointer belongs to a frame that has returned, so Truncate()
+// drops its records without them ever reaching an escape chain; only those
+// still live when the thread next commits its escapes are moved to its
+// EscapeBuffer.  Like EscapeBuffer, it is owned by one thread and needs no
+// synchronization, and records keep the ptr_info format of escape_cache.
+class StackEscapeBuffer {
+ public:
+  static constexpr size_t kCapacity = 32;
+
+  struct Record {
+    void** loc;
+    size_t ptr;
+  };
+
+  constexpr StackEscapeBuffer() : records_{}, size_(0) {}
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  bool full() const { return size_ == kCapacity; }
+
+  // Stages ptr_info for loc, replacing a record already staged for loc.
+  // Returns false if the buffer is full and loc is not in it.
+  bool ABSL_ATTRIBUTE_ALWAYS_INLINE Push(void** loc, size_t ptr_info) {
+    for (size_t i = 0; i < size_; ++i) {
+      if (records_[i].loc == loc) {
+        records_[i].ptr = ptr_info;
+        return true;
+      }
+    }
+    if (ABSL_PREDICT_FALSE(full())) return false;
+    records_[size_++] = {loc, ptr_info};
+    return true;
+  }
+
+  // Drops the records of slots below sp, whose frames have returned, and
+  // returns how many were dropped.
+  size_t Truncate(uintptr_t sp) {
+    size_t kept = 0;
+    for (size_t i = 0; i < size_; ++i) {
+      if (reinterpret_cast<uintptr_t>(records_[i].loc) >= sp) {
+        records_[kept++] = records_[i];
+      }
+    }
+    const size_t dropped = size_ - kept;
+    size_ = kept;
+    return dropped;
+  }
+
+  // Calls f(r) for every record, and drops those for which it returns true.
+  template <typename F>
+  void RemoveIf(F f) {
+    size_t kept = 0;
+    for (size_t i = 0; i < size_; ++i) {
+      if (!f(records_[i])) records_[kept++] = records_[i];
+    }
+    size_ = kept;
+  }
+
+  void Clear() { size_ = 0; }
+
+ private:
+  Record records_[kCapacity];
+  size_t size_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ESCAPE_LOCATION_H_
@@ -0,0 +1,121 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/escape_location.h"
+
+#include <stdint.h>
+
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+int global_data = 1;
+int global_bss;
+
+TEST(GlobalRanges, ContainsGlobals) {
+  GlobalRanges ranges;
+  ranges.Init();
+  ASSERT_GT(ranges.num_ranges(), 0);
+  EXPECT_TRUE(ranges.Contains(reinterpret_cast<uintptr_t>(&global_data)));
+  EXPECT_TRUE(ranges.Contains(reinterpret_cast<uintptr_t>(&global_bss)));
+
+  int local = 0;
+  EXPECT_FALSE(ranges.Contains(reinterpret_cast<uintptr_t>(&local)));
+  auto heap = std::make_unique<int>(0);
+  EXPECT_FALSE(ranges.Contains(reinterpret_cast<uintptr_t>(heap.get())));
+}
+
+bool OnOwnStack(const GlobalRanges& ranges) {
+  uintptr_t lo, hi;
+  if (!LookupThreadStack(ranges, &lo, &hi)) return false;
+  int local = 0;
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(&local);
+  return lo <= addr && addr < hi;
+}
+
+TEST(LookupThreadStack, MainAndOtherThreads) {
+  GlobalRanges ranges;
+  ranges.Init();
+  EXPECT_TRUE(OnOwnStack(ranges));
+  bool other = false;
+  std::thread t([&] { other = OnOwnStack(ranges); });
+  t.join();
+  EXPECT_TRUE(other);
+}
+
+TEST(StackEscapeBuffer, PushReplacesSameLocation) {
+  StackEscapeBuffer buffer;
+  void* slots[2];
+  EXPECT_TRUE(buffer.Push(&slots[0], 1));
+  EXPECT_TRUE(buffer.Push(&slots[1], 2));
+  EXPECT_TRUE(buffer.Push(&slots[0], 3));
+  EXPECT_EQ(buffer.size(), 2);
+  size_t seen = 0;
+  buffer.RemoveIf([&](const StackEscapeBuffer::Record& r) {
+    if (r.loc == &slots[0]) EXPECT_EQ(r.ptr, 3);
+    ++seen;
+    return false;
+  });
+  EXPECT_EQ(seen, 2);
+}
+
+TEST(StackEscapeBuffer, Full) {
+  StackEscapeBuffer buffer;
+  void* slots[StackEscapeBuffer::kCapacity + 1];
+  for (size_t i = 0; i < StackEscapeBuffer::kCapacity; ++i) {
+    EXPECT_TRUE(buffer.Push(&slots[i], i));
+  }
+  EXPECT_TRUE(buffer.full());
+  EXPECT_FALSE(buffer.Push(&slots[StackEscapeBuffer::kCapacity], 0));
+  // a location already staged is still updated
+  EXPECT_TRUE(buffer.Push(&slots[0], 7));
+  buffer.Clear();
+  EXPECT_TRUE(buffer.empty());
+}
+
+TEST(StackEscapeBuffer, TruncateDropsSlotsBelow) {
+  StackEscapeBuffer buffer;
+  void* slots[8];
+  for (size_t i = 0; i < 8; ++i) buffer.Push(&slots[i], i);
+  EXPECT_EQ(buffer.Truncate(reinterpret_cast<uintptr_t>(&slots[5])), 5);
+  EXPECT_EQ(buffer.size(), 3);
+  buffer.RemoveIf([&](const StackEscapeBuffer::Record& r) {
+    EXPECT_GE(r.loc, &slots[5]);
+    return false;
+  });
+  EXPECT_EQ(buffer.Truncate(reinterpret_cast<uintptr_t>(&slots[0])), 0);
+}
+
+TEST(StackEscapeBuffer, RemoveIf) {
+  StackEscapeBuffer buffer;
+  void* slots[6];
+  for (size_t i = 0; i < 6; ++i) buffer.Push(&slots[i], i);
+  buffer.RemoveIf(
+      [](const StackEscapeBuffer::Record& r) { return r.ptr % 2 == 0; });
+  EXPECT_EQ(buffer.size(), 3);
+  buffer.RemoveIf([](const StackEscapeBuffer::Record& r) {
+    EXPECT_EQ(r.ptr % 2, 1);
+    return false;
+  });
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,104 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Per-thread cache of the spans recent escapes pointed into
+// (ESCAPE_SPAN_CACHE).
+
+#ifndef TCMALLOC_ESCAPE_SPAN_CACHE_H_
+#define TCMALLOC_ESCAPE_SPAN_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+class Span;
+
+// Consecutive escapes mostly point into the same few spans (the nodes of a
+// list being built, the children stored into an array), so each thread
+// remembers the spans of its last escapes and finds them again without the
+// page map walk.
+//
+// Entries are only valid while the spans they name are registered:
+// PageMap::UnregisterSizeClass(), UnregisterObjectSize() and ResizeObject()
+// bump a global epoch through Invalidate(), and a cache that sees a new
+// epoch drops all of its entries.
+class EscapeSpanCache {
+ public:
+  static constexpr size_t kEntries = 4;
+
+  constexpr EscapeSpanCache() : epoch_(0), next_(0), entries_{} {}
+
+  // Returns the cached span whose pages hold addr, or nullptr.  Entries
+  // inserted after a lookup belong to the epoch it saw, so a span resolved
+  // across an invalidation is dropped by the next Lookup().
+  Span* ABSL_ATTRIBUTE_ALWAYS_INLINE Lookup(uintptr_t addr) {
+    const uint64_t epoch = epoch_counter_.load(std::memory_order_acquire);
+    if (ABSL_PREDICT_FALSE(epoch != epoch_)) {
+      Reset(epoch);
+      return nullptr;
+    }
+    for (const Entry& e : entries_) {
+      // Empty entries have len == 0 and never match.
+      if (addr - e.start < e.len) return e.span;
+    }
+    return nullptr;
+  }
+
+  // Caches span, whose pages are [start, start + len), replacing the oldest
+  // entry.
+  void ABSL_ATTRIBUTE_ALWAYS_INLINE Insert(uintptr_t start, size_t len,
+                                           Span* span) {
+    entries_[next_] = {start, len, span};
+    next_ = (next_ + 1) % kEntries;
+  }
+
+  // Invalidates the entries of every thread.
+  static void Invalidate() {
+    epoch_counter_.fetch_add(1, std::memory_order_release);
+  }
+
+ private:
+  struct Entry {
+    uintptr_t start;
+    size_t len;
+    Span* span;
+  };
+
+  ABSL_ATTRIBUTE_NOINLINE void Reset(uint64_t epoch) {
+    for (Entry& e : entries_) e = {0, 0, nullptr};
+    next_ = 0;
+    epoch_ = epoch;
+  }
+
+  uint64_t epoch_;
+  size_t next_;
+  Entry entries_[kEntries];
+
+  ABSL_CONST_INIT static std::atomic<uint64_t> epoch_counter_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ESCAPE_SPAN_CACHE_H_
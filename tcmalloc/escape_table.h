@@ -0,0 +1,337 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Per-span escape tables: one EscapeHead per object of the span.
+
+#ifndef TCMALLOC_ESCAPE_TABLE_H_
+#define TCMALLOC_ESCAPE_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/numeric/bits.h"
+#include "absl/time/time.h"
+#include "tcmalloc/arena.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/page_heap_allocator.h"
+#include "tcmalloc/span.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Escape tables come in power-of-two sizes starting at kMinEscapeTableSize
+// heads (one cache line), so a span only pays for the objects it holds.
+inline constexpr size_t kMinEscapeTableSize = 8;
+inline constexpr size_t kNumEscapeTableClasses = 14;
+// Objects past this index are not tracked.  No size class currently produces
+// a span that holds this many objects.
+inline constexpr size_t kMaxEscapeTableSize =
+    kMinEscapeTableSize << (kNumEscapeTableClasses - 1);
+
+// Returns the class of the smallest table that holds `objects` heads.
+inline size_t EscapeTableClass(size_t objects) {
+  if (objects <= kMinEscapeTableSize) return 0;
+  if (objects > kMaxEscapeTableSize) return kNumEscapeTableClasses - 1;
+  return absl::bit_width((objects - 1) / kMinEscapeTableSize);
+}
+
+// Number of heads in a table of class `cls`.
+inline constexpr size_t EscapeTableClassSize(size_t cls) {
+  return kMinEscapeTableSize << cls;
+}
+
+// Number of heads usable by a span holding `objects` objects.
+inline size_t EscapeTableSize(size_t objects) {
+  return objects < kMaxEscapeTableSize ? objects : kMaxEscapeTableSize;
+}
+
+#ifdef PAGE_ESCAPE_CHAINS
+// A page allocation of more than kPageEscapeChainBytes has a head per
+// kPageEscapeChainBytes of it, its page escape chains, rather than a single
+// one.  Escapes into each run of its pages are staged and committed as if
+// the run were an object of its own, so freeing a huge array walks many
+// short chains instead of one that holds every pointer into it, and
+// trimming it in place walks only the chains of the pages it loses.
+inline constexpr size_t kPageEscapeChainBytes = size_t{256} << 10;
+static_assert(kPageEscapeChainBytes >= kMaxSize,
+              "objects of a size class have a single chain");
+static_assert(kPageEscapeChainBytes % kPageSize == 0,
+              "page escape chains cover whole pages");
+
+// Page escape chains of an object of `bytes` bytes, 1 when it has none.
+inline size_t PageEscapeChains(size_t bytes) {
+  return bytes > kPageEscapeChainBytes
+             ? (bytes + kPageEscapeChainBytes - 1) / kPageEscapeChainBytes
+             : 1;
+}
+#endif
+
+// Bytes of each part of the objects of span that escapes are tracked into:
+// the objects themselves, or the runs of pages of its page escape chains.
+inline size_t EscapeObjectBytes(const Span* span) {
+  const size_t bytes = span->object_bytes();
+#ifdef PAGE_ESCAPE_CHAINS
+  if (bytes > kPageEscapeChainBytes) return kPageEscapeChainBytes;
+#endif
+  return bytes;
+}
+
+// EscapeObjectBytes() in the units of Span::obj_size, as staged escapes
+// record it.
+inline size_t EscapeObjectUnits(const Span* span) {
+#ifdef PAGE_ESCAPE_CHAINS
+  if (span->object_bytes() > kPageEscapeChainBytes) {
+    return kPageEscapeChainBytes >> 3;
+  }
+#endif
+  return span->obj_size;
+}
+
+// Number of those parts, that the escape table of span is sized by.
+inline size_t EscapeObjects(const Span* span) {
+#ifdef PAGE_ESCAPE_CHAINS
+  if (span->object_bytes() > kPageEscapeChainBytes) {
+    return PageEscapeChains(span->object_bytes());
+  }
+#endif
+  return span->objects_per_span;
+}
+
+#ifdef OUTGOING_ESCAPE_INDEX
+// Words of the outgoing escape index of a span of `pages` pages (see
+// Span::escape_slots).  The index is carved like a table of that many heads,
+// so words of a span past the largest table are not indexed.
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(EscapeHead),
+              "the outgoing escape index is allocated as an escape table");
+inline size_t EscapeSlotWords(Length pages) {
+  const size_t words = pages.in_bytes() / (sizeof(void*) * 64);
+  return words < kMaxEscapeTableSize ? words : kMaxEscapeTableSize;
+}
+#endif
+
+#ifdef ESCAPE_REFCOUNTS
+// Words of the escape counts of a span holding `objects` objects (see
+// Span::escape_refs), one byte per object that has an escape head.  The
+// counts are carved like a table of that many heads.
+inline constexpr size_t kEscapeRefsPerWord = sizeof(EscapeHead);
+inline size_t EscapeRefWords(size_t objects) {
+  return (EscapeTableSize(objects) + kEscapeRefsPerWord - 1) /
+         kEscapeRefsPerWord;
+}
+#endif
+
+#ifdef SPARSE_ESCAPE_TABLES
+// Spans holding more than kSparseEscapeMinObjects objects start with a
+// sparse table (see SparseEscapeTable) rather than one head per object, and
+// Span::escape_list points at it with kSparseEscapeTable set.  Smaller spans
+// keep the per-object table, which is no larger.
+inline constexpr size_t kSparseEscapeHeads = 16;
+inline constexpr size_t kSparseEscapeMaxProbes = 4;
+inline constexpr size_t kSparseEscapeMinObjects = 64;
+inline constexpr uintptr_t kSparseEscapeTable = 1;
+
+// The heads of the first objects of a span to get escapes, found by linear
+// probing on the object index from its hash.  An object whose probes all
+// land on claimed heads has its head in `overflow`, a per-object table
+// installed by the first such object.  Claimed heads are never released
+// while the table lives, so an object's head stays where it was claimed and
+// lookups need no lock.
+struct SparseEscapeTable {
+  // Object index plus one of each head, or 0 while the head is unclaimed.
+  std::atomic<uint32_t> keys[kSparseEscapeHeads];
+  std::atomic<EscapeHead*> overflow;
+  EscapeHead heads[kSparseEscapeHeads];
+};
+
+// Heads the sparse table is carved as, like an escape table.
+inline constexpr size_t kSparseEscapeTableWords =
+    (sizeof(SparseEscapeTable) + sizeof(EscapeHead) - 1) / sizeof(EscapeHead);
+
+// The forms of escape table a span can have, for the statistics.
+enum class EscapeTableForm {
+  kPerObject,  // one head per object from the start
+  kSparse,     // a sparse table without overflow
+  kOverflow,   // a sparse table with an overflow table
+  kNumForms,
+};
+
+inline bool IsSparseEscapeTable(const EscapeHead* list) {
+  return reinterpret_cast<uintptr_t>(list) & kSparseEscapeTable;
+}
+
+inline SparseEscapeTable* AsSparseEscapeTable(EscapeHead* list) {
+  return reinterpret_cast<SparseEscapeTable*>(
+      reinterpret_cast<uintptr_t>(list) & ~kSparseEscapeTable);
+}
+
+// First head probed for object idx.
+inline size_t SparseEscapeSlot(size_t idx) {
+  return (static_cast<uint32_t>(idx) * 0x9E3779B1u) >>
+         (32 - absl::bit_width(kSparseEscapeHeads - 1));
+}
+#endif
+
+// Returns the head of object idx in the escape table `list`, nullptr if it
+// has none.  REQUIRES: idx < EscapeTableSize() of the span's objects.
+inline EscapeHead* FindEscapeHead(EscapeHead* list, size_t idx) {
+#ifdef SPARSE_ESCAPE_TABLES
+  if (IsSparseEscapeTable(list)) {
+    SparseEscapeTable* table = AsSparseEscapeTable(list);
+    const uint32_t key = idx + 1;
+    size_t slot = SparseEscapeSlot(idx);
+    for (size_t probe = 0; probe < kSparseEscapeMaxProbes; ++probe) {
+      const uint32_t cur = table->keys[slot].load(std::memory_order_acquire);
+      if (cur == key) return &table->heads[slot];
+      if (cur == 0) return nullptr;
+      slot = (slot + 1) % kSparseEscapeHeads;
+    }
+    EscapeHead* overflow = table->overflow.load(std::memory_order_acquire);
+    return overflow != nullptr ? &overflow[idx] : nullptr;
+  }
+#endif
+  return &list[idx];
+}
+
+// Calls f(idx, head) for the head of every object of the escape table
+// `list` of a span holding `objects` objects that may have one.
+template <typename F>
+inline void ForEachEscapeHead(EscapeHead* list, size_t objects, F f) {
+#ifdef SPARSE_ESCAPE_TABLES
+  if (IsSparseEscapeTable(list)) {
+    SparseEscapeTable* table = AsSparseEscapeTable(list);
+    for (size_t slot = 0; slot < kSparseEscapeHeads; ++slot) {
+      const uint32_t key = table->keys[slot].load(std::memory_order_acquire);
+      if (key != 0) f(size_t{key - 1}, &table->heads[slot]);
+    }
+    list = table->overflow.load(std::memory_order_acquire);
+    if (list == nullptr) return;
+  }
+#endif
+  const size_t n = EscapeTableSize(objects);
+  for (size_t i = 0; i < n; ++i) f(i, &list[i]);
+}
+
+// Simple allocator for escape tables, one free list per size class.  Like
+// PageHeapAllocator, external locking is required.
+class EscapeTableAllocator {
+ public:
+  constexpr EscapeTableAllocator()
+      : arena_(nullptr), free_lists_{}, stats_{0, 0}, class_stats_{} {}
+
+  void Init(Arena* arena) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    arena_ = arena;
+  }
+
+  // Returns an uninitialized table with room for at least `objects` heads.
+  ABSL_ATTRIBUTE_RETURNS_NONNULL EscapeHead* New(size_t objects)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    const size_t cls = EscapeTableClass(objects);
+    void* result = free_lists_[cls];
+    stats_.in_use++;
+    class_stats_[cls].in_use++;
+    if (ABSL_PREDICT_FALSE(result == nullptr)) {
+      stats_.total++;
+      class_stats_[cls].total++;
+      return reinterpret_cast<EscapeHead*>(
+          arena_->Alloc(EscapeTableClassSize(cls) * sizeof(EscapeHead)));
+    }
+    free_lists_[cls] = *(reinterpret_cast<void**>(result));
+    return reinterpret_cast<EscapeHead*>(result);
+  }
+
+  // REQUIRES: `objects` is the value `table` was allocated with.
+  void Delete(EscapeHead* table, size_t objects) ABSL_ATTRIBUTE_NONNULL()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    const size_t cls = EscapeTableClass(objects);
+    *(reinterpret_cast<void**>(table)) = free_lists_[cls];
+    free_lists_[cls] = table;
+    stats_.in_use--;
+    class_stats_[cls].in_use--;
+  }
+
+  AllocatorStats stats() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return stats_;
+  }
+
+  // Tables of class `cls` in use, and ever carved from the arena.
+  AllocatorStats class_stats(size_t cls) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return class_stats_[cls];
+  }
+
+  // Bytes of all tables ever carved from the arena, free or in use.
+  size_t bytes() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    size_t bytes = 0;
+    for (size_t cls = 0; cls < kNumEscapeTableClasses; ++cls) {
+      bytes += class_stats_[cls].total * EscapeTableClassSize(cls) *
+               sizeof(EscapeHead);
+    }
+    return bytes;
+  }
+
+#ifdef SPARSE_ESCAPE_TABLES
+  // Keeps the number of spans whose table has each form; tables change form
+  // without pageheap_lock.
+  void CountForm(EscapeTableForm form, int64_t delta) {
+    forms_[static_cast<int>(form)].fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  int64_t spans_with_form(EscapeTableForm form) const {
+    return forms_[static_cast<int>(form)].load(std::memory_order_relaxed);
+  }
+#endif
+
+ private:
+  Arena* arena_;
+
+  void* free_lists_[kNumEscapeTableClasses] ABSL_GUARDED_BY(pageheap_lock);
+
+  AllocatorStats stats_ ABSL_GUARDED_BY(pageheap_lock);
+  AllocatorStats class_stats_[kNumEscapeTableClasses]
+      ABSL_GUARDED_BY(pageheap_lock);
+#ifdef SPARSE_ESCAPE_TABLES
+  std::atomic<int64_t> forms_[static_cast<int>(EscapeTableForm::kNumForms)] =
+      {};
+#endif
+};
+
+#ifdef ESCAPE_CHAIN_SWEEP
+// Walks the escape tables of the heap from where the previous call stopped,
+// for about `budget` of CPU, and drops the records whose location no longer
+// points into their object.  Returns how many were dropped.  Defined in
+// tcmalloc.cc; driven by MallocExtension::ProcessBackgroundActions().
+size_t SweepEscapeChains(absl::Duration budget);
+#endif
+
+#ifdef ESCAPE_REFCOUNTS
+// Halves the escape counts of the heap from where the previous call
+// stopped, for about `budget` of CPU, so that objects whose escapes are old
+// are freed without a stay in the quarantine.  Returns the number of spans
+// visited.  Defined in tcmalloc.cc; driven by
+// MallocExtension::ProcessBackgroundActions().
+size_t DecayEscapeRefs(absl::Duration budget);
+#endif
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ESCAPE_TABLE_H_
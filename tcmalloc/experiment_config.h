@@ -31,6 +31,10 @@ enum class Experiment : int {
   TCMALLOC_CFL_AWARE_SIZE_CLASS,
   TCMALLOC_DYNAMIC_SLABS,
   TCMALLOC_PASS_SPAN_OBJECT_COUNT_TO_PAGEHEAP,
+  TCMALLOC_PROTECTION_NO_ESCAPE_L2_CACHE,
+  TCMALLOC_PROTECTION_SAMPLED_CHECKS,
+  TCMALLOC_PROTECTION_SAMPLED_ESCAPE_SPANS,
+  TCMALLOC_PROTECTION_REALLOC_MIGRATE_ESCAPES,
   kMaxExperimentID,
 };
 
@@ -51,6 +55,10 @@ inline constexpr ExperimentConfig experiments[] = {
     {Experiment::TCMALLOC_CFL_AWARE_SIZE_CLASS, "TCMALLOC_CFL_AWARE_SIZE_CLASS"},
     {Experiment::TCMALLOC_DYNAMIC_SLABS, "TCMALLOC_DYNAMIC_SLABS"},
     {Experiment::TCMALLOC_PASS_SPAN_OBJECT_COUNT_TO_PAGEHEAP, "TCMALLOC_PASS_SPAN_OBJECT_COUNT_TO_PAGEHEAP"},
+    {Experiment::TCMALLOC_PROTECTION_NO_ESCAPE_L2_CACHE, "TCMALLOC_PROTECTION_NO_ESCAPE_L2_CACHE"},
+    {Experiment::TCMALLOC_PROTECTION_SAMPLED_CHECKS, "TCMALLOC_PROTECTION_SAMPLED_CHECKS"},
+    {Experiment::TCMALLOC_PROTECTION_SAMPLED_ESCAPE_SPANS, "TCMALLOC_PROTECTION_SAMPLED_ESCAPE_SPANS"},
+    {Experiment::TCMALLOC_PROTECTION_REALLOC_MIGRATE_ESCAPES, "TCMALLOC_PROTECTION_REALLOC_MIGRATE_ESCAPES"},
 };
 // clang-format on
 
@@ -0,0 +1,36 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/flat_page_info.h"
+
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT std::atomic<uintptr_t> FlatPageInfo::base_{uintptr_t{1}
+                                                           << 63};
+uintptr_t* FlatPageInfo::shadow_ = nullptr;
+
+void FlatPageInfo::Init(uintptr_t base, uintptr_t* shadow) {
+  ASSERT(base % kHeapBytes == 0);
+  ASSERT(shadow_ == nullptr);
+  shadow_ = shadow;
+  base_.store(base, std::memory_order_release);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
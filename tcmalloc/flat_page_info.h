@@ -0,0 +1,117 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A flat copy of the page map's page info words for a fixed heap range.
+
+#ifndef TCMALLOC_FLAT_PAGE_INFO_H_
+#define TCMALLOC_FLAT_PAGE_INFO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// With FLAT_PAGE_INFO, the system allocator reserves kHeapBytes of normal
+// tagged address space up front and carves the MmapAligned() regions of
+// that tag from it.  The page info word of every page of the reservation is
+// mirrored in a flat array indexed by page, so a bounds check on an address
+// in it needs a subtract, a shift, a compare and one load, instead of the
+// walk through the page map root and a leaf.  Addresses outside (sampled and
+// cold memory, or normal memory after the reservation runs out) and words
+// that are 0 fall back to the page map.
+//
+// The array is mapped MAP_NORESERVE and only the pages covering the used
+// part of the heap are ever touched.  Writers mirror the page map under the
+// same synchronization as their page map updates; readers need none.
+class FlatPageInfo {
+ public:
+  static constexpr int kHeapBits = 36;
+  static constexpr size_t kHeapBytes = size_t{1} << kHeapBits;
+  static constexpr size_t kPages = kHeapBytes >> kPageShift;
+  static_assert(kHeapBits < kTagShift, "the reservation must have one tag");
+
+  // Returns the mirrored page info word of addr, 0 outside the reservation.
+  // No locks required.
+  static uintptr_t ABSL_ATTRIBUTE_ALWAYS_INLINE Get(uintptr_t addr) {
+    const uintptr_t i =
+        (addr - base_.load(std::memory_order_relaxed)) >> kPageShift;
+    if (i >= kPages) return 0;
+    return __atomic_load_n(&shadow_[i], __ATOMIC_RELAXED);
+  }
+
+  // Prefetches the word Get(addr) reads.
+  static void ABSL_ATTRIBUTE_ALWAYS_INLINE Prefetch(uintptr_t addr) {
+    const uintptr_t i =
+        (addr - base_.load(std::memory_order_relaxed)) >> kPageShift;
+    if (i < kPages) __builtin_prefetch(&shadow_[i], 0, 3);
+  }
+
+  // Mirrors the page info word of page p; pages outside are ignored.
+  static void Set(uintptr_t p, uintptr_t word) {
+    if (uintptr_t* slot = Slot(p)) {
+      __atomic_store_n(slot, word, __ATOMIC_RELAXED);
+    }
+  }
+
+  // Mirrors word as the page info of the n pages from p; pages outside are
+  // ignored.
+  static void Fill(uintptr_t p, size_t n, uintptr_t word) {
+    const uintptr_t first = base() >> kPageShift;
+    const uintptr_t lo = std::max(p, first);
+    const uintptr_t hi = std::min(p + n, first + kPages);
+    if (lo < hi) std::fill(&shadow_[lo - first], &shadow_[hi - first], word);
+  }
+
+  // Ors bits into the word of page p; may race with others doing the same.
+  static void Or(uintptr_t p, uintptr_t bits) {
+    if (uintptr_t* slot = Slot(p)) {
+      __atomic_fetch_or(slot, bits, __ATOMIC_RELAXED);
+    }
+  }
+
+  // Publishes the reservation at base and its zeroed page info array.
+  // Called once by the system allocator, before it hands out any memory of
+  // the reservation.
+  static void Init(uintptr_t base, uintptr_t* shadow);
+
+  // First byte of the reservation; a non-canonical address if there is none,
+  // so every lookup misses.
+  static uintptr_t base() { return base_.load(std::memory_order_relaxed); }
+  static const uintptr_t* shadow() { return shadow_; }
+
+ private:
+  static uintptr_t* Slot(uintptr_t p) {
+    const uintptr_t i = p - (base() >> kPageShift);
+    return i < kPages ? &shadow_[i] : nullptr;
+  }
+
+  ABSL_CONST_INIT static std::atomic<uintptr_t> base_;
+  // Only dereferenced for indices in range, which needs base_ to be set.
+  static uintptr_t* shadow_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_FLAT_PAGE_INFO_H_
@@ -14,8 +14,19 @@
 
 #include "tcmalloc/global_stats.h"
 
+#include <errno.h>
+#include <linux/memfd.h>
+#include <sys/mman.h>
+#include <syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
 #include "absl/strings/match.h"
 #include "absl/strings/strip.h"
+#include "tcmalloc/callsite_profile.h"
 #include "tcmalloc/central_freelist.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/cpu_cache.h"
@@ -23,17 +34,21 @@
 #include "tcmalloc/guarded_page_allocator.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/memory_stats.h"
+#include "tcmalloc/memory_pressure.h"
 #include "tcmalloc/page_allocator.h"
 #include "tcmalloc/page_heap.h"
 #include "tcmalloc/page_heap_allocator.h"
 #include "tcmalloc/pagemap.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/protection_timing.h"
 #include "tcmalloc/sampled_allocation.h"
 #include "tcmalloc/sampler.h"
+#include "tcmalloc/sampling_autotune.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/stats.h"
+#include "tcmalloc/stats_page.h"
 #include "tcmalloc/system-alloc.h"
 #include "tcmalloc/thread_cache.h"
 #include "tcmalloc/transfer_cache.h"
@@ -89,11 +104,87 @@ void ExtractStats(TCMallocStats* r, uint64_t* class_count,
     ThreadCache::GetThreadStats(&r->thread_bytes, class_count);
     r->tc_stats = ThreadCache::HeapStats();
     r->span_stats = tc_globals.span_allocator().stats();
+#ifdef SPAN_CACHE
+    // Spans waiting in the per-CPU caches are not in use.
+    r->span_stats.in_use -= tc_globals.span_cache().cached();
+#endif
     r->stack_stats = tc_globals.sampledallocation_allocator().stats();
     r->bucket_stats = tc_globals.bucket_allocator().stats();
+    r->escape_chunk_stats = {0, 0};
+    r->escape_chunk_released_bytes = 0;
+    size_t escape_chunk_cached = 0;
+    size_t escape_chunk_touched_bytes = 0;
+    for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+      const EscapeChunkAllocator& a = tc_globals.escape_allocator(partition);
+      const AllocatorStats s = a.stats();
+      r->escape_chunk_stats.in_use += s.in_use;
+      r->escape_chunk_stats.total += s.total;
+      r->escape_chunk_released_bytes += a.released_bytes();
+      escape_chunk_cached += a.cached();
+      escape_chunk_touched_bytes += a.touched_bytes();
+    }
+    // Shards refill concurrently, so cap what they hold to what stats() saw.
+    r->escape_chunk_cached = std::min<size_t>(escape_chunk_cached,
+                                              r->escape_chunk_stats.in_use);
+    r->escape_table_stats = tc_globals.escape_table_allocator().stats();
+    for (size_t cls = 0; cls < kNumEscapeTableClasses; ++cls) {
+      r->escape_table_class_stats[cls] =
+          tc_globals.escape_table_allocator().class_stats(cls);
+    }
+#ifdef SPARSE_ESCAPE_TABLES
+    for (int form = 0; form < static_cast<int>(EscapeTableForm::kNumForms);
+         ++form) {
+      r->escape_table_forms[form] =
+          tc_globals.escape_table_allocator().spans_with_form(
+              static_cast<EscapeTableForm>(form));
+    }
+#endif
+    r->escape_buffer_stats = tc_globals.escape_buffer_allocator().stats();
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+    for (size_t cls = 0; cls < EscapeBufferAllocator::kClasses; ++cls) {
+      r->escape_buffer_class_stats[cls] =
+          tc_globals.escape_buffer_allocator().class_stats(cls);
+    }
+    const size_t escape_buffer_bytes =
+        tc_globals.escape_buffer_allocator().bytes();
+#else
+    const size_t escape_buffer_bytes =
+        r->escape_buffer_stats.total * sizeof(EscapeBuffer);
+#endif
+    r->escape_metadata_bytes =
+        tc_globals.escape_table_allocator().bytes() +
+        escape_buffer_bytes +
+        escape_chunk_touched_bytes - r->escape_chunk_released_bytes;
+#ifdef ESCAPE_CACHE_L2
+    r->escape_metadata_bytes += tc_globals.escape_filter().mapped_bytes();
+#endif
+    r->metadata_hugepage_backed_bytes = 0;
+#ifdef ESCAPE_HUGEPAGE_METADATA
+    {
+      const ArenaStats a = tc_globals.escape_arena().stats();
+      r->metadata_hugepage_backed_bytes +=
+          a.bytes_allocated + a.bytes_unallocated + a.bytes_unavailable +
+          escape_chunk_touched_bytes - r->escape_chunk_released_bytes;
+    }
+#endif
+#ifdef PAGEMAP_HUGE_LEAVES
+    r->metadata_hugepage_backed_bytes += MetaDataHugeBytes();
+#endif
     r->metadata_bytes = tc_globals.metadata_bytes();
     r->pagemap_bytes = tc_globals.pagemap().bytes();
     r->pageheap = tc_globals.page_allocator().stats();
+#ifdef COLD_TIER_BIND
+    {
+      const BackingStats cold =
+          tc_globals.page_allocator().stats(MemoryTag::kCold);
+      r->cold_tier_heap_bytes =
+          ColdTierNodes() != 0 ? cold.system_bytes - cold.unmapped_bytes : 0;
+      r->cold_tier_metadata_bytes =
+          ColdTierEscapes()
+              ? escape_chunk_touched_bytes - r->escape_chunk_released_bytes
+              : 0;
+    }
+#endif
     r->peak_stats = tc_globals.page_allocator().peak_stats();
     if (small_spans != nullptr) {
       tc_globals.page_allocator().GetSmallSpanStats(small_spans);
@@ -265,6 +356,9 @@ void DumpStats(Printer* out, int level) {
       "MALLOC:   %12u (%7.1f MiB) Stack traces created\n"
       "MALLOC:   %12u               Table buckets in use\n"
       "MALLOC:   %12u (%7.1f MiB) Table buckets created\n"
+      "MALLOC:   %12u               Escape chunks in use\n"
+      "MALLOC:   %12u (%7.1f MiB) Escape chunks backed\n"
+      "MALLOC:   %12u (%7.1f MiB) Escape chunk bytes released\n"
       "MALLOC:   %12u (%7.1f MiB) Pagemap bytes used\n"
       "MALLOC:   %12u (%7.1f MiB) Pagemap root resident bytes\n"
       "MALLOC:   %12u (%7.1f MiB) per-CPU slab bytes used\n"
@@ -302,6 +396,11 @@ void DumpStats(Printer* out, int level) {
       uint64_t(stats.bucket_stats.in_use),
       uint64_t(stats.bucket_stats.total),
       (stats.bucket_stats.total * sizeof(StackTraceTable::Bucket)) / MiB,
+      uint64_t(stats.escape_chunk_stats.in_use),
+      uint64_t(stats.escape_chunk_stats.total),
+      (stats.escape_chunk_stats.total * sizeof(EscapeChunk)) / MiB,
+      uint64_t(stats.escape_chunk_released_bytes),
+      stats.escape_chunk_released_bytes / MiB,
       uint64_t(stats.pagemap_bytes),
       stats.pagemap_bytes / MiB,
       stats.pagemap_root_bytes_res, stats.pagemap_root_bytes_res / MiB,
@@ -335,6 +434,104 @@ void DumpStats(Printer* out, int level) {
       tc_globals.sampled_internal_fragmentation_.value(),
       tc_globals.peak_heap_tracker().CurrentPeakSize());
 
+  // clang-format off
+  out->printf(
+      "------------------------------------------------\n"
+      "MALLOC PROTECTION: %12u (%7.1f MiB) Bytes in escape metadata\n"
+      "MALLOC PROTECTION: %12u               Escape tables in use\n"
+      "MALLOC PROTECTION: %12u               Escape chunks in use\n"
+      "MALLOC PROTECTION: %12u               Escape chunks cached per CPU\n"
+      "MALLOC PROTECTION: %12u               Escape chunks free in slabs\n"
+      "MALLOC PROTECTION: %12u               Escape buffers in use\n"
+      "MALLOC PROTECTION: %12u (%7.1f MiB) Bytes of metadata on huge pages\n",
+      stats.escape_metadata_bytes, stats.escape_metadata_bytes / MiB,
+      uint64_t(stats.escape_table_stats.in_use),
+      uint64_t(stats.escape_chunk_stats.in_use - stats.escape_chunk_cached),
+      uint64_t(stats.escape_chunk_cached),
+      uint64_t(stats.escape_chunk_stats.total -
+               stats.escape_chunk_stats.in_use),
+      uint64_t(stats.escape_buffer_stats.in_use),
+      stats.metadata_hugepage_backed_bytes,
+      stats.metadata_hugepage_backed_bytes / MiB);
+  for (size_t cls = 0; cls < kNumEscapeTableClasses; ++cls) {
+    const AllocatorStats& t = stats.escape_table_class_stats[cls];
+    if (t.total == 0) continue;
+    const uint64_t bytes =
+        t.total * EscapeTableClassSize(cls) * sizeof(EscapeHead);
+    out->printf(
+        "MALLOC PROTECTION: %12u (%7.1f MiB) Escape tables of %5u heads"
+        " (%u in use, %u free)\n",
+        bytes, bytes / MiB, EscapeTableClassSize(cls), uint64_t(t.in_use),
+        uint64_t(t.total - t.in_use));
+  }
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+  for (size_t cls = 0; cls < EscapeBufferAllocator::kClasses; ++cls) {
+    const AllocatorStats& b = stats.escape_buffer_class_stats[cls];
+    if (b.total == 0) continue;
+    const size_t capacity = EscapeBufferAllocator::ClassCapacity(cls);
+    const uint64_t bytes = b.total * EscapeBuffer::BytesFor(capacity);
+    out->printf(
+        "MALLOC PROTECTION: %12u (%7.1f MiB) Escape buffers of %5u records"
+        " (%u in use, %u free)\n",
+        bytes, bytes / MiB, capacity, uint64_t(b.in_use),
+        uint64_t(b.total - b.in_use));
+  }
+#endif
+#ifdef SPARSE_ESCAPE_TABLES
+  out->printf(
+      "MALLOC PROTECTION: %12d               Spans with per-object escape "
+      "tables\n"
+      "MALLOC PROTECTION: %12d               Spans with sparse escape tables\n"
+      "MALLOC PROTECTION: %12d               Spans with sparse escape tables "
+      "and overflow\n",
+      stats.escape_table_forms[static_cast<int>(EscapeTableForm::kPerObject)],
+      stats.escape_table_forms[static_cast<int>(EscapeTableForm::kSparse)],
+      stats.escape_table_forms[static_cast<int>(EscapeTableForm::kOverflow)]);
+#endif
+#ifdef ENABLE_STATISTIC
+  out->printf(
+      "MALLOC PROTECTION: %12d               Mallocs\n"
+      "MALLOC PROTECTION: %12d               Frees\n"
+      "MALLOC PROTECTION: %12d               Escapes (%d to the heap)\n"
+      "MALLOC PROTECTION: %12d               Escapes committed\n"
+      "MALLOC PROTECTION: %12d               Escapes inside their object\n"
+      "MALLOC PROTECTION: %12d               GEP checks (%d invalid)\n"
+      "MALLOC PROTECTION: %12d               BC checks (%d invalid)\n"
+      "MALLOC PROTECTION: %12d               Range checks (%d invalid)\n"
+      "MALLOC PROTECTION: %12d               Invalid checks (estimated)\n",
+      tc_globals.malloc_cnt.value(), tc_globals.free_cnt.value(),
+      tc_globals.escape_cnt.value(), tc_globals.escape_heap_cnt.value(),
+      tc_globals.escape_final_cnt.value(),
+      tc_globals.escape_intra_object.value(), tc_globals.gep_check_cnt.value(),
+      tc_globals.gep_check_invalid_cnt.value(),
+      tc_globals.bc_check_cnt.value(), tc_globals.bc_check_invalid_cnt.value(),
+      tc_globals.get_range_cnt.value(),
+      tc_globals.get_range_invalid_cnt.value(),
+      tc_globals.check_invalid_estimate.value());
+#endif
+  // clang-format on
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_flush_tracker().Print(out);
+#endif
+#ifdef PROTECTION_TIMING
+  ProtectionTiming::Print(out);
+#endif
+#ifdef CALLSITE_PROFILE
+  CallSiteProfile::Print(out);
+#endif
+#ifdef MEMORY_PRESSURE_RELEASE
+  MemoryPressureMonitor::Print(out);
+#endif
+#ifdef SAMPLING_AUTOTUNE
+  SamplingAutotuner::Print(out);
+#endif
+#ifdef LLC_REMOTE_FREES
+  out->printf("------------------------------------------------\n");
+  out->printf(
+      "REMOTE FREES: %zu frees to the L3 shard refilling their size class\n",
+      tc_globals.sharded_transfer_cache().remote_inserts());
+#endif
+
   MemoryStats memstats;
   if (GetMemoryStats(&memstats)) {
     uint64_t rss = memstats.rss;
@@ -390,6 +587,27 @@ void DumpStats(Printer* out, int level) {
     for (int size_class = 1; size_class < kNumClasses; ++size_class) {
       tc_globals.central_freelist(size_class).PrintSpanUtilStats(out);
     }
+
+    out->printf("------------------------------------------------\n");
+    out->printf("Central cache freelist: Span occupancy histogram\n");
+    out->printf("Full spans, then spans with free objects / of them with an\n");
+    out->printf("escape table, by allocated objects < N\n");
+    out->printf("------------------------------------------------\n");
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      tc_globals.central_freelist(size_class).PrintSpanOccupancyStats(out);
+    }
+
+#ifdef CENTRAL_FREELIST_SHARDS
+    out->printf("------------------------------------------------\n");
+    out->printf("Central cache freelist: %zu shards by L3 cache\n",
+                CentralFreeList::num_shards());
+    out->printf("Objects taken from another shard, and lock holds and mean\n");
+    out->printf("cycles held of each shard\n");
+    out->printf("------------------------------------------------\n");
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      tc_globals.central_freelist(size_class).PrintShardStats(out);
+    }
+#endif
 #endif
 
     out->printf("------------------------------------------------\n");
@@ -422,6 +640,15 @@ void DumpStats(Printer* out, int level) {
           tc_stats[size_class].remove_hits, tc_stats[size_class].remove_misses,
           tc_stats[size_class].remove_non_batch_misses);
     }
+    int lock_free_classes = 0;
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      lock_free_classes += tc_globals.transfer_cache().lock_free(size_class);
+    }
+    out->printf("Size classes with a lock-free transfer cache: %d\n",
+                lock_free_classes);
+    out->printf("Initialization took %s, topology probing %s\n",
+                absl::FormatDuration(tc_globals.init_time()),
+                absl::FormatDuration(tc_globals.topology_init_time()));
 
     if (UsePerCpuCache()) {
       tc_globals.cpu_cache().Print(out);
@@ -433,6 +660,17 @@ void DumpStats(Printer* out, int level) {
     }
     tc_globals.page_allocator().Print(out, MemoryTag::kSampled);
     tc_globals.page_allocator().Print(out, MemoryTag::kCold);
+#ifdef COLD_TIER_BIND
+    if (ColdTierNodes() != 0) {
+      out->printf(
+          "\nCOLD TIER: nodes %#x, %zu bytes of address space placed\n"
+          "COLD TIER: %12u (%7.1f MiB) Bytes of cold heap backed\n"
+          "COLD TIER: %12u (%7.1f MiB) Bytes of escape chunks backed\n",
+          ColdTierNodes(), ColdTierBoundBytes(), stats.cold_tier_heap_bytes,
+          stats.cold_tier_heap_bytes / MiB, stats.cold_tier_metadata_bytes,
+          stats.cold_tier_metadata_bytes / MiB);
+    }
+#endif
     tc_globals.guardedpage_allocator().Print(out);
 
     uint64_t limit_bytes;
@@ -456,6 +694,8 @@ void DumpStats(Printer* out, int level) {
         absl::FormatDuration(Parameters::filler_skip_subrelease_interval()));
     out->printf("PARAMETER flat vcpus %d\n",
                 subtle::percpu::UsingFlatVirtualCpus() ? 1 : 0);
+    out->printf("PARAMETER mm_cid vcpus %d\n",
+                subtle::percpu::UsingMmCid() ? 1 : 0);
     out->printf("PARAMETER tcmalloc_shuffle_per_cpu_caches %d\n",
                 Parameters::shuffle_per_cpu_caches() ? 1 : 0);
     out->printf("PARAMETER tcmalloc_prioritize_spans %d\n",
@@ -466,6 +706,16 @@ void DumpStats(Printer* out, int level) {
                 Parameters::partial_transfer_cache() ? 1 : 0);
     out->printf("PARAMETER tcmalloc_linear_search_length_tracker_list %d\n",
                 Parameters::linear_search_length_tracker_list());
+    out->printf("PARAMETER tcmalloc_background_escape_flush %d\n",
+                Parameters::background_escape_flush() ? 1 : 0);
+    out->printf("PARAMETER tcmalloc_escape_l2_cache_size %lld\n",
+                Parameters::escape_l2_cache_size());
+    out->printf("PARAMETER tcmalloc_realloc_migrate_escapes %d\n",
+                Parameters::realloc_migrate_escapes() ? 1 : 0);
+    out->printf("PARAMETER tcmalloc_escape_poison_chunk_limit %lld\n",
+                Parameters::escape_poison_chunk_limit());
+    out->printf("PARAMETER tcmalloc_escape_span_sample_period %lld\n",
+                Parameters::escape_span_sample_period());
   }
 }
 
@@ -493,6 +743,10 @@ void DumpStatsInPbtxt(Printer* out, int level) {
   region.PrintI64("per_cpu_cache_freelist", stats.per_cpu_bytes);
   region.PrintI64("sharded_transfer_cache_freelist",
                   stats.sharded_transfer_bytes);
+#ifdef LLC_REMOTE_FREES
+  region.PrintI64("sharded_transfer_cache_remote_inserts",
+                  tc_globals.sharded_transfer_cache().remote_inserts());
+#endif
   region.PrintI64("transfer_cache_freelist", stats.transfer_bytes);
   region.PrintI64("thread_cache_freelists", stats.thread_bytes);
   region.PrintI64("malloc_metadata", stats.metadata_bytes);
@@ -513,6 +767,191 @@ void DumpStatsInPbtxt(Printer* out, int level) {
   region.PrintI64("num_table_buckets", uint64_t(stats.bucket_stats.in_use));
   region.PrintI64("num_table_buckets_created",
                   uint64_t(stats.bucket_stats.total));
+  region.PrintI64("num_escape_chunks",
+                  uint64_t(stats.escape_chunk_stats.in_use));
+  region.PrintI64("num_escape_chunks_backed",
+                  uint64_t(stats.escape_chunk_stats.total));
+  region.PrintI64("escape_chunk_released_bytes",
+                  uint64_t(stats.escape_chunk_released_bytes));
+  {
+    auto protection = region.CreateSubRegion("protection");
+    protection.PrintI64("escape_metadata_bytes", stats.escape_metadata_bytes);
+    protection.PrintI64("metadata_hugepage_backed_bytes",
+                        stats.metadata_hugepage_backed_bytes);
+    protection.PrintI64("num_escape_tables",
+                        uint64_t(stats.escape_table_stats.in_use));
+    protection.PrintI64(
+        "num_escape_chunks_live",
+        uint64_t(stats.escape_chunk_stats.in_use - stats.escape_chunk_cached));
+    protection.PrintI64("num_escape_chunks_cached",
+                        uint64_t(stats.escape_chunk_cached));
+    protection.PrintI64("num_escape_chunks_free",
+                        uint64_t(stats.escape_chunk_stats.total -
+                                 stats.escape_chunk_stats.in_use));
+    for (size_t cls = 0; cls < kNumEscapeTableClasses; ++cls) {
+      const AllocatorStats& t = stats.escape_table_class_stats[cls];
+      if (t.total == 0) continue;
+      auto entry = protection.CreateSubRegion("escape_table_class");
+      entry.PrintI64("heads", EscapeTableClassSize(cls));
+      entry.PrintI64("in_use", uint64_t(t.in_use));
+      entry.PrintI64("free", uint64_t(t.total - t.in_use));
+      entry.PrintI64("bytes",
+                     t.total * EscapeTableClassSize(cls) * sizeof(EscapeHead));
+    }
+#ifdef SPARSE_ESCAPE_TABLES
+    protection.PrintI64("num_per_object_escape_tables",
+                        stats.escape_table_forms[static_cast<int>(
+                            EscapeTableForm::kPerObject)]);
+    protection.PrintI64(
+        "num_sparse_escape_tables",
+        stats.escape_table_forms[static_cast<int>(EscapeTableForm::kSparse)]);
+    protection.PrintI64(
+        "num_overflowed_escape_tables",
+        stats.escape_table_forms[static_cast<int>(EscapeTableForm::kOverflow)]);
+#endif
+    protection.PrintI64("num_escape_buffers",
+                        uint64_t(stats.escape_buffer_stats.in_use));
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+    for (size_t cls = 0; cls < EscapeBufferAllocator::kClasses; ++cls) {
+      const AllocatorStats& b = stats.escape_buffer_class_stats[cls];
+      if (b.total == 0) continue;
+      const size_t capacity = EscapeBufferAllocator::ClassCapacity(cls);
+      auto entry = protection.CreateSubRegion("escape_buffer_class");
+      entry.PrintI64("records", capacity);
+      entry.PrintI64("in_use", uint64_t(b.in_use));
+      entry.PrintI64("free", uint64_t(b.total - b.in_use));
+      entry.PrintI64("bytes", b.total * EscapeBuffer::BytesFor(capacity));
+    }
+#endif
+#ifdef ENABLE_STATISTIC
+    protection.PrintI64("malloc_count", tc_globals.malloc_cnt.value());
+    protection.PrintI64("free_count", tc_globals.free_cnt.value());
+    protection.PrintI64("escape_count", tc_globals.escape_cnt.value());
+    protection.PrintI64("escape_heap_count",
+                        tc_globals.escape_heap_cnt.value());
+    protection.PrintI64("escape_final_count",
+                        tc_globals.escape_final_cnt.value());
+    protection.PrintI64("check_gep_count", tc_globals.gep_check_cnt.value());
+    protection.PrintI64("check_gep_invalid_count",
+                        tc_globals.gep_check_invalid_cnt.value());
+    protection.PrintI64("check_bc_count", tc_globals.bc_check_cnt.value());
+    protection.PrintI64("check_bc_invalid_count",
+                        tc_globals.bc_check_invalid_cnt.value());
+    protection.PrintI64("check_range_count", tc_globals.get_range_cnt.value());
+    protection.PrintI64("check_range_invalid_count",
+                        tc_globals.get_range_invalid_cnt.value());
+    protection.PrintI64("check_invalid_estimate",
+                        tc_globals.check_invalid_estimate.value());
+    protection.PrintI64("escape_valid_count",
+                        tc_globals.escape_valid_cnt.value());
+    protection.PrintI64("escape_optimized_count",
+                        tc_globals.escape_loc_optimized.value());
+    protection.PrintI64("escape_intra_object_count",
+                        tc_globals.escape_intra_object.value());
+    protection.PrintI64("escape_cache_optimized_count",
+                        tc_globals.escape_cache_optimized.value());
+    protection.PrintI64("escape_buffer_dedup_count",
+                        tc_globals.escape_buffer_dedup.value());
+#ifdef ESCAPE_CACHE_L2
+    protection.PrintI64("escape_l2_cache_entries",
+                        tc_globals.escape_filter().entries());
+    protection.PrintI64("escape_l2_cache_hit_count",
+                        tc_globals.escape_l2_cache_optimized.value());
+    protection.PrintI64("escape_l2_cache_miss_count",
+                        tc_globals.escape_l2_cache_miss.value());
+#endif
+#ifdef CHUNK_CACHE
+    protection.PrintI64("chunk_cache_hit_count",
+                        tc_globals.chunk_cache_hit.value());
+#endif
+#ifdef ESCAPE_SPAN_CACHE
+    protection.PrintI64("escape_span_cache_hit_count",
+                        tc_globals.escape_span_cache_hit.value());
+#endif
+#if defined(FREE_QUARANTINE) || defined(LIFETIME_PROTECTION)
+    protection.PrintI64("quarantine_released_count",
+                        tc_globals.quarantine_released_cnt.value());
+#endif
+    protection.PrintI64("remote_escape_free_count",
+                        tc_globals.remote_escape_free_cnt.value());
+#ifdef REMOTE_FREE_QUEUE
+    protection.PrintI64("remote_free_drained_count",
+                        tc_globals.remote_free_drained_cnt.value());
+#endif
+#ifdef LIFETIME_PROTECTION
+    protection.PrintI64("short_lived_sampled_count",
+                        tc_globals.short_lived_sampled_cnt.value());
+    protection.PrintI64("short_lived_escape_skipped_count",
+                        tc_globals.short_lived_escape_skipped.value());
+#endif
+#ifdef OUTGOING_ESCAPE_INDEX
+    protection.PrintI64("escape_pruned_count",
+                        tc_globals.escape_pruned_cnt.value());
+    protection.PrintI64("escape_dead_count", tc_globals.escape_dead_cnt.value());
+#endif
+#ifdef ESCAPE_CHAIN_SWEEP
+    protection.PrintI64("escape_swept_count",
+                        tc_globals.escape_swept_cnt.value());
+#endif
+#ifdef ESCAPE_LOCATION_CLASSES
+    {
+      static constexpr const char* kLocations[] = {"heap", "stack", "global",
+                                                   "other"};
+      for (int i = 0; i < 4; ++i) {
+        auto location = protection.CreateSubRegion("escape_location");
+        location.PrintRaw("location", kLocations[i]);
+        location.PrintI64("count", tc_globals.escape_location_cnt[i].value());
+      }
+    }
+    protection.PrintI64("stack_escape_truncated_count",
+                        tc_globals.escape_stack_truncated.value());
+#endif
+#ifdef DEFERRED_ESCAPE_POISON
+    protection.PrintI64("escape_poison_deferred_count",
+                        tc_globals.escape_deferred_cnt.value());
+    protection.PrintI64("escape_poison_evicted_count",
+                        tc_globals.escape_deferred_evicted.value());
+#endif
+#ifdef SAMPLED_ESCAPE_SPANS
+    protection.PrintI64("escape_untracked_count",
+                        tc_globals.escape_untracked_cnt.value());
+#endif
+#ifdef ESCAPE_REFCOUNTS
+    protection.PrintI64("escape_ref_quarantined_count",
+                        tc_globals.escape_ref_quarantined.value());
+    protection.PrintI64("escape_ref_overwritten_count",
+                        tc_globals.escape_ref_overwritten.value());
+#endif
+    {
+      auto flushes = protection.CreateSubRegion("escape_flushes");
+      tc_globals.escape_flush_tracker().PrintInPbtxt(&flushes);
+    }
+#endif
+#ifdef PROTECTION_TIMING
+    {
+      auto timing = protection.CreateSubRegion("protection_timing");
+      ProtectionTiming::PrintInPbtxt(&timing);
+    }
+#endif
+#ifdef CALLSITE_PROFILE
+    {
+      auto callsites = protection.CreateSubRegion("call_sites");
+      CallSiteProfile::PrintInPbtxt(&callsites);
+    }
+#endif
+  }
+#ifdef MEMORY_PRESSURE_RELEASE
+  {
+    auto pressure = region.CreateSubRegion("memory_pressure");
+    MemoryPressureMonitor::PrintInPbtxt(&pressure);
+  }
+#endif
+#ifdef SAMPLING_AUTOTUNE
+  {
+    auto autotune = region.CreateSubRegion("sampling_autotune");
+    SamplingAutotuner::PrintInPbtxt(&autotune);
+  }
+#endif
   region.PrintI64("pagemap_size", uint64_t(stats.pagemap_bytes));
   region.PrintI64("pagemap_root_residence", stats.pagemap_root_bytes_res);
   region.PrintI64("percpu_slab_size", stats.percpu_metadata_bytes);
@@ -560,6 +999,11 @@ void DumpStatsInPbtxt(Printer* out, int level) {
         entry.PrintI64("obj_capacity", span_stats[size_class].obj_capacity);
         tc_globals.central_freelist(size_class)
             .PrintSpanUtilStatsInPbtxt(&entry);
+        tc_globals.central_freelist(size_class)
+            .PrintSpanOccupancyStatsInPbtxt(&entry);
+#ifdef CENTRAL_FREELIST_SHARDS
+        tc_globals.central_freelist(size_class).PrintShardStatsInPbtxt(&entry);
+#endif
       }
 #endif
     }
@@ -580,12 +1024,18 @@ void DumpStatsInPbtxt(Printer* out, int level) {
         entry.PrintI64("used", tc_stats[size_class].used);
         entry.PrintI64("capacity", tc_stats[size_class].capacity);
         entry.PrintI64("max_capacity", tc_stats[size_class].max_capacity);
+        entry.PrintBool("lock_free",
+                        tc_globals.transfer_cache().lock_free(size_class));
       }
     }
 
     region.PrintRaw("transfer_cache_implementation",
                     TransferCacheImplementationToLabel(
                         tc_globals.transfer_cache().implementation()));
+    region.PrintI64("init_time_ns",
+                    absl::ToInt64Nanoseconds(tc_globals.init_time()));
+    region.PrintI64("topology_init_time_ns",
+                    absl::ToInt64Nanoseconds(tc_globals.topology_init_time()));
 
     if (UsePerCpuCache()) {
       tc_globals.cpu_cache().PrintInPbtxt(&region);
@@ -597,6 +1047,15 @@ void DumpStatsInPbtxt(Printer* out, int level) {
   }
   tc_globals.page_allocator().PrintInPbtxt(&region, MemoryTag::kSampled);
   tc_globals.page_allocator().PrintInPbtxt(&region, MemoryTag::kCold);
+#ifdef COLD_TIER_BIND
+  if (ColdTierNodes() != 0) {
+    auto cold = region.CreateSubRegion("cold_tier");
+    cold.PrintI64("nodes", ColdTierNodes());
+    cold.PrintI64("bound_bytes", ColdTierBoundBytes());
+    cold.PrintI64("heap_bytes", stats.cold_tier_heap_bytes);
+    cold.PrintI64("metadata_bytes", stats.cold_tier_metadata_bytes);
+  }
+#endif
   // We do not collect tracking information in pbtxt.
 
   size_t limit_bytes;
@@ -627,7 +1086,9 @@ void DumpStatsInPbtxt(Printer* out, int level) {
                    Parameters::shuffle_per_cpu_caches());
   region.PrintI64("profile_sampling_rate", Parameters::profile_sampling_rate());
   region.PrintRaw("percpu_vcpu_type",
-                  subtle::percpu::UsingFlatVirtualCpus() ? "FLAT" : "NONE");
+                  subtle::percpu::UsingMmCid()             ? "MM_CID"
+                  : subtle::percpu::UsingFlatVirtualCpus() ? "FLAT"
+                                                           : "NONE");
   region.PrintBool("tcmalloc_prioritize_spans", Parameters::prioritize_spans());
   region.PrintBool("madvise_cold_regions_nohugepage",
                    Parameters::madvise_cold_regions_nohugepage());
@@ -635,8 +1096,113 @@ void DumpStatsInPbtxt(Printer* out, int level) {
                    Parameters::partial_transfer_cache());
   region.PrintI64("tcmalloc_linear_search_length_tracker_list",
                   Parameters::linear_search_length_tracker_list());
+  region.PrintBool("tcmalloc_background_escape_flush",
+                   Parameters::background_escape_flush());
+  region.PrintI64("tcmalloc_escape_l2_cache_size",
+                  Parameters::escape_l2_cache_size());
+  region.PrintBool("tcmalloc_realloc_migrate_escapes",
+                   Parameters::realloc_migrate_escapes());
+  region.PrintI64("tcmalloc_escape_poison_chunk_limit",
+                  Parameters::escape_poison_chunk_limit());
+  region.PrintI64("tcmalloc_escape_span_sample_period",
+                  Parameters::escape_span_sample_period());
+}
+
+#ifdef STATS_PAGE
+// The memfd of the stats page and its mapping, set up by the first
+// RefreshStatsPage().  Only the background thread writes the page.
+static std::atomic<int> stats_page_fd{-1};
+static StatsPage* stats_page = nullptr;
+static bool stats_page_failed = false;
+
+static StatsPage* MapStatsPage() {
+#ifdef __NR_memfd_create
+  const int fd = syscall(__NR_memfd_create, "tcmalloc_stats", MFD_CLOEXEC);
+#else
+  const int fd = -1;
+#endif
+  if (fd < 0) return nullptr;
+  const size_t page_size = getpagesize();
+  const size_t size = (sizeof(StatsPage) + page_size - 1) & ~(page_size - 1);
+  void* p = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (p == MAP_FAILED) {
+    Log(kLog, __FILE__, __LINE__, "Could not set up the stats page", errno);
+    close(fd);
+    return nullptr;
+  }
+  // The page starts out zeroed, so readers reject it until magic is set.
+  StatsPage* page = static_cast<StatsPage*>(p);
+  page->version = kStatsPageVersion;
+  page->size = sizeof(StatsPage);
+  std::atomic_thread_fence(std::memory_order_release);
+  page->magic = kStatsPageMagic;
+  stats_page_fd.store(fd, std::memory_order_release);
+  return page;
 }
 
+void RefreshStatsPage() {
+  if (stats_page == nullptr) {
+    if (stats_page_failed) return;
+    stats_page = MapStatsPage();
+    if (stats_page == nullptr) {
+      stats_page_failed = true;
+      return;
+    }
+  }
+
+  TCMallocStats stats;
+  uint64_t class_count[kNumClasses];
+  SpanStats span_stats[kNumClasses];
+  ExtractStats(&stats, class_count, span_stats, nullptr, nullptr, nullptr,
+               false);
+
+  StatsPageSnapshot s = {};
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  s.update_time_ns = int64_t{now.tv_sec} * 1000000000 + now.tv_nsec;
+  s.in_use_bytes = InUseByApp(stats);
+  s.heap_size = HeapSizeBytes(stats.pageheap);
+  s.physical_bytes = PhysicalMemoryUsed(stats);
+  s.virtual_bytes = VirtualMemoryUsed(stats);
+  s.pageheap_free_bytes = stats.pageheap.free_bytes;
+  s.pageheap_unmapped_bytes = stats.pageheap.unmapped_bytes;
+  s.metadata_bytes = stats.metadata_bytes;
+  s.escape_metadata_bytes = stats.escape_metadata_bytes;
+  s.release_rate =
+      static_cast<uint64_t>(Parameters::background_release_rate());
+#ifdef ENABLE_STATISTIC
+  s.mallocs = tc_globals.malloc_cnt.value();
+  s.frees = tc_globals.free_cnt.value();
+  s.escapes = tc_globals.escape_cnt.value();
+  s.gep_checks = tc_globals.gep_check_cnt.value();
+  s.gep_checks_invalid = tc_globals.gep_check_invalid_cnt.value();
+  s.bc_checks = tc_globals.bc_check_cnt.value();
+  s.bc_checks_invalid = tc_globals.bc_check_invalid_cnt.value();
+  s.range_checks = tc_globals.get_range_cnt.value();
+  s.range_checks_invalid = tc_globals.get_range_invalid_cnt.value();
+  s.invalid_checks_estimate = tc_globals.check_invalid_estimate.value();
+#endif
+  s.num_classes = std::min<size_t>(kNumClasses, kStatsPageMaxClasses);
+  for (size_t size_class = 1; size_class < s.num_classes; ++size_class) {
+    const uint64_t size = tc_globals.sizemap().class_to_size(size_class);
+    s.classes[size_class].size = size;
+    s.classes[size_class].free_bytes = class_count[size_class] * size;
+    s.classes[size_class].live_bytes =
+        StatSub(span_stats[size_class].obj_capacity, class_count[size_class]) *
+        size;
+  }
+
+  const uint64_t seq = stats_page->seq.load(std::memory_order_relaxed);
+  stats_page->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&stats_page->snapshot, &s, sizeof(s));
+  stats_page->seq.store(seq + 2, std::memory_order_release);
+}
+#endif  // STATS_PAGE
+
 bool GetNumericProperty(const char* name_data, size_t name_size,
                         size_t* value) {
   // LINT.IfChange
@@ -778,6 +1344,29 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
     return true;
   }
 
+  if (name == "safe_tcmalloc.escape_metadata_bytes") {
+    TCMallocStats stats;
+    ExtractTCMallocStats(&stats, false);
+    *value = stats.escape_metadata_bytes;
+    return true;
+  }
+
+  if (name == "safe_tcmalloc.metadata_hugepage_backed_bytes") {
+    TCMallocStats stats;
+    ExtractTCMallocStats(&stats, false);
+    *value = stats.metadata_hugepage_backed_bytes;
+    return true;
+  }
+
+#ifdef STATS_PAGE
+  if (name == "safe_tcmalloc.stats_page_fd") {
+    const int fd = stats_page_fd.load(std::memory_order_acquire);
+    if (fd < 0) return false;
+    *value = fd;
+    return true;
+  }
+#endif
+
   if (name == "tcmalloc.transfer_cache_free") {
     TCMallocStats stats;
     ExtractTCMallocStats(&stats, false);
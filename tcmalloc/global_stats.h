@@ -17,6 +17,8 @@
 
 #include <cstdint>
 
+#include "tcmalloc/escape_buffer.h"
+#include "tcmalloc/escape_table.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/page_allocator.h"
 #include "tcmalloc/span_stats.h"
@@ -41,9 +43,30 @@ struct TCMallocStats {
   AllocatorStats span_stats;     // Span objects
   AllocatorStats stack_stats;    // StackTrace objects
   AllocatorStats bucket_stats;   // StackTraceTable::Bucket objects
+  AllocatorStats escape_chunk_stats;  // escape chain chunks
+  size_t escape_chunk_released_bytes;  // escape chunk slabs given back
+  size_t escape_chunk_cached;  // free escape chunks cached by the CPU shards
+  AllocatorStats escape_table_stats;   // escape tables of spans
+  AllocatorStats escape_table_class_stats[kNumEscapeTableClasses];
+#ifdef SPARSE_ESCAPE_TABLES
+  // Spans with an escape table of each EscapeTableForm
+  int64_t escape_table_forms[static_cast<int>(EscapeTableForm::kNumForms)];
+#endif
+  AllocatorStats escape_buffer_stats;  // per-thread escape buffers
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+  // Escape buffers of each capacity
+  AllocatorStats escape_buffer_class_stats[EscapeBufferAllocator::kClasses];
+#endif
+  size_t escape_metadata_bytes;  // escape tables, chunks, buffers and filter
+  // Metadata carved from huge page aligned regions advised onto huge pages
+  size_t metadata_hugepage_backed_bytes;
   size_t pagemap_bytes;          // included in metadata bytes
   size_t percpu_metadata_bytes;  // included in metadata bytes
   BackingStats pageheap;         // Stats from page heap
+#ifdef COLD_TIER_BIND
+  size_t cold_tier_heap_bytes;      // backed bytes of the cold page heap
+  size_t cold_tier_metadata_bytes;  // backed escape chunks, if placed there
+#endif
   PageAllocator::PeakStats peak_stats;
 
   ArenaStats arena;  // Stats from the metadata Arena
@@ -73,6 +96,19 @@ size_t SlackBytes(const BackingStats& stats);
 void DumpStats(Printer* out, int level);
 void DumpStatsInPbtxt(Printer* out, int level);
 
+// Renders the stats into the snapshot GetStats() serves under
+// STATS_SNAPSHOT.  Called by the background thread.
+void RefreshStatsSnapshot();
+
+// Hands the interval of the continuous profile that just ended to its sink,
+// with the escapes of the live sampled objects, under CONTINUOUS_PROFILE.
+// Called by the background thread.
+void EmitContinuousProfile();
+
+// Copies key counters into the stats page external agents map, setting it up
+// on the first call, under STATS_PAGE.  Called by the background thread.
+void RefreshStatsPage();
+
 bool GetNumericProperty(const char* name_data, size_t name_size, size_t* value);
 
 }  // namespace tcmalloc_internal
@@ -23,6 +23,7 @@
 #include <array>
 #include <cmath>
 #include <csignal>
+#include <numeric>
 #include <tuple>
 #include <utility>
 
@@ -35,6 +36,8 @@
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/internal/stack_unwinder.h"
 #include "tcmalloc/internal/util.h"
 #include "tcmalloc/pagemap.h"
 #include "tcmalloc/sampler.h"
@@ -98,11 +101,14 @@ void* GuardedPageAllocator::Allocate(size_t size, size_t alignment) {
   // Record stack trace.
   SlotMetadata& d = data_[free_slot];
   d.dealloc_trace.depth = 0;
-  d.alloc_trace.depth = absl::GetStackTrace(d.alloc_trace.stack, kMaxStackDepth,
-                                            /*skip_count=*/3);
+  d.alloc_trace.depth = CaptureStackTrace(d.alloc_trace.stack, kMaxStackDepth,
+                                          /*skip_count=*/3);
   d.alloc_trace.tid = absl::base_internal::GetTID();
   d.requested_size = size;
   d.allocation_start = reinterpret_cast<uintptr_t>(result);
+#ifdef SCALABLE_GUARDED_PAGES
+  d.allocated = true;
+#endif
 
   ASSERT(!alignment || d.allocation_start % alignment == 0);
   return result;
@@ -130,10 +136,13 @@ void GuardedPageAllocator::Deallocate(void* ptr) {
 
   // Record stack trace.
   GpaStackTrace& trace = data_[slot].dealloc_trace;
-  trace.depth = absl::GetStackTrace(trace.stack, kMaxStackDepth,
-                                    /*skip_count=*/2);
+  trace.depth = CaptureStackTrace(trace.stack, kMaxStackDepth,
+                                  /*skip_count=*/2);
   trace.tid = absl::base_internal::GetTID();
 
+#ifdef SCALABLE_GUARDED_PAGES
+  data_[slot].allocated = false;
+#endif
   FreeSlot(slot);
 }
 
@@ -176,7 +185,11 @@ static int GetChainedRate() {
 }
 
 void GuardedPageAllocator::Print(Printer* out) {
+  // Shard locks are taken before guarded_page_lock_, never after it.
+  const ShardStats shards = GetShardStats();
   absl::base_internal::SpinLockHolder h(&guarded_page_lock_);
+  const size_t requests = num_allocation_requests_ + shards.requests;
+  const size_t failures = num_failed_allocations_ + shards.failures;
   out->printf(
       "\n"
       "------------------------------------------------\n"
@@ -188,23 +201,28 @@ void GuardedPageAllocator::Print(Printer* out) {
       "Slots Currently Quarantined: %zu\n"
       "Maximum Slots Allocated: %zu / %zu\n"
       "PARAMETER tcmalloc_guarded_sample_parameter %d\n",
-      num_allocation_requests_ - num_failed_allocations_,
-      num_failed_allocations_, num_alloced_pages_,
+      requests - failures, failures, num_alloced_pages_ - shards.cached,
       total_pages_ - num_alloced_pages_, num_alloced_pages_max_,
       max_alloced_pages_, GetChainedRate());
 }
 
 void GuardedPageAllocator::PrintInPbtxt(PbtxtRegion* gwp_asan) {
+  const ShardStats shards = GetShardStats();
   absl::base_internal::SpinLockHolder h(&guarded_page_lock_);
-  gwp_asan->PrintI64("successful_allocations",
-                     num_allocation_requests_ - num_failed_allocations_);
-  gwp_asan->PrintI64("failed_allocations", num_failed_allocations_);
-  gwp_asan->PrintI64("current_slots_allocated", num_alloced_pages_);
+  const size_t requests = num_allocation_requests_ + shards.requests;
+  const size_t failures = num_failed_allocations_ + shards.failures;
+  gwp_asan->PrintI64("successful_allocations", requests - failures);
+  gwp_asan->PrintI64("failed_allocations", failures);
+  gwp_asan->PrintI64("current_slots_allocated",
+                     num_alloced_pages_ - shards.cached);
   gwp_asan->PrintI64("current_slots_quarantined",
                      total_pages_ - num_alloced_pages_);
   gwp_asan->PrintI64("max_slots_allocated", num_alloced_pages_max_);
   gwp_asan->PrintI64("allocated_slot_limit", max_alloced_pages_);
   gwp_asan->PrintI64("tcmalloc_guarded_sample_parameter", GetChainedRate());
+#ifdef SCALABLE_GUARDED_PAGES
+  gwp_asan->PrintI64("current_slots_reserved_by_shards", shards.cached);
+#endif
 }
 
 // Maps 2 * total_pages_ + 1 pages so that there are total_pages_ unique pages
@@ -227,12 +245,26 @@ void GuardedPageAllocator::MapPages() {
     return;
   }
 
+#ifdef SCALABLE_GUARDED_PAGES
+  // The metadata of tens of thousands of slots is mapped apart, and only the
+  // pages of the slots used are committed: zero is what SlotMetadata starts
+  // as.
+  void* data = mmap(nullptr, sizeof(*data_) * total_pages_,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (data == MAP_FAILED) {
+    ASSERT(false && "Failed to map page-guarded slot metadata.");
+    return;
+  }
+  data_ = static_cast<SlotMetadata*>(data);
+#else
   // Allocate memory for slot metadata.
   data_ = reinterpret_cast<SlotMetadata*>(
       tc_globals.arena().Alloc(sizeof(*data_) * total_pages_));
   for (size_t i = 0; i < total_pages_; ++i) {
     new (&data_[i]) SlotMetadata;
   }
+#endif
 
   pages_base_addr_ = base_addr;
   pages_end_addr_ = pages_base_addr_ + len;
@@ -240,10 +272,77 @@ void GuardedPageAllocator::MapPages() {
   // Align first page to page_size_.
   first_page_addr_ = GetPageAddr(pages_base_addr_ + page_size_);
 
+#ifdef SCALABLE_GUARDED_PAGES
+  free_slots_.SetRange(0, total_pages_);
+#else
   std::fill_n(free_pages_, total_pages_, true);
+#endif
   initialized_ = true;
 }
 
+#ifdef SCALABLE_GUARDED_PAGES
+ssize_t GuardedPageAllocator::ReserveFreeSlot() {
+  const int cpu = subtle::percpu::GetCurrentCpu();
+  Shard& s = shards_[cpu < 0 ? 0 : static_cast<size_t>(cpu) % kShards];
+  absl::base_internal::SpinLockHolder h(&s.lock);
+  if (s.count == 0 && !RefillShard(&s)) return -1;
+  s.requests++;
+  if (s.count > 0) return s.slots[--s.count];
+
+  // The pool is out of slots, but other shards may still hold some.  They
+  // are only tried, as two shards stealing from each other would deadlock.
+  for (Shard& other : shards_) {
+    if (&other == &s) continue;
+    ssize_t slot = -1;
+    if (other.lock.TryLock()) {
+      if (other.count > 0) slot = other.slots[--other.count];
+      other.lock.Unlock();
+    }
+    if (slot != -1) return slot;
+  }
+  s.failures++;
+  return -1;
+}
+
+bool GuardedPageAllocator::RefillShard(Shard* s) {
+  absl::base_internal::SpinLockHolder h(&guarded_page_lock_);
+  if (!initialized_ || !allow_allocations_) return false;
+  while (s->count < kBatch && num_alloced_pages_ < max_alloced_pages_) {
+    rand_ = NextRandom(rand_);
+    size_t slot = free_slots_.FindSet(rand_ % total_pages_);
+    if (slot >= total_pages_) slot = free_slots_.FindSet(0);
+    ASSERT(slot < total_pages_);
+    free_slots_.ClearBit(slot);
+    num_alloced_pages_++;
+    s->slots[s->count++] = slot;
+  }
+  num_alloced_pages_max_ = std::max(num_alloced_pages_, num_alloced_pages_max_);
+  return true;
+}
+
+GuardedPageAllocator::ShardStats GuardedPageAllocator::GetShardStats() {
+  ShardStats stats;
+  for (Shard& s : shards_) {
+    absl::base_internal::SpinLockHolder h(&s.lock);
+    stats.requests += s.requests;
+    stats.failures += s.failures;
+    stats.cached += s.count;
+  }
+  return stats;
+}
+
+void GuardedPageAllocator::FreeSlot(size_t slot) {
+  ASSERT(slot < total_pages_);
+  ASSERT(!free_slots_.GetBit(slot));
+  free_slots_.SetBit(slot);
+  num_alloced_pages_--;
+}
+
+bool GuardedPageAllocator::IsFreed(size_t slot) const {
+  return !data_[slot].allocated;
+}
+#else
+
 // Selects a random slot in O(total_pages_) time.
 ssize_t GuardedPageAllocator::ReserveFreeSlot() {
   absl::base_internal::SpinLockHolder h(&guarded_page_lock_);
@@ -281,6 +380,11 @@ void GuardedPageAllocator::FreeSlot(size_t slot) {
   num_alloced_pages_--;
 }
 
+bool GuardedPageAllocator::IsFreed(size_t slot) const {
+  return free_pages_[slot];
+}
+#endif
+
 uintptr_t GuardedPageAllocator::GetPageAddr(uintptr_t addr) const {
   const uintptr_t addr_mask = ~(page_size_ - 1ULL);
   return addr & addr_mask;
@@ -308,10 +412,6 @@ size_t GuardedPageAllocator::GetNearestSlot(uintptr_t addr) const {
   return AddrToSlot(GetPageAddr(GetNearestValidPage(addr)));
 }
 
-bool GuardedPageAllocator::IsFreed(size_t slot) const {
-  return free_pages_[slot];
-}
-
 bool GuardedPageAllocator::WriteOverflowOccurred(size_t slot) const {
   if (!ShouldRightAlign(slot)) return false;
   uint8_t magic = GetWriteOverflowMagic(slot);
@@ -371,7 +471,17 @@ void GuardedPageAllocator::MaybeRightAlign(size_t slot, size_t size,
 
   // Ensure valid alignment.
   alignment = std::max(alignment, default_alignment);
+#ifdef ENABLE_PROTECTION
+  // The page info describes the object as the chunk of its size rounded up
+  // to 8 bytes that contains it, counted from the start of its page (see
+  // SampleifyAllocation()), so the object has to start such a chunk.
+  const size_t chunk = std::max((size + 7) & ~size_t{7}, size_t{8});
+  const size_t step = chunk / std::gcd(chunk, alignment) * alignment;
+  const uintptr_t page = adjusted_ptr & ~(kPageSize - 1);
+  uintptr_t alignment_padding = (adjusted_ptr - page) % step;
+#else
   uintptr_t alignment_padding = adjusted_ptr & (alignment - 1);
+#endif
   adjusted_ptr -= alignment_padding;
 
   // Write magic bytes in alignment padding to detect small overflow writes.
@@ -26,6 +26,9 @@
 #include "absl/base/thread_annotations.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/logging.h"
+#ifdef SCALABLE_GUARDED_PAGES
+#include "tcmalloc/internal/range_tracker.h"
+#endif
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -71,7 +74,11 @@ class GuardedPageAllocator {
   };
 
   // Maximum number of pages this class can allocate.
+#ifdef SCALABLE_GUARDED_PAGES
+  static constexpr size_t kGpaMaxPages = 32768;
+#else
   static constexpr size_t kGpaMaxPages = 512;
+#endif
 
   enum class ErrorType {
     kUseAfterFree,
@@ -85,7 +92,12 @@ class GuardedPageAllocator {
   constexpr GuardedPageAllocator()
       : guarded_page_lock_(absl::kConstInit,
                            absl::base_internal::SCHEDULE_KERNEL_ONLY),
+#ifdef SCALABLE_GUARDED_PAGES
+        shards_{},
+        free_slots_(),
+#else
         free_pages_{},
+#endif
         num_alloced_pages_(0),
         num_alloced_pages_max_(0),
         num_allocation_requests_(0),
@@ -187,8 +199,49 @@ class GuardedPageAllocator {
     GpaStackTrace dealloc_trace;
     size_t requested_size = 0;
     uintptr_t allocation_start = 0;
+#ifdef SCALABLE_GUARDED_PAGES
+    // Whether the slot holds an allocation, rather than being free or
+    // reserved by a shard.
+    bool allocated = false;
+#endif
   };
 
+#ifdef SCALABLE_GUARDED_PAGES
+  // Free slots reserved ahead for the CPUs of a shard, kBatch at a time, so
+  // that most allocations take no guarded_page_lock_.  Freed slots go back
+  // to the shared pool rather than to a shard, so that their reuse stays as
+  // far off as without shards.
+  static constexpr size_t kShards = 16;
+  static constexpr size_t kBatch = 8;
+
+  struct Shard {
+    absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    size_t slots[kBatch] ABSL_GUARDED_BY(lock) = {};
+    size_t count ABSL_GUARDED_BY(lock) = 0;
+    size_t requests ABSL_GUARDED_BY(lock) = 0;
+    size_t failures ABSL_GUARDED_BY(lock) = 0;
+  };
+
+  // Reserves up to kBatch random free slots for s.  Returns false, counting
+  // nothing, if AllowAllocations() hasn't been called yet.
+  bool RefillShard(Shard* s) ABSL_EXCLUSIVE_LOCKS_REQUIRED(s->lock)
+      ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
+#endif
+
+  // The allocation requests and failures counted by the shards, and the
+  // slots they hold; all zero without SCALABLE_GUARDED_PAGES.
+  struct ShardStats {
+    size_t requests = 0;
+    size_t failures = 0;
+    size_t cached = 0;
+  };
+#ifdef SCALABLE_GUARDED_PAGES
+  ShardStats GetShardStats() ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
+#else
+  ShardStats GetShardStats() { return {}; }
+#endif
+
   // Max number of magic bytes we use to detect write-overflows at deallocation.
   static constexpr size_t kMagicSize = 32;
 
@@ -198,7 +251,8 @@ class GuardedPageAllocator {
 
   // Reserves and returns a slot randomly selected from the free slots in
   // free_pages_.  Returns -1 if no slots available, or if AllowAllocations()
-  // hasn't been called yet.
+  // hasn't been called yet.  With SCALABLE_GUARDED_PAGES the slot comes from
+  // the shard of the current CPU.
   ssize_t ReserveFreeSlot() ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
 
   // Returns the i-th free slot of free_pages_.  i must be in the range [0,
@@ -248,11 +302,20 @@ class GuardedPageAllocator {
 
   absl::base_internal::SpinLock guarded_page_lock_;
 
+#ifdef SCALABLE_GUARDED_PAGES
+  Shard shards_[kShards];
+
+  // One bit per page, set if the page is free and not reserved by a shard.
+  // A free slot is found a word of 64 pages at a time.
+  Bitmap<kGpaMaxPages> free_slots_ ABSL_GUARDED_BY(guarded_page_lock_);
+#else
   // Maps each bool to one page.
   // true: Free.  false: Reserved.
   bool free_pages_[kGpaMaxPages] ABSL_GUARDED_BY(guarded_page_lock_);
+#endif
 
-  // Number of currently-allocated pages.
+  // Number of currently-allocated pages, with SCALABLE_GUARDED_PAGES
+  // including those reserved by the shards.
   size_t num_alloced_pages_ ABSL_GUARDED_BY(guarded_page_lock_);
 
   // The high-water mark for num_alloced_pages_.
@@ -0,0 +1,101 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The bytes and limits of the heap partitions of
+// MallocExtension::GetHeapPartitionStats().
+
+#ifndef TCMALLOC_HEAP_PARTITION_H_
+#define TCMALLOC_HEAP_PARTITION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/malloc_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Byte counts of the page allocations made in each partition.  Lock-free; a
+// limit set while allocations race with it may let them pass it once.
+class HeapPartitions {
+ public:
+  static constexpr int kNumPartitions = MallocExtension::kMaxHeapPartitions;
+
+  constexpr HeapPartitions() = default;
+
+  static constexpr bool IsValid(int partition) {
+    return partition >= 0 && partition < kNumPartitions;
+  }
+
+  // Charges `bytes` to `partition`.  Returns false, and charges nothing, if
+  // that would take it past its limit.
+  bool Charge(int partition, size_t bytes) {
+    Partition& p = partitions_[partition];
+    const size_t limit = p.limit.load(std::memory_order_relaxed);
+    size_t now = p.bytes.load(std::memory_order_relaxed);
+    size_t next;
+    do {
+      next = now + bytes;
+      if (limit != 0 && (next > limit || next < now)) {
+        p.failed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    } while (!p.bytes.compare_exchange_weak(now, next,
+                                            std::memory_order_relaxed));
+    size_t peak = p.peak.load(std::memory_order_relaxed);
+    while (peak < next && !p.peak.compare_exchange_weak(
+                              peak, next, std::memory_order_relaxed)) {
+    }
+    return true;
+  }
+
+  void Uncharge(int partition, size_t bytes) {
+    partitions_[partition].bytes.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+  // 0 lifts the limit.
+  void SetLimit(int partition, size_t bytes) {
+    partitions_[partition].limit.store(bytes, std::memory_order_relaxed);
+  }
+
+  MallocExtension::HeapPartitionStats Stats(int partition) const {
+    const Partition& p = partitions_[partition];
+    MallocExtension::HeapPartitionStats stats;
+    stats.allocated_bytes = p.bytes.load(std::memory_order_relaxed);
+    stats.peak_bytes = p.peak.load(std::memory_order_relaxed);
+    stats.limit_bytes = p.limit.load(std::memory_order_relaxed);
+    stats.failed_allocations = p.failed.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+ private:
+  struct Partition {
+    std::atomic<size_t> bytes{0};
+    std::atomic<size_t> peak{0};
+    std::atomic<size_t> limit{0};
+    std::atomic<uint64_t> failed{0};
+  };
+
+  Partition partitions_[kNumPartitions];
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_HEAP_PARTITION_H_
@@ -0,0 +1,69 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/heap_partition.h"
+
+#include <stddef.h>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+TEST(HeapPartitions, ChargeAndUncharge) {
+  HeapPartitions partitions;
+  EXPECT_TRUE(partitions.Charge(1, 100));
+  EXPECT_TRUE(partitions.Charge(1, 50));
+  partitions.Uncharge(1, 100);
+
+  const auto stats = partitions.Stats(1);
+  EXPECT_EQ(stats.allocated_bytes, 50);
+  EXPECT_EQ(stats.peak_bytes, 150);
+  EXPECT_EQ(stats.limit_bytes, 0);
+  EXPECT_EQ(stats.failed_allocations, 0);
+  // Other partitions are untouched.
+  EXPECT_EQ(partitions.Stats(0).allocated_bytes, 0);
+  EXPECT_EQ(partitions.Stats(2).peak_bytes, 0);
+}
+
+TEST(HeapPartitions, Limit) {
+  HeapPartitions partitions;
+  partitions.SetLimit(3, 1000);
+  EXPECT_TRUE(partitions.Charge(3, 600));
+  EXPECT_FALSE(partitions.Charge(3, 600));
+  EXPECT_TRUE(partitions.Charge(3, 400));
+  EXPECT_FALSE(partitions.Charge(3, 1));
+
+  auto stats = partitions.Stats(3);
+  EXPECT_EQ(stats.allocated_bytes, 1000);
+  EXPECT_EQ(stats.limit_bytes, 1000);
+  EXPECT_EQ(stats.failed_allocations, 2);
+
+  // Lifting the limit lets it grow again.
+  partitions.SetLimit(3, 0);
+  EXPECT_TRUE(partitions.Charge(3, 600));
+  EXPECT_EQ(partitions.Stats(3).allocated_bytes, 1600);
+}
+
+TEST(HeapPartitions, IsValid) {
+  EXPECT_TRUE(HeapPartitions::IsValid(0));
+  EXPECT_TRUE(HeapPartitions::IsValid(HeapPartitions::kNumPartitions - 1));
+  EXPECT_FALSE(HeapPartitions::IsValid(-1));
+  EXPECT_FALSE(HeapPartitions::IsValid(HeapPartitions::kNumPartitions));
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -27,13 +27,17 @@
 #include "absl/container/flat_hash_set.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "tcmalloc/escape_buffer.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/pointer_tag.h"
 #include "tcmalloc/sampled_allocation.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/testing/test_allocator_harness.h"
 #include "tcmalloc/testing/thread_manager.h"
 
+extern "C" int __escape(void** loc, void* ptr);
+
 namespace tcmalloc {
 namespace {
 
@@ -59,6 +63,8 @@ TEST_P(HeapProfilingTest, GetHeapProfileWhileAllocAndDealloc) {
            ProfileType::kHeap,
            ProfileType::kFragmentation,
            ProfileType::kPeakHeap,
+           ProfileType::kEscapes,
+           ProfileType::kAges,
        }) {
     manager.Start(2, [&](int) {
       MallocExtension::SnapshotCurrent(t).Iterate(
@@ -182,5 +188,59 @@ TEST(HeapProfilingTest, CheckResidency) {
   }
 }
 
+TEST(HeapProfilingTest, AgeProfile) {
+  ScopedProfileSamplingRate s(1);
+  const size_t requested_size = (1 << 19) + 5;
+  void* old_obj = ::operator new(requested_size);
+  absl::SleepFor(absl::Milliseconds(20));
+  void* new_obj = ::operator new(requested_size + 1);
+
+  int old_bucket = -1, new_bucket = -1;
+  MallocExtension::SnapshotCurrent(ProfileType::kAges)
+      .Iterate([&](const Profile::Sample& s) {
+        EXPECT_GE(s.age_bucket, 0);
+        EXPECT_LT(s.age_bucket, Profile::Sample::kNumAgeBuckets);
+        if (s.requested_size == requested_size) old_bucket = s.age_bucket;
+        if (s.requested_size == requested_size + 1) new_bucket = s.age_bucket;
+      });
+  // 20 ms is in [16, 32) ms.
+  EXPECT_GE(old_bucket, 4);
+  EXPECT_GE(new_bucket, 0);
+  EXPECT_LT(new_bucket, old_bucket);
+
+  ::operator delete(new_obj);
+  ::operator delete(old_obj);
+}
+
+#ifdef ENABLE_PROTECTION
+TEST(HeapProfilingTest, EscapeProfile) {
+  if (tcmalloc_internal::PointerTags::enabled()) {
+    GTEST_SKIP() << "pointer tags replace escape tracking";
+  }
+  ScopedProfileSamplingRate s(1);
+  const size_t requested_size = (1 << 19) + 3;
+  constexpr int kEscapes = 4;
+
+  void* obj = ::operator new(requested_size);
+  void** holder = static_cast<void**>(::operator new(kEscapes * sizeof(void*)));
+  for (int i = 0; i < kEscapes; i++) {
+    holder[i] = obj;
+    __escape(&holder[i], obj);
+  }
+  tcmalloc_internal::CommitPendingEscapes();
+
+  int64_t escapes = 0;
+  MallocExtension::SnapshotCurrent(ProfileType::kEscapes)
+      .Iterate([&](const Profile::Sample& s) {
+        EXPECT_GT(s.escapes, 0);
+        if (s.requested_size == requested_size) escapes += s.escapes;
+      });
+  EXPECT_GE(escapes, kEscapes);
+
+  ::operator delete(holder);
+  ::operator delete(obj);
+}
+#endif
+
 }  // namespace
 }  // namespace tcmalloc
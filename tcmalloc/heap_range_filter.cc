@@ -0,0 +1,38 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/heap_range_filter.h"
+
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT std::atomic<uint64_t>
+    HeapRangeFilter::words_[HeapRangeFilter::kWords] = {};
+
+void HeapRangeFilter::Add(uintptr_t start, size_t bytes) {
+  if (bytes == 0) return;
+  ASSERT(((start + bytes - 1) >> kAddressBits) == 0);
+  const uintptr_t last = (start + bytes - 1) >> kGranuleShift;
+  for (uintptr_t g = start >> kGranuleShift; g <= last; ++g) {
+    words_[g / 64].fetch_or(uint64_t{1} << (g % 64),
+                            std::memory_order_relaxed);
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
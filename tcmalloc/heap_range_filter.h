@@ -0,0 +1,71 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Coarse summary of the address ranges the allocator ever mapped.
+
+#ifndef TCMALLOC_HEAP_RANGE_FILTER_H_
+#define TCMALLOC_HEAP_RANGE_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// One bit per kGranuleShift sized granule of the address space, set once any
+// byte of the granule was mapped by MmapAligned() or returned by
+// SystemAlloc().  Bounds checks read a single bit to reject stack, global and
+// other non-heap pointers before walking the page map.
+//
+// Bits are never cleared, so a set bit only means "maybe heap" and the page
+// map stays the authority.  A pointer to fresh heap memory reaches another
+// thread through some synchronization that follows the mapping, so relaxed
+// loads see its bit.  With 48 address bits the bitmap is 32KiB, of which a
+// process only ever touches the few cache lines covering its heap.
+class HeapRangeFilter {
+ public:
+  static constexpr int kGranuleShift = std::max(30, kAddressBits - 18);
+  static constexpr size_t kGranules = size_t{1}
+                                      << (kAddressBits - kGranuleShift);
+
+  // Returns false if addr is certainly not heap memory.
+  static bool ABSL_ATTRIBUTE_ALWAYS_INLINE MayContain(uintptr_t addr) {
+    if (ABSL_PREDICT_FALSE(addr >> kAddressBits)) return false;
+    const uintptr_t g = addr >> kGranuleShift;
+    return (words_[g / 64].load(std::memory_order_relaxed) >> (g % 64)) & 1;
+  }
+
+  // Marks [start, start + bytes) as possibly heap.
+  // REQUIRES: start + bytes <= 2^kAddressBits
+  static void Add(uintptr_t start, size_t bytes);
+
+ private:
+  static constexpr size_t kWords = (kGranules + 63) / 64;
+
+  ABSL_CONST_INIT static std::atomic<uint64_t> words_[kWords];
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_HEAP_RANGE_FILTER_H_
@@ -63,6 +63,18 @@ class HintedTrackerLists {
     return lists_[i].first();
   }
 
+  // Returns the pointer PeekLeast would return once <pt>, on the nonempty_[i]
+  // list, is removed: the one after it on that list, or the first one on the
+  // next non-empty list.  Returns nullptr if there is none.
+  // REQUIRES: i < N && pt is first on the nonempty_[i] list.
+  TrackerType* PeekNext(const TrackerType* pt, const size_t i) const {
+    ASSERT(i < N);
+    if (TrackerType* next = lists_[i].next(pt)) return next;
+    if (i + 1 == N) return nullptr;
+    const size_t j = nonempty_.FindSet(i + 1);
+    return j == N ? nullptr : lists_[j].first();
+  }
+
   // Adds pointer <pt> to the nonempty_[i] list.
   // REQUIRES: i < N && pt != nullptr.
   void Add(TrackerType* pt, const size_t i) {
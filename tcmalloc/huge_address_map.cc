@@ -26,6 +26,454 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+namespace {
+
+// The time of the union of x and y, an average weighted by their lengths.
+int64_t MergeWhen(HugeRange x, int64_t x_when, HugeRange y, int64_t y_when) {
+  // avoid overflow with floating-point
+  const size_t x_len = x.len().raw_num();
+  const size_t y_len = y.len().raw_num();
+  const double x_weight = static_cast<double>(x_len) * x_when;
+  const double y_weight = static_cast<double>(y_len) * y_when;
+  return static_cast<int64_t>((x_weight + y_weight) / (x_len + y_len));
+}
+
+}  // namespace
+
+size_t HugeAddressMap::nranges() const { return used_nodes_; }
+
+HugeLength HugeAddressMap::total_mapped() const { return total_size_; }
+
+HugeAddressMap::Node* HugeAddressMap::Node::next() {
+  const Node* n = static_cast<const Node*>(this)->next();
+  return const_cast<Node*>(n);
+}
+
+HugeAddressMap::Node* HugeAddressMap::first() {
+  const Node* f = static_cast<const HugeAddressMap*>(this)->first();
+  return const_cast<Node*>(f);
+}
+
+#ifdef HUGE_ADDRESS_BTREE
+const HugeAddressMap::Node* HugeAddressMap::Node::next() const {
+  const size_t i = this - leaf_->ranges;
+  if (i + 1 < leaf_->count) return &leaf_->ranges[i + 1];
+  const Leaf* next = leaf_->next;
+  return next ? &next->ranges[0] : nullptr;
+}
+
+const HugeAddressMap::Node* HugeAddressMap::first() const {
+  return head_ ? &head_->ranges[0] : nullptr;
+}
+
+HugePage HugeAddressMap::First(const Block* b) {
+  if (b->is_leaf) return static_cast<const Leaf*>(b)->ranges[0].range_.start();
+  return static_cast<const Inner*>(b)->first[0];
+}
+
+HugeLength HugeAddressMap::Longest(const Block* b) {
+  HugeLength longest = NHugePages(0);
+  if (b->is_leaf) {
+    const Leaf* leaf = static_cast<const Leaf*>(b);
+    for (size_t i = 0; i < leaf->count; ++i) {
+      longest = std::max(longest, leaf->ranges[i].range_.len());
+    }
+  } else {
+    const Inner* inner = static_cast<const Inner*>(b);
+    for (size_t i = 0; i < inner->count; ++i) {
+      longest = std::max(longest, inner->longest[i]);
+    }
+  }
+  return longest;
+}
+
+size_t HugeAddressMap::IndexOf(const Inner* parent, const Block* child) {
+  size_t i = 0;
+  while (parent->child[i] != child) {
+    ++i;
+    ASSERT(i < parent->count);
+  }
+  return i;
+}
+
+void HugeAddressMap::Check() {
+  size_t nodes = 0;
+  size_t blocks = 0;
+  size_t leaf_depth = 0;
+  HugeLength size = NHugePages(0);
+  if (root_) {
+    CHECK_CONDITION(root_->parent == nullptr);
+    Check(root_, 0, &leaf_depth, &nodes, &size, &blocks);
+  } else {
+    CHECK_CONDITION(head_ == nullptr);
+  }
+  // The leaves, in order, hold disjoint ranges in address order.
+  size_t listed = 0;
+  const Node* prev = nullptr;
+  for (const Node* n = first(); n != nullptr; n = n->next()) {
+    if (prev) {
+      CHECK_CONDITION(prev->range_.end_addr() < n->range_.start_addr());
+    }
+    prev = n;
+    ++listed;
+  }
+  CHECK_CONDITION(listed == nodes);
+  CHECK_CONDITION(nodes == nranges());
+  CHECK_CONDITION(size == total_mapped());
+  CHECK_CONDITION(blocks == used_blocks_);
+  size_t free_blocks = 0;
+  for (const Leaf* l = free_leaves_; l != nullptr; l = l->next) ++free_blocks;
+  for (const Inner* i = free_inners_; i != nullptr; i = i->parent) {
+    ++free_blocks;
+  }
+  CHECK_CONDITION(total_blocks_ == used_blocks_ + free_blocks);
+}
+
+void HugeAddressMap::Check(const Block* b, size_t depth, size_t* leaf_depth,
+                           size_t* num_nodes, HugeLength* size,
+                           size_t* num_blocks) const {
+  CHECK_CONDITION(b->count > 0 && b->count <= kFanout);
+  *num_blocks += 1;
+  if (b->is_leaf) {
+    // balanced
+    if (*leaf_depth == 0) *leaf_depth = depth + 1;
+    CHECK_CONDITION(*leaf_depth == depth + 1);
+    const Leaf* leaf = static_cast<const Leaf*>(b);
+    for (size_t i = 0; i < leaf->count; ++i) {
+      CHECK_CONDITION(leaf->ranges[i].leaf_ == leaf);
+      *num_nodes += 1;
+      *size += leaf->ranges[i].range_.len();
+    }
+    return;
+  }
+  const Inner* inner = static_cast<const Inner*>(b);
+  for (size_t i = 0; i < inner->count; ++i) {
+    const Block* child = inner->child[i];
+    // well-formed
+    CHECK_CONDITION(child->parent == inner);
+    CHECK_CONDITION(inner->first[i] == First(child));
+    CHECK_CONDITION(inner->longest[i] == Longest(child));
+    Check(child, depth + 1, leaf_depth, num_nodes, size, num_blocks);
+  }
+}
+
+void HugeAddressMap::Print(Printer* out) const {
+  out->printf("HugeAddressMap: B-tree %zu / %zu blocks used / created\n",
+              used_blocks_, total_blocks_);
+  const size_t longest = root_ ? Longest(root_).raw_num() : 0;
+  out->printf("HugeAddressMap: %zu contiguous hugepages available\n", longest);
+}
+
+void HugeAddressMap::PrintInPbtxt(PbtxtRegion* hpaa) const {
+  hpaa->PrintI64("num_huge_address_map_btree_blocks_used", used_blocks_);
+  hpaa->PrintI64("num_huge_address_map_btree_blocks_created", total_blocks_);
+  const size_t longest = root_ ? Longest(root_).in_bytes() : 0;
+  hpaa->PrintI64("contiguous_free_bytes", longest);
+}
+
+HugeAddressMap::Node* HugeAddressMap::Predecessor(HugePage p) {
+  Block* b = root_;
+  if (!b) return nullptr;
+  while (!b->is_leaf) {
+    Inner* inner = static_cast<Inner*>(b);
+    // The last child starting at or before p.
+    size_t i = inner->count;
+    while (i > 0 && p < inner->first[i - 1]) --i;
+    if (i == 0) return nullptr;
+    b = inner->child[i - 1];
+  }
+  Leaf* leaf = static_cast<Leaf*>(b);
+  size_t i = leaf->count;
+  while (i > 0 && p < leaf->ranges[i - 1].range_.start()) --i;
+  return i > 0 ? &leaf->ranges[i - 1] : nullptr;
+}
+
+HugeAddressMap::Node* HugeAddressMap::FindFit(HugeLength n) {
+  Block* b = root_;
+  if (!b || Longest(b) < n) return nullptr;
+  while (!b->is_leaf) {
+    Inner* inner = static_cast<Inner*>(b);
+    size_t best = inner->count;
+    for (size_t i = 0; i < inner->count; ++i) {
+      if (inner->longest[i] >= n &&
+          (best == inner->count || inner->longest[i] < inner->longest[best])) {
+        best = i;
+      }
+    }
+    ASSERT(best < inner->count);
+    b = inner->child[best];
+  }
+  Leaf* leaf = static_cast<Leaf*>(b);
+  Node* best = nullptr;
+  for (size_t i = 0; i < leaf->count; ++i) {
+    const HugeLength len = leaf->ranges[i].range_.len();
+    if (len >= n && (!best || len < best->range_.len())) {
+      best = &leaf->ranges[i];
+    }
+  }
+  return best;
+}
+
+void HugeAddressMap::Merge(Node* b, HugeRange r, Node* a) {
+  int64_t when = absl::base_internal::CycleClock::Now();
+  // Two way merges are easy.
+  if (a == nullptr) {
+    b->when_ = MergeWhen(b->range_, b->when(), r, when);
+    b->range_ = Join(b->range_, r);
+    FixUp(b->leaf_);
+    return;
+  } else if (b == nullptr) {
+    a->when_ = MergeWhen(r, when, a->range_, a->when());
+    a->range_ = Join(r, a->range_);
+    FixUp(a->leaf_);
+    return;
+  }
+
+  // Three way merge: removing a may move b, so find b again after.
+  HugeRange partial = Join(r, a->range_);
+  int64_t partial_when = MergeWhen(r, when, a->range_, a->when());
+  HugeRange full = Join(b->range_, partial);
+  int64_t full_when = MergeWhen(b->range_, b->when(), partial, partial_when);
+  // Removing a will reduce total_size_ by that length, but since we're merging
+  // we actually don't change lengths at all; undo that.
+  total_size_ += a->range_.len();
+  Remove(a);
+  b = Predecessor(full.start());
+  b->range_ = full;
+  b->when_ = full_when;
+  FixUp(b->leaf_);
+}
+
+void HugeAddressMap::Insert(HugeRange r) {
+  total_size_ += r.len();
+  // First, try to merge if necessary. Note there are three possibilities:
+  // we might need to merge before with r, r with after, or all three together.
+  Node* before = Predecessor(r.start());
+  CHECK_CONDITION(!before || !before->range_.intersects(r));
+  Node* after = before ? before->next() : first();
+  CHECK_CONDITION(!after || !after->range_.intersects(r));
+  if (before && before->range_.precedes(r)) {
+    if (after && r.precedes(after->range_)) {
+      Merge(before, r, after);
+    } else {
+      Merge(before, r, nullptr);
+    }
+    return;
+  } else if (after && r.precedes(after->range_)) {
+    Merge(nullptr, r, after);
+    return;
+  }
+  // No merging possible; just add a new node, after before.
+  used_nodes_++;
+  if (!root_) {
+    head_ = NewLeaf();
+    root_ = head_;
+  }
+  if (before) {
+    InsertAt(before->leaf_, before - before->leaf_->ranges + 1, r);
+  } else {
+    InsertAt(head_, 0, r);
+  }
+}
+
+void HugeAddressMap::InsertAt(Leaf* leaf, size_t i, HugeRange r) {
+  Leaf* const left = leaf;
+  if (leaf->count == kFanout) {
+    // Split off the upper half into a new leaf after this one.
+    constexpr size_t kHalf = kFanout / 2;
+    Leaf* right = NewLeaf();
+    for (size_t j = kHalf; j < kFanout; ++j) {
+      right->ranges[j - kHalf] = leaf->ranges[j];
+      right->ranges[j - kHalf].leaf_ = right;
+    }
+    right->count = kFanout - kHalf;
+    leaf->count = kHalf;
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next) leaf->next->prev = right;
+    leaf->next = right;
+    AddChild(leaf, right);
+    if (i > kHalf) {
+      leaf = right;
+      i -= kHalf;
+    }
+  }
+  for (size_t j = leaf->count; j > i; --j) {
+    leaf->ranges[j] = leaf->ranges[j - 1];
+  }
+  Node& n = leaf->ranges[i];
+  n.range_ = r;
+  n.when_ = absl::base_internal::CycleClock::Now();
+  n.leaf_ = leaf;
+  leaf->count++;
+  FixUp(leaf);
+  if (leaf != left) FixUp(left);
+}
+
+void HugeAddressMap::AddChild(Block* after, Block* n) {
+  Inner* parent = after->parent;
+  if (!parent) {
+    // after is the root: the tree grows a level.
+    parent = NewInner();
+    parent->child[0] = after;
+    parent->first[0] = First(after);
+    parent->longest[0] = Longest(after);
+    parent->count = 1;
+    after->parent = parent;
+    root_ = parent;
+  }
+  size_t i = IndexOf(parent, after) + 1;
+  if (parent->count == kFanout) {
+    constexpr size_t kHalf = kFanout / 2;
+    Inner* right = NewInner();
+    for (size_t j = kHalf; j < kFanout; ++j) {
+      right->child[j - kHalf] = parent->child[j];
+      right->first[j - kHalf] = parent->first[j];
+      right->longest[j - kHalf] = parent->longest[j];
+      parent->child[j]->parent = right;
+    }
+    right->count = kFanout - kHalf;
+    parent->count = kHalf;
+    AddChild(parent, right);
+    FixUp(parent);
+    if (i > kHalf) {
+      parent = right;
+      i -= kHalf;
+    }
+  }
+  for (size_t j = parent->count; j > i; --j) {
+    parent->child[j] = parent->child[j - 1];
+    parent->first[j] = parent->first[j - 1];
+    parent->longest[j] = parent->longest[j - 1];
+  }
+  parent->child[i] = n;
+  parent->first[i] = First(n);
+  parent->longest[i] = Longest(n);
+  parent->count++;
+  n->parent = parent;
+  FixUp(parent);
+}
+
+void HugeAddressMap::FixUp(Block* b) {
+  for (Inner* parent = b->parent; parent != nullptr;
+       b = parent, parent = parent->parent) {
+    const size_t i = IndexOf(parent, b);
+    parent->first[i] = First(b);
+    parent->longest[i] = Longest(b);
+  }
+}
+
+void HugeAddressMap::Remove(Node* n) {
+  total_size_ -= n->range_.len();
+  used_nodes_--;
+  Leaf* leaf = n->leaf_;
+  for (size_t j = n - leaf->ranges + 1; j < leaf->count; ++j) {
+    leaf->ranges[j - 1] = leaf->ranges[j];
+  }
+  leaf->count--;
+  if (leaf->count == 0) {
+    if (leaf->prev) {
+      leaf->prev->next = leaf->next;
+    } else {
+      head_ = leaf->next;
+    }
+    if (leaf->next) leaf->next->prev = leaf->prev;
+    RemoveChild(leaf);
+    return;
+  }
+
+  // Fold sparse neighbours under one parent together, so that leaves stay
+  // dense enough to be worth scanning.
+  for (Leaf* into : {leaf->prev, leaf}) {
+    Leaf* from = into ? into->next : nullptr;
+    if (!from || from->parent != into->parent ||
+        into->count + from->count > kFanout / 2) {
+      continue;
+    }
+    for (size_t j = 0; j < from->count; ++j) {
+      into->ranges[into->count + j] = from->ranges[j];
+      into->ranges[into->count + j].leaf_ = into;
+    }
+    into->count += from->count;
+    into->next = from->next;
+    if (from->next) from->next->prev = into;
+    FixUp(into);
+    RemoveChild(from);
+    return;
+  }
+  FixUp(leaf);
+}
+
+void HugeAddressMap::RemoveChild(Block* child) {
+  Inner* parent = child->parent;
+  if (!parent) {
+    Put(child);
+    root_ = nullptr;
+    return;
+  }
+  const size_t i = IndexOf(parent, child);
+  Put(child);
+  for (size_t j = i + 1; j < parent->count; ++j) {
+    parent->child[j - 1] = parent->child[j];
+    parent->first[j - 1] = parent->first[j];
+    parent->longest[j - 1] = parent->longest[j];
+  }
+  parent->count--;
+  if (parent->count == 0) {
+    RemoveChild(parent);
+    return;
+  }
+  FixUp(parent);
+  // A root with a single child is a level too many.
+  while (!root_->is_leaf && root_->count == 1) {
+    Inner* old = static_cast<Inner*>(root_);
+    root_ = old->child[0];
+    root_->parent = nullptr;
+    Put(old);
+  }
+}
+
+HugeAddressMap::Leaf* HugeAddressMap::NewLeaf() {
+  used_blocks_++;
+  Leaf* ret = free_leaves_;
+  if (ret) {
+    free_leaves_ = ret->next;
+  } else {
+    total_blocks_++;
+    ret = reinterpret_cast<Leaf*>(meta_(sizeof(Leaf)));
+  }
+  new (ret) Leaf();
+  ret->is_leaf = true;
+  return ret;
+}
+
+HugeAddressMap::Inner* HugeAddressMap::NewInner() {
+  used_blocks_++;
+  Inner* ret = free_inners_;
+  if (ret) {
+    free_inners_ = ret->parent;
+  } else {
+    total_blocks_++;
+    ret = reinterpret_cast<Inner*>(meta_(sizeof(Inner)));
+  }
+  new (ret) Inner();
+  ret->is_leaf = false;
+  return ret;
+}
+
+void HugeAddressMap::Put(Block* b) {
+  used_blocks_--;
+  if (b->is_leaf) {
+    Leaf* leaf = static_cast<Leaf*>(b);
+    leaf->next = free_leaves_;
+    free_leaves_ = leaf;
+  } else {
+    Inner* inner = static_cast<Inner*>(b);
+    inner->parent = free_inners_;
+    free_inners_ = inner;
+  }
+}
+#else
 const HugeAddressMap::Node* HugeAddressMap::Node::next() const {
   const Node* n = right_;
   if (n) {
@@ -44,11 +492,6 @@ const HugeAddressMap::Node* HugeAddressMap::Node::next() const {
   return nullptr;
 }
 
-HugeAddressMap::Node* HugeAddressMap::Node::next() {
-  const Node* n = static_cast<const Node*>(this)->next();
-  return const_cast<Node*>(n);
-}
-
 void HugeAddressMap::Node::Check(size_t* num_nodes, HugeLength* size) const {
   HugeLength longest = range_.len();
   *num_nodes += 1;
@@ -95,11 +538,6 @@ const HugeAddressMap::Node* HugeAddressMap::first() const {
   return n;
 }
 
-HugeAddressMap::Node* HugeAddressMap::first() {
-  const Node* f = static_cast<const HugeAddressMap*>(this)->first();
-  return const_cast<Node*>(f);
-}
-
 void HugeAddressMap::Check() {
   size_t nodes = 0;
   HugeLength size = NHugePages(0);
@@ -112,10 +550,6 @@ void HugeAddressMap::Check() {
   CHECK_CONDITION(total_nodes_ == used_nodes_ + freelist_size_);
 }
 
-size_t HugeAddressMap::nranges() const { return used_nodes_; }
-
-HugeLength HugeAddressMap::total_mapped() const { return total_size_; }
-
 void HugeAddressMap::Print(Printer* out) const {
   out->printf("HugeAddressMap: treap %zu / %zu nodes used / created\n",
               used_nodes_, total_nodes_);
@@ -151,26 +585,63 @@ HugeAddressMap::Node* HugeAddressMap::Predecessor(HugePage p) {
   return best;
 }
 
-void HugeAddressMap::Merge(Node* b, HugeRange r, Node* a) {
-  auto merge_when = [](HugeRange x, int64_t x_when, HugeRange y,
-                       int64_t y_when) {
-    // avoid overflow with floating-point
-    const size_t x_len = x.len().raw_num();
-    const size_t y_len = y.len().raw_num();
-    const double x_weight = static_cast<double>(x_len) * x_when;
-    const double y_weight = static_cast<double>(y_len) * y_when;
-    return static_cast<int64_t>((x_weight + y_weight) / (x_len + y_len));
-  };
+HugeAddressMap::Node* HugeAddressMap::FindFit(HugeLength n) {
+  Node* curr = root();
+  // invariant: curr != nullptr && curr->longest >= n
+  // we favor smaller gaps and lower nodes and lower addresses, in that
+  // order. The net effect is that we are neither a best-fit nor a
+  // lowest-address allocator but vaguely close to both.
+  Node* best = nullptr;
+  while (curr && curr->longest() >= n) {
+    if (curr->range().len() >= n) {
+      if (!best || best->range().len() > curr->range().len()) {
+        best = curr;
+      }
+    }
 
+    // Either subtree could contain a better fit and we don't want to
+    // search the whole tree. Pick a reasonable child to look at.
+    auto left = curr->left();
+    auto right = curr->right();
+    if (!left || left->longest() < n) {
+      curr = right;
+      continue;
+    }
+
+    if (!right || right->longest() < n) {
+      curr = left;
+      continue;
+    }
+
+    // Here, we have a nontrivial choice.
+    if (left->range().len() == right->range().len()) {
+      if (left->longest() <= right->longest()) {
+        curr = left;
+      } else {
+        curr = right;
+      }
+    } else if (left->range().len() < right->range().len()) {
+      // Here, the longest range in both children is the same...look
+      // in the subtree with the smaller root, as that's slightly
+      // more likely to be our best.
+      curr = left;
+    } else {
+      curr = right;
+    }
+  }
+  return best;
+}
+
+void HugeAddressMap::Merge(Node* b, HugeRange r, Node* a) {
   int64_t when = absl::base_internal::CycleClock::Now();
   // Two way merges are easy.
   if (a == nullptr) {
-    b->when_ = merge_when(b->range_, b->when(), r, when);
+    b->when_ = MergeWhen(b->range_, b->when(), r, when);
     b->range_ = Join(b->range_, r);
     FixLongest(b);
     return;
   } else if (b == nullptr) {
-    a->when_ = merge_when(r, when, a->range_, a->when());
+    a->when_ = MergeWhen(r, when, a->range_, a->when());
     a->range_ = Join(r, a->range_);
     FixLongest(a);
     return;
@@ -179,9 +650,9 @@ void HugeAddressMap::Merge(Node* b, HugeRange r, Node* a) {
   // Three way merge: slightly harder.  We must remove one node
   // (arbitrarily picking next).
   HugeRange partial = Join(r, a->range_);
-  int64_t partial_when = merge_when(r, when, a->range_, a->when());
+  int64_t partial_when = MergeWhen(r, when, a->range_, a->when());
   HugeRange full = Join(b->range_, partial);
-  int64_t full_when = merge_when(b->range_, b->when(), partial, partial_when);
+  int64_t full_when = MergeWhen(b->range_, b->when(), partial, partial_when);
   // Removing a will reduce total_size_ by that length, but since we're merging
   // we actually don't change lengths at all; undo that.
   total_size_ += a->range_.len();
@@ -368,6 +839,7 @@ HugeAddressMap::Node* HugeAddressMap::Get(HugeRange r) {
 
 HugeAddressMap::Node::Node(HugeRange r, int prio)
     : range_(r), prio_(prio), when_(absl::base_internal::CycleClock::Now()) {}
+#endif  // HUGE_ADDRESS_BTREE
 
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
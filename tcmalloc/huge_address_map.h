@@ -24,6 +24,138 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+#ifdef HUGE_ADDRESS_BTREE
+// Maintains a set of disjoint HugeRanges, merging adjacent ranges into one,
+// in a B+-tree (HUGE_ADDRESS_BTREE).  The leaves hold up to kFanout ranges
+// each, in address order and linked to each other; the inner nodes hold for
+// each of their children its lowest address and the length of its longest
+// range.  Lookups scan a contiguous block per level instead of chasing one
+// node per level of a treap, through a tree of a fraction of its depth.
+//
+// Node pointers stay valid until the next Insert() or Remove().
+class HugeAddressMap {
+  struct Leaf;
+
+ public:
+  typedef void* (*MetadataAllocFunction)(size_t bytes);
+  explicit constexpr HugeAddressMap(MetadataAllocFunction meta);
+
+  // IMPORTANT: DESTROYING A HUGE ADDRESS MAP DOES NOT MAKE ANY ATTEMPT
+  // AT FREEING ALLOCATED METADATA.
+  ~HugeAddressMap() = default;
+
+  class Node {
+   public:
+    // the range stored at this point
+    HugeRange range() const;
+    // Iterate to the next node in address order
+    const Node* next() const;
+    Node* next();
+    // when were this node's content added (in
+    // absl::base_internal::CycleClock::Now units)?
+    int64_t when() const;
+
+   private:
+    friend class HugeAddressMap;
+    HugeRange range_;
+    int64_t when_;
+    Leaf* leaf_;
+  };
+
+  // Get lowest-addressed node
+  const Node* first() const;
+  Node* first();
+
+  // Returns the highest-addressed range that does not lie completely
+  // after p (if any).
+  Node* Predecessor(HugePage p);
+
+  // Returns a range of at least n hugepages, if there is one.  Like the
+  // treap, it favors smaller ranges and lower addresses without being
+  // strictly best-fit: each inner node descends into the child whose
+  // longest range is the shortest that fits.
+  Node* FindFit(HugeLength n);
+
+  // Expensive consistency check.
+  void Check();
+
+  // Statistics
+  size_t nranges() const;
+  HugeLength total_mapped() const;
+  void Print(Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* hpaa) const;
+
+  // Add <r> to the map, merging with adjacent ranges as needed.
+  void Insert(HugeRange r);
+
+  // Delete n from the map.
+  void Remove(Node* n);
+
+ private:
+  static constexpr size_t kFanout = 16;
+
+  struct Inner;
+  struct Block {
+    Inner* parent;
+    bool is_leaf;
+    size_t count;
+  };
+
+  struct Leaf : Block {
+    Leaf* prev;
+    Leaf* next;
+    Node ranges[kFanout];
+  };
+
+  struct Inner : Block {
+    Block* child[kFanout];
+    // The lowest address and the longest range of each child.
+    HugePage first[kFanout];
+    HugeLength longest[kFanout];
+  };
+
+  Block* root_{nullptr};
+  Leaf* head_{nullptr};
+  size_t used_nodes_{0};
+  HugeLength total_size_{NHugePages(0)};
+
+  // Blocks in use, cached unused ones and how we get more.
+  size_t used_blocks_{0};
+  size_t total_blocks_{0};
+  Leaf* free_leaves_{nullptr};
+  Inner* free_inners_{nullptr};
+  MetadataAllocFunction meta_;
+  Leaf* NewLeaf();
+  Inner* NewInner();
+  void Put(Block* b);
+
+  static HugePage First(const Block* b);
+  static HugeLength Longest(const Block* b);
+  static size_t IndexOf(const Inner* parent, const Block* child);
+
+  // Refreshes the lowest address and longest range of b, and of each of its
+  // ancestors, in their parents.
+  void FixUp(Block* b);
+  // Makes n the child after `after` in the parent of `after`, splitting
+  // the parent if it is full.
+  void AddChild(Block* after, Block* n);
+  // Drops child, which is empty, from its parent.
+  void RemoveChild(Block* child);
+  // Inserts r at index i of leaf, splitting it if it is full.
+  void InsertAt(Leaf* leaf, size_t i, HugeRange r);
+  void Merge(Node* b, HugeRange r, Node* a);
+
+  // Recursive consistency check of the subtree at b, of the given depth.
+  void Check(const Block* b, size_t depth, size_t* leaf_depth,
+             size_t* num_nodes, HugeLength* size, size_t* num_blocks) const;
+};
+
+inline constexpr HugeAddressMap::HugeAddressMap(MetadataAllocFunction meta)
+    : meta_(meta) {}
+
+inline HugeRange HugeAddressMap::Node::range() const { return range_; }
+inline int64_t HugeAddressMap::Node::when() const { return when_; }
+#else
 // Maintains a set of disjoint HugeRanges, merging adjacent ranges into one.
 // Exposes a balanced (somehow) binary tree of free ranges on address,
 // augmented with the largest range in each subtree (this allows fairly simple
@@ -87,6 +219,10 @@ class HugeAddressMap {
   // after p (if any).
   Node* Predecessor(HugePage p);
 
+  // Returns a range of at least n hugepages, if there is one, favoring
+  // smaller ranges and lower nodes.
+  Node* FindFit(HugeLength n);
+
   // Expensive consistency check.
   void Check();
 
@@ -140,6 +276,7 @@ inline HugeAddressMap::Node* HugeAddressMap::root() { return root_; }
 inline const HugeAddressMap::Node* HugeAddressMap::root() const {
   return root_;
 }
+#endif  // HUGE_ADDRESS_BTREE
 
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -16,10 +16,13 @@
 
 #include <stdlib.h>
 
+#include <iterator>
+#include <map>
 #include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "absl/random/random.h"
 
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -80,6 +83,90 @@ TEST_F(HugeAddressMapTest, Merging) {
   EXPECT_THAT(Contents(), testing::ElementsAre(all));
 }
 
+TEST_F(HugeAddressMapTest, FindFit) {
+  EXPECT_EQ(map_.FindFit(hl(1)), nullptr);
+  map_.Insert(HugeRange::Make(hp(0), hl(4)));
+  map_.Insert(HugeRange::Make(hp(10), hl(2)));
+  map_.Insert(HugeRange::Make(hp(20), hl(8)));
+  map_.Check();
+  ASSERT_NE(map_.FindFit(hl(2)), nullptr);
+  EXPECT_GE(map_.FindFit(hl(2))->range().len(), hl(2));
+  ASSERT_NE(map_.FindFit(hl(5)), nullptr);
+  EXPECT_EQ(map_.FindFit(hl(5))->range(), HugeRange::Make(hp(20), hl(8)));
+  EXPECT_EQ(map_.FindFit(hl(9)), nullptr);
+}
+
+// Inserts and removes enough ranges to build and tear down a tree several
+// levels deep, checking it against a plain map of the same ranges.
+TEST_F(HugeAddressMapTest, MatchesReference) {
+  absl::BitGen rng;
+  // Hugepages come and go one at a time, so the ranges merge and split.
+  constexpr size_t kPages = 6000;
+  std::map<size_t, size_t> expected;  // first hugepage to length
+  auto reference_insert = [&](size_t first, size_t len) {
+    auto next = expected.lower_bound(first);
+    if (next != expected.end() && next->first == first + len) {
+      len += next->second;
+      next = expected.erase(next);
+    }
+    if (next != expected.begin()) {
+      auto prev = std::prev(next);
+      if (prev->first + prev->second == first) {
+        prev->second += len;
+        return;
+      }
+    }
+    expected[first] = len;
+  };
+
+  std::vector<bool> present(kPages, false);
+  for (int i = 0; i < 20000; ++i) {
+    const size_t page = absl::Uniform<size_t>(rng, 0, present.size());
+    if (!present[page]) {
+      present[page] = true;
+      map_.Insert(HugeRange::Make(hp(page), hl(1)));
+      reference_insert(page, 1);
+    } else {
+      // Remove the range holding page, and put back all of it but page.
+      HugeAddressMap::Node* node = map_.Predecessor(hp(page));
+      ASSERT_NE(node, nullptr);
+      const HugeRange r = node->range();
+      ASSERT_TRUE(r.contains(hp(page)));
+      map_.Remove(node);
+      expected.erase(r.start().index());
+      present[page] = false;
+      if (hp(page) > r.start()) {
+        const HugeRange before =
+            HugeRange::Make(r.start(), hp(page) - r.start());
+        map_.Insert(before);
+        reference_insert(before.start().index(), before.len().raw_num());
+      }
+      if (hp(page) + hl(1) < r.start() + r.len()) {
+        const HugeRange after = HugeRange::Make(
+            hp(page) + hl(1), r.start() + r.len() - hp(page) - hl(1));
+        map_.Insert(after);
+        reference_insert(after.start().index(), after.len().raw_num());
+      }
+    }
+    if (i % 1000 == 0) map_.Check();
+
+    const HugeLength want = hl(absl::Uniform<size_t>(rng, 1, 8));
+    bool fits = false;
+    for (const auto& [first, len] : expected) fits |= len >= want.raw_num();
+    HugeAddressMap::Node* fit = map_.FindFit(want);
+    ASSERT_EQ(fit != nullptr, fits);
+    if (fit) EXPECT_GE(fit->range().len(), want);
+  }
+  map_.Check();
+
+  std::vector<HugeRange> want;
+  for (const auto& [first, len] : expected) {
+    want.push_back(HugeRange::Make(hp(first), hl(len)));
+  }
+  EXPECT_EQ(Contents(), want);
+  EXPECT_EQ(map_.nranges(), expected.size());
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
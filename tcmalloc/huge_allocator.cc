@@ -38,53 +38,6 @@ void HugeAllocator::PrintInPbtxt(PbtxtRegion* hpaa) const {
   hpaa->PrintI64("num_in_use_huge_pages", in_use_.raw_num());
 }
 
-HugeAddressMap::Node* HugeAllocator::Find(HugeLength n) {
-  HugeAddressMap::Node* curr = free_.root();
-  // invariant: curr != nullptr && curr->longest >= n
-  // we favor smaller gaps and lower nodes and lower addresses, in that
-  // order. The net effect is that we are neither a best-fit nor a
-  // lowest-address allocator but vaguely close to both.
-  HugeAddressMap::Node* best = nullptr;
-  while (curr && curr->longest() >= n) {
-    if (curr->range().len() >= n) {
-      if (!best || best->range().len() > curr->range().len()) {
-        best = curr;
-      }
-    }
-
-    // Either subtree could contain a better fit and we don't want to
-    // search the whole tree. Pick a reasonable child to look at.
-    auto left = curr->left();
-    auto right = curr->right();
-    if (!left || left->longest() < n) {
-      curr = right;
-      continue;
-    }
-
-    if (!right || right->longest() < n) {
-      curr = left;
-      continue;
-    }
-
-    // Here, we have a nontrivial choice.
-    if (left->range().len() == right->range().len()) {
-      if (left->longest() <= right->longest()) {
-        curr = left;
-      } else {
-        curr = right;
-      }
-    } else if (left->range().len() < right->range().len()) {
-      // Here, the longest range in both children is the same...look
-      // in the subtree with the smaller root, as that's slightly
-      // more likely to be our best.
-      curr = left;
-    } else {
-      curr = right;
-    }
-  }
-  return best;
-}
-
 void HugeAllocator::CheckFreelist() {
   free_.Check();
   size_t num_nodes = free_.nranges();
@@ -116,14 +69,14 @@ HugeRange HugeAllocator::AllocateRange(HugeLength n) {
 
 HugeRange HugeAllocator::Get(HugeLength n) {
   CHECK_CONDITION(n > NHugePages(0));
-  auto* node = Find(n);
+  auto* node = free_.FindFit(n);
   if (!node) {
     // Get more memory, then "delete" it
     HugeRange r = AllocateRange(n);
     if (!r.valid()) return r;
     in_use_ += r.len();
     Release(r);
-    node = Find(n);
+    node = free_.FindFit(n);
     CHECK_CONDITION(node != nullptr);
   }
   in_use_ += n;
@@ -79,13 +79,12 @@ class HugeAllocator {
   // * no pre-allocation.
   // * reasonable space overhead
   //
-  // We use a treap ordered on addresses to track.  This isn't the most
+  // We use a map ordered on addresses to track.  This isn't the most
   // efficient thing ever but we're about to hit 100usec+/hugepage
   // backing costs if we've gotten this far; the last few bits of performance
   // don't matter, and most of the simple ideas can't hit all of the above
   // requirements.
   HugeAddressMap free_;
-  HugeAddressMap::Node* Find(HugeLength n);
 
   void CheckFreelist();
   void DebugCheckFreelist() {
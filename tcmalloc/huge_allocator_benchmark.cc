@@ -0,0 +1,89 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The latency of HugeAllocator::Get() and Release(), and with them of the
+// lookups of HugeAddressMap, as the free ranges grow in number.
+//
+// BM_GetRelease fragments the free list into state.range(0) ranges of 1 to
+// 16 hugepages, each between two ranges in use, then times getting a range
+// of random length and releasing it, which merges it back into what was
+// left of the range it came from.  Run it with and without
+// HUGE_ADDRESS_BTREE to compare the treap with the B-tree.
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include "absl/random/random.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/huge_allocator.h"
+#include "tcmalloc/huge_pages.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr size_t kMaxRangeLength = 16;
+
+// Hands out address space that is never touched, from 1 TiB on.
+AddressRange AllocateFake(size_t bytes, size_t align) {
+  static uintptr_t next = uintptr_t{1} << 40;
+  CHECK_CONDITION(align % kHugePageSize == 0);
+  next = (next + align - 1) & ~(align - 1);
+  void* ptr = reinterpret_cast<void*>(next);
+  next += bytes;
+  return {ptr, bytes};
+}
+
+// Metadata is never freed, as with the real arena.
+void* MallocMetadata(size_t size) { return malloc(size); }
+
+void BM_GetRelease(benchmark::State& state) {
+  const size_t ranges = state.range(0);
+  absl::BitGen rng;
+  auto length = [&] {
+    return NHugePages(absl::Uniform<size_t>(rng, 1, kMaxRangeLength + 1));
+  };
+
+  HugeAllocator* allocator = new HugeAllocator(AllocateFake, MallocMetadata);
+  // Take ranges in pairs and release the first of each, so the free ones
+  // cannot merge.
+  std::vector<HugeRange> held;
+  for (size_t i = 0; i < ranges; ++i) {
+    const HugeRange free = allocator->Get(length());
+    held.push_back(allocator->Get(NHugePages(1)));
+    CHECK_CONDITION(free.valid() && held.back().valid());
+    allocator->Release(free);
+  }
+
+  std::vector<HugeLength> lengths(1024);
+  for (HugeLength& n : lengths) n = length();
+  size_t i = 0;
+  for (auto _ : state) {
+    HugeRange r = allocator->Get(lengths[i++ % lengths.size()]);
+    benchmark::DoNotOptimize(r);
+    allocator->Release(r);
+  }
+  state.SetItemsProcessed(state.iterations());
+  // The allocator and its metadata are leaked, like the fake address space.
+}
+
+BENCHMARK(BM_GetRelease)->Range(16, 1 << 16);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
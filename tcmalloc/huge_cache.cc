@@ -100,7 +100,37 @@ template class MinMaxTracker<600>;
 // The logic for actually allocating from the cache or backing, and keeping
 // the hit rates specified.
 HugeRange HugeCache::DoGet(HugeLength n, bool* from_released) {
-  auto* node = Find(n);
+  // Prefer the tiers whose pages are still resident, and among the shards
+  // of the first one, memory on the calling CPU's node.
+  HugeAddressMap* map = nullptr;
+  HugeAddressMap::Node* node = nullptr;
+  const size_t local = CurrentShard();
+  NodeStats& stats = node_stats_[local];
+  for (size_t i = 0; i < kNodeShards; ++i) {
+    HugeAddressMap* shard = &cache_[(local + i) % kNodeShards];
+    node = shard->FindFit(n);
+    if (node) {
+      map = shard;
+      ++(i == 0 ? stats.local_hits : stats.remote_hits);
+      break;
+    }
+  }
+  if (!node) {
+    ++stats.other;
+    for (HugeAddressMap* tier : {&cold_, &paged_out_}) {
+      node = tier->FindFit(n);
+      if (node) {
+        map = tier;
+        break;
+      }
+    }
+  }
+  if (!node && releasing_size_ > NHugePages(0)) {
+    // A range waiting to be unbacked is still backed: taking it back saves
+    // both its release and the faults of backing a fresh range.
+    map = &releasing_;
+    node = map->FindFit(n);
+  }
   if (!node) {
     misses_++;
     weighted_misses_ += n.raw_num();
@@ -114,14 +144,18 @@ HugeRange HugeCache::DoGet(HugeLength n, bool* from_released) {
   hits_++;
   weighted_hits_ += n.raw_num();
   *from_released = false;
-  size_ -= n;
-  UpdateSize(size());
+  if (map != &releasing_) {
+    size_ -= n;
+    UpdateSize(size());
+  } else {
+    releasing_size_ -= n;
+  }
   HugeRange result, leftover;
   // Put back whatever we have left (or nothing, if it's exact.)
   std::tie(result, leftover) = Split(node->range(), n);
-  cache_.Remove(node);
+  map->Remove(node);
   if (leftover.valid()) {
-    cache_.Insert(leftover);
+    map->Insert(leftover);
   }
   return result;
 }
@@ -191,6 +225,7 @@ void HugeCache::DecUsage(HugeLength n) {
 
 void HugeCache::UpdateSize(HugeLength size) {
   size_tracker_.Report(size);
+  idle_tracker_.Report(size);
 
   // TODO(b/134691947): moving this inside the MinMaxTracker would save one call
   // to clock_.now() but all MinMaxTrackers would track regret instead.
@@ -216,7 +251,7 @@ HugeRange HugeCache::Get(HugeLength n, bool* from_released) {
 void HugeCache::Release(HugeRange r) {
   DecUsage(r.len());
 
-  cache_.Insert(r);
+  cache_[ShardOf(r)].Insert(r);
   size_ += r.len();
   if (size_ <= limit()) {
     fills_++;
@@ -228,9 +263,9 @@ void HugeCache::Release(HugeRange r) {
   // the max size.  (This could reduce the number of regions we break
   // in half to avoid overshrinking.)
   if ((clock_.now() - last_limit_change_) > (cache_time_ticks_ * 2)) {
-    total_fast_unbacked_ += MaybeShrinkCacheLimit();
+    total_fast_unbacked_ += MaybeShrinkCacheLimit(defer_unback_);
   }
-  total_fast_unbacked_ += ShrinkCache(limit());
+  total_fast_unbacked_ += ShrinkCache(limit(), defer_unback_);
 
   UpdateSize(size());
 }
@@ -241,7 +276,15 @@ void HugeCache::ReleaseUnbacked(HugeRange r) {
   allocator_->Release(r);
 }
 
-HugeLength HugeCache::MaybeShrinkCacheLimit() {
+void HugeCache::Prefill(HugeRange r) {
+  cache_[ShardOf(r)].Insert(r);
+  size_ += r.len();
+  limit_ = std::max(limit(), size());
+  last_limit_change_ = clock_.now();
+  UpdateSize(size());
+}
+
+HugeLength HugeCache::MaybeShrinkCacheLimit(bool defer) {
   last_limit_change_ = clock_.now();
 
   const HugeLength min = size_tracker_.MinOverTime(kCacheTime * 2);
@@ -254,17 +297,27 @@ HugeLength HugeCache::MaybeShrinkCacheLimit() {
   HugeLength drop = std::max(min / 2, NHugePages(1));
   limit_ = std::max(limit() <= drop ? NHugePages(0) : limit() - drop,
                     MinCacheLimit());
-  return ShrinkCache(limit());
+  return ShrinkCache(limit(), defer);
 }
 
-HugeLength HugeCache::ShrinkCache(HugeLength target) {
+HugeLength HugeCache::ShrinkCache(HugeLength target, bool defer) {
   HugeLength removed = NHugePages(0);
   while (size_ > target) {
-    // Remove smallest-ish nodes, to avoid fragmentation where possible.
-    auto* node = Find(NHugePages(1));
+    // Evict from the tier idle the longest, and in it remove smallest-ish
+    // nodes, to avoid fragmentation where possible.
+    HugeAddressMap* map = &paged_out_;
+    if (map->total_mapped() == NHugePages(0)) map = &cold_;
+    if (map->total_mapped() == NHugePages(0)) {
+      // The fullest shard gives up its memory first.
+      map = &cache_[0];
+      for (HugeAddressMap& shard : cache_) {
+        if (shard.total_mapped() > map->total_mapped()) map = &shard;
+      }
+    }
+    auto* node = map->FindFit(NHugePages(1));
     CHECK_CONDITION(node);
     HugeRange r = node->range();
-    cache_.Remove(node);
+    map->Remove(node);
     // Suppose we're 10 MiB over target but the smallest available node
     // is 100 MiB.  Don't go overboard--split up the range.
     // In particular - this prevents disastrous results if we've decided
@@ -275,11 +328,18 @@ HugeLength HugeCache::ShrinkCache(HugeLength target) {
       HugeRange to_remove, leftover;
       std::tie(to_remove, leftover) = Split(r, delta);
       ASSERT(leftover.valid());
-      cache_.Insert(leftover);
+      map->Insert(leftover);
       r = to_remove;
     }
 
     size_ -= r.len();
+    if (defer) {
+      // Insert() merges r with queued neighbours, so the release thread
+      // unbacks runs of evictions with one call.
+      releasing_.Insert(r);
+      releasing_size_ += r.len();
+      continue;
+    }
     // Note, actual unback implementation is temporarily dropping and
     // re-acquiring the page heap lock here.
     unback_(r.start_addr(), r.byte_len());
@@ -290,14 +350,84 @@ HugeLength HugeCache::ShrinkCache(HugeLength target) {
   return removed;
 }
 
+HugeLength HugeCache::ReleasePending() {
+  HugeLength released = NHugePages(0);
+  while (releasing_size_ > NHugePages(0)) {
+    auto* node = releasing_.first();
+    CHECK_CONDITION(node);
+    const HugeRange r = node->range();
+    // Dequeue before unbacking: Get() and Release() may run on the queue
+    // while unback_ has dropped the page heap lock.
+    releasing_.Remove(node);
+    releasing_size_ -= r.len();
+    unback_(r.start_addr(), r.byte_len());
+    allocator_->Release(r);
+    released += r.len();
+  }
+  total_deferred_unbacked_ += released;
+  return released;
+}
+
+HugeLength HugeCache::AdviseIdle() {
+  UpdateSize(size());
+  HugeLength advised = NHugePages(0);
+  // Epochs without a report count as no constraint, so clamp to what is
+  // cached now.
+  const HugeLength idle_pageout =
+      std::min(idle_tracker_.MinOverTime(kPageOutTime), size());
+  const HugeLength idle_cold =
+      std::min(idle_tracker_.MinOverTime(kColdTime), size());
+  if (advise_pageout_ != nullptr && idle_pageout > paged_out()) {
+    advised += Demote(&cold_, &paged_out_, idle_pageout - paged_out(),
+                      advise_pageout_);
+  }
+  if (advise_cold_ != nullptr) {
+    for (HugeAddressMap& shard : cache_) {
+      if (idle_cold <= cold() + paged_out()) break;
+      advised += Demote(&shard, &cold_, idle_cold - cold() - paged_out(),
+                        advise_cold_);
+    }
+  }
+  return advised;
+}
+
+
+HugeLength HugeCache::Demote(HugeAddressMap* from, HugeAddressMap* to,
+                             HugeLength n, MemoryModifyFunction advice) {
+  HugeLength demoted = NHugePages(0);
+  while (demoted < n && from->total_mapped() > NHugePages(0)) {
+    HugeAddressMap::Node* oldest = from->first();
+    for (HugeAddressMap::Node* node = oldest->next(); node != nullptr;
+         node = node->next()) {
+      if (node->when() < oldest->when()) oldest = node;
+    }
+    HugeRange r = oldest->range();
+    from->Remove(oldest);
+    if (r.len() > n - demoted) {
+      HugeRange leftover;
+      std::tie(r, leftover) = Split(r, n - demoted);
+      from->Insert(leftover);
+    }
+    // Insert() dates r now, so the next tier times it from its advice.
+    to->Insert(r);
+    demoted += r.len();
+    // Like unback_, the advice may drop the page heap lock.  Either advice
+    // keeps the contents, so a Get() of r meanwhile is safe.
+    advice(r.start_addr(), r.byte_len());
+  }
+  return demoted;
+}
+
 HugeLength HugeCache::ReleaseCachedPages(HugeLength n) {
+  HugeLength released = ReleasePending();
+
   // This is a good time to check: is our cache going persistently unused?
-  HugeLength released = MaybeShrinkCacheLimit();
+  released += MaybeShrinkCacheLimit(/*defer=*/false);
 
   if (released < n) {
     n -= released;
     const HugeLength target = n > size() ? NHugePages(0) : size() - n;
-    released += ShrinkCache(target);
+    released += ShrinkCache(target, /*defer=*/false);
   }
 
   UpdateSize(size());
@@ -308,65 +438,26 @@ HugeLength HugeCache::ReleaseCachedPages(HugeLength n) {
 void HugeCache::AddSpanStats(SmallSpanStats* small, LargeSpanStats* large,
                              PageAgeHistograms* ages) const {
   static_assert(kPagesPerHugePage >= kMaxPages);
-  for (const HugeAddressMap::Node* node = cache_.first(); node != nullptr;
-       node = node->next()) {
-    HugeLength n = node->range().len();
-    if (large != nullptr) {
-      large->spans++;
-      large->normal_pages += n.in_pages();
-    }
-
-    if (ages != nullptr) {
-      ages->RecordRange(n.in_pages(), false, node->when());
-    }
-  }
-}
-
-HugeAddressMap::Node* HugeCache::Find(HugeLength n) {
-  HugeAddressMap::Node* curr = cache_.root();
-  // invariant: curr != nullptr && curr->longest >= n
-  // we favor smaller gaps and lower nodes and lower addresses, in that
-  // order. The net effect is that we are neither a best-fit nor a
-  // lowest-address allocator but vaguely close to both.
-  HugeAddressMap::Node* best = nullptr;
-  while (curr && curr->longest() >= n) {
-    if (curr->range().len() >= n) {
-      if (!best || best->range().len() > curr->range().len()) {
-        best = curr;
+  auto add = [&](const HugeAddressMap* map) {
+    for (const HugeAddressMap::Node* node = map->first(); node != nullptr;
+         node = node->next()) {
+      HugeLength n = node->range().len();
+      if (large != nullptr) {
+        large->spans++;
+        large->normal_pages += n.in_pages();
       }
-    }
-
-    // Either subtree could contain a better fit and we don't want to
-    // search the whole tree. Pick a reasonable child to look at.
-    auto left = curr->left();
-    auto right = curr->right();
-    if (!left || left->longest() < n) {
-      curr = right;
-      continue;
-    }
 
-    if (!right || right->longest() < n) {
-      curr = left;
-      continue;
-    }
-
-    // Here, we have a nontrivial choice.
-    if (left->range().len() == right->range().len()) {
-      if (left->longest() <= right->longest()) {
-        curr = left;
-      } else {
-        curr = right;
+      if (ages != nullptr) {
+        ages->RecordRange(n.in_pages(), false, node->when());
       }
-    } else if (left->range().len() < right->range().len()) {
-      // Here, the longest range in both children is the same...look
-      // in the subtree with the smaller root, as that's slightly
-      // more likely to be our best.
-      curr = left;
-    } else {
-      curr = right;
     }
+  };
+  for (const HugeAddressMap& shard : cache_) {
+    add(&shard);
+  }
+  for (const HugeAddressMap* map : {&cold_, &paged_out_, &releasing_}) {
+    add(map);
   }
-  return best;
 }
 
 void HugeCache::Print(Printer* out) {
@@ -392,6 +483,25 @@ void HugeCache::Print(Printer* out) {
   out->printf("HugeCache: %zu MiB fast unbacked, %zu MiB periodic\n",
               total_fast_unbacked_.in_bytes() / 1024 / 1024,
               total_periodic_unbacked_.in_bytes() / 1024 / 1024);
+  out->printf(
+      "HugeCache: %zu hugepages waiting on the release thread, "
+      "%zu MiB released by it\n",
+      pending().raw_num(), total_deferred_unbacked_.in_bytes() / 1024 / 1024);
+  out->printf(
+      "HugeCache: %zu cached hugepages advised cold, %zu paged out\n",
+      cold().raw_num(), paged_out().raw_num());
+  if (kNodeShards > 1) {
+    for (size_t shard = 0; shard < kNodeShards; ++shard) {
+      const NodeStats& s = node_stats_[shard];
+      const size_t gets = s.local_hits + s.remote_hits + s.other;
+      out->printf(
+          "HugeCache: node shard %zu: %zu hugepages cached, %zu gets "
+          "(%.3f local hit rate, %.3f remote hit rate)\n",
+          shard, cache_[shard].total_mapped().raw_num(), gets,
+          safe_ratio(s.local_hits, s.remote_hits + s.other),
+          safe_ratio(s.remote_hits, s.local_hits + s.other));
+    }
+  }
   UpdateSize(size());
   out->printf(
       "HugeCache: %zu MiB*s cached since startup\n",
@@ -448,6 +558,24 @@ void HugeCache::PrintInPbtxt(PbtxtRegion* hpaa) {
   // bytes unbacked by periodic releaser thread
   hpaa->PrintI64("periodic_unbacked_bytes",
                  total_periodic_unbacked_.in_bytes());
+  // bytes queued for, and bytes unbacked by, the release thread
+  hpaa->PrintI64("pending_unback_bytes", pending().in_bytes());
+  hpaa->PrintI64("deferred_unbacked_bytes",
+                 total_deferred_unbacked_.in_bytes());
+  // cached bytes advised cold, and paged out, while idle
+  hpaa->PrintI64("cold_cached_bytes", cold().in_bytes());
+  hpaa->PrintI64("paged_out_cached_bytes", paged_out().in_bytes());
+  if (kNodeShards > 1) {
+    for (size_t shard = 0; shard < kNodeShards; ++shard) {
+      const NodeStats& s = node_stats_[shard];
+      auto region = hpaa->CreateSubRegion("huge_cache_node_shard");
+      region.PrintI64("shard", shard);
+      region.PrintI64("cached_bytes", cache_[shard].total_mapped().in_bytes());
+      region.PrintI64("local_hits", s.local_hits);
+      region.PrintI64("remote_hits", s.remote_hits);
+      region.PrintI64("other_gets", s.other);
+    }
+  }
   UpdateSize(size());
   // memory cached since startup (in MiB*s)
   hpaa->PrintI64("huge_cache_regret", NHugePages(regret_).in_mib() /
@@ -38,6 +38,10 @@ namespace tcmalloc {
 namespace tcmalloc_internal {
 
 typedef void (*MemoryModifyFunction)(void* start, size_t len);
+// Returns the NUMA node of the calling CPU, or of the memory at addr; -1 if
+// unknown.
+typedef int (*CurrentNodeFunction)();
+typedef int (*MemoryNodeFunction)(const void* addr);
 
 // Track the extreme values of a HugeLength value over the past
 // kWindow (time ranges approximate.)
@@ -95,10 +99,13 @@ class HugeCache {
  public:
   // For use in production
   HugeCache(HugeAllocator* allocator, MetadataAllocFunction meta_allocate,
-            MemoryModifyFunction unback)
+            MemoryModifyFunction unback,
+            MemoryModifyFunction advise_cold = nullptr,
+            MemoryModifyFunction advise_pageout = nullptr)
       : HugeCache(allocator, meta_allocate, unback,
                   Clock{.now = absl::base_internal::CycleClock::Now,
-                        .freq = absl::base_internal::CycleClock::Frequency}) {}
+                        .freq = absl::base_internal::CycleClock::Frequency},
+                  advise_cold, advise_pageout) {}
 
   // For testing with mock clock.
   //
@@ -126,10 +133,23 @@ class HugeCache {
   // capture the empirical dynamics we've seen.  See "Beyond Malloc
   // Efficiency..." (https://research.google/pubs/pub50370/) for more
   // information.
+  //
+  // <advise_cold> and <advise_pageout>, if given, are the hints AdviseIdle()
+  // gives hugepages the cache holds for long.
   HugeCache(HugeAllocator* allocator, MetadataAllocFunction meta_allocate,
-            MemoryModifyFunction unback, Clock clock)
+            MemoryModifyFunction unback, Clock clock,
+            MemoryModifyFunction advise_cold = nullptr,
+            MemoryModifyFunction advise_pageout = nullptr)
       : allocator_(allocator),
-        cache_(meta_allocate),
+#ifdef NUMA_HUGE_CACHE
+        cache_{HugeAddressMap(meta_allocate), HugeAddressMap(meta_allocate),
+               HugeAddressMap(meta_allocate), HugeAddressMap(meta_allocate)},
+#else
+        cache_{HugeAddressMap(meta_allocate)},
+#endif
+        cold_(meta_allocate),
+        paged_out_(meta_allocate),
+        releasing_(meta_allocate),
         clock_(clock),
         cache_time_ticks_(clock_.freq() * absl::ToDoubleSeconds(kCacheTime)),
         nanoseconds_per_tick_(absl::ToInt64Nanoseconds(absl::Seconds(1)) /
@@ -140,7 +160,10 @@ class HugeCache {
         usage_tracker_(clock, kCacheTime * 2),
         off_peak_tracker_(clock, kCacheTime * 2),
         size_tracker_(clock, kCacheTime * 2),
-        unback_(unback) {}
+        idle_tracker_(clock, kPageOutTime),
+        unback_(unback),
+        advise_cold_(advise_cold),
+        advise_pageout_(advise_pageout) {}
   // Allocate a usable set of <n> contiguous hugepages.  Try to give out
   // memory that's currently backed from the kernel if we have it available.
   // *from_released is set to false if the return range is already backed;
@@ -152,10 +175,52 @@ class HugeCache {
   // As Release, but the range is assumed to _not_ be backed.
   void ReleaseUnbacked(HugeRange r);
 
+  // Caches <r>, which is backed and was never handed out by Get(), and
+  // raises the limit to hold it.  The limit shrinks back as usual once the
+  // cache stays larger than it needs to be.
+  void Prefill(HugeRange r);
+
   // Release to the system up to <n> hugepages of cache contents; returns
-  // the number of hugepages released.
+  // the number of hugepages released.  Ranges waiting on the release thread
+  // are released first.
   HugeLength ReleaseCachedPages(HugeLength n);
 
+  // While set, ranges evicted by Release() are queued for ReleasePending()
+  // instead of being unbacked on the freeing thread.  Queued ranges are
+  // coalesced with their neighbours, stay backed and may be handed back out
+  // by Get() until they are released.
+  void set_defer_unback(bool value) { defer_unback_ = value; }
+  bool defer_unback() const { return defer_unback_; }
+
+  // With NUMA_HUGE_CACHE, backed hugepages that AdviseIdle() has not touched
+  // are cached in one shard per NUMA node (modulo kNodeShards): Release()
+  // files a range under the node of its memory, and Get() tries the shard
+  // of the calling CPU's node before the others.  Without node functions,
+  // everything goes to shard 0.
+  void set_node_functions(CurrentNodeFunction current_node,
+                          MemoryNodeFunction memory_node) {
+    current_node_ = current_node;
+    memory_node_ = memory_node;
+  }
+
+  // Unbacks every queued range, one call per coalesced range, and returns
+  // the number of hugepages released.
+  HugeLength ReleasePending();
+
+  // Backed memory evicted from the cache and waiting to be unbacked.
+  HugeLength pending() const { return releasing_size_; }
+
+  // Moves cached hugepages one tier down the way to release: once the cache
+  // has held a hugepage for kColdTime it is advised cold, and once it has
+  // held it for kPageOutTime it is paged out.  Eviction still unbacks them;
+  // it takes the deepest tier first, while Get() takes the shallowest.
+  // Returns the number of hugepages advised.
+  HugeLength AdviseIdle();
+
+  // Cached memory advised cold, and paged out, by AdviseIdle().
+  HugeLength cold() const { return cold_.total_mapped(); }
+  HugeLength paged_out() const { return paged_out_.total_mapped(); }
+
   // Backed memory available.
   HugeLength size() const { return size_; }
   // Total memory cached (in HugeLength * nanoseconds)
@@ -170,8 +235,8 @@ class HugeCache {
 
   BackingStats stats() const {
     BackingStats s;
-    s.system_bytes = (usage() + size()).in_bytes();
-    s.free_bytes = size().in_bytes();
+    s.system_bytes = (usage() + size() + pending()).in_bytes();
+    s.free_bytes = (size() + pending()).in_bytes();
     s.unmapped_bytes = 0;
     return s;
   }
@@ -187,21 +252,56 @@ class HugeCache {
   void MaybeGrowCacheLimit(HugeLength missed);
   // Check if the cache seems consistently too big.  Returns the
   // number of pages *evicted* (not the change in limit).
-  HugeLength MaybeShrinkCacheLimit();
+  HugeLength MaybeShrinkCacheLimit(bool defer);
 
   // Ensure the cache contains at most <target> hugepages,
-  // returning the number removed.
-  HugeLength ShrinkCache(HugeLength target);
+  // returning the number unbacked.  If <defer>, removed ranges are queued
+  // for ReleasePending() rather than unbacked.
+  HugeLength ShrinkCache(HugeLength target, bool defer);
 
   HugeRange DoGet(HugeLength n, bool* from_released);
 
-  HugeAddressMap::Node* Find(HugeLength n);
+  // Moves the oldest ranges of <from>, at least <n> hugepages if it has
+  // them, to <to> and gives each of them <advice>.
+  HugeLength Demote(HugeAddressMap* from, HugeAddressMap* to, HugeLength n,
+                    MemoryModifyFunction advice);
+
+#ifdef NUMA_HUGE_CACHE
+  static constexpr size_t kNodeShards = 4;
+#else
+  static constexpr size_t kNodeShards = 1;
+#endif
+
+  // The shard of node, and of the calling CPU and of r by the node
+  // functions.
+  static size_t NodeShard(int node) {
+    return node < 0 ? 0 : static_cast<size_t>(node) % kNodeShards;
+  }
+  size_t CurrentShard() const {
+    return current_node_ == nullptr ? 0 : NodeShard(current_node_());
+  }
+  size_t ShardOf(HugeRange r) const {
+    return memory_node_ == nullptr ? 0
+                                   : NodeShard(memory_node_(r.start_addr()));
+  }
 
-  HugeAddressMap cache_;
+  // Cached ranges by tier: cache_ holds the ones AdviseIdle() has not
+  // touched, by node shard, cold_ and paged_out_ the ones it advised.
+  // size_ counts all three.
+  HugeAddressMap cache_[kNodeShards];
+  HugeAddressMap cold_;
+  HugeAddressMap paged_out_;
   HugeLength size_{NHugePages(0)};
 
+  // Evicted, still backed ranges queued for ReleasePending().
+  HugeAddressMap releasing_;
+  HugeLength releasing_size_{NHugePages(0)};
+  bool defer_unback_{false};
+
   HugeLength limit_{NHugePages(10)};
   const absl::Duration kCacheTime = absl::Seconds(1);
+  const absl::Duration kColdTime = absl::Seconds(10);
+  const absl::Duration kPageOutTime = absl::Minutes(1);
 
   size_t hits_{0};
   size_t misses_{0};
@@ -210,6 +310,18 @@ class HugeCache {
   uint64_t weighted_hits_{0};
   uint64_t weighted_misses_{0};
 
+  // Get()s by the shard of the calling CPU: hits in its own shard of cache_,
+  // hits in another shard of it, and the rest (hits in the other tiers and
+  // misses.)
+  struct NodeStats {
+    size_t local_hits;
+    size_t remote_hits;
+    size_t other;
+  };
+  NodeStats node_stats_[kNodeShards] = {};
+  CurrentNodeFunction current_node_{nullptr};
+  MemoryNodeFunction memory_node_{nullptr};
+
   // Sum(size of Gets) - Sum(size of Releases), i.e. amount of backed
   // hugepages our user currently wants to have.
   void IncUsage(HugeLength n);
@@ -237,11 +349,18 @@ class HugeCache {
   MinMaxTracker<> usage_tracker_;
   MinMaxTracker<> off_peak_tracker_;
   MinMaxTracker<> size_tracker_;
+  // The cache size over kPageOutTime: the cache held at least
+  // MinOverTime(t) hugepages throughout the last t, so that many of its
+  // hugepages have been idle for t.
+  MinMaxTracker<600> idle_tracker_;
 
   HugeLength total_fast_unbacked_{NHugePages(0)};
   HugeLength total_periodic_unbacked_{NHugePages(0)};
+  HugeLength total_deferred_unbacked_{NHugePages(0)};
 
   MemoryModifyFunction unback_;
+  MemoryModifyFunction advise_cold_;
+  MemoryModifyFunction advise_pageout_;
 };
 
 }  // namespace tcmalloc_internal
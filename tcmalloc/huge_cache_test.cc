@@ -20,6 +20,7 @@
 #include <algorithm>
 #include <memory>
 #include <random>
+#include <string>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -91,15 +92,21 @@ class HugeCacheTest : public testing::Test {
   class BackingInterface {
    public:
     virtual void Unback(void* p, size_t len) = 0;
+    virtual void MarkCold(void* p, size_t len) = 0;
+    virtual void PageOut(void* p, size_t len) = 0;
     virtual ~BackingInterface() {}
   };
 
   class MockBackingInterface : public BackingInterface {
    public:
     MOCK_METHOD2(Unback, void(void* p, size_t len));
+    MOCK_METHOD2(MarkCold, void(void* p, size_t len));
+    MOCK_METHOD2(PageOut, void(void* p, size_t len));
   };
 
   static void MockUnback(void* p, size_t len) { mock_->Unback(p, len); }
+  static void MockMarkCold(void* p, size_t len) { mock_->MarkCold(p, len); }
+  static void MockPageOut(void* p, size_t len) { mock_->PageOut(p, len); }
 
  protected:
   static std::unique_ptr<testing::NiceMock<MockBackingInterface>> mock_;
@@ -130,6 +137,12 @@ class HugeCacheTest : public testing::Test {
   HugeAllocator alloc_{AllocateFake, MallocMetadata};
   HugeCache cache_{&alloc_, MallocMetadata, MockUnback,
                    Clock{.now = GetClock, .freq = GetClockFrequency}};
+  HugeCache tiered_cache_{&alloc_,
+                          MallocMetadata,
+                          MockUnback,
+                          Clock{.now = GetClock, .freq = GetClockFrequency},
+                          MockMarkCold,
+                          MockPageOut};
 };
 
 std::vector<size_t> HugeCacheTest::backing;
@@ -205,6 +218,145 @@ TEST_F(HugeCacheTest, Release) {
   EXPECT_EQ(NHugePages(4), cache_.ReleaseCachedPages(NHugePages(200)));
 }
 
+TEST_F(HugeCacheTest, Prefill) {
+  bool from;
+  // More than the initial limit stays cached, and is handed out backed.
+  EXPECT_CALL(*mock_, Unback(testing::_, testing::_)).Times(0);
+  cache_.Prefill(alloc_.Get(NHugePages(32)));
+  EXPECT_EQ(NHugePages(32), cache_.size());
+  EXPECT_LE(NHugePages(32), cache_.limit());
+  EXPECT_EQ(NHugePages(0), cache_.usage());
+  HugeRange r = cache_.Get(NHugePages(20), &from);
+  EXPECT_FALSE(from);
+  cache_.Release(r);
+  EXPECT_EQ(NHugePages(32), cache_.size());
+  testing::Mock::VerifyAndClearExpectations(mock_.get());
+
+  // Once it sits unused for a while, the limit shrinks back.
+  Advance(absl::Seconds(10));
+  r = cache_.Get(NHugePages(1), &from);
+  cache_.Release(r);
+  EXPECT_GT(NHugePages(32), cache_.limit());
+  EXPECT_GE(cache_.limit(), cache_.size());
+}
+
+#ifdef NUMA_HUGE_CACHE
+int fake_current_node;
+const void* fake_remote_addr;
+
+int FakeCurrentNode() { return fake_current_node; }
+int FakeMemoryNode(const void* addr) {
+  return addr == fake_remote_addr ? 1 : 0;
+}
+
+TEST_F(HugeCacheTest, NodeShards) {
+  bool from;
+  cache_.set_node_functions(FakeCurrentNode, FakeMemoryNode);
+  fake_current_node = 0;
+  HugeRange local = cache_.Get(NHugePages(1), &from);
+  HugeRange remote = cache_.Get(NHugePages(1), &from);
+  fake_remote_addr = remote.start_addr();
+  cache_.Release(local);
+  cache_.Release(remote);
+
+  // Node 1 gets its own hugepage first, then falls back to node 0's.
+  fake_current_node = 1;
+  HugeRange r1 = cache_.Get(NHugePages(1), &from);
+  EXPECT_FALSE(from);
+  EXPECT_EQ(remote.start_addr(), r1.start_addr());
+  HugeRange r2 = cache_.Get(NHugePages(1), &from);
+  EXPECT_FALSE(from);
+  EXPECT_EQ(local.start_addr(), r2.start_addr());
+  cache_.Release(r1);
+  cache_.Release(r2);
+
+  fake_current_node = 0;
+  HugeRange r3 = cache_.Get(NHugePages(1), &from);
+  EXPECT_EQ(local.start_addr(), r3.start_addr());
+  cache_.Release(r3);
+
+  std::string buffer(1024 * 1024, '\0');
+  Printer printer(&*buffer.begin(), buffer.size());
+  cache_.Print(&printer);
+  buffer.resize(strlen(buffer.c_str()));
+  EXPECT_THAT(buffer, testing::HasSubstr(
+                          "HugeCache: node shard 1: 1 hugepages cached, 2 gets "
+                          "(0.500 local hit rate, 0.500 remote hit rate)"));
+}
+#endif
+
+TEST_F(HugeCacheTest, DeferredUnback) {
+  bool from;
+  cache_.set_defer_unback(true);
+  // The cache keeps limit() hugepages of the range and queues the rest.
+  EXPECT_CALL(*mock_, Unback(testing::_, testing::_)).Times(0);
+  HugeRange r = cache_.Get(NHugePages(12), &from);
+  cache_.Release(r);
+  EXPECT_EQ(NHugePages(10), cache_.size());
+  EXPECT_EQ(NHugePages(2), cache_.pending());
+  EXPECT_EQ(NHugePages(12).in_bytes(), cache_.stats().free_bytes);
+
+  // A queued range is still backed and is handed out before a fresh one.
+  HugeRange cached = cache_.Get(NHugePages(10), &from);
+  EXPECT_FALSE(from);
+  HugeRange queued = cache_.Get(NHugePages(2), &from);
+  EXPECT_FALSE(from);
+  EXPECT_EQ(NHugePages(0), cache_.pending());
+  cache_.Release(cached);
+  cache_.Release(queued);
+  ASSERT_EQ(NHugePages(2), cache_.pending());
+  testing::Mock::VerifyAndClearExpectations(mock_.get());
+
+  EXPECT_CALL(*mock_, Unback(r.start_addr(), 2 * kHugePageSize)).Times(1);
+  EXPECT_EQ(NHugePages(2), cache_.ReleasePending());
+  EXPECT_EQ(NHugePages(0), cache_.pending());
+  EXPECT_EQ(NHugePages(10).in_bytes(), cache_.stats().free_bytes);
+}
+
+TEST_F(HugeCacheTest, AdviseIdle) {
+  using testing::_;
+  bool from;
+  tiered_cache_.AdviseIdle();
+  HugeRange r = tiered_cache_.Get(NHugePages(4), &from);
+  tiered_cache_.Release(r);
+
+  // Cached for 5s: still hot.
+  EXPECT_CALL(*mock_, MarkCold(_, _)).Times(0);
+  EXPECT_CALL(*mock_, PageOut(_, _)).Times(0);
+  Advance(absl::Seconds(5));
+  EXPECT_EQ(NHugePages(0), tiered_cache_.AdviseIdle());
+  testing::Mock::VerifyAndClearExpectations(mock_.get());
+
+  // Cached for 11s: cold.
+  EXPECT_CALL(*mock_, MarkCold(r.start_addr(), 4 * kHugePageSize)).Times(1);
+  EXPECT_CALL(*mock_, PageOut(_, _)).Times(0);
+  Advance(absl::Seconds(6));
+  EXPECT_EQ(NHugePages(4), tiered_cache_.AdviseIdle());
+  EXPECT_EQ(NHugePages(4), tiered_cache_.cold());
+  EXPECT_EQ(NHugePages(4), tiered_cache_.size());
+  testing::Mock::VerifyAndClearExpectations(mock_.get());
+
+  // Cached for over a minute: paged out, once.
+  EXPECT_CALL(*mock_, MarkCold(_, _)).Times(0);
+  EXPECT_CALL(*mock_, PageOut(r.start_addr(), 4 * kHugePageSize)).Times(1);
+  for (int i = 0; i < 12; ++i) {
+    Advance(absl::Seconds(5));
+    tiered_cache_.AdviseIdle();
+  }
+  EXPECT_EQ(NHugePages(0), tiered_cache_.cold());
+  EXPECT_EQ(NHugePages(4), tiered_cache_.paged_out());
+  testing::Mock::VerifyAndClearExpectations(mock_.get());
+
+  // Paged out memory is still cached, and handed out before a fresh range.
+  HugeRange again = tiered_cache_.Get(NHugePages(4), &from);
+  EXPECT_FALSE(from);
+  EXPECT_EQ(r, again);
+  EXPECT_EQ(NHugePages(0), tiered_cache_.paged_out());
+  tiered_cache_.Release(again);
+  EXPECT_CALL(*mock_, Unback(r.start_addr(), 4 * kHugePageSize)).Times(1);
+  EXPECT_EQ(NHugePages(4), tiered_cache_.ReleaseCachedPages(NHugePages(100)));
+}
+
 TEST_F(HugeCacheTest, Regret) {
   bool from;
   HugeRange r = cache_.Get(NHugePages(20), &from);
@@ -17,12 +17,14 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <algorithm>
 #include <new>
 
 #include "absl/base/internal/cycleclock.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/thread_annotations.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/experiment_config.h"
@@ -136,6 +138,9 @@ HugePageAwareAllocator::HugePageAwareAllocator(
     MemoryTag tag, LifetimePredictionOptions lifetime_options)
     : PageAllocatorInterface("HugePageAware", tag),
       filler_(decide_partial_rerelease()),
+#ifdef CLASS_REGIONS
+      class_regions_(UnbackWithoutLock, MetaDataAlloc),
+#endif
       alloc_(
           [](MemoryTag tag) {
             // TODO(ckennelly): Remove the template parameter.
@@ -154,11 +159,19 @@ HugePageAwareAllocator::HugePageAwareAllocator(
             }
           }(tag),
           MetaDataAlloc),
-      cache_(HugeCache{&alloc_, MetaDataAlloc, UnbackWithoutLock}),
+      cache_(HugeCache{&alloc_, MetaDataAlloc, UnbackWithoutLock,
+                       MarkColdWithoutLock, PageOutWithoutLock}),
       lifetime_allocator_region_alloc_(this),
       lifetime_allocator_(lifetime_options, &lifetime_allocator_region_alloc_) {
   tracker_allocator_.Init(&tc_globals.arena());
   region_allocator_.Init(&tc_globals.arena());
+#ifdef CLASS_REGIONS
+  // Only one page heap can own the regions, and only normal memory has any.
+  if (tag == MemoryTag::kNormal) class_regions_.Init(&tc_globals.arena());
+#endif
+#ifdef NUMA_HUGE_CACHE
+  cache_.set_node_functions(SystemCurrentNode, SystemMemoryNode);
+#endif
 }
 
 HugePageAwareAllocator::FillerType::Tracker* HugePageAwareAllocator::GetTracker(
@@ -176,7 +189,8 @@ void HugePageAwareAllocator::SetTracker(
 
 PageId HugePageAwareAllocator::AllocAndContribute(HugePage p, Length n,
                                                   size_t num_objects,
-                                                  bool donated) {
+                                                  bool donated,
+                                                  size_t size_class) {
   CHECK_CONDITION(p.start_addr() != nullptr);
   FillerType::Tracker* pt = tracker_allocator_.New();
   new (pt) FillerType::Tracker(p, absl::base_internal::CycleClock::Now());
@@ -185,11 +199,17 @@ PageId HugePageAwareAllocator::AllocAndContribute(HugePage p, Length n,
   ASSERT(page == p.first_page());
   SetTracker(p, pt);
   filler_.Contribute(pt, donated);
+#ifdef CLASS_COLOCATED_SPANS
+  filler_.SetClassHome(size_class, pt);
+#else
+  (void)size_class;
+#endif
   return page;
 }
 
 PageId HugePageAwareAllocator::RefillFiller(Length n, size_t num_objects,
-                                            bool* from_released) {
+                                            bool* from_released,
+                                            size_t size_class) {
   HugeRange r = cache_.Get(NHugePages(1), from_released);
   if (!r.valid()) return PageId{0};
   // This is duplicate to Finalize, but if we need to break up
@@ -201,7 +221,8 @@ PageId HugePageAwareAllocator::RefillFiller(Length n, size_t num_objects,
   // isn't very large), and the next allocation will just repeat this
   // process.
   tc_globals.page_allocator().ShrinkToUsageLimit();
-  return AllocAndContribute(r.start(), n, num_objects, /*donated=*/false);
+  return AllocAndContribute(r.start(), n, num_objects, /*donated=*/false,
+                            size_class);
 }
 
 Span* HugePageAwareAllocator::Finalize(Length n, size_t num_objects,
@@ -222,27 +243,48 @@ Span* HugePageAwareAllocator::Finalize(Length n, size_t num_objects,
 // For anything <= half a huge page, we will unconditionally use the filler
 // to pack it into a single page.  If we need another page, that's fine.
 Span* HugePageAwareAllocator::AllocSmall(Length n, size_t objects_per_span,
-                                         bool* from_released) {
-  auto [pt, page] = filler_.TryGet(n, objects_per_span);
+                                         bool* from_released,
+                                         bool* known_zero,
+                                         size_t size_class) {
+#ifdef CLASS_REGIONS
+  if (size_class != 0) {
+    const PageId slot = class_regions_.Get(size_class, n, from_released);
+    if (ABSL_PREDICT_TRUE(slot != PageId{0})) {
+      // A hugepage from the free map was never backed, or was released.
+      *known_zero = *from_released;
+      return Finalize(n, objects_per_span, slot);
+    }
+  }
+#endif
+  auto [pt, page] = filler_.TryGet(n, objects_per_span, size_class);
   if (ABSL_PREDICT_TRUE(pt != nullptr)) {
     *from_released = false;
+    *known_zero = false;
     return Finalize(n, objects_per_span, page);
   }
 
-  page = RefillFiller(n, objects_per_span, from_released);
+  page = RefillFiller(n, objects_per_span, from_released, size_class);
   if (ABSL_PREDICT_FALSE(page == PageId{0})) {
     return nullptr;
   }
+  // A refill takes a whole hugepage, so a released one is zero throughout.
+  *known_zero = *from_released;
   return Finalize(n, objects_per_span, page);
 }
 
 Span* HugePageAwareAllocator::AllocLarge(Length n, size_t objects_per_span,
                                          bool* from_released,
+                                         bool* known_zero,
                                          LifetimeStats* lifetime_context) {
+  // Only raw hugepages are known to be zero: the filler's free pages may
+  // have been used, and regions back hugepages they have partly used before.
+  *known_zero = false;
   // If it's an exact page multiple, just pull it from pages directly.
   HugeLength hl = HLFromPages(n);
   if (hl.in_pages() == n) {
-    return AllocRawHugepages(n, objects_per_span, from_released);
+    Span* s = AllocRawHugepages(n, objects_per_span, from_released);
+    *known_zero = *from_released;
+    return s;
   }
 
   PageId page;
@@ -286,8 +328,10 @@ Span* HugePageAwareAllocator::AllocLarge(Length n, size_t objects_per_span,
   const Length slack = info_.slack();
   // Don't bother at all until the binary is reasonably sized
   if (slack < HLFromBytes(64 * 1024 * 1024).in_pages()) {
-    return AllocRawHugepagesAndMaybeTrackLifetime(n, objects_per_span, lifetime,
-                                                  from_released);
+    Span* s = AllocRawHugepagesAndMaybeTrackLifetime(
+        n, objects_per_span, lifetime, from_released);
+    *known_zero = *from_released;
+    return s;
   }
 
   // In the vast majority of binaries, we have many small allocations which
@@ -295,15 +339,19 @@ Span* HugePageAwareAllocator::AllocLarge(Length n, size_t objects_per_span,
   // a handful of binaries fall below 1:1.)
   const Length small = info_.small();
   if (slack < small) {
-    return AllocRawHugepagesAndMaybeTrackLifetime(n, objects_per_span, lifetime,
-                                                  from_released);
+    Span* s = AllocRawHugepagesAndMaybeTrackLifetime(
+        n, objects_per_span, lifetime, from_released);
+    *known_zero = *from_released;
+    return s;
   }
 
   // We couldn't allocate a new region. They're oversized, so maybe we'd get
   // lucky with a smaller request?
   if (!AddRegion()) {
-    return AllocRawHugepagesAndMaybeTrackLifetime(n, objects_per_span, lifetime,
-                                                  from_released);
+    Span* s = AllocRawHugepagesAndMaybeTrackLifetime(
+        n, objects_per_span, lifetime, from_released);
+    *known_zero = *from_released;
+    return s;
   }
 
   CHECK_CONDITION(regions_.MaybeGet(n, &page, from_released));
@@ -375,9 +423,17 @@ static void BackSpan(Span* span) {
 
 // public
 Span* HugePageAwareAllocator::New(Length n, size_t objects_per_span) {
+  return NewForSizeClass(n, objects_per_span, 0);
+}
+
+Span* HugePageAwareAllocator::NewForSizeClass(Length n,
+                                              size_t objects_per_span,
+                                              size_t size_class) {
   CHECK_CONDITION(n > Length(0));
   bool from_released;
-  Span* s = LockAndAlloc(n, objects_per_span, &from_released);
+  bool known_zero;
+  Span* s = LockAndAlloc(n, objects_per_span, &from_released, &known_zero,
+                         size_class);
   if (s) {
     // Prefetch for writing, as we anticipate using the memory soon.
     __builtin_prefetch(s->start_address(), 1, 3);
@@ -388,7 +444,9 @@ Span* HugePageAwareAllocator::New(Length n, size_t objects_per_span) {
 }
 
 Span* HugePageAwareAllocator::LockAndAlloc(Length n, size_t objects_per_span,
-                                           bool* from_released) {
+                                           bool* from_released,
+                                           bool* known_zero,
+                                           size_t size_class) {
   // Check whether we may perform lifetime-based allocation, and if so, collect
   // the allocation context without holding the lock.
   LifetimeStats* lifetime_ctx = lifetime_allocator_.CollectLifetimeContext(n);
@@ -397,18 +455,22 @@ Span* HugePageAwareAllocator::LockAndAlloc(Length n, size_t objects_per_span,
   // Our policy depends on size.  For small things, we will pack them
   // into single hugepages.
   if (n <= kPagesPerHugePage / 2) {
-    return AllocSmall(n, objects_per_span, from_released);
+    return AllocSmall(n, objects_per_span, from_released, known_zero,
+                      size_class);
   }
 
   // For anything too big for the filler, we use either a direct hugepage
   // allocation, or possibly the regions if we are worried about slack.
   if (n <= HugeRegion::size().in_pages()) {
-    return AllocLarge(n, objects_per_span, from_released, lifetime_ctx);
+    return AllocLarge(n, objects_per_span, from_released, known_zero,
+                      lifetime_ctx);
   }
 
   // In the worst case, we just fall back to directly allocating a run
   // of hugepages.
-  return AllocEnormous(n, objects_per_span, from_released);
+  Span* s = AllocEnormous(n, objects_per_span, from_released);
+  *known_zero = *from_released;
+  return s;
 }
 
 // public
@@ -417,17 +479,30 @@ Span* HugePageAwareAllocator::NewAligned(Length n, Length align,
   if (align <= Length(1)) {
     return New(n, objects_per_span);
   }
+  bool known_zero;
+  return NewAlignedKnownZero(n, align, objects_per_span, &known_zero);
+}
 
-  // we can do better than this, but...
-  // TODO(b/134690769): support higher align.
-  CHECK_CONDITION(align <= kPagesPerHugePage);
+// public
+Span* HugePageAwareAllocator::NewAlignedKnownZero(Length n, Length align,
+                                                  size_t objects_per_span,
+                                                  bool* known_zero) {
+  CHECK_CONDITION(n > Length(0));
   bool from_released;
   Span* s;
-  {
+  if (align <= Length(1)) {
+    s = LockAndAlloc(n, objects_per_span, &from_released, known_zero);
+  } else {
+    // we can do better than this, but...
+    // TODO(b/134690769): support higher align.
+    CHECK_CONDITION(align <= kPagesPerHugePage);
     absl::base_internal::SpinLockHolder h(&pageheap_lock);
     s = AllocRawHugepages(n, objects_per_span, &from_released);
+    *known_zero = from_released;
   }
   if (s && from_released) BackSpan(s);
+  // A failed release leaves the old contents of the pages it was given.
+  *known_zero = s != nullptr && *known_zero && SystemReleaseErrors() == 0;
   ASSERT(!s || GetMemoryTag(s->start_address()) == tag_);
   return s;
 }
@@ -466,9 +541,13 @@ void HugePageAwareAllocator::Delete(Span* span, size_t objects_per_span) {
   }
   p = span->first_page();
 
-  span->DestroyEscape();
+  span->DestroyEscapeLocked();
   Span::Delete(span);
 
+#ifdef CLASS_REGIONS
+  if (class_regions_.MaybePut(p, n)) return;
+#endif
+
   // The tricky part, as with so many allocators: where did we come from?
   // There are several possibilities.
   FillerType::Tracker* pt = GetTracker(hp);
@@ -529,6 +608,47 @@ void HugePageAwareAllocator::Delete(Span* span, size_t objects_per_span) {
   cache_.Release({hp, hl});
 }
 
+// public
+bool HugePageAwareAllocator::ResizeInPlace(Span* span, Length n,
+                                           size_t objects_per_span) {
+  ASSERT(GetMemoryTag(span->start_address()) == tag_);
+  ASSERT(n > Length(0));
+  const PageId p = span->first_page();
+  const Length old_n = span->num_pages();
+  if (n == old_n) return true;
+
+  Length unbacked = Length(0);
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    FillerType::Tracker* pt = GetTracker(HugePageContaining(p));
+    // A donated hugepage's allocation stands in for the tail of a larger
+    // one, which Delete() returns as a whole.
+    if (pt == nullptr || pt->donated()) return false;
+    if (n > old_n) {
+      if (!filler_.TryExtend(pt, p, old_n, n - old_n, &unbacked)) {
+        return false;
+      }
+      for (PageId q = p + old_n; q < p + n; ++q) {
+        tc_globals.pagemap().Set(q, span);
+      }
+    } else {
+      // As in Delete(), before the pages can be handed out again.
+      for (PageId q = p + n; q < p + old_n; ++q) {
+        tc_globals.pagemap().Set(q, nullptr);
+      }
+      filler_.Truncate(pt, p, old_n, old_n - n);
+    }
+    span->set_num_pages(n);
+    info_.RecordFree(p, old_n, objects_per_span);
+    info_.RecordAlloc(p, n, objects_per_span);
+    if (n > old_n) tc_globals.page_allocator().ShrinkToUsageLimit();
+  }
+  if (unbacked > Length(0)) {
+    SystemBack((p + old_n).start_addr(), (n - old_n).in_bytes());
+  }
+  return true;
+}
+
 void HugePageAwareAllocator::ReleaseHugepage(FillerType::Tracker* pt) {
   ASSERT(pt->used_pages() == Length(0));
   HugeRange r = {pt->location(), NHugePages(1)};
@@ -556,6 +676,10 @@ BackingStats HugePageAwareAllocator::stats() const {
   // since it all comes from HugeAllocator but is then managed by
   // cache/regions/filler. Adjust for that.
   stats.system_bytes = actual_system;
+#ifdef CLASS_REGIONS
+  // The class regions are reserved apart from HugeAllocator.
+  stats += class_regions_.stats();
+#endif
   return stats;
 }
 
@@ -589,6 +713,9 @@ void HugePageAwareAllocator::GetSpanStats(SmallSpanStats* small,
 Length HugePageAwareAllocator::ReleaseAtLeastNPages(Length num_pages) {
   Length released;
   released += cache_.ReleaseCachedPages(HLFromPages(num_pages)).in_pages();
+#ifdef CLASS_REGIONS
+  if (released < num_pages) released += class_regions_.ReleaseSpares();
+#endif
 
   // This is our long term plan but in current state will lead to insufficient
   // THP coverage. It is however very useful to have the ability to turn this on
@@ -630,6 +757,67 @@ static void BreakdownStatsInPbtxt(PbtxtRegion* hpaa, const BackingStats& s,
 }
 
 // public
+Length HugePageAwareAllocator::Prefault(Length n) {
+  const HugeLength hl = HLFromPages(n);
+  if (hl == NHugePages(0)) return Length(0);
+  HugeRange r = alloc_.Get(hl);
+  if (!r.valid()) return Length(0);
+  SystemPopulate(r.start_addr(), r.byte_len());
+  cache_.Prefill(r);
+  prefaulted_huge_pages_ += r.len();
+  return r.len().in_pages();
+}
+
+HugeLength HugePageAwareAllocator::CollapseDense(HugeLength limit) {
+  // Each collapse may copy a hugepage, so all of them run without
+  // pageheap_lock, on the hugepages picked while it was held.
+  constexpr size_t kMaxCandidates = 16;
+  HugePage candidates[kMaxCandidates];
+  bool collapsed[kMaxCandidates];
+  const size_t n = filler_.SelectCollapseCandidates(absl::MakeSpan(
+      candidates, std::min(limit.raw_num(), kMaxCandidates)));
+  if (n == 0) return NHugePages(0);
+
+  pageheap_lock.Unlock();
+  for (size_t i = 0; i < n; ++i) {
+    collapsed[i] = SystemCollapse(candidates[i].start_addr(), kHugePageSize);
+  }
+  pageheap_lock.Lock();
+
+  HugeLength total;
+  for (size_t i = 0; i < n; ++i) {
+    filler_.RecordCollapse(GetTracker(candidates[i]), collapsed[i]);
+    if (collapsed[i]) ++total;
+  }
+  return total;
+}
+
+#ifdef CLASS_COLOCATED_SPANS
+void HugePageAwareAllocator::GetClassSpread(ClassSpread* spread) {
+  memset(spread, 0, sizeof(*spread));
+  filler_.ForEachTracker([&](const PageTracker<SystemRelease>* pt) {
+    bool seen[kNumClasses] = {};
+    const PageId first = pt->location().first_page();
+    for (PageId p = first; p < first + kPagesPerHugePage;) {
+      const size_t size_class =
+          tc_globals.pagemap().get_page_info(p).size_class();
+      Span* s = tc_globals.pagemap().GetDescriptor(p);
+      // Free pages keep the descriptor of the span that last held them.
+      if (size_class == 0 || s == nullptr || s->first_page() != p) {
+        ++p;
+        continue;
+      }
+      ++spread->spans[size_class];
+      if (!seen[size_class]) {
+        seen[size_class] = true;
+        ++spread->hugepages[size_class];
+      }
+      p = s->last_page() + Length(1);
+    }
+  });
+}
+#endif
+
 void HugePageAwareAllocator::Print(Printer* out) { Print(out, true); }
 
 void HugePageAwareAllocator::Print(Printer* out, bool everything) {
@@ -652,6 +840,10 @@ void HugePageAwareAllocator::Print(Printer* out, bool everything) {
   auto rstats = regions_.stats();
   BreakdownStats(out, rstats, "HugePageAware: region  ");
 
+#ifdef CLASS_REGIONS
+  BreakdownStats(out, class_regions_.stats(), "HugePageAware: classes ");
+#endif
+
   // Report short-lived region allocations when enabled.
   auto lstats = lifetime_allocator_.GetRegionStats();
   if (lstats.has_value()) {
@@ -674,12 +866,18 @@ void HugePageAwareAllocator::Print(Printer* out, bool everything) {
 
   out->printf("HugePageAware: filler donations %zu\n",
               donated_huge_pages_.raw_num());
+  out->printf("HugePageAware: prefaulted hugepages %zu\n",
+              prefaulted_huge_pages_.raw_num());
 
   // Component debug output
   // Filler is by far the most important; print (some) of it
   // unconditionally.
   filler_.Print(out, everything);
   out->printf("\n");
+#ifdef CLASS_REGIONS
+  class_regions_.Print(out);
+  out->printf("\n");
+#endif
   if (everything) {
     regions_.Print(out);
     out->printf("\n");
@@ -694,6 +892,20 @@ void HugePageAwareAllocator::Print(Printer* out, bool everything) {
 
     // and age tracking.
     ages.Print("HugePageAware", out);
+
+#ifdef CLASS_COLOCATED_SPANS
+    // With co-location, a class should need about as many hugepages as its
+    // spans fill.
+    ClassSpread spread;
+    GetClassSpread(&spread);
+    out->printf("\nHugePageAware: size class spread over filler hugepages\n");
+    for (size_t size_class = 1; size_class < kNumClasses; ++size_class) {
+      if (spread.spans[size_class] == 0) continue;
+      out->printf("HugePageAware: class %3zu: %6zu spans on %6zu hugepages\n",
+                  size_class, spread.spans[size_class],
+                  spread.hugepages[size_class]);
+    }
+#endif
   }
 
   out->printf("PARAMETER hpaa_subrelease %d\n",
@@ -719,6 +931,11 @@ void HugePageAwareAllocator::PrintInPbtxt(PbtxtRegion* region) {
     auto rstats = regions_.stats();
     BreakdownStatsInPbtxt(&hpaa, rstats, "region_usage");
 
+#ifdef CLASS_REGIONS
+    BreakdownStatsInPbtxt(&hpaa, class_regions_.stats(),
+                          "class_region_usage");
+#endif
+
     auto cstats = cache_.stats();
     // Everything in the filler came from the cache -
     // adjust the totals so we see the amount used by the mutator.
@@ -740,6 +957,9 @@ void HugePageAwareAllocator::PrintInPbtxt(PbtxtRegion* region) {
 
     filler_.PrintInPbtxt(&hpaa);
     regions_.PrintInPbtxt(&hpaa);
+#ifdef CLASS_REGIONS
+    class_regions_.PrintInPbtxt(&hpaa);
+#endif
     cache_.PrintInPbtxt(&hpaa);
     alloc_.PrintInPbtxt(&hpaa);
     lifetime_allocator_.PrintInPbtxt(&hpaa);
@@ -748,6 +968,19 @@ void HugePageAwareAllocator::PrintInPbtxt(PbtxtRegion* region) {
     info_.PrintInPbtxt(&hpaa, "hpaa_stat");
 
     hpaa.PrintI64("filler_donated_huge_pages", donated_huge_pages_.raw_num());
+    hpaa.PrintI64("prefaulted_huge_pages", prefaulted_huge_pages_.raw_num());
+
+#ifdef CLASS_COLOCATED_SPANS
+    ClassSpread spread;
+    GetClassSpread(&spread);
+    for (size_t size_class = 1; size_class < kNumClasses; ++size_class) {
+      if (spread.spans[size_class] == 0) continue;
+      auto c = hpaa.CreateSubRegion("filler_class_spread");
+      c.PrintI64("sizeclass", size_class);
+      c.PrintI64("spans", spread.spans[size_class]);
+      c.PrintI64("hugepages", spread.hugepages[size_class]);
+    }
+#endif
   }
 }
 
@@ -779,6 +1012,18 @@ void HugePageAwareAllocator::UnbackWithoutLock(void* start, size_t length) {
   pageheap_lock.Lock();
 }
 
+void HugePageAwareAllocator::MarkColdWithoutLock(void* start, size_t length) {
+  pageheap_lock.Unlock();
+  SystemMarkCold(start, length);
+  pageheap_lock.Lock();
+}
+
+void HugePageAwareAllocator::PageOutWithoutLock(void* start, size_t length) {
+  pageheap_lock.Unlock();
+  SystemPageOut(start, length);
+  pageheap_lock.Lock();
+}
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
@@ -19,6 +19,9 @@
 
 #include "absl/base/thread_annotations.h"
 #include "tcmalloc/arena.h"
+#ifdef CLASS_REGIONS
+#include "tcmalloc/class_regions.h"
+#endif
 #include "tcmalloc/common.h"
 #include "tcmalloc/huge_allocator.h"
 #include "tcmalloc/huge_cache.h"
@@ -56,17 +59,37 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
   Span* New(Length n, size_t objects_per_span)
       ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
 
+  // With CLASS_COLOCATED_SPANS, small spans of one size class share
+  // hugepages where they can; see HugePageFiller::TryGet().  With
+  // CLASS_REGIONS, the page heap of normal memory places them in the region
+  // of their class first; see ClassRegions.
+  Span* NewForSizeClass(Length n, size_t objects_per_span, size_t size_class)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+
   // As New, but the returned span is aligned to a <align>-page boundary.
   // <align> must be a power of two.
   Span* NewAligned(Length n, Length align, size_t objects_per_span)
       ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
 
+  // Spans are known to be zero when they come from whole hugepages the cache
+  // had to get from the system, and no release has failed so far.  Spans
+  // carved from the filler or the regions are never reported zero.
+  Span* NewAlignedKnownZero(Length n, Length align, size_t objects_per_span,
+                            bool* known_zero)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+
   // Delete the span "[p, p+n-1]".
   // REQUIRES: span was returned by earlier call to New() and
   //           has not yet been deleted.
   void Delete(Span* span, size_t objects_per_span)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override;
 
+  // Only spans the filler packed onto one hugepage can be resized, within
+  // that hugepage.  Spans of whole hugepages, regions and donated hugepages
+  // are left alone.
+  bool ResizeInPlace(Span* span, Length n, size_t objects_per_span)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
+
   BackingStats stats() const
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override;
 
@@ -88,6 +111,31 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
   Length ReleaseAtLeastNPagesBreakingHugepages(Length n)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Only the hugepages the cache evicts are deferred; the filler and the
+  // regions still unback in place.
+  void SetDeferredRelease(bool value)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override {
+    cache_.set_defer_unback(value);
+  }
+
+  Length ReleasePending()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override {
+    return cache_.ReleasePending().in_pages();
+  }
+
+  // Of the free memory, only whole hugepages in the cache are advised.
+  Length AdviseIdle() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override {
+    return cache_.AdviseIdle().in_pages();
+  }
+
+  // Only the filler's hugepages can be broken by subrelease.
+  HugeLength CollapseDense(HugeLength limit)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override;
+
+  // Whole hugepages, which go to the cache.
+  Length Prefault(Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) override;
+
   // Prints stats about the page heap to *out.
   void Print(Printer* out) ABSL_LOCKS_EXCLUDED(pageheap_lock) override;
 
@@ -140,6 +188,12 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
   static void UnbackWithoutLock(void* start, size_t length)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // As UnbackWithoutLock, for SystemMarkCold and SystemPageOut.
+  static void MarkColdWithoutLock(void* start, size_t length)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+  static void PageOutWithoutLock(void* start, size_t length)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   HugeRegionSet<HugeRegion> regions_ ABSL_GUARDED_BY(pageheap_lock);
 
   PageHeapAllocator<FillerType::Tracker> tracker_allocator_
@@ -147,6 +201,10 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
   PageHeapAllocator<HugeRegion> region_allocator_
       ABSL_GUARDED_BY(pageheap_lock);
 
+#ifdef CLASS_REGIONS
+  ClassRegionAllocator class_regions_ ABSL_GUARDED_BY(pageheap_lock);
+#endif
+
   FillerType::Tracker* GetTracker(HugePage p);
 
   void SetTracker(HugePage p, FillerType::Tracker* pt);
@@ -170,27 +228,45 @@ class HugePageAwareAllocator final : public PageAllocatorInterface {
   RegionAllocImpl lifetime_allocator_region_alloc_;
   LifetimeBasedAllocator lifetime_allocator_;
 
+  // Hugepages faulted in by Prefault().
+  HugeLength prefaulted_huge_pages_ ABSL_GUARDED_BY(pageheap_lock);
+
   void GetSpanStats(SmallSpanStats* small, LargeSpanStats* large,
                     PageAgeHistograms* ages)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
-  PageId RefillFiller(Length n, size_t num_objects, bool* from_released)
+#ifdef CLASS_COLOCATED_SPANS
+  // For every size class, the spans of it in the filler and the number of
+  // filler hugepages they are spread over.
+  struct ClassSpread {
+    size_t spans[kNumClasses];
+    size_t hugepages[kNumClasses];
+  };
+  void GetClassSpread(ClassSpread* spread)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+#endif
+
+  PageId RefillFiller(Length n, size_t num_objects, bool* from_released,
+                      size_t size_class = 0)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   // Allocate the first <n> from p, and contribute the rest to the filler.  If
   // "donated" is true, the contribution will be marked as coming from the
   // tail of a multi-hugepage alloc.  Returns the allocated section.
   PageId AllocAndContribute(HugePage p, Length n, size_t num_objects,
-                            bool donated)
+                            bool donated, size_t size_class = 0)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   // Helpers for New().
 
-  Span* LockAndAlloc(Length n, size_t objects_per_span, bool* from_released);
+  // Sets *known_zero as NewAlignedKnownZero(), but for release failures.
+  Span* LockAndAlloc(Length n, size_t objects_per_span, bool* from_released,
+                     bool* known_zero, size_t size_class = 0);
 
-  Span* AllocSmall(Length n, size_t objects_per_span, bool* from_released)
+  Span* AllocSmall(Length n, size_t objects_per_span, bool* from_released,
+                   bool* known_zero, size_t size_class = 0)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   Span* AllocLarge(Length n, size_t objects_per_span, bool* from_released,
-                   LifetimeStats* lifetime_context)
+                   bool* known_zero, LifetimeStats* lifetime_context)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   Span* AllocEnormous(Length n, size_t objects_per_span, bool* from_released)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
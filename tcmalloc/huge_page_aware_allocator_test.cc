@@ -50,6 +50,7 @@
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/page_allocator_test_util.h"
+#include "tcmalloc/pagemap.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/static_vars.h"
@@ -312,6 +313,67 @@ TEST_F(HugePageAwareAllocatorTest, ReleasingLarge) {
   ASSERT_LE(kPagesPerHugePage, ReleasePages(kPagesPerHugePage));
 }
 
+TEST_F(HugePageAwareAllocatorTest, KnownZero) {
+  if (SystemReleaseErrors() != 0) {
+    GTEST_SKIP() << "a release has failed";
+  }
+  bool known_zero;
+  // A hugepage the cache gets from the system is zero...
+  Span* s = allocator_->NewAlignedKnownZero(kPagesPerHugePage, Length(1), 1,
+                                            &known_zero);
+  ASSERT_NE(s, nullptr);
+  EXPECT_TRUE(known_zero);
+  AllocatorDelete(s, 1);
+
+  // ...but not once the cache holds it backed.
+  s = allocator_->NewAlignedKnownZero(kPagesPerHugePage, Length(1), 1,
+                                      &known_zero);
+  ASSERT_NE(s, nullptr);
+  EXPECT_FALSE(known_zero);
+
+  // Neither are the free pages of the filler's hugepages.
+  Span* small = allocator_->NewAlignedKnownZero(Length(1), Length(1), 1,
+                                                &known_zero);
+  ASSERT_NE(small, nullptr);
+  Span* next = allocator_->NewAlignedKnownZero(Length(1), Length(1), 1,
+                                               &known_zero);
+  ASSERT_NE(next, nullptr);
+  EXPECT_FALSE(known_zero);
+  AllocatorDelete(next, 1);
+  AllocatorDelete(small, 1);
+  AllocatorDelete(s, 1);
+}
+
+TEST_F(HugePageAwareAllocatorTest, ResizeInPlace) {
+  Span* s = AllocatorNew(Length(40), 1);
+  ASSERT_NE(s, nullptr);
+  const PageId p = s->first_page();
+
+  ASSERT_TRUE(allocator_->ResizeInPlace(s, Length(60), 1));
+  EXPECT_EQ(s->first_page(), p);
+  EXPECT_EQ(s->num_pages(), Length(60));
+  EXPECT_EQ(tc_globals.pagemap().GetDescriptor(p + Length(59)), s);
+
+  ASSERT_TRUE(allocator_->ResizeInPlace(s, Length(20), 1));
+  EXPECT_EQ(s->num_pages(), Length(20));
+  EXPECT_EQ(tc_globals.pagemap().GetDescriptor(p + Length(30)), nullptr);
+
+  // The pages given back are reused, and are in the way of growing again.
+  Span* next = AllocatorNew(kPagesPerHugePage - Length(20), 1);
+  ASSERT_NE(next, nullptr);
+  EXPECT_EQ(next->first_page(), p + Length(20));
+  EXPECT_FALSE(allocator_->ResizeInPlace(s, Length(21), 1));
+  EXPECT_EQ(s->num_pages(), Length(20));
+  AllocatorDelete(next, 1);
+  AllocatorDelete(s, 1);
+
+  // Spans of whole hugepages stay as they are.
+  Span* large = AllocatorNew(kPagesPerHugePage, 1);
+  ASSERT_NE(large, nullptr);
+  EXPECT_FALSE(allocator_->ResizeInPlace(large, kPagesPerHugePage / 2, 1));
+  AllocatorDelete(large, 1);
+}
+
 TEST_F(HugePageAwareAllocatorTest, ReleasingSmall) {
   const bool old_subrelease = Parameters::hpaa_subrelease();
   Parameters::set_hpaa_subrelease(true);
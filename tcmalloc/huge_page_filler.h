@@ -721,6 +721,23 @@ class PageTracker : public TList<PageTracker<Unback>>::Elem {
   void Put(PageId p, Length n, size_t num_objects)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Returns true if [p, p + n) is on this hugepage and free.
+  bool IsFree(PageId p, Length n) const;
+
+  // REQUIRES: p was the result of a previous call to Get(n), and
+  // IsFree(p + n, more).
+  //
+  // Grows the allocation to [p, p + n + more).  Returns the count of
+  // previously unbacked pages it took.
+  Length Extend(PageId p, Length n, Length more)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // REQUIRES: p was the result of a previous call to Get(n), and fewer < n.
+  //
+  // Shrinks the allocation to [p, p + n - fewer).
+  void Truncate(PageId p, Length n, Length fewer)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Returns true if any unused pages have been returned-to-system.
   bool released() const { return released_count_ > 0; }
 
@@ -742,6 +759,12 @@ class PageTracker : public TList<PageTracker<Unback>>::Elem {
   bool empty() const;
 
   bool unbroken() const { return unbroken_; }
+  // Records that the kernel collapsed the hugepage back into a THP.
+  // REQUIRES: no page is released.
+  void MarkCollapsed() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    ASSERT(released_count_ == 0);
+    unbroken_ = true;
+  }
   static bool compare(const PageTracker<Unback>* a,
                       const PageTracker<Unback>* b) {
     return a->nallocs() < b->nallocs();
@@ -885,10 +908,27 @@ class HugePageFiller {
   // n is the number of TCMalloc pages to be allocated.  num_objects is the
   // number of individual objects that would be allocated on these n pages.
   //
+  // size_class is the size class the span is for, 0 if it has none.  With
+  // CLASS_COLOCATED_SPANS, spans of one size class go to the hugepage the
+  // class last got a span from, as long as it has room.
+  //
   // On failure, returns nullptr/PageId{0}.
-  TryGetResult TryGet(Length n, size_t num_objects)
+  TryGetResult TryGet(Length n, size_t num_objects, size_t size_class = 0)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+#ifdef CLASS_COLOCATED_SPANS
+  // Makes pt, which got a span of size_class outside of TryGet(), the
+  // hugepage the next spans of size_class go to.
+  void SetClassHome(size_t size_class, TrackerType* pt)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    if (size_class != 0) class_home_[size_class] = pt;
+  }
+#endif
+
+  // Calls f on every hugepage of the filler.
+  template <typename F>
+  void ForEachTracker(F f) const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Marks [p, p + n) as usable by new allocations into *pt; returns pt
   // if that hugepage is now empty (nullptr otherwise.)
   // REQUIRES: pt is owned by this object (has been Contribute()), and
@@ -896,6 +936,21 @@ class HugePageFiller {
   TrackerType* Put(TrackerType* pt, PageId p, Length n, size_t num_objects)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Grows the allocation {pt, p, n} to n + more pages, if the pages after it
+  // on pt are free; returns whether it did.  *previously_unbacked is set to
+  // how many of the pages it took were unbacked.
+  // REQUIRES: as Put().
+  bool TryExtend(TrackerType* pt, PageId p, Length n, Length more,
+                 Length* previously_unbacked)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Marks the last `fewer` pages of the allocation {pt, p, n} as usable by
+  // new allocations, like Put() would.  Like Put(), may drop pageheap_lock
+  // while releasing them.
+  // REQUIRES: as Put(), and fewer < n.
+  void Truncate(TrackerType* pt, PageId p, Length n, Length fewer)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Contributes a tracker to the filler. If "donated," then the tracker is
   // marked as having come from the tail of a multi-hugepage allocation, which
   // causes it to be treated slightly differently.
@@ -941,6 +996,27 @@ class HugePageFiller {
                     PageAgeHistograms* ages) const;
 
   BackingStats stats() const;
+  // A hugepage broken by subrelease is worth collapsing back into a THP once
+  // all its pages are backed again and at least this many are used.
+  static constexpr Length kCollapseMinUsed = kPagesPerHugePage * 7 / 8;
+
+  // Stores in candidates the hugepages worth collapsing, fullest lists
+  // first, and returns how many it stored.  They are collapsed without
+  // pageheap_lock, and each outcome handed to RecordCollapse().
+  size_t SelectCollapseCandidates(absl::Span<HugePage> candidates) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Counts the collapse of a candidate, and marks pt, its tracker looked up
+  // again once pageheap_lock is held, unbroken if the collapse succeeded.
+  // pt is nullptr if the hugepage has left the filler meanwhile.  If it was
+  // subreleased, and refilled, while being collapsed, it is wrongly marked
+  // unbroken, which only costs the broken count its next break.
+  void RecordCollapse(TrackerType* pt, bool collapsed)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  HugeLength collapsed_hugepages() const { return collapsed_hugepages_; }
+  HugeLength failed_collapses() const { return failed_collapses_; }
+
   SubreleaseStats subrelease_stats() const { return subrelease_stats_; }
   void Print(Printer* out, bool everything) const;
   void PrintInPbtxt(PbtxtRegion* hpaa) const;
@@ -957,6 +1033,8 @@ class HugePageFiller {
   };
 
   SubreleaseStats subrelease_stats_;
+  HugeLength collapsed_hugepages_;
+  HugeLength failed_collapses_;
 
   // We group hugepages first by longest-free (as a measure of fragmentation),
   // then into 8 chunks inside there by desirability of allocation.
@@ -1036,6 +1114,29 @@ class HugePageFiller {
 
   FillerPartialRerelease partial_rerelease_;
 
+#ifdef CLASS_COLOCATED_SPANS
+  // The hugepage each size class last got a span from, if it is still in
+  // the filler.
+  TrackerType* class_home_[kNumClasses] = {};
+
+  // Returns the home of size_class if it is backed and can hold n pages.
+  TrackerType* HomeFor(size_t size_class, Length n) const {
+    if (size_class == 0) return nullptr;
+    TrackerType* pt = class_home_[size_class];
+    if (pt == nullptr || pt->released() || pt->longest_free_range() < n) {
+      return nullptr;
+    }
+    return pt;
+  }
+
+  // Forgets pt as a home once it leaves the filler.
+  void ForgetHome(TrackerType* pt) {
+    for (TrackerType*& home : class_home_) {
+      if (home == pt) home = nullptr;
+    }
+  }
+#endif
+
   // Functionality related to time series tracking.
   void UpdateFillerStatsTracker();
   using StatsTrackerType = FillerStatsTracker<600>;
@@ -1078,6 +1179,40 @@ inline void PageTracker<Unback>::Put(PageId p, Length n, size_t num_objects) {
   when_denominator_ += n.raw_num();
 }
 
+template <MemoryModifyFunction Unback>
+inline bool PageTracker<Unback>::IsFree(PageId p, Length n) const {
+  if (p < location_.first_page()) return false;
+  return free_.IsClear((p - location_.first_page()).raw_num(), n.raw_num());
+}
+
+template <MemoryModifyFunction Unback>
+inline Length PageTracker<Unback>::Extend(PageId p, Length n, Length more) {
+  const size_t index = (p - location_.first_page()).raw_num();
+  free_.Extend(index, n.raw_num(), more.raw_num());
+
+  // As in Get(), for the pages we just took.
+  size_t unbacked = 0;
+  if (ABSL_PREDICT_FALSE(released_count_ > 0)) {
+    unbacked = released_by_page_.CountBits(index + n.raw_num(), more.raw_num());
+    released_by_page_.ClearRange(index + n.raw_num(), more.raw_num());
+    ASSERT(released_count_ >= unbacked);
+    released_count_ -= unbacked;
+  }
+
+  ASSERT(released_by_page_.CountBits(0, kPagesPerHugePage.raw_num()) ==
+         released_count_);
+  return Length(unbacked);
+}
+
+template <MemoryModifyFunction Unback>
+inline void PageTracker<Unback>::Truncate(PageId p, Length n, Length fewer) {
+  Length index = p - location_.first_page();
+  free_.Truncate(index.raw_num(), n.raw_num(), fewer.raw_num());
+
+  when_numerator_ += fewer.raw_num() * absl::base_internal::CycleClock::Now();
+  when_denominator_ += fewer.raw_num();
+}
+
 template <MemoryModifyFunction Unback>
 inline Length PageTracker<Unback>::ReleaseFree() {
   size_t count = 0;
@@ -1205,7 +1340,8 @@ inline HugePageFiller<TrackerType>::HugePageFiller(
 
 template <class TrackerType>
 inline typename HugePageFiller<TrackerType>::TryGetResult
-HugePageFiller<TrackerType>::TryGet(Length n, size_t num_objects) {
+HugePageFiller<TrackerType>::TryGet(Length n, size_t num_objects,
+                                    size_t size_class) {
   ASSERT(n > Length(0));
 
   // How do we choose which hugepage to allocate from (among those with
@@ -1277,6 +1413,14 @@ HugePageFiller<TrackerType>::TryGet(Length n, size_t num_objects) {
 
   bool was_released = false;
   do {
+#ifdef CLASS_COLOCATED_SPANS
+    // Ahead of all of the above, keep a size class on its hugepage, so its
+    // spans share page map leaves, escape tables and TLB entries.
+    if ((pt = HomeFor(size_class, n)) != nullptr) {
+      RemoveFromFillerList(pt);
+      break;
+    }
+#endif
     pt = regular_alloc_.GetLeast(ListFor(n, 0));
     if (pt) {
       ASSERT(!pt->donated());
@@ -1312,6 +1456,11 @@ HugePageFiller<TrackerType>::TryGet(Length n, size_t num_objects) {
   const auto page_allocation = pt->Get(n, num_objects);
   AddToFillerList(pt);
   allocated_ += n;
+#ifdef CLASS_COLOCATED_SPANS
+  if (size_class != 0) class_home_[size_class] = pt;
+#else
+  (void)size_class;
+#endif
 
   ASSERT(was_released || page_allocation.previously_unbacked == Length(0));
   (void)was_released;
@@ -1324,6 +1473,47 @@ HugePageFiller<TrackerType>::TryGet(Length n, size_t num_objects) {
   return {pt, page_allocation.page};
 }
 
+template <class TrackerType>
+inline bool HugePageFiller<TrackerType>::TryExtend(
+    TrackerType* pt, PageId p, Length n, Length more,
+    Length* previously_unbacked) {
+  ASSERT(more > Length(0));
+  if (!pt->IsFree(p + n, more)) return false;
+
+  RemoveFromFillerList(pt);
+  *previously_unbacked = pt->Extend(p, n, more);
+  AddToFillerList(pt);
+  allocated_ += more;
+
+  ASSERT(unmapped_ >= *previously_unbacked);
+  unmapped_ -= *previously_unbacked;
+  UpdateFillerStatsTracker();
+  return true;
+}
+
+template <class TrackerType>
+inline void HugePageFiller<TrackerType>::Truncate(TrackerType* pt, PageId p,
+                                                  Length n, Length fewer) {
+  ASSERT(fewer > Length(0));
+  ASSERT(fewer < n);
+  const PageId tail = p + n - fewer;
+  // As in Put(), unback before the pages can be seen as free.
+  if (partial_rerelease_ == FillerPartialRerelease::Return) {
+    pt->MaybeRelease(tail, fewer);
+  }
+
+  RemoveFromFillerList(pt);
+  pt->Truncate(p, n, fewer);
+
+  allocated_ -= fewer;
+  if (partial_rerelease_ == FillerPartialRerelease::Return && pt->released()) {
+    unmapped_ += fewer;
+    unmapping_unaccounted_ += fewer;
+  }
+  AddToFillerList(pt);
+  UpdateFillerStatsTracker();
+}
+
 // Marks [p, p + n) as usable by new allocations into *pt; returns pt
 // if that hugepage is now empty (nullptr otherwise.)
 // REQUIRES: pt is owned by this object (has been Contribute()), and
@@ -1360,6 +1550,9 @@ inline TrackerType* HugePageFiller<TrackerType>::Put(TrackerType* pt, PageId p,
   if (pt->longest_free_range() == kPagesPerHugePage) {
     ASSERT(pt->nallocs() == 0);
     --size_;
+#ifdef CLASS_COLOCATED_SPANS
+    ForgetHome(pt);
+#endif
     if (pt->released()) {
       const Length free_pages = pt->free_pages();
       const Length released_pages = pt->released_pages();
@@ -1641,6 +1834,47 @@ inline void HugePageFiller<TrackerType>::AddSpanStats(
   regular_alloc_released_.Iter(loop, 0);
 }
 
+template <class TrackerType>
+inline size_t HugePageFiller<TrackerType>::SelectCollapseCandidates(
+    absl::Span<HugePage> candidates) const {
+  size_t n = 0;
+  // Donated hugepages are never broken, and the released lists hold those
+  // with unbacked pages.
+  regular_alloc_.Iter(
+      [&](const TrackerType* pt) {
+        if (n == candidates.size() || pt->unbroken() ||
+            pt->used_pages() < kCollapseMinUsed) {
+          return;
+        }
+        ASSERT(!pt->released());
+        candidates[n++] = pt->location();
+      },
+      0);
+  return n;
+}
+
+template <class TrackerType>
+inline void HugePageFiller<TrackerType>::RecordCollapse(TrackerType* pt,
+                                                        bool collapsed) {
+  if (!collapsed) {
+    ++failed_collapses_;
+    return;
+  }
+  ++collapsed_hugepages_;
+  if (pt != nullptr && !pt->released()) {
+    pt->MarkCollapsed();
+  }
+}
+
+template <class TrackerType>
+template <typename F>
+inline void HugePageFiller<TrackerType>::ForEachTracker(F f) const {
+  regular_alloc_.Iter(f, 0);
+  donated_alloc_.Iter(f, 0);
+  regular_alloc_partial_released_.Iter(f, 0);
+  regular_alloc_released_.Iter(f, 0);
+}
+
 template <class TrackerType>
 inline BackingStats HugePageFiller<TrackerType>::stats() const {
   BackingStats s;
@@ -1842,6 +2076,10 @@ inline void HugePageFiller<TrackerType>::Print(Printer* out,
       subrelease_stats_.total_hugepages_broken.raw_num(),
       subrelease_stats_.total_pages_subreleased_due_to_limit.raw_num(),
       subrelease_stats_.total_hugepages_broken_due_to_limit.raw_num());
+  out->printf(
+      "HugePageFiller: Since startup, %zu broken hugepages collapsed, %zu "
+      "collapses failed\n",
+      collapsed_hugepages_.raw_num(), failed_collapses_.raw_num());
 
   if (!everything) return;
 
@@ -1963,6 +2201,9 @@ inline void HugePageFiller<TrackerType>::PrintInPbtxt(PbtxtRegion* hpaa) const {
   hpaa->PrintI64(
       "filler_num_hugepages_broken_due_to_limit",
       subrelease_stats_.total_hugepages_broken_due_to_limit.raw_num());
+  hpaa->PrintI64("filler_num_hugepages_collapsed",
+                 collapsed_hugepages_.raw_num());
+  hpaa->PrintI64("filler_num_failed_collapses", failed_collapses_.raw_num());
   // Compute some histograms of fullness.
   using huge_page_filler_internal::UsageInfo;
   UsageInfo usage;
@@ -47,6 +47,7 @@
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/huge_pages.h"
 #include "tcmalloc/internal/logging.h"
@@ -935,6 +936,57 @@ TEST_P(FillerTest, Density) {
   }
 }
 
+#ifdef CLASS_COLOCATED_SPANS
+TEST_P(FillerTest, ClassHome) {
+  // a nearly fills one hugepage, b half of another.
+  PAlloc a = Allocate(kPagesPerHugePage - Length(2));
+  PAlloc b = Allocate(kPagesPerHugePage / 2);
+  ASSERT_NE(a.pt, b.pt);
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    filler_.SetClassHome(3, b.pt);
+  }
+
+  // Without a class, the fuller hugepage is used; class 3 goes home.
+  PAlloc c = AllocateRaw(Length(1));
+  EXPECT_EQ(a.pt, c.pt);
+  PAlloc d;
+  d.n = Length(1);
+  d.objects = 1;
+  d.mark = ++next_mark_;
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    auto [pt, page] = filler_.TryGet(d.n, d.objects, 3);
+    d.pt = pt;
+    d.p = page;
+  }
+  EXPECT_EQ(b.pt, d.pt);
+  total_allocated_ += d.n;
+  Mark(c);
+  Mark(d);
+  CheckStats();
+
+  // Once the home is freed, the class goes wherever it fits, again.
+  Delete(b);
+  Delete(d);
+  d.mark = ++next_mark_;
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    auto [pt, page] = filler_.TryGet(d.n, d.objects, 3);
+    d.pt = pt;
+    d.p = page;
+  }
+  EXPECT_EQ(a.pt, d.pt);
+  total_allocated_ += d.n;
+  Mark(d);
+  CheckStats();
+
+  Delete(a);
+  Delete(c);
+  Delete(d);
+}
+#endif
+
 TEST_P(FillerTest, Release) {
   static const Length kAlloc = kPagesPerHugePage / 2;
   PAlloc p1 = Allocate(kAlloc - Length(1));
@@ -1288,6 +1340,46 @@ TEST_P(FillerTest, ReleaseWithReuse) {
   EXPECT_EQ(Length(0), filler_.unmapped_pages());
 }
 
+TEST_P(FillerTest, CollapseDense) {
+  const Length N = kPagesPerHugePage;
+  auto half = Allocate(N / 2);
+  auto quarter1 = Allocate(N / 4);
+  auto quarter2 = Allocate(N / 4);
+  ASSERT_EQ(half.pt, quarter1.pt);
+  ASSERT_EQ(half.pt, quarter2.pt);
+
+  // A broken hugepage with pages still released is no candidate.
+  Delete(quarter1);
+  EXPECT_EQ(N / 4, ReleasePages(kMaxValidPages));
+  EXPECT_FALSE(half.pt->unbroken());
+  HugePage candidates[2];
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    EXPECT_EQ(0, filler_.SelectCollapseCandidates(absl::MakeSpan(candidates)));
+  }
+
+  // Refilled, it is backed and dense again.
+  quarter1 = Allocate(N / 4);
+  ASSERT_EQ(half.pt, quarter1.pt);
+  {
+    absl::base_internal::SpinLockHolder l(&pageheap_lock);
+    ASSERT_EQ(1, filler_.SelectCollapseCandidates(absl::MakeSpan(candidates)));
+    EXPECT_EQ(half.pt->location(), candidates[0]);
+
+    filler_.RecordCollapse(half.pt, /*collapsed=*/false);
+    EXPECT_FALSE(half.pt->unbroken());
+    filler_.RecordCollapse(half.pt, /*collapsed=*/true);
+    EXPECT_TRUE(half.pt->unbroken());
+    EXPECT_EQ(0, filler_.SelectCollapseCandidates(absl::MakeSpan(candidates)));
+  }
+  EXPECT_EQ(NHugePages(1), filler_.collapsed_hugepages());
+  EXPECT_EQ(NHugePages(1), filler_.failed_collapses());
+
+  Delete(half);
+  Delete(quarter1);
+  Delete(quarter2);
+}
+
 TEST_P(FillerTest, AvoidArbitraryQuarantineVMGrowth) {
   const Length N = kPagesPerHugePage;
   // Guarantee we have a ton of released pages go empty.
@@ -1826,6 +1918,7 @@ HugePageFiller: 499 used pages in subreleased hugepages (0 of them in partially
 HugePageFiller: 2 hugepages partially released, 0.0254 released
 HugePageFiller: 0.7187 of used pages hugepageable
 HugePageFiller: Since startup, 269 pages subreleased, 3 hugepages broken, (0 pages, 0 hugepages due to reaching tcmalloc limit)
+HugePageFiller: Since startup, 0 broken hugepages collapsed, 0 collapses failed
 
 HugePageFiller: fullness histograms
 
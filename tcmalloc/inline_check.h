@@ -0,0 +1,519 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Layout of the metadata read by inlined bounds checks.
+//
+// Instrumented code that wants to find the chunk containing an address
+// without calling into the allocator reads the page map, the class_to_size
+// table and a few Span fields directly.  The first part of this file is plain
+// C: it describes that layout as data, which __inline_check_layout() fills in
+// at run time, so a check compiled against an older allocator either keeps
+// working or sees a version mismatch instead of reading the wrong words.  The
+// second part derives the same layout at compile time for the allocator's
+// own fast paths.
+
+#ifndef TCMALLOC_INLINE_CHECK_H_
+#define TCMALLOC_INLINE_CHECK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bumped whenever a field of TCMallocInlineCheckLayout changes meaning.
+#define TCMALLOC_INLINE_CHECK_VERSION 10
+
+// One record per size class, so a check needs a single load to turn an
+// offset into its span into the start of the object.
+struct TCMallocClassCheckInfo {
+  uint32_t size;
+  // log2(size) if flags has TCMALLOC_CLASS_POW2, 0 otherwise.
+  uint8_t shift;
+  uint8_t flags;
+  uint16_t reserved;
+  // ceil(2^64 / size): the high half of offset * reciprocal is
+  // offset / size for offsets into a span of small objects.
+  uint64_t reciprocal;
+};
+
+#define TCMALLOC_CLASS_POW2 1
+#define TCMALLOC_CLASS_POINTER_FREE 2
+
+struct TCMallocInlineCheckLayout {
+  uint32_t version;
+  // Root of the page map: one leaf pointer per 1 << leaf_shift bytes.
+  const void* const* pagemap_root;
+  // Object size of each size class, indexed by size class.  class_info
+  // holds the same facts one record per class and is cheaper to read.
+  const uint32_t* class_to_size;
+  // ceil(2^64 / class_to_size[sc]): the high half of offset * magic is
+  // offset / class_to_size[sc] for offsets into a span of small objects.
+  const uint64_t* class_to_magic;
+  // Addresses with bits at or above address_bits are never heap memory.
+  uint32_t address_bits;
+  uint32_t page_shift;
+  uint32_t leaf_shift;
+  // Index of a page within its leaf is (addr >> page_shift) & leaf_mask.
+  uintptr_t leaf_mask;
+  // A leaf starts with one uintptr_t of page info per page: the size class
+  // in the low page_info_class_bits bits, then the first page of the span up
+  // to bit page_info_size_shift, then the object size in units of
+  // 1 << span_obj_size_shift bytes up to bit 61.  If the top bit of the word
+  // is set, the object size counts pages instead; only spans without a size
+  // class use that.  Bits 61 and 62 are flags of the allocator and are not
+  // part of the size.  An object size of zero means the Span has to be consulted; the
+  // Span pointers start leaf_span_offset bytes into the leaf.
+  uint32_t page_info_class_bits;
+  uint32_t page_info_size_shift;
+  uint32_t leaf_span_offset;
+  // Span fields: a uint32_t object size in units of 1 << span_obj_size_shift
+  // bytes, a uintptr_t first page and a uintptr_t number of pages.  An object
+  // size of span_whole_obj_size marks a single object filling the span,
+  // which is too large for those units.
+  uint32_t span_obj_size_offset;
+  uint32_t span_obj_size_shift;
+  uint32_t span_first_page_offset;
+  uint32_t span_num_pages_offset;
+  uint32_t span_whole_obj_size;
+  // Bits of a heap pointer that hold its tag rather than its address; 0
+  // unless the allocator tags pointers.  The lookup runs on the address
+  // with them cleared and puts them back on the chunk bounds, so the bounds
+  // compare with pointers derived from the same base.  Whether the tag is
+  // still current is left to __gep_check_boundary().
+  uintptr_t pointer_tag_mask;
+  // Flat copy of the page info words of flat_pages pages from flat_base,
+  // indexed by (addr - flat_base) >> page_shift; flat_pages is 0 if there is
+  // none.  A word of 0 there says nothing, and the page map has to be read.
+  uintptr_t flat_base;
+  uintptr_t flat_pages;
+  const uintptr_t* flat_page_info;
+  // Indexed by size class, cache line aligned.
+  const struct TCMallocClassCheckInfo* class_info;
+};
+
+// Chunk containing an address, [start, end).
+struct TCMallocChunkRange {
+  uintptr_t start;
+  uintptr_t end;
+};
+
+// Hoistable entry points for checks in loops.  __chunk_range() resolves the
+// chunk of base once (the whole address space for non-heap memory) so the
+// loop can compare against it inline; it only reads allocator metadata.
+// __gep_check_boundary_range() checks a whole [ptr, ptr + size) access range
+// against the chunk of base, and __gep_check_boundary_batch() checks n
+// (bases[i], ptrs[i]) pairs like n calls to __gep_check_boundary().  Both
+// return 0 if every access is valid and -1 otherwise.
+//
+// __chunk_range_batch() is for conservative scanners, such as the collector
+// of a managed runtime, that map many candidate words to the objects they
+// point into.  It sets out[i] to the chunk of ptrs[i], allocated or free, or
+// to {0, 0} if ptrs[i] points into no heap object, and returns how many do.
+// Candidates are screened a block at a time before any page info is read.
+#ifdef __cplusplus
+extern "C" {
+#define TCMALLOC_INLINE_CHECK_NOEXCEPT noexcept
+#else
+#define TCMALLOC_INLINE_CHECK_NOEXCEPT
+#endif
+#if defined(__GNUC__)
+__attribute__((pure))
+#endif
+struct TCMallocChunkRange __chunk_range(const void* base)
+    TCMALLOC_INLINE_CHECK_NOEXCEPT;
+int __gep_check_boundary_range(void* base, void* ptr,
+                               size_t size) TCMALLOC_INLINE_CHECK_NOEXCEPT;
+int __gep_check_boundary_batch(void* const* bases, void* const* ptrs,
+                               size_t n) TCMALLOC_INLINE_CHECK_NOEXCEPT;
+size_t __chunk_range_batch(const void* const* ptrs, size_t n,
+                           struct TCMallocChunkRange* out)
+    TCMALLOC_INLINE_CHECK_NOEXCEPT;
+// Bytes from p to the end of the heap object it points into, allocated or
+// free, or SIZE_MAX if p is not heap memory.  TCMallocInlineRemainingBytes()
+// below is the same lookup inlined through __inline_check_layout().
+#if defined(__GNUC__)
+__attribute__((pure))
+#endif
+size_t tcmalloc_remaining_bytes(const void* p) TCMALLOC_INLINE_CHECK_NOEXCEPT;
+// With EXTERNAL_REGIONS, has the checks above treat [base, base + len),
+// memory the allocator does not own such as a pool of packet buffers, as
+// objects of element_size bytes laid out from base, so they are bounds
+// checked through the page map like heap objects.  base must be aligned to
+// the allocator's page size and element_size to 8 bytes; the tail of the
+// last page past len counts as more elements.  The objects cannot be
+// freed.  tcmalloc_unregister_region() takes the same base and len when the
+// memory goes away.  Both return 0, or -1 if nothing changed because the
+// arguments were invalid or the range overlaps heap memory or another
+// region.
+int tcmalloc_register_region(void* base, size_t len, size_t element_size)
+    TCMALLOC_INLINE_CHECK_NOEXCEPT;
+int tcmalloc_unregister_region(void* base,
+                               size_t len) TCMALLOC_INLINE_CHECK_NOEXCEPT;
+#ifdef __cplusplus
+}
+#endif
+#undef TCMALLOC_INLINE_CHECK_NOEXCEPT
+
+// Fills *layout and returns TCMALLOC_INLINE_CHECK_VERSION, or returns 0 and
+// leaves *layout untouched if this build has no inlinable layout, in which
+// case callers have to call TCGetChunkRange() instead.
+#ifdef __cplusplus
+extern "C" int __inline_check_layout(
+    struct TCMallocInlineCheckLayout* layout) noexcept;
+#else
+int __inline_check_layout(struct TCMallocInlineCheckLayout* layout);
+#endif
+
+// Reference implementation of the lookup inlined by instrumented code.  Sets
+// [*start, *end) to the chunk containing addr and returns 1, or returns 0 if
+// addr is not heap memory.
+static inline int TCMallocInlineChunkRange(
+    const struct TCMallocInlineCheckLayout* l, uintptr_t addr,
+    uintptr_t* start, uintptr_t* end) {
+  const uintptr_t tag = addr & l->pointer_tag_mask;
+  addr ^= tag;
+  if (addr >> l->address_bits) return 0;
+  const char* leaf = NULL;
+  const uintptr_t i = (addr >> l->page_shift) & l->leaf_mask;
+  const uintptr_t flat = (addr - l->flat_base) >> l->page_shift;
+  uintptr_t info = flat < l->flat_pages ? l->flat_page_info[flat] : 0;
+  if (info == 0) {
+    leaf = (const char*)l->pagemap_root[addr >> l->leaf_shift];
+    if (leaf == NULL) return 0;
+    info = ((const uintptr_t*)leaf)[i];
+  }
+  const uintptr_t sc = info & (((uintptr_t)1 << l->page_info_class_bits) - 1);
+  const uintptr_t first =
+      (info & (((uintptr_t)1 << l->page_info_size_shift) - 1)) >>
+      l->page_info_class_bits << l->page_shift;
+  const uintptr_t units = (info << 3 >> 3) >> l->page_info_size_shift;
+  uintptr_t size = units << (info >> 63 ? l->page_shift
+                                        : l->span_obj_size_shift);
+  if (sc != 0) {
+    const struct TCMallocClassCheckInfo* c = &l->class_info[sc];
+    if (size == 0) size = c->size;
+    if (c->flags & TCMALLOC_CLASS_POW2) {
+      *start = first + ((addr - first) >> c->shift << c->shift);
+    } else {
+#ifdef __SIZEOF_INT128__
+      *start = first + (uintptr_t)(((unsigned __int128)c->reciprocal *
+                                    (addr - first)) >> 64) * size;
+#else
+      *start = first + (addr - first) / size * size;
+#endif
+    }
+  } else if (size != 0) {
+    // Spans without a size class mostly hold a single object.
+    *start = addr - first < size ? first : first + (addr - first) / size * size;
+  } else {
+    if (leaf == NULL) {
+      leaf = (const char*)l->pagemap_root[addr >> l->leaf_shift];
+      if (leaf == NULL) return 0;
+    }
+    const char* span =
+        ((const char* const*)(leaf + l->leaf_span_offset))[i];
+    if (span == NULL) return 0;
+    const uint32_t units =
+        *(const uint32_t*)(span + l->span_obj_size_offset);
+    if (units == 0) return 0;
+    const uintptr_t span_first =
+        *(const uintptr_t*)(span + l->span_first_page_offset)
+        << l->page_shift;
+    if (units == l->span_whole_obj_size) {
+      size = *(const uintptr_t*)(span + l->span_num_pages_offset)
+             << l->page_shift;
+      *start = span_first;
+    } else {
+      size = (uintptr_t)units << l->span_obj_size_shift;
+      *start = span_first + (addr - span_first) / size * size;
+    }
+  }
+  *start |= tag;
+  *end = *start + size;
+  return 1;
+}
+
+// tcmalloc_remaining_bytes() without the call, for layouts filled in by
+// __inline_check_layout().
+static inline size_t TCMallocInlineRemainingBytes(
+    const struct TCMallocInlineCheckLayout* l, const void* p) {
+  uintptr_t start, end;
+  if (!TCMallocInlineChunkRange(l, (uintptr_t)p, &start, &end)) {
+    return SIZE_MAX;
+  }
+  return end - (uintptr_t)p;
+}
+
+#ifdef __cplusplus
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/class_regions.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/flat_page_info.h"
+#include "tcmalloc/heap_range_filter.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/pointer_tag.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Span::obj_size is kept in 8 byte units.
+inline constexpr int kSpanObjSizeShift = 3;
+
+#ifndef TCMALLOC_USE_PAGEMAP3
+// Compile-time view of TCMallocInlineCheckLayout.  It is a friend of the
+// classes it describes, so the offsets follow their definitions.
+struct InlineCheckLayout {
+  using Map = PageMap2<kAddressBits - kPageShift, MetaDataAlloc>;
+  using Leaf = Map::Leaf;
+  using Info = Map::Info;
+
+  static constexpr int kLeafShift = kPageShift + Map::kLeafBits;
+  static constexpr uintptr_t kLeafMask = Map::kLeafLength - 1;
+  static_assert(Info::kPageUnits == uintptr_t{1} << 63,
+                "the page unit flag is the top bit of the page info word");
+  static_assert(Info::kHasEscapes == uintptr_t{1} << 62 &&
+                    Info::kUntracked == uintptr_t{1} << 61,
+                "the C reference masks the three top bits off the size");
+  static_assert(kSpanObjSizeShift == 3,
+                "page info keeps the object size in Span::obj_size units");
+
+  // Span is not standard layout (it derives from TList<Span>::Elem), but
+  // every compiler we build with lays it out like one.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+  static constexpr size_t kLeafSpanOffset = offsetof(Leaf, span);
+  static constexpr size_t kClassToSizeOffset =
+      offsetof(SizeMap, class_to_size_);
+  static constexpr size_t kSpanObjSizeOffset = offsetof(Span, obj_size);
+  static constexpr size_t kSpanFirstPageOffset = offsetof(Span, first_page_);
+  static constexpr size_t kSpanNumPagesOffset = offsetof(Span, num_pages_);
+#pragma GCC diagnostic pop
+
+  static_assert(offsetof(Leaf, page_info) == 0,
+                "page info must start the leaf");
+  static_assert(sizeof(Leaf::page_info[0]) == sizeof(uintptr_t),
+                "page info is one word per page");
+  static_assert(sizeof(PageId) == sizeof(uintptr_t),
+                "Span::first_page_ is read as one word");
+  static_assert(sizeof(Length) == sizeof(uintptr_t),
+                "Span::num_pages_ is read as one word");
+  static_assert(sizeof(Span::obj_size) == sizeof(uint32_t),
+                "Span::obj_size is read as 32 bits");
+  static_assert(sizeof(ClassCheckInfo) == sizeof(TCMallocClassCheckInfo) &&
+                    offsetof(ClassCheckInfo, size) ==
+                        offsetof(TCMallocClassCheckInfo, size) &&
+                    offsetof(ClassCheckInfo, shift) ==
+                        offsetof(TCMallocClassCheckInfo, shift) &&
+                    offsetof(ClassCheckInfo, flags) ==
+                        offsetof(TCMallocClassCheckInfo, flags) &&
+                    offsetof(ClassCheckInfo, reciprocal) ==
+                        offsetof(TCMallocClassCheckInfo, reciprocal),
+                "ClassCheckInfo must match TCMallocClassCheckInfo");
+  static_assert(ClassCheckInfo::kPow2 == TCMALLOC_CLASS_POW2 &&
+                ClassCheckInfo::kPointerFree == TCMALLOC_CLASS_POINTER_FREE);
+
+  static const Leaf* LeafFor(uintptr_t addr) {
+    if (ABSL_PREDICT_FALSE(addr >> kAddressBits)) return nullptr;
+    return Static::pagemap_.map_.root_[addr >> kLeafShift];
+  }
+
+  static const uint32_t* class_to_size() {
+    return Static::sizemap_.class_to_size_;
+  }
+
+  static const uint64_t* class_to_magic() {
+    return Static::sizemap_.class_to_magic_;
+  }
+
+  static void Fill(TCMallocInlineCheckLayout* layout) {
+    layout->version = TCMALLOC_INLINE_CHECK_VERSION;
+    layout->pagemap_root = reinterpret_cast<const void* const*>(
+        Static::pagemap_.map_.root_);
+    layout->class_to_size = class_to_size();
+    layout->class_to_magic = class_to_magic();
+    layout->class_info = reinterpret_cast<const TCMallocClassCheckInfo*>(
+        Static::sizemap_.class_check_info());
+    layout->address_bits = kAddressBits;
+    layout->page_shift = kPageShift;
+    layout->leaf_shift = kLeafShift;
+    layout->leaf_mask = kLeafMask;
+    layout->page_info_class_bits = Info::kClassBits;
+    layout->page_info_size_shift = Info::kSizeShift;
+    layout->leaf_span_offset = kLeafSpanOffset;
+    layout->span_obj_size_offset = kSpanObjSizeOffset;
+    layout->span_obj_size_shift = kSpanObjSizeShift;
+    layout->span_first_page_offset = kSpanFirstPageOffset;
+    layout->span_num_pages_offset = kSpanNumPagesOffset;
+    layout->span_whole_obj_size = Span::kWholeSpanObjSize;
+    layout->pointer_tag_mask = PointerTags::enabled() ? kPointerTagMask : 0;
+#ifdef FLAT_PAGE_INFO
+    layout->flat_base = FlatPageInfo::base();
+    layout->flat_pages = FlatPageInfo::shadow() ? FlatPageInfo::kPages : 0;
+    layout->flat_page_info = FlatPageInfo::shadow();
+#else
+    layout->flat_base = 0;
+    layout->flat_pages = 0;
+    layout->flat_page_info = nullptr;
+#endif
+  }
+};
+#endif  // TCMALLOC_USE_PAGEMAP3
+
+// Whether every small size class fits in the page info word, so the
+// class_to_size lookup can be skipped.
+inline constexpr bool kPageInfoHoldsClassSize =
+    PageMap::Info::kMaxSize >= kMaxSize;
+
+// Returns the start of the chunk containing addr in a span without a size
+// class.  Such spans hold a single object unless they are sampled, so only
+// addresses past the first object need a divide.
+inline uintptr_t ABSL_ATTRIBUTE_ALWAYS_INLINE
+SpanChunkStart(uintptr_t addr, uintptr_t first, uintptr_t size) {
+  const uintptr_t offset = addr - first;
+  if (ABSL_PREDICT_TRUE(offset < size)) return first;
+  return first + offset / size * size;
+}
+
+// Returns the start of the chunk containing addr in the span described by
+// info, whose objects are size bytes.
+inline uintptr_t ABSL_ATTRIBUTE_ALWAYS_INLINE
+PageInfoChunkStart(uintptr_t addr, PageMap::Info info, uintptr_t size) {
+  const uintptr_t first = info.span_start();
+  if (ABSL_PREDICT_FALSE(info.size_class() == 0)) {
+    return SpanChunkStart(addr, first, size);
+  }
+#ifdef POW2_SIZE_CLASSES
+  // Spans are page aligned and objects are laid out from the span start,
+  // so the offset rounds down with a mask.
+  return first + ((addr - first) & ~(size - 1));
+#else
+  return first +
+         Static::sizemap().DivideBySizeClass(addr - first, info.size_class()) *
+             size;
+#endif
+}
+
+// Sets [*start, *end) to the chunk containing addr.  Returns false if addr
+// is not heap memory, usually straight from the HeapRangeFilter.  The page
+// info word alone describes the chunk unless the object is too large for it
+// to hold the size even in pages, and only then is the Span read.  No path
+// divides for addresses inside an object.  With CLASS_REGIONS, addresses in
+// a class region read nothing but the layout of their class.
+inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE InlineChunkRange(uintptr_t addr,
+                                                          uintptr_t* start,
+                                                          uintptr_t* end) {
+#ifdef CLASS_REGIONS
+  const size_t region = ClassRegions::Region(addr);
+  if (ABSL_PREDICT_TRUE(region < ClassRegions::kRegions)) {
+    return ClassRegions::ChunkRange(addr, region, start, end);
+  }
+#endif
+#ifdef HEAP_RANGE_FILTER
+  if (!HeapRangeFilter::MayContain(addr)) return false;
+#endif
+  uintptr_t size;
+#ifdef FLAT_PAGE_INFO
+  // The flat mirror of the heap reservation describes most chunks with one
+  // load.  Words it does not have, and chunks that need the Span, take the
+  // page map walk below.
+  const PageMap::Info flat(FlatPageInfo::Get(addr));
+  if (ABSL_PREDICT_TRUE((size = flat.object_size()) != 0)) {
+    *start = PageInfoChunkStart(addr, flat, size);
+    *end = *start + size;
+    return true;
+  }
+#endif
+#ifndef TCMALLOC_USE_PAGEMAP3
+  using L = InlineCheckLayout;
+  const L::Leaf* leaf = L::LeafFor(addr);
+  if (ABSL_PREDICT_FALSE(leaf == nullptr)) return false;
+  const uintptr_t i = (addr >> kPageShift) & L::kLeafMask;
+  const PageMap::Info info(leaf->page_info[i]);
+#else
+  const PageMap::Info info = Static::pagemap().get_page_info(
+      PageIdContaining(reinterpret_cast<void*>(addr)));
+#endif
+  size = info.object_size();
+  if (!kPageInfoHoldsClassSize && size == 0 && info.size_class() != 0) {
+    // A class too large for byte units; spans with a size class never use
+    // page units.
+    size = Static::sizemap().class_to_size(info.size_class());
+  }
+  if (ABSL_PREDICT_TRUE(size != 0)) {
+#if defined(CHUNK_START_TABLE) && !defined(TCMALLOC_USE_PAGEMAP3)
+    // Only sizes the word holds had their first objects recorded.
+    if (info.object_size() >= kPageSize && info.size_class() != 0) {
+      // A multiply and a compare instead of dividing the offset in the span.
+      *start = info.span_start() + leaf->first_object[i] * size;
+      if (addr - *start >= size) *start += size;
+      *end = *start + size;
+      return true;
+    }
+#endif
+    *start = PageInfoChunkStart(addr, info, size);
+  } else {
+#ifndef TCMALLOC_USE_PAGEMAP3
+    const Span* span = leaf->span[i];
+#else
+    const Span* span = Static::pagemap().GetDescriptor(
+        PageIdContaining(reinterpret_cast<void*>(addr)));
+#endif
+    if (span == nullptr) return false;
+    // Spans that are not in use have no objects.
+    if (span->obj_size == 0) return false;
+    if (ABSL_PREDICT_FALSE(span->obj_size == Span::kWholeSpanObjSize)) {
+      // Objects too large for obj_size fill their span, so there is nothing
+      // to divide.
+      *start = reinterpret_cast<uintptr_t>(span->start_address());
+      *end = *start + span->bytes_in_span();
+      return true;
+    }
+    size = uintptr_t{span->obj_size} << kSpanObjSizeShift;
+    *start = SpanChunkStart(
+        addr, reinterpret_cast<uintptr_t>(span->start_address()), size);
+  }
+  *end = *start + size;
+  return true;
+}
+
+// Prefetches the page info InlineChunkRange(addr) reads first, so that the
+// misses of a batch of lookups overlap.
+inline void ABSL_ATTRIBUTE_ALWAYS_INLINE PrefetchChunkRange(uintptr_t addr) {
+#ifdef FLAT_PAGE_INFO
+  FlatPageInfo::Prefetch(addr);
+#endif
+#ifndef TCMALLOC_USE_PAGEMAP3
+  using L = InlineCheckLayout;
+  const L::Leaf* leaf = L::LeafFor(addr);
+  if (leaf == nullptr) return;
+  __builtin_prefetch(&leaf->page_info[(addr >> kPageShift) & L::kLeafMask], 0,
+                     3);
+#else
+  Static::pagemap().PrefetchDescriptor(
+      PageIdContaining(reinterpret_cast<void*>(addr)));
+#endif
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // __cplusplus
+
+#endif  // TCMALLOC_INLINE_CHECK_H_
@@ -89,6 +89,12 @@ class LifetimeDatabase {
       return Key();
     }
 
+    // Returns the key of a stack trace recorded earlier, e.g. the one of a
+    // sampled allocation.
+    static Key FromStack(void* const* stack, int depth) {
+      return Key(stack, depth);
+    }
+
     template <typename H>
     friend H AbslHashValue(H h, const Key& c) {
       return H::combine(H::combine_contiguous(std::move(h), c.stack_, c.depth_),
@@ -111,6 +117,11 @@ class LifetimeDatabase {
     Key() {
       depth_ = absl::GetStackTrace(stack_, kMaxStackDepth, /*skip_count=*/1);
     }
+
+    Key(void* const* stack, int depth)
+        : depth_(depth < kMaxStackDepth ? depth : kMaxStackDepth) {
+      std::copy(stack, stack + depth_, stack_);
+    }
   };
 
   // Captures statistics associated with the low-level allocator backing the
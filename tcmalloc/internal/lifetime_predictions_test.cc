@@ -188,6 +188,26 @@ TEST_F(LifetimeDatabaseTest, Hash) {
   EXPECT_TRUE(absl::VerifyTypeImplementsAbslHashCorrectly(keys));
 }
 
+TEST_F(LifetimeDatabaseTest, FromStack) {
+  void* stack[kMaxStackDepth];
+  const int depth = absl::GetStackTrace(stack, kMaxStackDepth, 0);
+  void* other[kMaxStackDepth];
+  std::copy(stack, stack + depth, other);
+  other[0] = nullptr;
+
+  LifetimeDatabase::Key a = LifetimeDatabase::Key::FromStack(stack, depth);
+  LifetimeDatabase::Key b = LifetimeDatabase::Key::FromStack(stack, depth);
+  EXPECT_TRUE(a == b);
+  EXPECT_FALSE(a == LifetimeDatabase::Key::FromStack(other, depth));
+  EXPECT_FALSE(a == LifetimeDatabase::Key::FromStack(stack, depth - 1));
+
+  // The same stack is the same site, so both keys share their statistics.
+  LifetimeStats* lifetime = lifetime_database_.LookupOrAddLifetimeStats(&a);
+  EXPECT_EQ(lifetime, lifetime_database_.LookupOrAddLifetimeStats(&b));
+  lifetime_database_.RemoveLifetimeStatsReference(lifetime);
+  lifetime_database_.RemoveLifetimeStatsReference(lifetime);
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -216,6 +216,13 @@ class TList {
     return static_cast<T*>(head_.prev_);
   }
 
+  // Returns the element after item, or nullptr if item is the last one.
+  // item must be on the list.
+  T* next(const T* item) const {
+    Elem* e = item->next_;
+    return e == &head_ ? nullptr : static_cast<T*>(e);
+  }
+
   // Add item to the front of list.
   void prepend(T* item) { head_.append(item); }
 
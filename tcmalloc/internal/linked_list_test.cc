@@ -284,6 +284,27 @@ TEST_F(TListTest, AppendRandomRemove) {
   EXPECT_TRUE(list_.empty());
 }
 
+TEST_F(TListTest, Next) {
+  const int N = 10;
+  for (int i = 0; i < N; i++) {
+    list_.append(MockSpan::New(i));
+  }
+
+  // Walk the list with next() from the first element to the last.
+  int i = 0;
+  for (MockSpan* s = list_.first(); s != nullptr; s = list_.next(s)) {
+    EXPECT_EQ(s->index_, i);
+    i++;
+  }
+  EXPECT_EQ(i, N);
+
+  while (!list_.empty()) {
+    MockSpan* s = list_.first();
+    list_.remove(s);
+    delete s;
+  }
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
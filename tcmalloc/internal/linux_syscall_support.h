@@ -22,7 +22,11 @@ struct kernel_rseq {
   unsigned cpu_id;
   unsigned long long rseq_cs;
   unsigned flags;
-  unsigned padding[2];
+  // Since Linux 6.3: the NUMA node of cpu_id, and the concurrency id of the
+  // thread, below the number of threads of the process running at once and
+  // reused as they come and go rather than tied to a physical core.
+  unsigned node_id;
+  unsigned mm_cid;
   // This is a prototype extension to the rseq() syscall.  Since a process may
   // run on only a few cores at a time, we can use a dense set of "v(irtual)
   // cpus."  This can reduce cache requirements, as we only need N caches for
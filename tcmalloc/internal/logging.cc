@@ -27,8 +27,8 @@
 #include "absl/base/const_init.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/macros.h"
-#include "absl/debugging/stacktrace.h"
 #include "tcmalloc/internal/parameter_accessors.h"
+#include "tcmalloc/internal/stack_unwinder.h"
 #include "tcmalloc/malloc_extension.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
@@ -85,7 +85,7 @@ static Logger FormatLog(bool with_stack, const char* filename, int line,
 
   if (with_stack) {
     state.trace.depth =
-        absl::GetStackTrace(state.trace.stack, kMaxStackDepth, 1);
+        CaptureStackTrace(state.trace.stack, kMaxStackDepth, 1);
     state.Add(LogItem("@"));
     for (int i = 0; i < state.trace.depth; i++) {
       state.Add(LogItem(state.trace.stack[i]));
@@ -60,6 +60,28 @@ ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetLinearSearchLengthTrackerList(
 ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetMadviseColdRegionsNoHugepage();
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetMadviseColdRegionsNoHugepage(
     bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetBackgroundEscapeFlushEnabled();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetBackgroundEscapeFlushEnabled(
+    bool v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetEscapeL2CacheSize();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetEscapeL2CacheSize(int64_t v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetReallocMigrateEscapesEnabled();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetReallocMigrateEscapesEnabled(
+    bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetDeterministicModeEnabled();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetDeterministicModeEnabled(bool v);
+ABSL_ATTRIBUTE_WEAK double TCMalloc_Internal_GetSamplingCpuBudget();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetSamplingCpuBudget(double v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetEffectiveProfileSamplingRate();
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetEscapePoisonChunkLimit();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetEscapePoisonChunkLimit(int64_t v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetEscapeSpanSamplePeriod();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetEscapeSpanSamplePeriod(int64_t v);
+ABSL_ATTRIBUTE_WEAK int TCMalloc_Internal_GetProtectionPolicy();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetProtectionPolicy(int v);
+ABSL_ATTRIBUTE_WEAK int64_t TCMalloc_Internal_GetProtectionSamplePeriod();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetProtectionSamplePeriod(
+    int64_t v);
 ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_PossiblyCold(const void* ptr);
 ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetPerCpuCachesDynamicSlabEnabled();
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetPerCpuCachesDynamicSlabEnabled(
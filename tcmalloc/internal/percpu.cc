@@ -15,6 +15,7 @@
 
 #include <fcntl.h>
 #include <sched.h>
+#include <sys/auxv.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -55,8 +56,13 @@ extern "C" {
 //     [0, NumCpus())    (Always updated at context-switch)
 ABSL_CONST_INIT thread_local ABSL_ATTRIBUTE_WEAK volatile kernel_rseq
     __rseq_abi = {
-        0,      static_cast<unsigned>(kCpuIdUninitialized),   0, 0,
-        {0, 0}, {{kCpuIdUninitialized, kCpuIdUninitialized}},
+        0,
+        static_cast<unsigned>(kCpuIdUninitialized),
+        0,
+        0,
+        0,
+        static_cast<unsigned>(kCpuIdUninitialized),
+        {{kCpuIdUninitialized, kCpuIdUninitialized}},
 };
 
 }  // extern "C"
@@ -71,6 +77,20 @@ ABSL_CONST_INIT static absl::once_flag init_per_cpu_once;
 #if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
 ABSL_CONST_INIT static std::atomic<bool> using_upstream_fence{false};
 #endif  // TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ && defined(RSEQ_MM_CID)
+ABSL_CONST_INIT std::atomic<bool> using_mm_cid{false};
+
+#ifndef AT_RSEQ_FEATURE_SIZE
+#define AT_RSEQ_FEATURE_SIZE 27
+#endif
+
+// Whether the kernel updates mm_cid, which it tells through the size of the
+// part of kernel_rseq it maintains.  Kernels before 6.3 do not report it.
+static bool KernelSupportsMmCid() {
+  return getauxval(AT_RSEQ_FEATURE_SIZE) >=
+         offsetof(kernel_rseq, mm_cid) + sizeof(kernel_rseq::mm_cid);
+}
+#endif
 
 // Is this thread's __rseq_abi struct currently registered with the kernel?
 static bool ThreadRegistered() { return RseqCpuId() >= kCpuIdInitialized; }
@@ -89,7 +109,15 @@ static bool InitThreadPerCpu() {
 }
 
 bool UsingFlatVirtualCpus() {
+  return UsingMmCid();
+}
+
+bool UsingMmCid() {
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ && defined(RSEQ_MM_CID)
+  return using_mm_cid.load(std::memory_order_relaxed);
+#else
   return false;
+#endif
 }
 
 static void InitPerCpu() {
@@ -109,6 +137,14 @@ static void InitPerCpu() {
                      kMEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0),
         std::memory_order_relaxed);
 #endif  // TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ && defined(RSEQ_MM_CID)
+    // mm_cid can only be fenced through the upstream fence, which
+    // interrupts every CPU running a thread of the process.
+    using_mm_cid.store(
+        using_upstream_fence.load(std::memory_order_relaxed) &&
+            KernelSupportsMmCid(),
+        std::memory_order_relaxed);
+#endif
   }
 }
 
@@ -297,6 +333,13 @@ void FenceCpu(int cpu, const size_t virtual_cpu_id_offset) {
     FenceAllCpus();
   }
 
+  // Nor with mm_cid, and a thread may take another id whenever it is
+  // scheduled.
+  if (virtual_cpu_id_offset == offsetof(kernel_rseq, mm_cid)) {
+    FenceAllCpus();
+    return;
+  }
+
 #if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
   if (using_upstream_fence.load(std::memory_order_relaxed)) {
     UpstreamRseqFenceCpu(cpu);
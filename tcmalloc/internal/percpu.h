@@ -87,7 +87,8 @@ static inline int RseqCpuId() { return __rseq_abi.cpu_id; }
 
 static inline int VirtualRseqCpuId(const size_t virtual_cpu_id_offset) {
   ASSERT(virtual_cpu_id_offset == offsetof(kernel_rseq, cpu_id) ||
-         virtual_cpu_id_offset == offsetof(kernel_rseq, vcpu_id));
+         virtual_cpu_id_offset == offsetof(kernel_rseq, vcpu_id) ||
+         virtual_cpu_id_offset == offsetof(kernel_rseq, mm_cid));
   return *reinterpret_cast<short*>(reinterpret_cast<uintptr_t>(&__rseq_abi) +
                                    virtual_cpu_id_offset);
 }
@@ -126,9 +127,26 @@ size_t TcmallocSlab_Internal_PopBatch(size_t size_class, void** batch,
 // increase the visibility of functions embedded into the root-namespace (by
 // virtue of C linkage) in the supported case.
 
-// Return whether we are using flat virtual CPUs.
+// Return whether we are using flat virtual CPUs: per-cpu data is indexed by
+// dense ids of the CPUs the process runs on at once rather than by physical
+// CPU.  With RSEQ_MM_CID these are the kernel's mm_cid concurrency ids.
 bool UsingFlatVirtualCpus();
 
+// Return whether the virtual CPUs are mm_cid concurrency ids.  Only known
+// once InitFastPerCpu() has registered a thread with rseq.
+bool UsingMmCid();
+
+// The offset in kernel_rseq of the id per-cpu data is indexed by.
+inline size_t VirtualCpuIdOffset() {
+  if (UsingMmCid()) return offsetof(kernel_rseq, mm_cid);
+  if (UsingFlatVirtualCpus()) return offsetof(kernel_rseq, vcpu_id);
+  return offsetof(kernel_rseq, cpu_id);
+}
+
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ && defined(RSEQ_MM_CID)
+ABSL_CONST_INIT extern std::atomic<bool> using_mm_cid;
+#endif
+
 inline int GetCurrentCpuUnsafe() {
   // Use the rseq mechanism.
   return RseqCpuId();
@@ -180,6 +198,7 @@ inline int GetCurrentVirtualCpu(const size_t virtual_cpu_id_offset) {
 
   // Do not return a physical CPU ID when we expect a virtual CPU ID.
   CHECK_CONDITION(virtual_cpu_id_offset != offsetof(kernel_rseq, vcpu_id));
+  CHECK_CONDITION(virtual_cpu_id_offset != offsetof(kernel_rseq, mm_cid));
 
 #ifdef TCMALLOC_HAVE_SCHED_GETCPU
   cpu = sched_getcpu();
@@ -219,6 +238,19 @@ inline bool IsFastNoInit() {
   return ABSL_PREDICT_TRUE(cpu >= kCpuIdInitialized);
 }
 
+// The mm_cid of the calling thread where the kernel maintains it, as
+// GetCurrentCpu() otherwise.  For locked shards indexed modulo their count:
+// threads running at once have distinct ids, and a process that runs on few
+// CPUs at a time only ever touches that many shards.
+inline int GetCurrentConcurrencyId() {
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ && defined(RSEQ_MM_CID)
+  if (using_mm_cid.load(std::memory_order_relaxed) && IsFastNoInit()) {
+    return __rseq_abi.mm_cid;
+  }
+#endif
+  return GetCurrentCpu();
+}
+
 // A barrier that prevents compiler reordering.
 inline void CompilerBarrier() {
 #if defined(__GNUC__)
@@ -22,7 +22,9 @@
 #endif
 #include <sys/mman.h>
 
+#include <algorithm>
 #include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <memory>
@@ -211,6 +213,13 @@ class TcmallocSlab {
   // REQUIRES: len > 0.
   size_t PopBatch(size_t size_class, void** batch, size_t len);
 
+  // Stores in <batch> up to <len> items the next Pops from the current cpu
+  // slab would return, most recently pushed first, without removing them.
+  // Returns the number of items stored.  The slab is read outside of a
+  // restartable sequence, so the items may be gone by the time the caller
+  // looks at them; they are only good as prefetch hints.
+  size_t PeekTop(size_t size_class, void** batch, size_t len);
+
   // Decrements the cpu/size_class slab's capacity to no less than
   // max(capacity-len, 0) and returns the actual decrement applied. It attempts
   // to shrink any unused capacity (i.e end-current) in cpu/size_class's slab;
@@ -753,8 +762,15 @@ inline ABSL_ATTRIBUTE_ALWAYS_INLINE void PrefetchNextObject(
   // (https://research.google/pubs/pub50370/), section 6.4 for additional
   // details.
   //
-  // TODO(b/214608320): Evaluate prefetch for write.
+#ifdef PREFETCH_FOR_WRITE
+  // The next object is usually written first, by a constructor or by the
+  // caller filling it in, so ask for the line in exclusive state and save
+  // the upgrade at the first store (prefetchw on x86, prfm pstl1keep on
+  // AArch64).
+  __builtin_prefetch(prefetch_target, 1, 3);
+#else
   __builtin_prefetch(prefetch_target, 0, 3);
+#endif
 }
 
 #if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ && defined(__x86_64__)
@@ -1133,6 +1149,22 @@ inline auto TcmallocSlab<NumClasses>::AllocSlabs(
   return {reused_slabs, can_reuse ? size : 0};
 }
 
+template <size_t NumClasses>
+inline size_t TcmallocSlab<NumClasses>::PeekTop(size_t size_class,
+                                                void** batch, size_t len) {
+  const int cpu = GetCurrentVirtualCpuUnsafe();
+  const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
+  const Header hdr = LoadHeader(GetHeader(slabs, shift, cpu, size_class));
+  if (hdr.IsLocked() || hdr.current <= hdr.begin) return 0;
+  const size_t n = std::min<size_t>(len, hdr.current - hdr.begin);
+  void** top =
+      reinterpret_cast<void**>(GetHeader(slabs, shift, cpu, 0)) + hdr.current;
+  for (size_t i = 0; i < n; ++i) {
+    batch[i] = top[-1 - static_cast<ptrdiff_t>(i)];
+  }
+  return n;
+}
+
 template <size_t NumClasses>
 inline auto TcmallocSlab<NumClasses>::CpuMemoryStart(Slabs* slabs, Shift shift,
                                                      int cpu) -> Slabs* {
@@ -1243,9 +1275,7 @@ void TcmallocSlab<NumClasses>::Init(
     absl::FunctionRef<void*(size_t, std::align_val_t)> alloc,
     absl::FunctionRef<size_t(size_t)> capacity, Shift shift,
     uint8_t shift_offset) {
-  if (UsingFlatVirtualCpus()) {
-    virtual_cpu_id_offset_ = offsetof(kernel_rseq, vcpu_id);
-  }
+  virtual_cpu_id_offset_ = VirtualCpuIdOffset();
 
   const int num_cpus = absl::base_internal::NumCPUs();
   Slabs* slabs = AllocSlabs(alloc, shift, num_cpus, shift_offset).first;
@@ -351,9 +351,15 @@ TEST_F(TcmallocSlabTest, Unit) {
         const size_t expect = std::min(i, kCapacity / 2);
         ASSERT_EQ(slab_.PushBatch(size_class, batch, i), expect);
         ASSERT_EQ(slab_.Length(cpu, size_class), expect);
+        // PeekTop() sees what the Pops return, in order, and takes nothing.
+        void* peeked[kCapacity + 1];
+        ASSERT_EQ(slab_.PeekTop(size_class, peeked, kCapacity), expect);
+        ASSERT_EQ(slab_.Length(cpu, size_class), expect);
         for (size_t j = 0; j < expect; ++j) {
           slabs_result[j] = slab_.Pop(size_class, ExpectNoUnderflow, nullptr);
+          ASSERT_EQ(slabs_result[j], peeked[j]);
         }
+        ASSERT_EQ(slab_.PeekTop(size_class, peeked, kCapacity), 0);
         ASSERT_THAT(
             std::vector<void*>(&slabs_result[0], &slabs_result[expect]),
             UnorderedElementsAreArray(&object_ptrs_[i - expect], expect));
@@ -871,6 +877,31 @@ TEST(TcmallocSlab, SMP) {
   ASSERT_GT(absl::base_internal::NumCPUs(), 1);
 }
 
+TEST(TcmallocSlab, ConcurrencyIdsAreDense) {
+  if (!IsFast() || !UsingMmCid()) {
+    GTEST_SKIP() << "mm_cid is not in use";
+  }
+  // Threads running at once hold distinct ids, below the number of CPUs the
+  // process may run on.
+  const int allowed = AllowedCpus().size();
+  std::vector<std::thread> threads;
+  std::atomic<int> max_id{-1};
+  for (int i = 0; i < 4 * allowed; ++i) {
+    threads.emplace_back([&]() {
+      ASSERT_TRUE(IsFast());
+      for (int j = 0; j < 1000; ++j) {
+        const int id = VirtualRseqCpuId(VirtualCpuIdOffset());
+        int seen = max_id.load(std::memory_order_relaxed);
+        while (id > seen && !max_id.compare_exchange_weak(seen, id)) {
+        }
+      }
+    });
+  }
+  for (auto& t : threads) t.join();
+  EXPECT_GE(max_id.load(), 0);
+  EXPECT_LT(max_id.load(), allowed);
+}
+
 #if ABSL_INTERNAL_HAVE_ELF_SYMBOLIZE
 int FilterElfHeader(struct dl_phdr_info* info, size_t size, void* data) {
   *reinterpret_cast<uintptr_t*>(data) =
@@ -29,7 +29,9 @@
 #include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
+#include "google/protobuf/io/coded_stream.h"
 #include "tcmalloc/internal/profile.pb.h"
 #include "absl/base/attributes.h"
 #include "absl/base/config.h"
@@ -103,6 +105,7 @@ uintptr_t RoundUpToPageSize(uintptr_t address) {
 struct SampleMergedData {
   int64_t count = 0;
   int64_t sum = 0;
+  int64_t escapes = 0;
   std::optional<size_t> sampled_resident_size;
   std::optional<size_t> swapped_size;
 };
@@ -118,7 +121,7 @@ struct SampleEqWithSubFields {
     auto fields = [](const Profile::Sample& s) {
       return std::tie(s.depth, s.requested_size, s.requested_alignment,
                       s.requested_size_returning, s.allocated_size,
-                      s.access_hint, s.access_allocated);
+                      s.access_hint, s.access_allocated, s.age_bucket);
     };
     return fields(a) == fields(b) &&
            std::equal(a.stack, a.stack + a.depth, b.stack, b.stack + b.depth);
@@ -130,7 +133,7 @@ struct SampleHashWithSubFields {
     return absl::HashOf(absl::MakeConstSpan(s.stack, s.depth), s.depth,
                         s.requested_size, s.requested_alignment,
                         s.requested_size_returning, s.allocated_size,
-                        s.access_hint, s.access_allocated);
+                        s.access_hint, s.access_allocated, s.age_bucket);
   }
 };
 
@@ -138,21 +141,26 @@ using SampleMergedMap =
     absl::flat_hash_map<const tcmalloc::Profile::Sample, SampleMergedData,
                         SampleHashWithSubFields, SampleEqWithSubFields>;
 
+void MergeSample(const tcmalloc::Profile::Sample& entry,
+                 SampleMergedData& data) {
+  data.count += entry.count;
+  data.sum += entry.sum;
+  data.escapes += entry.escapes;
+  // As long as some entries have values on `sampled_resident_size` and
+  // `swapped_size`, the merged data will have their sums.
+  if (!data.sampled_resident_size.has_value()) {
+    data.sampled_resident_size = entry.sampled_resident_size;
+    data.swapped_size = entry.swapped_size;
+  } else if (entry.sampled_resident_size.has_value()) {
+    data.sampled_resident_size.value() += entry.sampled_resident_size.value();
+    data.swapped_size.value() += entry.swapped_size.value();
+  }
+}
+
 SampleMergedMap MergeProfileSamples(const tcmalloc::Profile& profile) {
   SampleMergedMap map;
   profile.Iterate([&](const tcmalloc::Profile::Sample& entry) {
-    SampleMergedData& data = map[entry];
-    data.count += entry.count;
-    data.sum += entry.sum;
-    // As long as some entries have values on `sampled_resident_size` and
-    // `swapped_size`, the merged data will have their sums.
-    if (!data.sampled_resident_size.has_value()) {
-      data.sampled_resident_size = entry.sampled_resident_size;
-      data.swapped_size = entry.swapped_size;
-    } else if (entry.sampled_resident_size.has_value()) {
-      data.sampled_resident_size.value() += entry.sampled_resident_size.value();
-      data.swapped_size.value() += entry.swapped_size.value();
-    }
+    MergeSample(entry, map[entry]);
   });
   return map;
 }
@@ -294,13 +302,14 @@ int ProfileBuilder::InternString(absl::string_view sv) {
     return 0;
   }
 
-  const int index = profile_->string_table_size();
+  const int index = num_strings_;
   const auto inserted = strings_.emplace(sv, index);
   if (!inserted.second) {
     // Failed to insert -- use existing id.
     return inserted.first->second;
   }
   profile_->add_string_table(inserted.first->first);
+  ++num_strings_;
   return index;
 }
 
@@ -308,12 +317,13 @@ int ProfileBuilder::InternLocation(const void* ptr) {
   uintptr_t address = absl::bit_cast<uintptr_t>(ptr);
 
   // Avoid assigning location ID 0 by incrementing by 1.
-  const int index = profile_->location_size() + 1;
+  const int index = num_locations_ + 1;
   const auto inserted = locations_.emplace(address, index);
   if (!inserted.second) {
     // Failed to insert -- use existing id.
     return inserted.first->second;
   }
+  ++num_locations_;
   perftools::profiles::Location& location = *profile_->add_location();
   ASSERT(inserted.first->second == index);
   location.set_id(index);
@@ -330,14 +340,9 @@ int ProfileBuilder::InternLocation(const void* ptr) {
   }
 
   // If *it contains address, add mapping to location.
-  const int mapping_index = it->second;
-  const perftools::profiles::Mapping& mapping =
-      profile_->mapping(mapping_index);
-  const int mapping_id = mapping.id();
-  ASSERT(it->first == mapping.memory_start());
-
-  if (it->first <= address && address < mapping.memory_limit()) {
-    location.set_mapping_id(mapping_id);
+  const MappingRange& mapping = it->second;
+  if (it->first <= address && address < mapping.memory_limit) {
+    location.set_mapping_id(mapping.id);
   }
 
   return index;
@@ -365,7 +370,7 @@ void ProfileBuilder::AddCurrentMappings() {
     }
 
     ProfileBuilder& builder = *static_cast<ProfileBuilder*>(data);
-    const bool is_main_executable = builder.profile_->mapping_size() == 0;
+    const bool is_main_executable = builder.num_mappings_ == 0;
 
     // Evaluate all the loadable segments.
     for (int i = 0; i < info->dlpi_phnum; ++i) {
@@ -430,48 +435,79 @@ void ProfileBuilder::AddMapping(uintptr_t memory_start, uintptr_t memory_limit,
                                 absl::string_view filename,
                                 absl::string_view build_id) {
   perftools::profiles::Mapping& mapping = *profile_->add_mapping();
-  mapping.set_id(profile_->mapping_size());
+  mapping.set_id(++num_mappings_);
   mapping.set_memory_start(memory_start);
   mapping.set_memory_limit(memory_limit);
   mapping.set_file_offset(file_offset);
   mapping.set_filename(InternString(filename));
   mapping.set_build_id(InternString(build_id));
 
-  mappings_.emplace(memory_start, mapping.id() - 1);
+  mappings_.emplace(memory_start, MappingRange{memory_limit, num_mappings_});
+}
+
+void ProfileBuilder::Flush(google::protobuf::io::CodedOutputStream& output) {
+  profile_->SerializeToCodedStream(&output);
+  profile_->Clear();
 }
 
 std::unique_ptr<perftools::profiles::Profile> ProfileBuilder::Finalize() && {
   return std::move(profile_);
 }
 
-absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
-    const ::tcmalloc::Profile& profile) {
-  ProfileBuilder builder;
+namespace {
+
+// IDs of the strings every sample of a profile may use.
+struct ProfileStringIds {
+  int alignment;
+  int bytes;
+  int count;
+  int escapes;
+  int objects;
+  int request;
+  int size_returning;
+  int space;
+  int access_hint;
+  int access_allocated;
+  int cold;
+  int hot;
+  int age;
+  int ms;
+  int sampled_resident;
+  int swapped;
+  bool has_escapes;
+};
+
+// Adds the mappings and the fields that describe the profile as a whole,
+// and interns the strings its samples use into `ids`.
+absl::Status AddProfileHeader(const ::tcmalloc::Profile& profile,
+                              ProfileBuilder& builder, ProfileStringIds& ids) {
   builder.AddCurrentMappings();
 
-  const int alignment_id = builder.InternString("alignment");
-  const int bytes_id = builder.InternString("bytes");
-  const int count_id = builder.InternString("count");
-  const int objects_id = builder.InternString("objects");
-  const int request_id = builder.InternString("request");
-  const int size_returning_id = builder.InternString("size_returning");
-  const int space_id = builder.InternString("space");
-  const int access_hint_id = builder.InternString("access_hint");
-  const int access_allocated_id = builder.InternString("access_allocated");
-  const int cold_id = builder.InternString("cold");
-  const int hot_id = builder.InternString("hot");
+  ids.alignment = builder.InternString("alignment");
+  ids.bytes = builder.InternString("bytes");
+  ids.count = builder.InternString("count");
+  ids.escapes = builder.InternString("escapes");
+  ids.objects = builder.InternString("objects");
+  ids.request = builder.InternString("request");
+  ids.size_returning = builder.InternString("size_returning");
+  ids.space = builder.InternString("space");
+  ids.access_hint = builder.InternString("access_hint");
+  ids.access_allocated = builder.InternString("access_allocated");
+  ids.cold = builder.InternString("cold");
+  ids.hot = builder.InternString("hot");
+  ids.age = builder.InternString("age");
+  ids.ms = builder.InternString("ms");
 
   // NOTE: Do not rely on these string constants. They will be removed!
-  const int sampled_resident_id =
-      builder.InternString("sampled_resident_bytes");
-  const int swapped_id = builder.InternString("swapped_bytes");
+  ids.sampled_resident = builder.InternString("sampled_resident_bytes");
+  ids.swapped = builder.InternString("swapped_bytes");
 
   perftools::profiles::Profile& converted = builder.profile();
 
   perftools::profiles::ValueType& period_type =
       *converted.mutable_period_type();
-  period_type.set_type(space_id);
-  period_type.set_unit(bytes_id);
+  period_type.set_type(ids.space);
+  period_type.set_unit(ids.bytes);
   converted.set_period(profile.Period());
   converted.set_drop_frames(builder.InternString(kProfileDropFrames));
 
@@ -479,14 +515,21 @@ absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
 
   {
     perftools::profiles::ValueType& sample_type = *converted.add_sample_type();
-    sample_type.set_type(objects_id);
-    sample_type.set_unit(count_id);
+    sample_type.set_type(ids.objects);
+    sample_type.set_unit(ids.count);
   }
 
   {
     perftools::profiles::ValueType& sample_type = *converted.add_sample_type();
-    sample_type.set_type(space_id);
-    sample_type.set_unit(bytes_id);
+    sample_type.set_type(ids.space);
+    sample_type.set_unit(ids.bytes);
+  }
+
+  ids.has_escapes = profile.Type() == tcmalloc::ProfileType::kEscapes;
+  if (ids.has_escapes) {
+    perftools::profiles::ValueType& sample_type = *converted.add_sample_type();
+    sample_type.set_type(ids.escapes);
+    sample_type.set_unit(ids.count);
   }
 
   int default_sample_type_id;
@@ -494,10 +537,14 @@ absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
     case tcmalloc::ProfileType::kFragmentation:
     case tcmalloc::ProfileType::kHeap:
     case tcmalloc::ProfileType::kPeakHeap:
-      default_sample_type_id = space_id;
+    case tcmalloc::ProfileType::kAges:
+      default_sample_type_id = ids.space;
       break;
     case tcmalloc::ProfileType::kAllocations:
-      default_sample_type_id = objects_id;
+      default_sample_type_id = ids.objects;
+      break;
+    case tcmalloc::ProfileType::kEscapes:
+      default_sample_type_id = ids.escapes;
       break;
     default:
 #if defined(ABSL_HAVE_ADDRESS_SANITIZER) || \
@@ -511,72 +558,152 @@ absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
   }
 
   converted.set_default_sample_type(default_sample_type_id);
+  return absl::OkStatus();
+}
 
-  SampleMergedMap samples = MergeProfileSamples(profile);
-  for (const auto& [entry, data] : samples) {
-    perftools::profiles::Profile& profile = builder.profile();
-    perftools::profiles::Sample& sample = *profile.add_sample();
+// Adds the merged samples of `entry` to the profile.
+void AddSample(ProfileBuilder& builder, const ProfileStringIds& ids,
+               const tcmalloc::Profile::Sample& entry,
+               const SampleMergedData& data) {
+  perftools::profiles::Profile& profile = builder.profile();
+  perftools::profiles::Sample& sample = *profile.add_sample();
+
+  CHECK_CONDITION(entry.depth <= ABSL_ARRAYSIZE(entry.stack));
+  builder.InternCallstack(absl::MakeSpan(entry.stack, entry.depth), sample);
+
+  sample.add_value(data.count);
+  sample.add_value(data.sum);
+  if (ids.has_escapes) sample.add_value(data.escapes);
+
+  // add fields that are common to all memory profiles
+  auto add_label = [&](int key, int unit, size_t value) {
+    perftools::profiles::Label& label = *sample.add_label();
+    label.set_key(key);
+    label.set_num(value);
+    label.set_num_unit(unit);
+  };
 
-    CHECK_CONDITION(entry.depth <= ABSL_ARRAYSIZE(entry.stack));
-    builder.InternCallstack(absl::MakeSpan(entry.stack, entry.depth), sample);
+  auto add_positive_label = [&](int key, int unit, size_t value) {
+    if (value <= 0) return;
+    add_label(key, unit, value);
+  };
 
-    sample.add_value(data.count);
-    sample.add_value(data.sum);
+  add_positive_label(ids.bytes, ids.bytes, entry.allocated_size);
+  add_positive_label(ids.request, ids.bytes, entry.requested_size);
+  add_positive_label(ids.alignment, ids.bytes, entry.requested_alignment);
+  add_positive_label(ids.size_returning, 0, entry.requested_size_returning);
+  // TODO(b/235916219): Remove these when we convert these from tags to sample
+  // types.
+  // If there is no issue getting the residency info, these two fields in
+  // `Profile::Sample` are populated so we add them to the proto.
+  if (data.sampled_resident_size.has_value()) {
+    add_label(ids.sampled_resident, ids.bytes,
+              data.sampled_resident_size.value());
+    add_label(ids.swapped, ids.bytes, data.swapped_size.value());
+  }
 
-    // add fields that are common to all memory profiles
-    auto add_label = [&](int key, int unit, size_t value) {
-      perftools::profiles::Label& label = *sample.add_label();
-      label.set_key(key);
-      label.set_num(value);
-      label.set_num_unit(unit);
-    };
+  auto add_access_label = [&](int key,
+                              tcmalloc::Profile::Sample::Access access) {
+    switch (access) {
+      case tcmalloc::Profile::Sample::Access::Hot: {
+        perftools::profiles::Label& access_label = *sample.add_label();
+        access_label.set_key(key);
+        access_label.set_str(ids.hot);
+        break;
+      }
+      case tcmalloc::Profile::Sample::Access::Cold: {
+        perftools::profiles::Label& access_label = *sample.add_label();
+        access_label.set_key(key);
+        access_label.set_str(ids.cold);
+        break;
+      }
+      default:
+        break;
+    }
+  };
 
-    auto add_positive_label = [&](int key, int unit, size_t value) {
-      if (value <= 0) return;
-      add_label(key, unit, value);
-    };
+  add_positive_label(ids.access_hint, 0,
+                     static_cast<uint8_t>(entry.access_hint));
+  add_access_label(ids.access_allocated, entry.access_allocated);
+  // The age label is the start of the sample's bucket, so that -tagfocus
+  // ranges select whole buckets.
+  if (entry.age_bucket >= 0) {
+    add_label(ids.age, ids.ms,
+              entry.age_bucket == 0 ? 0 : int64_t{1} << entry.age_bucket);
+  }
+}
 
-    add_positive_label(bytes_id, bytes_id, entry.allocated_size);
-    add_positive_label(request_id, bytes_id, entry.requested_size);
-    add_positive_label(alignment_id, bytes_id, entry.requested_alignment);
-    add_positive_label(size_returning_id, 0, entry.requested_size_returning);
-    // TODO(b/235916219): Remove these when we convert these from tags to sample
-    // types.
-    // If there is no issue getting the residency info, these two fields in
-    // `Profile::Sample` are populated so we add them to the proto.
-    if (data.sampled_resident_size.has_value()) {
-      add_label(sampled_resident_id, bytes_id,
-                data.sampled_resident_size.value());
-      add_label(swapped_id, bytes_id, data.swapped_size.value());
-    }
+// Samples StreamProfileProto() adds before flushing them.
+constexpr int kStreamFlushSamples = 256;
 
-    auto add_access_label = [&](int key,
-                                tcmalloc::Profile::Sample::Access access) {
-      switch (access) {
-        case tcmalloc::Profile::Sample::Access::Hot: {
-          perftools::profiles::Label& access_label = *sample.add_label();
-          access_label.set_key(key);
-          access_label.set_str(hot_id);
-          break;
-        }
-        case tcmalloc::Profile::Sample::Access::Cold: {
-          perftools::profiles::Label& access_label = *sample.add_label();
-          access_label.set_key(key);
-          access_label.set_str(cold_id);
-          break;
-        }
-        default:
-          break;
-      }
-    };
+}  // namespace
 
-    add_positive_label(access_hint_id, 0,
-                       static_cast<uint8_t>(entry.access_hint));
-    add_access_label(access_allocated_id, entry.access_allocated);
+absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
+    const ::tcmalloc::Profile& profile) {
+  ProfileBuilder builder;
+  ProfileStringIds ids;
+  if (absl::Status status = AddProfileHeader(profile, builder, ids);
+      !status.ok()) {
+    return status;
+  }
+
+  SampleMergedMap samples = MergeProfileSamples(profile);
+  for (const auto& [entry, data] : samples) {
+    AddSample(builder, ids, entry, data);
   }
 
   return std::move(builder).Finalize();
 }
 
+absl::Status StreamProfileProto(
+    const ::tcmalloc::Profile& profile,
+    google::protobuf::io::ZeroCopyOutputStream* output) {
+  ProfileBuilder builder;
+  ProfileStringIds ids;
+  if (absl::Status status = AddProfileHeader(profile, builder, ids);
+      !status.ok()) {
+    return status;
+  }
+
+  google::protobuf::io::CodedOutputStream coded(output);
+  builder.Flush(coded);
+
+  struct Slot {
+    bool used = false;
+    tcmalloc::Profile::Sample entry;
+    SampleMergedData data;
+  };
+  std::vector<Slot> slots(kStreamMergeSlots);
+  auto emit = [&](Slot& slot) {
+    AddSample(builder, ids, slot.entry, slot.data);
+    if (builder.profile().sample_size() >= kStreamFlushSamples) {
+      builder.Flush(coded);
+    }
+  };
+  profile.Iterate([&](const tcmalloc::Profile::Sample& entry) {
+    Slot& slot = slots[SampleHashWithSubFields()(entry) % kStreamMergeSlots];
+    if (slot.used && !SampleEqWithSubFields()(slot.entry, entry)) {
+      emit(slot);
+      slot.used = false;
+    }
+    if (!slot.used) {
+      slot.used = true;
+      slot.entry = entry;
+      slot.data = SampleMergedData();
+    }
+    MergeSample(entry, slot.data);
+  });
+  for (Slot& slot : slots) {
+    if (slot.used) emit(slot);
+  }
+  builder.Flush(coded);
+
+  coded.Trim();
+  if (coded.HadError()) {
+    return absl::InternalError("Failed to write the profile");
+  }
+  return absl::OkStatus();
+}
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -24,9 +24,12 @@
 #include <memory>
 #include <string>
 
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream.h"
 #include "tcmalloc/internal/profile.pb.h"
 #include "absl/container/btree_map.h"
 #include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
 #include "absl/types/span.h"
@@ -65,15 +68,30 @@ class ProfileBuilder {
   void InternCallstack(absl::Span<const void* const> stack,
                        perftools::profiles::Sample& sample);
 
+  // Writes what profile() holds so far to `output` and clears it, keeping
+  // the IDs already interned.  Serialized Profile messages concatenate into
+  // one whose repeated fields are appended, so flushing a profile in pieces
+  // yields the same profile as serializing it whole.
+  void Flush(google::protobuf::io::CodedOutputStream& output);
+
   std::unique_ptr<perftools::profiles::Profile> Finalize() &&;
 
  private:
+  struct MappingRange {
+    uintptr_t memory_limit;
+    int id;
+  };
+
   std::unique_ptr<perftools::profiles::Profile> profile_;
-  // mappings_ stores the start address of each mapping in profile_->mapping()
-  // to its index.
-  absl::btree_map<uintptr_t, int> mappings_;
+  // mappings_ stores the start address of each mapping to its limit and ID,
+  // which persist after Flush() drops profile_->mapping().
+  absl::btree_map<uintptr_t, MappingRange> mappings_;
   absl::flat_hash_map<std::string, int> strings_;
   absl::flat_hash_map<uintptr_t, int> locations_;
+  // Entries interned so far, flushed or not.
+  int num_strings_ = 1;
+  int num_locations_ = 0;
+  int num_mappings_ = 0;
 };
 
 extern const absl::string_view kProfileDropFrames;
@@ -81,6 +99,20 @@ extern const absl::string_view kProfileDropFrames;
 absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
     const ::tcmalloc::Profile& profile);
 
+// Number of merged samples StreamProfileProto() keeps at a time.
+inline constexpr size_t kStreamMergeSlots = 1024;
+
+// Encodes the same profile as MakeProfileProto() onto `output`, without
+// building the whole Profile message or merging all of the samples first.
+// Samples are merged through a table of kStreamMergeSlots entries, and one
+// evicted from it is emitted then; a stack evicted and seen again is emitted
+// as another sample, which pprof adds up.  The encoder holds the merge
+// table, the strings and locations interned so far and one chunk of samples
+// not yet written.
+absl::Status StreamProfileProto(
+    const ::tcmalloc::Profile& profile,
+    google::protobuf::io::ZeroCopyOutputStream* output);
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 
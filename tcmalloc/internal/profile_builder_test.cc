@@ -29,6 +29,8 @@
 #include "tcmalloc/internal/profile.pb.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
@@ -410,6 +412,119 @@ TEST(ProfileConverterTest, Profile) {
   EXPECT_EQ(converted.period(), 1);
 }
 
+// Sums the values of the samples of `profile` by their stacks of addresses.
+absl::flat_hash_map<std::vector<uint64_t>, std::vector<int64_t>> SumByStack(
+    const perftools::profiles::Profile& profile) {
+  absl::flat_hash_map<uint64_t, uint64_t> addresses;
+  for (const auto& location : profile.location()) {
+    EXPECT_TRUE(addresses.emplace(location.id(), location.address()).second);
+  }
+  absl::flat_hash_map<std::vector<uint64_t>, std::vector<int64_t>> sums;
+  for (const auto& sample : profile.sample()) {
+    std::vector<uint64_t> stack;
+    for (uint64_t id : sample.location_id()) {
+      EXPECT_TRUE(addresses.contains(id));
+      stack.push_back(addresses[id]);
+    }
+    std::vector<int64_t>& sum = sums[stack];
+    sum.resize(sample.value_size());
+    for (int i = 0; i < sample.value_size(); ++i) {
+      sum[i] += sample.value(i);
+    }
+  }
+  return sums;
+}
+
+TEST(ProfileConverterTest, Stream) {
+  // Enough stacks for the merge table to evict some and for the samples to
+  // be written in several chunks.
+  constexpr int kStacks = 3 * kStreamMergeSlots;
+
+  auto fake_profile = std::make_unique<FakeProfile>();
+  fake_profile->SetType(ProfileType::kEscapes);
+  fake_profile->SetDuration(absl::Milliseconds(10));
+  std::vector<Profile::Sample> samples;
+  for (int repeat = 0; repeat < 3; ++repeat) {
+    for (int i = 0; i < kStacks; ++i) {
+      Profile::Sample& sample = samples.emplace_back();
+      sample.sum = 16 * (i + 1);
+      sample.count = 1;
+      sample.escapes = i % 7;
+      sample.requested_size = 16;
+      sample.allocated_size = 16;
+      sample.depth = 2;
+      sample.stack[0] = absl::bit_cast<void*>(uintptr_t{0x1000} + i);
+      sample.stack[1] = reinterpret_cast<void*>(&RealPath);
+    }
+  }
+  fake_profile->SetSamples(std::move(samples));
+  Profile profile = ProfileAccessor::MakeProfile(std::move(fake_profile));
+
+  auto converted_or = MakeProfileProto(profile);
+  ASSERT_TRUE(converted_or.ok());
+  const auto& converted = **converted_or;
+
+  std::string encoded;
+  {
+    google::protobuf::io::StringOutputStream stream(&encoded);
+    ASSERT_TRUE(StreamProfileProto(profile, &stream).ok());
+  }
+  perftools::profiles::Profile streamed;
+  ASSERT_TRUE(streamed.ParseFromString(encoded));
+
+  EXPECT_EQ(streamed.string_table(0), "");
+  EXPECT_EQ(streamed.string_table(streamed.default_sample_type()), "escapes");
+  EXPECT_EQ(streamed.sample_type_size(), converted.sample_type_size());
+  EXPECT_EQ(streamed.mapping_size(), converted.mapping_size());
+  EXPECT_EQ(streamed.period(), converted.period());
+  EXPECT_EQ(streamed.duration_nanos(), converted.duration_nanos());
+  EXPECT_EQ(streamed.string_table(streamed.drop_frames()),
+            converted.string_table(converted.drop_frames()));
+  // Every stack is in the table once, however often it was emitted.
+  EXPECT_EQ(streamed.location_size(), converted.location_size());
+  EXPECT_EQ(converted.sample_size(), kStacks);
+  EXPECT_GE(streamed.sample_size(), kStacks);
+  EXPECT_EQ(SumByStack(streamed), SumByStack(converted));
+}
+
+TEST(ProfileConverterTest, AgeBuckets) {
+  auto fake_profile = std::make_unique<FakeProfile>();
+  fake_profile->SetType(ProfileType::kAges);
+  std::vector<Profile::Sample> samples;
+  // Two samples of the same stack in bucket 3 merge; the one in bucket 0
+  // stays apart.
+  for (int bucket : {3, 0, 3}) {
+    Profile::Sample& sample = samples.emplace_back();
+    sample.sum = 64;
+    sample.count = 2;
+    sample.requested_size = 32;
+    sample.allocated_size = 32;
+    sample.age_bucket = bucket;
+    sample.depth = 1;
+    sample.stack[0] = reinterpret_cast<void*>(&RealPath);
+  }
+  fake_profile->SetSamples(std::move(samples));
+  Profile profile = ProfileAccessor::MakeProfile(std::move(fake_profile));
+
+  auto converted_or = MakeProfileProto(profile);
+  ASSERT_TRUE(converted_or.ok());
+  const auto& converted = **converted_or;
+  EXPECT_EQ(converted.string_table(converted.default_sample_type()), "space");
+
+  absl::flat_hash_map<int64_t, int64_t> bytes_by_age;
+  for (const auto& sample : converted.sample()) {
+    int64_t age = -1;
+    for (const auto& label : sample.label()) {
+      if (converted.string_table(label.key()) != "age") continue;
+      EXPECT_EQ(converted.string_table(label.num_unit()), "ms");
+      age = label.num();
+    }
+    bytes_by_age[age] += sample.value(1);
+  }
+  EXPECT_THAT(bytes_by_age, testing::UnorderedElementsAre(
+                                testing::Pair(0, 64), testing::Pair(8, 128)));
+}
+
 TEST(BuildId, CorruptImage_b180635896) {
   std::string image_path;
   const char* srcdir = thread_safe_getenv("TEST_SRCDIR");
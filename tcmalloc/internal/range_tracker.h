@@ -28,6 +28,12 @@
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/optimization.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -89,6 +95,12 @@ class Bitmap {
   size_t FindValue(size_t index) const;
   template <bool Goal>
   ssize_t FindValueBackwards(size_t index) const;
+
+  // Returns the first word at or after `word` with a bit equal to Goal, or
+  // kWords if none.  Built with AVX2 it tests four words per compare, and
+  // two with NEON on AArch64.
+  template <bool Goal>
+  size_t FindWord(size_t word) const;
 };
 
 // Tracks allocations in a range of items of fixed size.  Supports
@@ -122,6 +134,24 @@ class RangeTracker {
   // Unmarks it andl also decrements the number of live allocations by
   // num_objects.
   void Unmark(size_t index, size_t n, size_t num_objects);
+
+  // Returns true if [index, index + n) lies within the tracker and is clear.
+  bool IsClear(size_t index, size_t n) const;
+
+  // REQUIRES: [index, index + n) was the returned value from a call to
+  // FindAndMark, and IsClear(index + n, more).
+  //
+  // Grows it by marking the `more` bits following it.  The count of live
+  // allocations does not change.
+  void Extend(size_t index, size_t n, size_t more);
+
+  // REQUIRES: [index, index + n) was the returned value from a call to
+  // FindAndMark, and fewer < n.
+  //
+  // Shrinks it by unmarking its last `fewer` bits.  The count of live
+  // allocations does not change.
+  void Truncate(size_t index, size_t n, size_t fewer);
+
   // If there is at least one free range at or after <start>,
   // put it in *index, *length and return true; else return false.
   bool NextFreeRange(size_t start, size_t* index, size_t* length) const;
@@ -260,6 +290,44 @@ inline void RangeTracker<N>::Unmark(size_t index, size_t n,
   }
 }
 
+template <size_t N>
+inline bool RangeTracker<N>::IsClear(size_t index, size_t n) const {
+  ASSERT(n > 0);
+  return index < N && n <= N - index && bits_.FindSet(index) >= index + n;
+}
+
+template <size_t N>
+inline void RangeTracker<N>::Extend(size_t index, size_t n, size_t more) {
+  ASSERT(IsClear(index + n, more));
+  bits_.SetRange(index + n, more);
+  nused_ += more;
+
+  // We may have shortened the longest free range; find it again.
+  size_t longest = 0;
+  size_t i = 0, len;
+  while (bits_.NextFreeRange(i, &i, &len)) {
+    longest = std::max(longest, len);
+    i += len;
+  }
+  longest_free_ = longest;
+}
+
+template <size_t N>
+inline void RangeTracker<N>::Truncate(size_t index, size_t n, size_t fewer) {
+  ASSERT(fewer > 0);
+  ASSERT(fewer < n);
+  ASSERT(bits_.FindClear(index) >= index + n);
+  index += n - fewer;
+  bits_.ClearRange(index, fewer);
+  nused_ -= fewer;
+
+  // As in Unmark(), the free range we just opened up joins the one after it.
+  const size_t lim = bits_.FindSet(index + fewer - 1);
+  if (lim - index > longest_free()) {
+    longest_free_ = lim - index;
+  }
+}
+
 // If there is at least one free range at or after <start>,
 // put it in *index, *length and return true; else return false.
 template <size_t N>
@@ -362,12 +430,7 @@ inline size_t Bitmap<N>::CountBits(size_t index, size_t n) const {
 
 template <size_t N>
 inline bool Bitmap<N>::IsZero() const {
-  for (int i = 0; i < kWords; ++i) {
-    if (bits_[i] != 0) {
-      return false;
-    }
-  }
-  return true;
+  return FindWord<true>(0) == kWords;
 }
 
 template <size_t N>
@@ -459,8 +522,8 @@ inline size_t Bitmap<N>::FindValue(size_t index) const {
   if (!Goal) here = ~here;
   size_t mask = ~static_cast<size_t>(0) << offset;
   here &= mask;
-  while (here == 0) {
-    ++word;
+  if (here == 0) {
+    word = FindWord<Goal>(word + 1);
     if (word >= kWords) {
       return N;
     }
@@ -503,6 +566,41 @@ inline ssize_t Bitmap<N>::FindValueBackwards(size_t index) const {
   return ret;
 }
 
+template <size_t N>
+template <bool Goal>
+inline size_t Bitmap<N>::FindWord(size_t word) const {
+  // The words to skip are all zero when looking for a set bit, and all ones
+  // when looking for a clear one.
+  constexpr size_t kSkip = Goal ? 0 : ~static_cast<size_t>(0);
+#if defined(__AVX2__)
+  if constexpr (kWordSize == 64 && kWords >= 4) {
+    const __m256i skip = _mm256_set1_epi64x(kSkip);
+    for (; word + 4 <= kWords; word += 4) {
+      const __m256i v = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(&bits_[word]));
+      const int skipped =
+          _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, skip)));
+      if (skipped != 0xf) return word + absl::countr_zero(~skipped & 0xfu);
+    }
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  if constexpr (kWordSize == 64 && kWords >= 2) {
+    const uint64x2_t skip = vdupq_n_u64(kSkip);
+    for (; word + 2 <= kWords; word += 2) {
+      const uint64x2_t skipped = vceqq_u64(vld1q_u64(
+          reinterpret_cast<const uint64_t*>(&bits_[word])), skip);
+      if (vminvq_u32(vreinterpretq_u32_u64(skipped)) == 0) {
+        return word + (vgetq_lane_u64(skipped, 0) != 0);
+      }
+    }
+  }
+#endif
+  for (; word < kWords; ++word) {
+    if (bits_[word] != kSkip) return word;
+  }
+  return kWords;
+}
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
@@ -113,6 +113,41 @@ BENCHMARK_TEMPLATE(BM_MarkUnmarkChunks, 64);
 BENCHMARK_TEMPLATE(BM_MarkUnmarkChunks, 256);
 BENCHMARK_TEMPLATE(BM_MarkUnmarkChunks, 256 * 32);
 
+// FindAndMark(K) on a hugepage's worth of pages, as HugePageFiller::TryGet()
+// places a span of K pages: about range(0) percent of the tracker is used,
+// in allocations of 1 to 8 pages, and the last K pages are free.  The search
+// skips the words of used pages, which builds with AVX2 or NEON compare
+// several at a time; run the same benchmark on a build with and without
+// -mavx2 for the speedup.
+template <size_t N, size_t K>
+static void BM_FindAndMarkFilled(benchmark::State& state) {
+  RangeTracker<N> range;
+  absl::BitGen rng;
+  const double free_share = 1 - state.range(0) / 100.0;
+  range.FindAndMark(N - K, N);
+  size_t index = 0;
+  while (index < N - K) {
+    const size_t len = std::min<size_t>(
+        absl::Uniform<int32_t>(rng, 0, 8) + 1, N - K - index);
+    if (absl::Bernoulli(rng, free_share)) range.Unmark(index, len, 1);
+    index += len;
+  }
+  for (auto s : state) {
+    const size_t i = range.FindAndMark(K, 1);
+    benchmark::DoNotOptimize(i);
+    range.Unmark(i, K, 1);
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_FindAndMarkFilled, 256, 1)->Arg(50)->Arg(90)->Arg(99);
+BENCHMARK_TEMPLATE(BM_FindAndMarkFilled, 256, 2)->Arg(50)->Arg(90)->Arg(99);
+BENCHMARK_TEMPLATE(BM_FindAndMarkFilled, 256, 4)->Arg(50)->Arg(90)->Arg(99);
+BENCHMARK_TEMPLATE(BM_FindAndMarkFilled, 256, 8)->Arg(50)->Arg(90)->Arg(99);
+BENCHMARK_TEMPLATE(BM_FindAndMarkFilled, 256, 16)->Arg(50)->Arg(90)->Arg(99);
+BENCHMARK_TEMPLATE(BM_FindAndMarkFilled, 512, 4)->Arg(50)->Arg(90)->Arg(99);
+
 template <size_t N>
 static void BM_FillOnes(benchmark::State& state) {
   RangeTracker<N> range;
@@ -250,6 +250,34 @@ TEST_F(BitmapTest, CountBitsFuzz) {
   }
 }
 
+// Sparse and dense maps make the searches skip whole words, which the vector
+// paths do several at a time.
+TEST_F(BitmapTest, FindFuzz) {
+  static constexpr size_t kBits = 1021;
+  absl::BitGen rng;
+  for (double p : {0.0, 0.01, 0.5, 0.99, 1.0}) {
+    SCOPED_TRACE(p);
+    absl::FixedArray<bool> truth(kBits);
+    Bitmap<kBits> map;
+    for (size_t i = 0; i < kBits; i++) {
+      truth[i] = absl::Bernoulli(rng, p);
+      if (truth[i]) map.SetBit(i);
+    }
+
+    size_t next_set = kBits, next_clear = kBits;
+    for (ssize_t i = kBits - 1; i >= 0; --i) {
+      if (truth[i]) {
+        next_set = i;
+      } else {
+        next_clear = i;
+      }
+      ASSERT_EQ(next_set, map.FindSet(i)) << i;
+      ASSERT_EQ(next_clear, map.FindClear(i)) << i;
+    }
+    EXPECT_EQ(map.IsZero(), next_set == kBits);
+  }
+}
+
 class RangeTrackerTest : public ::testing::Test {
  protected:
   std::vector<std::pair<size_t, size_t>> FreeRanges() {
@@ -294,6 +322,28 @@ TEST_F(RangeTrackerTest, Trivial) {
   EXPECT_EQ(range_.used(), range_.allocs());
 }
 
+TEST_F(RangeTrackerTest, ExtendAndTruncate) {
+  ASSERT_EQ(0, range_.FindAndMark(100, 1));
+  ASSERT_EQ(100, range_.FindAndMark(100, 1));
+  range_.Unmark(100, 100, 1);
+  EXPECT_THAT(FreeRanges(), ElementsAre(Pair(100, kBits - 100)));
+
+  EXPECT_TRUE(range_.IsClear(100, 50));
+  EXPECT_FALSE(range_.IsClear(50, 100));
+  EXPECT_FALSE(range_.IsClear(kBits - 10, 20));
+  range_.Extend(0, 100, 50);
+  EXPECT_EQ(150, range_.used());
+  EXPECT_EQ(1, range_.allocs());
+  EXPECT_EQ(kBits - 150, range_.longest_free());
+  EXPECT_THAT(FreeRanges(), ElementsAre(Pair(150, kBits - 150)));
+
+  range_.Truncate(0, 150, 120);
+  EXPECT_EQ(30, range_.used());
+  EXPECT_EQ(1, range_.allocs());
+  EXPECT_EQ(kBits - 30, range_.longest_free());
+  EXPECT_THAT(FreeRanges(), ElementsAre(Pair(30, kBits - 30)));
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -62,46 +62,22 @@ Residency::~Residency() {
   }
 }
 
-absl::StatusCode Residency::Seek(const uintptr_t vaddr) {
-  size_t offset = vaddr / kPageSize * kPagemapEntrySize;
-  // Note: lseek can't be interrupted.
-  off_t status = ::lseek(fd_, offset, SEEK_SET);
-  if (status != offset) {
-    return absl::StatusCode::kUnavailable;
-  }
-  return absl::StatusCode::kOk;
-}
-
-std::optional<uint64_t> Residency::ReadOne() {
-  static_assert(sizeof(buf_) >= kPagemapEntrySize);
+absl::StatusCode Residency::Read(const uintptr_t vaddr,
+                                 const int64_t num_pages) {
   // /proc/pid/pagemap is a sequence of 64-bit values in machine endianness, one
   // per page. The style guide really does not want me to do this "unsafe
   // conversion", but the conversion is done in reverse by the kernel and we
   // never persist it anywhere, so we actually do want this.
-  auto status = signal_safe_read(fd_, reinterpret_cast<char*>(buf_),
-                                 kPagemapEntrySize, nullptr);
-  if (status != kPagemapEntrySize) {
-    return std::nullopt;
-  }
-  return buf_[0];
-}
-
-absl::StatusCode Residency::ReadMany(int64_t num_pages, Residency::Info& info) {
-  while (num_pages > 0) {
-    const size_t batch_size = std::min<int64_t>(kEntriesInBuf, num_pages);
-    const size_t to_read = kPagemapEntrySize * batch_size;
-
-    // We read continuously. For the first read, this starts at wherever the
-    // first ReadOne ended. See above note for the reinterpret_cast.
-    auto status =
-        signal_safe_read(fd_, reinterpret_cast<char*>(buf_), to_read, nullptr);
-    if (status != to_read) {
-      return absl::StatusCode::kUnavailable;
-    }
-    for (int i = 0; i < batch_size; ++i) {
-      Update(buf_[i], kPageSize, info);
-    }
-    num_pages -= batch_size;
+  char* const buf = reinterpret_cast<char*>(buf_);
+  const size_t to_read = kPagemapEntrySize * num_pages;
+  off_t offset = vaddr / kPageSize * kPagemapEntrySize;
+  size_t total = 0;
+  while (total < to_read) {
+    const ssize_t rc = ::pread(fd_, buf + total, to_read - total, offset);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) return absl::StatusCode::kUnavailable;
+    total += rc;
+    offset += rc;
   }
   return absl::StatusCode::kOk;
 }
@@ -115,49 +91,30 @@ std::optional<Residency::Info> Residency::Get(const void* const addr,
   Residency::Info info;
   if (size == 0) return info;
 
-  uintptr_t uaddr = reinterpret_cast<uintptr_t>(addr);
+  const uintptr_t uaddr = reinterpret_cast<uintptr_t>(addr);
+  const uintptr_t uend = uaddr + size;
   // Round address down to get the start of the page containing the data.
-  uintptr_t basePage = uaddr & ~(kPageSize - 1);
+  uintptr_t page = uaddr & ~(kPageSize - 1);
   // Round end address up to get the end of the page containing the data.
-  // The data is in [basePage, endPage).
-  uintptr_t endPage = (uaddr + size + kPageSize - 1) & ~(kPageSize - 1);
-
-  int64_t remainingPages = (endPage - basePage) / kPageSize;
-
-  if (auto res = Seek(basePage); res != absl::StatusCode::kOk) {
-    return std::nullopt;
-  }
-
-  if (remainingPages == 1) {
-    auto res = ReadOne();
-    if (!res.has_value()) return std::nullopt;
-    Update(res.value(), size, info);
-    return info;
-  }
-
-  // Since the input address might not be page-aligned (it can possibly point to
-  // an arbitrary object), we read the information about the first page
-  // separately with ReadOne, then read the complete pages with ReadMany, and
-  // then read the last page with ReadOne again if needed.
-  auto res = ReadOne();
-  if (!res.has_value()) return std::nullopt;
-
-  // Handle the first page.
-  size_t firstPageSize = kPageSize - (uaddr - basePage);
-  Update(res.value(), firstPageSize, info);
-  remainingPages--;
-
-  // Handle all pages but the last page.
-  if (auto res = ReadMany(remainingPages - 1, info);
-      res != absl::StatusCode::kOk) {
-    return std::nullopt;
+  // The data is in [page, endPage).
+  const uintptr_t endPage = (uend + kPageSize - 1) & ~(kPageSize - 1);
+
+  int64_t remainingPages = (endPage - page) / kPageSize;
+  while (remainingPages > 0) {
+    const int64_t batch = std::min<int64_t>(kEntriesInBuf, remainingPages);
+    if (Read(page, batch) != absl::StatusCode::kOk) {
+      return std::nullopt;
+    }
+    // Since the input address might not be page-aligned (it can possibly
+    // point to an arbitrary object), the first and the last page count only
+    // for the part of them the range covers.
+    for (int64_t i = 0; i < batch; ++i, page += kPageSize) {
+      const uintptr_t lo = std::max(page, uaddr);
+      const uintptr_t hi = std::min(page + kPageSize, uend);
+      Update(buf_[i], hi - lo, info);
+    }
+    remainingPages -= batch;
   }
-
-  // Check final page
-  size_t lastPageSize = kPageSize - (endPage - uaddr - size);
-  res = ReadOne();
-  if (!res.has_value()) return std::nullopt;
-  Update(res.value(), lastPageSize, info);
   return info;
 }
 
@@ -55,17 +55,11 @@ class Residency {
   std::optional<Info> Get(const void* addr, size_t size);
 
  private:
-  // This helper seeks the internal file to the correct location for the given
-  // virtual address.
-  absl::StatusCode Seek(uintptr_t vaddr);
-  // This helper reads information for a single page. This is useful for the
-  // boundaries. It continues the read from the last Seek() or last Read
-  // operation.
-  std::optional<uint64_t> ReadOne();
-  // This helper reads information for `num_pages` worth of _full_ pages and
-  // puts the results into `info`. It continues the read from the last Seek() or
-  // last Read operation.
-  absl::StatusCode ReadMany(int64_t num_pages, Info& info);
+  // This helper reads the entries of `num_pages` pages, starting with the
+  // one at `vaddr`, into buf_ with a single pread, so a query costs one
+  // syscall per kEntriesInBuf pages rather than a seek and a read for each
+  // of its boundary pages and its middle.
+  absl::StatusCode Read(uintptr_t vaddr, int64_t num_pages);
 
   // For testing.
   friend class ResidencySpouse;
@@ -102,6 +102,38 @@ TEST(ResidenceTest, ThisProcess) {
   }
 }
 
+// A range read in several batches of pagemap entries adds up like one read
+// at once.
+TEST(ResidenceTest, ManyBatches) {
+  const size_t kPageSize = getpagesize();
+  const int kNumPages = 3 * 512 + 5;
+
+  Residency r;
+  void* p = mmap(nullptr, kNumPages * kPageSize, PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  ASSERT_NE(p, MAP_FAILED) << errno;
+  // Keep the untouched pages from being faulted in with a hugepage.
+  ASSERT_EQ(madvise(p, kNumPages * kPageSize, MADV_NOHUGEPAGE), 0) << errno;
+  char* c = static_cast<char*>(p);
+  // Touch every third page.
+  size_t touched = 0;
+  for (int i = 0; i < kNumPages; i += 3) {
+    c[i * kPageSize] = 1;
+    ++touched;
+  }
+  ::benchmark::DoNotOptimize(c);
+
+  EXPECT_THAT(r.Get(p, kNumPages * kPageSize),
+              Optional(FieldsAre(touched * kPageSize, 0)));
+  // The first page is touched and the last is not, so an unaligned range
+  // loses only the head of the first.
+  ASSERT_EQ((kNumPages - 1) % 3, 1);
+  EXPECT_THAT(r.Get(c + 7, (kNumPages - 1) * kPageSize),
+              Optional(FieldsAre(touched * kPageSize - 7, 0)));
+
+  ASSERT_EQ(munmap(p, kNumPages * kPageSize), 0);
+}
+
 TEST(ResidenceTest, CannotOpen) {
   ResidencySpouse r("/tmp/a667ba48-18ba-4523-a8a7-b49ece3a6c2b");
   EXPECT_FALSE(r.Get(nullptr, 1).has_value());
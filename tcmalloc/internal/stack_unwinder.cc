@@ -0,0 +1,134 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/stack_unwinder.h"
+
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/debugging/stacktrace.h"
+
+#ifdef __GLIBC__
+// Top of the main thread's stack, above the frames of main() and its callers.
+extern "C" void* __libc_stack_end;
+#endif
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+namespace {
+
+// Stack size assumed for the main thread when its limit is unlimited.
+constexpr uintptr_t kDefaultMainStackSize = uintptr_t{8} << 20;
+
+ABSL_CONST_INIT thread_local uintptr_t stack_lo = 0;
+ABSL_CONST_INIT thread_local uintptr_t stack_hi = 0;
+ABSL_CONST_INIT thread_local bool stack_looked_up = false;
+
+bool LookupStackBounds(uintptr_t* lo, uintptr_t* hi) {
+  if (syscall(SYS_gettid) == getpid()) {
+    // pthread_getattr_np() reads /proc/self/maps for the main thread.
+#ifdef __GLIBC__
+    struct rlimit limit;
+    uintptr_t size = kDefaultMainStackSize;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY) {
+      size = limit.rlim_cur;
+    }
+    *hi = reinterpret_cast<uintptr_t>(__libc_stack_end);
+    *lo = *hi > size ? *hi - size : 0;
+    return *hi != 0;
+#else
+    return false;
+#endif
+  }
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) return false;
+  void* addr;
+  size_t size;
+  const bool found = pthread_attr_getstack(&attr, &addr, &size) == 0;
+  pthread_attr_destroy(&attr);
+  if (!found) return false;
+  *lo = reinterpret_cast<uintptr_t>(addr);
+  *hi = *lo + size;
+  return true;
+}
+
+}  // namespace
+
+void InitThreadStackBounds() {
+  if (ABSL_PREDICT_TRUE(stack_looked_up)) return;
+  // Set first, so that an allocation made by the lookup that is sampled
+  // uses absl::GetStackTrace() instead of looking up again.
+  stack_looked_up = true;
+  uintptr_t lo, hi;
+  if (LookupStackBounds(&lo, &hi)) {
+    stack_lo = lo;
+    stack_hi = hi;
+  }
+}
+
+int UnwindFramePointers(const void* fp, uintptr_t lo, uintptr_t hi,
+                        void** result, int max_depth, int skip_count) {
+  // A frame holds the caller's frame pointer, then the return address.
+  constexpr uintptr_t kFrameSize = 2 * sizeof(void*);
+  uintptr_t frame = reinterpret_cast<uintptr_t>(fp);
+  int n = 0;
+  while (n < max_depth) {
+    if (frame % sizeof(void*) != 0 || frame < lo || hi - lo < kFrameSize ||
+        frame > hi - kFrameSize) {
+      break;
+    }
+    void* const* f = reinterpret_cast<void* const*>(frame);
+    if (f[1] == nullptr) break;
+    if (skip_count > 0) {
+      --skip_count;
+    } else {
+      result[n++] = f[1];
+    }
+    // Callers' frames are above their callees'.
+    const uintptr_t next = reinterpret_cast<uintptr_t>(f[0]);
+    if (next <= frame) break;
+    frame = next;
+  }
+  return n;
+}
+
+ABSL_ATTRIBUTE_NOINLINE int CaptureStackTrace(void** result, int max_depth,
+                                              int skip_count) {
+#if defined(FRAME_POINTER_UNWIND) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+  if (stack_hi != 0) {
+    // As for absl::GetStackTrace(), the first address stored is the return
+    // address of our caller's frame, so our own frame is skipped.
+    const int n =
+        UnwindFramePointers(__builtin_frame_address(0), stack_lo, stack_hi,
+                            result, max_depth, skip_count + 1);
+    // Nothing is found from a signal handler on an alternate stack.
+    if (n > 0) return n;
+  }
+#endif
+  const int n = absl::GetStackTrace(result, max_depth, skip_count + 1);
+  ABSL_BLOCK_TAIL_CALL_OPTIMIZATION();
+  return n;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
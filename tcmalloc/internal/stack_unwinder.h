@@ -0,0 +1,57 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Stack traces from the frame pointer chain (FRAME_POINTER_UNWIND).
+//
+// absl::GetStackTrace() may go through the generic unwinder, which reads the
+// unwind tables of every frame.  In builds with frame pointers the chain of
+// saved frame pointers gives the same return addresses for a fraction of the
+// cost.  The walk stops at the first frame outside the calling thread's
+// stack, so a frame built without a frame pointer ends the trace early
+// instead of sending it through arbitrary memory.
+
+#ifndef TCMALLOC_INTERNAL_STACK_UNWINDER_H_
+#define TCMALLOC_INTERNAL_STACK_UNWINDER_H_
+
+#include <stdint.h>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Looks up the bounds of the calling thread's stack, the first time it is
+// called on the thread.  pthread_getattr_np() may allocate, so this must not
+// be called under a lock that allocation may take.
+void InitThreadStackBounds();
+
+// Like absl::GetStackTrace(): stores up to max_depth return addresses of the
+// callers of CaptureStackTrace(), skipping the skip_count innermost ones, and
+// returns how many it stored.  With FRAME_POINTER_UNWIND, on threads whose
+// stack bounds InitThreadStackBounds() found, they are read off the frame
+// pointer chain; otherwise absl::GetStackTrace() is used.
+int CaptureStackTrace(void** result, int max_depth, int skip_count);
+
+// Walks the frame pointer chain from `fp` while it stays within [lo, hi) and
+// moves up the stack, storing the return address of every frame after the
+// first skip_count.  Returns how many were stored.  Exposed for testing.
+int UnwindFramePointers(const void* fp, uintptr_t lo, uintptr_t hi,
+                        void** result, int max_depth, int skip_count);
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_STACK_UNWINDER_H_
@@ -0,0 +1,115 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/stack_unwinder.h"
+
+#include <stdint.h>
+
+#include <thread>  // NOLINT(build/c++11)
+
+#include "gtest/gtest.h"
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// A fake stack of kFrames frames, each holding the address of the frame
+// above it and a made-up return address.
+constexpr int kFrames = 8;
+struct FakeStack {
+  void* words[2 * kFrames + 2];
+
+  FakeStack() {
+    for (int i = 0; i < kFrames; ++i) {
+      words[2 * i] = &words[2 * (i + 1)];
+      words[2 * i + 1] = reinterpret_cast<void*>(uintptr_t{0x1000} + i);
+    }
+    // The outermost frame ends the chain.
+    words[2 * kFrames] = nullptr;
+    words[2 * kFrames + 1] = nullptr;
+  }
+
+  uintptr_t lo() const { return reinterpret_cast<uintptr_t>(&words[0]); }
+  uintptr_t hi() const {
+    return reinterpret_cast<uintptr_t>(&words[2 * kFrames + 2]);
+  }
+};
+
+TEST(UnwindFramePointers, WalksChain) {
+  FakeStack s;
+  void* result[16];
+  ASSERT_EQ(UnwindFramePointers(&s.words[0], s.lo(), s.hi(), result, 16, 0),
+            kFrames);
+  for (int i = 0; i < kFrames; ++i) {
+    EXPECT_EQ(result[i], reinterpret_cast<void*>(uintptr_t{0x1000} + i));
+  }
+}
+
+TEST(UnwindFramePointers, SkipsAndTruncates) {
+  FakeStack s;
+  void* result[16];
+  ASSERT_EQ(UnwindFramePointers(&s.words[0], s.lo(), s.hi(), result, 3, 2),
+            3);
+  EXPECT_EQ(result[0], reinterpret_cast<void*>(uintptr_t{0x1002}));
+  EXPECT_EQ(result[2], reinterpret_cast<void*>(uintptr_t{0x1004}));
+}
+
+TEST(UnwindFramePointers, StopsOutsideBounds) {
+  FakeStack s;
+  void* result[16];
+  // Only the first three frames lie below hi.
+  const uintptr_t hi = reinterpret_cast<uintptr_t>(&s.words[6]);
+  EXPECT_EQ(UnwindFramePointers(&s.words[0], s.lo(), hi, result, 16, 0), 3);
+  EXPECT_EQ(UnwindFramePointers(&s.words[0], s.lo() + 1, s.hi(), result, 16,
+                                0),
+            0);
+}
+
+TEST(UnwindFramePointers, StopsOnDownwardLink) {
+  FakeStack s;
+  s.words[4] = &s.words[0];
+  void* result[16];
+  EXPECT_EQ(UnwindFramePointers(&s.words[0], s.lo(), s.hi(), result, 16, 0),
+            3);
+}
+
+ABSL_ATTRIBUTE_NOINLINE int Capture(void** result, int max_depth) {
+  const int n = CaptureStackTrace(result, max_depth, 0);
+  ABSL_BLOCK_TAIL_CALL_OPTIMIZATION();
+  return n;
+}
+
+void CaptureFindsCaller() {
+  InitThreadStackBounds();
+  void* result[64];
+  const int n = Capture(result, 64);
+  ASSERT_GT(n, 0);
+  // result[0] is the return address of Capture()'s frame, here.
+  const uintptr_t here = reinterpret_cast<uintptr_t>(&CaptureFindsCaller);
+  EXPECT_GT(reinterpret_cast<uintptr_t>(result[0]), here);
+  EXPECT_LT(reinterpret_cast<uintptr_t>(result[0]), here + 4096);
+}
+
+TEST(CaptureStackTrace, MainThread) { CaptureFindsCaller(); }
+
+TEST(CaptureStackTrace, OtherThread) {
+  std::thread t(CaptureFindsCaller);
+  t.join();
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -21,6 +21,7 @@
 #define TCMALLOC_INTERNAL_MALLOC_EXTENSION_H_
 
 #include <string>
+#include <vector>
 
 #include "absl/base/attributes.h"
 #include "absl/functional/function_ref.h"
@@ -80,6 +81,18 @@ ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetSkipSubreleaseInterval(
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetProperties(
     std::map<std::string, tcmalloc::MallocExtension::Property>* ret);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetStats(std::string* ret);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetThreadAllocationStats(
+    tcmalloc::MallocExtension::ThreadAllocationStats* stats);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetHeapPartitionStats(
+    int partition, tcmalloc::MallocExtension::HeapPartitionStats* stats);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetHeapPartitionLimit(
+    int partition, size_t bytes);
+ABSL_ATTRIBUTE_WEAK int MallocExtension_Internal_SetHeapPartition(
+    int partition);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetDeterministicMode(
+    bool enabled);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetStatsInPbtxtString(
+    std::string* ret);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetMaxPerCpuCacheSize(
     int32_t value);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetSkipSubreleaseInterval(
@@ -87,6 +100,7 @@ ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetSkipSubreleaseInterval(
 ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_ReleaseCpuMemory(int cpu);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_ReleaseMemoryToSystem(
     size_t bytes);
+ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_CompactHeap(size_t budget);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetMemoryLimit(
     const tcmalloc::MallocExtension::MemoryLimit* limit);
 
@@ -100,6 +114,13 @@ ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetProfileSamplingRate(
     int64_t);
 
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_ProcessBackgroundActions();
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_ProcessBackgroundEscapes();
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_ProcessBackgroundReleases();
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetProtectionReports(
+    std::vector<tcmalloc::MallocExtension::ProtectionReport>* ret);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_StartContinuousProfile(
+    tcmalloc::MallocExtension::ContinuousProfileSink sink);
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_StopContinuousProfile();
 
 ABSL_ATTRIBUTE_WEAK tcmalloc::MallocExtension::BytesPerSecond
 MallocExtension_Internal_GetBackgroundReleaseRate();
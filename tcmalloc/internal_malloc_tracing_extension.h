@@ -20,6 +20,7 @@
 #ifndef TCMALLOC_INTERNAL_MALLOC_TRACING_EXTENSION_H_
 #define TCMALLOC_INTERNAL_MALLOC_TRACING_EXTENSION_H_
 
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "tcmalloc/malloc_tracing_extension.h"
 
@@ -29,6 +30,23 @@ ABSL_ATTRIBUTE_WEAK
 absl::StatusOr<tcmalloc::malloc_tracing_extension::AllocatedAddressRanges>
 MallocTracingExtension_Internal_GetAllocatedAddressRanges();
 
+ABSL_ATTRIBUTE_WEAK absl::Status
+MallocTracingExtension_Internal_StartAllocationTrace(const char* path,
+                                                     size_t max_events);
+
+ABSL_ATTRIBUTE_WEAK absl::StatusOr<size_t>
+MallocTracingExtension_Internal_StopAllocationTrace();
+
+ABSL_ATTRIBUTE_WEAK absl::Status
+MallocTracingExtension_Internal_StartTraceCapture(int fd);
+
+ABSL_ATTRIBUTE_WEAK
+absl::StatusOr<tcmalloc::malloc_tracing_extension::TraceCaptureStats>
+MallocTracingExtension_Internal_StopTraceCapture();
+
+ABSL_ATTRIBUTE_WEAK absl::Status
+MallocTracingExtension_Internal_WriteCallSiteProfile(const char* path);
+
 #endif
 
 #endif  // TCMALLOC_INTERNAL_MALLOC_TRACING_EXTENSION_H_
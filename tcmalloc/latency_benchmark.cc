@@ -0,0 +1,205 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Latency distributions of malloc(), free(), __escape() and
+// __gep_check_boundary() under protection, where the averages of the other
+// benchmarks hide the calls that flush an escape buffer or poison a long
+// list of escapes.  Every benchmark runs the same churn: allocate an object,
+// escape it into a random slot, check it and free the object allocated
+// kLive iterations before.  One of the four calls is timed with the cycle
+// counter on every iteration, and p50, p99, p99.9 and the maximum of those
+// times are reported as counters, in nanoseconds.  range(1) selects whether
+// MallocExtension::ProcessBackgroundEscapes() runs, so the tails with and
+// without the background flusher can be compared.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "absl/base/call_once.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/numeric/bits.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/tcmalloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// A log-linear histogram in the manner of HdrHistogram: values below
+// 2^kSubBucketBits have a bucket each, and every power of two above is
+// split into 2^kSubBucketBits linear buckets, so a percentile is off by
+// less than 1/2^kSubBucketBits of its value.
+class LatencyHistogram {
+ public:
+  static constexpr int kSubBucketBits = 4;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  static constexpr int kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  void Record(uint64_t value) {
+    counts_[Index(value)]++;
+    total_++;
+    max_ = std::max(max_, value);
+  }
+
+  // The largest value of the bucket holding the p-th percentile, or the
+  // maximum if that is smaller.
+  uint64_t Percentile(double p) const {
+    const uint64_t rank = std::max<uint64_t>(1, total_ * p / 100.0 + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += counts_[i];
+      if (seen >= rank) return std::min(UpperBound(i), max_);
+    }
+    return max_;
+  }
+
+  uint64_t max() const { return max_; }
+
+ private:
+  static int Index(uint64_t value) {
+    if (value < kSubBuckets) return value;
+    const int shift = absl::bit_width(value) - 1 - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + (value >> shift) - kSubBuckets;
+  }
+
+  static uint64_t UpperBound(int index) {
+    if (index < kSubBuckets) return index;
+    const int shift = index / kSubBuckets - 1;
+    const uint64_t sub = index % kSubBuckets + kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  uint64_t counts_[kBuckets] = {};
+  uint64_t total_ = 0;
+  uint64_t max_ = 0;
+};
+
+enum class TimedCall { kMalloc, kFree, kEscape, kGepCheck };
+
+int64_t Now() { return absl::base_internal::CycleClock::Now(); }
+
+// Cycles two back-to-back reads of the cycle counter take, subtracted from
+// every timed call.
+int64_t TimerOverhead() {
+  static absl::once_flag once;
+  static int64_t overhead;
+  absl::call_once(once, [] {
+    overhead = INT64_MAX;
+    for (int i = 0; i < 1000; ++i) {
+      const int64_t start = Now();
+      overhead = std::min(overhead, Now() - start);
+    }
+  });
+  return overhead;
+}
+
+// Starts the background flusher the first time it is asked for; it cannot
+// be stopped, so turning it off makes threads commit inline again.
+void SetBackgroundFlush(bool enabled) {
+  static absl::once_flag once;
+  if (enabled) {
+    absl::call_once(once, [] {
+      std::thread(MallocExtension::ProcessBackgroundEscapes).detach();
+    });
+  }
+  Parameters::set_background_escape_flush(enabled);
+}
+
+void Report(benchmark::State& state, const LatencyHistogram& histogram) {
+  const double ns_per_cycle =
+      1e9 / absl::base_internal::CycleClock::Frequency();
+  state.counters["p50_ns"] = histogram.Percentile(50) * ns_per_cycle;
+  state.counters["p99_ns"] = histogram.Percentile(99) * ns_per_cycle;
+  state.counters["p99.9_ns"] = histogram.Percentile(99.9) * ns_per_cycle;
+  state.counters["max_ns"] = histogram.max() * ns_per_cycle;
+}
+
+template <TimedCall kCall>
+void BM_Latency(benchmark::State& state) {
+  constexpr size_t kLive = 1024;
+  constexpr size_t kSlots = 4096;
+  const size_t size = state.range(0);
+  SetBackgroundFlush(state.range(1) != 0);
+  const int64_t overhead = TimerOverhead();
+
+  std::vector<void*> live(kLive, nullptr);
+  std::vector<void*> slots(kSlots, nullptr);
+  LatencyHistogram histogram;
+  uint64_t rng = 1;
+  size_t next = 0;
+
+  auto timed = [&](TimedCall call, auto fn) {
+    if (call != kCall) {
+      fn();
+      return;
+    }
+    const int64_t start = Now();
+    fn();
+    const int64_t elapsed = Now() - start - overhead;
+    histogram.Record(std::max<int64_t>(elapsed, 0));
+  };
+
+  for (auto _ : state) {
+    char* p;
+    timed(TimedCall::kMalloc,
+          [&] { p = static_cast<char*>(malloc(size)); });
+
+    rng = rng * 6364136223846793005 + 1442695040888963407;
+    void** slot = &slots[(rng >> 33) % kSlots];
+    timed(TimedCall::kEscape, [&] { TCMallocInternalEscape(slot, p); });
+    *slot = p;
+
+    timed(TimedCall::kGepCheck, [&] {
+      benchmark::DoNotOptimize(
+          TCMallocInternalGepCheckBoundary(p, p + size - 1, 1));
+    });
+
+    void* old = live[next];
+    live[next] = p;
+    next = (next + 1) % kLive;
+    timed(TimedCall::kFree, [&] { free(old); });
+  }
+
+  for (void* p : live) free(p);
+  Parameters::set_background_escape_flush(false);
+  Report(state, histogram);
+}
+
+// Object sizes crossed with the background flusher off and on.
+void SizesAndBackground(benchmark::internal::Benchmark* b) {
+  for (int size : {16, 256, 4096, 65536}) {
+    for (int background : {0, 1}) {
+      b->Args({size, background});
+    }
+  }
+}
+
+BENCHMARK_TEMPLATE(BM_Latency, TimedCall::kMalloc)->Apply(SizesAndBackground);
+BENCHMARK_TEMPLATE(BM_Latency, TimedCall::kFree)->Apply(SizesAndBackground);
+BENCHMARK_TEMPLATE(BM_Latency, TimedCall::kEscape)->Apply(SizesAndBackground);
+BENCHMARK_TEMPLATE(BM_Latency, TimedCall::kGepCheck)
+    ->Apply(SizesAndBackground);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
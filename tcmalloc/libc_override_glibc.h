@@ -77,15 +77,102 @@ void *__strcpy_check(void *dst, void *src) noexcept
     TCMALLOC_ALIAS(TCMallocInternalStrcpyCheck);
 void *__strncpy_check(void *dst, void *src, size_t maxlen) noexcept
     TCMALLOC_ALIAS(TCMallocInternalStrncpyCheck);
+void *__memcpy_check(void *dst, const void *src, size_t n) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalMemcpyCheck);
+void *__memmove_check(void *dst, const void *src, size_t n) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalMemmoveCheck);
+void *__memset_check(void *dst, int c, size_t n) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalMemsetCheck);
+size_t __strlen_check(const void *s) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalStrlenCheck);
+size_t __strnlen_check(const void *s, size_t maxlen) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalStrnlenCheck);
+#ifdef FORTIFY_CHK
+// glibc's _FORTIFY_SOURCE entry points, bounded by the heap object as well.
+void* __memcpy_chk(void* dst, const void* src, size_t n,
+                   size_t destlen) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalMemcpyChk);
+void* __mempcpy_chk(void* dst, const void* src, size_t n,
+                    size_t destlen) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalMempcpyChk);
+void* __memmove_chk(void* dst, const void* src, size_t n,
+                    size_t destlen) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalMemmoveChk);
+void* __memset_chk(void* dst, int c, size_t n, size_t destlen) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalMemsetChk);
+char* __strcpy_chk(char* dst, const char* src, size_t destlen) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalStrcpyChk);
+char* __stpcpy_chk(char* dst, const char* src, size_t destlen) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalStpcpyChk);
+char* __strncpy_chk(char* dst, const char* src, size_t n,
+                    size_t destlen) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalStrncpyChk);
+char* __strcat_chk(char* dst, const char* src, size_t destlen) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalStrcatChk);
+char* __strncat_chk(char* dst, const char* src, size_t n,
+                    size_t destlen) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalStrncatChk);
+#endif
+size_t tcmalloc_remaining_bytes(const void* p) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalRemainingBytes);
+#ifdef EXTERNAL_REGIONS
+int tcmalloc_register_region(void* base, size_t len,
+                             size_t element_size) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalRegisterRegion);
+int tcmalloc_unregister_region(void* base, size_t len) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalUnregisterRegion);
+#endif
 int __inline_hook(size_t ***, unsigned int**) noexcept
     TCMALLOC_ALIAS(TCMallocInternalInlineHook);
+int __inline_check_layout(struct TCMallocInlineCheckLayout* layout) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalInlineCheckLayout);
+#ifdef LTO_ARCHIVE
+// The link-time inliner does not see through an alias, so the hooks
+// instrumented code calls most are plain functions that forward to the
+// allocator's, and inline into the caller with it.
+int __gep_check_boundary(void *base, void* ptr, size_t size) noexcept {
+  return TCMallocInternalGepCheckBoundary(base, ptr, size);
+}
+int __gep_check_boundary_range(void *base, void* ptr, size_t size) noexcept {
+  return TCMallocInternalGepCheckBoundaryRange(base, ptr, size);
+}
+#else
 int __gep_check_boundary(void *base, void* ptr, size_t size) noexcept
     TCMALLOC_ALIAS(TCMallocInternalGepCheckBoundary);
+int __gep_check_boundary_range(void *base, void* ptr, size_t size) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalGepCheckBoundaryRange);
+#endif
+int __gep_check_boundary_batch(void* const* bases, void* const* ptrs,
+                               size_t n) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalGepCheckBoundaryBatch);
+struct TCMallocChunkRange __chunk_range(const void* base) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalChunkRange);
+size_t __chunk_range_batch(const void* const* ptrs, size_t n,
+                           struct TCMallocChunkRange* out) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalChunkRangeBatch);
+#ifdef LTO_ARCHIVE
+int __bc_check_boundary(void *base, size_t size) noexcept {
+  return TCMallocInternalBcCheckBoundary(base, size);
+}
+
+int __escape(void** loc, void* ptr) noexcept {
+  return TCMallocInternalEscape(loc, ptr);
+}
+#else
 int __bc_check_boundary(void *base, size_t size) noexcept
     TCMALLOC_ALIAS(TCMallocInternalBcCheckBoundary);
 
 int __escape(void** loc, void* ptr) noexcept
     TCMALLOC_ALIAS(TCMallocInternalEscape);
+#endif
+int __escape_batch(void*** locs, void** ptrs, size_t n) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalEscapeBatch);
+int __escape_range(void* dst, const void* src, size_t len) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalEscapeRange);
+int __escape_store_release(void** loc, void* ptr) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalEscapeStoreRelease);
+void* __escape_cas(void** loc, void* expected, void* desired) noexcept
+    TCMALLOC_ALIAS(TCMallocInternalEscapeCAS);
 
 void __report_statistic() noexcept
     TCMALLOC_ALIAS(TCReportStatistic);
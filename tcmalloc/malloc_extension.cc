@@ -135,6 +135,62 @@ std::string MallocExtension::GetStats() {
   return ret;
 }
 
+std::string MallocExtension::GetStatsInPbtxt() {
+  std::string ret;
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetStatsInPbtxtString != nullptr) {
+    MallocExtension_Internal_GetStatsInPbtxtString(&ret);
+  }
+#endif
+  return ret;
+}
+
+MallocExtension::ThreadAllocationStats
+MallocExtension::GetThreadAllocationStats() {
+  ThreadAllocationStats stats;
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetThreadAllocationStats != nullptr) {
+    MallocExtension_Internal_GetThreadAllocationStats(&stats);
+  }
+#endif
+  return stats;
+}
+
+MallocExtension::HeapPartitionStats MallocExtension::GetHeapPartitionStats(
+    int partition) {
+  HeapPartitionStats stats;
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetHeapPartitionStats != nullptr) {
+    MallocExtension_Internal_GetHeapPartitionStats(partition, &stats);
+  }
+#endif
+  return stats;
+}
+
+void MallocExtension::SetHeapPartitionLimit(int partition, size_t bytes) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SetHeapPartitionLimit != nullptr) {
+    MallocExtension_Internal_SetHeapPartitionLimit(partition, bytes);
+  }
+#endif
+}
+
+ScopedHeapPartition::ScopedHeapPartition(int partition) : previous_(0) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SetHeapPartition != nullptr) {
+    previous_ = MallocExtension_Internal_SetHeapPartition(partition);
+  }
+#endif
+}
+
+ScopedHeapPartition::~ScopedHeapPartition() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SetHeapPartition != nullptr) {
+    MallocExtension_Internal_SetHeapPartition(previous_);
+  }
+#endif
+}
+
 void MallocExtension::ReleaseMemoryToSystem(size_t num_bytes) {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (&MallocExtension_Internal_ReleaseMemoryToSystem != nullptr) {
@@ -143,6 +199,15 @@ void MallocExtension::ReleaseMemoryToSystem(size_t num_bytes) {
 #endif
 }
 
+size_t MallocExtension::CompactHeap(size_t budget) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_CompactHeap != nullptr) {
+    return MallocExtension_Internal_CompactHeap(budget);
+  }
+#endif
+  return 0;
+}
+
 AddressRegionFactory* MallocExtension::GetRegionFactory() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (&MallocExtension_Internal_GetRegionFactory == nullptr) {
@@ -434,6 +499,129 @@ void MallocExtension::ProcessBackgroundActions() {
 #endif
 }
 
+void MallocExtension::ProcessBackgroundEscapes() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_ProcessBackgroundEscapes != nullptr) {
+    MallocExtension_Internal_ProcessBackgroundEscapes();
+  }
+#endif
+}
+
+void MallocExtension::ProcessBackgroundReleases() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_ProcessBackgroundReleases != nullptr) {
+    MallocExtension_Internal_ProcessBackgroundReleases();
+  }
+#endif
+}
+
+std::vector<MallocExtension::ProtectionReport>
+MallocExtension::GetProtectionReports() {
+  std::vector<ProtectionReport> ret;
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetProtectionReports != nullptr) {
+    MallocExtension_Internal_GetProtectionReports(&ret);
+  }
+#endif
+  return ret;
+}
+
+void MallocExtension::StartContinuousProfile(ContinuousProfileSink sink) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_StartContinuousProfile != nullptr) {
+    MallocExtension_Internal_StartContinuousProfile(std::move(sink));
+  }
+#endif
+}
+
+void MallocExtension::StopContinuousProfile() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_StopContinuousProfile != nullptr) {
+    MallocExtension_Internal_StopContinuousProfile();
+  }
+#endif
+}
+
+MallocExtension::ProtectionPolicy MallocExtension::GetProtectionPolicy() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&TCMalloc_Internal_GetProtectionPolicy != nullptr) {
+    return static_cast<ProtectionPolicy>(
+        TCMalloc_Internal_GetProtectionPolicy());
+  }
+#endif
+  return ProtectionPolicy::kDisabled;
+}
+
+void MallocExtension::SetProtectionPolicy(ProtectionPolicy policy) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&TCMalloc_Internal_SetProtectionPolicy != nullptr) {
+    TCMalloc_Internal_SetProtectionPolicy(static_cast<int>(policy));
+  }
+#endif
+}
+
+int64_t MallocExtension::GetProtectionSamplePeriod() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&TCMalloc_Internal_GetProtectionSamplePeriod != nullptr) {
+    return TCMalloc_Internal_GetProtectionSamplePeriod();
+  }
+#endif
+  return 1;
+}
+
+void MallocExtension::SetProtectionSamplePeriod(int64_t period) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&TCMalloc_Internal_SetProtectionSamplePeriod != nullptr) {
+    TCMalloc_Internal_SetProtectionSamplePeriod(period);
+  }
+#endif
+}
+
+bool MallocExtension::GetDeterministicMode() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&TCMalloc_Internal_GetDeterministicModeEnabled != nullptr) {
+    return TCMalloc_Internal_GetDeterministicModeEnabled();
+  }
+#endif
+  return false;
+}
+
+void MallocExtension::SetDeterministicMode(bool enabled) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SetDeterministicMode != nullptr) {
+    MallocExtension_Internal_SetDeterministicMode(enabled);
+  }
+#endif
+  (void)enabled;
+}
+
+double MallocExtension::GetSamplingCpuBudget() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&TCMalloc_Internal_GetSamplingCpuBudget != nullptr) {
+    return TCMalloc_Internal_GetSamplingCpuBudget();
+  }
+#endif
+  return 0;
+}
+
+void MallocExtension::SetSamplingCpuBudget(double fraction) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&TCMalloc_Internal_SetSamplingCpuBudget != nullptr) {
+    TCMalloc_Internal_SetSamplingCpuBudget(fraction);
+  }
+#endif
+  (void)fraction;
+}
+
+int64_t MallocExtension::GetEffectiveProfileSamplingRate() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&TCMalloc_Internal_GetEffectiveProfileSamplingRate != nullptr) {
+    return TCMalloc_Internal_GetEffectiveProfileSamplingRate();
+  }
+#endif
+  return GetProfileSamplingRate();
+}
+
 bool MallocExtension::NeedsProcessBackgroundActions() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   return &MallocExtension_Internal_ProcessBackgroundActions != nullptr;
@@ -477,6 +665,25 @@ ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE void sdallocx(void* ptr, size_t,
   free(ptr);
 }
 
+ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE size_t
+tcmalloc_malloc_batch(size_t size, void** out, size_t n) noexcept {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = malloc(size);
+    if (out[i] == nullptr) return i;
+  }
+  return n;
+}
+
+ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE void tcmalloc_free_batch(
+    void* const* ptrs, size_t n) noexcept {
+  for (size_t i = 0; i < n; ++i) {
+    free(ptrs[i]);
+  }
+}
+
+ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE void tcmalloc_prefetch_alloc(
+    size_t) noexcept {}
+
 ABSL_ATTRIBUTE_WEAK ABSL_ATTRIBUTE_NOINLINE tcmalloc::sized_ptr_t
 tcmalloc_size_returning_operator_new(size_t size) {
   return {::operator new(size), size};
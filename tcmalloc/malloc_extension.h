@@ -57,6 +57,16 @@ namespace tcmalloc {
 // as is.
 using ::hot_cold_t;
 
+// Tags an operator new whose object holds no pointers, such as a string or
+// an I/O buffer, and is never the object of a tracked pointer.  Under
+// protection it comes from spans that keep no escape metadata: pointers into
+// it are not tracked, so a dangling one is not poisoned when it is freed.
+// Without POINTER_FREE_CLASSES the tag is ignored.
+struct pointer_free_t {
+  explicit pointer_free_t() = default;
+};
+inline constexpr pointer_free_t pointer_free{};
+
 }  // namespace tcmalloc
 
 namespace tcmalloc {
@@ -82,6 +92,15 @@ enum class ProfileType {
   // the profile was terminated with Stop().
   kAllocations,
 
+  // Sample of live objects with the escapes (heap locations pointing into
+  // them) currently recorded for them, which free() has to poison.  Objects
+  // without escapes are left out.
+  kEscapes,
+
+  // Sample of live objects, bucketed by their age when the profile was taken
+  // (see Profile::Sample::age_bucket).
+  kAges,
+
   // Only present to prevent switch statements without a default clause so that
   // we can extend this enumeration without breaking code.
   kDoNotUse,
@@ -107,6 +126,16 @@ class Profile final {
     // number of objects is the quotient of weight (number of bytes requested
     // between previous and current samples) divided by the requested size.
     int64_t count;
+    // The escapes recorded for the sampled objects, multiplied by count like
+    // sum.  Only kEscapes profiles set it.
+    int64_t escapes = 0;
+
+    // Log2 bucket of the age of the sampled objects when the profile was
+    // taken: bucket b holds ages in [2^b, 2^(b+1)) ms, with bucket 0 taking
+    // every age below 2 ms and the last bucket every age from about 18.6
+    // hours on, past a day.  Only kAges profiles set it; -1 otherwise.
+    static constexpr int kNumAgeBuckets = 27;
+    int age_bucket = -1;
 
     size_t requested_size;
     size_t requested_alignment;
@@ -231,6 +260,11 @@ class MallocExtension final {
   // statistics.
   static std::string GetStats();
 
+  // Gets the same statistics, together with every protection counter this
+  // build keeps, as a text protocol buffer.  Field names are stable, so
+  // collectors should read this rather than parse GetStats().
+  static std::string GetStatsInPbtxt();
+
   // -------------------------------------------------------------------
   // Control operations for getting malloc implementation specific parameters.
   // Some currently useful properties:
@@ -273,6 +307,18 @@ class MallocExtension final {
   //
   //  "tcmalloc.per_cpu_caches_active"
   //      Whether tcmalloc is using per-CPU caches (1 or 0 respectively).
+  //
+  // safe_tcmalloc
+  // -------------
+  // "safe_tcmalloc.escape_metadata_bytes"
+  //      Number of bytes in escape tables, escape chunks, escape buffers
+  //      and the escape filter.  Included in tcmalloc.metadata_bytes.
+  // "safe_tcmalloc.metadata_hugepage_backed_bytes"
+  //      Number of bytes of metadata in huge page aligned regions advised
+  //      onto huge pages (ESCAPE_HUGEPAGE_METADATA, PAGEMAP_HUGE_LEAVES).
+  // "safe_tcmalloc.stats_page_fd"
+  //      File descriptor of the shared stats page (STATS_PAGE, see
+  //      tcmalloc/stats_page.h), once the background thread set it up.
   // -------------------------------------------------------------------
 
   // Gets the named property's value or a nullopt if the property is not valid.
@@ -334,6 +380,24 @@ class MallocExtension final {
   //   back in.
   static void ReleaseMemoryToSystem(size_t num_bytes);
 
+  // Moves live objects out of the sparsest spans of each size class into the
+  // free objects of its other spans, until about budget bytes of objects
+  // have moved, so that the spans left empty go back to the page heap, to be
+  // released by ReleaseMemoryToSystem() or the background thread.  Every
+  // escaped location pointing into a moved object is rewritten to point at
+  // its new address, as are the escapes the object itself made.  Returns the
+  // bytes of the spans freed.
+  //
+  // Only a build with HEAP_COMPACTION moves anything; others return 0.  The
+  // caller must ensure that no other thread allocates, frees or escapes while
+  // this runs, that those threads have flushed the escapes they staged, and
+  // that every pointer into the heap the program still uses is at a tracked
+  // location: none may be held on a stack, in a register or in a global.
+  // Objects still quarantined, and those of spans too large for an escape
+  // table, are not moved.  The per-CPU, transfer and quarantine caches are
+  // emptied first, which the next allocations pay for.
+  static size_t CompactHeap(size_t budget);
+
   struct MemoryLimit {
     // Make a best effort attempt to prevent more than limit bytes of memory
     // from being allocated by the system. In particular, if satisfying a given
@@ -451,6 +515,17 @@ class MallocExtension final {
   //  tcmalloc.metadata_bytes      -- Used by internal data structures
   //  tcmalloc.thread_cache_count  -- Number of thread caches in use
   //  tcmalloc.experiment.NAME     -- Experiment NAME is running if 1
+  //
+  // Protection specific properties
+  //  safe_tcmalloc.escape_metadata_bytes -- Bytes of escape tracking metadata
+  //  safe_tcmalloc.metadata_hugepage_backed_bytes -- Metadata on huge pages
+  //  safe_tcmalloc.escape_tables  -- Number of span escape tables in use
+  //  safe_tcmalloc.escape_table_bytes -- Bytes of escape tables, free or not
+  //  safe_tcmalloc.escape_chunks  -- Number of escape chain chunks in use
+  //  safe_tcmalloc.escape_chunks_free -- Backed escape chunks not in use
+  //  safe_tcmalloc.escape_buffers -- Number of per-thread escape buffers
+  //  safe_tcmalloc.escape_*_count -- Escapes recorded (ENABLE_STATISTIC)
+  //  safe_tcmalloc.check_*_count  -- Bounds checks run (ENABLE_STATISTIC)
   static std::map<std::string, Property> GetProperties();
 
   static Profile SnapshotCurrent(tcmalloc::ProfileType type);
@@ -496,6 +571,178 @@ class MallocExtension final {
   // When linked against TCMalloc, this method does not return.
   static void ProcessBackgroundActions();
 
+  // Commits the escape buffers of application threads off of their critical
+  // path.  While this runs, a thread whose escape buffer fills up hands it to
+  // this thread instead of committing it inline; free() still commits any
+  // handed-off buffers before it poisons.  With FREE_QUARANTINE it also
+  // poisons and releases quarantined objects, with REMOTE_FREE_QUEUE the
+  // objects queued for their home CPUs, and with LARGE_FREE_OFFLOAD it
+  // completes the frees of large objects.  Run it on its own thread,
+  // separate from ProcessBackgroundActions().
+  //
+  // When linked against TCMalloc, this method does not return.
+  static void ProcessBackgroundEscapes();
+
+  // Returns hugepages freed by the application to the system off of its
+  // critical path.  While this runs, a free() that pushes the hugepage cache
+  // over its limit queues the evicted hugepages instead of unbacking them;
+  // this thread unbacks the queue every few milliseconds, one call per
+  // contiguous range, and an allocation may take a queued hugepage back
+  // before then.  Run it on its own thread, separate from
+  // ProcessBackgroundActions().
+  //
+  // When linked against TCMalloc, this method does not return.
+  static void ProcessBackgroundReleases();
+
+  // A memory safety error found by the protection checks of a build that
+  // reports errors without crashing.  Errors are aggregated by call site and
+  // kind; only the first occurrence at a site is described.
+  struct ProtectionReport {
+    enum class Kind { kOutOfBounds = 0, kUseAfterFree, kInvalidFree };
+
+    Kind kind = Kind::kOutOfBounds;
+    // Return address of the check or free() that found the error.
+    void* call_site = nullptr;
+    // Symbol of call_site, empty if it could not be symbolized.
+    std::string symbol;
+    // Message and values (address first) of the first occurrence.
+    std::string description;
+    // Number of occurrences so far.
+    uint64_t count = 0;
+  };
+
+  // Returns the errors reported so far, one per call site and kind.  The same
+  // errors are logged by ProcessBackgroundActions() as they come in.  Empty
+  // unless linked against TCMalloc built with ENABLE_ERROR_REPORT and run with
+  // a policy other than ProtectionPolicy::kCrash.
+  static std::vector<ProtectionReport> GetProtectionReports();
+
+  // One interval of the continuous allocation profile: what the sampled
+  // allocations and frees of the interval add up to, per allocation stack.
+  struct ContinuousProfile {
+    struct Entry {
+      // Hash of the allocation stack, the same in every interval.
+      uint64_t stack_id = 0;
+      std::vector<void*> stack;
+      // Estimated allocations and frees of objects allocated from the stack,
+      // and their requested bytes.  Frees are counted under the stack that
+      // allocated the object, whichever interval that was in.
+      double allocs = 0;
+      double frees = 0;
+      double alloc_bytes = 0;
+      double free_bytes = 0;
+      // Escapes recorded into the stack's live sampled objects at the end of
+      // the interval.  Always 0 without ENABLE_PROTECTION.
+      uint64_t escapes = 0;
+    };
+
+    absl::Time start;
+    absl::Duration duration;
+    std::vector<Entry> entries;
+    // Samples of stacks that found no room in the interval's table.
+    uint64_t dropped = 0;
+  };
+  using ContinuousProfileSink = std::function<void(const ContinuousProfile&)>;
+
+  // Hands `sink` one ContinuousProfile a second, from the background thread
+  // (see ProcessBackgroundActions()), until StopContinuousProfile().  A later
+  // call replaces the sink.  Does nothing unless linked against TCMalloc
+  // built with CONTINUOUS_PROFILE.  The sink runs under the profile's lock
+  // and must not call either function itself.
+  static void StartContinuousProfile(ContinuousProfileSink sink);
+  static void StopContinuousProfile();
+
+  // What the calling thread has allocated and freed since it started.
+  // Bytes are the capacity of each object, as nallocx() would report it.  A
+  // free that protection quarantines or turns away may count without its
+  // bytes.  Escapes and checks are only counted under ENABLE_PROTECTION.  All
+  // 0 unless linked against TCMalloc built with THREAD_ALLOCATION_STATS.
+  //
+  // Take the difference of two calls to attribute a span of work, such as a
+  // request, to the thread that ran it.
+  struct ThreadAllocationStats {
+    uint64_t allocations = 0;
+    uint64_t allocated_bytes = 0;
+    uint64_t frees = 0;
+    uint64_t freed_bytes = 0;
+    uint64_t escapes = 0;
+    uint64_t checks = 0;
+  };
+  static ThreadAllocationStats GetThreadAllocationStats();
+
+  // Heap partitions attribute and bound the page allocations, those of more
+  // than kMaxSize bytes, made by threads inside a ScopedHeapPartition.
+  // Partition 0 holds every other thread's.  Small objects come from caches
+  // shared by all partitions and are neither counted nor limited.  All 0,
+  // and limits ignored, unless linked against TCMalloc built with
+  // HEAP_PARTITIONS.
+  static constexpr int kMaxHeapPartitions = 16;
+  struct HeapPartitionStats {
+    // Bytes of the partition's live page allocations, and their high mark.
+    size_t allocated_bytes = 0;
+    size_t peak_bytes = 0;
+    // 0 if unlimited.
+    size_t limit_bytes = 0;
+    // Allocations refused because of the limit.
+    uint64_t failed_allocations = 0;
+  };
+  static HeapPartitionStats GetHeapPartitionStats(int partition);
+
+  // A page allocation that would take `partition` past `bytes` fails like one
+  // the system refused: malloc() returns nullptr and operator new throws.  0
+  // lifts the limit.
+  static void SetHeapPartitionLimit(int partition, size_t bytes);
+
+  // What the protection checks do.  The default is kCrash in builds with
+  // CRASH_ON_CORRUPTION and kReportOnly otherwise; the
+  // TCMALLOC_PROTECTION_POLICY environment variable (crash, report, sampled or
+  // disabled) overrides it at startup, except that setuid and other AT_SECURE
+  // processes ignore values weaker than the default.  Checks inlined into instrumented code
+  // always run.
+  enum class ProtectionPolicy {
+    // Log each error with a stack trace and abort.  Escaped pointers to freed
+    // objects are poisoned, so that dereferencing them faults.
+    kCrash = 0,
+    // Report errors (see GetProtectionReports()) and carry on.  Escaped
+    // pointers to freed objects are left as they are.
+    kReportOnly,
+    // Like kReportOnly, but each thread runs only one in
+    // GetProtectionSamplePeriod() checks on average, at random intervals.
+    // The invalid checks found are scaled up by the interval in the
+    // "Invalid checks (estimated)" statistic.  Escapes are still all recorded.
+    kSampled,
+    // Skip the checks and do not record escapes.
+    kDisabled,
+  };
+  static ProtectionPolicy GetProtectionPolicy();
+  static void SetProtectionPolicy(ProtectionPolicy policy);
+
+  // Period of the checks under ProtectionPolicy::kSampled, also set with
+  // TCMALLOC_PROTECTION_SAMPLE_PERIOD.  Defaults to 100.
+  static int64_t GetProtectionSamplePeriod();
+  static void SetProtectionSamplePeriod(int64_t period);
+
+  // Deterministic mode, for allocator benchmarks, in builds with
+  // DETERMINISTIC_MODE.  While it is on, ProcessBackgroundActions() releases,
+  // shuffles, reclaims and resizes nothing, the calling thread and samplers
+  // started afterwards draw their sampling points from fixed seeds, and the
+  // thread that turned it on stays on the CPU it ran on until it is turned
+  // off.  SetProfileSamplingRate(0) turns sampling off altogether.
+  // TCMALLOC_DETERMINISTIC=1 (or nosample, for both) turns it on at startup.
+  static bool GetDeterministicMode();
+  static void SetDeterministicMode(bool enabled);
+
+  // Share of the CPU of the process that sampling allocations for the heap
+  // profiles may take, in builds with SAMPLING_AUTOTUNE.  While they take
+  // more, the background thread samples less often than
+  // GetProfileSamplingRate(); GetEffectiveProfileSamplingRate() is the rate
+  // in effect.  Samples are weighted by the rate they were taken at, so
+  // profiles stay unbiased.  Defaults to 0.01; 0 or less keeps the
+  // configured rate.
+  static double GetSamplingCpuBudget();
+  static void SetSamplingCpuBudget(double fraction);
+  static int64_t GetEffectiveProfileSamplingRate();
+
   // Return true if ProcessBackgroundActions should be called on this platform.
   // Not all platforms need/support background actions. As of 2021 this
   // includes Apple and Emscripten.
@@ -514,6 +761,22 @@ class MallocExtension final {
   static void SetBackgroundReleaseRate(BytesPerSecond rate);
 };
 
+// Puts the calling thread in heap partition `partition` (see
+// MallocExtension::GetHeapPartitionStats()) until destroyed, then back in the
+// one it was in.  Memory stays charged to the partition it was allocated in,
+// whichever thread frees it.  Ids out of range mean partition 0.
+class ScopedHeapPartition {
+ public:
+  explicit ScopedHeapPartition(int partition);
+  ~ScopedHeapPartition();
+
+  ScopedHeapPartition(const ScopedHeapPartition&) = delete;
+  ScopedHeapPartition& operator=(const ScopedHeapPartition&) = delete;
+
+ private:
+  int previous_;
+};
+
 }  // namespace tcmalloc
 
 // The nallocx function allocates no memory, but it performs the same size
@@ -602,6 +865,31 @@ tcmalloc_size_returning_operator_new_aligned_hot_cold_nothrow(
 
 }  // extern "C"
 
+// Allocates n objects of `size` bytes each, like n calls to malloc(size), and
+// stores them in out[0, n).  Returns the number of objects allocated, which
+// is less than n only if memory ran out; out[ret, n) is then left unset.
+// Small batches are taken from the per-CPU cache in one step.
+//
+// The default weak implementation calls malloc() n times.
+extern "C" size_t tcmalloc_malloc_batch(size_t size, void** out,
+                                        size_t n) noexcept;
+
+// Frees ptrs[0, n), like n calls to free().  The pointers may be of any sizes
+// and come from any allocation function that free() accepts; runs of
+// pointers of the same size class are returned to the per-CPU cache together.
+//
+// The default weak implementation calls free() n times.
+extern "C" void tcmalloc_free_batch(void* const* ptrs, size_t n) noexcept;
+
+// Hints that allocations of `size` bytes are about to follow, for callers
+// that know a burst is coming.  The first few objects the current CPU's cache
+// would hand out for the size are prefetched for write, and with
+// ENABLE_PROTECTION the escape table entries their first escapes update.
+// Nothing is allocated; sizes without a size class are ignored.
+//
+// The default weak implementation does nothing.
+extern "C" void tcmalloc_prefetch_alloc(size_t size) noexcept;
+
 #ifndef MALLOCX_LG_ALIGN
 #define MALLOCX_LG_ALIGN(la) (la)
 #endif
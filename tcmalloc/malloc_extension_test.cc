@@ -16,7 +16,10 @@
 
 #include "tcmalloc/malloc_extension.h"
 
+#include <sched.h>
+
 #include <optional>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -40,6 +43,22 @@ class CpuCachePeer {
 
 namespace {
 
+TEST(MallocExtension, ProtectionPolicy) {
+  const MallocExtension::ProtectionPolicy policy =
+      MallocExtension::GetProtectionPolicy();
+  const int64_t period = MallocExtension::GetProtectionSamplePeriod();
+
+  MallocExtension::SetProtectionPolicy(
+      MallocExtension::ProtectionPolicy::kSampled);
+  MallocExtension::SetProtectionSamplePeriod(7);
+  EXPECT_EQ(MallocExtension::GetProtectionPolicy(),
+            MallocExtension::ProtectionPolicy::kSampled);
+  EXPECT_EQ(MallocExtension::GetProtectionSamplePeriod(), 7);
+
+  MallocExtension::SetProtectionPolicy(policy);
+  MallocExtension::SetProtectionSamplePeriod(period);
+}
+
 TEST(MallocExtension, BackgroundReleaseRate) {
 
   // Mutate via MallocExtension.
@@ -140,6 +159,79 @@ TEST(MallocExtension, DynamicSlabMallocMetadata) {
       testing::Field(&MallocExtension::Property::value, testing::Gt(0)));
 }
 
+#ifdef ENABLE_ERROR_REPORT
+extern "C" void TCReportError() noexcept;
+
+// Test that repeated errors at one call site are folded into one report.
+TEST(MallocExtension, ProtectionReports) {
+  const MallocExtension::ProtectionPolicy policy =
+      MallocExtension::GetProtectionPolicy();
+  MallocExtension::SetProtectionPolicy(
+      MallocExtension::ProtectionPolicy::kReportOnly);
+  for (int i = 0; i < 3; ++i) {
+    TCReportError();
+  }
+  MallocExtension::SetProtectionPolicy(policy);
+
+  std::vector<MallocExtension::ProtectionReport> reports =
+      MallocExtension::GetProtectionReports();
+  ASSERT_THAT(reports, testing::SizeIs(1));
+  EXPECT_EQ(reports[0].kind,
+            MallocExtension::ProtectionReport::Kind::kOutOfBounds);
+  EXPECT_EQ(reports[0].count, 3);
+  EXPECT_THAT(reports[0].description, testing::HasSubstr("OOB detected"));
+}
+#endif
+
+#ifdef THREAD_ALLOCATION_STATS
+TEST(MallocExtension, ThreadAllocationStats) {
+  constexpr int kObjects = 100;
+  const MallocExtension::ThreadAllocationStats before =
+      MallocExtension::GetThreadAllocationStats();
+  std::vector<void*> objects;
+  objects.reserve(kObjects);
+  const MallocExtension::ThreadAllocationStats reserved =
+      MallocExtension::GetThreadAllocationStats();
+  for (int i = 0; i < kObjects; ++i) {
+    objects.push_back(::operator new(64));
+  }
+  const MallocExtension::ThreadAllocationStats allocated =
+      MallocExtension::GetThreadAllocationStats();
+  for (void* object : objects) {
+    ::operator delete(object);
+  }
+  const MallocExtension::ThreadAllocationStats freed =
+      MallocExtension::GetThreadAllocationStats();
+
+  EXPECT_GT(reserved.allocations, before.allocations);
+  EXPECT_EQ(allocated.allocations - reserved.allocations, kObjects);
+  EXPECT_EQ(allocated.allocated_bytes - reserved.allocated_bytes,
+            kObjects * nallocx(64, 0));
+  EXPECT_EQ(freed.frees - allocated.frees, kObjects);
+  EXPECT_EQ(freed.freed_bytes - allocated.freed_bytes,
+            kObjects * nallocx(64, 0));
+}
+#endif
+
+#ifdef DETERMINISTIC_MODE
+TEST(MallocExtension, DeterministicMode) {
+  cpu_set_t before;
+  ASSERT_EQ(sched_getaffinity(0, sizeof(before), &before), 0);
+
+  MallocExtension::SetDeterministicMode(true);
+  EXPECT_TRUE(MallocExtension::GetDeterministicMode());
+  cpu_set_t pinned;
+  ASSERT_EQ(sched_getaffinity(0, sizeof(pinned), &pinned), 0);
+  EXPECT_EQ(CPU_COUNT(&pinned), 1);
+
+  MallocExtension::SetDeterministicMode(false);
+  EXPECT_FALSE(MallocExtension::GetDeterministicMode());
+  cpu_set_t after;
+  ASSERT_EQ(sched_getaffinity(0, sizeof(after), &after), 0);
+  EXPECT_TRUE(CPU_EQUAL(&before, &after));
+}
+#endif
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
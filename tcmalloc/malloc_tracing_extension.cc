@@ -36,5 +36,56 @@ absl::StatusOr<AllocatedAddressRanges> GetAllocatedAddressRanges() {
       "malloc_tracing_extension routines not exported by the current malloc.");
 }
 
+absl::Status StartAllocationTrace(const char* path, size_t max_events) {
+#if ABSL_HAVE_ATTRIBUTE_WEAK && !defined(__APPLE__) && !defined(__EMSCRIPTEN__)
+  if (&MallocTracingExtension_Internal_StartAllocationTrace != nullptr) {
+    return MallocTracingExtension_Internal_StartAllocationTrace(path,
+                                                                max_events);
+  }
+#endif
+  return absl::UnimplementedError(
+      "malloc_tracing_extension routines not exported by the current malloc.");
+}
+
+absl::StatusOr<size_t> StopAllocationTrace() {
+#if ABSL_HAVE_ATTRIBUTE_WEAK && !defined(__APPLE__) && !defined(__EMSCRIPTEN__)
+  if (&MallocTracingExtension_Internal_StopAllocationTrace != nullptr) {
+    return MallocTracingExtension_Internal_StopAllocationTrace();
+  }
+#endif
+  return absl::UnimplementedError(
+      "malloc_tracing_extension routines not exported by the current malloc.");
+}
+
+absl::Status StartTraceCapture(int fd) {
+#if ABSL_HAVE_ATTRIBUTE_WEAK && !defined(__APPLE__) && !defined(__EMSCRIPTEN__)
+  if (&MallocTracingExtension_Internal_StartTraceCapture != nullptr) {
+    return MallocTracingExtension_Internal_StartTraceCapture(fd);
+  }
+#endif
+  return absl::UnimplementedError(
+      "malloc_tracing_extension routines not exported by the current malloc.");
+}
+
+absl::StatusOr<TraceCaptureStats> StopTraceCapture() {
+#if ABSL_HAVE_ATTRIBUTE_WEAK && !defined(__APPLE__) && !defined(__EMSCRIPTEN__)
+  if (&MallocTracingExtension_Internal_StopTraceCapture != nullptr) {
+    return MallocTracingExtension_Internal_StopTraceCapture();
+  }
+#endif
+  return absl::UnimplementedError(
+      "malloc_tracing_extension routines not exported by the current malloc.");
+}
+
+absl::Status WriteCallSiteProfile(const char* path) {
+#if ABSL_HAVE_ATTRIBUTE_WEAK && !defined(__APPLE__) && !defined(__EMSCRIPTEN__)
+  if (&MallocTracingExtension_Internal_WriteCallSiteProfile != nullptr) {
+    return MallocTracingExtension_Internal_WriteCallSiteProfile(path);
+  }
+#endif
+  return absl::UnimplementedError(
+      "malloc_tracing_extension routines not exported by the current malloc.");
+}
+
 }  // namespace malloc_tracing_extension
 }  // namespace tcmalloc
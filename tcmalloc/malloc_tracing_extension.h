@@ -24,6 +24,7 @@
 #include <cstdint>
 #include <vector>
 
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 
 namespace tcmalloc {
@@ -48,6 +49,140 @@ struct AllocatedAddressRanges {
 // Returns the address ranges currently allocated by TCMalloc.
 absl::StatusOr<AllocatedAddressRanges> GetAllocatedAddressRanges();
 
+// Allocation traces.
+//
+// With ALLOCATION_TRACE, StartAllocationTrace() makes every malloc(), free(),
+// __escape(), __gep_check_boundary() and __bc_check_boundary() of the
+// process, including the batched variants, append a TraceEvent to a file,
+// until StopAllocationTrace() is called or the file is full.  The file holds
+// a TraceHeader followed by the events in the order the threads reserved
+// their slots, so it can be mapped and replayed as is
+// (tcmalloc/testing:replay_benchmark).
+
+enum class TraceEventType : uint8_t {
+  kNone = 0,  // The slot was reserved but never written.
+  kMalloc,    // address returned; size requested
+  kFree,      // address freed
+  kEscape,    // address of the location; value is the pointer stored
+  kGepCheck,  // address is the base; value the derived pointer; size
+  kBcCheck,   // address accessed; size accessed
+};
+
+struct TraceEvent {
+  uint64_t cycles;  // absl::base_internal::CycleClock::Now()
+  uint64_t address;
+  uint64_t value;
+  uint32_t size;
+  TraceEventType type;
+  uint8_t reserved[3];
+};
+static_assert(sizeof(TraceEvent) == 32, "TraceEvent is part of the format");
+
+struct TraceHeader {
+  // "TCMTRACE" in the first eight bytes of the file.
+  static constexpr uint64_t kMagic = 0x45434152544d4354;
+  static constexpr uint32_t kVersion = 1;
+
+  uint64_t magic;
+  uint32_t version;
+  uint32_t event_size;
+  uint64_t events;  // Slots reserved, at most the capacity of the file.
+  double cycles_per_second;
+};
+static_assert(sizeof(TraceHeader) == 32, "TraceHeader is part of the format");
+
+// Starts tracing into a new file at `path` with room for `max_events`.
+// Fails if a trace is already running or the file cannot be created.
+absl::Status StartAllocationTrace(const char* path, size_t max_events);
+
+// Stops the running trace, truncates its file to the events recorded and
+// returns their number.  Threads still inside the allocator may leave events
+// of type kNone behind, which readers skip.
+absl::StatusOr<size_t> StopAllocationTrace();
+
+// Trace capture.
+//
+// With TRACE_CAPTURE, StartTraceCapture() makes every allocation, free,
+// realloc() and __escape() of the process, and every check that finds its
+// pointer out of bounds, append a CaptureEvent to a ring of the CPU it runs
+// on.  The background thread (MallocExtension::ProcessBackgroundActions())
+// drains the rings to `fd` once a second and StopTraceCapture() drains what
+// is left.  The file gets a CaptureHeader followed by the events in the
+// order they were drained: in order per ring, each ring's backlog at once,
+// so readers sort by cycles for a global order.  Events that find their
+// ring full are dropped and counted; for a complete trace of a short run,
+// use StartAllocationTrace().
+
+enum class CaptureEventType : uint8_t {
+  kNone = 0,
+  kAlloc,         // address returned; size requested
+  kFree,          // address freed
+  kRealloc,       // address returned; value the old address; size requested.
+                  // Follows the kAlloc and kFree it is made of; a
+                  // realloc() that keeps the object as it is has none.
+  kEscape,        // address of the location; value is the pointer stored
+  kCheckFailure,  // address is the base; value the derived pointer or 0;
+                  // size, 0 for batched checks
+};
+
+struct CaptureEvent {
+  uint64_t cycles;  // absl::base_internal::CycleClock::Now()
+  uint64_t address;
+  uint64_t value;
+  uint32_t size;
+  CaptureEventType type;
+  uint8_t size_class;  // of address for kAlloc, kFree and kRealloc, else 0
+  uint16_t cpu;        // the ring the event went to
+};
+static_assert(sizeof(CaptureEvent) == 32,
+              "CaptureEvent is part of the format");
+
+struct CaptureHeader {
+  // "TCMCAPTR" in the first eight bytes of the file.
+  static constexpr uint64_t kMagic = 0x52545041434d4354;
+  static constexpr uint32_t kVersion = 1;
+
+  uint64_t magic;
+  uint32_t version;
+  uint32_t event_size;
+  double cycles_per_second;
+  uint64_t reserved;
+};
+static_assert(sizeof(CaptureHeader) == 32,
+              "CaptureHeader is part of the format");
+
+struct TraceCaptureStats {
+  uint64_t events;   // written to the file
+  uint64_t dropped;  // lost to full rings or a failed write
+};
+
+// Starts capturing into `fd`, which must stay open until
+// StopTraceCapture() returns, writing the header first.  Fails if a capture
+// is already running.
+absl::Status StartTraceCapture(int fd);
+
+// Stops the running capture, writes out the events still in the rings, and
+// returns the counts.  Does not close the fd.
+absl::StatusOr<TraceCaptureStats> StopTraceCapture();
+
+// Call site profiles.
+//
+// With CALLSITE_PROFILE, WriteCallSiteProfile() writes the counts of every
+// call site of __gep_check_boundary(), __bc_check_boundary() and __escape()
+// to a new text file at `path`.  After a few lines starting with '#', each
+// line holds
+//
+//   build_id offset kind calls failed skipped module
+//
+// where offset is the return address relative to the load address of the
+// module, calls and skipped are estimated from the sampled calls, and failed
+// counts every check that found its pointer out of bounds.  skipped counts
+// the escapes of the site that did nothing because the location already
+// pointed into the same object.  A build-id of "-" means the module has
+// none, and a module of "-" is the main program.  The process writes the
+// same file at exit when TCMALLOC_CALLSITE_PROFILE_FILE names it.
+absl::Status WriteCallSiteProfile(const char* path);
+
 }  // namespace malloc_tracing_extension
 }  // namespace tcmalloc
 
@@ -19,8 +19,14 @@
 
 #include "tcmalloc/malloc_tracing_extension.h"
 
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
 #include <cstdint>
 #include <optional>
+#include <string>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "absl/status/statusor.h"
@@ -28,6 +34,7 @@
 #ifndef MALLOC_TRACING_EXTENSION_NOT_SUPPORTED
 #include "gmock/gmock.h"
 #include "absl/cleanup/cleanup.h"
+#include "absl/status/status.h"
 #endif
 
 namespace {
@@ -106,6 +113,115 @@ TEST(MallocTracingExtension, GetAllocatedAddressRanges) {
     }
   }
 }
+
+TEST(MallocTracingExtension, AllocationTrace) {
+  using ::tcmalloc::malloc_tracing_extension::TraceEvent;
+  using ::tcmalloc::malloc_tracing_extension::TraceEventType;
+  using ::tcmalloc::malloc_tracing_extension::TraceHeader;
+
+  const std::string path = ::testing::TempDir() + "/allocation_trace";
+  absl::Status started = tcmalloc::malloc_tracing_extension::
+      StartAllocationTrace(path.c_str(), 1 << 16);
+  if (absl::IsUnimplemented(started)) {
+    GTEST_SKIP() << "built without ALLOCATION_TRACE";
+  }
+  ASSERT_TRUE(started.ok()) << started;
+  EXPECT_FALSE(tcmalloc::malloc_tracing_extension::StartAllocationTrace(
+                   path.c_str(), 1)
+                   .ok());
+
+  // Act.
+  void* ptr = ::operator new(100);
+  ::operator delete(ptr);
+  absl::StatusOr<size_t> events =
+      tcmalloc::malloc_tracing_extension::StopAllocationTrace();
+
+  // Assert.
+  ASSERT_TRUE(events.ok()) << events.status();
+  EXPECT_FALSE(tcmalloc::malloc_tracing_extension::StopAllocationTrace().ok());
+
+  FILE* f = fopen(path.c_str(), "rb");
+  ASSERT_NE(f, nullptr);
+  TraceHeader header;
+  ASSERT_EQ(fread(&header, sizeof(header), 1, f), 1);
+  EXPECT_EQ(header.magic, TraceHeader::kMagic);
+  EXPECT_EQ(header.event_size, sizeof(TraceEvent));
+  EXPECT_EQ(header.events, *events);
+  std::vector<TraceEvent> trace(header.events);
+  ASSERT_EQ(fread(trace.data(), sizeof(TraceEvent), trace.size(), f),
+            trace.size());
+  fclose(f);
+
+  bool allocated = false, freed = false;
+  for (const TraceEvent& e : trace) {
+    if (e.address != reinterpret_cast<uintptr_t>(ptr)) continue;
+    if (e.type == TraceEventType::kMalloc && e.size == 100) {
+      allocated = true;
+    } else if (e.type == TraceEventType::kFree && allocated) {
+      freed = true;
+    }
+  }
+  EXPECT_TRUE(allocated);
+  EXPECT_TRUE(freed);
+}
+
+TEST(MallocTracingExtension, TraceCapture) {
+  using ::tcmalloc::malloc_tracing_extension::CaptureEvent;
+  using ::tcmalloc::malloc_tracing_extension::CaptureEventType;
+  using ::tcmalloc::malloc_tracing_extension::CaptureHeader;
+  using ::tcmalloc::malloc_tracing_extension::TraceCaptureStats;
+
+  const std::string path = ::testing::TempDir() + "/trace_capture";
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  ASSERT_GE(fd, 0);
+  absl::Cleanup closer = [fd] { close(fd); };
+  absl::Status started =
+      tcmalloc::malloc_tracing_extension::StartTraceCapture(fd);
+  if (absl::IsUnimplemented(started)) {
+    GTEST_SKIP() << "built without TRACE_CAPTURE";
+  }
+  ASSERT_TRUE(started.ok()) << started;
+  EXPECT_FALSE(tcmalloc::malloc_tracing_extension::StartTraceCapture(fd).ok());
+
+  // Act.
+  void* ptr = ::operator new(100);
+  ::operator delete(ptr);
+  absl::StatusOr<TraceCaptureStats> stats =
+      tcmalloc::malloc_tracing_extension::StopTraceCapture();
+
+  // Assert.
+  ASSERT_TRUE(stats.ok()) << stats.status();
+  EXPECT_FALSE(tcmalloc::malloc_tracing_extension::StopTraceCapture().ok());
+  EXPECT_EQ(static_cast<size_t>(lseek(fd, 0, SEEK_END)),
+            sizeof(CaptureHeader) + stats->events * sizeof(CaptureEvent));
+
+  FILE* f = fopen(path.c_str(), "rb");
+  ASSERT_NE(f, nullptr);
+  CaptureHeader header;
+  ASSERT_EQ(fread(&header, sizeof(header), 1, f), 1);
+  EXPECT_EQ(header.magic, CaptureHeader::kMagic);
+  EXPECT_EQ(header.version, CaptureHeader::kVersion);
+  EXPECT_EQ(header.event_size, sizeof(CaptureEvent));
+  std::vector<CaptureEvent> trace(stats->events);
+  ASSERT_EQ(fread(trace.data(), sizeof(CaptureEvent), trace.size(), f),
+            trace.size());
+  fclose(f);
+
+  // The thread may have moved to another ring in between, so the events are
+  // not looked for in order.
+  bool allocated = false, freed = false;
+  for (const CaptureEvent& e : trace) {
+    if (e.address != reinterpret_cast<uintptr_t>(ptr)) continue;
+    if (e.type == CaptureEventType::kAlloc && e.size == 100) {
+      EXPECT_NE(e.size_class, 0);
+      allocated = true;
+    } else if (e.type == CaptureEventType::kFree) {
+      freed = true;
+    }
+  }
+  EXPECT_TRUE(allocated);
+  EXPECT_TRUE(freed);
+}
 #endif
 
 }  // namespace
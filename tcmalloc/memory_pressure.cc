@@ -0,0 +1,330 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/memory_pressure.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "absl/base/internal/sysinfo.h"
+#include "absl/strings/numbers.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/internal/util.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+MemoryPressureMonitor::State MemoryPressureMonitor::state_ =
+    MemoryPressureMonitor::State::kUnknown;
+char MemoryPressureMonitor::pressure_path_[kMaxPath];
+char MemoryPressureMonitor::current_path_[kMaxPath];
+char MemoryPressureMonitor::high_path_[kMaxPath];
+char MemoryPressureMonitor::max_path_[kMaxPath];
+
+ABSL_CONST_INIT std::atomic<int> MemoryPressureMonitor::level_(0);
+ABSL_CONST_INIT std::atomic<int64_t> MemoryPressureMonitor::some_avg10_(0);
+ABSL_CONST_INIT std::atomic<int64_t> MemoryPressureMonitor::full_avg10_(0);
+ABSL_CONST_INIT std::atomic<int64_t> MemoryPressureMonitor::current_(0);
+ABSL_CONST_INIT std::atomic<int64_t> MemoryPressureMonitor::limit_(0);
+ABSL_CONST_INIT std::atomic<uint64_t> MemoryPressureMonitor::ticks_
+    [static_cast<int>(MemoryPressureLevel::kNumLevels)] = {};
+ABSL_CONST_INIT std::atomic<uint64_t> MemoryPressureMonitor::requested_bytes_(
+    0);
+ABSL_CONST_INIT std::atomic<uint64_t> MemoryPressureMonitor::cpu_cache_bytes_(
+    0);
+ABSL_CONST_INIT std::atomic<uint64_t>
+    MemoryPressureMonitor::escape_slab_bytes_(0);
+
+namespace {
+
+constexpr const char* kLevelNames[] = {"none", "moderate", "high",
+                                       "critical"};
+
+struct FDCloser {
+  FDCloser() : fd(-1) {}
+  ~FDCloser() {
+    if (fd != -1) {
+      signal_safe_close(fd);
+    }
+  }
+  int fd;
+};
+
+// Reads the file at path into buf, which it leaves NUL-terminated.  Returns
+// the length read, or -1 if the file is missing or does not fit.
+ssize_t ReadSmallFile(const char* path, char* buf, size_t size) {
+  FDCloser fd;
+  fd.fd = signal_safe_open(path, O_RDONLY | O_CLOEXEC);
+  if (fd.fd < 0) {
+    return -1;
+  }
+  ssize_t rc = signal_safe_read(fd.fd, buf, size, nullptr);
+  if (rc < 0 || rc >= size) {
+    return -1;
+  }
+  buf[rc] = '\0';
+  return rc;
+}
+
+absl::string_view StripTrailingNewline(absl::string_view s) {
+  while (!s.empty() && s.back() == '\n') s.remove_suffix(1);
+  return s;
+}
+
+// Parses the avg10 value of the line of `contents` starting with `prefix`.
+bool ParseAvg10(absl::string_view contents, absl::string_view prefix,
+                double* avg10) {
+  while (!contents.empty()) {
+    const auto eol = contents.find('\n');
+    const absl::string_view line = contents.substr(0, eol);
+    contents.remove_prefix(eol == absl::string_view::npos ? contents.size()
+                                                          : eol + 1);
+    if (line.substr(0, prefix.size()) != prefix) continue;
+
+    constexpr absl::string_view kField = "avg10=";
+    const auto start = line.find(kField);
+    if (start == absl::string_view::npos) return false;
+    absl::string_view value = line.substr(start + kField.size());
+    value = value.substr(0, value.find(' '));
+    return absl::SimpleAtod(value, avg10);
+  }
+  return false;
+}
+
+}  // namespace
+
+MemoryPressureLevel ClassifyMemoryPressure(const MemoryPressureSample& sample) {
+  const double usage =
+      sample.limit > 0 ? static_cast<double>(sample.current) / sample.limit : 0;
+  if (sample.full_avg10 >= kCriticalFull || usage >= kCriticalUsage) {
+    return MemoryPressureLevel::kCritical;
+  }
+  if (sample.full_avg10 >= kHighFull || sample.some_avg10 >= kHighSome ||
+      usage >= kHighUsage) {
+    return MemoryPressureLevel::kHigh;
+  }
+  if (sample.some_avg10 >= kModerateSome || usage >= kModerateUsage) {
+    return MemoryPressureLevel::kModerate;
+  }
+  return MemoryPressureLevel::kNone;
+}
+
+bool ParseCgroupPath(absl::string_view contents, absl::string_view* path) {
+  while (!contents.empty()) {
+    const auto eol = contents.find('\n');
+    const absl::string_view line = contents.substr(0, eol);
+    contents.remove_prefix(eol == absl::string_view::npos ? contents.size()
+                                                          : eol + 1);
+    constexpr absl::string_view kUnified = "0::";
+    if (line.substr(0, kUnified.size()) == kUnified &&
+        line.size() > kUnified.size()) {
+      *path = line.substr(kUnified.size());
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ParseCgroupBytes(absl::string_view contents, int64_t* bytes) {
+  contents = StripTrailingNewline(contents);
+  if (contents == "max") {
+    *bytes = 0;
+    return true;
+  }
+  return absl::SimpleAtoi(contents, bytes) && *bytes >= 0;
+}
+
+bool ParseMemoryPressure(absl::string_view contents,
+                         MemoryPressureSample* sample) {
+  if (!ParseAvg10(contents, "some ", &sample->some_avg10)) return false;
+  // Kernels before 5.x report no full line for the root cgroup.  Taking it
+  // as 0 only loses the levels full would have raised.
+  double full;
+  sample->full_avg10 = ParseAvg10(contents, "full ", &full) ? full : 0;
+  return true;
+}
+
+bool MemoryPressureMonitor::Init() {
+  char buf[kMaxPath];
+  const ssize_t n = ReadSmallFile("/proc/self/cgroup", buf, sizeof(buf));
+  if (n < 0) return false;
+  absl::string_view path;
+  if (!ParseCgroupPath(absl::string_view(buf, n), &path)) return false;
+  if (path == "/") path = "";
+
+  struct {
+    char* dst;
+    const char* file;
+  } files[] = {{pressure_path_, "memory.pressure"},
+               {current_path_, "memory.current"},
+               {high_path_, "memory.high"},
+               {max_path_, "memory.max"}};
+  for (const auto& f : files) {
+    const int len = snprintf(f.dst, kMaxPath, "/sys/fs/cgroup%.*s/%s",
+                             static_cast<int>(path.size()), path.data(),
+                             f.file);
+    if (len < 0 || len >= kMaxPath) return false;
+  }
+
+  // Without PSI the limit alone could set the level, but a cgroup that does
+  // not report it is in all likelihood not one whose memory is accounted.
+  MemoryPressureSample sample;
+  return Sample(&sample);
+}
+
+bool MemoryPressureMonitor::Sample(MemoryPressureSample* sample) {
+  char buf[256];
+  ssize_t n = ReadSmallFile(pressure_path_, buf, sizeof(buf));
+  if (n < 0 || !ParseMemoryPressure(absl::string_view(buf, n), sample)) {
+    return false;
+  }
+
+  // The root cgroup has no memory.current nor limits.
+  n = ReadSmallFile(current_path_, buf, sizeof(buf));
+  if (n < 0 || !ParseCgroupBytes(absl::string_view(buf, n), &sample->current)) {
+    sample->current = 0;
+  }
+  sample->limit = 0;
+  for (const char* path : {high_path_, max_path_}) {
+    int64_t limit;
+    n = ReadSmallFile(path, buf, sizeof(buf));
+    if (n >= 0 && ParseCgroupBytes(absl::string_view(buf, n), &limit) &&
+        limit > 0 && (sample->limit == 0 || limit < sample->limit)) {
+      sample->limit = limit;
+    }
+  }
+  return true;
+}
+
+uint64_t MemoryPressureMonitor::DrainCpuCaches() {
+  if (!MallocExtension::PerCpuCachesActive()) return 0;
+  uint64_t drained = 0;
+  const int num_cpus = absl::base_internal::NumCPUs();
+  for (int cpu = 0; cpu < num_cpus; ++cpu) {
+    if (tc_globals.cpu_cache().HasPopulated(cpu)) {
+      drained += tc_globals.cpu_cache().Reclaim(cpu);
+    }
+  }
+  return drained;
+}
+
+void MemoryPressureMonitor::Tick(absl::Duration elapsed) {
+  if (state_ == State::kUnknown) {
+    state_ = Init() ? State::kWatching : State::kUnavailable;
+  }
+  if (state_ != State::kWatching) return;
+
+  MemoryPressureSample sample;
+  if (!Sample(&sample)) return;
+  const MemoryPressureLevel level = ClassifyMemoryPressure(sample);
+  const int l = static_cast<int>(level);
+  level_.store(l, std::memory_order_relaxed);
+  some_avg10_.store(sample.some_avg10 * 100, std::memory_order_relaxed);
+  full_avg10_.store(sample.full_avg10 * 100, std::memory_order_relaxed);
+  current_.store(sample.current, std::memory_order_relaxed);
+  limit_.store(sample.limit, std::memory_order_relaxed);
+  ticks_[l].fetch_add(1, std::memory_order_relaxed);
+  if (level == MemoryPressureLevel::kNone) return;
+
+  // Caches go first, so that what they held is free for the release below.
+  if (level >= MemoryPressureLevel::kHigh) {
+    cpu_cache_bytes_.fetch_add(DrainCpuCaches(), std::memory_order_relaxed);
+    size_t escape_released = 0;
+    for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+      escape_released +=
+          tc_globals.escape_allocator(partition).ReleaseEmptySlabs();
+    }
+    escape_slab_bytes_.fetch_add(escape_released, std::memory_order_relaxed);
+  }
+
+  size_t bytes;
+  if (level == MemoryPressureLevel::kCritical) {
+    bytes = std::numeric_limits<size_t>::max();
+  } else {
+    // The fixed-rate release has already freed one share of this.
+    const double seconds = std::max(absl::ToDoubleSeconds(elapsed), 0.0);
+    const size_t rate = std::max(
+        static_cast<size_t>(Parameters::background_release_rate()) *
+            (kRateFactor[l] - 1),
+        kMinRate[l]);
+    bytes = rate * seconds;
+    if (sample.limit > 0) {
+      const int64_t target = sample.limit * kModerateUsage;
+      if (sample.current > target) {
+        bytes = std::max<size_t>(bytes, sample.current - target);
+      }
+    }
+  }
+  if (bytes == 0) return;
+  if (bytes != std::numeric_limits<size_t>::max()) {
+    requested_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  MallocExtension::ReleaseMemoryToSystem(bytes);
+}
+
+void MemoryPressureMonitor::Print(Printer* out) {
+  const int level = level_.load(std::memory_order_relaxed);
+  out->printf("------------------------------------------------\n");
+  out->printf(
+      "MEMORY PRESSURE: level %s, stalls some %.2f%% full %.2f%%, "
+      "%d of %d bytes\n",
+      kLevelNames[level], some_avg10_.load(std::memory_order_relaxed) / 100.0,
+      full_avg10_.load(std::memory_order_relaxed) / 100.0,
+      current_.load(std::memory_order_relaxed),
+      limit_.load(std::memory_order_relaxed));
+  out->printf(
+      "MEMORY PRESSURE: %d moderate, %d high, %d critical ticks\n",
+      ticks_[1].load(std::memory_order_relaxed),
+      ticks_[2].load(std::memory_order_relaxed),
+      ticks_[3].load(std::memory_order_relaxed));
+  out->printf(
+      "MEMORY PRESSURE: %d bytes requested, %d drained from per-cpu caches, "
+      "%d of escape slabs released\n",
+      requested_bytes_.load(std::memory_order_relaxed),
+      cpu_cache_bytes_.load(std::memory_order_relaxed),
+      escape_slab_bytes_.load(std::memory_order_relaxed));
+}
+
+void MemoryPressureMonitor::PrintInPbtxt(PbtxtRegion* region) {
+  const int level = level_.load(std::memory_order_relaxed);
+  region->PrintRaw("level", kLevelNames[level]);
+  region->PrintDouble("some_avg10",
+                      some_avg10_.load(std::memory_order_relaxed) / 100.0);
+  region->PrintDouble("full_avg10",
+                      full_avg10_.load(std::memory_order_relaxed) / 100.0);
+  region->PrintI64("current_bytes", current_.load(std::memory_order_relaxed));
+  region->PrintI64("limit_bytes", limit_.load(std::memory_order_relaxed));
+  region->PrintI64("moderate_ticks", ticks_[1].load(std::memory_order_relaxed));
+  region->PrintI64("high_ticks", ticks_[2].load(std::memory_order_relaxed));
+  region->PrintI64("critical_ticks", ticks_[3].load(std::memory_order_relaxed));
+  region->PrintI64("requested_bytes",
+                   requested_bytes_.load(std::memory_order_relaxed));
+  region->PrintI64("cpu_cache_drained_bytes",
+                   cpu_cache_bytes_.load(std::memory_order_relaxed));
+  region->PrintI64("escape_slab_released_bytes",
+                   escape_slab_bytes_.load(std::memory_order_relaxed));
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
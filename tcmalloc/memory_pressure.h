@@ -0,0 +1,136 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Release driven by the memory pressure on the process's cgroup
+// (MEMORY_PRESSURE_RELEASE).
+//
+// The background thread releases background_release_rate bytes a second
+// whatever the host is going through, and shrinks further only once a
+// MallocExtension limit is hit.  With MEMORY_PRESSURE_RELEASE it also reads,
+// every tick, the stall times the kernel reports in the cgroup v2
+// memory.pressure file and how close memory.current is to memory.high (or
+// memory.max, whichever is lower).  The worse of the two sets a level, and
+// each level sheds more: a faster release that also takes back whatever lies
+// above kModerateUsage of the limit, then draining every per-cpu cache and
+// the empty escape chunk slabs, and at kCritical everything the page heap
+// holds free, the HugeCache included.
+
+#ifndef TCMALLOC_MEMORY_PRESSURE_H_
+#define TCMALLOC_MEMORY_PRESSURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+enum class MemoryPressureLevel : int {
+  kNone,
+  kModerate,  // faster release, down to kModerateUsage of the limit
+  kHigh,      // also drains per-cpu caches and empty escape slabs
+  kCritical,  // also releases all free memory
+  kNumLevels,
+};
+
+// One reading of the cgroup.  The stall shares are the percent of the last
+// 10 seconds in which some, or all, of its tasks waited on memory.
+struct MemoryPressureSample {
+  double some_avg10 = 0;
+  double full_avg10 = 0;
+  // memory.current, and the lower of memory.high and memory.max; limit is 0
+  // if the cgroup has neither.
+  int64_t current = 0;
+  int64_t limit = 0;
+};
+
+// Thresholds of the levels, on either the stall shares or current / limit.
+inline constexpr double kModerateSome = 10;
+inline constexpr double kHighSome = 40;
+inline constexpr double kHighFull = 10;
+inline constexpr double kCriticalFull = 40;
+inline constexpr double kModerateUsage = 0.90;
+inline constexpr double kHighUsage = 0.95;
+inline constexpr double kCriticalUsage = 0.99;
+
+MemoryPressureLevel ClassifyMemoryPressure(const MemoryPressureSample& sample);
+
+// Parsers of the cgroup files, which return false on malformed contents.
+// ParseCgroupPath() finds the v2 entry ("0::<path>") of /proc/self/cgroup.
+// ParseCgroupBytes() reads a memory.* value, "max" being 0.
+bool ParseCgroupPath(absl::string_view contents, absl::string_view* path);
+bool ParseCgroupBytes(absl::string_view contents, int64_t* bytes);
+bool ParseMemoryPressure(absl::string_view contents,
+                         MemoryPressureSample* sample);
+
+class MemoryPressureMonitor {
+ public:
+  static constexpr size_t kMaxPath = 512;
+
+  // Samples the cgroup and sheds memory for the `elapsed` time since the
+  // last tick, on top of the fixed-rate release.  Only the background thread
+  // calls it.  Does nothing if the process is not in a cgroup v2 hierarchy
+  // with memory accounting, which the first call finds out.
+  static void Tick(absl::Duration elapsed);
+
+  static void Print(Printer* out);
+  static void PrintInPbtxt(PbtxtRegion* region);
+
+ private:
+  // Bytes per second released at least at each level, when
+  // background_release_rate times kRateFactor is fewer.
+  static constexpr size_t kMinRate[] = {0, size_t{16} << 20, size_t{64} << 20,
+                                        0};
+  static constexpr size_t kRateFactor[] = {1, 4, 16, 1};
+
+  enum class State { kUnknown, kWatching, kUnavailable };
+
+  static bool Init();
+  static bool Sample(MemoryPressureSample* sample);
+  // Drains the caches of every populated cpu and returns their bytes.
+  static uint64_t DrainCpuCaches();
+
+  // Owned by the background thread.
+  static State state_;
+  static char pressure_path_[kMaxPath];
+  static char current_path_[kMaxPath];
+  static char high_path_[kMaxPath];
+  static char max_path_[kMaxPath];
+
+  // Read by Print() from any thread.
+  ABSL_CONST_INIT static std::atomic<int> level_;
+  ABSL_CONST_INIT static std::atomic<int64_t> some_avg10_;  // in 1/100 %
+  ABSL_CONST_INIT static std::atomic<int64_t> full_avg10_;  // in 1/100 %
+  ABSL_CONST_INIT static std::atomic<int64_t> current_;
+  ABSL_CONST_INIT static std::atomic<int64_t> limit_;
+  ABSL_CONST_INIT static std::atomic<uint64_t>
+      ticks_[static_cast<int>(MemoryPressureLevel::kNumLevels)];
+  ABSL_CONST_INIT static std::atomic<uint64_t> requested_bytes_;
+  ABSL_CONST_INIT static std::atomic<uint64_t> cpu_cache_bytes_;
+  ABSL_CONST_INIT static std::atomic<uint64_t> escape_slab_bytes_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_MEMORY_PRESSURE_H_
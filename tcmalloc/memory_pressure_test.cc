@@ -0,0 +1,93 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/memory_pressure.h"
+
+#include <stdint.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/strings/string_view.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+TEST(MemoryPressure, ParsesCgroupPath) {
+  absl::string_view path;
+  EXPECT_TRUE(ParseCgroupPath("0::/user.slice/app.scope\n", &path));
+  EXPECT_EQ(path, "/user.slice/app.scope");
+
+  // Hybrid hierarchies list the v1 controllers first.
+  EXPECT_TRUE(ParseCgroupPath("12:memory:/job\n3:cpu:/job\n0::/job\n", &path));
+  EXPECT_EQ(path, "/job");
+
+  EXPECT_FALSE(ParseCgroupPath("12:memory:/job\n", &path));
+  EXPECT_FALSE(ParseCgroupPath("", &path));
+}
+
+TEST(MemoryPressure, ParsesCgroupBytes) {
+  int64_t bytes = -1;
+  EXPECT_TRUE(ParseCgroupBytes("1073741824\n", &bytes));
+  EXPECT_EQ(bytes, int64_t{1} << 30);
+  EXPECT_TRUE(ParseCgroupBytes("max\n", &bytes));
+  EXPECT_EQ(bytes, 0);
+  EXPECT_FALSE(ParseCgroupBytes("lots\n", &bytes));
+  EXPECT_FALSE(ParseCgroupBytes("-1\n", &bytes));
+}
+
+TEST(MemoryPressure, ParsesPressure) {
+  MemoryPressureSample sample;
+  EXPECT_TRUE(ParseMemoryPressure(
+      "some avg10=12.50 avg60=3.00 avg300=1.00 total=123456\n"
+      "full avg10=4.25 avg60=1.00 avg300=0.50 total=654\n",
+      &sample));
+  EXPECT_DOUBLE_EQ(sample.some_avg10, 12.5);
+  EXPECT_DOUBLE_EQ(sample.full_avg10, 4.25);
+
+  EXPECT_TRUE(ParseMemoryPressure(
+      "some avg10=1.00 avg60=0.00 avg300=0.00 total=1\n", &sample));
+  EXPECT_DOUBLE_EQ(sample.some_avg10, 1);
+  EXPECT_DOUBLE_EQ(sample.full_avg10, 0);
+
+  EXPECT_FALSE(ParseMemoryPressure("full avg10=1.00\n", &sample));
+  EXPECT_FALSE(ParseMemoryPressure("some total=1\n", &sample));
+}
+
+TEST(MemoryPressure, Classifies) {
+  MemoryPressureSample sample;
+  EXPECT_EQ(ClassifyMemoryPressure(sample), MemoryPressureLevel::kNone);
+
+  sample.some_avg10 = kModerateSome;
+  EXPECT_EQ(ClassifyMemoryPressure(sample), MemoryPressureLevel::kModerate);
+  sample.full_avg10 = kHighFull;
+  EXPECT_EQ(ClassifyMemoryPressure(sample), MemoryPressureLevel::kHigh);
+  sample.full_avg10 = kCriticalFull;
+  EXPECT_EQ(ClassifyMemoryPressure(sample), MemoryPressureLevel::kCritical);
+
+  // Usage raises the level on its own, but only against a limit.
+  sample = MemoryPressureSample();
+  sample.current = 96;
+  EXPECT_EQ(ClassifyMemoryPressure(sample), MemoryPressureLevel::kNone);
+  sample.limit = 100;
+  EXPECT_EQ(ClassifyMemoryPressure(sample), MemoryPressureLevel::kHigh);
+  sample.current = 99;
+  EXPECT_EQ(ClassifyMemoryPressure(sample), MemoryPressureLevel::kCritical);
+  sample.current = 50;
+  EXPECT_EQ(ClassifyMemoryPressure(sample), MemoryPressureLevel::kNone);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
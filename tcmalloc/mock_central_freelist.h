@@ -43,7 +43,11 @@ class FakeCentralFreeListBase {
   FakeCentralFreeListBase(const FakeCentralFreeListBase&) = delete;
   FakeCentralFreeListBase& operator=(const FakeCentralFreeListBase&) = delete;
 
-  static constexpr void Init(size_t) {}
+  void Init(size_t size_class) { size_class_ = size_class; }
+  size_t size_class() const { return size_class_; }
+
+ private:
+  size_t size_class_ = 0;
 };
 
 // CentralFreeList implementation that backs onto the system's malloc.
@@ -303,6 +303,10 @@ class TwoSizeClassManager : public FakeTransferCacheManager {
 
   size_t tc_length(int size_class) { return caches_[size_class]->tc_length(); }
 
+  TransferCacheStats GetStats(int size_class) {
+    return caches_[size_class]->GetStats();
+  }
+
   std::vector<std::unique_ptr<TransferCache>> caches_;
 
   // From which size class to evict.
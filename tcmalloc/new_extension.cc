@@ -61,3 +61,23 @@ ABSL_ATTRIBUTE_WEAK void* operator new[](
   return ::operator new[](size, alignment, std::nothrow);
 }
 #endif  // __cpp_aligned_new
+
+ABSL_ATTRIBUTE_WEAK void* operator new(
+    size_t size, tcmalloc::pointer_free_t) noexcept(false) {
+  return ::operator new(size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new(size_t size, const std::nothrow_t,
+                                       tcmalloc::pointer_free_t) noexcept {
+  return ::operator new(size, std::nothrow);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](
+    size_t size, tcmalloc::pointer_free_t) noexcept(false) {
+  return ::operator new[](size);
+}
+
+ABSL_ATTRIBUTE_WEAK void* operator new[](
+    size_t size, const std::nothrow_t, tcmalloc::pointer_free_t) noexcept {
+  return ::operator new[](size, std::nothrow);
+}
@@ -42,4 +42,11 @@ void* operator new[](size_t size, std::align_val_t alignment,
                      tcmalloc::hot_cold_t hot_cold) noexcept;
 #endif  // __cpp_aligned_new
 
+void* operator new(size_t size, tcmalloc::pointer_free_t) noexcept(false);
+void* operator new(size_t size, const std::nothrow_t,
+                   tcmalloc::pointer_free_t) noexcept;
+void* operator new[](size_t size, tcmalloc::pointer_free_t) noexcept(false);
+void* operator new[](size_t size, const std::nothrow_t,
+                     tcmalloc::pointer_free_t) noexcept;
+
 #endif  // TCMALLOC_NEW_EXTENSION_H_
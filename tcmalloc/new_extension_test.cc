@@ -474,5 +474,37 @@ TEST(HotColdNew, OperatorNewArrayAlignedNothrow) {
 }
 #endif  // __cpp_aligned_new
 
+TEST(PointerFreeNew, InvalidSizeNothrow) {
+  constexpr size_t kBadSize = std::numeric_limits<size_t>::max();
+  EXPECT_EQ(::operator new (kBadSize, std::nothrow, pointer_free), nullptr);
+  EXPECT_EQ(::operator new[](kBadSize, std::nothrow, pointer_free), nullptr);
+}
+
+TEST(PointerFreeNew, OperatorNew) {
+  absl::BitGen rng;
+  std::vector<SizedPtr> ptrs;
+  for (size_t size = 0; size < 1024; ++size) {
+    void* ret = ::operator new(size, pointer_free);
+    ASSERT_NE(ret, nullptr);
+    benchmark::DoNotOptimize(memset(ret, 0xBF, size));
+    ptrs.emplace_back(SizedPtr{ret, size});
+
+    ret = ::operator new(size, std::nothrow, pointer_free);
+    ASSERT_NE(ret, nullptr);
+    benchmark::DoNotOptimize(memset(ret, 0xBF, size));
+    ptrs.emplace_back(SizedPtr{ret, size});
+  }
+
+  // Sized and unsized delete both have to find the object, whichever span it
+  // came from.
+  for (SizedPtr s : ptrs) {
+    if (absl::Bernoulli(rng, 0.5)) {
+      ::operator delete(s.ptr);
+    } else {
+      sized_delete(s.ptr, s.size);
+    }
+  }
+}
+
 }  // namespace
 }  // namespace tcmalloc
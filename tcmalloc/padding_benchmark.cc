@@ -0,0 +1,139 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The cost of the byte ENABLE_PROTECTION adds to every request so that a
+// pointer to the end of an object does not point into its neighbour.  A
+// request of exactly a class size no longer fits its class and takes the
+// next one.  For every size class, the benchmarks allocate the class size
+// itself and one byte less, which fits under padding, and report
+//
+//   class_size         bytes of the class, what a request of it would get
+//                      without padding;
+//   allocated          nallocx() of the request and the padding byte, what
+//                      it gets now;
+//   padding_waste      (allocated - requested) / allocated;
+//   sampled_waste      the same ratio estimated from the growth of
+//                      sampled_internal_fragmentation_ while kLive objects
+//                      are held (BM_PaddingFragmentation only).
+//
+// Sampled allocations record the padded size as the requested one, so
+// sampled_waste misses the padding byte itself and counts only the bytes a
+// bumped request loses to the larger class.  An alternative layout that needs
+// no padding is compared by running the same benchmarks on its build.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/tcmalloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr int kLive = 4096;
+
+void AllSizeClasses(benchmark::internal::Benchmark* b) {
+  for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+    b->Args({size_class, 0});
+    b->Args({size_class, 1});
+  }
+}
+
+// Returns the request of a benchmark: the size of class range(0), less
+// range(1) bytes.  Returns 0 for a class the size map does not use.
+size_t RequestSize(const benchmark::State& state) {
+  // The first allocation sets up tc_globals for the size map.
+  free(malloc(1));
+  const size_t class_size = tc_globals.sizemap().class_to_size(state.range(0));
+  if (class_size <= static_cast<size_t>(state.range(1))) return 0;
+  return class_size - state.range(1);
+}
+
+void SetSizeCounters(benchmark::State& state, size_t size) {
+  const size_t allocated = nallocx(size, 0) + kPaddingBytes;
+  state.counters["class_size"] =
+      tc_globals.sizemap().class_to_size(state.range(0));
+  state.counters["allocated"] = allocated;
+  state.counters["padding_waste"] =
+      static_cast<double>(allocated - size) / allocated;
+}
+
+// Throughput of malloc() and free() of one request, kLive objects at a
+// time, so a bumped request also pays for the larger class's spans.
+void BM_PaddingThroughput(benchmark::State& state) {
+  const size_t size = RequestSize(state);
+  if (size == 0) {
+    state.SkipWithError("unused size class");
+    return;
+  }
+  std::vector<void*> objects(kLive);
+  for (auto _ : state) {
+    for (void*& p : objects) {
+      p = malloc(size);
+      benchmark::DoNotOptimize(p);
+    }
+    for (void* p : objects) {
+      free(p);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kLive);
+  SetSizeCounters(state, size);
+}
+
+// The internal fragmentation of one request as the heap profile sees it:
+// every allocation is sampled, and sampled_internal_fragmentation_ is read
+// while kLive objects are held.
+void BM_PaddingFragmentation(benchmark::State& state) {
+  const size_t size = RequestSize(state);
+  if (size == 0) {
+    state.SkipWithError("unused size class");
+    return;
+  }
+  const int64_t previous_rate = MallocExtension::GetProfileSamplingRate();
+  MallocExtension::SetProfileSamplingRate(1);
+  std::vector<void*> objects(kLive);
+  double waste = 0;
+  for (auto _ : state) {
+    const double before = tc_globals.sampled_internal_fragmentation_.value();
+    for (void*& p : objects) {
+      p = malloc(size);
+      benchmark::DoNotOptimize(p);
+    }
+    waste = tc_globals.sampled_internal_fragmentation_.value() - before;
+    for (void* p : objects) {
+      free(p);
+    }
+  }
+  MallocExtension::SetProfileSamplingRate(previous_rate);
+  state.SetItemsProcessed(state.iterations() * kLive);
+  SetSizeCounters(state, size);
+  state.counters["sampled_waste"] =
+      waste / (static_cast<double>(nallocx(size, 0) + kPaddingBytes) * kLive);
+}
+
+BENCHMARK(BM_PaddingThroughput)->Apply(AllSizeClasses);
+BENCHMARK(BM_PaddingFragmentation)->Apply(AllSizeClasses);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -156,7 +156,18 @@ void PageAllocator::ShrinkToUsageLimit() {
   }
 
   limit_hits_++;
-  const size_t overage = backed - limit_;
+  size_t overage = backed - limit_;
+  // Empty escape chunk slabs count as metadata; give them back before
+  // breaking up the page heap.
+  size_t escape_released = 0;
+  for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+    escape_released +=
+        tc_globals.escape_allocator(partition).ReleaseEmptySlabs();
+  }
+  if (escape_released >= overage) {
+    return;
+  }
+  overage -= escape_released;
   const Length pages = LengthFromBytes(overage + kPageSize - 1);
   if (ShrinkHardBy(pages)) {
     return;
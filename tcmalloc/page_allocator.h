@@ -45,14 +45,28 @@ class PageAllocator {
   //
   // Any address in the returned Span is guaranteed to satisfy
   // GetMemoryTag(addr) == "tag".
-  Span* New(Length n, size_t objects_per_span, MemoryTag tag)
-      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  //
+  // size_class is the size class the span is for, 0 if it has none; see
+  // PageAllocatorInterface::NewForSizeClass().
+  Span* New(Length n, size_t objects_per_span, MemoryTag tag,
+            size_t size_class = 0) ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
   // As New, but the returned span is aligned to a <align>-page boundary.
   // <align> must be a power of two.
   Span* NewAligned(Length n, Length align, size_t objects_per_span,
                    MemoryTag tag) ABSL_LOCKS_EXCLUDED(pageheap_lock);
 
+  // As NewAligned, and sets *known_zero if the span needs no zeroing; see
+  // PageAllocatorInterface::NewAlignedKnownZero().
+  Span* NewAlignedKnownZero(Length n, Length align, size_t objects_per_span,
+                            MemoryTag tag, bool* known_zero)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Grows or shrinks span to "n" pages without moving it; see
+  // PageAllocatorInterface::ResizeInPlace().
+  bool ResizeInPlace(Span* span, Length n, size_t objects_per_span,
+                     MemoryTag tag) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
   // Delete the span "[p, p+n-1]".
   // REQUIRES: span was returned by earlier call to New() with the same value of
   //           "tag" and has not yet been deleted.
@@ -61,6 +75,10 @@ class PageAllocator {
 
   BackingStats stats() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Stats of the page heap of one tag; empty for kCold without a cold heap.
+  BackingStats stats(MemoryTag tag) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   void GetSmallSpanStats(SmallSpanStats* result)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
@@ -76,6 +94,28 @@ class PageAllocator {
   Length ReleaseAtLeastNPages(Length num_pages)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Sets deferred release on every page heap; see
+  // PageAllocatorInterface::SetDeferredRelease().
+  void SetDeferredRelease(bool value)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Unbacks what every page heap queued while deferred release was set and
+  // returns the number of pages released.
+  Length ReleasePending() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Advises the idle free memory of every page heap; see
+  // PageAllocatorInterface::AdviseIdle().
+  Length AdviseIdle() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Collapses up to `limit` dense broken hugepages of each page heap; see
+  // PageAllocatorInterface::CollapseDense().
+  HugeLength CollapseDense(HugeLength limit)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Faults in n pages of normal memory, split over the NUMA partitions; see
+  // PageAllocatorInterface::Prefault().
+  Length Prefault(Length n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Prints stats about the page heap to *out.
   void Print(Printer* out, MemoryTag tag) ABSL_LOCKS_EXCLUDED(pageheap_lock);
   void PrintInPbtxt(PbtxtRegion* region, MemoryTag tag)
@@ -171,7 +211,10 @@ inline PageAllocatorInterface* PageAllocator::impl(MemoryTag tag) const {
 }
 
 inline Span* PageAllocator::New(Length n, size_t objects_per_span,
-                                MemoryTag tag) {
+                                MemoryTag tag, size_t size_class) {
+  if (size_class != 0) {
+    return impl(tag)->NewForSizeClass(n, objects_per_span, size_class);
+  }
   return impl(tag)->New(n, objects_per_span);
 }
 
@@ -180,6 +223,20 @@ inline Span* PageAllocator::NewAligned(Length n, Length align,
   return impl(tag)->NewAligned(n, align, objects_per_span);
 }
 
+inline Span* PageAllocator::NewAlignedKnownZero(Length n, Length align,
+                                                size_t objects_per_span,
+                                                MemoryTag tag,
+                                                bool* known_zero) {
+  return impl(tag)->NewAlignedKnownZero(n, align, objects_per_span,
+                                        known_zero);
+}
+
+inline bool PageAllocator::ResizeInPlace(Span* span, Length n,
+                                         size_t objects_per_span,
+                                         MemoryTag tag) {
+  return impl(tag)->ResizeInPlace(span, n, objects_per_span);
+}
+
 inline void PageAllocator::Delete(Span* span, size_t objects_per_span,
                                   MemoryTag tag) {
   impl(tag)->Delete(span, objects_per_span);
@@ -251,6 +308,62 @@ inline Length PageAllocator::ReleaseAtLeastNPages(Length num_pages) {
   return released;
 }
 
+inline void PageAllocator::SetDeferredRelease(bool value) {
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    normal_impl_[partition]->SetDeferredRelease(value);
+  }
+  sampled_impl_->SetDeferredRelease(value);
+  if (has_cold_impl_) {
+    cold_impl_->SetDeferredRelease(value);
+  }
+}
+
+inline Length PageAllocator::ReleasePending() {
+  Length released;
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    released += normal_impl_[partition]->ReleasePending();
+  }
+  released += sampled_impl_->ReleasePending();
+  if (has_cold_impl_) {
+    released += cold_impl_->ReleasePending();
+  }
+  return released;
+}
+
+inline Length PageAllocator::AdviseIdle() {
+  Length advised;
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    advised += normal_impl_[partition]->AdviseIdle();
+  }
+  advised += sampled_impl_->AdviseIdle();
+  if (has_cold_impl_) {
+    advised += cold_impl_->AdviseIdle();
+  }
+  return advised;
+}
+
+inline HugeLength PageAllocator::CollapseDense(HugeLength limit) {
+  HugeLength collapsed;
+  for (int partition = 0; partition < active_numa_partitions(); partition++) {
+    collapsed += normal_impl_[partition]->CollapseDense(limit);
+  }
+  collapsed += sampled_impl_->CollapseDense(limit);
+  if (has_cold_impl_) {
+    collapsed += cold_impl_->CollapseDense(limit);
+  }
+  return collapsed;
+}
+
+inline Length PageAllocator::Prefault(Length n) {
+  const int partitions = active_numa_partitions();
+  const Length per_partition = (n + Length(partitions - 1)) / partitions;
+  Length faulted;
+  for (int partition = 0; partition < partitions; partition++) {
+    faulted += normal_impl_[partition]->Prefault(per_partition);
+  }
+  return faulted;
+}
+
 inline void PageAllocator::Print(Printer* out, MemoryTag tag) {
   if (tag == MemoryTag::kCold && !has_cold_impl_) {
     return;
@@ -292,6 +405,11 @@ inline int64_t PageAllocator::limit_hits() const {
   return limit_hits_;
 }
 
+inline BackingStats PageAllocator::stats(MemoryTag tag) const {
+  if (tag == MemoryTag::kCold && !has_cold_impl_) return BackingStats();
+  return impl(tag)->stats();
+}
+
 inline const PageAllocInfo& PageAllocator::info(MemoryTag tag) const {
   return impl(tag)->info();
 }
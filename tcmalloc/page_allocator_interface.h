@@ -23,6 +23,7 @@
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/thread_annotations.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/huge_pages.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stats.h"
 
@@ -44,17 +45,44 @@ class PageAllocatorInterface {
   virtual Span* New(Length n, size_t objects_per_span)
       ABSL_LOCKS_EXCLUDED(pageheap_lock) = 0;
 
+  // As New, for a span of size class size_class.  Allocators may keep the
+  // spans of one size class together; others ignore it.
+  virtual Span* NewForSizeClass(Length n, size_t objects_per_span,
+                                size_t size_class)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+    return New(n, objects_per_span);
+  }
+
   // As New, but the returned span is aligned to a <align>-page boundary.
   // <align> must be a power of two.
   virtual Span* NewAligned(Length n, Length align, size_t objects_per_span)
       ABSL_LOCKS_EXCLUDED(pageheap_lock) = 0;
 
+  // As NewAligned, and sets *known_zero if the whole span is known to read as
+  // zeroes, as memory fresh from the system or released back to it does.
+  // Allocators that do not track it always report false.
+  virtual Span* NewAlignedKnownZero(Length n, Length align,
+                                    size_t objects_per_span, bool* known_zero)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+    *known_zero = false;
+    return NewAligned(n, align, objects_per_span);
+  }
+
   // Delete the span "[p, p+n-1]".
   // REQUIRES: span was returned by earlier call to New() and
   //           has not yet been deleted.
   virtual void Delete(Span* span, size_t objects_per_span)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) = 0;
 
+  // Grows or shrinks span to "n" pages without moving it, and sets the page
+  // map of the pages it gains or loses.  Returns false, changing nothing, if
+  // that is not possible; allocators that do not support it always do.
+  // REQUIRES: as Delete().
+  virtual bool ResizeInPlace(Span* span, Length n, size_t objects_per_span)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+    return false;
+  }
+
   virtual BackingStats stats() const
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) = 0;
 
@@ -73,6 +101,42 @@ class PageAllocatorInterface {
   virtual Length ReleaseAtLeastNPages(Length num_pages)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) = 0;
 
+  // While set, memory the allocator would unback on Delete() is queued for
+  // ReleasePending() instead.  Allocators that do not queue ignore it.
+  virtual void SetDeferredRelease(bool value)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {}
+
+  // Unbacks the memory queued while deferred release was set.  Returns the
+  // number of pages released.
+  virtual Length ReleasePending()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return Length(0);
+  }
+
+  // Hints the kernel about free memory that stays unused: memory idle for a
+  // while is advised cold, and memory idle for longer is paged out, ahead of
+  // its release.  Returns the number of pages advised.
+  virtual Length AdviseIdle() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return Length(0);
+  }
+
+  // Asks the kernel to collapse back into transparent hugepages up to
+  // `limit` hugepages that subrelease broke and that are densely used again.
+  // May drop pageheap_lock.  Returns the number of hugepages collapsed.
+  virtual HugeLength CollapseDense(HugeLength limit)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return NHugePages(0);
+  }
+
+  // Maps and faults in at least n pages of free memory ahead of their first
+  // use, so that early allocations do not take the faults.  Returns the
+  // number of pages faulted in; allocators that cannot keep free memory
+  // backed return 0.
+  virtual Length Prefault(Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return Length(0);
+  }
+
   // Prints stats about the page heap to *out.
   virtual void Print(Printer* out) ABSL_LOCKS_EXCLUDED(pageheap_lock) = 0;
 
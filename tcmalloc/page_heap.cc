@@ -200,24 +200,29 @@ Span* PageHeap::NewAligned(Length n, Length align, size_t objects_per_span) {
 
 Span* PageHeap::AllocLarge(Length n, bool* from_returned) {
   // find the best span (closest to n in size).
-  // The following loops implements address-ordered best-fit.
+  // The following loops implements address-ordered best-fit.  Every span of
+  // a later bucket is longer than those of an earlier one, so the search
+  // stops at the first bucket with a span of n pages or more.
   Span* best = nullptr;
 
-  // Search through normal list
-  for (Span* span : large_.normal) {
-    ASSERT(span->location() == Span::ON_NORMAL_FREELIST);
-    if (IsSpanBetter(span, best, n)) {
-      best = span;
-      *from_returned = false;
+  for (size_t b = NextLarge(LargeBucket(n));
+       best == nullptr && b < kLargeBuckets; b = NextLarge(b + 1)) {
+    // Search through normal list
+    for (Span* span : large_[b].normal) {
+      ASSERT(span->location() == Span::ON_NORMAL_FREELIST);
+      if (IsSpanBetter(span, best, n)) {
+        best = span;
+        *from_returned = false;
+      }
     }
-  }
 
-  // Search through released list in case it has a better fit
-  for (Span* span : large_.returned) {
-    ASSERT(span->location() == Span::ON_RETURNED_FREELIST);
-    if (IsSpanBetter(span, best, n)) {
-      best = span;
-      *from_returned = true;
+    // Search through released list in case it has a better fit
+    for (Span* span : large_[b].returned) {
+      ASSERT(span->location() == Span::ON_RETURNED_FREELIST);
+      if (IsSpanBetter(span, best, n)) {
+        best = span;
+        *from_returned = true;
+      }
     }
   }
 
@@ -280,8 +285,8 @@ void PageHeap::Delete(Span* span, size_t objects_per_span) {
   ASSERT(pagemap_->GetDescriptor(span->last_page()) == span);
   span->set_location(Span::ON_NORMAL_FREELIST);
 
-  // destroy escape list of the span
-  span->DestroyEscape();
+  // destroy escape list of the span, unless the caller already did
+  span->DestroyEscapeLocked();
   span->obj_size = span->objects_per_span = 0;
   MergeIntoFreeList(span);  // Coalesces if possible
   ASSERT(Check());
@@ -327,11 +332,19 @@ void PageHeap::MergeIntoFreeList(Span* span) {
   PrependToFreeList(span);
 }
 
+PageHeap::SpanListPair* PageHeap::FreeListFor(Span* span) {
+  if (span->num_pages() < kMaxPages) {
+    return &free_[span->num_pages().raw_num()];
+  }
+  return &large_[LargeBucket(span->num_pages())];
+}
+
 void PageHeap::PrependToFreeList(Span* span) {
   ASSERT(span->location() != Span::IN_USE);
-  SpanListPair* list = (span->num_pages() < kMaxPages)
-                           ? &free_[span->num_pages().raw_num()]
-                           : &large_;
+  SpanListPair* list = FreeListFor(span);
+  if (span->num_pages() >= kMaxPages) {
+    large_nonempty_.SetBit(LargeBucket(span->num_pages()));
+  }
   if (span->location() == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes += span->bytes_in_span();
     list->normal.prepend(span);
@@ -343,9 +356,7 @@ void PageHeap::PrependToFreeList(Span* span) {
 
 void PageHeap::RemoveFromFreeList(Span* span) {
   ASSERT(span->location() != Span::IN_USE);
-  SpanListPair* list = (span->num_pages() < kMaxPages)
-                           ? &free_[span->num_pages().raw_num()]
-                           : &large_;
+  SpanListPair* list = FreeListFor(span);
   if (span->location() == Span::ON_NORMAL_FREELIST) {
     stats_.free_bytes -= span->bytes_in_span();
     list->normal.remove(span);
@@ -353,6 +364,18 @@ void PageHeap::RemoveFromFreeList(Span* span) {
     stats_.unmapped_bytes -= span->bytes_in_span();
     list->returned.remove(span);
   }
+  if (span->num_pages() >= kMaxPages && list->normal.empty() &&
+      list->returned.empty()) {
+    large_nonempty_.ClearBit(LargeBucket(span->num_pages()));
+  }
+}
+
+PageHeap::SpanListPair* PageHeap::LongestNormalLarge() {
+  for (ssize_t b = large_nonempty_.FindSetBackwards(kLargeBuckets - 1);
+       b >= 0; b = b > 0 ? large_nonempty_.FindSetBackwards(b - 1) : -1) {
+    if (!large_[b].normal.empty()) return &large_[b];
+  }
+  return nullptr;
 }
 
 Length PageHeap::ReleaseLastNormalSpan(SpanListPair* slist) {
@@ -396,7 +419,8 @@ Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
   Length prev_released_pages = Length::max() + Length(1);
 
   // Round robin through the lists of free spans, releasing the last
-  // span in each list.  Stop after releasing at least num_pages.
+  // span in each list, and for the large spans the last one of the longest
+  // bucket.  Stop after releasing at least num_pages.
   while (released_pages < num_pages) {
     if (released_pages == prev_released_pages) {
       // Last iteration of while loop made no progress.
@@ -408,9 +432,9 @@ Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
          i++, release_index_++) {
       if (release_index_ > kMaxPages.raw_num()) release_index_ = 0;
       SpanListPair* slist = (release_index_ == kMaxPages.raw_num())
-                                ? &large_
+                                ? LongestNormalLarge()
                                 : &free_[release_index_];
-      if (!slist->normal.empty()) {
+      if (slist != nullptr && !slist->normal.empty()) {
         Length released_len = ReleaseLastNormalSpan(slist);
         released_pages += released_len;
       }
@@ -431,13 +455,15 @@ void PageHeap::GetLargeSpanStats(LargeSpanStats* result) {
   result->spans = 0;
   result->normal_pages = Length(0);
   result->returned_pages = Length(0);
-  for (Span* s : large_.normal) {
-    result->normal_pages += s->num_pages();
-    result->spans++;
-  }
-  for (Span* s : large_.returned) {
-    result->returned_pages += s->num_pages();
-    result->spans++;
+  for (size_t b = NextLarge(0); b < kLargeBuckets; b = NextLarge(b + 1)) {
+    for (Span* s : large_[b].normal) {
+      result->normal_pages += s->num_pages();
+      result->spans++;
+    }
+    for (Span* s : large_[b].returned) {
+      result->returned_pages += s->num_pages();
+      result->spans++;
+    }
   }
 }
 
@@ -505,7 +531,9 @@ void PageHeap::PrintInPbtxt(PbtxtRegion* region) {
   for (int s = 0; s < kMaxPages.raw_num(); ++s) {
     Helper::RecordAges(&ages, free_[s]);
   }
-  Helper::RecordAges(&ages, large_);
+  for (size_t b = NextLarge(0); b < kLargeBuckets; b = NextLarge(b + 1)) {
+    Helper::RecordAges(&ages, large_[b]);
+  }
   PrintStatsInPbtxt(region, small, large, ages);
   // We do not collect info_.PrintInPbtxt for now.
 }
@@ -534,7 +562,9 @@ void PageHeap::Print(Printer* out) {
   for (int s = 0; s < kMaxPages.raw_num(); ++s) {
     Helper::RecordAges(&ages, free_[s]);
   }
-  Helper::RecordAges(&ages, large_);
+  for (size_t b = NextLarge(0); b < kLargeBuckets; b = NextLarge(b + 1)) {
+    Helper::RecordAges(&ages, large_[b]);
+  }
   ages.Print("PageHeap", out);
 
   info_.Print(out);
@@ -18,7 +18,9 @@
 #include <stdint.h>
 
 #include "absl/base/thread_annotations.h"
+#include "absl/numeric/bits.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/internal/range_tracker.h"
 #include "tcmalloc/page_allocator_interface.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stats.h"
@@ -95,8 +97,36 @@ class PageHeap final : public PageAllocatorInterface {
     SpanList returned;
   };
 
-  // List of free spans of length >= kMaxPages
-  SpanListPair large_ ABSL_GUARDED_BY(pageheap_lock);
+  // Free spans of length >= kMaxPages are bucketed by length: every power of
+  // two is split into kLargeSubBuckets buckets of equal width, the last
+  // bucket taking whatever is longer than the address space.  Lengths only
+  // grow with the bucket, so a best fit looks at most at the bucket of n and
+  // the next nonempty one, which large_nonempty_ finds.
+  static constexpr int kLargeSubBits = 3;
+  static constexpr size_t kLargeSubBuckets = size_t{1} << kLargeSubBits;
+  static constexpr int kLargeMinLog = absl::bit_width(kMaxPages.raw_num()) - 1;
+  static constexpr size_t kLargeBuckets =
+      (kAddressBits - kPageShift - kLargeMinLog) * kLargeSubBuckets;
+
+  // Returns the bucket of spans of length n, 0 for n < kMaxPages.
+  static size_t LargeBucket(Length n) {
+    if (n < kMaxPages) return 0;
+    const int log = absl::bit_width(n.raw_num()) - 1;
+    const int shift = log > kLargeSubBits ? log - kLargeSubBits : 0;
+    const size_t bucket = (log - kLargeMinLog) * kLargeSubBuckets +
+                          ((n.raw_num() >> shift) & (kLargeSubBuckets - 1));
+    return bucket < kLargeBuckets ? bucket : kLargeBuckets - 1;
+  }
+
+  SpanListPair large_[kLargeBuckets] ABSL_GUARDED_BY(pageheap_lock);
+  // Bit i is set if large_[i] holds any span.
+  Bitmap<kLargeBuckets> large_nonempty_ ABSL_GUARDED_BY(pageheap_lock);
+
+  // Returns the first bucket from b on that holds a span, or kLargeBuckets.
+  size_t NextLarge(size_t b) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    return b < kLargeBuckets ? large_nonempty_.FindSet(b) : kLargeBuckets;
+  }
 
   // Array mapping from span length to a doubly linked list of free spans
   SpanListPair free_[kMaxPages.raw_num()] ABSL_GUARDED_BY(pageheap_lock);
@@ -144,6 +174,14 @@ class PageHeap final : public PageAllocatorInterface {
   Length ReleaseLastNormalSpan(SpanListPair* slist)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Returns the list pair that holds span, or would.
+  SpanListPair* FreeListFor(Span* span)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Returns the longest bucket of large spans with a normal span, or nullptr.
+  SpanListPair* LongestNormalLarge()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
   // Do invariant testing.
   bool Check() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
@@ -17,13 +17,18 @@
 
 #include <stddef.h>
 
+#include <algorithm>
+#include <atomic>
+
 #include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
 #include "absl/base/internal/spinlock.h"
 #include "tcmalloc/arena.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -60,7 +65,8 @@ class PageHeapAllocator {
     stats_.in_use++;
     if (ABSL_PREDICT_FALSE(result == nullptr)) {
       stats_.total++;
-      return reinterpret_cast<T*>(arena_->Alloc(sizeof(T)));
+      return reinterpret_cast<T*>(
+          arena_->Alloc(sizeof(T), std::max(alignof(T), size_t{kAlignment})));
     }
     free_list_ = *(reinterpret_cast<T**>(free_list_));
     return result;
@@ -87,6 +93,86 @@ class PageHeapAllocator {
   AllocatorStats stats_ ABSL_GUARDED_BY(pageheap_lock);
 };
 
+// Per-CPU caches in front of a PageHeapAllocator, for callers that do not
+// hold pageheap_lock otherwise: they take it once per kBatch objects.  An
+// object may be freed through either allocator, whichever it came from.
+// Cached objects count as in use in the stats of the PageHeapAllocator.
+template <class T>
+class ShardedPageHeapAllocator {
+ public:
+  static constexpr size_t kShards = 64;
+  static constexpr size_t kBatch = 16;
+  static constexpr size_t kMaxCached = 2 * kBatch;
+
+  constexpr explicit ShardedPageHeapAllocator(PageHeapAllocator<T>* allocator)
+      : allocator_(allocator), cached_(0) {}
+
+  ABSL_ATTRIBUTE_RETURNS_NONNULL T* New() ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+    Shard& s = shards_[ShardIndex()];
+    absl::base_internal::SpinLockHolder h(&s.lock);
+    if (ABSL_PREDICT_FALSE(s.head == nullptr)) Refill(&s);
+    void* result = s.head;
+    s.head = *static_cast<void**>(result);
+    s.count--;
+    cached_.fetch_sub(1, std::memory_order_relaxed);
+    return static_cast<T*>(result);
+  }
+
+  void Delete(T* p) ABSL_ATTRIBUTE_NONNULL()
+      ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+    Shard& s = shards_[ShardIndex()];
+    absl::base_internal::SpinLockHolder h(&s.lock);
+    *reinterpret_cast<void**>(p) = s.head;
+    s.head = p;
+    s.count++;
+    cached_.fetch_add(1, std::memory_order_relaxed);
+    if (ABSL_PREDICT_FALSE(s.count > kMaxCached)) Drain(&s, kBatch);
+  }
+
+  // Objects sitting in the caches.  Needs no lock.
+  size_t cached() const { return cached_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Shard {
+    absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    void* head ABSL_GUARDED_BY(lock) = nullptr;
+    size_t count ABSL_GUARDED_BY(lock) = 0;
+  };
+
+  static size_t ShardIndex() {
+    const int id = subtle::percpu::GetCurrentConcurrencyId();
+    return id < 0 ? 0 : static_cast<size_t>(id) % kShards;
+  }
+
+  // The shard lock is taken before pageheap_lock, never after it.
+  void Refill(Shard* s) ABSL_EXCLUSIVE_LOCKS_REQUIRED(s->lock) {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    for (size_t i = 0; i < kBatch; ++i) {
+      void* p = allocator_->New();
+      *static_cast<void**>(p) = s->head;
+      s->head = p;
+    }
+    s->count += kBatch;
+    cached_.fetch_add(kBatch, std::memory_order_relaxed);
+  }
+
+  void Drain(Shard* s, size_t n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(s->lock) {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    for (size_t i = 0; i < n; ++i) {
+      void* p = s->head;
+      s->head = *static_cast<void**>(p);
+      allocator_->Delete(static_cast<T*>(p));
+    }
+    s->count -= n;
+    cached_.fetch_sub(n, std::memory_order_relaxed);
+  }
+
+  PageHeapAllocator<T>* const allocator_;
+  std::atomic<size_t> cached_;
+  Shard shards_[kShards];
+};
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
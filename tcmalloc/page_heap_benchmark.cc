@@ -0,0 +1,85 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The latency of a large allocation from the legacy PageHeap, the page
+// allocator of builds without the HugePageAwareAllocator, against how
+// fragmented its large free spans are.  BM_AllocLarge leaves state.range(0)
+// free spans of random lengths in [kMaxPages, 2 * kMaxPages) between one
+// page guards, so none of them coalesce, and then allocates and frees a span
+// of 1.5 * kMaxPages, which a best fit must find among them.  The length
+// buckets keep the search to the spans of one bucket, an eighth of the
+// fragments here, where a single list of large spans was walked end to end.
+
+#include <stdlib.h>
+
+#include <new>
+#include <vector>
+
+#include "absl/base/internal/spinlock.h"
+#include "absl/memory/memory.h"
+#include "absl/random/random.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/page_heap.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+void Delete(PageHeap* ph, Span* s) ABSL_LOCKS_EXCLUDED(pageheap_lock) {
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  ph->Delete(s, 1);
+}
+
+void BM_AllocLarge(benchmark::State& state) {
+  tc_globals.InitIfNecessary();
+  const size_t fragments = state.range(0);
+  auto pagemap = absl::make_unique<PageMap>();
+  void* memory = calloc(1, sizeof(PageHeap));
+  PageHeap* ph = new (memory) PageHeap(pagemap.get(), MemoryTag::kNormal);
+
+  absl::BitGen rng;
+  std::vector<Span*> holes, guards;
+  for (size_t i = 0; i < fragments; ++i) {
+    const Length n =
+        kMaxPages + Length(absl::Uniform<size_t>(rng, 0, kMaxPages.raw_num()));
+    holes.push_back(ph->New(n, 1));
+    guards.push_back(ph->New(Length(1), 1));
+    CHECK_CONDITION(holes.back() != nullptr && guards.back() != nullptr);
+  }
+  for (Span* s : holes) Delete(ph, s);
+
+  const Length n = kMaxPages + kMaxPages / 2;
+  for (auto _ : state) {
+    Span* s = ph->New(n, 1);
+    benchmark::DoNotOptimize(s);
+    Delete(ph, s);
+  }
+  state.SetItemsProcessed(state.iterations());
+
+  for (Span* s : guards) Delete(ph, s);
+  // The heap's memory stays mapped, as in page_heap_test.
+  free(memory);
+}
+
+BENCHMARK(BM_AllocLarge)->RangeMultiplier(4)->Range(1, 2048);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <new>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "absl/base/internal/spinlock.h"
@@ -107,6 +108,50 @@ TEST_F(PageHeapTest, Stats) {
   free(memory);
 }
 
+// Large spans of many lengths, kept apart by one page guards, share and
+// straddle the length buckets; every allocation must still take the shortest
+// one that fits.  The spans are longer than what is left over of a system
+// allocation, so nothing else can fit better.
+TEST_F(PageHeapTest, LargeBestFit) {
+  auto pagemap = absl::make_unique<PageMap>();
+  void* memory = calloc(1, sizeof(PageHeap));
+  PageHeap* ph = new (memory) PageHeap(pagemap.get(), MemoryTag::kNormal);
+
+  constexpr int kSpans = 40;
+  constexpr Length kBase =
+      kMaxPages > kMinSpanLength ? kMaxPages : kMinSpanLength;
+  const auto length = [=](int i) { return kBase + Length(i * 7); };
+  std::vector<Span*> spans, guards;
+  for (int i = 0; i < kSpans; ++i) {
+    spans.push_back(ph->New(length(i), 1));
+    guards.push_back(ph->New(Length(1), 1));
+  }
+  std::vector<PageId> first(kSpans);
+  for (int i = 0; i < kSpans; ++i) {
+    first[i] = spans[i]->first_page();
+    Delete(ph, spans[i], 1);
+  }
+
+  // Take them back starting from the longest, asking for a little more than
+  // the next shorter one.
+  for (int i = kSpans - 1; i > 0; --i) {
+    Span* s = ph->New(length(i - 1) + Length(1), 1);
+    ASSERT_NE(s, nullptr);
+    EXPECT_EQ(s->first_page(), first[i]) << i;
+    EXPECT_EQ(s->num_pages(), length(i - 1) + Length(1));
+    spans[i] = s;
+  }
+  Span* s = ph->New(length(0), 1);
+  EXPECT_EQ(s->first_page(), first[0]);
+  spans[0] = s;
+
+  for (int i = 0; i < kSpans; ++i) {
+    Delete(ph, spans[i], 1);
+    Delete(ph, guards[i], 1);
+  }
+  free(memory);
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -16,39 +16,200 @@
 
 #include <sys/mman.h>
 
+#include <algorithm>
+
+#include "tcmalloc/chunk_cache.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/escape_span_cache.h"
+#include "tcmalloc/flat_page_info.h"
+#include "tcmalloc/parameters.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/static_vars.h"
+#include "tcmalloc/system-alloc.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
+namespace {
+
+// Copies the page info word of the n pages from p to the flat mirror of the
+// heap reservation, if there is one.
+inline void MirrorPageInfo(PageId p, Length n, uintptr_t word) {
+#ifdef FLAT_PAGE_INFO
+  FlatPageInfo::Fill(p.index(), n.raw_num(), word);
+#endif
+}
+
+#ifdef SAMPLED_ESCAPE_SPANS
+ABSL_CONST_INIT std::atomic<uint64_t> escape_span_seq{0};
+
+// Returns info, marked untracked unless the span registered at `first` is
+// picked for escape tracking: each span is, with a probability of one in
+// Parameters::escape_span_sample_period().
+template <typename Info>
+Info SampleEscapeTracking(PageId first, Info info) {
+  const int64_t period = Parameters::escape_span_sample_period();
+  if (period <= 1) return info;
+  // splitmix64 of the span and a sequence number, so a slot that is
+  // registered again is not always picked the same way.
+  uint64_t h = first.index() ^
+               (escape_span_seq.fetch_add(1, std::memory_order_relaxed) +
+                0x9E3779B97F4A7C15ull);
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+  h ^= h >> 31;
+  if (h % static_cast<uint64_t>(period) == 0) return info;
+  return Info(info.word() | Info::kUntracked);
+}
+#else
+template <typename Info>
+Info SampleEscapeTracking(PageId, Info info) {
+  return info;
+}
+#endif
+
+}  // namespace
 
 void PageMap::RegisterSizeClass(Span* span, size_t sc) {
   ASSERT(span->location() == Span::IN_USE);
   const PageId first = span->first_page();
-  const PageId last = span->last_page();
+  const Length n = span->num_pages();
   ASSERT(GetDescriptor(first) == span);
-  for (PageId p = first; p <= last; ++p) {
-    map_.set_with_sizeclass(p.index(), span, sc);
-  }
-  span->obj_size = tc_globals.sizemap().class_to_size(sc) / 8;
-  size_t span_size =
-          Length(tc_globals.sizemap().class_to_pages(sc)).in_bytes();
-  span->objects_per_span = span_size/(span->obj_size*8ULL);
+  ASSERT(n == Length(tc_globals.sizemap().class_to_pages(sc)));
+  const size_t obj_size = tc_globals.sizemap().class_to_size(sc);
+  const Info info =
+      SampleEscapeTracking(first, Info::Make(first.index(), sc, obj_size));
+  // Every page of the span gets the same word, so this is a fill rather
+  // than a store per page.
+  map_.set_range_with_sizeclass(first.index(), n.raw_num(), span, info);
+  MirrorPageInfo(first, n, info.word());
+  span->obj_size = obj_size / 8;
+  span->set_pointer_free(IsPointerFreeSizeClass(sc));
+  span->objects_per_span = n.in_bytes() / obj_size;
 }
 
 void PageMap::UnregisterSizeClass(Span* span) {
   ASSERT(span->location() == Span::IN_USE);
   const PageId first = span->first_page();
-  const PageId last = span->last_page();
+  const Length n = span->num_pages();
   ASSERT(GetDescriptor(first) == span);
+  map_.set_range_page_info(first.index(), n.raw_num(), Info());
+  MirrorPageInfo(first, n, 0);
+  // objects_per_span is kept until the span's escape table is released.
+  span->obj_size = 0;
+  span->set_pointer_free(false);
+#ifdef CHUNK_CACHE
+  ChunkCache::Invalidate(first.start_uintptr(), (first + n).start_uintptr());
+#endif
+#ifdef ESCAPE_SPAN_CACHE
+  EscapeSpanCache::Invalidate();
+#endif
+}
+
+void PageMap::RegisterObjectSize(Span* span) {
+  ASSERT(span->location() == Span::IN_USE);
+  const PageId first = span->first_page();
+  const Length n = span->num_pages();
+  ASSERT(GetDescriptor(first) == span);
+  ASSERT(sizeclass(first) == 0);
+  const Info info = SampleEscapeTracking(
+      first, Info::Make(first.index(), 0, span->object_bytes()));
+  map_.set_range_page_info(first.index(), n.raw_num(), info);
+  MirrorPageInfo(first, n, info.word());
+}
+
+void PageMap::UnregisterObjectSize(Span* span) {
+  const PageId first = span->first_page();
+  const Length n = span->num_pages();
+  map_.set_range_page_info(first.index(), n.raw_num(), Info());
+  MirrorPageInfo(first, n, 0);
+#ifdef CHUNK_CACHE
+  ChunkCache::Invalidate(first.start_uintptr(), (first + n).start_uintptr());
+#endif
+#ifdef ESCAPE_SPAN_CACHE
+  EscapeSpanCache::Invalidate();
+#endif
+}
+
+void PageMap::ResizeObject(Span* span, Length old_n) {
+  ASSERT(span->location() == Span::IN_USE);
+  const PageId first = span->first_page();
+  const Length n = span->num_pages();
+  ASSERT(GetDescriptor(first) == span);
+  ASSERT(sizeclass(first) == 0);
+  const uintptr_t state =
+      get_page_info(first).word() & (Info::kHasEscapes | Info::kUntracked);
+  const Info info(Info::Make(first.index(), 0, span->object_bytes()).word() |
+                  state);
+  map_.set_range_page_info(first.index(), n.raw_num(), info);
+  MirrorPageInfo(first, n, info.word());
+  if (n < old_n) {
+    map_.set_range_page_info((first + n).index(), (old_n - n).raw_num(),
+                             Info());
+    MirrorPageInfo(first + n, old_n - n, 0);
+  }
+#ifdef CHUNK_CACHE
+  ChunkCache::Invalidate(first.start_uintptr(),
+                         (first + std::max(n, old_n)).start_uintptr());
+#endif
+#ifdef ESCAPE_SPAN_CACHE
+  EscapeSpanCache::Invalidate();
+#endif
+}
+
+void PageMap::MarkEscapes(Span* span) {
+  ASSERT(span->location() == Span::IN_USE);
+  const PageId first = span->first_page();
+  const PageId last = span->last_page();
   for (PageId p = first; p <= last; ++p) {
-    map_.clear_sizeclass(p.index());
+    map_.set_has_escapes(p.index());
+#ifdef FLAT_PAGE_INFO
+    FlatPageInfo::Or(p.index(), Info::kHasEscapes);
+#endif
+  }
+}
+
+#ifdef EXTERNAL_REGIONS
+bool PageMap::RegisterExternalRegion(PageId first, Length n,
+                                     size_t element_size) {
+  if (n == Length(0) || element_size == 0 || element_size % 8 != 0) {
+    return false;
+  }
+  // Ensure() also fails for pages past the address bits.
+  if (!Ensure(first, n)) return false;
+  const Info info = Info::Make(first.index(), 0, element_size);
+  if (info.object_size() != element_size) return false;
+  for (PageId p = first; p < first + n; ++p) {
+    if (GetDescriptor(p) != nullptr || get_page_info(p).word() != 0) {
+      return false;
+    }
   }
-  span->obj_size = span->objects_per_span = 0;
+  map_.set_range_page_info(first.index(), n.raw_num(), info);
+  MirrorPageInfo(first, n, info.word());
+  return true;
 }
 
+bool PageMap::UnregisterExternalRegion(PageId first, Length n) {
+  if (n == Length(0)) return false;
+  // Spans without a size class have the same kind of word, but a Span.
+  auto in_region = [&](PageId p) {
+    const Info info = get_page_info(p);
+    return info.word() != 0 && info.size_class() == 0 &&
+           info.first_page() == first.index() && GetDescriptor(p) == nullptr;
+  };
+  for (PageId p = first; p < first + n; ++p) {
+    if (!in_region(p)) return false;
+  }
+  if (in_region(first + n)) return false;
+  map_.set_range_page_info(first.index(), n.raw_num(), Info());
+  MirrorPageInfo(first, n, 0);
+#ifdef CHUNK_CACHE
+  ChunkCache::Invalidate(first.start_uintptr(), (first + n).start_uintptr());
+#endif
+  return true;
+}
+#endif  // EXTERNAL_REGIONS
+
 void PageMap::MapRootWithSmallPages() {
   constexpr size_t kHugePageMask = ~(kHugePageSize - 1);
   uintptr_t begin = reinterpret_cast<uintptr_t>(map_.RootAddress());
@@ -69,9 +230,50 @@ void PageMap::MapRootWithSmallPages() {
   }
 }
 
+#ifdef PAGEMAP_HUGE_LEAVES
+namespace {
+
+// Regions the page map nodes are carved from.  Each is reserved huge page
+// aligned and advised onto huge pages, so a leaf (512KiB with 8KiB pages)
+// sits in one or two huge pages instead of 128 small ones, and the bounds
+// checks that read page info words all over a large heap hit few TLB
+// entries.  Only the pages the nodes touch become resident.
+constexpr size_t kHugeLeafRegion = 8 * kHugePageSize;
+
+char* huge_leaf_area ABSL_GUARDED_BY(pageheap_lock) = nullptr;
+size_t huge_leaf_avail ABSL_GUARDED_BY(pageheap_lock) = 0;
+size_t huge_leaf_bytes ABSL_GUARDED_BY(pageheap_lock) = 0;
+
+}  // namespace
+
+void* MetaDataAlloc(size_t bytes) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  bytes = (bytes + kAlignment - 1) & ~(kAlignment - 1);
+  if (huge_leaf_avail < bytes) {
+    const size_t ask = std::max(
+        kHugeLeafRegion, (bytes + kHugePageSize - 1) & ~(kHugePageSize - 1));
+    auto [ptr, actual_size] =
+        SystemAlloc(ask, kHugePageSize, MemoryTag::kNormal);
+    // Ensure() fails cleanly when no node can be had.
+    if (ptr == nullptr) return nullptr;
+    madvise(ptr, actual_size, MADV_HUGEPAGE);
+    huge_leaf_area = static_cast<char*>(ptr);
+    huge_leaf_avail = actual_size;
+  }
+  void* result = huge_leaf_area;
+  huge_leaf_area += bytes;
+  huge_leaf_avail -= bytes;
+  huge_leaf_bytes += bytes;
+  return result;
+}
+
+size_t MetaDataHugeBytes() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  return huge_leaf_bytes;
+}
+#else
 void* MetaDataAlloc(size_t bytes) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
   return tc_globals.arena().Alloc(bytes);
 }
+#endif  // PAGEMAP_HUGE_LEAVES
 
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
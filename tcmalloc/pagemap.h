@@ -29,6 +29,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <algorithm>
+#include <limits>
 #include <optional>
 #include <vector>
 
@@ -38,6 +40,7 @@
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/malloc_tracing_extension.h"
 #include "tcmalloc/pages.h"
+#include "tcmalloc/pointer_tag.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/static_vars.h"
 
@@ -48,6 +51,99 @@ namespace tcmalloc_internal {
 // Two-level radix tree
 typedef void* (*PagemapAllocator)(size_t);
 void* MetaDataAlloc(size_t bytes);
+#ifdef PAGEMAP_HUGE_LEAVES
+// Bytes MetaDataAlloc() has handed out from its huge page regions, which do
+// not come from the arena.
+size_t MetaDataHugeBytes();
+#endif
+
+// The page info word the leaves of a page map keep for every page.  It packs,
+// from the low bits up, the size class, the first page of the span (BITS
+// wide) and the object size in 8 byte units.  When the top bit (kPageUnits)
+// is set, the object size counts pages instead, which is how large spans too
+// big for byte units are described.  An object size of zero means it is
+// unknown (or too large to fit even in pages), and the Span has to be
+// consulted; see Span::object_bytes() for objects past 32 GiB.  Bounds
+// checks thus find the chunk containing an address with a single load.
+//
+// The bit below it (kHasEscapes) is set on every page of a span once the
+// span gets an escape table (or an outgoing escape index, see
+// Span::escape_slots), so free() of an object whose span never had escapes
+// skips the Span entirely.  Registering or unregistering the span
+// rewrites the word and clears it.
+//
+// The bit below that (kUntracked) is set on every page of a span registered
+// without escape tracking (see SAMPLED_ESCAPE_SPANS), so that __escape()
+// into it returns after one load.
+//
+// The word format is also read by instrumented code through
+// TCMallocInlineCheckLayout, so it must not change without bumping
+// TCMALLOC_INLINE_CHECK_VERSION.
+template <int BITS>
+class PageInfo {
+ public:
+  static constexpr int kClassBits = sizeof(CompactSizeClass) * 8;
+  static constexpr uintptr_t kClassMask = (uintptr_t{1} << kClassBits) - 1;
+  static constexpr int kSizeShift = kClassBits + BITS;
+  static_assert(kSizeShift < 61, "no room for the object size");
+  static constexpr uintptr_t kFirstPageMask =
+      ((uintptr_t{1} << kSizeShift) - 1) & ~kClassMask;
+  static constexpr uintptr_t kPageUnits = uintptr_t{1} << 63;
+  static constexpr uintptr_t kHasEscapes = uintptr_t{1} << 62;
+  static constexpr uintptr_t kUntracked = uintptr_t{1} << 61;
+  static constexpr uintptr_t kUnitsMask =
+      ~(kPageUnits | kHasEscapes | kUntracked);
+  static constexpr size_t kMaxUnits = (size_t{1} << (61 - kSizeShift)) - 1;
+  static constexpr size_t kMaxSize = kMaxUnits << 3;
+  static constexpr size_t kMaxPages = kMaxUnits;
+
+  constexpr PageInfo() : word_(0) {}
+  constexpr explicit PageInfo(uintptr_t word) : word_(word) {}
+
+  // The page info of the pages of a span starting at page `first`, with
+  // objects of obj_size bytes in size class sc (0 for spans without one).
+  static PageInfo Make(uintptr_t first, CompactSizeClass sc, size_t obj_size) {
+    ASSERT(first >> BITS == 0);
+    ASSERT(obj_size % 8 == 0);
+    uintptr_t word = (first << kClassBits) | sc;
+    if (obj_size <= kMaxSize) {
+      word |= (obj_size >> 3) << kSizeShift;
+    } else if (sc == 0 && obj_size % kPageSize == 0 &&
+               (obj_size >> kPageShift) <= kMaxPages) {
+      word |= kPageUnits | (obj_size >> kPageShift) << kSizeShift;
+    }
+    return PageInfo(word);
+  }
+
+  uintptr_t word() const { return word_; }
+
+  // Size class of the span, 0 for large spans and unregistered pages.
+  CompactSizeClass size_class() const {
+    return static_cast<CompactSizeClass>(word_ & kClassMask);
+  }
+
+  // First page of the span, if the word was set for one.
+  uintptr_t first_page() const {
+    return (word_ & kFirstPageMask) >> kClassBits;
+  }
+
+  // Address of the first page of the span.
+  uintptr_t span_start() const { return first_page() << kPageShift; }
+
+  // Object size recorded by Make(), 0 if the Span has to be read.
+  size_t object_size() const {
+    const size_t units = (word_ & kUnitsMask) >> kSizeShift;
+    return units << (word_ & kPageUnits ? kPageShift : 3);
+  }
+
+  bool has_escapes() const { return word_ & kHasEscapes; }
+
+  // Whether escapes into the span are ignored.
+  bool untracked() const { return word_ & kUntracked; }
+
+ private:
+  uintptr_t word_;
+};
 
 template <int BITS, PagemapAllocator Allocator>
 class PageMap2 {
@@ -67,20 +163,54 @@ class PageMap2 {
       (kLeafBits + kPageShift - kHugePageShift);
   static constexpr size_t kLeafHugepages = kLeafCoveredBytes / kHugePageSize;
   static_assert(kLeafHugepages == 1 << kLeafHugeBits, "sanity");
+
+ public:
+  using Info = PageInfo<BITS>;
+
+ private:
   struct Leaf {
     // We keep parallel arrays indexed by page number.  One keeps the
-    // size class; another span pointers; the last hugepage-related
-    // information.  The size class information is kept segregated
+    // page info words (see PageInfo); another span pointers; the last
+    // hugepage-related information.  The page info is kept segregated
     // since small object deallocations are so frequent and do not
     // need the other information kept in a Span.
-    size_t sizeclass[kLeafLength];
+    uintptr_t page_info[kLeafLength];
     Span* span[kLeafLength];
     void* hugepage[kLeafHugepages];
+#ifdef CHUNK_START_TABLE
+    // For size classes of a page or more, the index in its span of the
+    // object containing the first byte of the page (see first_object()).
+    uint8_t first_object[kLeafLength];
+#endif
+#ifdef POINTER_TAGGING
+    // kTagsPerLeaf pointer tags (see pointer_tag.h), reserved with the leaf.
+    uint8_t* tags;
+#endif
   };
 
+#ifdef POINTER_TAGGING
+  static constexpr size_t kTagsPerPage = kPageSize >> kPointerTagGranuleShift;
+  static constexpr size_t kTagsPerLeaf = kLeafLength * kTagsPerPage;
+#endif
+
   Leaf* root_[kRootLength];  // Top-level node
   size_t bytes_used_;
 
+  // Calls f(leaf, index, length) for each run of the n pages from k that
+  // lies in one leaf.
+  template <typename F>
+  void ForEachLeafRange(uintptr_t k, size_t n, F f) {
+    while (n > 0) {
+      const uintptr_t i2 = k & (kLeafLength - 1);
+      const size_t len = std::min<size_t>(n, kLeafLength - i2);
+      f(root_[k >> kLeafBits], i2, len);
+      k += len;
+      n -= len;
+    }
+  }
+
+  friend struct InlineCheckLayout;
+
  public:
   typedef uintptr_t Number;
 
@@ -96,6 +226,16 @@ class PageMap2 {
     return root_[i1]->span[i2];
   }
 
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  void prefetch(Number k) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    const Number i1 = k >> kLeafBits;
+    const Number i2 = k & (kLeafLength - 1);
+    if ((k >> BITS) > 0 || root_[i1] == nullptr) {
+      return;
+    }
+    __builtin_prefetch(&root_[i1]->span[i2], 0, 3);
+  }
+
   // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
   std::optional<Number> get_next_set_page(Number k) const {
     Number next_k = k + 1;
@@ -128,20 +268,62 @@ class PageMap2 {
     const Number i2 = k & (kLeafLength - 1);
     ASSERT((k >> BITS) == 0);
     ASSERT(root_[i1] != nullptr);
-    size_t sc = root_[i1]->sizeclass[i2];
-    return (CompactSizeClass)(sc & (CompactSizeClass)(-1));
+    return Info(root_[i1]->page_info[i2]).size_class();
   }
 
-  size_t ABSL_ATTRIBUTE_ALWAYS_INLINE
+  // Page info of page k, empty if no leaf covers it.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  Info ABSL_ATTRIBUTE_ALWAYS_INLINE
   get_page_info(Number k) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
     const Number i1 = k >> kLeafBits;
     const Number i2 = k & (kLeafLength - 1);
     if ((k >> BITS) != 0 || root_[i1] == nullptr) {
-      return 0;
+      return Info();
     }
-    return root_[i1]->sizeclass[i2];
+    return Info(root_[i1]->page_info[i2]);
   }
 
+  // Object size recorded in the page info of page k, 0 if unknown.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  size_t ABSL_ATTRIBUTE_ALWAYS_INLINE object_size(Number k) const {
+    return get_page_info(k).object_size();
+  }
+
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  // REQUIRES: Must be a valid page number previously Ensure()d.
+  bool ABSL_ATTRIBUTE_ALWAYS_INLINE
+  has_escapes(Number k) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    const Number i1 = k >> kLeafBits;
+    const Number i2 = k & (kLeafLength - 1);
+    ASSERT((k >> BITS) == 0);
+    ASSERT(root_[i1] != nullptr);
+    return Info(__atomic_load_n(&root_[i1]->page_info[i2], __ATOMIC_RELAXED))
+        .has_escapes();
+  }
+
+  // Sets Info::kHasEscapes; may race with other threads doing the same.
+  void set_has_escapes(Number k) {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> kLeafBits;
+    const Number i2 = k & (kLeafLength - 1);
+    __atomic_fetch_or(&root_[i1]->page_info[i2], Info::kHasEscapes,
+                      __ATOMIC_RELAXED);
+  }
+
+#ifdef POINTER_TAGGING
+  // Returns the tag byte of the granule at byte `offset` of page k, or
+  // nullptr if no leaf covers the page.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  uint8_t* tag_slot(Number k, uintptr_t offset) const
+      ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    const Number i1 = k >> kLeafBits;
+    const Number i2 = k & (kLeafLength - 1);
+    if ((k >> BITS) > 0 || root_[i1] == nullptr) return nullptr;
+    return root_[i1]->tags + i2 * kTagsPerPage +
+           (offset >> kPointerTagGranuleShift);
+  }
+#endif
+
   void set(Number k, Span* s) {
     ASSERT(k >> BITS == 0);
     const Number i1 = k >> kLeafBits;
@@ -149,23 +331,82 @@ class PageMap2 {
     root_[i1]->span[i2] = s;
   }
 
-  void set_with_sizeclass(Number k, Span* s, CompactSizeClass sc) {
+  void set_with_sizeclass(Number k, Span* s, Info info) {
     ASSERT(k >> BITS == 0);
     const Number i1 = k >> kLeafBits;
     const Number i2 = k & (kLeafLength - 1);
     Leaf* leaf = root_[i1];
     leaf->span[i2] = s;
+    leaf->page_info[i2] = info.word();
+#ifdef CHUNK_START_TABLE
+    const size_t size = info.object_size();
+    if (size >= kPageSize) {
+      const size_t index = ((k - info.first_page()) << kPageShift) / size;
+      ASSERT(index <= std::numeric_limits<uint8_t>::max());
+      leaf->first_object[i2] = index;
+    }
+#endif
+  }
+
+  // Like set_with_sizeclass() on each of the n pages from k; the span pointer
+  // and the page info word are the same for all of them, so each leaf they
+  // cover is filled with two contiguous stores.
+  void set_range_with_sizeclass(Number k, size_t n, Span* s, Info info) {
+    ASSERT(n > 0 && (k + n - 1) >> BITS == 0);
+    ForEachLeafRange(k, n, [&](Leaf* leaf, Number i2, size_t len) {
+      std::fill_n(&leaf->span[i2], len, s);
+      std::fill_n(&leaf->page_info[i2], len, info.word());
+    });
+#ifdef CHUNK_START_TABLE
+    const size_t size = info.object_size();
+    if (size >= kPageSize) {
+      for (Number p = k; p < k + n; ++p) {
+        const size_t index = ((p - info.first_page()) << kPageShift) / size;
+        ASSERT(index <= std::numeric_limits<uint8_t>::max());
+        root_[p >> kLeafBits]->first_object[p & (kLeafLength - 1)] = index;
+      }
+    }
+#endif
+  }
+
+  // Sets the page info word of the n pages from k to info.
+  void set_range_page_info(Number k, size_t n, Info info) {
+    ASSERT(n > 0 && (k + n - 1) >> BITS == 0);
+    ForEachLeafRange(k, n, [&](Leaf* leaf, Number i2, size_t len) {
+      std::fill_n(&leaf->page_info[i2], len, info.word());
+    });
+  }
 
-    size_t new_sc = s->first_page().index() << (sizeof(CompactSizeClass) * 8);
-    new_sc = new_sc | (CompactSizeClass)(sc);
-    leaf->sizeclass[i2] = new_sc;
+#ifdef CHUNK_START_TABLE
+  // Index in its span of the object containing the first byte of page k,
+  // which set_with_sizeclass() recorded if the objects of its size class
+  // are a page or more.  A page holds at most one more object start, so
+  // the chunk containing an address of the page is this object or the next.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  // REQUIRES: Must be a valid page number previously Ensure()d.
+  size_t ABSL_ATTRIBUTE_ALWAYS_INLINE
+  first_object(Number k) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    const Number i1 = k >> kLeafBits;
+    const Number i2 = k & (kLeafLength - 1);
+    ASSERT((k >> BITS) == 0);
+    ASSERT(root_[i1] != nullptr);
+    return root_[i1]->first_object[i2];
+  }
+#endif
+
+  // Records the page info of a span without a size class.
+  void set_page_info(Number k, Info info) {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> kLeafBits;
+    const Number i2 = k & (kLeafLength - 1);
+    root_[i1]->page_info[i2] = info.word();
   }
 
   void clear_sizeclass(Number k) {
     ASSERT(k >> BITS == 0);
     const Number i1 = k >> kLeafBits;
     const Number i2 = k & (kLeafLength - 1);
-    root_[i1]->sizeclass[i2] = 0;
+    root_[i1]->page_info[i2] = 0;
   }
 
   void* get_hugepage(Number k) {
@@ -198,6 +439,10 @@ class PageMap2 {
         if (leaf == nullptr) return false;
         bytes_used_ += sizeof(Leaf);
         memset(leaf, 0, sizeof(*leaf));
+#ifdef POINTER_TAGGING
+        leaf->tags = static_cast<uint8_t*>(ReservePointerTags(kTagsPerLeaf));
+        if (leaf->tags == nullptr) return false;
+#endif
         root_[i1] = leaf;
       }
 
@@ -242,13 +487,18 @@ class PageMap3 {
       (kLeafBits + kPageShift - kHugePageShift);
   static constexpr size_t kLeafHugepages = kLeafCoveredBytes / kHugePageSize;
   static_assert(kLeafHugepages == 1 << kLeafHugeBits, "sanity");
+
+ public:
+  using Info = PageInfo<BITS>;
+
+ private:
   struct Leaf {
     // We keep parallel arrays indexed by page number.  One keeps the
-    // size class; another span pointers; the last hugepage-related
-    // information.  The size class information is kept segregated
+    // page info words (see PageInfo); another span pointers; the last
+    // hugepage-related information.  The page info is kept segregated
     // since small object deallocations are so frequent and do not
     // need the other information kept in a Span.
-    CompactSizeClass sizeclass[kLeafLength];
+    uintptr_t page_info[kLeafLength];
     Span* span[kLeafLength];
     void* hugepage[kLeafHugepages];
   };
@@ -261,6 +511,21 @@ class PageMap3 {
   Node* root_[kRootLength];  // Top-level node
   size_t bytes_used_;
 
+  // Calls f(leaf, index, length) for each run of the n pages from k that
+  // lies in one leaf.
+  template <typename F>
+  void ForEachLeafRange(uintptr_t k, size_t n, F f) {
+    while (n > 0) {
+      const uintptr_t i3 = k & (kLeafLength - 1);
+      const size_t len = std::min<size_t>(n, kLeafLength - i3);
+      f(root_[k >> (kLeafBits + kMidBits)]
+            ->leafs[(k >> kLeafBits) & (kMidLength - 1)],
+        i3, len);
+      k += len;
+      n -= len;
+    }
+  }
+
  public:
   typedef uintptr_t Number;
 
@@ -278,6 +543,18 @@ class PageMap3 {
     return root_[i1]->leafs[i2]->span[i3];
   }
 
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  void prefetch(Number k) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    const Number i1 = k >> (kLeafBits + kMidBits);
+    const Number i2 = (k >> kLeafBits) & (kMidLength - 1);
+    const Number i3 = k & (kLeafLength - 1);
+    if ((k >> BITS) > 0 || root_[i1] == nullptr ||
+        root_[i1]->leafs[i2] == nullptr) {
+      return;
+    }
+    __builtin_prefetch(&root_[i1]->leafs[i2]->span[i3], 0, 3);
+  }
+
   // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
   std::optional<Number> get_next_set_page(Number k) const {
     Number next_k = k + 1;
@@ -319,11 +596,53 @@ class PageMap3 {
     ASSERT((k >> BITS) == 0);
     ASSERT(root_[i1] != nullptr);
     ASSERT(root_[i1]->leafs[i2] != nullptr);
-    return root_[i1]->leafs[i2]->sizeclass[i3];
+    return Info(root_[i1]->leafs[i2]->page_info[i3]).size_class();
   }
 
-  size_t ABSL_ATTRIBUTE_ALWAYS_INLINE
-  get_page_info(Number k) const ABSL_NO_THREAD_SAFETY_ANALYSIS {return 0;}
+  // Page info of page k, empty if no leaf covers it.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  Info ABSL_ATTRIBUTE_ALWAYS_INLINE
+  get_page_info(Number k) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    const Number i1 = k >> (kLeafBits + kMidBits);
+    const Number i2 = (k >> kLeafBits) & (kMidLength - 1);
+    const Number i3 = k & (kLeafLength - 1);
+    if ((k >> BITS) > 0 || root_[i1] == nullptr ||
+        root_[i1]->leafs[i2] == nullptr) {
+      return Info();
+    }
+    return Info(root_[i1]->leafs[i2]->page_info[i3]);
+  }
+
+  // Object size recorded in the page info of page k, 0 if unknown.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  size_t ABSL_ATTRIBUTE_ALWAYS_INLINE object_size(Number k) const {
+    return get_page_info(k).object_size();
+  }
+
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  // REQUIRES: Must be a valid page number previously Ensure()d.
+  bool ABSL_ATTRIBUTE_ALWAYS_INLINE
+  has_escapes(Number k) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    const Number i1 = k >> (kLeafBits + kMidBits);
+    const Number i2 = (k >> kLeafBits) & (kMidLength - 1);
+    const Number i3 = k & (kLeafLength - 1);
+    ASSERT((k >> BITS) == 0);
+    ASSERT(root_[i1] != nullptr);
+    ASSERT(root_[i1]->leafs[i2] != nullptr);
+    return Info(__atomic_load_n(&root_[i1]->leafs[i2]->page_info[i3],
+                                __ATOMIC_RELAXED))
+        .has_escapes();
+  }
+
+  // Sets Info::kHasEscapes; may race with other threads doing the same.
+  void set_has_escapes(Number k) {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> (kLeafBits + kMidBits);
+    const Number i2 = (k >> kLeafBits) & (kMidLength - 1);
+    const Number i3 = k & (kLeafLength - 1);
+    __atomic_fetch_or(&root_[i1]->leafs[i2]->page_info[i3], Info::kHasEscapes,
+                      __ATOMIC_RELAXED);
+  }
 
   void set(Number k, Span* s) {
     ASSERT(k >> BITS == 0);
@@ -333,14 +652,40 @@ class PageMap3 {
     root_[i1]->leafs[i2]->span[i3] = s;
   }
 
-  void set_with_sizeclass(Number k, Span* s, CompactSizeClass sc) {
+  void set_with_sizeclass(Number k, Span* s, Info info) {
     ASSERT(k >> BITS == 0);
     const Number i1 = k >> (kLeafBits + kMidBits);
     const Number i2 = (k >> kLeafBits) & (kMidLength - 1);
     const Number i3 = k & (kLeafLength - 1);
     Leaf* leaf = root_[i1]->leafs[i2];
     leaf->span[i3] = s;
-    leaf->sizeclass[i3] = sc;
+    leaf->page_info[i3] = info.word();
+  }
+
+  // Like set_with_sizeclass() on each of the n pages from k.
+  void set_range_with_sizeclass(Number k, size_t n, Span* s, Info info) {
+    ASSERT(n > 0 && (k + n - 1) >> BITS == 0);
+    ForEachLeafRange(k, n, [&](Leaf* leaf, Number i3, size_t len) {
+      std::fill_n(&leaf->span[i3], len, s);
+      std::fill_n(&leaf->page_info[i3], len, info.word());
+    });
+  }
+
+  // Sets the page info word of the n pages from k to info.
+  void set_range_page_info(Number k, size_t n, Info info) {
+    ASSERT(n > 0 && (k + n - 1) >> BITS == 0);
+    ForEachLeafRange(k, n, [&](Leaf* leaf, Number i3, size_t len) {
+      std::fill_n(&leaf->page_info[i3], len, info.word());
+    });
+  }
+
+  // Records the page info of a span without a size class.
+  void set_page_info(Number k, Info info) {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> (kLeafBits + kMidBits);
+    const Number i2 = (k >> kLeafBits) & (kMidLength - 1);
+    const Number i3 = k & (kLeafLength - 1);
+    root_[i1]->leafs[i2]->page_info[i3] = info.word();
   }
 
   void clear_sizeclass(Number k) {
@@ -348,7 +693,7 @@ class PageMap3 {
     const Number i1 = k >> (kLeafBits + kMidBits);
     const Number i2 = (k >> kLeafBits) & (kMidLength - 1);
     const Number i3 = k & (kLeafLength - 1);
-    root_[i1]->leafs[i2]->sizeclass[i3] = 0;
+    root_[i1]->leafs[i2]->page_info[i3] = 0;
   }
 
   void* get_hugepage(Number k) {
@@ -411,6 +756,8 @@ class PageMap3 {
 
 class PageMap {
  public:
+  using Info = PageInfo<kAddressBits - kPageShift>;
+
   constexpr PageMap() : map_{} {}
 
   // Return the size class for p, or 0 if it is not known to tcmalloc
@@ -423,10 +770,19 @@ class PageMap {
     return map_.sizeclass(p.index());
   }
 
-  size_t get_page_info(PageId p) ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  // Return the page info of p, empty if it is not known to tcmalloc.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  Info get_page_info(PageId p) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
     return map_.get_page_info(p.index());
   }
 
+  // Object size of the span containing p recorded by RegisterSizeClass() or
+  // RegisterObjectSize(), or 0 if the Span has to be consulted for it.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  size_t ObjectSize(PageId p) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    return map_.object_size(p.index());
+  }
+
   void Set(PageId p, Span* span) { map_.set(p.index(), span); }
 
   bool Ensure(PageId p, Length n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
@@ -446,6 +802,68 @@ class PageMap {
   // Concurrent calls to this method are safe unless they mark the same span.
   void UnregisterSizeClass(Span* span);
 
+  // Record span->obj_size in the page info of a span without a size class
+  // (large and sampled allocations), so bounds checks need not read the Span.
+  // REQUIRES: span is in use and not registered with a size class.
+  void RegisterObjectSize(Span* span);
+
+  // Undo RegisterObjectSize() before the span is freed.
+  void UnregisterObjectSize(Span* span);
+
+  // Update the page info of a registered span that grew or shrank in place
+  // from old_n pages to its current size and object size.  It keeps the
+  // escape tracking state the span was registered with, and clears the page
+  // info of the pages it lost.
+  void ResizeObject(Span* span, Length old_n);
+
+  // Record in the page info of every page of span that it has an escape
+  // table.  Must happen before the table is published.
+  // REQUIRES: span is in use and registered.
+  void MarkEscapes(Span* span);
+
+#ifdef EXTERNAL_REGIONS
+  // Describes the n pages from first, memory the allocator does not own, as
+  // elements of element_size bytes laid out from the start of first.  No
+  // Span backs them: bounds checks find an element from the page info word
+  // alone, and everything else sees memory that is not the heap's.  Returns
+  // false, changing nothing, if a page is already known to the page map or
+  // element_size does not fit the word.
+  bool RegisterExternalRegion(PageId first, Length n, size_t element_size)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+  // Undoes RegisterExternalRegion(first, n, ...).  Returns false, changing
+  // nothing, unless the pages are exactly one registered region.
+  bool UnregisterExternalRegion(PageId first, Length n)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+#endif
+
+#if defined(ESCAPE_CHAIN_SWEEP) || defined(ESCAPE_REFCOUNTS)
+  // Returns the first page after p that has a descriptor, if any, to walk
+  // the spans of the heap a few at a time.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  std::optional<PageId> GetNextSetPage(PageId p) const {
+    std::optional<uintptr_t> next = map_.get_next_set_page(p.index());
+    if (!next.has_value()) return std::nullopt;
+    return PageId{next.value()};
+  }
+#endif
+
+  // Returns false if the span containing p never had an escape table since
+  // it was registered, so its escapes need not be poisoned.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  bool HasEscapes(PageId p) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    return map_.has_escapes(p.index());
+  }
+
+#ifdef POINTER_TAGGING
+  // Returns the current tag of the object starting at the untagged address
+  // addr, or nullptr if addr is not covered by the page map.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  uint8_t* TagSlot(uintptr_t addr) const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    return map_.tag_slot(addr >> kPageShift, addr & (kPageSize - 1));
+  }
+#endif
+
   // Return the descriptor for the specified page.  Returns NULL if
   // this PageId was not allocated previously.
   // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
@@ -453,6 +871,14 @@ class PageMap {
     return reinterpret_cast<Span*>(map_.get(p.index()));
   }
 
+  // Prefetches the descriptor slot of the specified page, so that a later
+  // GetDescriptor(p) does not miss.  Does nothing for unmapped pages.
+  // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
+  inline void PrefetchDescriptor(PageId p) const
+      ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    map_.prefetch(p.index());
+  }
+
   // Return the descriptor for the specified page.
   // PageId must have been previously allocated.
   // No locks required.  See SYNCHRONIZATION explanation at top of tcmalloc.cc.
@@ -515,6 +941,8 @@ class PageMap {
   }
 
  private:
+  friend struct InlineCheckLayout;
+
 #ifdef TCMALLOC_USE_PAGEMAP3
   PageMap3<kAddressBits - kPageShift, MetaDataAlloc> map_;
 #else
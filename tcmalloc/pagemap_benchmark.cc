@@ -0,0 +1,343 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The page map lookups the checks and free() rest on, and the four
+// out-of-line checks, over heaps of configurable size.
+//
+// BM_MapLookup compares PageMap2 against PageMap3 on a map of their own
+// describing state.range(0) MiB of one page spans: sizeclass(),
+// get_page_info() and get(), the lookup of GetDescriptor(), on pages taken
+// in order or at random.  BM_PageMapLookup does the same lookups through
+// tc_globals.pagemap(), of the pointers to state.range(0) MiB of small,
+// large or sampled objects, and BM_CheckObjects runs each of
+// __gep_check_boundary(), __bc_check_boundary(),
+// __gep_check_boundary_range() and __gep_check_boundary_batch() on them.
+//
+// Where perf_event_open() is permitted, every benchmark reports the dTLB
+// load misses it took per lookup as dtlb_misses.
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "absl/random/random.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/tcmalloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// Counts the dTLB load misses of the calling thread between Start() and
+// Report(), or nothing where the kernel does not let us.
+class DtlbMisses {
+ public:
+  DtlbMisses() {
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  ~DtlbMisses() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  void Start() {
+    if (fd_ < 0) return;
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  // Reports the misses per lookup, with `lookups` lookups an iteration.
+  void Report(benchmark::State& state, size_t lookups) {
+    if (fd_ < 0) return;
+    ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t misses;
+    if (read(fd_, &misses, sizeof(misses)) != sizeof(misses)) return;
+    const double n = static_cast<double>(state.iterations()) * lookups;
+    if (n > 0) state.counters["dtlb_misses"] = misses / n;
+  }
+
+ private:
+  int fd_;
+};
+
+enum Pattern { kSequential, kRandom };
+
+// Yields the indices of [0, n) in order or scattered over all of them.
+// Both cost the same few instructions, so that only the access pattern
+// tells the two apart.
+class Indices {
+ public:
+  Indices(Pattern pattern, size_t n) : pattern_(pattern), n_(n) {}
+
+  size_t Next() {
+    ++i_;
+    if (pattern_ == kSequential) return i_ % n_;
+    x_ = x_ * 6364136223846793005ull + 1442695040888963407ull;
+    return ((x_ >> 32) * n_) >> 32;
+  }
+
+ private:
+  const Pattern pattern_;
+  const size_t n_;
+  uint64_t i_ = 0;
+  uint64_t x_ = 1;
+};
+
+// Heap sizes in MiB.
+void HeapSizes(benchmark::internal::Benchmark* b) {
+  for (int64_t pattern : {kSequential, kRandom}) {
+    for (int64_t mib : {16, 256, 4096, 16384}) {
+      b->Args({mib, pattern});
+    }
+  }
+}
+
+// Page number of the first page of the standalone maps, as where the heap
+// of normal tagged memory starts.
+constexpr uintptr_t kFirstPage = (uintptr_t{1} << 40) >> kPageShift;
+
+// A standalone map of Map describing the pages from kFirstPage on as one
+// page spans of size class 1.  Grown as benchmarks ask for more pages and
+// never freed, as in pagemap_test.
+template <class Map>
+Map& StandaloneMap(size_t pages) {
+  static Map* map = new (::operator new(sizeof(Map))) Map();
+  static size_t populated = 0;
+  if (pages > populated) {
+    CHECK_CONDITION(map->Ensure(kFirstPage + populated, pages - populated));
+    for (size_t i = populated; i < pages; ++i) {
+      const uintptr_t k = kFirstPage + i;
+      // The spans are never dereferenced.
+      Span* span = reinterpret_cast<Span*>(k << kPageShift);
+      map->set_with_sizeclass(k, span, Map::Info::Make(k, 1, 16));
+    }
+    populated = pages;
+  }
+  return *map;
+}
+
+enum Lookup { kSizeclass, kPageInfo, kDescriptor };
+
+template <class Map, Lookup lookup>
+void BM_MapLookup(benchmark::State& state) {
+  const size_t pages = (state.range(0) << 20) >> kPageShift;
+  Map& map = StandaloneMap<Map>(pages);
+  Indices indices(static_cast<Pattern>(state.range(1)), pages);
+  DtlbMisses misses;
+  misses.Start();
+  for (auto _ : state) {
+    const uintptr_t k = kFirstPage + indices.Next();
+    switch (lookup) {
+      case kSizeclass:
+        benchmark::DoNotOptimize(map.sizeclass(k));
+        break;
+      case kPageInfo:
+        benchmark::DoNotOptimize(map.get_page_info(k).word());
+        break;
+      case kDescriptor:
+        benchmark::DoNotOptimize(map.get(k));
+        break;
+    }
+  }
+  misses.Report(state, 1);
+  state.SetItemsProcessed(state.iterations());
+}
+
+constexpr int kMapBits = kAddressBits - kPageShift;
+using Map2 = PageMap2<kMapBits, ::operator new>;
+using Map3 = PageMap3<kMapBits, ::operator new>;
+
+BENCHMARK_TEMPLATE(BM_MapLookup, Map2, kSizeclass)->Apply(HeapSizes);
+BENCHMARK_TEMPLATE(BM_MapLookup, Map3, kSizeclass)->Apply(HeapSizes);
+BENCHMARK_TEMPLATE(BM_MapLookup, Map2, kPageInfo)->Apply(HeapSizes);
+BENCHMARK_TEMPLATE(BM_MapLookup, Map3, kPageInfo)->Apply(HeapSizes);
+BENCHMARK_TEMPLATE(BM_MapLookup, Map2, kDescriptor)->Apply(HeapSizes);
+BENCHMARK_TEMPLATE(BM_MapLookup, Map3, kDescriptor)->Apply(HeapSizes);
+
+enum Kind { kSmall, kLarge, kSampled };
+
+// Sampled objects each take a span and a stack trace, so there are at most
+// this many of them.
+constexpr size_t kMaxSampled = 4096;
+
+size_t ObjectSize(Kind kind) {
+  return kind == kLarge ? kMaxSize + kPageSize : 64;
+}
+
+// Allocates about `bytes` of objects of `kind`, in a random order in the
+// result so that neighbouring entries are not neighbouring objects.
+std::vector<char*> AllocateObjects(Kind kind, size_t bytes) {
+  const size_t size = ObjectSize(kind);
+  size_t n = std::max<size_t>(bytes / size, 1);
+  int64_t rate = 0;
+  if (kind == kSampled) {
+    n = std::min(n, kMaxSampled);
+    rate = MallocExtension::GetProfileSamplingRate();
+    MallocExtension::SetProfileSamplingRate(1);
+    // Uses up the bytes left before the next sample at the old rate.
+    for (;;) {
+      void* p = malloc(size);
+      const bool sampled = IsSampledMemory(p);
+      free(p);
+      if (sampled) break;
+    }
+  }
+  std::vector<char*> objects(n);
+  for (char*& p : objects) p = static_cast<char*>(malloc(size));
+  if (kind == kSampled) MallocExtension::SetProfileSamplingRate(rate);
+
+  absl::BitGen rng;
+  for (size_t i = n - 1; i > 0; --i) {
+    std::swap(objects[i], objects[absl::Uniform<size_t>(rng, 0, i + 1)]);
+  }
+  return objects;
+}
+
+void FreeObjects(const std::vector<char*>& objects) {
+  for (char* p : objects) free(p);
+}
+
+// Object kinds and heap sizes in MiB; sampled objects only fill the small
+// sizes.
+void ObjectHeaps(benchmark::internal::Benchmark* b) {
+  for (int64_t kind : {kSmall, kLarge, kSampled}) {
+    for (int64_t pattern : {kSequential, kRandom}) {
+      for (int64_t mib : {16, 256, 1024}) {
+        if (kind == kSampled && mib > 16) continue;
+        b->Args({mib, kind, pattern});
+      }
+    }
+  }
+}
+
+template <Lookup lookup>
+void BM_PageMapLookup(benchmark::State& state) {
+  const Kind kind = static_cast<Kind>(state.range(1));
+  const std::vector<char*> objects =
+      AllocateObjects(kind, state.range(0) << 20);
+  // In the sequential runs the objects are visited in address order.
+  std::vector<char*> order = objects;
+  if (state.range(2) == kSequential) std::sort(order.begin(), order.end());
+  PageMap& pagemap = tc_globals.pagemap();
+  Indices indices(kSequential, order.size());
+  DtlbMisses misses;
+  misses.Start();
+  for (auto _ : state) {
+    const PageId p = PageIdContaining(order[indices.Next()]);
+    switch (lookup) {
+      case kSizeclass:
+        benchmark::DoNotOptimize(pagemap.sizeclass(p));
+        break;
+      case kPageInfo:
+        benchmark::DoNotOptimize(pagemap.get_page_info(p).word());
+        break;
+      case kDescriptor:
+        benchmark::DoNotOptimize(pagemap.GetDescriptor(p));
+        break;
+    }
+  }
+  misses.Report(state, 1);
+  state.SetItemsProcessed(state.iterations());
+  FreeObjects(objects);
+}
+
+BENCHMARK_TEMPLATE(BM_PageMapLookup, kSizeclass)->Apply(ObjectHeaps);
+BENCHMARK_TEMPLATE(BM_PageMapLookup, kPageInfo)->Apply(ObjectHeaps);
+BENCHMARK_TEMPLATE(BM_PageMapLookup, kDescriptor)->Apply(ObjectHeaps);
+
+enum Check { kGep, kBc, kGepRange, kGepBatch };
+
+// Pointers checked per __gep_check_boundary_batch() call.
+constexpr size_t kBatch = 8;
+
+template <Check check>
+void BM_CheckObjects(benchmark::State& state) {
+  const Kind kind = static_cast<Kind>(state.range(1));
+  const size_t size = ObjectSize(kind);
+  const std::vector<char*> objects =
+      AllocateObjects(kind, state.range(0) << 20);
+  std::vector<char*> order = objects;
+  if (state.range(2) == kSequential) std::sort(order.begin(), order.end());
+  Indices indices(kSequential, order.size());
+  DtlbMisses misses;
+  misses.Start();
+  for (auto _ : state) {
+    if (check == kGepBatch) {
+      void* bases[kBatch];
+      void* ptrs[kBatch];
+      for (size_t i = 0; i < kBatch; ++i) {
+        bases[i] = order[indices.Next()];
+        ptrs[i] = static_cast<char*>(bases[i]) + size / 2;
+      }
+      benchmark::DoNotOptimize(
+          TCMallocInternalGepCheckBoundaryBatch(bases, ptrs, kBatch));
+      continue;
+    }
+    char* base = order[indices.Next()];
+    char* ptr = base + size / 2;
+    switch (check) {
+      case kGep:
+        benchmark::DoNotOptimize(
+            TCMallocInternalGepCheckBoundary(base, ptr, 1));
+        break;
+      case kBc:
+        benchmark::DoNotOptimize(TCMallocInternalBcCheckBoundary(ptr, 1));
+        break;
+      case kGepRange:
+        benchmark::DoNotOptimize(
+            TCMallocInternalGepCheckBoundaryRange(base, ptr, size / 2));
+        break;
+      case kGepBatch:
+        break;
+    }
+  }
+  const size_t per_iteration = check == kGepBatch ? kBatch : 1;
+  misses.Report(state, per_iteration);
+  state.SetItemsProcessed(state.iterations() * per_iteration);
+  FreeObjects(objects);
+}
+
+BENCHMARK_TEMPLATE(BM_CheckObjects, kGep)->Apply(ObjectHeaps);
+BENCHMARK_TEMPLATE(BM_CheckObjects, kBc)->Apply(ObjectHeaps);
+BENCHMARK_TEMPLATE(BM_CheckObjects, kGepRange)->Apply(ObjectHeaps);
+BENCHMARK_TEMPLATE(BM_CheckObjects, kGepBatch)->Apply(ObjectHeaps);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -86,8 +86,10 @@ TEST_P(PageMapTest, Sequential) {
 
     // Test size class handling
     ASSERT_EQ(0, map->sizeclass(i));
-    map->set_with_sizeclass(i, span(i), sc(i));
+    map->set_with_sizeclass(i, span(i), Map::Info::Make(i, sc(i), 64));
     ASSERT_EQ(sc(i), map->sizeclass(i));
+    ASSERT_EQ(i, map->get_page_info(i).first_page());
+    ASSERT_EQ(64, map->object_size(i));
   }
   for (intptr_t i = 0; i < limit; i++) {
     ASSERT_EQ(map->get(i), span(i));
@@ -133,6 +135,91 @@ TEST_P(PageMapTest, RandomAccess) {
 
 INSTANTIATE_TEST_SUITE_P(Limits, PageMapTest, ::testing::Values(100, 1 << 20));
 
+TEST_P(PageMapTest, RangeCrossesLeaves) {
+  // Leaves of PageMap2 cover 1 << 15 pages.
+  constexpr uintptr_t kFirst = (uintptr_t{1} << 15) - 3;
+  constexpr size_t kPages = 6;
+  ASSERT_TRUE(map->Ensure(kFirst, kPages));
+  const Map::Info info = Map::Info::Make(kFirst, 3, 1024);
+  map->set_range_with_sizeclass(kFirst, kPages, span(kFirst), info);
+  for (uintptr_t p = kFirst; p < kFirst + kPages; ++p) {
+    EXPECT_EQ(map->get(p), span(kFirst)) << p;
+    EXPECT_EQ(map->get_page_info(p).word(), info.word()) << p;
+  }
+  map->set_range_page_info(kFirst, kPages, Map::Info());
+  for (uintptr_t p = kFirst; p < kFirst + kPages; ++p) {
+    EXPECT_EQ(map->sizeclass(p), 0) << p;
+    EXPECT_EQ(map->get(p), span(kFirst)) << p;
+  }
+}
+
+#ifdef CHUNK_START_TABLE
+TEST_P(PageMapTest, FirstObject) {
+  // Objects of a page and a half: pages 0 to 5 of the span start inside
+  // objects 0, 0, 1, 2, 2 and 3.
+  constexpr size_t kSize = kPageSize * 3 / 2;
+  constexpr uintptr_t kFirst = 16;
+  ASSERT_TRUE(map->Ensure(kFirst, 6));
+  const Map::Info info = Map::Info::Make(kFirst, 1, kSize);
+  const size_t expected[] = {0, 0, 1, 2, 2, 3};
+  for (uintptr_t p = 0; p < 6; ++p) {
+    map->set_with_sizeclass(kFirst + p, span(kFirst + p), info);
+    EXPECT_EQ(map->first_object(kFirst + p), expected[p]) << p;
+  }
+}
+#endif
+
+TEST(PageInfoTest, RoundTrip) {
+  using Info = PageInfo<20>;
+  EXPECT_EQ(Info().size_class(), 0);
+  EXPECT_EQ(Info().object_size(), 0);
+  EXPECT_FALSE(Info().has_escapes());
+
+  const uintptr_t first = (uintptr_t{1} << 20) - 1;
+  const Info small = Info::Make(first, 255, 4096);
+  EXPECT_EQ(small.size_class(), 255);
+  EXPECT_EQ(small.first_page(), first);
+  EXPECT_EQ(small.span_start(), first << kPageShift);
+  EXPECT_EQ(small.object_size(), 4096);
+  EXPECT_FALSE(small.has_escapes());
+  EXPECT_TRUE(Info(small.word() | Info::kHasEscapes).has_escapes());
+  EXPECT_EQ(Info(small.word() | Info::kHasEscapes).object_size(), 4096);
+  EXPECT_FALSE(small.untracked());
+  const Info untracked(small.word() | Info::kUntracked | Info::kHasEscapes);
+  EXPECT_TRUE(untracked.untracked());
+  EXPECT_EQ(untracked.object_size(), 4096);
+  EXPECT_EQ(untracked.size_class(), 255);
+
+  // Spans without a size class too large for byte units count pages.
+  const size_t large = (Info::kMaxSize / kPageSize + 1) * kPageSize;
+  const Info pages = Info::Make(1, 0, large);
+  EXPECT_EQ(pages.size_class(), 0);
+  EXPECT_EQ(pages.first_page(), 1);
+  EXPECT_EQ(pages.object_size(), large);
+  EXPECT_EQ(Info(pages.word() | Info::kUntracked).object_size(), large);
+
+  // Sizes that fit neither are left for the Span.
+  EXPECT_EQ(Info::Make(1, 0, large + 8).object_size(), 0);
+}
+
+TEST(PageMap3Test, PageInfo) {
+  using Map = PageMap3<kAddressBits - kPageShift, ::operator new>;
+  alignas(Map) static char storage[sizeof(Map)];
+  Map* map = new (storage) Map();
+  EXPECT_EQ(map->get_page_info(5).word(), 0);
+  ASSERT_TRUE(map->Ensure(0, 16));
+  map->set_with_sizeclass(5, span(5), Map::Info::Make(4, 7, 128));
+  EXPECT_EQ(map->sizeclass(5), 7);
+  EXPECT_EQ(map->get_page_info(5).first_page(), 4);
+  EXPECT_EQ(map->object_size(5), 128);
+  EXPECT_FALSE(map->has_escapes(5));
+  map->set_has_escapes(5);
+  EXPECT_TRUE(map->has_escapes(5));
+  EXPECT_EQ(map->sizeclass(5), 7);
+  map->clear_sizeclass(5);
+  EXPECT_EQ(map->get_page_info(5).word(), 0);
+}
+
 // Surround pagemap with unused memory. This isolates it so that it does not
 // share pages with any other structures. This avoids the risk that adjacent
 // objects might cause it to be mapped in. The padding is of sufficient size
@@ -13,13 +13,22 @@
 // limitations under the License.
 #include "tcmalloc/parameters.h"
 
+#include <sys/auxv.h>
+
+#include <algorithm>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/string_view.h"
 #include "absl/time/time.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/experiment_config.h"
 #include "tcmalloc/huge_page_aware_allocator.h"
+#include "tcmalloc/internal/environment.h"
+#include "tcmalloc/internal/logging.h"
 #include "tcmalloc/lifetime_based_allocator.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/sampling_autotune.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/thread_cache.h"
 
@@ -95,6 +104,29 @@ ABSL_CONST_INIT std::atomic<int32_t>
     Parameters::linear_search_length_tracker_list_(0);
 ABSL_CONST_INIT std::atomic<bool> Parameters::madvise_cold_regions_nohugepage_(
     true);
+ABSL_CONST_INIT std::atomic<bool> Parameters::background_escape_flush_enabled_(
+    false);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::escape_l2_cache_size_(
+    4 << 20);
+ABSL_CONST_INIT std::atomic<bool>
+    Parameters::realloc_migrate_escapes_enabled_(false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::deterministic_mode_enabled_(
+    false);
+ABSL_CONST_INIT std::atomic<double> Parameters::sampling_cpu_budget_(0.01);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::escape_poison_chunk_limit_(
+    128);
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::escape_span_sample_period_(
+    1);
+ABSL_CONST_INIT std::atomic<MallocExtension::ProtectionPolicy>
+    Parameters::protection_policy_(
+#ifdef CRASH_ON_CORRUPTION
+        MallocExtension::ProtectionPolicy::kCrash
+#else
+        MallocExtension::ProtectionPolicy::kReportOnly
+#endif
+    );
+ABSL_CONST_INIT std::atomic<int64_t> Parameters::protection_sample_period_(
+    100);
 ABSL_CONST_INIT std::atomic<int64_t> Parameters::max_total_thread_cache_bytes_(
     kDefaultOverallThreadCacheSize);
 ABSL_CONST_INIT std::atomic<double>
@@ -130,6 +162,112 @@ bool Parameters::pass_span_object_count_to_pageheap() {
   return v;
 }
 
+// Escape spans one in this many are tracked in under
+// TCMALLOC_PROTECTION_SAMPLED_ESCAPE_SPANS.
+static constexpr int64_t kExperimentEscapeSpanSamplePeriod = 8;
+
+// Whether the process runs setuid, setgid or with file capabilities, when
+// its environment comes from a less privileged caller.  This is the test
+// secure_getenv() makes.
+static bool SecureExecution() { return getauxval(AT_SECURE) != 0; }
+
+void Parameters::InitProtectionPolicyFromEnvironment() {
+  using Policy = MallocExtension::ProtectionPolicy;
+  // The policy the build starts with is the floor in secure execution: the
+  // environment may make the checks stricter there, but the experiments,
+  // which only weaken them, and weaker policies are ignored.  Only
+  // MallocExtension calls from the program itself go below it.  Policies are
+  // declared from the strictest to the weakest.
+#ifdef CRASH_ON_CORRUPTION
+  constexpr Policy kFloor = Policy::kCrash;
+#else
+  constexpr Policy kFloor = Policy::kReportOnly;
+#endif
+  const bool secure = SecureExecution();
+  auto set_policy = [&](Policy policy, const char* value) {
+    if (secure && policy > kFloor) {
+      Log(kLog, __FILE__, __LINE__,
+          "TCMALLOC_PROTECTION_POLICY below the default ignored in secure "
+          "execution",
+          value);
+      return;
+    }
+    set_protection_policy(policy);
+  };
+
+  // The experiments only move defaults; the variables below and later
+  // MallocExtension calls still override them.
+  if (!secure) {
+    if (IsExperimentActive(
+            Experiment::TCMALLOC_PROTECTION_NO_ESCAPE_L2_CACHE)) {
+      set_escape_l2_cache_size(0);
+    }
+    if (IsExperimentActive(Experiment::TCMALLOC_PROTECTION_SAMPLED_CHECKS)) {
+      set_protection_policy(Policy::kSampled);
+    }
+    if (IsExperimentActive(
+            Experiment::TCMALLOC_PROTECTION_SAMPLED_ESCAPE_SPANS)) {
+      set_escape_span_sample_period(kExperimentEscapeSpanSamplePeriod);
+    }
+    if (IsExperimentActive(
+            Experiment::TCMALLOC_PROTECTION_REALLOC_MIGRATE_ESCAPES)) {
+      set_realloc_migrate_escapes(true);
+    }
+  }
+  if (const char* e = thread_safe_getenv("TCMALLOC_PROTECTION_POLICY")) {
+    const absl::string_view v(e);
+    if (v == "crash") {
+      set_policy(Policy::kCrash, e);
+    } else if (v == "report") {
+      set_policy(Policy::kReportOnly, e);
+    } else if (v == "sampled") {
+      set_policy(Policy::kSampled, e);
+    } else if (v == "disabled") {
+      set_policy(Policy::kDisabled, e);
+    } else {
+      Log(kLog, __FILE__, __LINE__,
+          "Unknown TCMALLOC_PROTECTION_POLICY (crash, report, sampled or "
+          "disabled)",
+          e);
+    }
+  }
+  if (const char* e =
+          thread_safe_getenv("TCMALLOC_PROTECTION_SAMPLE_PERIOD")) {
+    int64_t period;
+    if (absl::SimpleAtoi(e, &period) && period > 0) {
+      set_protection_sample_period(period);
+    } else {
+      Log(kLog, __FILE__, __LINE__,
+          "Invalid TCMALLOC_PROTECTION_SAMPLE_PERIOD", e);
+    }
+  }
+}
+
+// Returns the value of environment variable name times unit, or 0 if it is
+// unset or invalid.
+static size_t PrefaultBytesFromEnvironment(const char* name, size_t unit) {
+  const char* e = thread_safe_getenv(name);
+  if (e == nullptr) return 0;
+  size_t n;
+  if (!absl::SimpleAtoi(e, &n) || n > (~size_t{0}) / unit) {
+    Log(kLog, __FILE__, __LINE__, "Invalid", name, e);
+    return 0;
+  }
+  return n * unit;
+}
+
+size_t Parameters::prefault_heap_bytes() {
+  static size_t v(PrefaultBytesFromEnvironment("TCMALLOC_PREFAULT_HEAP_GIB",
+                                               size_t{1} << 30));
+  return v;
+}
+
+size_t Parameters::prefault_metadata_bytes() {
+  static size_t v(PrefaultBytesFromEnvironment(
+      "TCMALLOC_PREFAULT_METADATA_MIB", size_t{1} << 20));
+  return v;
+}
+
 bool Parameters::per_cpu_caches_dynamic_slab_enabled() {
   return dynamic_slab_enabled().load(std::memory_order_relaxed);
 }
@@ -357,4 +495,89 @@ void TCMalloc_Internal_SetMadviseColdRegionsNoHugepage(bool v) {
                                                      std::memory_order_relaxed);
 }
 
+bool TCMalloc_Internal_GetBackgroundEscapeFlushEnabled() {
+  return Parameters::background_escape_flush();
+}
+
+void TCMalloc_Internal_SetBackgroundEscapeFlushEnabled(bool v) {
+  Parameters::background_escape_flush_enabled_.store(v,
+                                                     std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetEscapeL2CacheSize() {
+  return Parameters::escape_l2_cache_size();
+}
+
+void TCMalloc_Internal_SetEscapeL2CacheSize(int64_t v) {
+  Parameters::escape_l2_cache_size_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetReallocMigrateEscapesEnabled() {
+  return Parameters::realloc_migrate_escapes();
+}
+
+void TCMalloc_Internal_SetReallocMigrateEscapesEnabled(bool v) {
+  Parameters::realloc_migrate_escapes_enabled_.store(
+      v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetDeterministicModeEnabled() {
+  return Parameters::deterministic_mode();
+}
+
+void TCMalloc_Internal_SetDeterministicModeEnabled(bool v) {
+  Parameters::deterministic_mode_enabled_.store(v, std::memory_order_relaxed);
+}
+
+double TCMalloc_Internal_GetSamplingCpuBudget() {
+  return Parameters::sampling_cpu_budget();
+}
+
+void TCMalloc_Internal_SetSamplingCpuBudget(double v) {
+  Parameters::sampling_cpu_budget_.store(v, std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetEffectiveProfileSamplingRate() {
+#ifdef SAMPLING_AUTOTUNE
+  return tcmalloc::tcmalloc_internal::SamplingAutotuner::EffectiveRate();
+#else
+  return Parameters::profile_sampling_rate();
+#endif
+}
+
+int64_t TCMalloc_Internal_GetEscapePoisonChunkLimit() {
+  return Parameters::escape_poison_chunk_limit();
+}
+
+void TCMalloc_Internal_SetEscapePoisonChunkLimit(int64_t v) {
+  Parameters::escape_poison_chunk_limit_.store(v, std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetEscapeSpanSamplePeriod() {
+  return Parameters::escape_span_sample_period();
+}
+
+void TCMalloc_Internal_SetEscapeSpanSamplePeriod(int64_t v) {
+  Parameters::escape_span_sample_period_.store(v, std::memory_order_relaxed);
+}
+
+int TCMalloc_Internal_GetProtectionPolicy() {
+  return static_cast<int>(Parameters::protection_policy());
+}
+
+void TCMalloc_Internal_SetProtectionPolicy(int v) {
+  Parameters::protection_policy_.store(
+      static_cast<tcmalloc::MallocExtension::ProtectionPolicy>(v),
+      std::memory_order_relaxed);
+}
+
+int64_t TCMalloc_Internal_GetProtectionSamplePeriod() {
+  return Parameters::protection_sample_period();
+}
+
+void TCMalloc_Internal_SetProtectionSamplePeriod(int64_t v) {
+  Parameters::protection_sample_period_.store(std::max<int64_t>(v, 1),
+                                              std::memory_order_relaxed);
+}
+
 }  // extern "C"
@@ -152,6 +152,99 @@ class Parameters {
     TCMalloc_Internal_SetMadviseColdRegionsNoHugepage(value);
   }
 
+  static bool background_escape_flush() {
+    return background_escape_flush_enabled_.load(std::memory_order_relaxed);
+  }
+
+  static void set_background_escape_flush(bool value) {
+    TCMalloc_Internal_SetBackgroundEscapeFlushEnabled(value);
+  }
+
+  static int64_t escape_l2_cache_size() {
+    return escape_l2_cache_size_.load(std::memory_order_relaxed);
+  }
+
+  static void set_escape_l2_cache_size(int64_t value) {
+    TCMalloc_Internal_SetEscapeL2CacheSize(value);
+  }
+
+  static bool realloc_migrate_escapes() {
+    return realloc_migrate_escapes_enabled_.load(std::memory_order_relaxed);
+  }
+
+  static void set_realloc_migrate_escapes(bool value) {
+    TCMalloc_Internal_SetReallocMigrateEscapesEnabled(value);
+  }
+
+  // Whether deterministic mode is on, with DETERMINISTIC_MODE; see
+  // MallocExtension::SetDeterministicMode().
+  static bool deterministic_mode() {
+    return deterministic_mode_enabled_.load(std::memory_order_relaxed);
+  }
+
+  static void set_deterministic_mode(bool value) {
+    TCMalloc_Internal_SetDeterministicModeEnabled(value);
+  }
+
+  // Fraction of the process's CPU the sampled allocations may take, with
+  // SAMPLING_AUTOTUNE; 0 or less keeps the configured sampling rate.
+  static double sampling_cpu_budget() {
+    return sampling_cpu_budget_.load(std::memory_order_relaxed);
+  }
+
+  static void set_sampling_cpu_budget(double value) {
+    TCMalloc_Internal_SetSamplingCpuBudget(value);
+  }
+
+  // Escape chunks free() poisons before it defers the rest of a chain to the
+  // background, with DEFERRED_ESCAPE_POISON; 0 poisons every chain in full.
+  static int64_t escape_poison_chunk_limit() {
+    return escape_poison_chunk_limit_.load(std::memory_order_relaxed);
+  }
+
+  static void set_escape_poison_chunk_limit(int64_t value) {
+    TCMalloc_Internal_SetEscapePoisonChunkLimit(value);
+  }
+
+  // One in this many spans gets escape tracking, with SAMPLED_ESCAPE_SPANS;
+  // 1 or less tracks every span.  Applies to spans registered afterwards.
+  static int64_t escape_span_sample_period() {
+    return escape_span_sample_period_.load(std::memory_order_relaxed);
+  }
+
+  static void set_escape_span_sample_period(int64_t value) {
+    TCMalloc_Internal_SetEscapeSpanSamplePeriod(value);
+  }
+
+  static MallocExtension::ProtectionPolicy protection_policy() {
+    return protection_policy_.load(std::memory_order_relaxed);
+  }
+
+  static void set_protection_policy(MallocExtension::ProtectionPolicy value) {
+    TCMalloc_Internal_SetProtectionPolicy(static_cast<int>(value));
+  }
+
+  static int64_t protection_sample_period() {
+    return protection_sample_period_.load(std::memory_order_relaxed);
+  }
+
+  static void set_protection_sample_period(int64_t value) {
+    TCMalloc_Internal_SetProtectionSamplePeriod(value);
+  }
+
+  // Applies the TCMALLOC_PROTECTION_* experiments, then
+  // TCMALLOC_PROTECTION_POLICY (crash, report, sampled or disabled) and
+  // TCMALLOC_PROTECTION_SAMPLE_PERIOD from the environment.  In setuid and
+  // other AT_SECURE processes the experiments are ignored, and so are
+  // policies weaker than the one the build defaults to.
+  static void InitProtectionPolicyFromEnvironment();
+
+  // Bytes of heap, and of each metadata arena, that startup faults in ahead
+  // of use, from TCMALLOC_PREFAULT_HEAP_GIB and TCMALLOC_PREFAULT_METADATA_MIB.
+  // 0 when unset.
+  static size_t prefault_heap_bytes();
+  static size_t prefault_metadata_bytes();
+
  private:
   friend void ::TCMalloc_Internal_SetBackgroundReleaseRate(size_t v);
   friend void ::TCMalloc_Internal_SetGuardedSamplingRate(int64_t v);
@@ -174,6 +267,15 @@ class Parameters {
       double v);
   friend void ::TCMalloc_Internal_SetLinearSearchLengthTrackerList(int32_t v);
   friend void ::TCMalloc_Internal_SetMadviseColdRegionsNoHugepage(bool v);
+  friend void ::TCMalloc_Internal_SetBackgroundEscapeFlushEnabled(bool v);
+  friend void ::TCMalloc_Internal_SetEscapeL2CacheSize(int64_t v);
+  friend void ::TCMalloc_Internal_SetReallocMigrateEscapesEnabled(bool v);
+  friend void ::TCMalloc_Internal_SetDeterministicModeEnabled(bool v);
+  friend void ::TCMalloc_Internal_SetSamplingCpuBudget(double v);
+  friend void ::TCMalloc_Internal_SetEscapePoisonChunkLimit(int64_t v);
+  friend void ::TCMalloc_Internal_SetEscapeSpanSamplePeriod(int64_t v);
+  friend void ::TCMalloc_Internal_SetProtectionPolicy(int v);
+  friend void ::TCMalloc_Internal_SetProtectionSamplePeriod(int64_t v);
 
   friend void TCMalloc_Internal_SetLifetimeAllocatorOptions(
       absl::string_view s);
@@ -183,6 +285,15 @@ class Parameters {
   static std::atomic<bool> shuffle_per_cpu_caches_enabled_;
   static std::atomic<int32_t> linear_search_length_tracker_list_;
   static std::atomic<bool> madvise_cold_regions_nohugepage_;
+  static std::atomic<bool> background_escape_flush_enabled_;
+  static std::atomic<int64_t> escape_l2_cache_size_;
+  static std::atomic<bool> realloc_migrate_escapes_enabled_;
+  static std::atomic<bool> deterministic_mode_enabled_;
+  static std::atomic<double> sampling_cpu_budget_;
+  static std::atomic<int64_t> escape_poison_chunk_limit_;
+  static std::atomic<int64_t> escape_span_sample_period_;
+  static std::atomic<MallocExtension::ProtectionPolicy> protection_policy_;
+  static std::atomic<int64_t> protection_sample_period_;
   static std::atomic<int32_t> max_per_cpu_cache_size_;
   static std::atomic<bool> prioritize_spans_enabled_;
   static std::atomic<bool> partial_transfer_cache_enabled_;
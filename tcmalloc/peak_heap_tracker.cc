@@ -32,16 +32,47 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
-bool PeakHeapTracker::IsNewPeak() {
-  size_t current_peak_size = CurrentPeakSize();
-  return current_peak_size == 0 ||
-         (static_cast<double>(tc_globals.sampled_objects_size_.value()) /
-              current_peak_size >
-          Parameters::peak_sampling_heap_growth_fraction());
+bool PeakHeapTracker::IsNewPeak(int64_t size, int64_t peak) const {
+  return peak == 0 || (static_cast<double>(size) / peak >
+                       Parameters::peak_sampling_heap_growth_fraction());
 }
 
+#ifdef DEFERRED_PEAK_HEAP
 void PeakHeapTracker::MaybeSaveSample() {
-  if (Parameters::peak_sampling_heap_growth_fraction() <= 0 || !IsNewPeak()) {
+  if (Parameters::peak_sampling_heap_growth_fraction() <= 0) return;
+
+  // Of the threads that see the same peak, one wins the swap and saves it.
+  std::atomic<int64_t>& peak_size =
+      do_not_access_directly_peak_sampled_heap_size_;
+  const int64_t size = tc_globals.sampled_objects_size_.value();
+  int64_t peak = peak_size.load(std::memory_order_relaxed);
+  do {
+    if (!IsNewPeak(size, peak)) return;
+  } while (!peak_size.compare_exchange_weak(peak, size,
+                                            std::memory_order_relaxed));
+
+  if (deferred_.load(std::memory_order_relaxed)) {
+    pending_.store(true, std::memory_order_relaxed);
+    return;
+  }
+  SaveSample();
+}
+
+void PeakHeapTracker::SaveDeferredSample() {
+  if (!pending_.load(std::memory_order_relaxed) ||
+      !pending_.exchange(false, std::memory_order_relaxed)) {
+    return;
+  }
+  SaveSample();
+}
+
+void PeakHeapTracker::SaveSample() {
+  absl::base_internal::SpinLockHolder h(&recorder_lock_);
+#else
+void PeakHeapTracker::MaybeSaveSample() {
+  if (Parameters::peak_sampling_heap_growth_fraction() <= 0 ||
+      !IsNewPeak(tc_globals.sampled_objects_size_.value(),
+                 CurrentPeakSize())) {
     return;
   }
 
@@ -49,10 +80,12 @@ void PeakHeapTracker::MaybeSaveSample() {
 
   // double-check in case another allocation was sampled (or a sampled
   // allocation freed) while we were waiting for the lock
-  if (!IsNewPeak()) {
+  if (!IsNewPeak(tc_globals.sampled_objects_size_.value(),
+                 CurrentPeakSize())) {
     return;
   }
   SetCurrentPeakSize(tc_globals.sampled_objects_size_.value());
+#endif
 
   // Guaranteed to have no live sample after this call since we are doing this
   // under `recorder_lock_`.
@@ -67,6 +100,10 @@ void PeakHeapTracker::MaybeSaveSample() {
 
 std::unique_ptr<ProfileBase> PeakHeapTracker::DumpSample() {
   auto profile = absl::make_unique<StackTraceTable>(ProfileType::kPeakHeap);
+#ifdef DEFERRED_PEAK_HEAP
+  // The last peak is not left for the next tick.
+  SaveDeferredSample();
+#endif
 
   absl::base_internal::SpinLockHolder h(&recorder_lock_);
   peak_heap_recorder_.get_mutable().Iterate(
@@ -48,8 +48,24 @@ class PeakHeapTracker {
   // profile. Should be called immediately after sampling an allocation. If
   // the heap has grown by a sufficient amount since the last high-water-mark,
   // it will save a copy of the sample profile.
+  //
+  // With DEFERRED_PEAK_HEAP, a new peak is claimed by a compare-and-swap on
+  // the peak size, and while the background thread runs the copy is left to
+  // it: peaks reached between two of its ticks are saved once, from the
+  // samples live at the tick.
   void MaybeSaveSample() ABSL_LOCKS_EXCLUDED(recorder_lock_);
 
+#ifdef DEFERRED_PEAK_HEAP
+  // Called by the background thread when it starts; until then, the thread
+  // that reaches a peak copies the samples itself.
+  void SetDeferred(bool deferred) {
+    deferred_.store(deferred, std::memory_order_relaxed);
+  }
+
+  // Saves the samples if a peak was reached since the last copy.
+  void SaveDeferredSample() ABSL_LOCKS_EXCLUDED(recorder_lock_);
+#endif
+
   // Return the saved high-water-mark heap profile, if any.
   std::unique_ptr<ProfileBase> DumpSample() ABSL_LOCKS_EXCLUDED(recorder_lock_);
 
@@ -84,10 +100,20 @@ class PeakHeapTracker {
       ABSL_GUARDED_BY(recorder_lock_);
 
   // Sampled heap size last time peak_heap_recorder_ was saved. Only written
-  // under `recorder_lock_`; may be read without it.
+  // under `recorder_lock_`; may be read without it.  With DEFERRED_PEAK_HEAP,
+  // the size of the last peak claimed, whose copy may still be pending.
   std::atomic<int64_t> do_not_access_directly_peak_sampled_heap_size_{0};
 
-  bool IsNewPeak();
+#ifdef DEFERRED_PEAK_HEAP
+  std::atomic<bool> deferred_{false};
+  // A peak was claimed and the samples are not yet copied.
+  std::atomic<bool> pending_{false};
+
+  // Replaces the saved samples with the live ones.
+  void SaveSample() ABSL_LOCKS_EXCLUDED(recorder_lock_);
+#endif
+
+  bool IsNewPeak(int64_t size, int64_t peak) const;
 };
 
 }  // namespace tcmalloc_internal
@@ -0,0 +1,95 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/pointer_tag.h"
+
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+#ifndef PR_SET_TAGGED_ADDR_CTRL
+#define PR_SET_TAGGED_ADDR_CTRL 55
+#endif
+#ifndef PR_TAGGED_ADDR_ENABLE
+#define PR_TAGGED_ADDR_ENABLE (1UL << 0)
+#endif
+#ifndef ARCH_ENABLE_TAGGED_ADDR
+#define ARCH_ENABLE_TAGGED_ADDR 0x4002
+#endif
+#ifndef PR_MTE_TCF_SYNC
+#define PR_MTE_TCF_SYNC (1UL << 1)
+#endif
+#ifndef PR_MTE_TAG_SHIFT
+#define PR_MTE_TAG_SHIFT 3
+#endif
+#ifndef PROT_MTE
+#define PROT_MTE 0x20
+#endif
+#ifndef HWCAP2_MTE
+#define HWCAP2_MTE (1 << 18)
+#endif
+
+ABSL_CONST_INIT bool PointerTags::enabled_ = false;
+ABSL_CONST_INIT bool PointerTags::hardware_ = false;
+
+int MemoryTagProtection() {
+#ifdef TCMALLOC_HAVE_MEMORY_TAGGING
+  static const int prot = (getauxval(AT_HWCAP2) & HWCAP2_MTE) ? PROT_MTE : 0;
+  return prot;
+#else
+  return 0;
+#endif
+}
+
+void PointerTags::Init() {
+  if (kPointerTagMask == 0) return;
+#ifdef TCMALLOC_HAVE_MEMORY_TAGGING
+  // Synchronous tag check faults, so a mismatch stops at the access; every
+  // tag but 0 may be generated.  Falls back to TBI if the kernel refuses.
+  if (MemoryTagProtection() != 0 &&
+      prctl(PR_SET_TAGGED_ADDR_CTRL,
+            PR_TAGGED_ADDR_ENABLE | PR_MTE_TCF_SYNC |
+                (0xfffeUL << PR_MTE_TAG_SHIFT),
+            0, 0, 0) == 0) {
+    hardware_ = true;
+    enabled_ = true;
+    return;
+  }
+#endif
+#if defined(__aarch64__)
+  // TBI is always on for user addresses; the tagged address ABI lets tagged
+  // pointers reach system calls as well.
+  enabled_ =
+      prctl(PR_SET_TAGGED_ADDR_CTRL, PR_TAGGED_ADDR_ENABLE, 0, 0, 0) == 0;
+#elif defined(__x86_64__)
+  enabled_ =
+      syscall(SYS_arch_prctl, ARCH_ENABLE_TAGGED_ADDR, kPointerTagBits) == 0;
+#endif
+}
+
+void* ReservePointerTags(size_t bytes) {
+  void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return mem == MAP_FAILED ? nullptr : mem;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
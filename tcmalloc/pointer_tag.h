@@ -0,0 +1,194 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Tags kept in the top bits of heap pointers with POINTER_TAGGING.
+//
+// On aarch64 (Top Byte Ignore) and on x86-64 with LAM_U57 the hardware skips
+// the top bits of an address, so they can carry a tag.  Every object has a
+// current tag, kept in a side table next to the page map (one byte per
+// 8 bytes of heap, written at the start of the object).  Pointers
+// handed out by the allocator carry that tag, and free() moves the object to
+// the next one.  A pointer whose tag is no longer the one of its object
+// outlived the object it was returned for, which the bounds checks can tell
+// from one byte instead of the escape lists.  While tags are enabled
+// __escape() has nothing left to do.
+//
+// Tag 0 marks untagged pointers, which are never checked.  Tags are only
+// enabled if the kernel agrees to ignore the bits (PointerTags::Init()),
+// otherwise the escape lists protect the heap as before.
+//
+// With MEMORY_TAGGING on an aarch64 host with MTE, the tag of an object is
+// also stored as the allocation tag of its 16 byte granules, and the
+// hardware compares it with the pointer's on every access.  A live object
+// carries its tag, a freed one tag 0, so loads and stores through a stale
+// pointer fault, as do those that run off an object into a neighbour, whose
+// tag differs: adjacent objects take tags of opposite parity.  Free memory
+// keeps tag 0, so the allocator's own untagged accesses to free objects, such
+// as its free lists, match.  Objects that share a granule with a neighbour,
+// those of classes that are not a multiple of 16 bytes, are handed out
+// untagged from such memory and keep their escapes tracked.
+
+#ifndef TCMALLOC_POINTER_TAG_H_
+#define TCMALLOC_POINTER_TAG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/poison.h"
+
+#if defined(POINTER_TAGGING) && defined(TCMALLOC_USE_PAGEMAP3)
+#error "POINTER_TAGGING keeps its tags in the leaves of the two level pagemap"
+#endif
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+#if defined(MEMORY_TAGGING) && !defined(POINTER_TAGGING)
+#error "MEMORY_TAGGING stores the tags of POINTER_TAGGING in memory"
+#endif
+
+#if defined(POINTER_TAGGING) && defined(MEMORY_TAGGING) && \
+    defined(__linux__) && defined(__aarch64__)
+// MTE: the hardware checks bits [56, 60) against the allocation tag.
+inline constexpr int kPointerTagShift = 56;
+inline constexpr int kPointerTagBits = 4;
+#define TCMALLOC_HAVE_MEMORY_TAGGING 1
+#elif defined(POINTER_TAGGING) && defined(__linux__) && defined(__aarch64__)
+// TBI: loads and stores ignore bits [56, 64).
+inline constexpr int kPointerTagShift = 56;
+inline constexpr int kPointerTagBits = 8;
+#elif defined(POINTER_TAGGING) && defined(__linux__) && defined(__x86_64__)
+// LAM_U57: bits [57, 63) are ignored; bit 63 still tells user from kernel.
+inline constexpr int kPointerTagShift = 57;
+inline constexpr int kPointerTagBits = 6;
+#else
+inline constexpr int kPointerTagShift = 0;
+inline constexpr int kPointerTagBits = 0;
+#endif
+
+inline constexpr uintptr_t kPointerTagMask =
+    ((uintptr_t{1} << kPointerTagBits) - 1) << kPointerTagShift;
+static_assert(kPointerTagMask == 0 || kPointerTagShift >= kAddressBits,
+              "tags must not overlap the address");
+
+// Objects start 8 byte aligned, so each 8 bytes of heap get a tag byte.
+inline constexpr int kPointerTagGranuleShift = 3;
+
+// Bytes of memory one MTE allocation tag covers.
+inline constexpr size_t kMemoryTagGranule = 16;
+
+class PointerTags {
+ public:
+  // Asks the kernel to ignore the tag bits, also in system calls.  Called
+  // once from Static::SlowInitIfNecessary(), before any pointer is tagged.
+  // LAM can only be enabled while the process has a single thread, which is
+  // the case for the first allocation.
+  static void Init();
+
+  static bool enabled() { return kPointerTagMask != 0 && enabled_; }
+
+  // Whether the tags are also in memory and checked by the hardware, see
+  // MEMORY_TAGGING above.  Implies enabled().
+  static bool hardware() {
+#ifdef TCMALLOC_HAVE_MEMORY_TAGGING
+    return hardware_;
+#else
+    return false;
+#endif
+  }
+
+ private:
+  ABSL_CONST_INIT static bool enabled_;
+  ABSL_CONST_INIT static bool hardware_;
+};
+
+inline uint8_t PointerTagOf(uintptr_t p) {
+  return static_cast<uint8_t>((p & kPointerTagMask) >> kPointerTagShift);
+}
+
+inline uintptr_t StripPointerTag(uintptr_t p) { return p & ~kPointerTagMask; }
+
+inline void* StripPointerTag(const void* p) {
+  return reinterpret_cast<void*>(
+      StripPointerTag(reinterpret_cast<uintptr_t>(p)));
+}
+
+inline uintptr_t ApplyPointerTag(uintptr_t p, uint8_t tag) {
+  return p | uintptr_t{tag} << kPointerTagShift;
+}
+
+// Tag an object gets when it is freed while tagged with `tag`.  Never 0, and
+// never a tag that would make a pointer look poisoned.
+inline uint8_t NextPointerTag(uint8_t tag) {
+  constexpr uintptr_t kMaxTag = (uintptr_t{1} << kPointerTagBits) - 1;
+  do {
+    tag = tag >= kMaxTag ? 1 : tag + 1;
+  } while (IsPoisoned(ApplyPointerTag(0, tag)));
+  return tag;
+}
+
+// Tag a freed object of the hardware gets when it is next allocated: the
+// tag after `tag` that has the parity of the object's index in its span, so
+// that it differs from the tags of both neighbours.  objects of `size`
+// bytes at addr and addr + size have consecutive addr / size.
+inline uint8_t NextMemoryTag(uint8_t tag, uintptr_t addr, size_t size) {
+  constexpr uint8_t kMaxTag = (1 << kPointerTagBits) - 1;
+  const uint8_t parity = (addr / size) & 1;
+  // Tag 0 is left to free memory; the even tags start at 2.
+  const uint8_t first = parity ? 1 : 2;
+  if (tag == 0 || (tag & 1) != parity) return first;
+  return tag + 2 > kMaxTag ? first : tag + 2;
+}
+
+// Protection bits heap mappings need for their granules to hold allocation
+// tags: PROT_MTE if the CPU has MTE, 0 otherwise.  Does not depend on Init(),
+// since memory can be mapped before it runs.
+int MemoryTagProtection();
+
+// Sets the allocation tag of the granules of [addr, addr + size) to the tag
+// of addr, which must be granule aligned, as size must be.  Tag stores to
+// memory mapped without PROT_MTE are ignored.
+inline void SetMemoryTags(uintptr_t addr, size_t size) {
+#ifdef TCMALLOC_HAVE_MEMORY_TAGGING
+  const uintptr_t end = addr + size;
+  for (; addr + 2 * kMemoryTagGranule <= end; addr += 2 * kMemoryTagGranule) {
+    __asm__ __volatile__(".arch_extension memtag\n\tst2g %0, [%0]"
+                         :
+                         : "r"(addr)
+                         : "memory");
+  }
+  if (addr < end) {
+    __asm__ __volatile__(".arch_extension memtag\n\tstg %0, [%0]"
+                         :
+                         : "r"(addr)
+                         : "memory");
+  }
+#else
+  (void)addr;
+  (void)size;
+#endif
+}
+
+// Reserves the tag bytes of one page map leaf; they are backed on first
+// touch.  Returns nullptr if the address space ran out.
+void* ReservePointerTags(size_t bytes);
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_POINTER_TAG_H_
@@ -0,0 +1,109 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Encoding of the values written into escaped locations of freed objects.
+//
+// A poisoned pointer keeps the address it held in its low
+// TCMALLOC_POISON_ADDRESS_BITS bits, carries TCMALLOC_POISON_TAG in its top
+// byte, and the generation of the freed object in the bits between.  The
+// tag makes the pointer non-canonical, so dereferencing it faults, and lets
+// any check tell a stale pointer from a live one with one compare, without
+// reaching the escape lists.  The generation counts how often an object at
+// that address was freed with escapes, so comparing it with the current one
+// tells whether the memory has been recycled since.  Like inline_check.h,
+// the first part of this file is plain C for instrumented code.
+
+#ifndef TCMALLOC_POISON_H_
+#define TCMALLOC_POISON_H_
+
+#include <stdint.h>
+
+#if defined(__powerpc64__) && defined(__linux__)
+#define TCMALLOC_POISON_ADDRESS_BITS 49
+#else
+#define TCMALLOC_POISON_ADDRESS_BITS 48
+#endif
+#define TCMALLOC_POISON_TAG_MASK ((uint64_t)0xff << 56)
+#define TCMALLOC_POISON_TAG ((uint64_t)0xde << 56)
+#define TCMALLOC_POISON_GENERATION_BITS (56 - TCMALLOC_POISON_ADDRESS_BITS)
+
+#define TCMALLOC_IS_POISONED(v) \
+  (((uint64_t)(uintptr_t)(v) & TCMALLOC_POISON_TAG_MASK) == TCMALLOC_POISON_TAG)
+#define TCMALLOC_POISONED_ADDRESS(v) \
+  ((uintptr_t)(v) & (((uintptr_t)1 << TCMALLOC_POISON_ADDRESS_BITS) - 1))
+#define TCMALLOC_POISON_GENERATION(v)                      \
+  (((uintptr_t)(v) >> TCMALLOC_POISON_ADDRESS_BITS) &      \
+   (((uintptr_t)1 << TCMALLOC_POISON_GENERATION_BITS) - 1))
+
+#ifdef __cplusplus
+
+#include <stddef.h>
+
+#include "absl/numeric/bits.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+static_assert(kAddressBits <= TCMALLOC_POISON_ADDRESS_BITS,
+              "poisoned pointers must keep the whole address");
+
+inline constexpr uintptr_t kPoisonAddressMask =
+    (uintptr_t{1} << TCMALLOC_POISON_ADDRESS_BITS) - 1;
+inline constexpr uintptr_t kPoisonGenerationMask =
+    (uintptr_t{1} << TCMALLOC_POISON_GENERATION_BITS) - 1;
+
+// Number of generation counters; objects share one when their starts hash
+// alike, which only makes reports of recycled memory less precise.
+inline constexpr size_t kPoisonGenerations = 1 << 14;
+
+// Generation that follows generation.  It skips 0: with the top byte
+// ignored, as by TBI on aarch64, a poisoned pointer of generation 0 would
+// keep bits 48-55 clear and reach the freed object instead of faulting.
+inline constexpr uintptr_t NextPoisonGeneration(uintptr_t generation) {
+  return 1 + generation % kPoisonGenerationMask;
+}
+
+inline uintptr_t PoisonPointer(uintptr_t p, uintptr_t generation) {
+  return TCMALLOC_POISON_TAG |
+         (generation & kPoisonGenerationMask)
+             << TCMALLOC_POISON_ADDRESS_BITS |
+         (p & kPoisonAddressMask);
+}
+
+inline bool IsPoisoned(uintptr_t v) { return TCMALLOC_IS_POISONED(v); }
+
+inline uintptr_t PoisonedAddress(uintptr_t v) {
+  return TCMALLOC_POISONED_ADDRESS(v);
+}
+
+inline uintptr_t PoisonGeneration(uintptr_t v) {
+  return TCMALLOC_POISON_GENERATION(v);
+}
+
+// Generation counter of the object starting at obj_start.
+inline size_t PoisonGenerationIndex(uintptr_t obj_start) {
+  // Object starts are 8 byte aligned; multiplicative hashing spreads the rest.
+  return ((obj_start >> 3) * 0x9E3779B97F4A7C15ull) >>
+         (64 - absl::bit_width(kPoisonGenerations - 1));
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // __cplusplus
+
+#endif  // TCMALLOC_POISON_H_
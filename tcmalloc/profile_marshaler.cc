@@ -16,11 +16,30 @@
 
 #include <string>
 
+#include "absl/functional/function_ref.h"
+#include "absl/strings/string_view.h"
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "tcmalloc/internal/profile_builder.h"
 
 namespace tcmalloc {
+namespace {
+
+// Hands what the adaptor buffers to the sink of MarshalToSink().
+class SinkOutputStream : public google::protobuf::io::CopyingOutputStream {
+ public:
+  explicit SinkOutputStream(absl::FunctionRef<bool(absl::string_view)> sink)
+      : sink_(sink) {}
+
+  bool Write(const void* buffer, int size) override {
+    return sink_(absl::string_view(static_cast<const char*>(buffer), size));
+  }
+
+ private:
+  absl::FunctionRef<bool(absl::string_view)> sink_;
+};
+
+}  // namespace
 
 // Marshal converts a Profile instance into a gzip-encoded, serialized
 // representation suitable for viewing with PProf
@@ -43,4 +62,47 @@ absl::StatusOr<std::string> Marshal(const tcmalloc::Profile& profile) {
   return output;
 }
 
+absl::Status MarshalToFd(const tcmalloc::Profile& profile, int fd) {
+  google::protobuf::io::FileOutputStream stream(fd);
+  google::protobuf::io::GzipOutputStream gzip_stream(&stream);
+  if (absl::Status status =
+          tcmalloc_internal::StreamProfileProto(profile, &gzip_stream);
+      !status.ok()) {
+    return status;
+  }
+  if (!gzip_stream.Close() || !stream.Flush()) {
+    return absl::InternalError("Failed to write gzip stream");
+  }
+  return absl::OkStatus();
+}
+
+absl::Status MarshalToSink(const tcmalloc::Profile& profile,
+                           absl::FunctionRef<bool(absl::string_view)> sink,
+                           MarshalCompression compression) {
+  SinkOutputStream sink_stream(sink);
+  google::protobuf::io::CopyingOutputStreamAdaptor stream(&sink_stream,
+                                                kMarshalChunkBytes);
+  if (compression == MarshalCompression::kNone) {
+    if (absl::Status status =
+            tcmalloc_internal::StreamProfileProto(profile, &stream);
+        !status.ok()) {
+      return status;
+    }
+  } else {
+    google::protobuf::io::GzipOutputStream gzip_stream(&stream);
+    if (absl::Status status =
+            tcmalloc_internal::StreamProfileProto(profile, &gzip_stream);
+        !status.ok()) {
+      return status;
+    }
+    if (!gzip_stream.Close()) {
+      return absl::InternalError("Failed to write gzip stream");
+    }
+  }
+  if (!stream.Flush()) {
+    return absl::InternalError("Failed to write the profile to the sink");
+  }
+  return absl::OkStatus();
+}
+
 }  // namespace tcmalloc
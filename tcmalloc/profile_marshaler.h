@@ -17,7 +17,10 @@
 
 #include <string>
 
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
 #include "tcmalloc/malloc_extension.h"
 
 namespace tcmalloc {
@@ -27,6 +30,27 @@ namespace tcmalloc {
 // (https://github.com/google/pprof).
 absl::StatusOr<std::string> Marshal(const tcmalloc::Profile& profile);
 
+// MarshalToFd writes the same gzip-encoded representation to fd as it is
+// encoded, without holding the whole profile.proto message or its output in
+// memory.  Samples with the same stack may be split over several entries,
+// which PProf adds up.
+absl::Status MarshalToFd(const tcmalloc::Profile& profile, int fd);
+
+// Encodings MarshalToSink() can write.  kNone is the serialized profile.proto
+// itself, for a sink that compresses it with a codec of its own, e.g. zstd.
+enum class MarshalCompression { kGzip, kNone };
+
+// Largest chunk MarshalToSink() passes to its sink.
+inline constexpr int kMarshalChunkBytes = 64 << 10;
+
+// MarshalToSink encodes profile as MarshalToFd() does and passes the output
+// to sink in chunks as it is encoded, so that memory use does not grow with
+// the profile.  sink returns false to stop the encoding, which then fails.
+absl::Status MarshalToSink(
+    const tcmalloc::Profile& profile,
+    absl::FunctionRef<bool(absl::string_view)> sink,
+    MarshalCompression compression = MarshalCompression::kGzip);
+
 }  // namespace tcmalloc
 
 #endif  // TCMALLOC_PROFILE_MARSHALER_H_
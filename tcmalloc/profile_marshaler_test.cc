@@ -14,6 +14,11 @@
 
 #include "tcmalloc/profile_marshaler.h"
 
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "tcmalloc/internal/profile.pb.h"
@@ -71,6 +76,109 @@ TEST(ProfileMarshalTest, Smoke) {
   EXPECT_EQ(converted.string_table(converted.default_sample_type()), "objects");
 }
 
+TEST(ProfileMarshalTest, ToFd) {
+  auto fake_profile = absl::make_unique<FakeProfile>();
+  fake_profile->SetType(ProfileType::kHeap);
+  fake_profile->SetDuration(absl::Milliseconds(10));
+
+  std::vector<Profile::Sample> samples;
+  for (int i = 0; i < 3; ++i) {
+    auto& sample = samples.emplace_back();
+    sample.sum = 1024;
+    sample.count = 1;
+    sample.depth = 1;
+    sample.stack[0] = absl::bit_cast<void*>(uintptr_t{0x1000});
+  }
+  fake_profile->SetSamples(std::move(samples));
+
+  Profile profile =
+      tcmalloc_internal::ProfileAccessor::MakeProfile(std::move(fake_profile));
+
+  FILE* file = tmpfile();
+  ASSERT_NE(file, nullptr);
+  const int fd = fileno(file);
+  ASSERT_TRUE(MarshalToFd(profile, fd).ok());
+  ASSERT_EQ(lseek(fd, 0, SEEK_SET), 0);
+
+  google::protobuf::io::FileInputStream stream(fd);
+  google::protobuf::io::GzipInputStream gzip_stream(&stream);
+  google::protobuf::io::CodedInputStream coded_stream(&gzip_stream);
+
+  perftools::profiles::Profile converted;
+  ASSERT_TRUE(converted.ParseFromCodedStream(&coded_stream));
+  fclose(file);
+
+  EXPECT_EQ(converted.string_table(converted.default_sample_type()), "space");
+  // The three samples share their stack, so they are merged.
+  ASSERT_EQ(converted.sample_size(), 1);
+  EXPECT_EQ(converted.sample(0).value(0), 3);
+  EXPECT_EQ(converted.sample(0).value(1), 3 * 1024);
+}
+
+Profile MakeLargeProfile() {
+  auto fake_profile = absl::make_unique<FakeProfile>();
+  fake_profile->SetType(ProfileType::kHeap);
+  fake_profile->SetDuration(absl::Milliseconds(10));
+
+  std::vector<Profile::Sample> samples;
+  for (int i = 0; i < 20000; ++i) {
+    auto& sample = samples.emplace_back();
+    sample.sum = 1024;
+    sample.count = 1;
+    sample.depth = 1;
+    sample.stack[0] = absl::bit_cast<void*>(uintptr_t{0x1000} + 16 * i);
+  }
+  fake_profile->SetSamples(std::move(samples));
+  return tcmalloc_internal::ProfileAccessor::MakeProfile(
+      std::move(fake_profile));
+}
+
+TEST(ProfileMarshalTest, ToSink) {
+  const Profile profile = MakeLargeProfile();
+  for (MarshalCompression compression :
+       {MarshalCompression::kGzip, MarshalCompression::kNone}) {
+    std::string encoded;
+    int chunks = 0;
+    ASSERT_TRUE(MarshalToSink(
+                    profile,
+                    [&](absl::string_view chunk) {
+                      EXPECT_LE(chunk.size(), kMarshalChunkBytes);
+                      encoded.append(chunk.data(), chunk.size());
+                      ++chunks;
+                      return true;
+                    },
+                    compression)
+                    .ok());
+    EXPECT_GT(chunks, 1);
+
+    perftools::profiles::Profile converted;
+    google::protobuf::io::ArrayInputStream stream(encoded.data(),
+                                                  encoded.size());
+    if (compression == MarshalCompression::kGzip) {
+      google::protobuf::io::GzipInputStream gzip_stream(&stream);
+      ASSERT_TRUE(converted.ParseFromZeroCopyStream(&gzip_stream));
+    } else {
+      ASSERT_TRUE(converted.ParseFromZeroCopyStream(&stream));
+    }
+    int64_t objects = 0;
+    for (const auto& sample : converted.sample()) {
+      objects += sample.value(0);
+    }
+    EXPECT_EQ(objects, 20000);
+  }
+}
+
+TEST(ProfileMarshalTest, SinkStops) {
+  const Profile profile = MakeLargeProfile();
+  int chunks = 0;
+  EXPECT_FALSE(MarshalToSink(
+                   profile,
+                   [&](absl::string_view) { return ++chunks < 2; },
+                   MarshalCompression::kNone)
+                   .ok());
+  EXPECT_EQ(chunks, 2);
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -0,0 +1,137 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/common.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+
+namespace tcmalloc_internal {
+
+// SizeMap::Init() uses these classes when PROFILED_SIZE_CLASSES is set.
+// size_class_generator fitted them to
+//   the Beta distribution of testing/empirical_distributions.cc.
+// Run it on a heap profile of the workload, built in the configuration the
+// allocator is built in, to replace them.  <fixed> is the tail of a span and
+// its metadata per byte of objects, as in size_classes.cc.
+
+#ifdef PROFILED_SIZE_CLASSES
+// clang-format off
+#if !(defined(__cpp_aligned_new) && __STDCPP_DEFAULT_NEW_ALIGNMENT__ <= 8)
+#if TCMALLOC_PAGE_SHIFT == 13
+static_assert(kMaxSize == 262144, "kMaxSize mismatch");
+static const int kCount = 86;
+static_assert(kCount <= kNumBaseClasses);
+const int SizeMap::kProfiledSizeClassesCount = kCount;
+const SizeClassInfo SizeMap::kProfiledSizeClasses[SizeMap::kProfiledSizeClassesCount] = {
+    // <bytes>, <pages>, <batch size>    <fixed>
+    {        0,       0,           0},  // +Inf%
+    {        8,       1,          32},  // 0.59%
+    {       16,       1,          32},  // 0.59%
+    {       32,       1,          32},  // 0.59%
+    {       48,       1,          32},  // 0.98%
+    {       64,       1,          32},  // 0.59%
+    {       80,       1,          32},  // 0.98%
+    {       96,       1,          32},  // 0.98%
+    {      112,       1,          32},  // 0.78%
+    {      128,       1,          32},  // 0.59%
+    {      144,       1,          32},  // 2.18%
+    {      160,       1,          32},  // 0.98%
+    {      176,       1,          32},  // 1.78%
+    {      192,       1,          32},  // 2.18%
+    {      208,       1,          32},  // 1.58%
+    {      224,       1,          32},  // 2.18%
+    {      240,       1,          32},  // 0.98%
+    {      256,       1,          32},  // 0.59%
+    {      272,       1,          32},  // 0.98%
+    {      288,       1,          32},  // 2.18%
+    {      304,       1,          32},  // 4.25%
+    {      320,       1,          32},  // 3.00%
+    {      336,       1,          32},  // 2.18%
+    {      352,       1,          32},  // 1.78%
+    {      368,       1,          32},  // 1.78%
+    {      400,       1,          32},  // 3.00%
+    {      416,       1,          32},  // 4.25%
+    {      448,       1,          32},  // 2.18%
+    {      480,       1,          32},  // 0.98%
+    {      512,       1,          32},  // 0.59%
+    {      576,       2,          32},  // 1.88%
+    {      640,       3,          32},  // 1.25%
+    {      704,       2,          32},  // 1.48%
+    {      768,       2,          32},  // 1.88%
+    {      832,       4,          32},  // 1.13%
+    {      960,       2,          32},  // 0.69%
+    {     1024,       1,          32},  // 0.59%
+    {     1152,       2,          32},  // 1.88%
+    {     1280,       3,          32},  // 1.25%
+    {     1408,       4,          32},  // 1.33%
+    {     1536,       3,          32},  // 0.20%
+    {     1664,       6,          32},  // 1.96%
+    {     1920,       4,          32},  // 0.54%
+    {     2048,       1,          32},  // 0.59%
+    {     2176,       4,          30},  // 0.54%
+    {     2304,       2,          28},  // 1.88%
+    {     2560,       5,          25},  // 0.12%
+    {     2816,       7,          23},  // 1.90%
+    {     2944,       4,          22},  // 1.33%
+    {     3200,       9,          20},  // 0.24%
+    {     3456,       3,          18},  // 1.79%
+    {     3712,       5,          17},  // 0.43%
+    {     4096,       1,          16},  // 0.59%
+    {     4224,      11,          15},  // 1.64%
+    {     4864,       3,          13},  // 1.25%
+    {     5504,      13,          11},  // 1.88%
+    {     5632,       7,          11},  // 1.90%
+    {     6272,       7,          10},  // 1.67%
+    {     7168,       7,           9},  // 0.08%
+    {     8192,       1,           8},  // 0.59%
+    {     8448,      17,           7},  // 3.07%
+    {     9344,       8,           7},  // 0.27%
+    {    10112,       5,           6},  // 1.38%
+    {    11392,       7,           5},  // 0.76%
+    {    12416,      17,           5},  // 2.00%
+    {    14464,      16,           4},  // 0.73%
+    {    16384,       2,           4},  // 0.29%
+    {    17024,      17,           3},  // 2.29%
+    {    18560,      16,           3},  // 0.92%
+    {    22656,      14,           2},  // 1.29%
+    {    24704,      19,           2},  // 5.04%
+    {    30720,      15,           2},  // 0.04%
+    {    32768,       4,           2},  // 0.15%
+    {    34816,      17,           2},  // 0.03%
+    {    36992,      14,           2},  // 3.39%
+    {    45696,      17,           2},  // 1.62%
+    {    51840,      19,           2},  // 0.11%
+    {    55552,      21,           2},  // 3.25%
+    {    65536,       8,           2},  // 0.07%
+    {    65664,      17,           2},  // 6.08%
+    {    74368,      19,           2},  // 4.68%
+    {    82048,      21,           2},  // 4.87%
+    {   114816,      29,           2},  // 3.48%
+    {   131072,      16,           2},  // 0.04%
+    {   135808,      17,           2},  // 2.58%
+    {   262144,      32,           2},  // 0.02%
+};
+#else
+#error "Generated for another TCMALLOC_PAGE_SHIFT; rerun size_class_generator"
+#endif
+#else
+#error "Generated for another operator new alignment; rerun size_class_generator"
+#endif
+// clang-format on
+#endif  // PROFILED_SIZE_CLASSES
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,199 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/protection_report.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/debugging/symbolize.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT ProtectionReports::Site ProtectionReports::sites_[kSites];
+ABSL_CONST_INIT ProtectionReports::Cell ProtectionReports::ring_[kRing];
+ABSL_CONST_INIT std::atomic<uint64_t> ProtectionReports::tail_{0};
+ABSL_CONST_INIT uint64_t ProtectionReports::head_ = 0;
+ABSL_CONST_INIT std::atomic<uint64_t> ProtectionReports::dropped_{0};
+
+namespace {
+
+// Serializes the consumers of the ring and of the sites' details; Record()
+// never takes it.
+ABSL_CONST_INIT absl::base_internal::SpinLock report_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+
+constexpr int kKindBits = 2;
+
+const char* KindName(ProtectionReports::Kind kind) {
+  switch (kind) {
+    case ProtectionReports::Kind::kOutOfBounds:
+      return "out of bounds";
+    case ProtectionReports::Kind::kUseAfterFree:
+      return "use after free";
+    case ProtectionReports::Kind::kInvalidFree:
+      return "invalid free";
+  }
+  return "unknown";
+}
+
+void* SitePc(uintptr_t key) {
+  return reinterpret_cast<void*>(key >> kKindBits);
+}
+
+ProtectionReports::Kind SiteKind(uintptr_t key) {
+  return static_cast<ProtectionReports::Kind>(
+      key & ((uintptr_t{1} << kKindBits) - 1));
+}
+
+// Symbolizes the call instruction rather than the one after it.
+void Symbolize(uintptr_t key, char* buf, size_t size) {
+  if (!absl::Symbolize(static_cast<char*>(SitePc(key)) - 1, buf, size)) {
+    buf[0] = '\0';
+  }
+}
+
+}  // namespace
+
+void ProtectionReports::RecordSlow(Kind kind, const void* pc, const char* what,
+                                   const uintptr_t* values, int num_values) {
+  const uintptr_t key = reinterpret_cast<uintptr_t>(pc) << kKindBits |
+                        static_cast<uintptr_t>(kind);
+  size_t i = (key * 0x9E3779B97F4A7C15ull) >> 32;
+  for (size_t probe = 0; probe < kMaxProbes; ++probe, ++i) {
+    Site& s = sites_[i % kSites];
+    uintptr_t cur = s.key.load(std::memory_order_acquire);
+    if (cur == 0 &&
+        s.key.compare_exchange_strong(cur, key, std::memory_order_acq_rel)) {
+      s.what.store(what, std::memory_order_release);
+      s.count.fetch_add(1, std::memory_order_relaxed);
+      if (!Push(i % kSites, values, num_values)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+      }
+      return;
+    }
+    if (cur == key) {
+      s.count.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+  dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+// A bounded multi-producer queue: producers claim a position by advancing
+// tail_ and publish their cell by advancing its sequence number past it.
+bool ProtectionReports::Push(uint32_t site, const uintptr_t* values,
+                             int num_values) {
+  uint64_t pos = tail_.load(std::memory_order_relaxed);
+  while (true) {
+    Cell& c = ring_[pos % kRing];
+    const uint64_t seq =
+        c.seq.load(std::memory_order_acquire) + pos % kRing;
+    if (seq == pos) {
+      if (tail_.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed)) {
+        c.site = site;
+        c.num_values = num_values;
+        std::copy(values, values + num_values, c.values);
+        c.seq.store(pos + 1 - pos % kRing, std::memory_order_release);
+        return true;
+      }
+    } else if (seq < pos) {
+      return false;  // Full: the consumer has not freed this cell yet.
+    } else {
+      pos = tail_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void ProtectionReports::Drain() {
+  while (true) {
+    Cell& c = ring_[head_ % kRing];
+    if (c.seq.load(std::memory_order_acquire) + head_ % kRing != head_ + 1) {
+      return;
+    }
+    Site& s = sites_[c.site];
+    s.num_values = c.num_values;
+    std::copy(c.values, c.values + c.num_values, s.values);
+    c.seq.store(head_ + kRing - head_ % kRing, std::memory_order_release);
+    ++head_;
+  }
+}
+
+void ProtectionReports::Describe(const Site& s, char* buf, size_t size) {
+  Printer out(buf, size);
+  const char* what = s.what.load(std::memory_order_acquire);
+  out.printf("%s", what != nullptr ? what : "");
+  for (int i = 0; i < s.num_values; ++i) {
+    if (i == 0) {
+      out.printf(" %p", reinterpret_cast<void*>(s.values[i]));
+    } else {
+      out.printf(" %u", s.values[i]);
+    }
+  }
+}
+
+void ProtectionReports::Emit() {
+  absl::base_internal::SpinLockHolder h(&report_lock);
+  Drain();
+  for (Site& s : sites_) {
+    const uintptr_t key = s.key.load(std::memory_order_acquire);
+    const uint64_t count = s.count.load(std::memory_order_relaxed);
+    if (key == 0 || count == s.logged) continue;
+
+    char symbol[256];
+    char what[256];
+    Symbolize(key, symbol, sizeof(symbol));
+    Describe(s, what, sizeof(what));
+    if (s.logged == 0) {
+      Log(kLog, __FILE__, __LINE__, KindName(SiteKind(key)), SitePc(key),
+          symbol, what);
+    } else {
+      Log(kLog, __FILE__, __LINE__, KindName(SiteKind(key)), SitePc(key),
+          symbol, "repeated (times)", count - s.logged);
+    }
+    s.logged = count;
+  }
+}
+
+void ProtectionReports::Get(
+    std::vector<MallocExtension::ProtectionReport>* ret) {
+  absl::base_internal::SpinLockHolder h(&report_lock);
+  Drain();
+  for (const Site& s : sites_) {
+    const uintptr_t key = s.key.load(std::memory_order_acquire);
+    if (key == 0) continue;
+
+    char symbol[256];
+    char what[256];
+    Symbolize(key, symbol, sizeof(symbol));
+    Describe(s, what, sizeof(what));
+    MallocExtension::ProtectionReport r;
+    r.kind = SiteKind(key);
+    r.call_site = SitePc(key);
+    r.symbol = symbol;
+    r.description = what;
+    r.count = s.count.load(std::memory_order_relaxed);
+    ret->push_back(std::move(r));
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
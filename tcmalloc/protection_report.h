@@ -0,0 +1,169 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Deferred reports of the errors found by the protection checks.
+//
+// Unless the protection policy is MallocExtension::ProtectionPolicy::kCrash,
+// the process keeps running after an error, so a buggy loop may hit the same
+// check millions of times.  Logging each occurrence with a stack trace would
+// stall it, so errors are only counted here, per call site and kind, with a
+// few atomic operations and without locks or allocation:
+//
+//  * kSites sites are kept in an open addressing table keyed by the return
+//    address of the check and the kind of the error.  Only the first
+//    occurrence at a site also pushes its values (address, generation, ...)
+//    to a bounded lock-free ring of kRing records.  Errors at new sites that
+//    find the table or the ring full are only counted as dropped.
+//  * Emit(), run by MallocExtension::ProcessBackgroundActions(), symbolizes
+//    the sites and logs the first occurrence at each new site and the number
+//    of occurrences since the last Emit() at every other one.
+//  * Get() returns the sites to MallocExtension::GetProtectionReports().
+
+#ifndef TCMALLOC_PROTECTION_REPORT_H_
+#define TCMALLOC_PROTECTION_REPORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <type_traits>
+#include <vector>
+
+#include "absl/base/attributes.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/parameters.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+class ProtectionReports {
+ public:
+  using Kind = MallocExtension::ProtectionReport::Kind;
+
+  static constexpr size_t kSites = 256;
+  static constexpr size_t kRing = 64;
+  static constexpr size_t kMaxProbes = 16;
+  static constexpr int kMaxValues = 3;
+
+  // Counts an error of `kind` found at call site `pc`.  `what` must be a
+  // string literal; values are the integers and pointers that Log() would
+  // have printed after it.
+  template <typename... Values>
+  static void Record(Kind kind, const void* pc, const char* what,
+                     Values... values) {
+    static_assert(sizeof...(Values) <= kMaxValues, "too many values");
+    const uintptr_t v[kMaxValues + 1] = {ToValue(values)...};
+    RecordSlow(kind, pc, what, v, sizeof...(Values));
+  }
+
+  // Logs the sites that saw errors since the last call.
+  static void Emit();
+
+  // Appends one report per site to ret.
+  static void Get(std::vector<MallocExtension::ProtectionReport>* ret);
+
+  // Errors that could not be recorded because their site found no room.
+  static uint64_t dropped() {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Site {
+    // Return address shifted left by two, or'ed with the kind; 0 if free.
+    std::atomic<uintptr_t> key;
+    std::atomic<uint64_t> count;
+    std::atomic<const char*> what;
+    // Values of the first occurrence, written by Drain().
+    uintptr_t values[kMaxValues];
+    int num_values;
+    // count when the site was last logged.
+    uint64_t logged;
+  };
+
+  // First occurrence at a new site, in flight to Drain().
+  struct Cell {
+    // Position in the ring this cell is free for (or was written at, plus
+    // one), minus the index of the cell, so that zero initialization is the
+    // empty ring.
+    std::atomic<uint64_t> seq;
+    uint32_t site;
+    int num_values;
+    uintptr_t values[kMaxValues];
+  };
+
+  static uintptr_t ToValue(const void* p) {
+    return reinterpret_cast<uintptr_t>(p);
+  }
+  template <typename T,
+            typename = std::enable_if_t<std::is_integral<T>::value>>
+  static uintptr_t ToValue(T v) {
+    return static_cast<uintptr_t>(v);
+  }
+
+  static void RecordSlow(Kind kind, const void* pc, const char* what,
+                         const uintptr_t* values, int num_values);
+  static bool Push(uint32_t site, const uintptr_t* values, int num_values);
+  // Moves the records of the ring to their sites.  Called with the lock of
+  // Emit() and Get() held.
+  static void Drain();
+  static void Describe(const Site& s, char* buf, size_t size);
+
+  ABSL_CONST_INIT static Site sites_[kSites];
+  ABSL_CONST_INIT static Cell ring_[kRing];
+  ABSL_CONST_INIT static std::atomic<uint64_t> tail_;
+  ABSL_CONST_INIT static uint64_t head_;
+  ABSL_CONST_INIT static std::atomic<uint64_t> dropped_;
+};
+
+// True if errors abort the process, see MallocExtension::ProtectionPolicy.
+inline bool CrashOnCorruption() {
+  return Parameters::protection_policy() ==
+         MallocExtension::ProtectionPolicy::kCrash;
+}
+
+// Called after an error was reported.
+inline void MaybeCrashOnCorruption() {
+  if (CrashOnCorruption()) {
+    fflush(stdout);
+    abort();
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+// Reports an error of `kind` found at call site `pc`; the remaining arguments
+// are those of Log().  An error that is about to crash the process is logged
+// with a stack trace right away.
+#define TCMALLOC_REPORT_PROTECTION_ERROR(kind, pc, ...)                  \
+  do {                                                                   \
+    if (::tcmalloc::tcmalloc_internal::CrashOnCorruption()) {            \
+      ::tcmalloc::tcmalloc_internal::Log(                                \
+          ::tcmalloc::tcmalloc_internal::kLogWithStack, __FILE__,        \
+          __LINE__, __VA_ARGS__);                                        \
+    } else {                                                             \
+      ::tcmalloc::tcmalloc_internal::ProtectionReports::Record(          \
+          ::tcmalloc::MallocExtension::ProtectionReport::Kind::kind, pc, \
+          __VA_ARGS__);                                                  \
+    }                                                                    \
+  } while (0)
+
+#endif  // TCMALLOC_PROTECTION_REPORT_H_
@@ -0,0 +1,119 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/protection_timing.h"
+
+#include <algorithm>
+
+#include "absl/numeric/bits.h"
+#include "tcmalloc/internal/percpu.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT thread_local int ProtectionTiming::countdown_ = 0;
+ProtectionTiming::Shard ProtectionTiming::shards_[kShards];
+
+void ProtectionTiming::Record(TimedPath path, int64_t cycles) {
+  // The cycle counters of two CPUs may disagree if the thread moved.
+  const uint64_t c = cycles > 0 ? static_cast<uint64_t>(cycles) : 0;
+  const int bucket =
+      c == 0 ? 0 : std::min<int>(absl::bit_width(c) - 1, kBuckets - 1);
+  const int cpu = subtle::percpu::GetCurrentCpu();
+  Shard& s = shards_[cpu < 0 ? 0 : static_cast<size_t>(cpu) % kShards];
+  const int p = static_cast<int>(path);
+  s.counts[p][bucket].fetch_add(1, std::memory_order_relaxed);
+  s.cycles[p].fetch_add(c, std::memory_order_relaxed);
+}
+
+namespace {
+
+constexpr const char* kNames[ProtectionTiming::kNumPaths] = {
+    "escape", "flush_escapes", "poison_escapes", "gep_check", "string_check",
+};
+
+}  // namespace
+
+uint64_t ProtectionTiming::Merge(int path, uint64_t counts[kBuckets],
+                                 uint64_t* cycles) {
+  uint64_t samples = 0;
+  *cycles = 0;
+  for (int b = 0; b < kBuckets; ++b) counts[b] = 0;
+  for (const Shard& s : shards_) {
+    for (int b = 0; b < kBuckets; ++b) {
+      const uint64_t n = s.counts[path][b].load(std::memory_order_relaxed);
+      counts[b] += n;
+      samples += n;
+    }
+    *cycles += s.cycles[path].load(std::memory_order_relaxed);
+  }
+  return samples;
+}
+
+void ProtectionTiming::Print(Printer* out) {
+  out->printf("------------------------------------------------\n");
+  out->printf("Protection timing: cycles of 1 in %d calls per thread\n",
+              kSamplePeriod);
+  out->printf("------------------------------------------------\n");
+  for (int p = 0; p < kNumPaths; ++p) {
+    uint64_t counts[kBuckets];
+    uint64_t cycles;
+    const uint64_t samples = Merge(p, counts, &cycles);
+    if (samples == 0) continue;
+
+    out->printf("PROTECTION TIMING %-15s %12u samples, %10.1f cycles mean\n",
+                kNames[p], samples, static_cast<double>(cycles) / samples);
+    for (int b = 0; b < kBuckets; ++b) {
+      if (counts[b] == 0) continue;
+      const uint64_t lo = b == 0 ? 0 : uint64_t{1} << b;
+      if (b == kBuckets - 1) {
+        out->printf("PROTECTION TIMING %-15s [%10u,        inf) %12u\n",
+                    kNames[p], lo, counts[b]);
+      } else {
+        out->printf("PROTECTION TIMING %-15s [%10u, %10u) %12u\n", kNames[p],
+                    lo, uint64_t{1} << (b + 1), counts[b]);
+      }
+    }
+  }
+}
+
+void ProtectionTiming::PrintInPbtxt(PbtxtRegion* region) {
+  region->PrintI64("sample_period", kSamplePeriod);
+  for (int p = 0; p < kNumPaths; ++p) {
+    uint64_t counts[kBuckets];
+    uint64_t cycles;
+    const uint64_t samples = Merge(p, counts, &cycles);
+    if (samples == 0) continue;
+
+    PbtxtRegion path = region->CreateSubRegion("path");
+    path.PrintRaw("name", kNames[p]);
+    path.PrintI64("samples", samples);
+    path.PrintI64("cycles", cycles);
+    for (int b = 0; b < kBuckets; ++b) {
+      if (counts[b] == 0) continue;
+      PbtxtRegion bucket = path.CreateSubRegion("histogram");
+      bucket.PrintI64("lower_bound", b == 0 ? 0 : uint64_t{1} << b);
+      // The last bucket is open; it has no upper bound.
+      if (b != kBuckets - 1) {
+        bucket.PrintI64("upper_bound", uint64_t{1} << (b + 1));
+      }
+      bucket.PrintI64("count", counts[b]);
+    }
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
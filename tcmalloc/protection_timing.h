@@ -0,0 +1,121 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Sampled cycle histograms of the protection hot paths (PROTECTION_TIMING).
+//
+// Each thread times one in kSamplePeriod calls of the timed paths: the
+// cycle counter is read around the call and the elapsed cycles go to a log2
+// histogram of the current CPU.  The other calls only count down a
+// thread-local.  The histograms are summed when GetStats() prints them, so
+// the share of each path in the protection overhead can be told apart
+// without instrumenting every call like ENABLE_GPROF does.
+
+#ifndef TCMALLOC_PROTECTION_TIMING_H_
+#define TCMALLOC_PROTECTION_TIMING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+enum class TimedPath {
+  kEscape,         // do_escape()
+  kFlushEscapes,   // flush_escape()
+  kPoisonEscapes,  // poison_escapes()
+  kGepCheck,       // do_gep_check_boundary()
+  kStringCheck,    // str* and mem* checks
+  kNumPaths,
+};
+
+class ProtectionTiming {
+ public:
+  static constexpr int kSamplePeriod = 64;
+  // Bucket b counts calls of [2^b, 2^(b+1)) cycles; the last one is open.
+  static constexpr int kBuckets = 32;
+  static constexpr size_t kShards = 64;
+  static constexpr int kNumPaths = static_cast<int>(TimedPath::kNumPaths);
+
+  // Returns true for one in kSamplePeriod calls on this thread.
+  static bool ShouldSample() {
+    if (ABSL_PREDICT_TRUE(--countdown_ > 0)) return false;
+    countdown_ = kSamplePeriod;
+    return true;
+  }
+
+  static void Record(TimedPath path, int64_t cycles);
+
+  // Prints the histograms of all paths that were sampled.
+  static void Print(Printer* out);
+  static void PrintInPbtxt(PbtxtRegion* region);
+
+ private:
+  struct alignas(ABSL_CACHELINE_SIZE) Shard {
+    std::atomic<uint64_t> counts[kNumPaths][kBuckets];
+    std::atomic<uint64_t> cycles[kNumPaths];
+  };
+
+  // Sums the histogram and cycles of `path` over all shards into `counts`
+  // and `cycles`, and returns the number of samples.
+  static uint64_t Merge(int path, uint64_t counts[kBuckets], uint64_t* cycles);
+
+  ABSL_CONST_INIT static thread_local int countdown_;
+  static Shard shards_[kShards];
+};
+
+// Times its scope when ProtectionTiming::ShouldSample() says so.
+class ProtectionTimer {
+ public:
+  explicit ProtectionTimer(TimedPath path)
+      : path_(path),
+        start_(ProtectionTiming::ShouldSample()
+                   ? absl::base_internal::CycleClock::Now()
+                   : 0) {}
+  ProtectionTimer(const ProtectionTimer&) = delete;
+  ProtectionTimer& operator=(const ProtectionTimer&) = delete;
+
+  ~ProtectionTimer() {
+    if (ABSL_PREDICT_FALSE(start_ != 0)) {
+      ProtectionTiming::Record(
+          path_, absl::base_internal::CycleClock::Now() - start_);
+    }
+  }
+
+ private:
+  const TimedPath path_;
+  const int64_t start_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#ifdef PROTECTION_TIMING
+#define TCMALLOC_TIME_PROTECTION(path)                    \
+  ::tcmalloc::tcmalloc_internal::ProtectionTimer          \
+      protection_timer(::tcmalloc::tcmalloc_internal::TimedPath::path)
+#else
+#define TCMALLOC_TIME_PROTECTION(path)
+#endif
+
+#endif  // TCMALLOC_PROTECTION_TIMING_H_
@@ -0,0 +1,207 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Quarantine of freed small objects whose escapes are poisoned in batches.
+
+#ifndef TCMALLOC_QUARANTINE_H_
+#define TCMALLOC_QUARANTINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/span.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// An object freed while FREE_QUARANTINE is enabled, or queued for its home
+// CPU with REMOTE_FREE_QUEUE.
+struct QuarantineEntry {
+  void* ptr;
+  uint16_t size_class;
+  // Poison generation of the object, already used for its staged escapes.
+  uint16_t generation;
+  uint32_t obj_size;
+};
+
+// With FREE_QUARANTINE, free() of a small object only poisons the escapes
+// staged by the calling thread and parks the object in the shard of the
+// current CPU.  The object is not handed back to the caches yet, so the
+// escaped locations that still point to it cannot reach a new object.  When
+// a shard fills up (kCapacity objects or kMaxBytes bytes), the freeing
+// thread takes the whole batch and poisons the escape chains of all of its
+// objects before releasing them; MallocExtension::ProcessBackgroundEscapes()
+// drains the shards in the background as well.
+//
+// The first word of a quarantined object holds kMagic, so a second free() of
+// it is caught by Contains() instead of releasing the object twice.
+class QuarantineShard {
+ public:
+  static constexpr size_t kCapacity = 128;
+  static constexpr size_t kMaxBytes = 1 << 20;
+  static constexpr uintptr_t kMagic = 0xdeadbeefdeadf1eeull;
+
+  constexpr QuarantineShard()
+      : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY),
+        size_(0),
+        bytes_(0),
+        entries_{} {}
+
+  // Parks e.  If the shard was full, its entries are moved to batch first and
+  // their number is returned; the caller has to release them.
+  size_t Push(const QuarantineEntry& e, QuarantineEntry* batch)
+      ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    size_t n = 0;
+    if (size_ == kCapacity || bytes_ + e.obj_size > kMaxBytes) {
+      n = TakeLocked(batch);
+    }
+    entries_[size_++] = e;
+    bytes_ += e.obj_size;
+    return n;
+  }
+
+  // Moves all parked entries to batch and returns their number.
+  size_t Take(QuarantineEntry* batch) ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    return TakeLocked(batch);
+  }
+
+  // Racy hint to skip the lock when there is likely nothing to Take().
+  bool MaybeEmpty() const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    return __atomic_load_n(&size_, __ATOMIC_RELAXED) == 0;
+  }
+
+  bool Contains(const void* ptr) ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    for (size_t i = 0; i < size_; ++i) {
+      if (entries_[i].ptr == ptr) return true;
+    }
+    return false;
+  }
+
+ private:
+  size_t TakeLocked(QuarantineEntry* batch)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+    const size_t n = size_;
+    std::copy(entries_, entries_ + n, batch);
+    size_ = 0;
+    bytes_ = 0;
+    return n;
+  }
+
+  absl::base_internal::SpinLock lock_;
+  size_t size_ ABSL_GUARDED_BY(lock_);
+  size_t bytes_ ABSL_GUARDED_BY(lock_);
+  QuarantineEntry entries_[kCapacity] ABSL_GUARDED_BY(lock_);
+};
+
+#ifdef DEFERRED_ESCAPE_POISON
+// An object whose free() poisoned only the first chunks of its escape chain;
+// `rest` holds the detached chunks it did not get to.
+struct DeferredPoisonEntry {
+  QuarantineEntry object;
+  struct escape* rest;
+};
+
+// Objects whose escape chain was too long to poison within the chunk limit
+// of one free(), see Parameters::escape_poison_chunk_limit().  They stay out
+// of reuse until the rest of their chain is poisoned, either by
+// MallocExtension::ProcessBackgroundEscapes() or, once the queue is full, by
+// the free() that pushes out the oldest entry.  The first word of a queued
+// object holds QuarantineShard::kMagic, like a quarantined one.
+class DeferredPoisonQueue {
+ public:
+  static constexpr size_t kCapacity = 32;
+
+  constexpr DeferredPoisonQueue()
+      : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY),
+        size_(0),
+        entries_{} {}
+
+  // Queues e.  If the queue was full, its oldest entry is moved to *evicted
+  // and true is returned; the caller has to finish it.
+  bool Push(const DeferredPoisonEntry& e, DeferredPoisonEntry* evicted)
+      ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    bool full = size_ == kCapacity;
+    if (full) {
+      *evicted = entries_[0];
+      std::copy(entries_ + 1, entries_ + size_, entries_);
+      size_--;
+    }
+    entries_[size_++] = e;
+    return full;
+  }
+
+  // Moves all queued entries to batch and returns their number.
+  size_t Take(DeferredPoisonEntry* batch) ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    const size_t n = size_;
+    std::copy(entries_, entries_ + n, batch);
+    size_ = 0;
+    return n;
+  }
+
+  // Racy hint to skip the lock when there is likely nothing to Take().
+  bool MaybeEmpty() const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    return __atomic_load_n(&size_, __ATOMIC_RELAXED) == 0;
+  }
+
+  bool Contains(const void* ptr) ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::base_internal::SpinLockHolder h(&lock_);
+    for (size_t i = 0; i < size_; ++i) {
+      if (entries_[i].object.ptr == ptr) return true;
+    }
+    return false;
+  }
+
+ private:
+  absl::base_internal::SpinLock lock_;
+  size_t size_ ABSL_GUARDED_BY(lock_);
+  DeferredPoisonEntry entries_[kCapacity] ABSL_GUARDED_BY(lock_);
+};
+#endif
+
+inline constexpr size_t kQuarantineShards = 64;
+
+// Shard for the calling thread: the current CPU where rseq or sched_getcpu()
+// tell it, shard 0 otherwise.
+inline size_t QuarantineShardIndex() {
+  const int cpu = subtle::percpu::GetCurrentCpu();
+  return cpu < 0 ? 0 : static_cast<size_t>(cpu) % kQuarantineShards;
+}
+
+// Releases every quarantined object, with REMOTE_FREE_QUEUE every object
+// queued for its home CPU, with DEFERRED_ESCAPE_POISON every object whose
+// escapes were deferred and with LARGE_FREE_OFFLOAD every large object whose
+// free was offloaded, and returns how many were released.
+// Defined in tcmalloc.cc; driven by MallocExtension::ProcessBackgroundEscapes().
+size_t DrainQuarantine();
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_QUARANTINE_H_
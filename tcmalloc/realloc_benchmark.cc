@@ -0,0 +1,208 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// realloc() under the growth patterns of containers: doubling, growing by
+// half, growing a byte at a time and shrinking to fit, from small, large and
+// huge starting sizes.  Each iteration runs one pattern from malloc() to
+// free(), with the object's escapes recorded in `escapes` heap locations
+// that point to its start, re-escaped after every move as a container's
+// users would.
+//
+// Besides the reallocs per second, every run reports the moves, the bytes
+// they copied, and what became of the escapes of the moved objects: those
+// realloc() poisoned, and those it migrated to the new object under
+// Parameters::realloc_migrate_escapes().  Growth in place, the mremap() of
+// huge objects and escape migration each show up in those counters.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/tcmalloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+enum Range { kSmall, kLarge, kHuge };
+enum Pattern { kDouble, kHalf, kIncrement, kShrinkToFit };
+enum Protection { kUnprotected, kPoison, kMigrate };
+
+// The first and last sizes of a pattern.
+size_t StartSize(Range range) {
+  switch (range) {
+    case kSmall:
+      return 16;
+    case kLarge:
+      return 2 * kMaxSize;
+    case kHuge:
+      return 64 << 20;
+  }
+  return 0;
+}
+
+size_t EndSize(Range range) {
+  switch (range) {
+    case kSmall:
+      return 4 << 10;
+    case kLarge:
+      return 8 << 20;
+    case kHuge:
+      return 256 << 20;
+  }
+  return 0;
+}
+
+// Reallocs of one byte each kIncrement runs from the start size.
+constexpr size_t kIncrements = 256;
+
+// The sizes a pattern reallocs the object to after malloc(start).
+std::vector<size_t> Steps(Range range, Pattern pattern) {
+  const size_t start = StartSize(range);
+  const size_t end = EndSize(range);
+  std::vector<size_t> steps;
+  switch (pattern) {
+    case kDouble:
+      for (size_t n = start * 2; n <= end; n *= 2) steps.push_back(n);
+      break;
+    case kHalf:
+      for (size_t n = start + start / 2; n <= end; n += n / 2) {
+        steps.push_back(n);
+      }
+      break;
+    case kIncrement:
+      for (size_t i = 1; i <= kIncrements; ++i) steps.push_back(start + i);
+      break;
+    case kShrinkToFit:
+      // Grown to its capacity, then trimmed to what a last doubling left
+      // in use.
+      steps.push_back(end);
+      steps.push_back(end / 2 + end / 8);
+      break;
+  }
+  return steps;
+}
+
+// Sets the protection policy and escape migration for a run, restoring both
+// when done.
+class ScopedProtection {
+ public:
+  explicit ScopedProtection(Protection protection)
+      : policy_(MallocExtension::GetProtectionPolicy()),
+        migrate_(Parameters::realloc_migrate_escapes()) {
+    MallocExtension::SetProtectionPolicy(
+        protection == kUnprotected
+            ? MallocExtension::ProtectionPolicy::kDisabled
+            : MallocExtension::ProtectionPolicy::kCrash);
+    Parameters::set_realloc_migrate_escapes(protection == kMigrate);
+  }
+
+  ~ScopedProtection() {
+    MallocExtension::SetProtectionPolicy(policy_);
+    Parameters::set_realloc_migrate_escapes(migrate_);
+  }
+
+ private:
+  const MallocExtension::ProtectionPolicy policy_;
+  const bool migrate_;
+};
+
+// Points every location at obj and records the escapes.
+void EscapeInto(std::vector<void*>& locs, void* obj) {
+  for (void*& loc : locs) {
+    TCMallocInternalEscape(&loc, obj);
+    loc = obj;
+  }
+}
+
+// state.range(0) is the Range, range(1) the Pattern, range(2) the
+// Protection and range(3) the number of escapes.
+void BM_ReallocGrowth(benchmark::State& state) {
+  const Range range = static_cast<Range>(state.range(0));
+  const std::vector<size_t> steps =
+      Steps(range, static_cast<Pattern>(state.range(1)));
+  ScopedProtection protection(static_cast<Protection>(state.range(2)));
+  std::vector<void*> locs(state.range(3), nullptr);
+
+  size_t moves = 0;
+  size_t copied = 0;
+  size_t poisoned = 0;
+  size_t migrated = 0;
+  for (auto _ : state) {
+    size_t size = StartSize(range);
+    char* p = static_cast<char*>(malloc(size));
+    // Touches the object once, as a container filling it would.
+    memset(p, 0, size);
+    EscapeInto(locs, p);
+    for (size_t n : steps) {
+      char* q = static_cast<char*>(realloc(p, n));
+      CHECK_CONDITION(q != nullptr);
+      if (q != p) {
+        moves++;
+        copied += std::min(size, n);
+        for (void* loc : locs) {
+          char* v = static_cast<char*>(loc);
+          if (v >= q && v < q + n) {
+            migrated++;
+          } else if (v != p) {
+            poisoned++;
+          }
+        }
+        EscapeInto(locs, q);
+      }
+      if (n > size) memset(q + size, 0, n - size);
+      p = q;
+      size = n;
+    }
+    for (void*& loc : locs) loc = nullptr;
+    free(p);
+  }
+  state.SetItemsProcessed(state.iterations() * steps.size());
+  state.counters["moves"] = benchmark::Counter(
+      moves, benchmark::Counter::kAvgIterations);
+  state.counters["bytes_copied"] = benchmark::Counter(
+      copied, benchmark::Counter::kAvgIterations);
+  state.counters["escapes_poisoned"] = benchmark::Counter(
+      poisoned, benchmark::Counter::kAvgIterations);
+  state.counters["escapes_migrated"] = benchmark::Counter(
+      migrated, benchmark::Counter::kAvgIterations);
+}
+
+void GrowthPatterns(benchmark::internal::Benchmark* b) {
+  for (int64_t range : {kSmall, kLarge, kHuge}) {
+    for (int64_t pattern : {kDouble, kHalf, kIncrement, kShrinkToFit}) {
+      b->Args({range, pattern, kUnprotected, 0});
+      for (int64_t protection : {kPoison, kMigrate}) {
+        for (int64_t escapes : {0, 1, 16}) {
+          b->Args({range, pattern, protection, escapes});
+        }
+      }
+    }
+  }
+}
+
+BENCHMARK(BM_ReallocGrowth)->Apply(GrowthPatterns);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,91 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/region.h"
+
+#include <cstdint>
+#include <cstdlib>
+
+namespace tcmalloc {
+
+namespace {
+
+char* AlignUp(char* p, size_t alignment) {
+  const uintptr_t a = reinterpret_cast<uintptr_t>(p);
+  return p + ((-a) & (alignment - 1));
+}
+
+}  // namespace
+
+Region::Region(size_t block_size)
+    : block_size_(block_size < kMinBlockSize ? kMinBlockSize : block_size) {}
+
+char* Region::NewBlock(size_t bytes, bool dedicated) {
+  const size_t total = sizeof(Block) + bytes;
+  if (total < bytes) return nullptr;
+  Block* block = static_cast<Block*>(malloc(total));
+  if (block == nullptr) return nullptr;
+  reserved_bytes_ += total;
+  char* start = reinterpret_cast<char*>(block + 1);
+  if (dedicated && blocks_ != nullptr) {
+    // Keep bumping from the current block, which stays at the head.
+    block->next = blocks_->next;
+    blocks_->next = block;
+    return start;
+  }
+  block->next = blocks_;
+  blocks_ = block;
+  cursor_ = start;
+  limit_ = start + bytes;
+  return start;
+}
+
+void* Region::Allocate(size_t size, size_t alignment) {
+  if (alignment < alignof(std::max_align_t)) {
+    alignment = alignof(std::max_align_t);
+  }
+  char* p = cursor_ == nullptr ? nullptr : AlignUp(cursor_, alignment);
+  if (p == nullptr || p > limit_ || static_cast<size_t>(limit_ - p) < size) {
+    const size_t bytes = size + alignment;
+    if (bytes < size) return nullptr;
+    if (bytes > block_size_ / 4) {
+      p = NewBlock(bytes, /*dedicated=*/true);
+      if (p == nullptr) return nullptr;
+      allocated_bytes_ += size;
+      return AlignUp(p, alignment);
+    }
+    p = NewBlock(block_size_ - sizeof(Block), /*dedicated=*/false);
+    if (p == nullptr) return nullptr;
+    p = AlignUp(p, alignment);
+  }
+  cursor_ = p + size;
+  allocated_bytes_ += size;
+  return p;
+}
+
+void Region::Release() {
+  Block* block = blocks_;
+  while (block != nullptr) {
+    Block* next = block->next;
+    free(block);
+    block = next;
+  }
+  blocks_ = nullptr;
+  cursor_ = nullptr;
+  limit_ = nullptr;
+  allocated_bytes_ = 0;
+  reserved_bytes_ = 0;
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,91 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A region hands out memory for objects that all die together, such as the
+// objects of one request, and frees them all at once.
+
+#ifndef TCMALLOC_REGION_H_
+#define TCMALLOC_REGION_H_
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace tcmalloc {
+
+// Bump-allocates from blocks obtained from malloc() and frees every block in
+// Release() or on destruction; objects are never freed one at a time, and
+// their destructors never run.
+//
+// Blocks are larger than any size class, so each is a span of its own, and
+// freeing one under ENABLE_PROTECTION sweeps the escapes into the whole block
+// in one pass rather than one per object.  Bounds checks see a block as a
+// single object: they keep a pointer inside its block, not inside the object
+// it was derived from.
+//
+// A Region is owned by one thread at a time and is not thread-safe.
+class Region {
+ public:
+  static constexpr size_t kDefaultBlockSize = size_t{1} << 20;
+  static constexpr size_t kMinBlockSize = size_t{512} << 10;
+
+  // Blocks are block_size bytes, or kMinBlockSize if it is smaller.
+  explicit Region(size_t block_size = kDefaultBlockSize);
+  ~Region() { Release(); }
+
+  Region(const Region&) = delete;
+  Region& operator=(const Region&) = delete;
+
+  // Returns size bytes aligned to alignment, which must be a power of two,
+  // or nullptr if malloc() fails.  Requests over a quarter of the block size
+  // get a block of their own.
+  void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+  // Constructs a T in the region.  Its destructor is never run.
+  template <typename T, typename... Args>
+  T* New(Args&&... args) {
+    void* p = Allocate(sizeof(T), alignof(T));
+    if (p == nullptr) return nullptr;
+    return new (p) T(std::forward<Args>(args)...);
+  }
+
+  // Frees every block.  All pointers into the region are then dangling; the
+  // region can be used again.
+  void Release();
+
+  // Bytes handed out by Allocate() since the last Release().
+  size_t allocated_bytes() const { return allocated_bytes_; }
+  // Bytes of the blocks the region holds, including their headers.
+  size_t reserved_bytes() const { return reserved_bytes_; }
+
+ private:
+  struct Block {
+    Block* next;
+  };
+
+  // Allocates a block of at least bytes past its header and links it in.
+  // The bump pointer moves to it unless dedicated.
+  char* NewBlock(size_t bytes, bool dedicated);
+
+  const size_t block_size_;
+  Block* blocks_ = nullptr;
+  char* cursor_ = nullptr;
+  char* limit_ = nullptr;
+  size_t allocated_bytes_ = 0;
+  size_t reserved_bytes_ = 0;
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_REGION_H_
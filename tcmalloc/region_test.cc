@@ -0,0 +1,92 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/region.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace {
+
+TEST(RegionTest, Allocate) {
+  Region region;
+  std::vector<char*> objects;
+  for (int i = 0; i < 10000; ++i) {
+    const size_t size = 1 + i % 200;
+    char* p = static_cast<char*>(region.Allocate(size));
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(p) % alignof(std::max_align_t), 0);
+    memset(p, i & 0xff, size);
+    objects.push_back(p);
+  }
+  for (int i = 0; i < 10000; ++i) {
+    const size_t size = 1 + i % 200;
+    for (size_t j = 0; j < size; ++j) {
+      ASSERT_EQ(static_cast<unsigned char>(objects[i][j]), i & 0xff);
+    }
+  }
+  EXPECT_GE(region.reserved_bytes(), region.allocated_bytes());
+  region.Release();
+  EXPECT_EQ(region.allocated_bytes(), 0);
+  EXPECT_EQ(region.reserved_bytes(), 0);
+}
+
+TEST(RegionTest, Alignment) {
+  Region region;
+  for (size_t alignment = 1; alignment <= 4096; alignment *= 2) {
+    void* p = region.Allocate(3, alignment);
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(p) % alignment, 0);
+  }
+}
+
+TEST(RegionTest, Dedicated) {
+  Region region(Region::kMinBlockSize);
+  char* small = static_cast<char*>(region.Allocate(16));
+  const size_t reserved = region.reserved_bytes();
+  char* large = static_cast<char*>(region.Allocate(Region::kMinBlockSize));
+  ASSERT_NE(large, nullptr);
+  memset(large, 1, Region::kMinBlockSize);
+  EXPECT_GT(region.reserved_bytes(), reserved + Region::kMinBlockSize);
+  // The large request did not retire the block being bumped from.
+  char* next = static_cast<char*>(region.Allocate(16));
+  EXPECT_EQ(next, small + 16);
+}
+
+TEST(RegionTest, New) {
+  struct Node {
+    explicit Node(int v) : value(v) {}
+    int value;
+    Node* next = nullptr;
+  };
+  Region region;
+  Node* head = nullptr;
+  for (int i = 0; i < 1000; ++i) {
+    Node* n = region.New<Node>(i);
+    n->next = head;
+    head = n;
+  }
+  int expected = 999;
+  for (Node* n = head; n != nullptr; n = n->next) {
+    EXPECT_EQ(n->value, expected--);
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc
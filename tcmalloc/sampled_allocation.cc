@@ -24,6 +24,10 @@ namespace tcmalloc_internal {
 
 void SampledAllocation::PrepareForSampling(StackTrace stack_trace) {
   sampled_stack = std::move(stack_trace);
+#ifdef LIFETIME_PROTECTION
+  lifetime = nullptr;
+  short_lived = false;
+#endif
 }
 
 }  // namespace tcmalloc_internal
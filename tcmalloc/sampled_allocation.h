@@ -17,6 +17,7 @@
 
 #include <utility>
 
+#include "tcmalloc/internal/lifetime_predictions.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/sampled_allocation_recorder.h"
 
@@ -52,6 +53,14 @@ struct SampledAllocation : public tcmalloc_internal::Sample<SampledAllocation> {
 
   // The stack trace of the sampled allocation.
   StackTrace sampled_stack = {};
+
+#ifdef LIFETIME_PROTECTION
+  // Lifetime statistics of the allocation site, referenced until the object
+  // is freed, and whether they predicted it short-lived when it was
+  // allocated.
+  LifetimeStats* lifetime = nullptr;
+  bool short_lived = false;
+#endif
 };
 
 }  // namespace tcmalloc_internal
@@ -20,7 +20,9 @@
 #include <limits>
 
 #include "tcmalloc/common.h"
+#include "tcmalloc/deterministic.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/sampling_autotune.h"
 #include "tcmalloc/static_vars.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
@@ -28,7 +30,11 @@ namespace tcmalloc {
 namespace tcmalloc_internal {
 
 ssize_t Sampler::GetSamplePeriod() {
+#ifdef SAMPLING_AUTOTUNE
+  return SamplingAutotuner::EffectiveRate();
+#else
   return Parameters::profile_sampling_rate();
+#endif
 }
 
 // Run this before using your sampler
@@ -58,6 +64,15 @@ ABSL_ATTRIBUTE_NOINLINE void Sampler::Init(uint64_t seed) {
   allocs_until_guarded_sample_ = PickNextGuardedSamplingPoint();
 }
 
+#ifdef DETERMINISTIC_MODE
+void Sampler::Reseed(uint64_t seed) {
+  bytes_until_sample_ = 0;
+  true_bytes_until_sample_ = 0;
+  initialized_ = true;
+  Init(seed);
+}
+#endif
+
 ssize_t Sampler::PickNextSamplingPoint() {
   sample_period_ = GetSamplePeriod();
   if (sample_period_ <= 0) {
@@ -133,9 +148,17 @@ size_t Sampler::RecordAllocationSlow(size_t k) {
 
   if (ABSL_PREDICT_FALSE(!initialized_)) {
     initialized_ = true;
-    uint64_t global_seed =
-        global_randomness.fetch_add(1, std::memory_order_relaxed);
-    Init(reinterpret_cast<uintptr_t>(this) ^ global_seed);
+#ifdef DETERMINISTIC_MODE
+    // Addresses differ from run to run; the order threads start in does not.
+    if (Parameters::deterministic_mode()) {
+      Init(DeterministicMode::NextSamplerSeed());
+    } else
+#endif
+    {
+      uint64_t global_seed =
+          global_randomness.fetch_add(1, std::memory_order_relaxed);
+      Init(reinterpret_cast<uintptr_t>(this) ^ global_seed);
+    }
     if (static_cast<size_t>(true_bytes_until_sample_) > k) {
       true_bytes_until_sample_ -= k;
       if (tc_globals.IsOnFastPath()) {
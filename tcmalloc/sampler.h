@@ -105,6 +105,12 @@ class Sampler {
   // point and returns true.  Otherwise returns false.
   bool ShouldSampleGuardedAllocation();
 
+#ifdef DETERMINISTIC_MODE
+  // Starts over from seed, which must be nonzero, dropping the bytes counted
+  // towards the current sampling point.
+  void Reseed(uint64_t seed);
+#endif
+
   // Returns the Sampler's cached tc_globals.IsOnFastPath state.  This may
   // differ from a fresh computation due to activating per-CPU mode or the
   // addition/removal of hooks.
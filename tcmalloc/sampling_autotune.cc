@@ -0,0 +1,113 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/sampling_autotune.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "absl/base/internal/cycleclock.h"
+#include "tcmalloc/parameters.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+ABSL_CONST_INIT std::atomic<int64_t> SamplingAutotuner::cycles_(0);
+ABSL_CONST_INIT std::atomic<int64_t> SamplingAutotuner::effective_rate_(0);
+ABSL_CONST_INIT std::atomic<int64_t> SamplingAutotuner::cost_ppm_(0);
+int64_t SamplingAutotuner::last_cycles_ = 0;
+int64_t SamplingAutotuner::last_cpu_ns_ = -1;
+double SamplingAutotuner::scale_ = 1;
+
+namespace {
+
+int64_t ProcessCpuNanos() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) return -1;
+  return int64_t{ts.tv_sec} * 1000000000 + ts.tv_nsec;
+}
+
+}  // namespace
+
+double NextSamplingScale(double scale, double fraction, double budget) {
+  if (budget <= 0) return 1;
+  const double step = std::clamp(std::sqrt(fraction / budget), 0.25, 4.0);
+  return std::clamp(scale * step, 1.0, kMaxSamplingScale);
+}
+
+int64_t SamplingAutotuner::EffectiveRate() {
+  const int64_t configured = Parameters::profile_sampling_rate();
+  if (configured <= 0) return configured;
+  return std::max(configured, effective_rate_.load(std::memory_order_relaxed));
+}
+
+void SamplingAutotuner::Tick() {
+  const int64_t cycles = cycles_.load(std::memory_order_relaxed);
+  const int64_t cpu_ns = ProcessCpuNanos();
+  if (cpu_ns < 0) return;
+  if (last_cpu_ns_ < 0) {
+    // The first tick only starts the measurement.
+    last_cycles_ = cycles;
+    last_cpu_ns_ = cpu_ns;
+    return;
+  }
+  const double spent = (cycles - last_cycles_) /
+                       absl::base_internal::CycleClock::Frequency();
+  const double cpu = (cpu_ns - last_cpu_ns_) * 1e-9;
+  last_cycles_ = cycles;
+  last_cpu_ns_ = cpu_ns;
+
+  const int64_t configured = Parameters::profile_sampling_rate();
+  if (configured <= 0) {
+    scale_ = 1;
+    effective_rate_.store(configured, std::memory_order_relaxed);
+    return;
+  }
+  if (cpu > 0) {
+    const double fraction = spent / cpu;
+    cost_ppm_.store(fraction * 1e6, std::memory_order_relaxed);
+    scale_ = NextSamplingScale(scale_, fraction,
+                               Parameters::sampling_cpu_budget());
+  }
+  const double rate = std::min(
+      configured * scale_,
+      static_cast<double>(std::numeric_limits<int64_t>::max() / 2));
+  effective_rate_.store(rate, std::memory_order_relaxed);
+}
+
+void SamplingAutotuner::Print(Printer* out) {
+  out->printf("------------------------------------------------\n");
+  out->printf(
+      "SAMPLING AUTOTUNE: effective rate %d bytes (configured %d), "
+      "sampling cost %.3f%% of CPU, budget %.3f%%\n",
+      EffectiveRate(), Parameters::profile_sampling_rate(),
+      cost_ppm_.load(std::memory_order_relaxed) / 1e4,
+      Parameters::sampling_cpu_budget() * 100);
+}
+
+void SamplingAutotuner::PrintInPbtxt(PbtxtRegion* region) {
+  region->PrintI64("effective_rate", EffectiveRate());
+  region->PrintI64("configured_rate", Parameters::profile_sampling_rate());
+  region->PrintDouble("cost_fraction",
+                      cost_ppm_.load(std::memory_order_relaxed) / 1e6);
+  region->PrintDouble("cpu_budget", Parameters::sampling_cpu_budget());
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,98 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Sampling rate bounded by the CPU the sampled allocations cost
+// (SAMPLING_AUTOTUNE).
+//
+// A sampled allocation takes a span of its own and may try a guarded
+// allocation, which costs far more than an ordinary allocation, so a
+// workload allocating hard at the configured profile_sampling_rate can
+// spend a noticeable share of its CPU in SampleifyAllocation().  The cycles
+// spent there are counted, and every tick the background thread compares
+// them with the CPU time of the process.  While they are above
+// sampling_cpu_budget of it, the sampling rate in effect is raised above
+// the configured one, and it falls back towards it once they are below.
+// Each sample counts the period it was taken at in its weight, so profiles
+// stay unbiased across changes of the rate.
+
+#ifndef TCMALLOC_SAMPLING_AUTOTUNE_H_
+#define TCMALLOC_SAMPLING_AUTOTUNE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/cycleclock.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Factor the effective rate may exceed the configured one by.
+inline constexpr double kMaxSamplingScale = 1024;
+
+// The scale of the configured rate for the next tick, given the one of the
+// last tick, the fraction of CPU its samples took and the budget.  The cost
+// is inverse to the rate, so scale * fraction / budget meets the budget; the
+// step goes a geometric half of the way, and at most 4x, to damp noise.
+double NextSamplingScale(double scale, double fraction, double budget);
+
+class SamplingAutotuner {
+ public:
+  // Charges its lifetime to the cost of sampling.
+  class ScopedCost {
+   public:
+    ScopedCost() : start_(absl::base_internal::CycleClock::Now()) {}
+    ~ScopedCost() {
+      cycles_.fetch_add(absl::base_internal::CycleClock::Now() - start_,
+                        std::memory_order_relaxed);
+    }
+
+   private:
+    const int64_t start_;
+  };
+
+  // The sampling rate in effect: the configured profile_sampling_rate,
+  // scaled up by the last tick.  Not above the configured one when it is 0
+  // or less, which turns sampling off.
+  static int64_t EffectiveRate();
+
+  // Measures the cost of sampling since the last tick and adjusts the rate.
+  // Only the background thread calls it.
+  static void Tick();
+
+  static void Print(Printer* out);
+  static void PrintInPbtxt(PbtxtRegion* region);
+
+ private:
+  // Cycles spent sampling, ever.
+  ABSL_CONST_INIT static std::atomic<int64_t> cycles_;
+  // Set by Tick(), read by EffectiveRate() and the stats.
+  ABSL_CONST_INIT static std::atomic<int64_t> effective_rate_;
+  ABSL_CONST_INIT static std::atomic<int64_t> cost_ppm_;  // of process CPU
+
+  // Owned by the background thread.
+  static int64_t last_cycles_;
+  static int64_t last_cpu_ns_;
+  static double scale_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_SAMPLING_AUTOTUNE_H_
@@ -0,0 +1,57 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/sampling_autotune.h"
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+TEST(SamplingAutotune, HoldsWithinBudget) {
+  EXPECT_DOUBLE_EQ(NextSamplingScale(1, 0.01, 0.01), 1);
+  EXPECT_DOUBLE_EQ(NextSamplingScale(8, 0.01, 0.01), 8);
+}
+
+TEST(SamplingAutotune, StepsGeometrically) {
+  // Four times over budget: half of the way to 4x is 2x.
+  EXPECT_DOUBLE_EQ(NextSamplingScale(1, 0.04, 0.01), 2);
+  EXPECT_DOUBLE_EQ(NextSamplingScale(8, 0.0025, 0.01), 4);
+  // Steps are at most 4x either way.
+  EXPECT_DOUBLE_EQ(NextSamplingScale(1, 1, 0.01), 4);
+  EXPECT_DOUBLE_EQ(NextSamplingScale(64, 0, 0.01), 16);
+}
+
+TEST(SamplingAutotune, StaysInRange) {
+  EXPECT_DOUBLE_EQ(NextSamplingScale(2, 0, 0.01), 1);
+  EXPECT_DOUBLE_EQ(NextSamplingScale(kMaxSamplingScale, 1, 0.01),
+                   kMaxSamplingScale);
+  // No budget keeps the configured rate.
+  EXPECT_DOUBLE_EQ(NextSamplingScale(16, 1, 0), 1);
+}
+
+TEST(SamplingAutotune, ConvergesOnBudget) {
+  // Cost is inverse to the scale; it takes a few ticks to meet the budget.
+  constexpr double kCostAtConfiguredRate = 0.2;
+  double scale = 1;
+  for (int i = 0; i < 20; ++i) {
+    scale = NextSamplingScale(scale, kCostAtConfiguredRate / scale, 0.01);
+  }
+  EXPECT_NEAR(scale, 20, 0.01);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,103 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Zeroing of freed memory (SCRUB_ON_FREE).
+
+#ifndef TCMALLOC_SCRUB_H_
+#define TCMALLOC_SCRUB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Objects of at least this many bytes are zeroed with non-temporal stores.
+// Below it the lines are likely cached, in the freeing thread's L1 more
+// often than not, and plain stores are cheaper than writing them around it.
+inline constexpr size_t kScrubStreamBytes = 4096;
+
+// Zeroes [p, p + n) with stores that bypass the caches, so scrubbing a large
+// span neither evicts the working set nor reads the lines it overwrites.
+// The stores are fenced before returning, so handing the memory to another
+// thread under a lock orders them as plain stores would be.
+inline void ScrubNonTemporal(void* p, size_t n) {
+  char* c = static_cast<char*>(p);
+#if defined(__SSE2__)
+  const size_t head = -reinterpret_cast<uintptr_t>(c) & 15;
+  if (head >= n) {
+    memset(c, 0, n);
+    return;
+  }
+  memset(c, 0, head);
+  c += head;
+  n -= head;
+  const __m128i zero = _mm_setzero_si128();
+  for (; n >= 64; c += 64, n -= 64) {
+    _mm_stream_si128(reinterpret_cast<__m128i*>(c), zero);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(c + 16), zero);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(c + 32), zero);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(c + 48), zero);
+  }
+  _mm_sfence();
+  memset(c, 0, n);
+#elif defined(__aarch64__)
+  const size_t head = -reinterpret_cast<uintptr_t>(c) & 15;
+  if (head >= n) {
+    memset(c, 0, n);
+    return;
+  }
+  memset(c, 0, head);
+  c += head;
+  n -= head;
+  for (; n >= 64; c += 64, n -= 64) {
+    __asm__ __volatile__(
+        "stnp xzr, xzr, [%0]\n"
+        "stnp xzr, xzr, [%0, #16]\n"
+        "stnp xzr, xzr, [%0, #32]\n"
+        "stnp xzr, xzr, [%0, #48]\n"
+        :
+        : "r"(c)
+        : "memory");
+  }
+  memset(c, 0, n);
+#else
+  memset(c, 0, n);
+#endif
+}
+
+// Zeroes the n bytes at p, an object being freed.
+inline void ABSL_ATTRIBUTE_ALWAYS_INLINE Scrub(void* p, size_t n) {
+  if (ABSL_PREDICT_TRUE(n < kScrubStreamBytes)) {
+    memset(p, 0, n);
+  } else {
+    ScrubNonTemporal(p, n);
+  }
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_SCRUB_H_
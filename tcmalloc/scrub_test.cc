@@ -0,0 +1,57 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/scrub.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// Every offset and length around the alignment and the unrolled loop zeroes
+// exactly the bytes asked for.
+TEST(Scrub, ZeroesExactly) {
+  constexpr size_t kGuard = 64;
+  for (size_t offset = 0; offset < 32; ++offset) {
+    for (size_t n : {size_t{0}, size_t{1}, size_t{15}, size_t{16}, size_t{63},
+                     size_t{64}, size_t{65}, size_t{200}, kScrubStreamBytes - 1,
+                     kScrubStreamBytes, kScrubStreamBytes + 17}) {
+      std::vector<char> buffer(offset + n + kGuard, 0x5a);
+      ScrubNonTemporal(buffer.data() + offset, n);
+      for (size_t i = 0; i < buffer.size(); ++i) {
+        const bool inside = i >= offset && i < offset + n;
+        ASSERT_EQ(buffer[i], inside ? 0 : 0x5a)
+            << "offset " << offset << " length " << n << " byte " << i;
+      }
+
+      memset(buffer.data(), 0x5a, buffer.size());
+      Scrub(buffer.data() + offset, n);
+      for (size_t i = 0; i < buffer.size(); ++i) {
+        const bool inside = i >= offset && i < offset + n;
+        ASSERT_EQ(buffer[i], inside ? 0 : 0x5a)
+            << "offset " << offset << " length " << n << " byte " << i;
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,101 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Event counters of ENABLE_STATISTIC builds, sharded by CPU.
+
+#ifndef TCMALLOC_SHARDED_STATS_COUNTER_H_
+#define TCMALLOC_SHARDED_STATS_COUNTER_H_
+
+#include <stddef.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/atomic_stats_counter.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/percpu.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// The counters are bumped on every malloc, free, escape and check, so each
+// CPU adds to a StatsCounter on its own cache line instead of all of them
+// fighting over one word.  A thread moved to another CPU between picking its
+// shard and adding to it may share the shard for a moment, which the atomic
+// add tolerates.  The shards are only summed when the statistics are read
+// (TCReportStatistic(), GetStats()).
+//
+// Without rseq there is no cheap CPU id, and sched_getcpu() on every count
+// would cost more than the count itself.  Each thread then adds to a shard it
+// is given round-robin on its first count, as a ThreadCache is its own.
+class ShardedStatsCounter {
+ public:
+  static constexpr size_t kShards = 64;
+
+  constexpr ShardedStatsCounter() : shards_{} {}
+  ShardedStatsCounter(const ShardedStatsCounter&) = delete;
+  ShardedStatsCounter& operator=(const ShardedStatsCounter&) = delete;
+
+  void Add(StatsCounter::Value increment) {
+    shards_[ShardIndex()].counter.Add(increment);
+  }
+
+  // Sum of all shards.  Counts added concurrently may or may not be included.
+  StatsCounter::Value value() const {
+    StatsCounter::Value total = 0;
+    for (const Shard& s : shards_) total += s.counter.value();
+    return total;
+  }
+
+ private:
+  struct alignas(ABSL_CACHELINE_SIZE) Shard {
+    StatsCounter counter;
+  };
+
+  static size_t ShardIndex() {
+    const int cpu = subtle::percpu::GetCurrentCpuUnsafe();
+    if (ABSL_PREDICT_TRUE(cpu >= subtle::percpu::kCpuIdInitialized)) {
+      return static_cast<size_t>(cpu) % kShards;
+    }
+    return ThreadShardIndex();
+  }
+
+  static ABSL_ATTRIBUTE_NOINLINE size_t AssignThreadShard() {
+    thread_shard_ =
+        next_thread_shard_.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return thread_shard_;
+  }
+
+  static size_t ThreadShardIndex() {
+    if (ABSL_PREDICT_TRUE(thread_shard_ != kNoShard)) return thread_shard_;
+    return AssignThreadShard();
+  }
+
+  static constexpr size_t kNoShard = ~size_t{0};
+
+  // Shard of the calling thread when it has no rseq CPU id.
+  ABSL_CONST_INIT static inline thread_local size_t thread_shard_
+      ABSL_ATTRIBUTE_INITIAL_EXEC = kNoShard;
+  ABSL_CONST_INIT static inline std::atomic<size_t> next_thread_shard_{0};
+
+  Shard shards_[kShards];
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_SHARDED_STATS_COUNTER_H_
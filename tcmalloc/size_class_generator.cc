@@ -0,0 +1,300 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/size_class_generator.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "absl/numeric/bits.h"
+#include "absl/strings/str_format.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/span.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// Alignment of the classes of at most SizeMap::kMultiPageSize bytes above
+// kAlignment, that of operator new.
+#if defined(__cpp_aligned_new) && __STDCPP_DEFAULT_NEW_ALIGNMENT__ <= 8
+constexpr size_t kNewAlignment = 8;
+constexpr absl::string_view kAlignmentCondition =
+    "defined(__cpp_aligned_new) && __STDCPP_DEFAULT_NEW_ALIGNMENT__ <= 8";
+#else
+constexpr size_t kNewAlignment = 16;
+constexpr absl::string_view kAlignmentCondition =
+    "!(defined(__cpp_aligned_new) && __STDCPP_DEFAULT_NEW_ALIGNMENT__ <= 8)";
+#endif
+
+// TCMalloc metadata per span, counted with the tail of the span.
+constexpr size_t kSpanMetadataBytes = 48;
+
+// Spans are grown until the overhead of their class drops below this.
+constexpr double kMaxSpanOverhead = 0.02;
+
+// Pages tried above the fewest that hold an object.
+constexpr size_t kExtraPages = 16;
+
+// The alignment SizeMap::IsValidSizeClass() requires of a class of size;
+// those above SizeMap::kMaxSmallSize, 1024 bytes, are looked up in units of
+// 128 bytes.
+size_t ClassAlignment(size_t size) {
+  if (size > 1024) return 128;
+  if (size > SizeMap::kMultiPageSize) return SizeMap::kMultiPageAlignment;
+  return size > kAlignment ? kNewAlignment : kAlignment;
+}
+
+// The smallest class size that holds need bytes.
+size_t RoundUpToClass(size_t need) {
+  const size_t alignment = ClassAlignment(need);
+  return (need + alignment - 1) & ~(alignment - 1);
+}
+
+// The pages and batch size of the class of size.
+SizeClassInfo FitClass(size_t size) {
+  SizeClassInfo info;
+  info.size = size;
+  info.num_to_move = std::clamp<size_t>((64 << 10) / size, 2, 32);
+  info.pages = 1;
+  if (size <= SizeMap::kMultiPageSize) return info;
+
+  const size_t min_pages = (size + kPageSize - 1) / kPageSize;
+  double best = std::numeric_limits<double>::infinity();
+  for (size_t pages = min_pages;
+       pages < min_pages + kExtraPages && pages < 256; ++pages) {
+    if (size >= kBitmapMinObjectSize && pages * kPageSize / size > 64) break;
+    const double overhead = SpanOverhead({size, pages, info.num_to_move});
+    if (overhead < best) {
+      best = overhead;
+      info.pages = pages;
+    }
+    if (overhead <= kMaxSpanOverhead) break;
+  }
+  return info;
+}
+
+}  // namespace
+
+std::vector<RequestWeight> ProfileRequestSizes(
+    const perftools::profiles::Profile& profile) {
+  int64_t request_id = -1;
+  int64_t bytes_id = -1;
+  int64_t objects_id = -1;
+  for (int i = 0; i < profile.string_table_size(); ++i) {
+    const std::string& s = profile.string_table(i);
+    if (s == "request") {
+      request_id = i;
+    } else if (s == "bytes") {
+      bytes_id = i;
+    } else if (s == "objects") {
+      objects_id = i;
+    }
+  }
+  int objects_index = 0;
+  for (int i = 0; i < profile.sample_type_size(); ++i) {
+    if (profile.sample_type(i).type() == objects_id) {
+      objects_index = i;
+      break;
+    }
+  }
+
+  std::map<size_t, double> sizes;
+  for (const perftools::profiles::Sample& sample : profile.sample()) {
+    if (sample.value_size() <= objects_index) continue;
+    int64_t request = 0;
+    int64_t bytes = 0;
+    for (const perftools::profiles::Label& label : sample.label()) {
+      if (label.key() == request_id) {
+        request = label.num();
+      } else if (label.key() == bytes_id) {
+        bytes = label.num();
+      }
+    }
+    const int64_t size = request > 0 ? request : bytes;
+    if (size <= 0 || static_cast<size_t>(size) > kMaxSize) continue;
+    sizes[size] += sample.value(objects_index);
+  }
+
+  std::vector<RequestWeight> requests;
+  requests.reserve(sizes.size());
+  for (const auto& [size, objects] : sizes) {
+    requests.push_back({size, objects});
+  }
+  return requests;
+}
+
+double SpanOverhead(const SizeClassInfo& info) {
+  const size_t span = info.pages * kPageSize;
+  const size_t used = span / info.size * info.size;
+  return static_cast<double>(span - used + kSpanMetadataBytes) / used;
+}
+
+std::vector<SizeClassInfo> GenerateSizeClasses(
+    absl::Span<const RequestWeight> requests, const SizeClassOptions& options) {
+  // Candidate classes: those the requests round up to and the powers of
+  // two, which must be chosen.
+  std::vector<size_t> candidates;
+  for (size_t size = kAlignment; size <= kMaxSize; size *= 2) {
+    candidates.push_back(size);
+  }
+  for (const RequestWeight& r : requests) {
+    if (r.size + options.padding > kMaxSize) continue;
+    candidates.push_back(RoundUpToClass(r.size + options.padding));
+  }
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                   candidates.end());
+  const size_t n = candidates.size();
+
+  // objects[j] and bytes[j] sum the requests of classes up to candidates[j];
+  // cost[j] is what a class of candidates[j] takes per object in it.
+  std::vector<double> objects(n, 0), bytes(n, 0), cost(n);
+  for (const RequestWeight& r : requests) {
+    if (r.size + options.padding > kMaxSize) continue;
+    const size_t j =
+        std::lower_bound(candidates.begin(), candidates.end(),
+                         r.size + options.padding) -
+        candidates.begin();
+    objects[j] += r.objects;
+    bytes[j] += r.objects * r.size;
+  }
+  for (size_t j = 1; j < n; ++j) {
+    objects[j] += objects[j - 1];
+    bytes[j] += bytes[j - 1];
+  }
+  // last_mandatory[j] is the last power of two before candidates[j].
+  std::vector<int> last_mandatory(n);
+  int mandatory = -1;
+  for (size_t j = 0; j < n; ++j) {
+    cost[j] = candidates[j] * (1 + SpanOverhead(FitClass(candidates[j])));
+    last_mandatory[j] = mandatory;
+    if (absl::has_single_bit(candidates[j])) mandatory = j;
+  }
+  const size_t powers = absl::bit_width(kMaxSize / kAlignment);
+  CHECK_CONDITION(options.classes > powers);
+  const size_t max_classes = std::min(options.classes - 1, n);
+
+  // waste[k][j] is the least waste of k + 1 classes up to candidates[j],
+  // which is the last of them, and prev[k][j] the class before it.
+  constexpr double kInf = std::numeric_limits<double>::infinity();
+  std::vector<std::vector<double>> waste(max_classes,
+                                         std::vector<double>(n, kInf));
+  std::vector<std::vector<int>> prev(max_classes, std::vector<int>(n, -1));
+  waste[0][0] = objects[0] * cost[0] - bytes[0];
+  for (size_t k = 1; k < max_classes; ++k) {
+    for (size_t j = 1; j < n; ++j) {
+      // Skipping a power of two is not allowed.
+      for (int i = j - 1; i >= 0 && i >= last_mandatory[j]; --i) {
+        if (waste[k - 1][i] == kInf) continue;
+        const double w = waste[k - 1][i] +
+                         (objects[j] - objects[i]) * cost[j] -
+                         (bytes[j] - bytes[i]);
+        if (w < waste[k][j]) {
+          waste[k][j] = w;
+          prev[k][j] = i;
+        }
+      }
+    }
+  }
+
+  size_t best = 0;
+  for (size_t k = 1; k < max_classes; ++k) {
+    if (waste[k][n - 1] < waste[best][n - 1]) best = k;
+  }
+  CHECK_CONDITION(waste[best][n - 1] != kInf);
+
+  std::vector<SizeClassInfo> classes(best + 2);
+  classes[0] = {0, 0, 0};
+  for (int k = best, j = n - 1; k >= 0; j = prev[k][j], --k) {
+    classes[k + 1] = FitClass(candidates[j]);
+  }
+  return classes;
+}
+
+std::string FormatSizeClasses(absl::Span<const SizeClassInfo> classes,
+                              absl::string_view source) {
+  std::string out = absl::StrFormat(
+      R"(// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/common.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+
+namespace tcmalloc_internal {
+
+// SizeMap::Init() uses these classes when PROFILED_SIZE_CLASSES is set.
+// size_class_generator fitted them to
+//   %s.
+// Run it on a heap profile of the workload, built in the configuration the
+// allocator is built in, to replace them.  <fixed> is the tail of a span and
+// its metadata per byte of objects, as in size_classes.cc.
+
+#ifdef PROFILED_SIZE_CLASSES
+// clang-format off
+#if %s
+#if TCMALLOC_PAGE_SHIFT == %d
+static_assert(kMaxSize == %d, "kMaxSize mismatch");
+static const int kCount = %d;
+static_assert(kCount <= kNumBaseClasses);
+const int SizeMap::kProfiledSizeClassesCount = kCount;
+const SizeClassInfo SizeMap::kProfiledSizeClasses[SizeMap::kProfiledSizeClassesCount] = {
+    // <bytes>, <pages>, <batch size>    <fixed>
+    {        0,       0,           0},  // +Inf%%
+)",
+      source, kAlignmentCondition, kPageShift, kMaxSize, classes.size());
+  for (size_t c = 1; c < classes.size(); ++c) {
+    const SizeClassInfo& info = classes[c];
+    absl::StrAppendFormat(&out, "    {%9u, %7u, %11u},  // %.2f%%\n",
+                          info.size, info.pages, info.num_to_move,
+                          100 * SpanOverhead(info));
+  }
+  absl::StrAppend(&out, R"(};
+#else
+#error "Generated for another TCMALLOC_PAGE_SHIFT; rerun size_class_generator"
+#endif
+#else
+#error "Generated for another operator new alignment; rerun size_class_generator"
+#endif
+// clang-format on
+#endif  // PROFILED_SIZE_CLASSES
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+)");
+  return out;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
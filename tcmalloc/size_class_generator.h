@@ -0,0 +1,82 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Size classes fitted to the request sizes of a heap profile, for
+// PROFILED_SIZE_CLASSES.  See size_class_generator_main.cc for the tool that
+// writes them out as profiled_size_classes.cc.
+
+#ifndef TCMALLOC_SIZE_CLASS_GENERATOR_H_
+#define TCMALLOC_SIZE_CLASS_GENERATOR_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/profile.pb.h"
+#include "tcmalloc/size_class_info.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// How many objects of a requested size the profile holds.
+struct RequestWeight {
+  size_t size;
+  double objects;
+};
+
+// The requested sizes of the samples of profile, as profile_builder.cc
+// writes them: the "request" label of each sample, or its "bytes" label
+// without one, weighed by its "objects" value.  Sizes above kMaxSize are
+// left out, and equal sizes are merged in increasing order.
+std::vector<RequestWeight> ProfileRequestSizes(
+    const perftools::profiles::Profile& profile);
+
+struct SizeClassOptions {
+  // Classes to generate, counting the empty class 0.
+  size_t classes;
+  // Bytes added to every request before it is looked up, 1 under
+  // ENABLE_PROTECTION.
+  size_t padding;
+};
+
+// Chooses at most options.classes classes that minimize the bytes the
+// requests waste, rounded up to their classes and with the tail of the spans
+// of each class counted against it.  The powers of two up to kMaxSize are
+// always classes, so that a size the profile missed wastes less than half
+// of its class.  Each class gets the fewest pages that keep the tail of its
+// spans under 2% (1 up to SizeMap::kMultiPageSize) and the usual batch size.
+// The result starts with class 0 and passes SizeMap::ValidSizeClasses().
+std::vector<SizeClassInfo> GenerateSizeClasses(
+    absl::Span<const RequestWeight> requests, const SizeClassOptions& options);
+
+// Bytes lost at the end of a span of info, with the span's metadata, per
+// byte of its objects.
+double SpanOverhead(const SizeClassInfo& info);
+
+// Source of profiled_size_classes.cc defining SizeMap::kProfiledSizeClasses
+// as classes, for this build's page size and alignment.  source names the
+// profile in the header comment.
+std::string FormatSizeClasses(absl::Span<const SizeClassInfo> classes,
+                              absl::string_view source);
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_SIZE_CLASS_GENERATOR_H_
@@ -0,0 +1,148 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Writes the size classes that fit a heap profile of a workload best, as a
+// replacement for profiled_size_classes.cc:
+//
+//   size_class_generator --profile=heap.pb.gz \
+//       --output=tcmalloc/profiled_size_classes.cc
+//
+// The profile is one MallocExtension::SnapshotCurrent() marshaled by
+// profile_marshaler.cc, gzipped or not.  The classes are for the page size
+// and alignment the tool is built with; build it in the configuration the
+// allocator is built in.  It also prints how many bytes the requests of the
+// profile waste with its own size classes and with the generated ones.
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/str_cat.h"
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/profile.pb.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/size_class_generator.h"
+
+ABSL_FLAG(std::string, profile, "", "Heap profile to fit the classes to.");
+ABSL_FLAG(std::string, output, "",
+          "File to write the classes to, instead of stdout.");
+ABSL_FLAG(size_t, classes, tcmalloc::tcmalloc_internal::kNumBaseClasses,
+          "Size classes to generate, counting the empty class 0.");
+ABSL_FLAG(size_t, padding,
+#ifdef ENABLE_PROTECTION
+          1,
+#else
+          0,
+#endif
+          "Bytes added to every request before it is looked up.");
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+bool ReadProfile(const std::string& path,
+                 perftools::profiles::Profile* profile) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) return false;
+  std::stringstream contents;
+  contents << file.rdbuf();
+  const std::string data = contents.str();
+  google::protobuf::io::ArrayInputStream stream(data.data(), data.size());
+  if (data.size() >= 2 && static_cast<unsigned char>(data[0]) == 0x1f &&
+      static_cast<unsigned char>(data[1]) == 0x8b) {
+    google::protobuf::io::GzipInputStream gzip_stream(&stream);
+    return profile->ParseFromZeroCopyStream(&gzip_stream);
+  }
+  return profile->ParseFromZeroCopyStream(&stream);
+}
+
+// Bytes the objects of requests waste, rounded up to round(size).
+template <typename Round>
+double Waste(const std::vector<RequestWeight>& requests, Round round) {
+  double waste = 0;
+  for (const RequestWeight& r : requests) {
+    waste += r.objects * (round(r.size) - r.size);
+  }
+  return waste;
+}
+
+int Main() {
+  perftools::profiles::Profile profile;
+  if (!ReadProfile(absl::GetFlag(FLAGS_profile), &profile)) {
+    fprintf(stderr, "Could not read a profile from --profile=%s\n",
+            absl::GetFlag(FLAGS_profile).c_str());
+    return 1;
+  }
+  const std::vector<RequestWeight> requests = ProfileRequestSizes(profile);
+  const size_t padding = absl::GetFlag(FLAGS_padding);
+  const std::vector<SizeClassInfo> classes = GenerateSizeClasses(
+      requests, {.classes = absl::GetFlag(FLAGS_classes), .padding = padding});
+
+  double objects = 0;
+  double bytes = 0;
+  for (const RequestWeight& r : requests) {
+    objects += r.objects;
+    bytes += r.objects * r.size;
+  }
+  // nallocx() adds the padding of this build itself.
+  const double current =
+      Waste(requests, [](size_t size) { return nallocx(size, 0); });
+  const double generated = Waste(requests, [&](size_t size) {
+    for (const SizeClassInfo& info : classes) {
+      if (info.size >= size + padding) return info.size;
+    }
+    return size;
+  });
+  fprintf(stderr,
+          "%zu request sizes, %.0f objects of %.0f bytes; %zu classes\n"
+          "waste with the current classes: %.0f bytes (%.2f%%)\n"
+          "waste with the generated classes: %.0f bytes (%.2f%%)\n",
+          requests.size(), objects, bytes, classes.size() - 1, current,
+          bytes > 0 ? 100 * current / bytes : 0, generated,
+          bytes > 0 ? 100 * generated / bytes : 0);
+
+  const std::string source = FormatSizeClasses(
+      classes, absl::StrCat("a heap profile of ", requests.size(),
+                            " request sizes"));
+  const std::string& path = absl::GetFlag(FLAGS_output);
+  if (path.empty()) {
+    fwrite(source.data(), 1, source.size(), stdout);
+    return 0;
+  }
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out << source;
+  if (!out) {
+    fprintf(stderr, "Could not write %s\n", path.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  return tcmalloc::tcmalloc_internal::Main();
+}
@@ -0,0 +1,125 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/size_class_generator.h"
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/profile.pb.h"
+#include "tcmalloc/size_class_info.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class TestingSizeMap : public SizeMap {
+ public:
+  bool Valid(const std::vector<SizeClassInfo>& classes) {
+    return ValidSizeClasses(classes.size(), classes.data());
+  }
+};
+
+// The class of classes a request of size with padding gets.
+size_t ClassFor(const std::vector<SizeClassInfo>& classes, size_t size,
+                size_t padding) {
+  for (const SizeClassInfo& info : classes) {
+    if (info.size >= size + padding) return info.size;
+  }
+  return 0;
+}
+
+TEST(SizeClassGeneratorTest, ReadsRequestSizes) {
+  perftools::profiles::Profile profile;
+  profile.add_string_table("");
+  profile.add_string_table("space");    // 1
+  profile.add_string_table("objects");  // 2
+  profile.add_string_table("request");  // 3
+  profile.add_string_table("bytes");    // 4
+  profile.add_sample_type()->set_type(2);
+  profile.add_sample_type()->set_type(1);
+  auto add = [&](int64_t objects, int64_t request, int64_t bytes) {
+    perftools::profiles::Sample& sample = *profile.add_sample();
+    sample.add_value(objects);
+    sample.add_value(objects * bytes);
+    if (request > 0) {
+      perftools::profiles::Label& label = *sample.add_label();
+      label.set_key(3);
+      label.set_num(request);
+    }
+    perftools::profiles::Label& label = *sample.add_label();
+    label.set_key(4);
+    label.set_num(bytes);
+  };
+  add(10, 100, 112);
+  add(5, 100, 112);
+  add(7, 0, 64);
+  add(1, kMaxSize + 1, kMaxSize + 8192);
+
+  const std::vector<RequestWeight> requests = ProfileRequestSizes(profile);
+  ASSERT_EQ(requests.size(), 2);
+  EXPECT_EQ(requests[0].size, 64);
+  EXPECT_EQ(requests[0].objects, 7);
+  EXPECT_EQ(requests[1].size, 100);
+  EXPECT_EQ(requests[1].objects, 15);
+}
+
+TEST(SizeClassGeneratorTest, FitsTheProfile) {
+  constexpr size_t kPadding = 1;
+  const std::vector<RequestWeight> requests = {
+      {24, 1000}, {100, 5000}, {200, 3000}, {1500, 200}, {5000, 50},
+      {70000, 2}};
+  const std::vector<SizeClassInfo> classes = GenerateSizeClasses(
+      requests, {.classes = kNumBaseClasses, .padding = kPadding});
+
+  TestingSizeMap m;
+  EXPECT_TRUE(m.Valid(classes));
+  EXPECT_LE(classes.size(), kNumBaseClasses);
+  // With classes to spare, each request gets one that holds it and its
+  // padding with no more than the alignment to spare.
+  for (const RequestWeight& r : requests) {
+    const size_t size = ClassFor(classes, r.size, kPadding);
+    EXPECT_GE(size, r.size + kPadding);
+    EXPECT_LT(size, r.size + kPadding + 128) << r.size;
+  }
+  for (size_t size = kAlignment; size <= kMaxSize; size *= 2) {
+    EXPECT_EQ(ClassFor(classes, size, 0), size);
+  }
+}
+
+TEST(SizeClassGeneratorTest, KeepsToTheClassCount) {
+  std::vector<RequestWeight> requests;
+  for (size_t size = 8; size <= 64 << 10; size += 40) {
+    requests.push_back({size, 1.0 * (64 << 10) / size});
+  }
+  for (size_t count : {size_t{20}, size_t{40}, kNumBaseClasses}) {
+    const std::vector<SizeClassInfo> classes =
+        GenerateSizeClasses(requests, {.classes = count, .padding = 0});
+    TestingSizeMap m;
+    EXPECT_TRUE(m.Valid(classes)) << count;
+    EXPECT_LE(classes.size(), count);
+    for (const SizeClassInfo& info : classes) {
+      if (info.size > SizeMap::kMultiPageSize) {
+        EXPECT_LE(SpanOverhead(info), 0.1) << info.size;
+      }
+    }
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -16,6 +16,7 @@
 #include <stdlib.h>
 
 #include "gtest/gtest.h"
+#include "absl/numeric/bits.h"
 #include "absl/random/random.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/size_class_info.h"
@@ -135,6 +136,32 @@ TEST_F(SizeClassesTest, ValidateCorrectScalingByReciprocal) {
   }
 }
 
+TEST_F(SizeClassesTest, DivideBySizeClass) {
+  // Every offset within a span of small objects must map to the index of the
+  // object containing it, including the first and last byte of each object.
+  for (int c = 1; c < kNumClasses; ++c) {
+    const size_t size = m_.class_to_size(c);
+    if (size == 0) continue;
+    const size_t span_bytes = Length(m_.class_to_pages(c)).in_bytes();
+    for (size_t offset = 0; offset < span_bytes; offset += size) {
+      ASSERT_EQ(m_.DivideBySizeClass(offset, c), offset / size) << size;
+      ASSERT_EQ(m_.DivideBySizeClass(offset + size - 1, c), offset / size)
+          << size;
+    }
+  }
+}
+
+#ifdef POW2_SIZE_CLASSES
+TEST_F(SizeClassesTest, Pow2) {
+  // InlineChunkRange() rounds offsets down with a mask in this mode.
+  for (int c = 1; c < kNumClasses; c++) {
+    const size_t size = m_.class_to_size(c);
+    if (size == 0) continue;
+    EXPECT_TRUE(absl::has_single_bit(size)) << size;
+  }
+}
+#endif
+
 TEST_F(SizeClassesTest, Aligned) {
   // Validate that each size class is properly aligned.
   for (int c = 1; c < kNumClasses; c++) {
@@ -243,8 +270,21 @@ class TestingSizeMap : public SizeMap {
     return SizeMap::ValidSizeClasses(num_classes, parsed);
   }
 
+#ifdef PROTECTION_SIZE_CLASSES
+  // The classes Init() uses in this build.
+  const SizeClassInfo* DefaultSizeClasses() const {
+    return kProtectionSizeClasses;
+  }
+  const int DefaultSizeClassesCount() const {
+    return kProtectionSizeClassesCount;
+  }
+
+  const SizeClassInfo* BaselineSizeClasses() const { return kSizeClasses; }
+  const int BaselineSizeClassesCount() const { return kSizeClassesCount; }
+#else
   const SizeClassInfo* DefaultSizeClasses() const { return kSizeClasses; }
   const int DefaultSizeClassesCount() const { return kSizeClassesCount; }
+#endif
 };
 
 class RunTimeSizeClassesTest : public ::testing::Test {
@@ -256,14 +296,55 @@ class RunTimeSizeClassesTest : public ::testing::Test {
 
 TEST_F(RunTimeSizeClassesTest, ExpandedSizeClasses) {
   // Verify that none of the default size classes are considered expanded size
-  // classes.
+  // classes.  The pointer-free copies of them are not expanded either.
   for (int i = 0; i < kNumClasses; i++) {
-    EXPECT_EQ(i < (m_.DefaultSizeClassesCount() * kNumaPartitions),
+    EXPECT_EQ(i < (m_.DefaultSizeClassesCount() * kNumaPartitions) ||
+                  IsPointerFreeSizeClass(i),
               !IsExpandedSizeClass(i))
         << i;
   }
 }
 
+#ifdef PROTECTION_SIZE_CLASSES
+TEST_F(RunTimeSizeClassesTest, PaddedPowersOfTwo) {
+  m_.Init();
+  const SizeClassInfo* baseline = m_.BaselineSizeClasses();
+  const int baseline_count = m_.BaselineSizeClassesCount();
+
+  // No request takes a larger class than kSizeClasses would give it.
+  int c = 1;
+  for (size_t size = 1; size <= kMaxSize; size++) {
+    while (baseline[c].size < size) {
+      ASSERT_LT(++c, baseline_count);
+    }
+    EXPECT_LE(m_.class_to_size(m_.SizeClass(CppPolicy(), size)),
+              baseline[c].size)
+        << size;
+  }
+
+  // A power of two from 2KiB plus the padding byte of ENABLE_PROTECTION takes
+  // the class 128 bytes above it or, where there is none, the same class as
+  // with kSizeClasses.  Some of them take the smaller class in every page size.
+  int smaller = 0;
+  c = 1;
+  for (size_t size = 2048; size < kMaxSize; size *= 2) {
+    const size_t padded = size + 1;
+    while (baseline[c].size < padded) {
+      ASSERT_LT(++c, baseline_count);
+    }
+    const size_t class_size =
+        m_.class_to_size(m_.SizeClass(CppPolicy(), padded));
+    if (class_size < baseline[c].size) {
+      EXPECT_EQ(class_size, size + 128) << size;
+      smaller++;
+    } else {
+      EXPECT_EQ(class_size, baseline[c].size) << size;
+    }
+  }
+  EXPECT_GT(smaller, 0);
+}
+#endif
+
 TEST_F(RunTimeSizeClassesTest, ValidateClassSizeIncreases) {
   SizeClassInfo parsed[] = {
       {0, 0, 0},
@@ -473,6 +554,21 @@ TEST(SizeMapTest, SizeClass) {
   }
 }
 
+TEST(SizeMapTest, EverySize) {
+  SizeMap m;
+  m.Init();
+
+  // Every size, including both sides of the 1024 byte boundary between the
+  // two halves of the lookup table, maps to the smallest class holding it.
+  for (size_t size = 0; size <= kMaxSize; ++size) {
+    const uint32_t size_class = m.SizeClass(CppPolicy(), size);
+    ASSERT_GE(m.class_to_size(size_class), size);
+    if (size_class > 1) {
+      ASSERT_LT(m.class_to_size(size_class - 1), size);
+    }
+  }
+}
+
 TEST(SizeMapTest, Preinit) {
   ABSL_CONST_INIT static SizeMap m;
 
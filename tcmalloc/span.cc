@@ -33,31 +33,171 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
-void Span::DestroyEscape() {
-  if (escape_list == nullptr)
+namespace {
+
+// The chains of a detached escape table, spliced into one list.
+struct EscapeChains {
+  struct escape* head = nullptr;
+  struct escape* tail = nullptr;
+  size_t chunks = 0;
+};
+
+// Links the chains of all objects of `list` into one list.  A chunk starts
+// with its next pointer, which doubles as the freelist link of
+// EscapeChunkAllocator, so the list can be handed back as it is.
+EscapeChains SpliceEscapeChains(EscapeHead* list, size_t objects) {
+  EscapeChains chains;
+  ForEachEscapeHead(list, objects, [&](size_t, EscapeHead* head) {
+#ifdef ESCAPE_CHAIN_SWEEP
+    // The sweeper may still be compacting a chain of the table; wait for it
+    // and keep the chain locked, so it skips the rest.
+    struct escape* first = head->load(std::memory_order_acquire);
+    while (first != nullptr &&
+           ((reinterpret_cast<uintptr_t>(first) & kEscapeHeadLocked) ||
+            !head->compare_exchange_weak(
+                first,
+                reinterpret_cast<struct escape*>(
+                    reinterpret_cast<uintptr_t>(first) | kEscapeHeadLocked),
+                std::memory_order_acquire, std::memory_order_relaxed))) {
+      first = head->load(std::memory_order_acquire);
+    }
+#else
+    struct escape* first = reinterpret_cast<struct escape*>(
+        reinterpret_cast<uintptr_t>(head->load(std::memory_order_acquire)) &
+        ~kEscapeHeadLocked);
+#endif
+    if (first == nullptr) return;
+    struct escape* last = first;
+    chains.chunks++;
+    while (last->next) {
+      last = last->next;
+      chains.chunks++;
+    }
+    if (chains.tail == nullptr) chains.tail = last;
+    last->next = chains.head;
+    chains.head = first;
+  });
+  return chains;
+}
+
+// Returns the detached escape table `list` of a span holding `objects`
+// objects to the allocator, with the overflow table of a sparse one.
+void DeleteEscapeTable(EscapeHead* list, size_t objects)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+#ifdef SPARSE_ESCAPE_TABLES
+  EscapeTableAllocator& tables = Static::escape_table_allocator();
+  if (IsSparseEscapeTable(list)) {
+    SparseEscapeTable* table = AsSparseEscapeTable(list);
+    EscapeHead* overflow = table->overflow.load(std::memory_order_acquire);
+    if (overflow != nullptr) {
+      tables.Delete(overflow, objects);
+      tables.CountForm(EscapeTableForm::kOverflow, -1);
+    } else {
+      tables.CountForm(EscapeTableForm::kSparse, -1);
+    }
+    tables.Delete(reinterpret_cast<EscapeHead*>(table),
+                  kSparseEscapeTableWords);
     return;
-  
-  for (int i=0; i<objects_per_span; i++) {
-    if (escape_list[i]) {
-      // Log(kLog, __FILE__, __LINE__, "Escape leak detected");
-      struct escape* cur = escape_list[i];
-      while (cur) {
-        struct escape *next = cur->next;
-        Static::escape_allocator().Delete((EscapeChunk*)(cur));
-        cur = next;
-      }
+  }
+  tables.CountForm(EscapeTableForm::kPerObject, -1);
+#endif
+  Static::escape_table_allocator().Delete(list, objects);
+}
+
+void ReleaseChains(const EscapeChains& chains) {
+  if (chains.head != nullptr) {
+    Static::DeleteEscapeChunks(
+        reinterpret_cast<EscapeChunk*>(chains.head),
+        reinterpret_cast<EscapeChunk*>(chains.tail), chains.chunks);
+  }
+}
+
+#ifdef OUTGOING_ESCAPE_INDEX
+// Returns the detached outgoing escape index of span, or nullptr.
+EscapeHead* DetachEscapeSlots(Span* span) {
+  return reinterpret_cast<EscapeHead*>(
+      span->escape_slots.exchange(nullptr, std::memory_order_acq_rel));
+}
+
+void DeleteEscapeSlots(EscapeHead* slots, Length pages)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  if (slots != nullptr) {
+    Static::escape_table_allocator().Delete(slots, EscapeSlotWords(pages));
+  }
+}
+#endif
+
+#ifdef ESCAPE_REFCOUNTS
+// Releases the escape counts of span, if it has any.
+void DeleteEscapeRefs(Span* span)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  std::atomic<uint8_t>* refs =
+      span->escape_refs.exchange(nullptr, std::memory_order_acq_rel);
+  if (refs != nullptr) {
+    Static::escape_table_allocator().Delete(
+        reinterpret_cast<EscapeHead*>(refs),
+        EscapeRefWords(span->objects_per_span));
+  }
+}
+#endif
+
+}  // namespace
+
+void Span::DestroyEscape() {
+#ifdef ESCAPE_REFCOUNTS
+  // A span with counts has no escape table, so they are released before
+  // the return below.
+  if (escape_refs.load(std::memory_order_relaxed) != nullptr) {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    DeleteEscapeRefs(this);
+  }
+#endif
+  EscapeHead* list = escape_list.exchange(nullptr, std::memory_order_acq_rel);
+#ifdef OUTGOING_ESCAPE_INDEX
+  EscapeHead* slots = DetachEscapeSlots(this);
+  if (list == nullptr) {
+    if (slots != nullptr) {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      DeleteEscapeSlots(slots, num_pages());
     }
+    return;
   }
+#else
+  if (list == nullptr)
+    return;
+#endif
 
-  if (objects_per_span > 2) {
-    Static::escape_list_allocator().Delete((EscapeList*)(escape_list));
+  const size_t objects = EscapeObjects(this);
+  ReleaseChains(SpliceEscapeChains(list, objects));
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  DeleteEscapeTable(list, objects);
 #ifdef ESCAPE_DEBUG
-    Static::escape_list_allocator().Delete((EscapeList*)(escape_cnts));
+  Static::escape_table_allocator().Delete((EscapeHead*)(escape_cnts),
+                                          objects);
+#endif
+#ifdef OUTGOING_ESCAPE_INDEX
+  DeleteEscapeSlots(slots, num_pages());
+#endif
+}
+
+void Span::DestroyEscapeLocked() {
+#ifdef OUTGOING_ESCAPE_INDEX
+  DeleteEscapeSlots(DetachEscapeSlots(this), num_pages());
+#endif
+#ifdef ESCAPE_REFCOUNTS
+  DeleteEscapeRefs(this);
+#endif
+  EscapeHead* list = escape_list.exchange(nullptr, std::memory_order_acq_rel);
+  if (list == nullptr)
+    return;
+
+  const size_t objects = EscapeObjects(this);
+  ReleaseChains(SpliceEscapeChains(list, objects));
+  DeleteEscapeTable(list, objects);
+#ifdef ESCAPE_DEBUG
+  Static::escape_table_allocator().Delete((EscapeHead*)(escape_cnts),
+                                          objects);
 #endif
-  } else {
-    Static::escape_allocator().Delete((EscapeChunk*)(escape_list));
-  }
-  escape_list = nullptr;
 }
 
 void Span::Sample(SampledAllocation* sampled_allocation) {
@@ -209,22 +349,25 @@ Span::ObjIdx* Span::BitmapIdxToPtr(ObjIdx idx, size_t size) const {
 size_t Span::BitmapFreelistPopBatch(void** __restrict batch, size_t N,
                                     size_t size) {
 #ifndef NDEBUG
-  size_t before = bitmap_.CountBits(0, 64);
+  size_t before = absl::popcount(bitmap_);
 #endif  // NDEBUG
 
-  size_t count = 0;
   // Want to fill the batch either with N objects, or the number of objects
-  // remaining in the span.
-  while (!bitmap_.IsZero() && count < N) {
-    size_t offset = bitmap_.FindSet(0);
-    ASSERT(offset < 64);
-    batch[count] = BitmapIdxToPtr(offset, size);
-    bitmap_.ClearLowestBit();
+  // remaining in the span.  The word is worked on in a register, lowest
+  // object first, and stored back once.
+  uint64_t bits = bitmap_;
+  const uintptr_t start = first_page_.start_uintptr();
+  size_t count = 0;
+  while (bits != 0 && count < N) {
+    batch[count] = reinterpret_cast<void*>(
+        start + static_cast<uintptr_t>(absl::countr_zero(bits)) * size);
+    bits &= bits - 1;
     count++;
   }
+  bitmap_ = bits;
 
 #ifndef NDEBUG
-  size_t after = bitmap_.CountBits(0, 64);
+  size_t after = absl::popcount(bitmap_);
   ASSERT(after + count == before);
   ASSERT(allocated_.load(std::memory_order_relaxed) + count ==
          embed_count_ - after);
@@ -276,9 +419,9 @@ void Span::BitmapBuildFreelist(size_t size, size_t count) {
 #endif  // NDEBUG
   reciprocal_ = CalcReciprocal(size);
   allocated_.store(0, std::memory_order_relaxed);
-  bitmap_.Clear();  // bitmap_ can be non-zero from a previous use.
-  bitmap_.SetRange(0, count);
-  ASSERT(bitmap_.CountBits(0, 64) == count);
+  // bitmap_ can be non-zero from a previous use.
+  bitmap_ = count == 64 ? ~uint64_t{0} : (uint64_t{1} << count) - 1;
+  ASSERT(absl::popcount(bitmap_) == static_cast<int>(count));
 }
 
 int Span::BuildFreelist(size_t size, size_t count, void** batch, int N) {
@@ -332,6 +475,11 @@ int Span::BuildFreelist(size_t size, size_t count, void** batch, int N) {
   ObjIdx* host = nullptr;  // cached first object on freelist
   const size_t max_embed = size / sizeof(ObjIdx) - 1;
   int embed_count = 0;
+  // Hosts are consecutive objects of a span that has just been allocated, so
+  // every cache line they reach is a miss.  Prefetch the lines a few ahead of
+  // the host being written, once per line.
+  static constexpr size_t kHostPrefetchDistance = 4 * ABSL_CACHELINE_SIZE;
+  uintptr_t next_prefetch_line = 0;
   while (idx < idxEnd) {
     // Check the no idx can be confused with kListEnd.
     ASSERT(idx != kListEnd);
@@ -343,6 +491,12 @@ int Span::BuildFreelist(size_t size, size_t count, void** batch, int N) {
     } else {
       // The first object is full, push new object onto freelist.
       host = IdxToPtr(idx, size);
+      const uintptr_t addr = reinterpret_cast<uintptr_t>(host);
+      if (addr >= next_prefetch_line) {
+        __builtin_prefetch(reinterpret_cast<char*>(addr) + kHostPrefetchDistance,
+                           1, 3);
+        next_prefetch_line = (addr | (ABSL_CACHELINE_SIZE - 1)) + 1;
+      }
       host[0] = freelist_;
       freelist_ = idx;
       embed_count = 0;
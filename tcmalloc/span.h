@@ -21,6 +21,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <atomic>
+
 #include "absl/base/attributes.h"
 #include "absl/base/thread_annotations.h"
 #include "absl/numeric/bits.h"
@@ -46,7 +48,6 @@ inline constexpr size_t kBitmapMinObjectSize = kPageSize / 64;
 // by N we multiply by M = kBitmapScalingDenominator / N and round the resulting
 // value.
 inline constexpr size_t kBitmapScalingDenominator = 65536;
-inline constexpr size_t escapeListSize = 1024;
 // Information kept for a span (a contiguous run of pages).
 //
 // Spans can be in different states. The current state determines set of methods
@@ -71,34 +72,191 @@ inline constexpr size_t escapeListSize = 1024;
 class Span;
 typedef TList<Span> SpanList;
 
+#ifdef COMPRESSED_ESCAPE_CHUNKS
+// Number of escaped locations held by one chunk of an escape chain: one
+// 32-bit word each in a narrow chunk, two in a wide one.
+inline constexpr size_t kEscapeChunkLocs = 13;
+inline constexpr size_t kEscapeWideChunkLocs = kEscapeChunkLocs / 2;
+// Window of a wide chunk.  User space addresses are below 2^47, so no narrow
+// chunk has it.
+inline constexpr uint16_t kEscapeWideChunk = 0xffff;
+#else
+// Number of escaped locations held by one chunk of an escape chain.
+inline constexpr size_t kEscapeChunkLocs = 7;
+#endif
+
+// The escapes of one object are kept in a chain of chunks, newest chunk
+// first.  Each chunk is filled front to back, so walking the escapes of an
+// object touches one cache line per kEscapeChunkLocs locations instead of
+// one node per location.  Chunks are only accessed through the
+// EscapeChunk*() functions below.
+//
+// With COMPRESSED_ESCAPE_CHUNKS, the locations of a narrow chunk share bits
+// 32 to 47, stored once in `window`, and each keeps its low 32 bits in a
+// word.  A location outside the window goes to a wide chunk, which keeps
+// whole addresses in pairs of words; a narrow chunk that holds no more than
+// a wide one is widened in place rather than closed for it.
 struct escape {
   struct escape *next;
-  union {
-    int idx;
-    void* loc;
-  };
+#ifdef COMPRESSED_ESCAPE_CHUNKS
+  uint16_t window;
+  uint16_t size;
+  uint32_t words[kEscapeChunkLocs];
+#else
+  void* locs[kEscapeChunkLocs];
+#endif
 };
+static_assert(sizeof(struct escape) == 64,
+              "an escape chunk should fill exactly one cache line");
+static_assert(offsetof(struct escape, next) == 0,
+              "chains are returned to the allocator linked as they are");
+
+#ifdef COMPRESSED_ESCAPE_CHUNKS
+inline size_t EscapeChunkSize(const struct escape* c) { return c->size; }
+
+// Location i of chunk c, or nullptr past its last one.
+inline void* EscapeChunkLoc(const struct escape* c, size_t i) {
+  if (i >= c->size) return nullptr;
+  if (c->window == kEscapeWideChunk) {
+    return reinterpret_cast<void*>(uintptr_t{c->words[2 * i + 1]} << 32 |
+                                   c->words[2 * i]);
+  }
+  return reinterpret_cast<void*>(uintptr_t{c->window} << 32 | c->words[i]);
+}
+
+// Empties chunk c.
+inline void ClearEscapeChunk(struct escape* c) {
+  c->window = 0;
+  c->size = 0;
+}
 
-// the size of memory allocated from metadata
-// not a cache friendly implementation right now
-// it is a escape for each allocation
+// Drops the locations of chunk c past the first n.
+inline void TruncateEscapeChunk(struct escape* c, size_t n) { c->size = n; }
+
+// Overwrites location `to` of chunk c with its location `from`.
+inline void MoveEscapeChunkLoc(struct escape* c, size_t to, size_t from) {
+  if (c->window == kEscapeWideChunk) {
+    c->words[2 * to] = c->words[2 * from];
+    c->words[2 * to + 1] = c->words[2 * from + 1];
+  } else {
+    c->words[to] = c->words[from];
+  }
+}
+
+// Stores loc as location i < EscapeChunkSize(c) of chunk c, or appends it
+// if i == EscapeChunkSize(c).  Returns false if c has no room for loc.
+inline bool SetEscapeChunkLoc(struct escape* c, size_t i, const void* loc) {
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(loc);
+  const uintptr_t window = addr >> 32;
+  if (c->size == 0 && window < kEscapeWideChunk) c->window = window;
+  if (c->window != kEscapeWideChunk && c->window != window) {
+    if (c->size > kEscapeWideChunkLocs ||
+        (i == c->size && c->size == kEscapeWideChunkLocs)) {
+      return false;
+    }
+    // widen, from the last location down so none is overwritten unread
+    for (size_t j = c->size; j-- > 0;) {
+      const uint32_t low = c->words[j];
+      c->words[2 * j] = low;
+      c->words[2 * j + 1] = c->window;
+    }
+    c->window = kEscapeWideChunk;
+  }
+  if (c->window == kEscapeWideChunk) {
+    if (i == kEscapeWideChunkLocs) return false;
+    c->words[2 * i] = static_cast<uint32_t>(addr);
+    c->words[2 * i + 1] = static_cast<uint32_t>(window);
+  } else {
+    if (i == kEscapeChunkLocs) return false;
+    c->words[i] = static_cast<uint32_t>(addr);
+  }
+  if (i == c->size) c->size++;
+  return true;
+}
+#else
+inline size_t EscapeChunkSize(const struct escape* c) {
+  size_t n = 0;
+  while (n < kEscapeChunkLocs && c->locs[n]) n++;
+  return n;
+}
+
+inline void* EscapeChunkLoc(const struct escape* c, size_t i) {
+  return i < kEscapeChunkLocs ? c->locs[i] : nullptr;
+}
+
+inline void ClearEscapeChunk(struct escape* c) {
+  memset(c->locs, 0, sizeof(c->locs));
+}
+
+inline void TruncateEscapeChunk(struct escape* c, size_t n) {
+  for (size_t i = n; i < kEscapeChunkLocs; i++) c->locs[i] = nullptr;
+}
+
+inline void MoveEscapeChunkLoc(struct escape* c, size_t to, size_t from) {
+  c->locs[to] = c->locs[from];
+}
+
+inline bool SetEscapeChunkLoc(struct escape* c, size_t i, const void* loc) {
+  if (i == kEscapeChunkLocs) return false;
+  c->locs[i] = const_cast<void*>(loc);
+  return true;
+}
+#endif
+
+// Appends loc to chunk c.  Returns false if c has no room for it.
+inline bool AddEscapeChunkLoc(struct escape* c, const void* loc) {
+  return SetEscapeChunkLoc(c, EscapeChunkSize(c), loc);
+}
+
+// Head of the escape chain of one object.  Bit 0 is a lock held while a
+// commit appends to the head chunk or a free detaches the chain; the lock is
+// per object, so flushes from several threads committing into the same span
+// only contend when they escape the very same object.
+typedef std::atomic<struct escape*> EscapeHead;
+static_assert(sizeof(EscapeHead) == sizeof(struct escape*),
+              "EscapeHead must be a plain pointer");
+inline constexpr uintptr_t kEscapeHeadLocked = 1;
+
+// the size of memory allocated from metadata: one chunk of an escape chain,
+// or the whole escape table of a span with at most two objects
 class EscapeChunk {
   char data[sizeof(struct escape)];
 };
 
-class EscapeList {
-  struct escape *list[escapeListSize];
-};
+// The members of a Span but its optional ones fit in 64 bytes, and spans are
+// allocated aligned to that, so that the list links, escape_list, obj_size,
+// objects_per_span, the free list and first_page_, which free, escape and
+// check read, come with one miss.  Spans with optional members keep those
+// first too, but are not padded to 128 bytes for the alignment.
+#if defined(ESCAPE_DEBUG) || defined(OUTGOING_ESCAPE_INDEX) || \
+    defined(ESCAPE_REFCOUNTS) || defined(CENTRAL_FREELIST_SHARDS)
+inline constexpr size_t kSpanAlignment = alignof(void*);
+#else
+inline constexpr size_t kSpanAlignment = 64;
+#endif
 
-class Span : public SpanList::Elem {
+class alignas(kSpanAlignment) Span : public SpanList::Elem {
  public:
   // Allocator/deallocator for spans. Note that these functions are defined
   // in static_vars.h, which is weird: see there for why.
   static Span* New(PageId p, Length len)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
   static void Delete(Span* span);
+#ifdef SPAN_CACHE
+  // As New() and Delete(), through per-CPU caches, for callers that do not
+  // hold pageheap_lock otherwise.  A span may be deleted by either.
+  static Span* NewCached(PageId p, Length len)
+      ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  static void DeleteCached(Span* span) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+#endif
 
-  void DestroyEscape();
+  // Releases the escape table of the span and all of its chains, and its
+  // outgoing escape index and escape counts if it has them.  The chains
+  // are gathered without any lock and handed back in one step, so callers
+  // tearing down many spans should call it before taking pageheap_lock.
+  void DestroyEscape() ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  // As above, for callers already holding pageheap_lock.
+  void DestroyEscapeLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
   // locations used to track what list a span resides on.
   enum Location {
@@ -138,6 +296,24 @@ class Span : public SpanList::Elem {
   // that sampling state can't be changed concurrently.
   bool sampled() const;
 
+#ifdef LIFETIME_PROTECTION
+  // Is it a sampled span whose object was predicted short-lived?  Escapes
+  // into it are not tracked; its free puts it into a quarantine instead.
+  bool short_lived() const;
+#endif
+
+  // Does the span hold objects of a pointer-free size class?  Escapes of
+  // pointers into them are not tracked, see IsPointerFreeSizeClass().
+  bool pointer_free() const;
+  void set_pointer_free(bool pointer_free);
+
+#ifdef HEAP_PARTITIONS
+  // One more than the heap partition a page allocation is charged to; 0 for
+  // spans charged to none, such as those of sampled small objects.
+  uint16_t heap_partition() const;
+  void set_heap_partition(uint16_t partition);
+#endif
+
   // ---------------------------------------------------------------------------
   // Span memory range.
   // ---------------------------------------------------------------------------
@@ -170,6 +346,14 @@ class Span : public SpanList::Elem {
   uint64_t freelist_added_time() const;
   void set_freelist_added_time(uint64_t t);
 
+#if defined(LARGE_FREE_OFFLOAD) || defined(SCRUB_ON_FREE)
+  // Next span on the queue of page frees the background thread completes.
+  // REQUIRES: this is an IN_USE span of a large object, unpublished from the
+  // pagemap.
+  Span* offloaded_next() const;
+  void set_offloaded_next(Span* next);
+#endif
+
   // Sets this span freelist added time to average of this and other times
   // weighted by their sizes.
   // REQUIRES: this is a ON_NORMAL_FREELIST or ON_RETURNED_FREELIST span.
@@ -246,13 +430,23 @@ class Span : public SpanList::Elem {
   // Prefetch cacheline containing most important span information.
   void Prefetch();
 
-  struct escape **escape_list = nullptr;
-#ifdef ESCAPE_DEBUG
-  size_t *escape_cnts = nullptr;
-#endif
+  // Installed lazily by the first committed escape, see commit_escape().
+  std::atomic<EscapeHead*> escape_list{nullptr};
+  // Object size in 8 byte units, 0 for spans that are not in use.  A span
+  // holding a single object too large for that (32 GiB or more) has
+  // kWholeSpanObjSize instead; the object is then the whole span.
   uint32_t obj_size;
   uint32_t objects_per_span;
 
+  static constexpr uint32_t kWholeSpanObjSize = ~uint32_t{0};
+
+  // Size of the objects of the span in bytes, 0 if it has none.
+  size_t object_bytes() const;
+
+  // Sets obj_size for objects of `bytes` bytes, a multiple of 8.  Objects
+  // too large for obj_size must fill the span.
+  void set_object_bytes(size_t bytes);
+
   static constexpr size_t kCacheSize = 4;
  private:
   // See the comment on freelist organization in cc file.
@@ -276,6 +470,10 @@ class Span : public SpanList::Elem {
   union {
     uint16_t freelist_;
     uint16_t reciprocal_;
+#ifdef HEAP_PARTITIONS
+    // Used only for LARGE_OBJECT and SAMPLED spans.
+    uint16_t heap_partition_;
+#endif
   };
   uint8_t cache_size_;
   // TODO(b/130897106): Remove this once we enable span prioritization by
@@ -283,16 +481,18 @@ class Span : public SpanList::Elem {
   uint8_t nonempty_index_ : 4;  // The nonempty_ list index for this span.
   uint8_t location_ : 2;  // Is the span on a freelist, and if so, which?
   uint8_t sampled_ : 1;   // Sampled object?
+  uint8_t pointer_free_ : 1;  // Objects of a pointer-free size class?
 
   union {
     // Used only for spans in CentralFreeList (SMALL_OBJECT state).
     // Embed cache of free objects.
     ObjIdx cache_[kCacheSize];
 
-    // Used for spans with in CentralFreeList with fewer than 64 objects.
-    // Each bit is set to one when the object is available, and zero
-    // when the object is used.
-    Bitmap<64> bitmap_{};
+    // Used for spans with in CentralFreeList with 64 or fewer objects.
+    // Bit i is set to one when object i is available, and zero when it is
+    // used, so a batch pops with a count of trailing zeros and a clear of the
+    // lowest set bit per object.
+    uint64_t bitmap_{};
 
     // Used only for sampled spans (SAMPLED state).
     SampledAllocation* sampled_allocation_;
@@ -303,11 +503,42 @@ class Span : public SpanList::Elem {
     // is merged into this one, we set this to the average of now and the
     // current freelist_added_time, weighted by the two spans' sizes.
     uint64_t freelist_added_time_;
+
+#if defined(LARGE_FREE_OFFLOAD) || defined(SCRUB_ON_FREE)
+    // Used only for spans queued for an offloaded free (IN_USE state).
+    Span* offloaded_next_;
+#endif
   };
 
   PageId first_page_;  // Starting page number.
   Length num_pages_;   // Number of pages in span.
 
+ public:
+  // The optional members follow the line of the members above, which free,
+  // escape and check read, so that they do not push those into a second
+  // one.
+#ifdef ESCAPE_DEBUG
+  size_t *escape_cnts = nullptr;
+#endif
+#ifdef CENTRAL_FREELIST_SHARDS
+  // Shard of the central free list that allocated the span, which its
+  // objects go back to, see ShardedCentralFreeList.
+  uint8_t central_shard = 0;
+#endif
+#ifdef OUTGOING_ESCAPE_INDEX
+  // Outgoing escape index: one bit per word of the span, set while the word
+  // is the location of a committed escape.  Installed lazily by the first
+  // such escape, see mark_escape_slot(), and sized by EscapeSlotWords().
+  std::atomic<std::atomic<uint64_t>*> escape_slots{nullptr};
+#endif
+#ifdef ESCAPE_REFCOUNTS
+  // Escape counts: one saturating byte per object, bumped by every escape
+  // into it and halved by DecayEscapeRefs().  Installed lazily by the first
+  // escape, see count_escape_ref(), and sized by EscapeRefWords().
+  std::atomic<std::atomic<uint8_t>*> escape_refs{nullptr};
+#endif
+
+ private:
   // Convert object pointer <-> freelist index.
   ObjIdx PtrToIdx(void* ptr, size_t size) const;
   ObjIdx* IdxToPtr(ObjIdx idx, size_t size) const;
@@ -361,6 +592,7 @@ class Span : public SpanList::Elem {
 
   // Friend class to enable more indepth testing of bitmap code.
   friend class SpanTestPeer;
+  friend struct InlineCheckLayout;
 };
 
 template <Span::Align align>
@@ -529,16 +761,17 @@ Span::ObjIdx Span::BitmapPtrToIdx(void* ptr, size_t size) const {
 template <Span::Align align>
 bool Span::BitmapFreelistPush(void* ptr, size_t size) {
 #ifndef NDEBUG
-  size_t before = bitmap_.CountBits(0, 64);
+  size_t before = absl::popcount(bitmap_);
 #endif
   // TODO(djgove) Conversions to offsets can be computed outside of lock.
   ObjIdx idx = BitmapPtrToIdx<align>(ptr, size);
+  ASSERT(idx < 64);
   // Check that the object is not already returned.
-  ASSERT(bitmap_.GetBit(idx) == 0);
+  ASSERT(((bitmap_ >> idx) & 1) == 0);
   // Set the bit indicating where the object was returned.
-  bitmap_.SetBit(idx);
+  bitmap_ |= uint64_t{1} << idx;
 #ifndef NDEBUG
-  size_t after = bitmap_.CountBits(0, 64);
+  size_t after = absl::popcount(bitmap_);
   ASSERT(before + 1 == after);
   ASSERT(allocated_.load(std::memory_order_relaxed) == embed_count_ - after);
 #endif
@@ -560,6 +793,26 @@ inline SampledAllocation* Span::sampled_allocation() const {
 
 inline bool Span::sampled() const { return sampled_; }
 
+#ifdef LIFETIME_PROTECTION
+inline bool Span::short_lived() const {
+  return sampled_ && sampled_allocation_->short_lived;
+}
+#endif
+
+inline bool Span::pointer_free() const { return pointer_free_; }
+
+inline void Span::set_pointer_free(bool pointer_free) {
+  pointer_free_ = pointer_free;
+}
+
+#ifdef HEAP_PARTITIONS
+inline uint16_t Span::heap_partition() const { return heap_partition_; }
+
+inline void Span::set_heap_partition(uint16_t partition) {
+  heap_partition_ = partition;
+}
+#endif
+
 inline PageId Span::first_page() const { return first_page_; }
 
 inline PageId Span::last_page() const {
@@ -582,6 +835,23 @@ inline void Span::set_num_pages(Length len) { num_pages_ = len; }
 
 inline size_t Span::bytes_in_span() const { return num_pages_.in_bytes(); }
 
+inline size_t Span::object_bytes() const {
+  if (ABSL_PREDICT_FALSE(obj_size == kWholeSpanObjSize)) {
+    return bytes_in_span();
+  }
+  return size_t{obj_size} << 3;
+}
+
+inline void Span::set_object_bytes(size_t bytes) {
+  ASSERT(bytes % 8 == 0);
+  if (ABSL_PREDICT_FALSE((bytes >> 3) >= kWholeSpanObjSize)) {
+    ASSERT(bytes == bytes_in_span());
+    obj_size = kWholeSpanObjSize;
+    return;
+  }
+  obj_size = static_cast<uint32_t>(bytes >> 3);
+}
+
 inline void Span::set_freelist_added_time(uint64_t t) {
   freelist_added_time_ = t;
 }
@@ -590,36 +860,51 @@ inline uint64_t Span::freelist_added_time() const {
   return freelist_added_time_;
 }
 
+#if defined(LARGE_FREE_OFFLOAD) || defined(SCRUB_ON_FREE)
+inline Span* Span::offloaded_next() const { return offloaded_next_; }
+
+inline void Span::set_offloaded_next(Span* next) { offloaded_next_ = next; }
+#endif
+
 inline bool Span::FreelistEmpty(size_t size) const {
   if (size < kBitmapMinObjectSize) {
     return (cache_size_ == 0 && freelist_ == kListEnd);
   } else {
-    return (bitmap_.IsZero());
+    return bitmap_ == 0;
   }
 }
 
 inline void Span::Prefetch() {
-  // The first 16 bytes of a Span are the next and previous pointers
-  // for when it is stored in a linked list. Since the sizeof(Span) is
-  // 48 bytes, spans fit into 2 cache lines 50% of the time, with either
-  // the first 16-bytes or the last 16-bytes in a different cache line.
-  // Prefetch the cacheline that contains the most frequestly accessed
-  // data by offseting into the middle of the Span.
+  // The members free, escape and check read are the first kHotBytes of the
+  // Span.  Aligned to them, they are one cache line, and spans with
+  // optional members may also need the line of their last byte.  The
+  // prefetch is for write: freeing changes the free list and allocated_,
+  // and escapes install escape_list.
+  constexpr size_t kHotBytes = 64;
 #if defined(__GNUC__)
-#if __WORDSIZE == 32
-  // The Span fits in one cache line, so simply prefetch the base pointer.
-  static_assert(sizeof(Span) == 32, "Update span prefetch offset");
-  __builtin_prefetch(this, 0, 3);
-#else
-  // The Span can occupy two cache lines, so prefetch the cacheline with the
-  // most frequently accessed parts of the Span.
-#ifdef ESCAPE_DEBUG
-  static_assert(sizeof(Span) == 64+8, "Update span prefetch offset");
-#else
-  static_assert(sizeof(Span) == 64, "Update span prefetch offset");
-#endif
-  __builtin_prefetch(&this->escape_list, 1, 3);
-#endif
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+  static_assert(offsetof(Span, escape_list) + sizeof(escape_list) <=
+                    kHotBytes &&
+                offsetof(Span, obj_size) + sizeof(obj_size) <= kHotBytes &&
+                offsetof(Span, objects_per_span) + sizeof(objects_per_span) <=
+                    kHotBytes &&
+                offsetof(Span, freelist_) + sizeof(freelist_) <= kHotBytes &&
+                offsetof(Span, allocated_) + sizeof(allocated_) <=
+                    kHotBytes &&
+                offsetof(Span, first_page_) + sizeof(first_page_) <=
+                    kHotBytes &&
+                offsetof(Span, num_pages_) + sizeof(num_pages_) <= kHotBytes,
+                "fields read by free, escape and check must share the first "
+                "line of the Span");
+#pragma GCC diagnostic pop
+  static_assert(kSpanAlignment == alignof(void*) || sizeof(Span) == kHotBytes,
+                "aligned spans must fill exactly their line");
+  __builtin_prefetch(this, 1, 3);
+  if constexpr (kSpanAlignment < kHotBytes) {
+    __builtin_prefetch(reinterpret_cast<const char*>(this) + kHotBytes - 1, 1,
+                       3);
+  }
 #endif
 }
 
@@ -634,7 +919,11 @@ inline void Span::Init(PageId p, Length n) {
   num_pages_ = n;
   location_ = IN_USE;
   sampled_ = 0;
+  pointer_free_ = 0;
   nonempty_index_ = 0;
+#ifdef HEAP_PARTITIONS
+  heap_partition_ = 0;
+#endif
 }
 
 }  // namespace tcmalloc_internal
@@ -117,6 +117,40 @@ void BM_single_span_fulldrain(benchmark::State& state) {
   state.SetItemsProcessed(processed);
 }
 
+// BM_bitmap_span_batch pushes and pops batches of state.range(0) objects of
+// the smallest class whose spans keep their free objects in a bitmap, which
+// has the most objects per span of those.
+void BM_bitmap_span_batch(benchmark::State& state) {
+  const size_t batch_size = state.range(0);
+  int size_class = 1;
+  while (tc_globals.sizemap().class_to_size(size_class) <
+         kBitmapMinObjectSize) {
+    ++size_class;
+  }
+
+  size_t size = tc_globals.sizemap().class_to_size(size_class);
+  RawSpan raw_span;
+  raw_span.Init(size_class);
+  Span& span = raw_span.span();
+
+  void* batch[kMaxObjectsToMove];
+  CHECK_CONDITION(batch_size <= kMaxObjectsToMove);
+
+  int64_t processed = 0;
+  while (state.KeepRunningBatch(batch_size)) {
+    int n = span.FreelistPopBatch(batch, batch_size, size);
+    processed += n;
+
+    for (int j = 0; j < n; j++) {
+      span.FreelistPush(batch[j], size);
+    }
+  }
+
+  state.SetItemsProcessed(processed);
+}
+
+BENCHMARK(BM_bitmap_span_batch)->RangeMultiplier(2)->Range(1, 32);
+
 BENCHMARK(BM_single_span)
     ->Arg(1)
     ->Arg(2)
@@ -190,6 +190,79 @@ TEST_P(SpanTest, FreelistRandomized) {
 
 INSTANTIATE_TEST_SUITE_P(All, SpanTest, testing::Range(size_t(1), kNumClasses));
 
+TEST(SpanObjectBytesTest, LargeObjects) {
+  Span span;
+  // The span is never touched, so it may describe far more than is mapped.
+  const Length pages = BytesToLengthCeil(size_t{40} << 30);
+  span.Init(PageId{1}, pages);
+
+  span.set_object_bytes(kPageSize);
+  EXPECT_EQ(span.obj_size, kPageSize / 8);
+  EXPECT_EQ(span.object_bytes(), kPageSize);
+
+  // The largest size 8 byte units hold.
+  const size_t largest = size_t{Span::kWholeSpanObjSize - 1} * 8;
+  span.set_object_bytes(largest);
+  EXPECT_EQ(span.object_bytes(), largest);
+
+  // A single object of 32 GiB or more fills its span.
+  span.set_object_bytes(pages.in_bytes());
+  EXPECT_EQ(span.obj_size, Span::kWholeSpanObjSize);
+  EXPECT_EQ(span.object_bytes(), pages.in_bytes());
+  EXPECT_GT(span.object_bytes(), size_t{32} << 30);
+}
+
+TEST(EscapeChunkTest, FillsFrontToBack) {
+  struct escape chunk;
+  ClearEscapeChunk(&chunk);
+  std::vector<void*> slots(kEscapeChunkLocs + 1);
+  for (size_t i = 0; i < kEscapeChunkLocs; ++i) {
+    ASSERT_TRUE(AddEscapeChunkLoc(&chunk, &slots[i]));
+  }
+  EXPECT_FALSE(AddEscapeChunkLoc(&chunk, &slots[kEscapeChunkLocs]));
+  ASSERT_EQ(EscapeChunkSize(&chunk), kEscapeChunkLocs);
+  for (size_t i = 0; i < kEscapeChunkLocs; ++i) {
+    EXPECT_EQ(EscapeChunkLoc(&chunk, i), &slots[i]);
+  }
+  EXPECT_EQ(EscapeChunkLoc(&chunk, kEscapeChunkLocs), nullptr);
+
+  MoveEscapeChunkLoc(&chunk, 0, kEscapeChunkLocs - 1);
+  TruncateEscapeChunk(&chunk, kEscapeChunkLocs - 1);
+  EXPECT_EQ(EscapeChunkSize(&chunk), kEscapeChunkLocs - 1);
+  EXPECT_EQ(EscapeChunkLoc(&chunk, 0), &slots[kEscapeChunkLocs - 1]);
+  EXPECT_EQ(EscapeChunkLoc(&chunk, kEscapeChunkLocs - 1), nullptr);
+  EXPECT_TRUE(SetEscapeChunkLoc(&chunk, 1, &slots[kEscapeChunkLocs]));
+  EXPECT_EQ(EscapeChunkLoc(&chunk, 1), &slots[kEscapeChunkLocs]);
+}
+
+#ifdef COMPRESSED_ESCAPE_CHUNKS
+TEST(EscapeChunkTest, WidensForOtherWindows) {
+  const uintptr_t near = uintptr_t{0x12} << 32;
+  const uintptr_t far = uintptr_t{0x7ffd} << 32;
+  struct escape chunk;
+  ClearEscapeChunk(&chunk);
+  for (size_t i = 0; i < kEscapeWideChunkLocs; ++i) {
+    ASSERT_TRUE(AddEscapeChunkLoc(&chunk, (void*)(near + 8 * i)));
+  }
+  // room to widen for one location of another window
+  ASSERT_TRUE(SetEscapeChunkLoc(&chunk, 0, (void*)far));
+  EXPECT_EQ(chunk.window, kEscapeWideChunk);
+  EXPECT_EQ(EscapeChunkLoc(&chunk, 0), (void*)far);
+  for (size_t i = 1; i < kEscapeWideChunkLocs; ++i) {
+    EXPECT_EQ(EscapeChunkLoc(&chunk, i), (void*)(near + 8 * i));
+  }
+  EXPECT_FALSE(AddEscapeChunkLoc(&chunk, (void*)near));
+
+  // a fuller narrow chunk is not widened
+  ClearEscapeChunk(&chunk);
+  for (size_t i = 0; i <= kEscapeWideChunkLocs; ++i) {
+    ASSERT_TRUE(AddEscapeChunkLoc(&chunk, (void*)(near + 8 * i)));
+  }
+  EXPECT_FALSE(AddEscapeChunkLoc(&chunk, (void*)far));
+  EXPECT_TRUE(AddEscapeChunkLoc(&chunk, (void*)(near + 0x1000)));
+}
+#endif
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
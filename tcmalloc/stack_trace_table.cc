@@ -17,9 +17,12 @@
 #include <stddef.h>
 #include <string.h>
 
+#include <algorithm>
 #include <limits>
 
 #include "absl/base/internal/spinlock.h"
+#include "absl/numeric/bits.h"
+#include "absl/time/time.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/mincore.h"
@@ -32,21 +35,65 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+namespace {
+
+// Buckets the destructor returns per pageheap_lock hold.
+constexpr int kDeleteBatch = 64;
+
+void DeleteBuckets(StackTraceTable::Bucket* const* buckets, int n) {
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  for (int i = 0; i < n; ++i) {
+    tc_globals.bucket_allocator().Delete(buckets[i]);
+  }
+}
+
+}  // namespace
+
 StackTraceTable::StackTraceTable(ProfileType type)
-    : type_(type), depth_total_(0), all_(nullptr) {}
+    : type_(type), depth_total_(0) {}
 
 StackTraceTable::~StackTraceTable() {
-  Bucket* cur = all_;
-  while (cur != nullptr) {
-    Bucket* next = cur->next;
-    cur->~Bucket();
-    {
-      absl::base_internal::SpinLockHolder h(&pageheap_lock);
-      tc_globals.bucket_allocator().Delete(cur);
+  Bucket* batch[kDeleteBatch];
+  int n = 0;
+  auto add = [&](Bucket* b) {
+    batch[n++] = b;
+    if (n == kDeleteBatch) {
+      DeleteBuckets(batch, n);
+      n = 0;
     }
-    cur = next;
+  };
+  for (Shard& shard : shards_) {
+    Bucket* cur = shard.samples.load(std::memory_order_acquire);
+    while (cur != nullptr) {
+      Bucket* next = cur->next;
+      cur->~Bucket();
+      add(cur);
+      cur = next;
+    }
+    absl::base_internal::SpinLockHolder h(&shard.lock);
+    while (shard.spare != nullptr) {
+      Bucket* next = shard.spare->next;
+      add(shard.spare);
+      shard.spare = next;
+    }
+  }
+  if (n != 0) DeleteBuckets(batch, n);
+}
+
+StackTraceTable::Shard& StackTraceTable::ShardFor(const StackTrace& t) {
+  uint64_t h = t.depth;
+  for (size_t i = 0; i < t.depth; ++i) {
+    h = (h ^ reinterpret_cast<uintptr_t>(t.stack[i])) * 0x9e3779b97f4a7c15;
+  }
+  return shards_[h >> (64 - kShardBits)];
+}
+
+void StackTraceTable::Insert(Shard& shard, Bucket* b) {
+  b->next = shard.samples.load(std::memory_order_relaxed);
+  while (!shard.samples.compare_exchange_weak(b->next, b,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed)) {
   }
-  all_ = nullptr;
 }
 
 void StackTraceTable::AddTrace(double sample_weight, const StackTrace& t) {
@@ -55,14 +102,33 @@ void StackTraceTable::AddTrace(double sample_weight, const StackTrace& t) {
 
 void StackTraceTable::AddTrace(double sample_weight, const StackTrace& t,
                                Residency* residency) {
-  depth_total_ += t.depth;
+  Shard& shard = ShardFor(t);
+  Insert(shard, NewSample(shard, sample_weight, t, residency));
+}
+
+StackTraceTable::Bucket* StackTraceTable::NewSample(Shard& shard,
+                                                    double sample_weight,
+                                                    const StackTrace& t,
+                                                    Residency* residency) {
+  depth_total_.fetch_add(t.depth, std::memory_order_relaxed);
   Bucket* b;
   {
     // TODO(b/239458966): Avoid the extra copy of stack trace data to sample
     // for cases where Iterate() can be directly based on TCMalloc's internal
     // data structure.
-    absl::base_internal::SpinLockHolder h(&pageheap_lock);
-    b = tc_globals.bucket_allocator().New();
+    absl::base_internal::SpinLockHolder l(&shard.lock);
+    if (ABSL_PREDICT_FALSE(shard.spare == nullptr)) {
+      // Refill in a batch, so that pageheap_lock, which allocation-side
+      // sampling takes too, is taken once per kBucketBatch samples.
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      for (int i = 0; i < kBucketBatch; ++i) {
+        Bucket* spare = tc_globals.bucket_allocator().New();
+        spare->next = shard.spare;
+        shard.spare = spare;
+      }
+    }
+    b = shard.spare;
+    shard.spare = b->next;
   }
   b = new (b) Bucket;
 
@@ -106,17 +172,39 @@ void StackTraceTable::AddTrace(double sample_weight, const StackTrace& t,
                 "Profile stack size smaller than internal stack sizes");
   memcpy(b->sample.stack, t.stack,
          sizeof(b->sample.stack[0]) * b->sample.depth);
+  return b;
+}
+
+void StackTraceTable::AddEscapeTrace(double sample_weight, const StackTrace& t,
+                                     size_t escapes) {
+  Shard& shard = ShardFor(t);
+  Bucket* b = NewSample(shard, sample_weight, t, nullptr);
+  b->sample.escapes = b->sample.count * escapes;
+  Insert(shard, b);
+}
 
-  b->next = all_;
-  all_ = b;
+void StackTraceTable::AddAgeTrace(double sample_weight, const StackTrace& t,
+                                  absl::Duration age) {
+  Shard& shard = ShardFor(t);
+  Bucket* b = NewSample(shard, sample_weight, t, nullptr);
+  b->sample.age_bucket = AgeBucket(age);
+  Insert(shard, b);
+}
+
+int StackTraceTable::AgeBucket(absl::Duration age) {
+  const int64_t ms = absl::ToInt64Milliseconds(age);
+  if (ms < 2) return 0;
+  return std::min<int>(absl::bit_width(static_cast<uint64_t>(ms)) - 1,
+                       Profile::Sample::kNumAgeBuckets - 1);
 }
 
 void StackTraceTable::Iterate(
     absl::FunctionRef<void(const Profile::Sample&)> func) const {
-  Bucket* cur = all_;
-  while (cur != nullptr) {
-    func(cur->sample);
-    cur = cur->next;
+  for (const Shard& shard : shards_) {
+    for (const Bucket* cur = shard.samples.load(std::memory_order_acquire);
+         cur != nullptr; cur = cur->next) {
+      func(cur->sample);
+    }
   }
 }
 
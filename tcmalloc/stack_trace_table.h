@@ -12,16 +12,22 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
-// Utility class for coalescing sampled stack traces.  Not thread-safe.
+// Utility class for coalescing sampled stack traces.  Samples may be added,
+// and the table iterated, from several threads at once.
 
 #ifndef TCMALLOC_STACK_TRACE_TABLE_H_
 #define TCMALLOC_STACK_TRACE_TABLE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <atomic>
 #include <string>
 
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/time/time.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/internal/residency.h"
 #include "tcmalloc/internal_malloc_extension.h"
@@ -54,6 +60,15 @@ class StackTraceTable final : public ProfileBase {
       ABSL_LOCKS_EXCLUDED(pageheap_lock);
   void AddTrace(double sample_weight, const StackTrace& t, Residency* residency)
       ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  // As AddTrace(), for an object with `escapes` escapes recorded.
+  void AddEscapeTrace(double sample_weight, const StackTrace& t,
+                      size_t escapes) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  // As AddTrace(), for an object that is `age` old.
+  void AddAgeTrace(double sample_weight, const StackTrace& t,
+                   absl::Duration age) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // The Profile::Sample::age_bucket of an object that is `age` old.
+  static int AgeBucket(absl::Duration age);
 
   // Exposed for PageHeapAllocator
   // TODO(b/239458966): Give a better name to this struct, since it is no longer
@@ -67,15 +82,41 @@ class StackTraceTable final : public ProfileBase {
   };
 
   // For testing
-  int depth_total() const { return depth_total_; }
+  int depth_total() const {
+    return depth_total_.load(std::memory_order_relaxed);
+  }
 
  private:
+  // Samples are spread over shards by the hash of their stack, so that
+  // threads adding samples of different stacks do not share a cache line.
+  static constexpr int kShardBits = 3;
+  static constexpr int kShards = 1 << kShardBits;
+  // Buckets a shard takes from bucket_allocator() per pageheap_lock hold.
+  static constexpr int kBucketBatch = 32;
+
+  struct ABSL_CACHELINE_ALIGNED Shard {
+    // Samples of the shard, pushed without a lock.
+    std::atomic<Bucket*> samples{nullptr};
+    absl::base_internal::SpinLock lock{
+        absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    // Unconstructed buckets linked through their `next`, taken ahead of use.
+    Bucket* spare ABSL_GUARDED_BY(lock) = nullptr;
+  };
+
+  Shard& ShardFor(const StackTrace& t);
+
+  // Returns a bucket holding the sample of t, not yet in the table.
+  Bucket* NewSample(Shard& shard, double sample_weight, const StackTrace& t,
+                    Residency* residency) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+  // Adds b, filled by NewSample(), to the table.
+  static void Insert(Shard& shard, Bucket* b);
+
   ProfileType type_;
   // TODO(b/245788128): Investigate why this impacts sampling_test.cc.
   void* ABSL_ATTRIBUTE_UNUSED padding_[2];
   absl::Duration duration_ = absl::ZeroDuration();
-  int depth_total_;
-  Bucket* all_;
+  std::atomic<int> depth_total_;
+  Shard shards_[kShards];
 };
 
 }  // namespace tcmalloc_internal
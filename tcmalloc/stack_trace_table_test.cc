@@ -18,6 +18,9 @@
 #include <sys/mman.h>
 
 #include <algorithm>
+#include <atomic>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -401,6 +404,56 @@ TEST(StackTraceTableTest, StackTraceTable) {
   }
 }
 
+TEST(StackTraceTableTest, ConcurrentAddTrace) {
+  tc_globals.InitIfNecessary();
+
+  constexpr int kThreads = 4;
+  constexpr int kTraces = 1000;
+  StackTraceTable table(ProfileType::kHeap);
+  std::atomic<bool> done{false};
+  // Iterate() runs alongside the threads adding samples.
+  std::thread reader([&]() {
+    while (!done.load(std::memory_order_acquire)) {
+      table.Iterate([](const Profile::Sample& e) { EXPECT_EQ(e.depth, 2); });
+    }
+  });
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&table, i]() {
+      StackTrace t = {};
+      t.requested_size = 8;
+      t.allocated_size = 8;
+      t.depth = 2;
+      t.weight = 9;
+      for (int j = 0; j < kTraces; ++j) {
+        t.stack[0] = reinterpret_cast<void*>(i + 1);
+        t.stack[1] = reinterpret_cast<void*>(j + 1);
+        table.AddTrace(1.0, t);
+      }
+    });
+  }
+  for (std::thread& t : threads) t.join();
+  done.store(true, std::memory_order_release);
+  reader.join();
+
+  int samples = 0;
+  table.Iterate([&](const Profile::Sample&) { ++samples; });
+  EXPECT_EQ(samples, kThreads * kTraces);
+  EXPECT_EQ(table.depth_total(), 2 * kThreads * kTraces);
+}
+
+TEST(StackTraceTableTest, AgeBucket) {
+  EXPECT_EQ(StackTraceTable::AgeBucket(absl::ZeroDuration()), 0);
+  EXPECT_EQ(StackTraceTable::AgeBucket(absl::Microseconds(1999)), 0);
+  EXPECT_EQ(StackTraceTable::AgeBucket(absl::Milliseconds(2)), 1);
+  EXPECT_EQ(StackTraceTable::AgeBucket(absl::Milliseconds(3)), 1);
+  EXPECT_EQ(StackTraceTable::AgeBucket(absl::Milliseconds(1024)), 10);
+  EXPECT_EQ(StackTraceTable::AgeBucket(absl::Hours(24)),
+            Profile::Sample::kNumAgeBuckets - 1);
+  EXPECT_EQ(StackTraceTable::AgeBucket(absl::Hours(24 * 365)),
+            Profile::Sample::kNumAgeBuckets - 1);
+}
+
 TEST(StackTraceTableTest, ResidentSizeResident) {
   tc_globals.InitIfNecessary();
 
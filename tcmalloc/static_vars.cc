@@ -21,14 +21,19 @@
 
 #include "absl/base/attributes.h"
 #include "absl/base/const_init.h"
+#include "absl/base/internal/cycleclock.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/macros.h"
+#include "absl/time/time.h"
 #include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/deterministic.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/mincore.h"
 #include "tcmalloc/internal/numa.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/pagemap.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/pointer_tag.h"
 #include "tcmalloc/sampler.h"
 #include "tcmalloc/thread_cache.h"
 
@@ -45,6 +50,9 @@ namespace tcmalloc_internal {
 ABSL_CONST_INIT absl::base_internal::SpinLock pageheap_lock(
     absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
 ABSL_CONST_INIT Arena Static::arena_;
+#ifdef ESCAPE_HUGEPAGE_METADATA
+ABSL_CONST_INIT Arena Static::escape_arena_(/*huge_pages=*/true);
+#endif
 ABSL_CONST_INIT SizeMap ABSL_CACHELINE_ALIGNED Static::sizemap_;
 TCMALLOC_ATTRIBUTE_NO_DESTROY ABSL_CONST_INIT TransferCacheManager
     Static::transfer_cache_;
@@ -53,11 +61,24 @@ ABSL_CONST_INIT ShardedTransferCacheManager
 ABSL_CONST_INIT CpuCache ABSL_CACHELINE_ALIGNED Static::cpu_cache_;
 ABSL_CONST_INIT SampledAllocationAllocator Static::sampledallocation_allocator_;
 ABSL_CONST_INIT PageHeapAllocator<Span> Static::span_allocator_;
+#ifdef SPAN_CACHE
+ABSL_CONST_INIT ShardedPageHeapAllocator<Span> Static::span_cache_(
+    &span_allocator_);
+#endif
 ABSL_CONST_INIT PageHeapAllocator<ThreadCache> Static::threadcache_allocator_;
-ABSL_CONST_INIT PageHeapAllocator<EscapeChunk> Static::escape_allocator_;
-ABSL_CONST_INIT PageHeapAllocator<EscapeList> Static::escape_list_allocator_;
+ABSL_CONST_INIT EscapeChunkAllocator Static::escape_allocator_[kNumaPartitions];
+ABSL_CONST_INIT EscapeTableAllocator Static::escape_table_allocator_;
+ABSL_CONST_INIT EscapeBufferAllocator Static::escape_buffer_allocator_;
 ABSL_CONST_INIT ExplicitlyConstructed<SampledAllocationRecorder>
     Static::sampled_allocation_recorder_;
+#ifdef ENABLE_STATISTIC
+ABSL_CONST_INIT ExplicitlyConstructed<EscapeFlushTracker<>>
+    Static::escape_flush_tracker_;
+#endif
+#ifdef LIFETIME_PROTECTION
+ABSL_CONST_INIT ExplicitlyConstructed<LifetimeDatabase>
+    Static::lifetime_database_;
+#endif
 ABSL_CONST_INIT tcmalloc_internal::StatsCounter Static::sampled_objects_size_;
 ABSL_CONST_INIT tcmalloc_internal::StatsCounter
     Static::sampled_internal_fragmentation_;
@@ -66,6 +87,9 @@ ABSL_CONST_INIT PageHeapAllocator<StackTraceTable::Bucket>
     Static::bucket_allocator_;
 ABSL_CONST_INIT std::atomic<bool> Static::inited_{false};
 ABSL_CONST_INIT std::atomic<bool> Static::cpu_cache_active_{false};
+ABSL_CONST_INIT bool Static::topology_inited_ = false;
+ABSL_CONST_INIT std::atomic<int64_t> Static::init_cycles_{0};
+ABSL_CONST_INIT std::atomic<int64_t> Static::topology_init_cycles_{0};
 ABSL_CONST_INIT Static::PageAllocatorStorage Static::page_allocator_;
 ABSL_CONST_INIT PageMap Static::pagemap_;
 ABSL_CONST_INIT GuardedPageAllocator Static::guardedpage_allocator_;
@@ -76,30 +100,64 @@ ABSL_CONST_INIT NumaTopology<kNumaPartitions, kNumBaseClasses>
 ABSL_CONST_INIT Static tc_globals;
 
 #ifdef ENABLE_STATISTIC
-size_t Static::malloc_cnt;
-size_t Static::free_cnt;
-size_t Static::escape_cnt;
-size_t Static::escape_valid_cnt;
-size_t Static::escape_heap_cnt;
-size_t Static::escape_loc_optimized;
-size_t Static::escape_cache_optimized;
-size_t Static::escape_l2_cache_optimized;
-size_t Static::escape_final_cnt;
-size_t Static::get_range_cnt;
-size_t Static::gep_check_cnt;
-size_t Static::bc_check_cnt;
-size_t Static::get_range_invalid_cnt;
-size_t Static::gep_check_invalid_cnt;
-size_t Static::bc_check_invalid_cnt;
-#endif
-uint32_t Static::escape_pos;
-
+ABSL_CONST_INIT ShardedStatsCounter Static::malloc_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::free_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_valid_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_heap_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_loc_optimized;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_intra_object;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_cache_optimized;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_l2_cache_optimized;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_l2_cache_miss;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_buffer_dedup;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_final_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::get_range_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::gep_check_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::bc_check_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::get_range_invalid_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::gep_check_invalid_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::bc_check_invalid_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::check_invalid_estimate;
+ABSL_CONST_INIT ShardedStatsCounter Static::chunk_cache_hit;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_span_cache_hit;
+ABSL_CONST_INIT ShardedStatsCounter Static::quarantine_released_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::remote_escape_free_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::remote_free_drained_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::short_lived_sampled_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::short_lived_escape_skipped;
+#ifdef OUTGOING_ESCAPE_INDEX
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_pruned_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_dead_cnt;
+#endif
+#ifdef ESCAPE_CHAIN_SWEEP
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_swept_cnt;
+#endif
+#ifdef ESCAPE_LOCATION_CLASSES
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_location_cnt[4];
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_stack_truncated;
+#endif
+#ifdef DEFERRED_ESCAPE_POISON
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_deferred_cnt;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_deferred_evicted;
+#endif
+#ifdef SAMPLED_ESCAPE_SPANS
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_untracked_cnt;
+#endif
+#ifdef ESCAPE_REFCOUNTS
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_ref_quarantined;
+ABSL_CONST_INIT ShardedStatsCounter Static::escape_ref_overwritten;
+#endif
+#endif
 #ifdef ESCAPE_CACHE_L2
-uint32_t Static::escape_l2_pos;
-struct escape_l2_cache_entry Static::escape_l2_caches[L2_CACHE_SIZE];
+ABSL_CONST_INIT EscapeFilter Static::escape_filter_;
+#endif
+#ifdef ESCAPE_LOCATION_CLASSES
+ABSL_CONST_INIT GlobalRanges Static::global_ranges_;
+#ifdef DEFERRED_TOPOLOGY
+ABSL_CONST_INIT absl::once_flag Static::global_ranges_once_;
+#endif
 #endif
-
-struct escape_cache Static::escape_caches[CACHE_SIZE];
 
 size_t Static::metadata_bytes() {
   // This is ugly and doesn't nicely account for e.g. alignment losses
@@ -116,24 +174,103 @@ size_t Static::metadata_bytes() {
       sizeof(cpu_cache_) + sizeof(sampledallocation_allocator_) +
       sizeof(span_allocator_) + +sizeof(threadcache_allocator_) +
       sizeof(sampled_allocation_recorder_) + sizeof(bucket_allocator_) +
-      sizeof(inited_) + sizeof(cpu_cache_active_) + sizeof(page_allocator_) +
+      sizeof(inited_) + sizeof(cpu_cache_active_) + sizeof(topology_inited_) +
+      sizeof(init_cycles_) + sizeof(topology_init_cycles_) +
+      sizeof(page_allocator_) +
       sizeof(pagemap_) + sizeof(sampled_objects_size_) +
       sizeof(sampled_internal_fragmentation_) +
       sizeof(peak_heap_tracker_) + sizeof(guardedpage_allocator_) +
 #ifdef ENABLE_STATISTIC
-      sizeof(size_t) * 15 +
+      sizeof(ShardedStatsCounter) * 24 + sizeof(escape_flush_tracker_) +
+#ifdef OUTGOING_ESCAPE_INDEX
+      sizeof(ShardedStatsCounter) * 2 +
+#endif
+#ifdef ESCAPE_CHAIN_SWEEP
+      sizeof(ShardedStatsCounter) +
+#endif
+#ifdef ESCAPE_LOCATION_CLASSES
+      sizeof(escape_location_cnt) + sizeof(escape_stack_truncated) +
+#endif
+#ifdef DEFERRED_ESCAPE_POISON
+      sizeof(ShardedStatsCounter) * 2 +
+#endif
+#ifdef SAMPLED_ESCAPE_SPANS
+      sizeof(ShardedStatsCounter) +
+#endif
+#ifdef ESCAPE_REFCOUNTS
+      sizeof(ShardedStatsCounter) * 2 +
+#endif
+#endif
+#ifdef ESCAPE_LOCATION_CLASSES
+      sizeof(global_ranges_) +
 #endif
-      sizeof(uint32_t) + sizeof(struct escape_cache) * CACHE_SIZE +
 #ifdef ESCAPE_CACHE_L2
-      sizeof(uint32_t) + sizeof(struct escape_l2_cache_entry) * L2_CACHE_SIZE +
+      sizeof(escape_filter_) + escape_filter_.mapped_bytes() +
+#endif
+#ifdef ESCAPE_HUGEPAGE_METADATA
+      sizeof(escape_arena_) +
+#endif
+#ifdef LIFETIME_PROTECTION
+      sizeof(lifetime_database_) +
+#endif
+#ifdef SPAN_CACHE
+      sizeof(span_cache_) +
 #endif
       sizeof(numa_topology_) + sizeof(escape_allocator_) +
-      sizeof(escape_list_allocator_);
+      sizeof(escape_table_allocator_) + sizeof(escape_buffer_allocator_);
+  size_t escape_chunk_bytes = 0;
+  for (const EscapeChunkAllocator& a : escape_allocator_) {
+    escape_chunk_bytes += a.touched_bytes() - a.released_bytes();
+  }
   // LINT.ThenChange(:static_vars)
 
-  const size_t allocated = arena().stats().bytes_allocated +
-                           AddressRegionFactory::InternalBytesAllocated();
-  return allocated + static_var_size;
+  size_t allocated = arena().stats().bytes_allocated +
+                     AddressRegionFactory::InternalBytesAllocated();
+#ifdef PAGEMAP_HUGE_LEAVES
+  allocated += MetaDataHugeBytes();
+#endif
+#ifdef ESCAPE_HUGEPAGE_METADATA
+  allocated += escape_arena_.stats().bytes_allocated;
+#endif
+  return allocated + static_var_size + escape_chunk_bytes;
+}
+
+void Static::DeleteEscapeChunks(EscapeChunk* first, EscapeChunk* last,
+                                size_t n) {
+  if (kNumaPartitions == 1) {
+    escape_allocator_[0].DeleteList(first, last, n);
+    return;
+  }
+  void* heads[kNumaPartitions] = {};
+  void* tails[kNumaPartitions] = {};
+  size_t counts[kNumaPartitions] = {};
+  void* chunk = first;
+  for (size_t i = 0; i < n; ++i) {
+    void* next = *static_cast<void**>(chunk);
+    size_t partition = 0;
+    while (partition + 1 < kNumaPartitions &&
+           !escape_allocator_[partition].Owns(chunk)) {
+      ++partition;
+    }
+#ifdef FORK_AWARE_PROTECTION
+    // left linked as they are, see EscapeChunkAllocator::Inherited()
+    if (escape_allocator_[partition].Inherited(chunk)) {
+      chunk = next;
+      continue;
+    }
+#endif
+    *static_cast<void**>(chunk) = heads[partition];
+    heads[partition] = chunk;
+    if (tails[partition] == nullptr) tails[partition] = chunk;
+    counts[partition]++;
+    chunk = next;
+  }
+  for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+    if (counts[partition] == 0) continue;
+    escape_allocator_[partition].DeleteList(
+        static_cast<EscapeChunk*>(heads[partition]),
+        static_cast<EscapeChunk*>(tails[partition]), counts[partition]);
+  }
 }
 
 size_t Static::pagemap_residence() {
@@ -147,6 +284,7 @@ ABSL_ATTRIBUTE_COLD ABSL_ATTRIBUTE_NOINLINE void Static::SlowInitIfNecessary() {
 
   // double-checked locking
   if (!inited_.load(std::memory_order_acquire)) {
+    const int64_t start = absl::base_internal::CycleClock::Now();
     sizemap_.Init();
     numa_topology_.Init();
     sampledallocation_allocator_.Init(&arena_);
@@ -157,25 +295,120 @@ ABSL_ATTRIBUTE_COLD ABSL_ATTRIBUTE_NOINLINE void Static::SlowInitIfNecessary() {
     span_allocator_.New();  // Reduce cache conflicts
     span_allocator_.New();  // Reduce cache conflicts
     bucket_allocator_.Init(&arena_);
-    escape_allocator_.Init(&arena_);
-    escape_list_allocator_.Init(&arena_);
+#ifdef ESCAPE_HUGEPAGE_METADATA
+    escape_table_allocator_.Init(&escape_arena_);
+    escape_buffer_allocator_.Init(&escape_arena_);
+#else
+    escape_table_allocator_.Init(&arena_);
+    escape_buffer_allocator_.Init(&arena_);
+#endif
+    for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+      escape_allocator_[partition].Init(partition);
+    }
+#ifdef ENABLE_STATISTIC
+    escape_flush_tracker_.Construct(
+        Clock{.now = absl::base_internal::CycleClock::Now,
+              .freq = absl::base_internal::CycleClock::Frequency},
+        absl::Minutes(1));
+#endif
+#ifdef LIFETIME_PROTECTION
+    lifetime_database_.Construct();
+#endif
     // Do a bit of sanitizing: make sure central_cache is aligned properly
     CHECK_CONDITION((sizeof(transfer_cache_) % ABSL_CACHELINE_SIZE) == 0);
     transfer_cache_.Init();
-    if (IsExperimentActive(
-            Experiment::TEST_ONLY_TCMALLOC_SHARDED_TRANSFER_CACHE)) {
-      // The constructor of the sharded transfer cache leaves it in a disabled
-      // state.
-      sharded_transfer_cache_.Init();
-    }
     new (page_allocator_.memory) PageAllocator;
     threadcache_allocator_.Init(&arena_);
     pagemap_.MapRootWithSmallPages();
+#ifdef SCALABLE_GUARDED_PAGES
+    guardedpage_allocator_.Init(
+        /*max_alloced_pages=*/GuardedPageAllocator::kGpaMaxPages / 2,
+        /*total_pages=*/GuardedPageAllocator::kGpaMaxPages);
+#else
     guardedpage_allocator_.Init(/*max_alloced_pages=*/64, /*total_pages=*/128);
+#endif
+    Parameters::InitProtectionPolicyFromEnvironment();
+#ifdef DETERMINISTIC_MODE
+    DeterministicMode::InitFromEnvironment();
+#endif
+    // Fault in what startup asked for now, ahead of the allocations that
+    // would take the faults one page at a time.
+    if (const size_t bytes = Parameters::prefault_metadata_bytes()) {
+      arena_.Prefault(bytes);
+#ifdef ESCAPE_HUGEPAGE_METADATA
+      escape_arena_.Prefault(bytes);
+#endif
+    }
+    if (const size_t bytes = Parameters::prefault_heap_bytes()) {
+      page_allocator().Prefault(BytesToLengthCeil(bytes));
+    }
+#ifdef POINTER_TAGGING
+    PointerTags::Init();
+#endif
+#ifndef DEFERRED_TOPOLOGY
+    InitTopologyLocked();
+#ifdef ESCAPE_LOCATION_CLASSES
+    InitGlobalRanges();
+#endif
+#endif
+    init_cycles_.store(absl::base_internal::CycleClock::Now() - start,
+                       std::memory_order_relaxed);
     inited_.store(true, std::memory_order_release);
   }
 }
 
+void Static::InitTopologyIfNecessary() {
+  InitIfNecessary();
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  InitTopologyLocked();
+}
+
+void Static::InitTopologyLocked() {
+  if (topology_inited_) return;
+  topology_inited_ = true;
+  const int64_t start = absl::base_internal::CycleClock::Now();
+  // The sharded transfer cache reads the L3 cache of every CPU from sysfs.
+  if (IsExperimentActive(
+          Experiment::TEST_ONLY_TCMALLOC_SHARDED_TRANSFER_CACHE)) {
+    // The constructor of the sharded transfer cache leaves it in a disabled
+    // state.
+    sharded_transfer_cache_.Init();
+  }
+#ifdef LLC_SHARED_REFILL
+  else {
+    // Only the batches the per-CPU caches refill and overflow go through
+    // the L3 shards.
+    sharded_transfer_cache_.Init(/*large_classes=*/false);
+  }
+#endif
+  topology_init_cycles_.fetch_add(
+      absl::base_internal::CycleClock::Now() - start,
+      std::memory_order_relaxed);
+}
+
+#ifdef ESCAPE_LOCATION_CLASSES
+void Static::InitGlobalRanges() {
+  const int64_t start = absl::base_internal::CycleClock::Now();
+  global_ranges_.Init();
+  topology_init_cycles_.fetch_add(
+      absl::base_internal::CycleClock::Now() - start,
+      std::memory_order_relaxed);
+}
+#endif
+
+static absl::Duration CyclesToDuration(int64_t cycles) {
+  return absl::Seconds(cycles / absl::base_internal::CycleClock::Frequency());
+}
+
+absl::Duration Static::init_time() {
+  return CyclesToDuration(init_cycles_.load(std::memory_order_relaxed));
+}
+
+absl::Duration Static::topology_init_time() {
+  return CyclesToDuration(
+      topology_init_cycles_.load(std::memory_order_relaxed));
+}
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
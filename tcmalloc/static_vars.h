@@ -24,14 +24,23 @@
 #include <atomic>
 
 #include "absl/base/attributes.h"
+#include "absl/base/call_once.h"
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/time/time.h"
 #include "tcmalloc/arena.h"
 #include "tcmalloc/central_freelist.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/escape_buffer.h"
+#include "tcmalloc/escape_chunk_allocator.h"
+#include "tcmalloc/escape_filter.h"
+#include "tcmalloc/escape_flush_tracker.h"
+#include "tcmalloc/escape_location.h"
+#include "tcmalloc/escape_table.h"
 #include "tcmalloc/explicitly_constructed.h"
 #include "tcmalloc/guarded_page_allocator.h"
 #include "tcmalloc/internal/atomic_stats_counter.h"
+#include "tcmalloc/internal/lifetime_predictions.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/numa.h"
 #include "tcmalloc/internal/percpu.h"
@@ -42,6 +51,7 @@
 #include "tcmalloc/sampled_allocation.h"
 #include "tcmalloc/sampled_allocation_allocator.h"
 #include "tcmalloc/sampled_allocation_recorder.h"
+#include "tcmalloc/sharded_stats_counter.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stack_trace_table.h"
 #include "tcmalloc/transfer_cache.h"
@@ -54,24 +64,10 @@ class CpuCache;
 class PageMap;
 class ThreadCache;
 
-struct escape_cache {
-  void **loc; size_t ptr; // void *old_ptr;
-};
-
-#define ESCAPE_CACHE_L2
-#define CACHE_SIZE (1024)
-#define L2_CACHE_SIZE (1024*1024*4)
-
-struct escape_l2_cache_entry {
-  uint32_t loc; 
-  uint32_t obj_start;
-};
-
 #define OBJ_START(x) (uint64_t)((uint64_t)x >> 24)
 #define SMALL_PTR(x) (uint64_t)((uint64_t)x & 0xffffffffff)
 #define OBJ_SIZE(x) (((uint32_t)(x & 0xffffff)) << 3)
 #define OBJ_SIZE_RAW(x) ((uint32_t)(x & 0xffffff))
-#define MASK(x) ((uint32_t)(((uint64_t)x >> 3) & (L2_CACHE_SIZE - 1)))
 
 using SampledAllocationRecorder =
     ::tcmalloc::tcmalloc_internal::SampleRecorder<SampledAllocation,
@@ -86,6 +82,16 @@ class Static final {
   // Must be called before calling any of the accessors below.
   // Safe to call multiple times.
   static void InitIfNecessary();
+  // Probes the cache topology the per-CPU caches shard their transfer
+  // caches by.  Under DEFERRED_TOPOLOGY it runs when the per-CPU caches
+  // activate rather than from InitIfNecessary().  Safe to call multiple
+  // times.
+  static void InitTopologyIfNecessary();
+
+  // Time InitIfNecessary() and InitTopologyIfNecessary() took, zero until
+  // they have run.
+  static absl::Duration init_time();
+  static absl::Duration topology_init_time();
 
   // Central cache.
   static CentralFreeList& central_freelist(int size_class) {
@@ -116,6 +122,11 @@ class Static final {
 
   static Arena& arena() { return arena_; }
 
+#ifdef ESCAPE_HUGEPAGE_METADATA
+  // Huge page backed arena of the escape tables and buffers.
+  static Arena& escape_arena() { return escape_arena_; }
+#endif
+
   // Page-level allocator.
   static PageAllocator& page_allocator() {
     return *reinterpret_cast<PageAllocator*>(page_allocator_.memory);
@@ -133,16 +144,33 @@ class Static final {
 
   static PageHeapAllocator<Span>& span_allocator() { return span_allocator_; }
 
+#ifdef SPAN_CACHE
+  // Per-CPU caches of span_allocator(), for Span::NewCached().
+  static ShardedPageHeapAllocator<Span>& span_cache() { return span_cache_; }
+#endif
+
   static PageHeapAllocator<ThreadCache>& threadcache_allocator() {
     return threadcache_allocator_;
   }
 
-  static PageHeapAllocator<EscapeChunk>& escape_allocator() {
-    return escape_allocator_;
+  // Escape chunks of spans in NUMA partition `partition`.
+  static EscapeChunkAllocator& escape_allocator(size_t partition) {
+    ASSERT(partition < kNumaPartitions);
+    return escape_allocator_[partition];
   }
 
-  static PageHeapAllocator<EscapeList>& escape_list_allocator() {
-    return escape_list_allocator_;
+  // Returns the n chunks linked from first to last to the allocators they
+  // came from.  A chain may hold chunks of several partitions once realloc
+  // has moved it to a span of another one.
+  static void DeleteEscapeChunks(EscapeChunk* first, EscapeChunk* last,
+                                 size_t n);
+
+  static EscapeTableAllocator& escape_table_allocator() {
+    return escape_table_allocator_;
+  }
+
+  static EscapeBufferAllocator& escape_buffer_allocator() {
+    return escape_buffer_allocator_;
   }
 
   static SampledAllocationRecorder& sampled_allocation_recorder() {
@@ -196,28 +224,85 @@ class Static final {
   static size_t pagemap_residence();
 
 #ifdef ENABLE_STATISTIC
-  static size_t malloc_cnt;
-  static size_t free_cnt;
-  static size_t escape_cnt;
-  static size_t escape_valid_cnt;
-  static size_t escape_heap_cnt;
-  static size_t escape_loc_optimized;
-  static size_t escape_cache_optimized;
-  static size_t escape_l2_cache_optimized;
-  static size_t escape_final_cnt;
-  static size_t get_range_cnt;
-  static size_t gep_check_cnt;
-  static size_t bc_check_cnt;
-  static size_t get_range_invalid_cnt;
-  static size_t gep_check_invalid_cnt;
-  static size_t bc_check_invalid_cnt;
+  static ShardedStatsCounter malloc_cnt;
+  static ShardedStatsCounter free_cnt;
+  static ShardedStatsCounter escape_cnt;
+  static ShardedStatsCounter escape_valid_cnt;
+  static ShardedStatsCounter escape_heap_cnt;
+  static ShardedStatsCounter escape_loc_optimized;
+  // Escapes through a location inside the object pointed to.
+  static ShardedStatsCounter escape_intra_object;
+  static ShardedStatsCounter escape_cache_optimized;
+  static ShardedStatsCounter escape_l2_cache_optimized;
+  static ShardedStatsCounter escape_l2_cache_miss;
+  static ShardedStatsCounter escape_buffer_dedup;
+  static ShardedStatsCounter escape_final_cnt;
+  static ShardedStatsCounter get_range_cnt;
+  static ShardedStatsCounter gep_check_cnt;
+  static ShardedStatsCounter bc_check_cnt;
+  static ShardedStatsCounter get_range_invalid_cnt;
+  static ShardedStatsCounter gep_check_invalid_cnt;
+  static ShardedStatsCounter bc_check_invalid_cnt;
+  // Invalid checks, scaled up by the calls ProtectionPolicy::kSampled skipped.
+  static ShardedStatsCounter check_invalid_estimate;
+  static ShardedStatsCounter chunk_cache_hit;
+  static ShardedStatsCounter escape_span_cache_hit;
+  static ShardedStatsCounter quarantine_released_cnt;
+  static ShardedStatsCounter remote_escape_free_cnt;
+  static ShardedStatsCounter remote_free_drained_cnt;
+  static ShardedStatsCounter short_lived_sampled_cnt;
+  static ShardedStatsCounter short_lived_escape_skipped;
+#ifdef OUTGOING_ESCAPE_INDEX
+  static ShardedStatsCounter escape_pruned_cnt;
+  static ShardedStatsCounter escape_dead_cnt;
+#endif
+#ifdef ESCAPE_CHAIN_SWEEP
+  static ShardedStatsCounter escape_swept_cnt;
+#endif
+#ifdef ESCAPE_LOCATION_CLASSES
+  // Escapes by EscapeLocation, and stack records dropped with their frame.
+  static ShardedStatsCounter escape_location_cnt[4];
+  static ShardedStatsCounter escape_stack_truncated;
+#endif
+#ifdef DEFERRED_ESCAPE_POISON
+  // Objects whose escapes free() left to the deferred queue, and those of
+  // them a full queue made a later free() finish.
+  static ShardedStatsCounter escape_deferred_cnt;
+  static ShardedStatsCounter escape_deferred_evicted;
+#endif
+#ifdef SAMPLED_ESCAPE_SPANS
+  // Escapes into spans registered without escape tracking.
+  static ShardedStatsCounter escape_untracked_cnt;
+#endif
+#ifdef ESCAPE_REFCOUNTS
+  // Objects free() quarantined for their escape count, and those of them
+  // found written to when released.
+  static ShardedStatsCounter escape_ref_quarantined;
+  static ShardedStatsCounter escape_ref_overwritten;
+#endif
+  static EscapeFlushTracker<>& escape_flush_tracker() {
+    return escape_flush_tracker_.get_mutable();
+  }
 #endif
 #ifdef ESCAPE_CACHE_L2
-  static uint32_t escape_l2_pos;
-  static struct escape_l2_cache_entry escape_l2_caches[L2_CACHE_SIZE];
+  static EscapeFilter& escape_filter() { return escape_filter_; }
+#endif
+#ifdef ESCAPE_LOCATION_CLASSES
+  // Under DEFERRED_TOPOLOGY, /proc/self/maps is read on the first call
+  // rather than at startup.
+  static const GlobalRanges& global_ranges() {
+#ifdef DEFERRED_TOPOLOGY
+    absl::call_once(global_ranges_once_, InitGlobalRanges);
+#endif
+    return global_ranges_;
+  }
+#endif
+#ifdef LIFETIME_PROTECTION
+  // Lifetime statistics of the stacks of sampled allocations.
+  static LifetimeDatabase& lifetime_database() {
+    return lifetime_database_.get_mutable();
+  }
 #endif
-  static uint32_t escape_pos;
-  static struct escape_cache escape_caches[CACHE_SIZE];
 
 //  private:
 #if defined(__clang__)
@@ -225,6 +310,11 @@ class Static final {
 #endif
   static void
   SlowInitIfNecessary();
+  static void InitTopologyLocked()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+#ifdef ESCAPE_LOCATION_CLASSES
+  static void InitGlobalRanges();
+#endif
 
   // These static variables require explicit initialization.  We cannot
   // count on their constructors to do any initialization because other
@@ -232,6 +322,9 @@ class Static final {
   // can run their constructors.
 
   ABSL_CONST_INIT static Arena arena_;
+#ifdef ESCAPE_HUGEPAGE_METADATA
+  ABSL_CONST_INIT static Arena escape_arena_;
+#endif
   static SizeMap sizemap_;
   TCMALLOC_ATTRIBUTE_NO_DESTROY ABSL_CONST_INIT static TransferCacheManager
       transfer_cache_;
@@ -240,12 +333,30 @@ class Static final {
   ABSL_CONST_INIT static GuardedPageAllocator guardedpage_allocator_;
   static SampledAllocationAllocator sampledallocation_allocator_;
   static PageHeapAllocator<Span> span_allocator_;
+#ifdef SPAN_CACHE
+  ABSL_CONST_INIT static ShardedPageHeapAllocator<Span> span_cache_;
+#endif
   static PageHeapAllocator<ThreadCache> threadcache_allocator_;
-  static PageHeapAllocator<EscapeChunk> escape_allocator_;
-  static PageHeapAllocator<EscapeList> escape_list_allocator_;
+  ABSL_CONST_INIT static EscapeChunkAllocator
+      escape_allocator_[kNumaPartitions];
+  static EscapeTableAllocator escape_table_allocator_;
+  static EscapeBufferAllocator escape_buffer_allocator_;
+#ifdef ESCAPE_CACHE_L2
+  ABSL_CONST_INIT static EscapeFilter escape_filter_;
+#endif
+#ifdef ESCAPE_LOCATION_CLASSES
+  ABSL_CONST_INIT static GlobalRanges global_ranges_;
+#ifdef DEFERRED_TOPOLOGY
+  ABSL_CONST_INIT static absl::once_flag global_ranges_once_;
+#endif
+#endif
   static PageHeapAllocator<StackTraceTable::Bucket> bucket_allocator_;
   ABSL_CONST_INIT static std::atomic<bool> inited_;
   ABSL_CONST_INIT static std::atomic<bool> cpu_cache_active_;
+  ABSL_CONST_INIT static bool topology_inited_
+      ABSL_GUARDED_BY(pageheap_lock);
+  ABSL_CONST_INIT static std::atomic<int64_t> init_cycles_;
+  ABSL_CONST_INIT static std::atomic<int64_t> topology_init_cycles_;
   ABSL_CONST_INIT static PeakHeapTracker peak_heap_tracker_;
   ABSL_CONST_INIT static NumaTopology<kNumaPartitions, kNumBaseClasses>
       numa_topology_;
@@ -267,6 +378,12 @@ class Static final {
   // the global pageheap_lock.
   static ExplicitlyConstructed<SampledAllocationRecorder>
       sampled_allocation_recorder_;
+#ifdef ENABLE_STATISTIC
+  static ExplicitlyConstructed<EscapeFlushTracker<>> escape_flush_tracker_;
+#endif
+#ifdef LIFETIME_PROTECTION
+  static ExplicitlyConstructed<LifetimeDatabase> lifetime_database_;
+#endif
 };
 
 ABSL_CONST_INIT extern Static tc_globals;
@@ -301,6 +418,21 @@ inline void Span::Delete(Span* span) {
   Static::span_allocator().Delete(span);
 }
 
+#ifdef SPAN_CACHE
+inline Span* Span::NewCached(PageId p, Length len) {
+  Span* result = Static::span_cache().New();
+  result->Init(p, len);
+  return result;
+}
+
+inline void Span::DeleteCached(Span* span) {
+#ifndef NDEBUG
+  memset(static_cast<void*>(span), 0x3f, sizeof(*span));
+#endif
+  Static::span_cache().Delete(span);
+}
+#endif
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
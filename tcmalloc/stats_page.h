@@ -0,0 +1,111 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Layout of the shared stats page (STATS_PAGE).
+//
+// With STATS_PAGE the background thread mirrors key counters into a memfd
+// named "tcmalloc_stats" once a second, so that an agent outside the process
+// can read them without calling into it.  The agent finds the memfd among the
+// links of /proc/<pid>/fd ("/memfd:tcmalloc_stats (deleted)"), or in-process
+// code through the "safe_tcmalloc.stats_page_fd" property, maps it read-only
+// and calls ReadStatsPage().  The page is a seqlock: the writer makes seq odd
+// while it copies a snapshot in, so a reader retries until it sees the same
+// even seq before and after its copy.  Readers never block the writer, and
+// allocation paths never touch the page.
+//
+// This header depends on nothing else in TCMalloc, so that agents can build
+// against it alone.
+
+#ifndef TCMALLOC_STATS_PAGE_H_
+#define TCMALLOC_STATS_PAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+namespace tcmalloc {
+
+inline constexpr uint64_t kStatsPageMagic = 0x7463'6d73'7461'7473;  // "tcmstats"
+inline constexpr uint32_t kStatsPageVersion = 1;
+inline constexpr size_t kStatsPageMaxClasses = 256;
+
+struct StatsPageClass {
+  uint64_t size;        // bytes of an object of the class, 0 if unused
+  uint64_t live_bytes;  // bytes of objects handed out and not freed
+  uint64_t free_bytes;  // bytes cached in the CPU, thread, transfer and
+                        // central caches
+};
+
+struct StatsPageSnapshot {
+  int64_t update_time_ns;  // CLOCK_REALTIME of the copy
+  uint64_t in_use_bytes;   // generic.bytes_in_use_by_app
+  uint64_t heap_size;      // generic.heap_size
+  uint64_t physical_bytes;  // generic.physical_memory_used
+  uint64_t virtual_bytes;   // generic.virtual_memory_used
+  uint64_t pageheap_free_bytes;
+  uint64_t pageheap_unmapped_bytes;
+  uint64_t metadata_bytes;
+  uint64_t escape_metadata_bytes;
+  uint64_t release_rate;  // background release rate in bytes per second
+  // Protection counters of ENABLE_STATISTIC builds, 0 otherwise.
+  uint64_t mallocs;
+  uint64_t frees;
+  uint64_t escapes;
+  uint64_t gep_checks;
+  uint64_t gep_checks_invalid;
+  uint64_t bc_checks;
+  uint64_t bc_checks_invalid;
+  uint64_t range_checks;
+  uint64_t range_checks_invalid;
+  uint64_t invalid_checks_estimate;
+  uint64_t num_classes;
+  StatsPageClass classes[kStatsPageMaxClasses];
+};
+
+struct StatsPage {
+  uint64_t magic;    // kStatsPageMagic once the page is set up
+  uint32_t version;  // kStatsPageVersion
+  uint32_t size;     // sizeof(StatsPage) of the writer
+  std::atomic<uint64_t> seq;
+  StatsPageSnapshot snapshot;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "seq must work across processes");
+
+// Copies the last complete snapshot of the page at `page` into *out.
+// Returns false if the page is not (yet) a stats page of this version, or if
+// the writer kept it busy for max_tries attempts.
+inline bool ReadStatsPage(const void* page, StatsPageSnapshot* out,
+                          int max_tries = 64) {
+  const StatsPage* p = static_cast<const StatsPage*>(page);
+  if (p->magic != kStatsPageMagic || p->version != kStatsPageVersion ||
+      p->size < sizeof(StatsPage)) {
+    return false;
+  }
+  for (int i = 0; i < max_tries; ++i) {
+    const uint64_t before = p->seq.load(std::memory_order_acquire);
+    if (before & 1) continue;
+    memcpy(out, &p->snapshot, sizeof(*out));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (p->seq.load(std::memory_order_relaxed) == before) return true;
+  }
+  return false;
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_STATS_PAGE_H_
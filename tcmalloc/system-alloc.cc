@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
 #include <unistd.h>
@@ -25,24 +26,36 @@
 #include <algorithm>
 #include <atomic>
 #include <new>
+#include <optional>
 #include <tuple>
 #include <type_traits>
 #include <utility>
 
 #include "absl/base/attributes.h"
+#include "absl/base/call_once.h"
 #include "absl/base/const_init.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/macros.h"
 #include "absl/base/optimization.h"
 #include "absl/types/optional.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/flat_page_info.h"
+#include "tcmalloc/heap_range_filter.h"
+#include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/numa.h"
 #include "tcmalloc/internal/optimization.h"
 #include "tcmalloc/internal/parameter_accessors.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/pointer_tag.h"
 #include "tcmalloc/sampler.h"
 
+// Linux 5.7 added MREMAP_DONTUNMAP; older headers do not know it.
+#if defined(__linux__) && !defined(MREMAP_DONTUNMAP)
+#define MREMAP_DONTUNMAP 4
+#endif
+
 // On systems (like freebsd) that don't define MAP_ANONYMOUS, use the old
 // form of the name instead.
 #ifndef MAP_ANONYMOUS
@@ -60,9 +73,18 @@ extern "C" int madvise(caddr_t, size_t, int);
 #include <linux/mempolicy.h>
 #endif
 
+// Linux 5.15 added MPOL_PREFERRED_MANY; older headers do not know it.
+#if defined(__linux__) && !defined(MPOL_PREFERRED_MANY)
+#define MPOL_PREFERRED_MANY 5
+#endif
+
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
+
+static uintptr_t RandomMmapHint(size_t size, size_t alignment,
+                                const MemoryTag tag);
+
 namespace {
 
 // Check that no bit is set at position ADDRESS_BITS or higher.
@@ -180,7 +202,11 @@ std::pair<void*, size_t> MmapRegion::Alloc(size_t request_size,
 
   ASSERT(result % pagesize == 0);
   void* result_ptr = reinterpret_cast<void*>(result);
-  if (mprotect(result_ptr, actual_size, PROT_READ | PROT_WRITE) != 0) {
+  int prot = PROT_READ | PROT_WRITE;
+#ifdef MEMORY_TAGGING
+  prot |= MemoryTagProtection();
+#endif
+  if (mprotect(result_ptr, actual_size, prot) != 0) {
     Log(kLogWithStack, __FILE__, __LINE__,
         "mprotect() region failed (ptr, size, error)", result_ptr, actual_size,
         strerror(errno));
@@ -318,6 +344,55 @@ std::pair<void*, size_t> RegionManager::Allocate(size_t size, size_t alignment,
   return region->Alloc(size, alignment);
 }
 
+#ifdef FLAT_PAGE_INFO
+// The part of the FlatPageInfo reservation MmapAligned() has not handed out
+// yet, empty if there is no reservation.
+uintptr_t flat_next = 0;
+uintptr_t flat_end = 0;
+
+// Reserves FlatPageInfo::kHeapBytes of normal tagged address space, aligned
+// to its size, and the array mirroring its page info.  Without either the
+// heap is mapped as usual and every lookup goes to the page map.
+void ReserveFlatHeap() {
+  constexpr size_t kHeapBytes = FlatPageInfo::kHeapBytes;
+  constexpr size_t kShadowBytes = FlatPageInfo::kPages * sizeof(uintptr_t);
+  void* shadow = mmap(nullptr, kShadowBytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (shadow == MAP_FAILED) {
+    Log(kLog, __FILE__, __LINE__, "flat page info mmap() failed (size, error)",
+        kShadowBytes, strerror(errno));
+    return;
+  }
+  for (int i = 0; i < 100; ++i) {
+    void* hint = reinterpret_cast<void*>(
+        RandomMmapHint(kHeapBytes, kHeapBytes, MemoryTag::kNormal));
+    void* result = mmap(hint, kHeapBytes, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (result == hint) {
+      flat_next = reinterpret_cast<uintptr_t>(result);
+      flat_end = flat_next + kHeapBytes;
+      FlatPageInfo::Init(flat_next, static_cast<uintptr_t*>(shadow));
+      return;
+    }
+    if (result != MAP_FAILED) munmap(result, kHeapBytes);
+  }
+  Log(kLog, __FILE__, __LINE__, "flat heap reservation failed (size)",
+      kHeapBytes);
+  munmap(shadow, kShadowBytes);
+}
+
+// Returns size bytes aligned to alignment from the reservation, or nullptr
+// once it is used up.
+void* FlatHeapCarve(size_t size, size_t alignment) {
+  const uintptr_t start = RoundUp(flat_next, alignment);
+  if (start < flat_next || start > flat_end || flat_end - start < size) {
+    return nullptr;
+  }
+  flat_next = start + size;
+  return reinterpret_cast<void*>(start);
+}
+#endif  // FLAT_PAGE_INFO
+
 void InitSystemAllocatorIfNecessary() {
   if (region_factory) return;
   pagesize = getpagesize();
@@ -328,6 +403,35 @@ void InitSystemAllocatorIfNecessary() {
   preferred_alignment = std::max(pagesize, kMinSystemAlloc);
   region_manager = new (&region_manager_space) RegionManager();
   region_factory = new (&mmap_space) MmapRegionFactory();
+#ifdef FLAT_PAGE_INFO
+  ReserveFlatHeap();
+#endif
+}
+
+ABSL_CONST_INIT std::atomic<int> system_release_errors(0);
+
+}  // namespace
+
+void* SystemReserve(size_t size, size_t alignment) {
+  absl::base_internal::SpinLockHolder lock_holder(&spinlock);
+  InitSystemAllocatorIfNecessary();
+  for (int i = 0; i < 100; ++i) {
+    void* hint = reinterpret_cast<void*>(
+        RandomMmapHint(size, alignment, MemoryTag::kNormal));
+    void* result = mmap(hint, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (result == hint) {
+      BindMemory(result, size, 0);
+#ifdef HEAP_RANGE_FILTER
+      HeapRangeFilter::Add(reinterpret_cast<uintptr_t>(result), size);
+#endif
+      return result;
+    }
+    if (result != MAP_FAILED) munmap(result, size);
+  }
+  Log(kLog, __FILE__, __LINE__, "address space reservation failed (size)",
+      size);
+  return nullptr;
 }
 
 // Bind the memory region spanning `size` bytes starting from `base` to NUMA
@@ -362,10 +466,88 @@ void BindMemory(void* const base, const size_t size, const size_t partition) {
         nodemask);
 }
 
-ABSL_CONST_INIT std::atomic<int> system_release_errors(0);
+#ifdef COLD_TIER_BIND
+namespace {
+
+ABSL_CONST_INIT absl::once_flag cold_tier_once;
+ABSL_CONST_INIT uint64_t cold_tier_nodes = 0;
+ABSL_CONST_INIT bool cold_tier_escapes = false;
+// Set once the kernel turns MPOL_PREFERRED_MANY down, before 5.15.
+ABSL_CONST_INIT std::atomic<bool> cold_tier_single{false};
+ABSL_CONST_INIT std::atomic<size_t> cold_tier_bound_bytes{0};
+
+void InitColdTier() {
+  const char* nodes = thread_safe_getenv("TCMALLOC_COLD_TIER_NODES");
+  if (nodes == nullptr || *nodes == '\0') return;
+  // ParseCpulist() reads a cpulist file; node lists share its syntax.
+  size_t left = strlen(nodes);
+  const std::optional<cpu_set_t> set =
+      ParseCpulist([&](char* const buf, const size_t count) {
+        const size_t n = std::min(left, count);
+        memcpy(buf, nodes, n);
+        nodes += n;
+        left -= n;
+        return static_cast<ssize_t>(n);
+      });
+  uint64_t mask = 0;
+  if (set.has_value()) {
+    for (size_t node = 0; node < 64; ++node) {
+      if (CPU_ISSET(node, &*set)) mask |= uint64_t{1} << node;
+    }
+  }
+  if (mask == 0) {
+    Log(kLog, __FILE__, __LINE__,
+        "Warning: ignoring TCMALLOC_COLD_TIER_NODES (value)",
+        thread_safe_getenv("TCMALLOC_COLD_TIER_NODES"));
+    return;
+  }
+  cold_tier_nodes = mask;
+  const char* escapes = thread_safe_getenv("TCMALLOC_COLD_TIER_ESCAPES");
+  cold_tier_escapes = escapes != nullptr && strcmp(escapes, "1") == 0;
+}
 
 }  // namespace
 
+uint64_t ColdTierNodes() {
+  absl::base_internal::LowLevelCallOnce(&cold_tier_once, InitColdTier);
+  return cold_tier_nodes;
+}
+
+bool ColdTierEscapes() { return ColdTierNodes() != 0 && cold_tier_escapes; }
+
+size_t ColdTierBoundBytes() {
+  return cold_tier_bound_bytes.load(std::memory_order_relaxed);
+}
+
+void BindColdTier(void* const base, const size_t size) {
+  uint64_t nodemask = ColdTierNodes();
+  if (nodemask == 0) return;
+  // A preferred policy, unlike BindMemory(): once the tier is full the
+  // kernel falls back to the other nodes rather than reclaim or fail.
+  int mode = MPOL_PREFERRED_MANY;
+  if (cold_tier_single.load(std::memory_order_relaxed)) {
+    mode = MPOL_PREFERRED;
+    nodemask &= -nodemask;
+  }
+  int err = syscall(__NR_mbind, base, size, mode, &nodemask,
+                    sizeof(nodemask) * 8, 0);
+  if (err != 0 && errno == EINVAL && mode == MPOL_PREFERRED_MANY) {
+    cold_tier_single.store(true, std::memory_order_relaxed);
+    mode = MPOL_PREFERRED;
+    nodemask &= -nodemask;
+    err = syscall(__NR_mbind, base, size, mode, &nodemask,
+                  sizeof(nodemask) * 8, 0);
+  }
+  if (err != 0) {
+    Log(kLogWithStack, __FILE__, __LINE__,
+        "Warning: Unable to mbind memory to the cold tier", errno, base,
+        nodemask);
+    return;
+  }
+  cold_tier_bound_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+#endif  // COLD_TIER_BIND
+
 AddressRange SystemAlloc(size_t bytes, size_t alignment, const MemoryTag tag) {
   // If default alignment is set request the minimum alignment provided by
   // the system.
@@ -384,6 +566,10 @@ AddressRange SystemAlloc(size_t bytes, size_t alignment, const MemoryTag tag) {
     CheckAddressBits<kAddressBits>(reinterpret_cast<uintptr_t>(result) +
                                    actual_bytes - 1);
     ASSERT(GetMemoryTag(result) == tag);
+#ifdef HEAP_RANGE_FILTER
+    // Custom region factories need not carve from MmapAligned() ranges.
+    HeapRangeFilter::Add(reinterpret_cast<uintptr_t>(result), actual_bytes);
+#endif
   }
   return {result, actual_bytes};
 }
@@ -419,6 +605,49 @@ static bool ReleasePages(void* start, size_t length) {
   return false;
 }
 
+// Ignores errors: kernels before 5.4 know neither advice, and either way the
+// pages are only hinted, not released.
+ABSL_ATTRIBUTE_UNUSED static void AdvisePages(void* start, size_t length,
+                                             int advice) {
+  int saved_errno = errno;
+  int ret;
+  do {
+    ret = madvise(start, length, advice);
+  } while (ret == -1 && errno == EAGAIN);
+  errno = saved_errno;
+}
+
+void SystemMarkCold(void* start, size_t length) {
+#ifdef MADV_COLD
+  AdvisePages(start, length, MADV_COLD);
+#endif
+}
+
+void SystemPageOut(void* start, size_t length) {
+#ifdef MADV_PAGEOUT
+  AdvisePages(start, length, MADV_PAGEOUT);
+#endif
+}
+
+bool SystemCollapse(void* start, size_t length) {
+#ifdef __linux__
+  ASSERT(reinterpret_cast<uintptr_t>(start) % kHugePageSize == 0);
+  ASSERT(length % kHugePageSize == 0);
+#ifdef MADV_COLLAPSE
+  constexpr int kCollapse = MADV_COLLAPSE;
+#else
+  // The headers may predate the advice; kernels that do too reject it.
+  constexpr int kCollapse = 25;
+#endif
+  int saved_errno = errno;
+  const bool collapsed = madvise(start, length, kCollapse) == 0;
+  errno = saved_errno;
+  return collapsed;
+#else
+  return false;
+#endif
+}
+
 int SystemReleaseErrors() {
   return system_release_errors.load(std::memory_order_relaxed);
 }
@@ -493,6 +722,71 @@ void SystemBack(void* start, size_t length) {
   }
 }
 
+void SystemPopulate(void* start, size_t length) {
+#ifdef MADV_POPULATE_WRITE
+  int saved_errno = errno;
+  const bool populated = madvise(start, length, MADV_POPULATE_WRITE) == 0;
+  errno = saved_errno;
+  if (populated) return;
+#endif
+
+  static const size_t kHardwarePageSize = 4 * 1024;
+  CHECK_CONDITION(reinterpret_cast<intptr_t>(start) % kHardwarePageSize == 0);
+  CHECK_CONDITION(length % kHardwarePageSize == 0);
+  volatile char* p = static_cast<volatile char*>(start);
+  for (size_t offset = 0; offset < length; offset += kHardwarePageSize) {
+    p[offset] = 0;
+  }
+}
+
+bool SystemMovePages(void* from, void* to, size_t length) {
+#ifdef __linux__
+  {
+    // Other factories may map memory that cannot be moved like anonymous
+    // memory, such as files or hugetlbfs.
+    absl::base_internal::SpinLockHolder lock_holder(&spinlock);
+    if (region_factory != reinterpret_cast<AddressRegionFactory*>(&mmap_space)) {
+      return false;
+    }
+  }
+  ASSERT(reinterpret_cast<uintptr_t>(from) % kHugePageSize == 0);
+  ASSERT(reinterpret_cast<uintptr_t>(to) % kHugePageSize == 0);
+  ASSERT(length % kHugePageSize == 0);
+  int saved_errno = errno;
+  void* result = mremap(from, length, length,
+                        MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, to);
+  errno = saved_errno;
+  return result == to;
+#else
+  return false;
+#endif
+}
+
+int SystemCurrentNode() {
+  int node = -1;
+#ifdef __NR_getcpu
+  int saved_errno = errno;
+  unsigned cpu, current;
+  if (syscall(__NR_getcpu, &cpu, &current, nullptr) == 0) node = current;
+  errno = saved_errno;
+#endif
+  return node;
+}
+
+int SystemMemoryNode(const void* addr) {
+  int node = -1;
+#if defined(__linux__) && defined(__NR_get_mempolicy)
+  int saved_errno = errno;
+  int found;
+  if (syscall(__NR_get_mempolicy, &found, nullptr, 0, addr,
+              MPOL_F_NODE | MPOL_F_ADDR) == 0) {
+    node = found;
+  }
+  errno = saved_errno;
+#endif
+  return node;
+}
+
 AddressRegionFactory* GetRegionFactory() {
   absl::base_internal::SpinLockHolder lock_holder(&spinlock);
   InitSystemAllocatorIfNecessary();
@@ -574,6 +868,22 @@ void* MmapAligned(size_t size, size_t alignment, const MemoryTag tag) {
     }
   }();
 
+#ifdef FLAT_PAGE_INFO
+  // Normal memory comes from the reservation while it lasts.  Only the
+  // system allocator asks for it, with spinlock held.
+  if (tag == MemoryTag::kNormal) {
+    if (void* result = FlatHeapCarve(size, alignment)) {
+      if (numa_partition.has_value()) {
+        BindMemory(result, size, *numa_partition);
+      }
+#ifdef HEAP_RANGE_FILTER
+      HeapRangeFilter::Add(reinterpret_cast<uintptr_t>(result), size);
+#endif
+      return result;
+    }
+  }
+#endif
+
   if (!next_addr || next_addr & (alignment - 1) ||
       GetMemoryTag(reinterpret_cast<void*>(next_addr)) != tag ||
       GetMemoryTag(reinterpret_cast<void*>(next_addr + size - 1)) != tag) {
@@ -590,12 +900,20 @@ void* MmapAligned(size_t size, size_t alignment, const MemoryTag tag) {
       if (numa_partition.has_value()) {
         BindMemory(result, size, *numa_partition);
       }
+#ifdef COLD_TIER_BIND
+      if (tag == MemoryTag::kCold) BindColdTier(result, size);
+#endif
       // Attempt to keep the next mmap contiguous in the common case.
       next_addr += size;
       CHECK_CONDITION(kAddressBits == std::numeric_limits<uintptr_t>::digits ||
                       next_addr <= uintptr_t{1} << kAddressBits);
 
       ASSERT((reinterpret_cast<uintptr_t>(result) & (alignment - 1)) == 0);
+#ifdef HEAP_RANGE_FILTER
+      // The guarded page allocator maps its pool here, bypassing
+      // SystemAlloc().
+      HeapRangeFilter::Add(reinterpret_cast<uintptr_t>(result), size);
+#endif
       return result;
     }
     if (result == MAP_FAILED) {
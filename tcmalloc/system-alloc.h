@@ -63,6 +63,24 @@ int SystemReleaseErrors();
 // be released, partial pages will not.)
 void SystemRelease(void* start, size_t length);
 
+// Hints that the pages of the range have sat unused for a while and should
+// be the first the kernel reclaims (MADV_COLD).  Unlike SystemRelease, the
+// contents are kept: a page reclaimed this way is swapped or, if clean,
+// refaulted from zero-fill as usual.
+void SystemMarkCold(void* start, size_t length);
+
+// As SystemMarkCold, but asks the kernel to reclaim the pages right away
+// (MADV_PAGEOUT).
+void SystemPageOut(void* start, size_t length);
+
+// Asks the kernel to back the range with transparent hugepages right away
+// (MADV_COLLAPSE), as khugepaged would in its own time.  The contents are
+// kept.  The call is synchronous and may copy every page, so it should be
+// made without locks.  Returns false if the kernel did not collapse the
+// range, as before 6.1.
+// REQUIRES: [start, start + length) is aligned to hugepages.
+bool SystemCollapse(void* start, size_t length);
+
 // This call is the inverse of SystemRelease: the pages in this range
 // are in use and should be faulted in.  (In principle this is a
 // best-effort hint, but in practice we will unconditionally fault the
@@ -70,6 +88,28 @@ void SystemRelease(void* start, size_t length);
 // REQUIRES: [start, start + length) is a range aligned to 4KiB boundaries.
 void SystemBack(void* start, size_t length);
 
+// Faults in every page of the range, which must be fresh from SystemAlloc()
+// with no data on it yet: with MADV_POPULATE_WRITE where the kernel and
+// headers have it (5.14 and later), and by writing a zero to each page
+// otherwise.
+// REQUIRES: [start, start + length) is a range aligned to 4KiB boundaries.
+void SystemPopulate(void* start, size_t length);
+
+// Moves the pages backing [from, from + length) to [to, to + length) without
+// copying them, by moving their page tables with mremap(MREMAP_DONTUNMAP).
+// The source range stays mapped, but reads as zero and is unbacked, as after
+// SystemRelease().  The previous pages of the destination are dropped.
+// Returns false, changing neither range, if the kernel cannot (before 5.7)
+// or the memory does not come from the default region factory.
+// REQUIRES: both ranges are aligned to hugepages, do not overlap, and were
+// allocated by SystemAlloc() with the same tag.
+bool SystemMovePages(void* from, void* to, size_t length);
+
+// Returns the NUMA node of the CPU the caller runs on, and of the page at
+// addr, or -1 if the kernel does not tell.  Each is a system call.
+int SystemCurrentNode();
+int SystemMemoryNode(const void* addr);
+
 // Returns the current address region factory.
 AddressRegionFactory* GetRegionFactory();
 
@@ -83,6 +123,38 @@ void SetRegionFactory(AddressRegionFactory* factory);
 // REQUIRES: size <= kTagMask
 void* MmapAligned(size_t size, size_t alignment, MemoryTag tag);
 
+// Maps size bytes of normal tagged address space, aligned to alignment,
+// readable and writable but with no memory or swap reserved for them: pages
+// are backed as they are touched and unbacked by SystemRelease().  The range
+// is heap memory as far as the HeapRangeFilter is concerned, but is not
+// carved by SystemAlloc().  Returns nullptr on failure.
+void* SystemReserve(size_t size, size_t alignment);
+
+// Binds [base, base + size) to the NUMA nodes of `partition`, as the heap
+// memory of that partition is bound.  Does nothing unless NUMA awareness is
+// enabled.
+void BindMemory(void* base, size_t size, size_t partition);
+
+#ifdef COLD_TIER_BIND
+// The NUMA nodes of the slow memory tier, such as CXL attached memory, as a
+// mask: the node list in TCMALLOC_COLD_TIER_NODES ("2-3" or "4,6"), or zero
+// if it is unset or unparsable.
+uint64_t ColdTierNodes();
+
+// Whether the escape chunk regions go to the cold tier as well, as asked by
+// TCMALLOC_COLD_TIER_ESCAPES=1.  Chunks are only walked when an object with
+// escapes is freed or moved.
+bool ColdTierEscapes();
+
+// Asks the kernel to place [base, base + size) on the cold tier nodes,
+// preferring rather than requiring them.  Does nothing if ColdTierNodes()
+// is zero; a failure is logged and leaves the default policy.
+void BindColdTier(void* base, size_t size);
+
+// Bytes of address space BindColdTier() has placed.
+size_t ColdTierBoundBytes();
+#endif
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
@@ -27,6 +27,7 @@
 #include "gtest/gtest.h"
 #include "absl/strings/str_format.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/heap_range_filter.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/malloc_extension.h"
 
@@ -48,6 +49,11 @@ class MmapAlignedTest : public testing::TestWithParam<size_t> {
       EXPECT_EQ(IsSampledMemory(p), tag == MemoryTag::kSampled);
       EXPECT_EQ(GetMemoryTag(p), tag);
       EXPECT_EQ(GetMemoryTag(static_cast<char*>(p) + size - 1), tag);
+#ifdef HEAP_RANGE_FILTER
+      EXPECT_TRUE(HeapRangeFilter::MayContain(reinterpret_cast<uintptr_t>(p)));
+      EXPECT_TRUE(HeapRangeFilter::MayContain(
+          reinterpret_cast<uintptr_t>(p) + size - 1));
+#endif
       EXPECT_EQ(munmap(p, size), 0);
     }
   }
@@ -67,6 +73,28 @@ TEST_F(MmapAlignedTest, LargeSizeSmallAlignment) {
   MmapAndCheck(uintptr_t{1} << kTagShift, kPageSize);
 }
 
+// Runs before InvokedTest installs a region factory SystemMovePages() does
+// not move pages of.
+TEST(Basic, MovePages) {
+  constexpr size_t kLength = 2 * kHugePageSize;
+  AddressRange r = SystemAlloc(2 * kLength, kHugePageSize, MemoryTag::kNormal);
+  ASSERT_NE(r.ptr, nullptr);
+  char* from = static_cast<char*>(r.ptr);
+  char* to = from + kLength;
+  for (size_t i = 0; i < kLength; i += kPageSize) {
+    from[i] = static_cast<char>(i / kPageSize + 1);
+  }
+  to[0] = 'x';
+
+  if (!SystemMovePages(from, to, kLength)) {
+    GTEST_SKIP() << "mremap(MREMAP_DONTUNMAP) is not supported";
+  }
+  for (size_t i = 0; i < kLength; i += kPageSize) {
+    EXPECT_EQ(to[i], static_cast<char>(i / kPageSize + 1));
+    EXPECT_EQ(from[i], 0);
+  }
+}
+
 // Was SimpleRegion::Alloc invoked at least once?
 static bool simple_region_alloc_invoked = false;
 
@@ -75,12 +75,12 @@
 #include "absl/base/config.h"
 #include "absl/base/const_init.h"
 #include "absl/base/dynamic_annotations.h"
+#include "absl/base/internal/cycleclock.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/internal/sysinfo.h"
 #include "absl/base/macros.h"
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
-#include "absl/debugging/stacktrace.h"
 #include "absl/memory/memory.h"
 #include "absl/numeric/bits.h"
 #include "absl/status/status.h"
@@ -89,17 +89,30 @@
 #include "absl/strings/numbers.h"
 #include "absl/strings/strip.h"
 #include "tcmalloc/allocation_sample.h"
+#include "tcmalloc/allocation_trace.h"
+#include "tcmalloc/callsite_profile.h"
 #include "tcmalloc/central_freelist.h"
+#include "tcmalloc/chunk_cache.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/continuous_profile.h"
 #include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/deterministic.h"
+#include "tcmalloc/escape_buffer.h"
+#include "tcmalloc/escape_location.h"
+#include "tcmalloc/escape_span_cache.h"
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/global_stats.h"
 #include "tcmalloc/guarded_page_allocator.h"
+#include "tcmalloc/heap_partition.h"
+#include "tcmalloc/inline_check.h"
+#include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/linked_list.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/optimization.h"
 #include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/internal/stack_unwinder.h"
 #include "tcmalloc/internal_malloc_extension.h"
+#include "tcmalloc/internal_malloc_tracing_extension.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/malloc_tracing_extension.h"
 #include "tcmalloc/new_extension.h"
@@ -109,8 +122,15 @@
 #include "tcmalloc/pagemap.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/pointer_tag.h"
+#include "tcmalloc/poison.h"
+#include "tcmalloc/protection_report.h"
+#include "tcmalloc/protection_timing.h"
+#include "tcmalloc/quarantine.h"
 #include "tcmalloc/sampled_allocation.h"
 #include "tcmalloc/sampler.h"
+#include "tcmalloc/sampling_autotune.h"
+#include "tcmalloc/scrub.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stack_trace_table.h"
 #include "tcmalloc/static_vars.h"
@@ -118,6 +138,7 @@
 #include "tcmalloc/system-alloc.h"
 #include "tcmalloc/tcmalloc_policy.h"
 #include "tcmalloc/thread_cache.h"
+#include "tcmalloc/trace_capture.h"
 #include "tcmalloc/transfer_cache.h"
 #include "tcmalloc/transfer_cache_stats.h"
 
@@ -125,10 +146,6 @@
 #include <malloc.h>
 #endif
 
-#ifdef JEMALLOC
-#include "tcmalloc/jemalloc.h"
-#endif
-
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -223,8 +240,124 @@ static std::unique_ptr<const ProfileBase> DumpHeapProfile() {
   return profile;
 }
 
+// Defined with the escape tables, in the anonymous namespace below.
+namespace {
+static size_t count_span_escapes(Span* span);
+}  // namespace
+
+// The escape profile weighs each sampled object by the escapes recorded for
+// it.  A sampled object has its span to itself, so these are the escapes of
+// the whole span.  As in DumpFragmentationProfile(), the per-sample lock held
+// by Iterate() keeps the object, and so its escape table, from being freed.
+static std::unique_ptr<const ProfileBase> DumpEscapeProfile() {
+  auto profile = std::make_unique<StackTraceTable>(ProfileType::kEscapes);
+  tc_globals.sampled_allocation_recorder().Iterate(
+      [&](const SampledAllocation& sampled_allocation) {
+        const StackTrace& t = sampled_allocation.sampled_stack;
+        Span* span = tc_globals.pagemap().GetDescriptor(
+            PageIdContaining(t.span_start_address));
+        if (span == nullptr) {
+          ASSERT(span != nullptr);
+          return;
+        }
+        const size_t escapes = count_span_escapes(span);
+        if (escapes != 0) profile->AddEscapeTrace(1.0, t, escapes);
+      });
+  return profile;
+}
+
+// The age profile buckets each live sampled object by how long ago it was
+// allocated, as of one clock reading for the whole profile.
+static std::unique_ptr<const ProfileBase> DumpAgeProfile() {
+  auto profile = std::make_unique<StackTraceTable>(ProfileType::kAges);
+  const absl::Time now = absl::Now();
+  tc_globals.sampled_allocation_recorder().Iterate(
+      [&](const SampledAllocation& sampled_allocation) {
+        const StackTrace& t = sampled_allocation.sampled_stack;
+        profile->AddAgeTrace(1.0, t, now - t.allocation_time);
+      });
+  return profile;
+}
+
 ABSL_CONST_INIT static AllocationSampleList allocation_samples_;
 
+// Renders the stats like TCMalloc_Internal_GetStats(), walking the caches
+// and the page heap.
+static size_t render_stats(char* buffer, size_t buffer_length) {
+  Printer printer(buffer, buffer_length);
+  if (buffer_length < 10000) {
+    DumpStats(&printer, 1);
+  } else {
+    DumpStats(&printer, 2);
+  }
+
+  printer.printf("\nLow-level allocator stats:\n");
+  printer.printf("Memory Release Failures: %d\n", SystemReleaseErrors());
+
+  size_t n = printer.SpaceRequired();
+
+  size_t bytes_remaining = buffer_length > n ? buffer_length - n : 0;
+  if (bytes_remaining > 0) {
+    n += GetRegionFactory()->GetStats(
+        absl::Span<char>(buffer + n, bytes_remaining));
+  }
+
+  return n;
+}
+
+#ifdef STATS_SNAPSHOT
+// The last complete rendering of the stats, replaced by the background
+// thread every stats snapshot period.  Scrapes copy it under
+// stats_snapshot_lock, which no allocation path takes, instead of walking
+// the caches and the page heap under pageheap_lock themselves.
+ABSL_CONST_INIT static absl::base_internal::SpinLock stats_snapshot_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+static std::string* stats_snapshot ABSL_GUARDED_BY(stats_snapshot_lock);
+static absl::Time stats_snapshot_time ABSL_GUARDED_BY(stats_snapshot_lock);
+
+void RefreshStatsSnapshot() {
+  // Render into a fresh string outside the lock; the residency lookups and
+  // the walks under pageheap_lock all happen here, on the background
+  // thread.
+  std::string* fresh = new std::string;
+  for (size_t size = size_t{1} << 18;; size *= 2) {
+    fresh->resize(size - 1);
+    const size_t n = render_stats(&*fresh->begin(), size - 1);
+    if (n < size - 1 || size >= (size_t{1} << 22)) {
+      fresh->resize(std::min(n, size - 2));
+      break;
+    }
+  }
+  std::string* old;
+  {
+    absl::base_internal::SpinLockHolder h(&stats_snapshot_lock);
+    old = stats_snapshot;
+    stats_snapshot = fresh;
+    stats_snapshot_time = absl::Now();
+  }
+  delete old;
+}
+
+// Copies the snapshot into buffer, after a line giving its age.  Returns
+// the length of the whole text, or 0 if no snapshot was taken yet.
+static size_t serve_stats_snapshot(char* buffer, size_t buffer_length) {
+  absl::base_internal::SpinLockHolder h(&stats_snapshot_lock);
+  if (stats_snapshot == nullptr) return 0;
+  Printer printer(buffer, buffer_length);
+  printer.printf("Stats snapshot taken %.3f seconds ago\n",
+                 absl::ToDoubleSeconds(absl::Now() - stats_snapshot_time));
+  const size_t header = printer.SpaceRequired();
+  const size_t n = header + stats_snapshot->size();
+  if (header < buffer_length) {
+    const size_t copied =
+        std::min(stats_snapshot->size(), buffer_length - header - 1);
+    memcpy(buffer + header, stats_snapshot->data(), copied);
+    buffer[header + copied] = '\0';
+  }
+  return n;
+}
+#endif  // STATS_SNAPSHOT
+
 extern "C" void MallocExtension_Internal_GetStats(std::string* ret) {
   size_t shift = std::max<size_t>(18, absl::bit_width(ret->capacity()) - 1);
   for (; shift < 22; shift++) {
@@ -245,27 +378,31 @@ extern "C" void MallocExtension_Internal_GetStats(std::string* ret) {
   }
 }
 
-extern "C" size_t TCMalloc_Internal_GetStats(char* buffer,
-                                             size_t buffer_length) {
-  Printer printer(buffer, buffer_length);
-  if (buffer_length < 10000) {
-    DumpStats(&printer, 1);
-  } else {
-    DumpStats(&printer, 2);
+extern "C" void MallocExtension_Internal_GetStatsInPbtxtString(
+    std::string* ret) {
+  // Level 2 adds a region per size class, so allow more than GetStats().
+  size_t shift = std::max<size_t>(18, absl::bit_width(ret->capacity()) - 1);
+  for (; shift < 24; shift++) {
+    const size_t size = 1 << shift;
+    ret->resize(size - 1);
+    size_t written_size =
+        MallocExtension_Internal_GetStatsInPbtxt(&*ret->begin(), size - 1);
+    if (written_size < size - 1) {
+      ret->resize(written_size);
+      break;
+    }
   }
+}
 
-  printer.printf("\nLow-level allocator stats:\n");
-  printer.printf("Memory Release Failures: %d\n", SystemReleaseErrors());
-
-  size_t n = printer.SpaceRequired();
-
-  size_t bytes_remaining = buffer_length > n ? buffer_length - n : 0;
-  if (bytes_remaining > 0) {
-    n += GetRegionFactory()->GetStats(
-        absl::Span<char>(buffer + n, bytes_remaining));
+extern "C" size_t TCMalloc_Internal_GetStats(char* buffer,
+                                             size_t buffer_length) {
+#ifdef STATS_SNAPSHOT
+  // Until the background thread has taken one, render them here.
+  if (const size_t n = serve_stats_snapshot(buffer, buffer_length); n != 0) {
+    return n;
   }
-
-  return n;
+#endif
+  return render_stats(buffer, buffer_length);
 }
 
 extern "C" const ProfileBase* MallocExtension_Internal_SnapshotCurrent(
@@ -277,6 +414,10 @@ extern "C" const ProfileBase* MallocExtension_Internal_SnapshotCurrent(
       return DumpFragmentationProfile().release();
     case ProfileType::kPeakHeap:
       return tc_globals.peak_heap_tracker().DumpSample().release();
+    case ProfileType::kEscapes:
+      return DumpEscapeProfile().release();
+    case ProfileType::kAges:
+      return DumpAgeProfile().release();
     default:
       return nullptr;
   }
@@ -288,7 +429,7 @@ MallocExtension_Internal_StartAllocationProfiling() {
 }
 
 MallocExtension::Ownership GetOwnership(const void* ptr) {
-  const PageId p = PageIdContaining(ptr);
+  const PageId p = PageIdContaining(StripPointerTag(ptr));
   return tc_globals.pagemap().GetDescriptor(p)
              ? MallocExtension::Ownership::kOwned
              : MallocExtension::Ownership::kNotOwned;
@@ -393,9 +534,9 @@ static ABSL_ATTRIBUTE_NOINLINE size_t nallocx_slow(size_t size, int flags) {
   if (ABSL_PREDICT_TRUE(tc_globals.sizemap().GetSizeClass(
           CppPolicy().AlignAs(align), size, &size_class))) {
     ASSERT(size_class != 0);
-    return tc_globals.sizemap().class_to_size(size_class);
+    return tc_globals.sizemap().class_to_size(size_class) - kPaddingBytes;
   } else {
-    return BytesToLengthCeil(size).in_bytes();
+    return BytesToLengthCeil(size).in_bytes() - kPaddingBytes;
   }
 }
 
@@ -405,9 +546,7 @@ static ABSL_ATTRIBUTE_NOINLINE size_t nallocx_slow(size_t size, int flags) {
 // nallocx is a malloc extension originally implemented by jemalloc:
 // http://www.unix.com/man-page/freebsd/3/nallocx/
 extern "C" size_t nallocx(size_t size, int flags) noexcept {
-#ifdef ENABLE_PROTECTION
-  size++;
-#endif
+  size += kPaddingBytes;
   if (ABSL_PREDICT_FALSE(!tc_globals.IsInited() || flags != 0)) {
     return nallocx_slow(size, flags);
   }
@@ -415,9 +554,9 @@ extern "C" size_t nallocx(size_t size, int flags) noexcept {
   if (ABSL_PREDICT_TRUE(
           tc_globals.sizemap().GetSizeClass(CppPolicy(), size, &size_class))) {
     ASSERT(size_class != 0);
-    return tc_globals.sizemap().class_to_size(size_class);
+    return tc_globals.sizemap().class_to_size(size_class) - kPaddingBytes;
   } else {
-    return BytesToLengthCeil(size).in_bytes();
+    return BytesToLengthCeil(size).in_bytes() - kPaddingBytes;
   }
 }
 
@@ -426,6 +565,38 @@ extern "C" MallocExtension::Ownership MallocExtension_Internal_GetOwnership(
   return GetOwnership(ptr);
 }
 
+extern "C" void MallocExtension_Internal_GetProtectionReports(
+    std::vector<MallocExtension::ProtectionReport>* ret) {
+  ProtectionReports::Get(ret);
+}
+
+#ifdef CONTINUOUS_PROFILE
+extern "C" void MallocExtension_Internal_StartContinuousProfile(
+    MallocExtension::ContinuousProfileSink sink) {
+  ContinuousProfiler::Start(std::move(sink));
+}
+
+extern "C" void MallocExtension_Internal_StopContinuousProfile() {
+  ContinuousProfiler::Stop();
+}
+
+void EmitContinuousProfile() {
+  if (!ContinuousProfiler::Rotate()) return;
+  // As in DumpEscapeProfile(), a sampled object has its span to itself, and
+  // Iterate() keeps it from being freed while its escapes are counted.
+  tc_globals.sampled_allocation_recorder().Iterate(
+      [](const SampledAllocation& sampled_allocation) {
+        const StackTrace& t = sampled_allocation.sampled_stack;
+        Span* span = tc_globals.pagemap().GetDescriptor(
+            PageIdContaining(t.span_start_address));
+        if (span == nullptr) return;
+        const size_t escapes = count_span_escapes(span);
+        if (escapes != 0) ContinuousProfiler::RecordEscapes(t, escapes);
+      });
+  ContinuousProfiler::Emit();
+}
+#endif  // CONTINUOUS_PROFILE
+
 extern "C" void MallocExtension_Internal_GetProperties(
     std::map<std::string, MallocExtension::Property>* result) {
   TCMallocStats stats;
@@ -508,6 +679,60 @@ extern "C" void MallocExtension_Internal_GetProperties(
   WalkExperiments([&](absl::string_view name, bool active) {
     (*result)[absl::StrCat("tcmalloc.experiment.", name)].value = active;
   });
+
+  // Escape metadata
+  (*result)["safe_tcmalloc.escape_metadata_bytes"].value =
+      stats.escape_metadata_bytes;
+  (*result)["safe_tcmalloc.metadata_hugepage_backed_bytes"].value =
+      stats.metadata_hugepage_backed_bytes;
+  (*result)["safe_tcmalloc.escape_tables"].value =
+      stats.escape_table_stats.in_use;
+  (*result)["safe_tcmalloc.escape_chunks"].value =
+      stats.escape_chunk_stats.in_use - stats.escape_chunk_cached;
+  (*result)["safe_tcmalloc.escape_chunks_free"].value =
+      stats.escape_chunk_stats.total - stats.escape_chunk_stats.in_use +
+      stats.escape_chunk_cached;
+  size_t escape_table_bytes = 0;
+  for (size_t cls = 0; cls < kNumEscapeTableClasses; ++cls) {
+    escape_table_bytes += stats.escape_table_class_stats[cls].total *
+                          EscapeTableClassSize(cls) * sizeof(EscapeHead);
+  }
+  (*result)["safe_tcmalloc.escape_table_bytes"].value = escape_table_bytes;
+  (*result)["safe_tcmalloc.escape_buffers"].value =
+      stats.escape_buffer_stats.in_use;
+#ifdef ENABLE_STATISTIC
+  // Event counters
+  (*result)["safe_tcmalloc.escape_count"].value = tc_globals.escape_cnt.value();
+  (*result)["safe_tcmalloc.escape_valid_count"].value =
+      tc_globals.escape_valid_cnt.value();
+  (*result)["safe_tcmalloc.escape_heap_count"].value =
+      tc_globals.escape_heap_cnt.value();
+  (*result)["safe_tcmalloc.escape_final_count"].value =
+      tc_globals.escape_final_cnt.value();
+  (*result)["safe_tcmalloc.check_gep_count"].value =
+      tc_globals.gep_check_cnt.value();
+  (*result)["safe_tcmalloc.check_gep_invalid_count"].value =
+      tc_globals.gep_check_invalid_cnt.value();
+  (*result)["safe_tcmalloc.check_bc_count"].value =
+      tc_globals.bc_check_cnt.value();
+  (*result)["safe_tcmalloc.check_bc_invalid_count"].value =
+      tc_globals.bc_check_invalid_cnt.value();
+  (*result)["safe_tcmalloc.check_range_count"].value =
+      tc_globals.get_range_cnt.value();
+  (*result)["safe_tcmalloc.check_range_invalid_count"].value =
+      tc_globals.get_range_invalid_cnt.value();
+  (*result)["safe_tcmalloc.check_invalid_estimate"].value =
+      tc_globals.check_invalid_estimate.value();
+  {
+    const auto flushes = tc_globals.escape_flush_tracker().totals();
+    (*result)["safe_tcmalloc.escape_flushes"].value = flushes.flushes;
+    (*result)["safe_tcmalloc.escape_flush_records"].value = flushes.records;
+    (*result)["safe_tcmalloc.escape_flush_committed"].value =
+        flushes.committed;
+    (*result)["safe_tcmalloc.escape_flush_stale"].value = flushes.stale;
+    (*result)["safe_tcmalloc.escape_flush_cycles"].value = flushes.cycles;
+  }
+#endif
 }
 
 extern "C" size_t MallocExtension_Internal_ReleaseCpuMemory(int cpu) {
@@ -522,10 +747,141 @@ extern "C" size_t MallocExtension_Internal_ReleaseCpuMemory(int cpu) {
 // Helpers for the exported routines below
 //-------------------------------------------------------------------
 
-ABSL_CONST_INIT static thread_local Sampler thread_sampler_
+// The per-thread state every malloc, free, escape and check reads, packed
+// into one initial-exec block at the start of its own cache lines: the fast
+// paths address all of it from the thread pointer at fixed offsets, and a
+// call touches one or two lines rather than a line per variable.  Members a
+// configuration does not use are left out; the larger per-thread buffers
+// below stay outside so they do not dilute it.
+struct alignas(ABSL_CACHELINE_SIZE) ThreadHotState {
+  Sampler sampler;
+
+  // Escapes recorded by this thread that have not been committed to the
+  // span escape lists yet.  Lazily created by GetEscapeBuffer().
+  EscapeBuffer* escape_buffer = nullptr;
+  // The escape_flush_epoch this thread last saw, see escape_flush_due().
+  uint32_t escape_flush_epoch = 0;
+
+  // Checks this thread skips before it runs the next one under
+  // ProtectionPolicy::kSampled, and the length of the current interval.
+  int64_t check_countdown = 0;
+  int64_t check_interval = 1;
+  uint64_t check_rng = 0;
+
+#ifdef ESCAPE_LOCATION_CLASSES
+  // The bounds of this thread's stack, looked up on its first escape.  They
+  // stay empty if the lookup fails.
+  uintptr_t stack_lo = 0;
+  uintptr_t stack_hi = 0;
+  bool stack_looked_up = false;
+#endif
+
+#ifdef HEAP_PARTITIONS
+  // The heap partition this thread allocates in, set by ScopedHeapPartition.
+  uint16_t heap_partition = 0;
+#endif
+};
+
+ABSL_CONST_INIT static thread_local ThreadHotState thread_state_
+    ABSL_ATTRIBUTE_INITIAL_EXEC;
+
+inline Sampler* GetThreadSampler() { return &thread_state_.sampler; }
+
+#ifdef THREAD_ALLOCATION_STATS
+// What this thread allocated, freed, escaped and checked, see
+// MallocExtension::GetThreadAllocationStats().  Only the owning thread
+// writes or reads it, so the counters are plain integers.
+ABSL_CONST_INIT static thread_local MallocExtension::ThreadAllocationStats
+    thread_allocation_stats_ ABSL_ATTRIBUTE_INITIAL_EXEC;
+#define TCMALLOC_COUNT_THREAD(field, n) \
+  (thread_allocation_stats_.field += (n))
+#else
+#define TCMALLOC_COUNT_THREAD(field, n) ((void)0)
+#endif
+
+#ifdef HEAP_PARTITIONS
+// The bytes and limits of every heap partition.
+ABSL_CONST_INIT static HeapPartitions heap_partitions_;
+#endif
+
+#ifdef ESCAPE_LOCATION_CLASSES
+// Escapes this thread recorded through slots of its own stack, see
+// stage_stack_escape().
+ABSL_CONST_INIT static thread_local StackEscapeBuffer thread_stack_escapes_
+    ABSL_ATTRIBUTE_INITIAL_EXEC;
+#endif
+
+#ifdef CHUNK_CACHE
+// Chunks recently resolved by this thread's bounds checks.
+ABSL_CONST_INIT static thread_local ChunkCache thread_chunk_cache_
     ABSL_ATTRIBUTE_INITIAL_EXEC;
+#endif
+
+#ifdef ESCAPE_SPAN_CACHE
+// Spans this thread's recent escapes pointed into.
+ABSL_CONST_INIT static thread_local EscapeSpanCache thread_escape_spans_
+    ABSL_ATTRIBUTE_INITIAL_EXEC;
+#endif
 
-inline Sampler* GetThreadSampler() { return &thread_sampler_; }
+// Draws the next sampling interval, uniform in [1, 2 * period - 1] so that
+// it averages to the period without aliasing with loops of that length.
+static ABSL_ATTRIBUTE_NOINLINE int64_t next_check_interval() {
+  const int64_t period = Parameters::protection_sample_period();
+  if (period <= 1) return 1;
+  if (ABSL_PREDICT_FALSE(thread_state_.check_rng == 0)) {
+    // Seeded from the address of the thread-local, which differs per thread.
+    thread_state_.check_rng =
+        reinterpret_cast<uintptr_t>(&thread_state_.check_rng) | 1;
+  }
+  thread_state_.check_rng = thread_state_.check_rng * 6364136223846793005ull +
+                            1442695040888963407ull;
+  return 1 + static_cast<int64_t>((thread_state_.check_rng >> 33) %
+                                  static_cast<uint64_t>(2 * period - 1));
+}
+
+// Number of calls of an out-of-line check this call stands for: 0 if the
+// protection policy skips it, 1 if every check runs, and the length of the
+// interval that just ended under ProtectionPolicy::kSampled, so the checks
+// found invalid can be scaled up to the ones that would have been.  The
+// policies that run every check come first, so the common case is a single
+// compare of a global that never changes.
+static inline int64_t ABSL_ATTRIBUTE_ALWAYS_INLINE protection_check_weight() {
+  const MallocExtension::ProtectionPolicy policy =
+      Parameters::protection_policy();
+  if (ABSL_PREDICT_TRUE(policy <=
+                        MallocExtension::ProtectionPolicy::kReportOnly)) {
+    return 1;
+  }
+  if (policy == MallocExtension::ProtectionPolicy::kDisabled) return 0;
+  if (ABSL_PREDICT_TRUE(--thread_state_.check_countdown > 0)) return 0;
+  const int64_t weight = thread_state_.check_interval;
+  thread_state_.check_interval = next_check_interval();
+  thread_state_.check_countdown = thread_state_.check_interval;
+  return weight;
+}
+
+// Extrapolates a check found invalid to the calls the sampling skipped.
+static inline int ABSL_ATTRIBUTE_ALWAYS_INLINE
+count_invalid_check(int result, int64_t weight, const void* base = nullptr,
+                    const void* ptr = nullptr, size_t size = 0) {
+#ifdef ENABLE_STATISTIC
+  if (ABSL_PREDICT_FALSE(result != 0)) {
+    tc_globals.check_invalid_estimate.Add(weight);
+  }
+#endif
+#ifdef TRACE_CAPTURE
+  if (ABSL_PREDICT_FALSE(result != 0)) {
+    TCMALLOC_CAPTURE_EVENT(kCheckFailure, base, ptr, size);
+  }
+#endif
+  return result;
+}
+
+// Whether escapes are recorded; they are under every policy but kDisabled.
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE protection_escapes_enabled() {
+  return ABSL_PREDICT_TRUE(Parameters::protection_policy() !=
+                           MallocExtension::ProtectionPolicy::kDisabled);
+}
 
 enum class Hooks { RUN, NO };
 
@@ -537,34 +893,36 @@ namespace {
 inline void SetCapacity(size_t size, std::nullptr_t) {}
 inline void SetCapacity(size_t size, size_t* psize) { *psize = size; }
 
-// Sets `*psize` to the size for the size class in `size_class`,
+// Sets `*psize` to the size for the size class in `size_class`, less the
+// padding byte,
 inline void SetClassCapacity(size_t size, std::nullptr_t) {}
 inline void SetClassCapacity(uint32_t size_class, size_t* psize) {
-  *psize = tc_globals.sizemap().class_to_size(size_class);
+  *psize = tc_globals.sizemap().class_to_size(size_class) - kPaddingBytes;
 }
 
-// Sets `*psize` to the size for the size class in `size_class` if `ptr` is not
-// null, else `*psize` is set to 0. This method is overloaded for `nullptr_t`
-// below, allowing the compiler to optimize code between regular and size
-// returning allocation operations.
+// Sets `*psize` to the size for the size class in `size_class`, less the
+// padding byte, if `ptr` is not null, else `*psize` is set to 0. This method
+// is overloaded for `nullptr_t` below, allowing the compiler to optimize code
+// between regular and size returning allocation operations.
 inline void SetClassCapacity(const void*, uint32_t, std::nullptr_t) {}
 inline void SetClassCapacity(const void* ptr, uint32_t size_class,
                              size_t* psize) {
   if (ABSL_PREDICT_TRUE(ptr != nullptr)) {
-    *psize = tc_globals.sizemap().class_to_size(size_class);
+    *psize = tc_globals.sizemap().class_to_size(size_class) - kPaddingBytes;
   } else {
     *psize = 0;
   }
 }
 
 // Sets `*psize` to the size in pages corresponding to the requested size in
-// `size` if `ptr` is not null, else `*psize` is set to 0. This method is
-// overloaded for `nullptr_t` below, allowing the compiler to optimize code
-// between regular and size returning allocation operations.
+// `size`, less the padding byte, if `ptr` is not null, else `*psize` is set
+// to 0. This method is overloaded for `nullptr_t` below, allowing the
+// compiler to optimize code between regular and size returning allocation
+// operations.
 inline void SetPagesCapacity(const void*, Length, std::nullptr_t) {}
 inline void SetPagesCapacity(const void* ptr, Length size, size_t* psize) {
   if (ABSL_PREDICT_TRUE(ptr != nullptr)) {
-    *psize = size.in_bytes();
+    *psize = size.in_bytes() - kPaddingBytes;
   } else {
     *psize = 0;
   }
@@ -592,6 +950,15 @@ static ABSL_ATTRIBUTE_SECTION(google_malloc) void invoke_delete_hooks_and_free(
   return F(ptr, p);
 }
 
+// Runs the delete hooks of an object whose release free() defers to a
+// queue, on the freeing thread, as FreeSmall() would have.  The batch that
+// later hands the object back frees it with Hooks::NO.
+static inline void invoke_deferred_delete_hooks() {
+  if (ABSL_PREDICT_FALSE(!GetThreadSampler()->IsOnFastPath())) {
+    GetThreadSampler()->UpdateFastPathState();
+  }
+}
+
 // Helper for do_free_with_size_class
 template <Hooks hooks_state>
 static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void FreeSmall(void* ptr,
@@ -601,6 +968,10 @@ static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void FreeSmall(void* ptr,
   } else {
     ASSERT(IsColdMemory(ptr));
   }
+#ifdef SCRUB_ON_FREE
+  // The caches keep no state per object, so only clean ones go into them.
+  Scrub(ptr, tc_globals.sizemap().class_to_size(size_class));
+#endif
   if (ABSL_PREDICT_FALSE(!GetThreadSampler()->IsOnFastPath())) {
     // Take the slow path.
     invoke_delete_hooks_and_free<FreeSmallSlow, hooks_state>(ptr, size_class);
@@ -673,6 +1044,52 @@ static void* TrySampleGuardedAllocation(size_t size, size_t alignment,
   return nullptr;
 }
 
+#ifdef LIFETIME_PROTECTION
+// Sampled objects freed sooner than this after their allocation count as
+// short-lived for their allocation site; the lifetime-based allocator uses
+// the same threshold by default.
+constexpr absl::Duration kShortLivedThreshold = absl::Milliseconds(500);
+
+// Looks up the lifetime statistics of the stack of a sampled allocation, and
+// marks the allocation short-lived if they predict so with high certainty.
+static void predict_lifetime(SampledAllocation* sampled_allocation) {
+  const StackTrace& stack = sampled_allocation->sampled_stack;
+  LifetimeDatabase::Key key =
+      LifetimeDatabase::Key::FromStack(stack.stack, stack.depth);
+  LifetimeStats* lifetime =
+      tc_globals.lifetime_database().LookupOrAddLifetimeStats(&key);
+  bool short_lived;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    short_lived = lifetime->Predict(LifetimeStats::Certainty::kHighCertainty) ==
+                  LifetimeStats::Prediction::kShortLived;
+  }
+  sampled_allocation->lifetime = lifetime;
+  sampled_allocation->short_lived = short_lived;
+#ifdef ENABLE_STATISTIC
+  if (short_lived) tc_globals.short_lived_sampled_cnt.Add(1);
+#endif
+}
+
+// Updates the lifetime statistics of the site of a sampled allocation with
+// the lifetime of the object, which is being freed, and drops its reference
+// to them.
+static void record_lifetime(SampledAllocation* sampled_allocation) {
+  LifetimeStats* lifetime = sampled_allocation->lifetime;
+  if (lifetime == nullptr) return;
+  sampled_allocation->lifetime = nullptr;
+  const bool short_lived =
+      absl::Now() - sampled_allocation->sampled_stack.allocation_time <
+      kShortLivedThreshold;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    lifetime->Update(short_lived ? LifetimeStats::Prediction::kShortLived
+                                 : LifetimeStats::Prediction::kLongLived);
+  }
+  tc_globals.lifetime_database().RemoveLifetimeStatsReference(lifetime);
+}
+#endif
+
 // Performs sampling for already occurred allocation of object.
 //
 // For very small object sizes, object is used as 'proxy' and full
@@ -702,6 +1119,9 @@ static void* SampleifyAllocation(Policy policy, size_t requested_size,
                                  Span* span, size_t* capacity) {
   CHECK_CONDITION((size_class != 0 && obj != nullptr && span == nullptr) ||
                   (size_class == 0 && obj == nullptr && span != nullptr));
+#ifdef SAMPLING_AUTOTUNE
+  SamplingAutotuner::ScopedCost sampling_cost;
+#endif
 
   void* proxy = nullptr;
   void* guarded_alloc = nullptr;
@@ -727,16 +1147,18 @@ static void* SampleifyAllocation(Policy policy, size_t requested_size,
              requested_size, requested_alignment, num_pages))) {
       ASSERT(IsSampledMemory(guarded_alloc));
       const PageId p = PageIdContaining(guarded_alloc);
+#ifdef SPAN_CACHE
+      // The page map leaves of guarded pages exist since the guarded page
+      // allocator's Init(), so nothing here needs pageheap_lock.
+      span = Span::NewCached(p, num_pages);
+#else
       absl::base_internal::SpinLockHolder h(&pageheap_lock);
       span = Span::New(p, num_pages);
+#endif
       for (Length i=Length(0); i<num_pages; ++i) {
         tc_globals.pagemap().Set(p+i, span);
       }
 
-      size_t span_size =
-        Length(tc_globals.sizemap().class_to_pages(size_class)).in_bytes();
-      span->obj_size = allocated_size / 8;
-      span->objects_per_span = span_size / allocated_size;
       // If we report capacity back from a size returning allocation, we can not
       // report the allocated_size, as we guard the size to 'requested_size',
       // and we maintain the invariant that GetAllocatedSize() must match the
@@ -745,7 +1167,7 @@ static void* SampleifyAllocation(Policy policy, size_t requested_size,
       if (capacity) allocated_size = requested_size;
     } else if ((span = tc_globals.page_allocator().New(
                     num_pages, 1, MemoryTag::kSampled)) == nullptr) {
-      if (capacity) *capacity = allocated_size;
+      if (capacity) *capacity = allocated_size - kPaddingBytes;
       return obj;
     }
 
@@ -767,14 +1189,15 @@ static void* SampleifyAllocation(Policy policy, size_t requested_size,
     allocated_size = span->bytes_in_span();
     allocated_cold = IsColdMemory(span->start_address());
   }
-  if (capacity) *capacity = allocated_size;
+  if (capacity) *capacity = allocated_size - kPaddingBytes;
 
   ASSERT(span != nullptr);
 
   // Grab the stack trace outside the heap lock.
   StackTrace tmp;
   tmp.proxy = proxy;
-  tmp.depth = absl::GetStackTrace(tmp.stack, kMaxStackDepth, 0);
+  InitThreadStackBounds();
+  tmp.depth = CaptureStackTrace(tmp.stack, kMaxStackDepth, 0);
   tmp.requested_size = requested_size;
   tmp.requested_alignment = requested_alignment;
   tmp.requested_size_returning = capacity != nullptr;
@@ -798,17 +1221,34 @@ static void* SampleifyAllocation(Policy policy, size_t requested_size,
   }
 
   allocation_samples_.ReportMalloc(tmp);
+#ifdef CONTINUOUS_PROFILE
+  ContinuousProfiler::RecordAlloc(tmp, allocation_estimate);
+#endif
 
   // The SampledAllocation object is visible to readers after this. Readers only
   // care about its various metadata (e.g. stack trace, weight) to generate the
   // heap profile, and won't need any information from Span::Sample() next.
   SampledAllocation* sampled_allocation =
       tc_globals.sampled_allocation_recorder().Register(std::move(tmp));
+#ifdef LIFETIME_PROTECTION
+  // Guarded objects already have their page protected once freed, and cold
+  // ones may be left unprotected, so only the others get a prediction.
+  if (size_class != 0 && guarded_alloc == nullptr && !allocated_cold) {
+    predict_lifetime(sampled_allocation);
+  }
+#endif
   // No pageheap_lock required. The span is freshly allocated and no one else
   // can access it. It is visible after we return from this allocation path.
   span->Sample(sampled_allocation);
-  span->obj_size = allocated_size / 8;
-  span->objects_per_span = span->bytes_in_span() / allocated_size;
+  // A guarded object is described as the requested size rounded up to 8
+  // bytes (at least 8); GuardedPageAllocator places it at the start of such
+  // a chunk of its page, so bounds checks find it from the page info alone.
+  const size_t chunk_size =
+      guarded_alloc ? std::max((requested_size + 7) & ~size_t{7}, size_t{8})
+                    : allocated_size;
+  span->obj_size = chunk_size / 8;
+  span->objects_per_span = span->bytes_in_span() / chunk_size;
+  tc_globals.pagemap().RegisterObjectSize(span);
 
   // if we register the size class here, tcmalloc crashes
   // if (size_class != 0)
@@ -835,174 +1275,1812 @@ inline size_t ShouldSampleAllocation(size_t size) {
   return GetThreadSampler()->RecordAllocation(size);
 }
 
-inline size_t GetSize(const void* ptr) {
-  if (ptr == nullptr) return 0;
-  const PageId p = PageIdContaining(ptr);
-  size_t size_class = tc_globals.pagemap().sizeclass(p);
-  if (size_class != 0) {
+// The bytes of the allocation at the untagged ptr, info being the page info
+// of its page: the size of its class, or the object size large and sampled
+// spans record, which for sampled ones is the allocated size of the sample.
+// Only guarded allocations, which report their requested size, and objects
+// too large for the word read anything else.
+inline size_t GetSize(const void* ptr, PageMap::Info info) {
+  if (const size_t size_class = info.size_class();
+      ABSL_PREDICT_TRUE(size_class != 0)) {
     return tc_globals.sizemap().class_to_size(size_class);
+  }
+  if (ABSL_PREDICT_FALSE(IsSampledMemory(ptr)) &&
+      tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
+    return tc_globals.guardedpage_allocator().GetRequestedSize(ptr);
+  }
+  const size_t size = info.object_size();
+  if (ABSL_PREDICT_TRUE(size != 0)) return size;
+  const Span* span =
+      tc_globals.pagemap().GetExistingDescriptor(PageIdContaining(ptr));
+  if (span->sampled()) {
+    return span->sampled_allocation()->sampled_stack.allocated_size;
   } else {
-    const Span* span = tc_globals.pagemap().GetExistingDescriptor(p);
-    if (span->sampled()) {
-      if (tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
-        return tc_globals.guardedpage_allocator().GetRequestedSize(ptr);
-      }
-      return span->sampled_allocation()->sampled_stack.allocated_size;
-    } else {
-      return span->bytes_in_span();
-    }
+    return span->bytes_in_span();
   }
 }
 
-static inline struct escape** alloc_escape_list() {
-#ifndef JEMALLOC
-  struct escape **list = (struct escape **)Static::escape_list_allocator().New();
+inline size_t GetSize(const void* ptr) {
+  if (ptr == nullptr) return 0;
+  ptr = StripPointerTag(ptr);
+  return GetSize(ptr,
+                 tc_globals.pagemap().get_page_info(PageIdContaining(ptr)));
+}
+
+// Returns the bytes of the allocation at ptr the caller may use: GetSize()
+// less the padding byte.
+inline size_t GetUsableSize(const void* ptr) {
+  if (ptr == nullptr) return 0;
+  return GetSize(ptr) - kPaddingBytes;
+}
+
+// Escape tables come from a PageHeapAllocator, which needs pageheap_lock;
+// escape chunks come from the per-CPU EscapeChunkAllocator, and
+// commit_escape() and poison_escapes() otherwise run lock-free.
+// Tables are sized by EscapeObjects() of the span, which must not change
+// until the table is released.
+static inline EscapeHead* alloc_escape_list(size_t objects) {
+#ifdef PAGE_ESCAPE_CHAINS
+  // A page allocation resized in place may take the heads its class has to
+  // spare for more page escape chains.
+  const size_t n = EscapeTableClassSize(EscapeTableClass(objects));
 #else
-  struct escape **list = (struct escape **)je_malloc(1024*sizeof(struct escape *));
+  const size_t n = EscapeTableSize(objects);
 #endif
-  memset(list, 0, 1024*sizeof(struct escape *));
+  // Span::DestroyEscape() returns tables to escape_table_allocator(), so
+  // they come from it in every build, JEMALLOC included.
+  EscapeHead* list;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    list = Static::escape_table_allocator().New(objects);
+  }
+  std::uninitialized_value_construct_n(list, n);
   return list;
 }
 
-static inline void delete_escape_list(struct escape **list) {
-#ifndef JEMALLOC
-  Static::escape_list_allocator().Delete(reinterpret_cast<EscapeList*>(list));
-#else
-  je_free(list);
-#endif
+static inline void delete_escape_list(EscapeHead* list, size_t objects) {
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  Static::escape_table_allocator().Delete(list, objects);
 }
 
-static inline struct escape* alloc_escape() {
+// Chunks of a span's escapes live on the NUMA partition of the span, where
+// the frees that walk them run.
+static inline struct escape* alloc_escape(const Span* span) {
   // no need to zero memory
-#ifndef JEMALLOC
-  return (struct escape *)Static::escape_allocator().New();
-#else
-  return (struct escape *)je_malloc(sizeof (struct escape));
-#endif
+  return (struct escape *)Static::escape_allocator(
+             NumaPartitionFromPointer(span->start_address()))
+      .New();
+}
+
+// Frees a detached chain.  Chunks are linked through their first word, so
+// the chain goes back to the allocator as it is.
+static inline void delete_escape_chain(struct escape *head) {
+  if (head == nullptr) return;
+  struct escape *tail = head;
+  size_t n = 1;
+  for (; tail->next; tail = tail->next) n++;
+  Static::DeleteEscapeChunks(reinterpret_cast<EscapeChunk*>(head),
+                             reinterpret_cast<EscapeChunk*>(tail), n);
+}
+
+#if defined(ENABLE_STATISTIC) || defined(REMOTE_FREE_QUEUE)
+// Shard (see QuarantineShardIndex()) of the CPU that installed the escape
+// table of each span, plus one, or 0 if unknown.  The Span has no room left,
+// so spans share a slot when their first pages hash alike, which at worst
+// treats a free as local or remote when it is not.
+inline constexpr size_t kEscapeHomeSlots = 1 << 12;
+ABSL_CONST_INIT static std::atomic<uint8_t>
+    escape_home_shards[kEscapeHomeSlots];
+
+static inline std::atomic<uint8_t>& escape_home_shard(const Span* span) {
+  const uint64_t page = span->first_page().index();
+  return escape_home_shards[(page * 0x9E3779B97F4A7C15ull) >>
+                            (64 - absl::bit_width(kEscapeHomeSlots - 1))];
 }
+#endif
+
+// Returns the escape table of `span`, installing one if this is the first
+// escape committed to it.  Several threads may race to install; the loser
+// frees its table and uses the winner's.
+static inline EscapeHead* get_or_install_escape_list(Span *span) {
+  EscapeHead* escape_list = span->escape_list.load(std::memory_order_acquire);
+  if (ABSL_PREDICT_TRUE(escape_list != nullptr)) {
+    return escape_list;
+  }
 
-static inline void delete_escape(struct escape *e) {
-#ifndef JEMALLOC
-  Static::escape_allocator().Delete(reinterpret_cast<EscapeChunk*>(e));
+  // Mark the pages first: whoever sees the table (and may thus commit an
+  // escape to it) is ordered after the marks by the exchange below.
+  tc_globals.pagemap().MarkEscapes(span);
+#ifdef SPARSE_ESCAPE_TABLES
+  const bool sparse = EscapeObjects(span) > kSparseEscapeMinObjects;
+  EscapeHead* fresh =
+      sparse ? reinterpret_cast<EscapeHead*>(
+                   reinterpret_cast<uintptr_t>(
+                       alloc_escape_list(kSparseEscapeTableWords)) |
+                   kSparseEscapeTable)
+             : alloc_escape_list(EscapeObjects(span));
 #else
-  je_free(e);
+  EscapeHead* fresh = alloc_escape_list(EscapeObjects(span));
 #endif
-}
-
-static inline void commit_escape(Span *span, void **loc,
-    void *ptr, unsigned idx) {
-  // insert escape here
-  if (span->escape_list == nullptr) {
-    if (span->objects_per_span <= 2) {
-      span->escape_list = (struct escape **)alloc_escape();
-      memset(span->escape_list, 0, 16);
-#ifdef ESCAPE_DEBUG
-      span->escape_cnts = (size_t *)alloc_escape();
-      memset(span->escape_cnts, 0, 16);
+  if (!span->escape_list.compare_exchange_strong(escape_list, fresh,
+                                                 std::memory_order_acq_rel,
+                                                 std::memory_order_acquire)) {
+#ifdef SPARSE_ESCAPE_TABLES
+    if (sparse) {
+      delete_escape_list(
+          reinterpret_cast<EscapeHead*>(AsSparseEscapeTable(fresh)),
+          kSparseEscapeTableWords);
+      return escape_list;
+    }
 #endif
-    } else {
-      span->escape_list = alloc_escape_list();
+    delete_escape_list(fresh, EscapeObjects(span));
+    return escape_list;
+  }
+#ifdef SPARSE_ESCAPE_TABLES
+  Static::escape_table_allocator().CountForm(
+      sparse ? EscapeTableForm::kSparse : EscapeTableForm::kPerObject, 1);
+#endif
+#if defined(ENABLE_STATISTIC) || defined(REMOTE_FREE_QUEUE)
+  escape_home_shard(span).store(QuarantineShardIndex() + 1,
+                                std::memory_order_relaxed);
+#endif
+
 #ifdef ESCAPE_DEBUG
-      span->escape_cnts = (size_t *)alloc_escape_list();
+  span->escape_cnts = (size_t *)alloc_escape_list(EscapeObjects(span));
 #endif
+  return fresh;
+}
+
+#ifdef SPARSE_ESCAPE_TABLES
+// Returns the head of object idx in the sparse table of span, claiming one
+// if the object has none yet.  An object that finds no head to claim within
+// kSparseEscapeMaxProbes gets its head in the overflow table, which the
+// first such object installs; the span then has both.
+static EscapeHead* claim_sparse_escape_head(Span* span,
+                                            SparseEscapeTable* table,
+                                            size_t idx) {
+  const uint32_t key = idx + 1;
+  size_t slot = SparseEscapeSlot(idx);
+  for (size_t probe = 0; probe < kSparseEscapeMaxProbes; ++probe) {
+    uint32_t cur = table->keys[slot].load(std::memory_order_acquire);
+    if (cur == 0 && table->keys[slot].compare_exchange_strong(
+                        cur, key, std::memory_order_acq_rel,
+                        std::memory_order_acquire)) {
+      return &table->heads[slot];
     }
+    if (cur == key) return &table->heads[slot];
+    slot = (slot + 1) % kSparseEscapeHeads;
   }
 
-#ifdef PROTECTION_DEBUG
-  printf("committing escapes %p -> %p\n", loc, ptr);
+  EscapeHead* overflow = table->overflow.load(std::memory_order_acquire);
+  if (ABSL_PREDICT_TRUE(overflow != nullptr)) return &overflow[idx];
+  EscapeHead* fresh = alloc_escape_list(EscapeObjects(span));
+  if (!table->overflow.compare_exchange_strong(overflow, fresh,
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_acquire)) {
+    delete_escape_list(fresh, EscapeObjects(span));
+    return &overflow[idx];
+  }
+  Static::escape_table_allocator().CountForm(EscapeTableForm::kSparse, -1);
+  Static::escape_table_allocator().CountForm(EscapeTableForm::kOverflow, 1);
+  return &fresh[idx];
+}
 #endif
 
-  struct escape **escape_list = span->escape_list;
-  // store the loc into ptr's escapes
-  struct escape *loc_e = alloc_escape();
-  loc_e->loc = (void *)loc;
-  loc_e->next = escape_list[idx];
-  escape_list[idx] = loc_e;
-#ifdef ESCAPE_DEBUG
-  span->escape_cnts[idx]++;
-  size_t obj_start = (size_t)span->start_address() + span->obj_size*8 * idx;
-  if (span->escape_cnts[idx] > 1000) {
-    printf("ptr %p, loc %p, obj start 0x%lx size %ld objs_per_span %ld idx %d has refs %ld\n", ptr, loc, obj_start, span->obj_size*8, span->objects_per_span, idx, span->escape_cnts[idx]);
+// Returns the head of object idx of span, installing what it takes.
+static inline EscapeHead* get_or_install_escape_head(Span* span, size_t idx) {
+  EscapeHead* escape_list = get_or_install_escape_list(span);
+#ifdef SPARSE_ESCAPE_TABLES
+  if (IsSparseEscapeTable(escape_list)) {
+    return claim_sparse_escape_head(span, AsSparseEscapeTable(escape_list),
+                                    idx);
   }
 #endif
+  return &escape_list[idx];
 }
 
-static inline void flush_escape() {
-#ifdef PROTECTION_DEBUG
-  printf("flushing caches\n");
-#endif
-  for (int i=0; i<tc_globals.escape_pos; i++) {
-    size_t loc = (size_t)tc_globals.escape_caches[i].loc;
-    size_t ptr_info = tc_globals.escape_caches[i].ptr;
-    size_t real_ptr = *(size_t *)loc;
-    size_t obj_start = OBJ_START(ptr_info);
-    uint32_t obj_size = OBJ_SIZE(ptr_info);
+// Spins until the chain of `head` is unlocked, locks it and returns its first
+// chunk.  The caller unlocks by storing the new first chunk into `head`.
+static inline struct escape* lock_escape_head(EscapeHead* head) {
+  struct escape* cur = head->load(std::memory_order_relaxed);
+  while (true) {
+    if (reinterpret_cast<uintptr_t>(cur) & kEscapeHeadLocked) {
+      cur = head->load(std::memory_order_relaxed);
+      continue;
+    }
+    struct escape* locked = reinterpret_cast<struct escape*>(
+        reinterpret_cast<uintptr_t>(cur) | kEscapeHeadLocked);
+    if (head->compare_exchange_weak(cur, locked, std::memory_order_acquire,
+                                    std::memory_order_relaxed)) {
+      return cur;
+    }
+  }
+}
 
-    // might have collision here
-    // but it doesn't matter
-    if (SMALL_PTR(real_ptr) >= obj_start && SMALL_PTR(real_ptr) < (obj_start+obj_size)) {
+// Number of escapes in the chains of span's escape table.  Each chain is
+// locked while it is walked, so commits to it wait.
+static size_t count_span_escapes(Span* span) {
+  EscapeHead* list = span->escape_list.load(std::memory_order_acquire);
+  if (list == nullptr) return 0;
+  size_t escapes = 0;
+  ForEachEscapeHead(list, EscapeObjects(span),
+                    [&](size_t, EscapeHead* head) {
+                      struct escape* chunk = lock_escape_head(head);
+                      for (const struct escape* c = chunk; c != nullptr;
+                           c = c->next) {
+                        escapes += EscapeChunkSize(c);
+                      }
+                      head->store(chunk, std::memory_order_release);
+                    });
+  return escapes;
+}
+
+#ifdef OUTGOING_ESCAPE_INDEX
+// The outgoing escape index of a span (Span::escape_slots) tells which of its
+// words hold committed escapes, so that freeing an object can find the
+// records of the pointers it contained, and poisoning can tell the records
+// whose location was freed since from the live ones without reading it.
+
+// Returns the outgoing index of `span`, installing one if this is the first
+// escape committed from it.  As for escape tables, the pages are marked
+// first, so that free() of the span's objects reads the Span.
+static inline std::atomic<uint64_t>* get_or_install_escape_slots(Span* span) {
+  std::atomic<uint64_t>* slots =
+      span->escape_slots.load(std::memory_order_acquire);
+  if (ABSL_PREDICT_TRUE(slots != nullptr)) {
+    return slots;
+  }
+
+  tc_globals.pagemap().MarkEscapes(span);
+  const size_t words = EscapeSlotWords(span->num_pages());
+  std::atomic<uint64_t>* fresh =
+      reinterpret_cast<std::atomic<uint64_t>*>(alloc_escape_list(words));
+  if (!span->escape_slots.compare_exchange_strong(slots, fresh,
+                                                  std::memory_order_acq_rel,
+                                                  std::memory_order_acquire)) {
+    delete_escape_list(reinterpret_cast<EscapeHead*>(fresh), words);
+    return slots;
+  }
+  return fresh;
+}
+
+// Records that loc holds a committed escape, if it is a word of the heap.
+static inline void mark_escape_slot(void** loc) {
+  Span* span = tc_globals.pagemap().GetDescriptor(PageIdContaining(loc));
+  if (span == nullptr || span->obj_size == 0) return;
+  const size_t word =
+      ((uintptr_t)loc - (uintptr_t)span->start_address()) / sizeof(void*);
+  if (word / 64 >= EscapeSlotWords(span->num_pages())) return;
+  std::atomic<uint64_t>& slot = get_or_install_escape_slots(span)[word / 64];
+  const uint64_t bit = uint64_t{1} << (word % 64);
+  if (!(slot.load(std::memory_order_relaxed) & bit)) {
+    slot.fetch_or(bit, std::memory_order_relaxed);
+  }
+}
+
+// Returns false if loc is a word of the heap that holds no committed escape
+// any more: the object it belongs to was freed, and loc may be free or
+// reused memory.  Locations outside the heap and words past the index are
+// always live.
+static inline bool escape_slot_live(const void* loc) {
+  const Span* span = tc_globals.pagemap().GetDescriptor(PageIdContaining(loc));
+  if (span == nullptr) return true;
+  if (span->obj_size == 0) return false;
+  const size_t word =
+      ((uintptr_t)loc - (uintptr_t)span->start_address()) / sizeof(void*);
+  if (word / 64 >= EscapeSlotWords(span->num_pages())) return true;
+  const std::atomic<uint64_t>* slots =
+      span->escape_slots.load(std::memory_order_acquire);
+  return slots != nullptr &&
+         (slots[word / 64].load(std::memory_order_relaxed) >> (word % 64)) & 1;
+}
+
+// Drops the locations of `chunk`, the full head chunk of a chain, that are
+// no longer live, keeping the chunk filled front to back.  Returns the number
+// of locations left.
+static size_t compact_escape_chunk(struct escape* chunk, uintptr_t obj_start) {
+  const size_t n = EscapeChunkSize(chunk);
+  size_t kept = 0;
+  for (size_t i = 0; i < n; i++) {
+    void* loc = EscapeChunkLoc(chunk, i);
+    if (escape_slot_live(loc)) {
+      MoveEscapeChunkLoc(chunk, kept++, i);
+      continue;
+    }
 #ifdef ESCAPE_CACHE_L2
-      escape_l2_cache_entry *ec = tc_globals.escape_l2_caches + MASK(loc);
-      if ((uint32_t)loc == ec->loc &&
-          (uint32_t)obj_start == ec->obj_start) {
+    tc_globals.escape_filter().Erase((uintptr_t)loc, obj_start);
+#endif
 #ifdef ENABLE_STATISTIC
-          tc_globals.escape_l2_cache_optimized++;
+    tc_globals.escape_dead_cnt.Add(1);
 #endif
-          continue;  
+  }
+  TruncateEscapeChunk(chunk, kept);
+  return kept;
+}
+
+// Removes loc from the chain of `head`, keeping every chunk filled front to
+// back; a chunk left empty is freed.  Returns false if loc is not there.
+static bool unlink_escape(EscapeHead* head, void** loc) {
+  struct escape* first = lock_escape_head(head);
+  struct escape* prev = nullptr;
+  struct escape* cur = first;
+  bool found = false;
+  while (cur && !found) {
+    const size_t n = EscapeChunkSize(cur);
+    for (size_t i = 0; i < n; i++) {
+      if (EscapeChunkLoc(cur, i) == (void*)loc) {
+        MoveEscapeChunkLoc(cur, i, n - 1);
+        TruncateEscapeChunk(cur, n - 1);
+        found = true;
+        break;
       }
-#endif
-      Span *span = tc_globals.pagemap().GetDescriptor(PageIdContaining((void*)real_ptr));
-      if (!span || span->obj_size != OBJ_SIZE_RAW(ptr_info))
-        continue;
-      unsigned obj_idx = ((size_t)real_ptr - (size_t)span->start_address()) / obj_size;
-      if (obj_idx >= escapeListSize)
-        continue;
-      commit_escape(span, (void **)loc, (void *)real_ptr, obj_idx);
-
+    }
+    if (found && n == 1) {
+      if (prev) {
+        prev->next = cur->next;
+      } else {
+        first = cur->next;
+      }
+      cur->next = nullptr;
+      delete_escape_chain(cur);
+      break;
+    }
+    prev = cur;
+    cur = cur->next;
+  }
+  head->store(first, std::memory_order_release);
+  return found;
+}
+
+// Unlinks the escape held at loc from the chain of the object loc points
+// into.  A location that was overwritten since points elsewhere, and its
+// record is only marked dead by the caller.
+static void unlink_outgoing_escape(void** loc) {
+  const uintptr_t target = SMALL_PTR(*loc);
+  Span* span =
+      tc_globals.pagemap().GetDescriptor(PageIdContaining((void*)target));
+  if (span == nullptr) return;
+  const size_t obj_size = EscapeObjectBytes(span);
+  EscapeHead* list = span->escape_list.load(std::memory_order_acquire);
+  if (obj_size == 0 || list == nullptr) return;
+  const size_t idx = (target - (uintptr_t)span->start_address()) / obj_size;
+  if (idx >= EscapeTableSize(EscapeObjects(span))) return;
+  EscapeHead* head = FindEscapeHead(list, idx);
+  if (head == nullptr || head->load(std::memory_order_relaxed) == nullptr)
+    return;
+  if (!unlink_escape(head, loc)) return;
 #ifdef ESCAPE_CACHE_L2
-      ec->loc = (uint32_t)loc;
-      ec->obj_start = (uint32_t)obj_start;
+  tc_globals.escape_filter().Erase(
+      (uintptr_t)loc, (uintptr_t)span->start_address() + obj_size * idx);
 #endif
-    } else {
-      // removing old records is heavy
-      // we leave it for free to do it
 #ifdef ENABLE_STATISTIC
-      tc_globals.escape_cache_optimized++;
+  tc_globals.escape_pruned_cnt.Add(1);
 #endif
+}
+
+// Called by free() of the object [ptr, ptr + obj_size) of span while its
+// contents are still intact.  Clears the object's words in the outgoing
+// index, which marks the records held there dead, and unlinks the records
+// of the words still pointing at the object they escaped to.
+static ABSL_ATTRIBUTE_NOINLINE void prune_outgoing_escapes(Span* span,
+                                                            void* ptr,
+                                                            size_t obj_size) {
+  std::atomic<uint64_t>* slots =
+      span->escape_slots.load(std::memory_order_acquire);
+  if (slots == nullptr) return;
+  const uintptr_t base = (uintptr_t)span->start_address();
+  size_t word = ((uintptr_t)ptr - base) / sizeof(void*);
+  const size_t end =
+      std::min(word + obj_size / sizeof(void*),
+               EscapeSlotWords(span->num_pages()) * size_t{64});
+  while (word < end) {
+    const size_t lo = word % 64;
+    const size_t hi = std::min<size_t>(64, lo + (end - word));
+    const uint64_t mask = (hi == 64 ? ~uint64_t{0} : (uint64_t{1} << hi) - 1) &
+                          ~((uint64_t{1} << lo) - 1);
+    std::atomic<uint64_t>& slot = slots[word / 64];
+    uint64_t bits = slot.load(std::memory_order_relaxed) & mask;
+    if (bits != 0) {
+      bits = slot.fetch_and(~mask, std::memory_order_acq_rel) & mask;
+    }
+    const uintptr_t first = base + (word - lo) * sizeof(void*);
+    for (; bits != 0; bits &= bits - 1) {
+      unlink_outgoing_escape(
+          (void**)(first + absl::countr_zero(bits) * sizeof(void*)));
     }
+    word += hi - lo;
   }
-  tc_globals.escape_pos = 0;
 }
+#endif
 
-static inline void poison_escapes(Span *span, int idx,
-    void *ptr, void *end) {
-  struct escape **escape_list = span->escape_list;
-  if (!escape_list || !escape_list[idx])
+#ifdef FORK_AWARE_PROTECTION
+// Whether a forked child inherited chunk from its parent, see
+// EscapeChunkAllocator::Inherited().
+static inline bool escape_chunk_inherited(const struct escape *chunk) {
+  for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+    if (tc_globals.escape_allocator(partition).Inherited(chunk)) return true;
+  }
+  return false;
+}
+#endif
+
+static inline void commit_escape(Span *span, void **loc,
+    void *ptr, unsigned idx) {
+  // insert escape here
+  EscapeHead* head = get_or_install_escape_head(span, idx);
+#ifdef OUTGOING_ESCAPE_INDEX
+  // before the record is published, so it never looks dead
+  mark_escape_slot(loc);
+#endif
+
+#ifdef PROTECTION_DEBUG
+  printf("committing escapes %p -> %p\n", loc, ptr);
+#endif
+
+  // store the loc into ptr's escapes, after the last one of the head chunk,
+  // or in a new head chunk if that one has no room for it
+  struct escape *chunk = lock_escape_head(head);
+#ifdef FORK_AWARE_PROTECTION
+  // a forked child leaves the chunks it inherited shared with its parent and
+  // puts its escapes in a chunk of its own in front of them
+  const bool writable = chunk && !escape_chunk_inherited(chunk);
+#else
+  const bool writable = chunk != nullptr;
+#endif
+  bool added = writable && AddEscapeChunkLoc(chunk, loc);
+#ifdef OUTGOING_ESCAPE_INDEX
+  // before growing the chain, drop the records whose location was freed
+  if (writable && !added) {
+    compact_escape_chunk(chunk, (uintptr_t)span->start_address() +
+                                    EscapeObjectBytes(span) * idx);
+    added = AddEscapeChunkLoc(chunk, loc);
+  }
+#endif
+  if (!added) {
+    struct escape *fresh = alloc_escape(span);
+    ClearEscapeChunk(fresh);
+    AddEscapeChunkLoc(fresh, loc);
+    fresh->next = chunk;
+    chunk = fresh;
+  }
+  head->store(chunk, std::memory_order_release);
+#ifdef ESCAPE_DEBUG
+  span->escape_cnts[idx]++;
+  size_t obj_start = (size_t)span->start_address() + span->obj_size*8 * idx;
+  if (span->escape_cnts[idx] > 1000) {
+    printf("ptr %p, loc %p, obj start 0x%lx size %ld objs_per_span %ld idx %d has refs %ld\n", ptr, loc, obj_start, span->obj_size*8, span->objects_per_span, idx, span->escape_cnts[idx]);
+  }
+#endif
+}
+
+// Moves the committed escape old_loc -> ptr to new_loc, as when the slot
+// holding ptr is moved.  Returns false if no such escape was committed.
+static inline bool transfer_escape(Span *span, void **old_loc,
+    void **new_loc, void *ptr) {
+  size_t obj_size = EscapeObjectBytes(span);
+  if (obj_size == 0)
+    return false;
+  size_t idx = ((size_t)ptr - (size_t)span->start_address()) / obj_size;
+  EscapeHead* escape_list = span->escape_list.load(std::memory_order_acquire);
+  if (!escape_list || idx >= EscapeTableSize(EscapeObjects(span)))
+    return false;
+  EscapeHead* escape_head = FindEscapeHead(escape_list, idx);
+  if (escape_head == nullptr) return false;
+
+  bool found = false;
+  struct escape *head = lock_escape_head(escape_head);
+  for (struct escape *cur = head; cur && !found; cur = cur->next) {
+    const size_t n = EscapeChunkSize(cur);
+    for (size_t i = 0; i < n; i++) {
+      if (EscapeChunkLoc(cur, i) == (void *)old_loc) {
+#ifdef OUTGOING_ESCAPE_INDEX
+        mark_escape_slot(new_loc);
+#endif
+        if (!SetEscapeChunkLoc(cur, i, new_loc)) {
+          // new_loc does not fit this chunk; move it to the head, which may
+          // leave this chunk empty until the chain is freed or swept
+          MoveEscapeChunkLoc(cur, i, n - 1);
+          TruncateEscapeChunk(cur, n - 1);
+          if (!AddEscapeChunkLoc(head, new_loc)) {
+            struct escape *fresh = alloc_escape(span);
+            ClearEscapeChunk(fresh);
+            AddEscapeChunkLoc(fresh, new_loc);
+            fresh->next = head;
+            head = fresh;
+          }
+        }
+        found = true;
+        break;
+      }
+    }
+  }
+  escape_head->store(head, std::memory_order_release);
+#ifdef ESCAPE_CACHE_L2
+  if (found) {
+    size_t obj_start = (size_t)span->start_address() + obj_size * idx;
+    // old_loc no longer has a committed escape to this object
+    tc_globals.escape_filter().Erase((uintptr_t)old_loc, obj_start);
+  }
+#endif
+  return found;
+}
+
+#ifdef ESCAPE_REFCOUNTS
+// With ESCAPE_REFCOUNTS an escape only bumps a byte of its object in the
+// span's escape counts (Span::escape_refs), and free() quarantines objects
+// whose count is not 0 rather than poisoning anything.  The counts never go
+// down on their own: the background thread halves them, so only objects
+// escaped recently are held back.  Nothing is staged or committed, and the
+// escape tables stay empty.
+inline constexpr uint8_t kMaxEscapeRefs = 0xff;
+
+// Returns the escape counts of `span`, installing them on its first escape.
+// As for escape tables, the pages are marked first, so that free() of the
+// span's objects reads the Span.
+static inline std::atomic<uint8_t>* get_or_install_escape_refs(Span* span) {
+  std::atomic<uint8_t>* refs =
+      span->escape_refs.load(std::memory_order_acquire);
+  if (ABSL_PREDICT_TRUE(refs != nullptr)) {
+    return refs;
+  }
+
+  tc_globals.pagemap().MarkEscapes(span);
+  const size_t words = EscapeRefWords(span->objects_per_span);
+  std::atomic<uint8_t>* fresh =
+      reinterpret_cast<std::atomic<uint8_t>*>(alloc_escape_list(words));
+  if (!span->escape_refs.compare_exchange_strong(refs, fresh,
+                                                 std::memory_order_acq_rel,
+                                                 std::memory_order_acquire)) {
+    delete_escape_list(reinterpret_cast<EscapeHead*>(fresh), words);
+    return refs;
+  }
+  return fresh;
+}
+
+// Counts an escape into object idx of span.  The count saturates, and
+// concurrent escapes may lose an increment; neither takes a count from
+// nonzero back to 0.
+static inline void count_escape_ref(Span* span, size_t idx) {
+  std::atomic<uint8_t>& ref = get_or_install_escape_refs(span)[idx];
+  const uint8_t n = ref.load(std::memory_order_relaxed);
+  if (n != kMaxEscapeRefs) ref.store(n + 1, std::memory_order_relaxed);
+}
+
+// Returns the escape count of the object [start, start + obj_size) and
+// resets it for the next object in the slot.  Returns 0 for objects of
+// spans that never had an escape.
+static inline uint8_t take_escape_refs(PageId page, uintptr_t start,
+                                       size_t obj_size) {
+  if (ABSL_PREDICT_TRUE(!tc_globals.pagemap().HasEscapes(page))) return 0;
+  Span* span = tc_globals.pagemap().GetExistingDescriptor(page);
+  std::atomic<uint8_t>* refs =
+      span->escape_refs.load(std::memory_order_acquire);
+  if (refs == nullptr) return 0;
+  const size_t idx = (start - (uintptr_t)span->start_address()) / obj_size;
+  if (idx >= EscapeTableSize(span->objects_per_span)) return 0;
+  const uint8_t n = refs[idx].load(std::memory_order_relaxed);
+  if (n != 0) refs[idx].store(0, std::memory_order_relaxed);
+  return n;
+}
+
+// Where DecayEscapeRefs() resumes.  Only the background thread touches it.
+ABSL_CONST_INIT static PageId escape_decay_page;
+
+// Halves the escape counts of the span at *page and leaves *page at its last
+// page.  Returns false if there was no span in use at *page.
+static bool decay_span_escape_refs(PageId* page)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  Span* span = tc_globals.pagemap().GetDescriptor(*page);
+  if (span == nullptr || span->location() != Span::IN_USE ||
+      *page < span->first_page() || span->last_page() < *page) {
+    return false;
+  }
+  *page = span->last_page();
+  // The counts cannot be freed while pageheap_lock is held.
+  std::atomic<uint8_t>* refs =
+      span->escape_refs.load(std::memory_order_acquire);
+  if (refs == nullptr) return true;
+  const size_t n = EscapeTableSize(span->objects_per_span);
+  for (size_t i = 0; i < n; ++i) {
+    const uint8_t count = refs[i].load(std::memory_order_relaxed);
+    if (count != 0) refs[i].store(count >> 1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+size_t DecayEscapeRefs(absl::Duration budget) {
+  const int64_t deadline =
+      absl::base_internal::CycleClock::Now() +
+      static_cast<int64_t>(absl::ToDoubleSeconds(budget) *
+                           absl::base_internal::CycleClock::Frequency());
+  size_t spans = 0;
+  do {
+    std::optional<PageId> next =
+        tc_globals.pagemap().GetNextSetPage(escape_decay_page);
+    if (!next.has_value()) {
+      // A pass over the heap is done; the next call starts over.
+      escape_decay_page = PageId{0};
+      break;
+    }
+    escape_decay_page = *next;
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    if (decay_span_escape_refs(&escape_decay_page)) spans++;
+  } while (absl::base_internal::CycleClock::Now() < deadline);
+  return spans;
+}
+#endif
+
+#ifdef ESCAPE_CHAIN_SWEEP
+// Where SweepEscapeChains() resumes: the span it got to and the next head of
+// its table, 0 to move on to the next span.  Only the background thread
+// touches them.
+ABSL_CONST_INIT static PageId escape_sweep_page;
+ABSL_CONST_INIT static size_t escape_sweep_head = 0;
+
+// Heads of one table swept per hold of pageheap_lock.
+inline constexpr size_t kEscapeSweepHeadsPerLock = 64;
+
+// Whether the record loc in the chain of the object [start, end) still
+// points into it.  A location in the guarded region without a span belongs
+// to a freed guarded allocation, whose page faults when read.
+static inline bool escape_record_live(void* loc, uintptr_t start,
+                                      uintptr_t end) {
+#ifdef OUTGOING_ESCAPE_INDEX
+  if (!escape_slot_live(loc)) return false;
+#endif
+  if (tc_globals.guardedpage_allocator().PointerIsMine(loc) &&
+      tc_globals.pagemap().GetDescriptor(PageIdContaining(loc)) == nullptr) {
+    return false;
+  }
+  const uintptr_t cur = SMALL_PTR(*reinterpret_cast<void**>(loc));
+  return start <= cur && cur < end;
+}
+
+// Drops the records of the chain of `head`, the escapes of the object
+// [start, end), that no longer point into it, and moves the chunks left
+// empty to *dropped.  The chain is skipped if it is locked: a commit or a
+// free is using it, or the span is being torn down.  Returns the number of
+// records dropped.
+static size_t sweep_escape_chain(EscapeHead* head, uintptr_t start,
+                                 uintptr_t end, struct escape** dropped) {
+  struct escape* first = head->load(std::memory_order_relaxed);
+  if (first == nullptr ||
+      (reinterpret_cast<uintptr_t>(first) & kEscapeHeadLocked) ||
+      !head->compare_exchange_strong(
+          first,
+          reinterpret_cast<struct escape*>(
+              reinterpret_cast<uintptr_t>(first) | kEscapeHeadLocked),
+          std::memory_order_acquire, std::memory_order_relaxed)) {
+    return 0;
+  }
+
+  // Drop the dead records of each chunk, then pack the live ones to the
+  // front of the chain in order: a chunk takes the records of the next one
+  // while it has room for them, and chunks left empty are unlinked.
+  size_t removed = 0;
+  for (struct escape* r = first; r; r = r->next) {
+    const size_t n = EscapeChunkSize(r);
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+      void* loc = EscapeChunkLoc(r, i);
+      if (!escape_record_live(loc, start, end)) {
+#ifdef ESCAPE_CACHE_L2
+        tc_globals.escape_filter().Erase((uintptr_t)loc, start);
+#endif
+        removed++;
+        continue;
+      }
+      MoveEscapeChunkLoc(r, kept++, i);
+    }
+    TruncateEscapeChunk(r, kept);
+  }
+
+  struct escape** link = &first;
+  struct escape* w = nullptr;
+  for (struct escape* r = first; r;) {
+    struct escape* next = r->next;
+    const size_t n = EscapeChunkSize(r);
+    size_t moved = 0;
+    if (w != nullptr) {
+      while (moved < n && AddEscapeChunkLoc(w, EscapeChunkLoc(r, moved))) {
+        moved++;
+      }
+    }
+    if (moved == n) {
+      // r is empty now
+      *link = next;
+      r->next = *dropped;
+      *dropped = r;
+    } else {
+      for (size_t i = moved; i < n; i++) MoveEscapeChunkLoc(r, i - moved, i);
+      TruncateEscapeChunk(r, n - moved);
+      w = r;
+      link = &r->next;
+    }
+    r = next;
+  }
+  head->store(first, std::memory_order_release);
+  return removed;
+}
+
+// Sweeps up to kEscapeSweepHeadsPerLock heads of the escape table of the
+// span at *page, from head *next_head on.  Leaves *next_head at the head to
+// resume from, with *page at the first page of the span, or at 0 with *page
+// at its last page once the table is done.
+static size_t sweep_span_escapes(PageId* page, size_t* next_head,
+                                 struct escape** dropped)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  size_t head = *next_head;
+  *next_head = 0;
+  Span* span = tc_globals.pagemap().GetDescriptor(*page);
+  if (span == nullptr || span->location() != Span::IN_USE ||
+      *page < span->first_page() || span->last_page() < *page) {
+    return 0;
+  }
+  *page = span->last_page();
+  const size_t obj_size = EscapeObjectBytes(span);
+  // The table cannot be freed while pageheap_lock is held, but the span may
+  // still be torn down up to that point, see Span::DestroyEscape().
+  EscapeHead* list = span->escape_list.load(std::memory_order_acquire);
+  if (obj_size == 0 || list == nullptr) return 0;
+  const size_t heads = EscapeTableSize(EscapeObjects(span));
+  const size_t stop = std::min(heads, head + kEscapeSweepHeadsPerLock);
+  const uintptr_t base = (uintptr_t)span->start_address();
+  size_t removed = 0;
+  for (; head < stop; ++head) {
+    if (span->escape_list.load(std::memory_order_acquire) != list) {
+      return removed;
+    }
+    EscapeHead* escape_head = FindEscapeHead(list, head);
+    if (escape_head == nullptr) continue;
+    const uintptr_t start = base + obj_size * head;
+    removed +=
+        sweep_escape_chain(escape_head, start, start + obj_size, dropped);
+  }
+  if (head < heads) {
+    *next_head = head;
+    *page = span->first_page();
+  }
+  return removed;
+}
+
+size_t SweepEscapeChains(absl::Duration budget) {
+  const int64_t deadline =
+      absl::base_internal::CycleClock::Now() +
+      static_cast<int64_t>(absl::ToDoubleSeconds(budget) *
+                           absl::base_internal::CycleClock::Frequency());
+  size_t removed = 0;
+  do {
+    if (escape_sweep_head == 0) {
+      // A page after the previous span; the page map is walked lock-free.
+      std::optional<PageId> next =
+          tc_globals.pagemap().GetNextSetPage(escape_sweep_page);
+      if (!next.has_value()) {
+        // A pass over the heap is done; the next call starts over.
+        escape_sweep_page = PageId{0};
+        break;
+      }
+      escape_sweep_page = *next;
+    }
+    struct escape* dropped = nullptr;
+    {
+      absl::base_internal::SpinLockHolder h(&pageheap_lock);
+      removed +=
+          sweep_span_escapes(&escape_sweep_page, &escape_sweep_head, &dropped);
+    }
+    delete_escape_chain(dropped);
+  } while (absl::base_internal::CycleClock::Now() < deadline);
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_swept_cnt.Add(removed);
+#endif
+  return removed;
+}
+#endif
+
+#ifdef PIPELINED_ESCAPE_PREFETCH
+// flush_escape() prefetches what committing a staged record touches in
+// kEscapePrefetchStages steps, each kEscapePrefetchStride records apart, so
+// that the misses of one record overlap the commits of the ones before it.
+inline constexpr size_t kEscapePrefetchStages = 3;
+inline constexpr size_t kEscapePrefetchStride = 4;
+
+// Issues prefetch `stage` of the staged record e.  Every stage only loads
+// lines the previous ones prefetched, and all of them start from the object
+// start in ptr_info rather than from *loc, which lies in the same span and
+// slot of its escape table as the pointer committed:
+//
+//   0: the location, its set in the escape filter and its page map entry;
+//   1: the span, whose line holds escape_list;
+//   2: the escape head of the object in the span's escape table.
+static inline void prefetch_escape_record(const escape_cache& e,
+                                          size_t stage) {
+  const uintptr_t obj_start = OBJ_START(e.ptr);
+  const PageId page = PageIdContaining((void*)obj_start);
+  if (stage == 0) {
+    __builtin_prefetch(e.loc, 0, 3);
+#ifdef ESCAPE_CACHE_L2
+    tc_globals.escape_filter().Prefetch((uintptr_t)e.loc);
+#endif
+    tc_globals.pagemap().PrefetchDescriptor(page);
+    return;
+  }
+  Span* span = tc_globals.pagemap().GetDescriptor(page);
+  if (span == nullptr) return;
+  if (stage == 1) {
+    span->Prefetch();
+    return;
+  }
+  EscapeHead* escape_list = span->escape_list.load(std::memory_order_relaxed);
+  const uint32_t obj_size = OBJ_SIZE(e.ptr);
+  if (escape_list == nullptr || obj_size == 0) return;
+  const size_t idx =
+      (obj_start - (uintptr_t)span->start_address()) / obj_size;
+  if (idx >= EscapeTableSize(EscapeObjects(span))) return;
+#ifdef SPARSE_ESCAPE_TABLES
+  // The keys of a sparse table share a line, which its lookup reads first.
+  if (IsSparseEscapeTable(escape_list)) {
+    __builtin_prefetch(AsSparseEscapeTable(escape_list), 1, 3);
+    return;
+  }
+#endif
+  __builtin_prefetch(&escape_list[idx], 1, 3);
+}
+
+// Issues, while record i of the n in `entries` is processed, the prefetch
+// stages [0, stages) of the records they are due for.
+static inline void prefetch_escape_pipeline(const escape_cache* entries,
+                                            size_t i, size_t n,
+                                            size_t stages) {
+  for (size_t stage = 0; stage < stages; ++stage) {
+    const size_t ahead = i + (kEscapePrefetchStages - stage) *
+                                 kEscapePrefetchStride;
+    if (ahead < n) prefetch_escape_record(entries[ahead], stage);
+  }
+}
+#endif
+
+#ifdef SORTED_ESCAPE_FLUSH
+// Records this far ahead of the one being committed have the span they point
+// into prefetched if it is not the current one.
+inline constexpr size_t kFlushPrefetchDistance = 8;
+
+// Page bits of the object a staged record points to, which flush_escape()
+// groups its commits by.
+static inline uint16_t escape_record_page_key(const escape_cache& e) {
+  return (OBJ_START(e.ptr) >> kPageShift) & 0xffff;
+}
+
+// Commits the records at positions flush_order()[0, n) of `buffer`, which
+// flush_escape() found still pointing into their object and unknown to the
+// filter.  They are committed grouped by the page of their object, so each
+// span, its escape table and the page map leaf are touched once per group
+// instead of once per record, and the span of another group a few records
+// ahead is prefetched.  The radix sort only looks at 16 bits of the page, so
+// a group may hold records of pages 2^16 pages apart, which only costs
+// another lookup.
+static void commit_sorted_escapes(EscapeBuffer* buffer, size_t n
+#ifdef ENABLE_STATISTIC
+                                  , EscapeFlushTracker<>::Flush* flush
+#endif
+) {
+  const escape_cache* entries = buffer->begin();
+  uint16_t* order = buffer->flush_order();
+  EscapeBuffer::SortByKey(entries, order, buffer->flush_tmp(), n,
+                          escape_record_page_key);
+  Span* span = nullptr;
+  uintptr_t span_start = 0, span_bytes = 0;
+  for (size_t k = 0; k < n; ++k) {
+    const escape_cache& e = entries[order[k]];
+    if (k + kFlushPrefetchDistance < n) {
+      const escape_cache& ahead = entries[order[k + kFlushPrefetchDistance]];
+      if (escape_record_page_key(ahead) != escape_record_page_key(e)) {
+        if (Span* s = tc_globals.pagemap().GetDescriptor(
+                PageIdContaining((void*)OBJ_START(ahead.ptr)))) {
+          s->Prefetch();
+        }
+      }
+    }
+    // Read again: the slot may have been stored to since it was filtered.
+    const size_t real_ptr = *(size_t*)e.loc;
+    const size_t obj_start = OBJ_START(e.ptr);
+    const uint32_t obj_size = OBJ_SIZE(e.ptr);
+    if (SMALL_PTR(real_ptr) < obj_start ||
+        SMALL_PTR(real_ptr) >= obj_start + obj_size) {
+      continue;
+    }
+    if (real_ptr - span_start >= span_bytes) {
+      span = tc_globals.pagemap().GetDescriptor(
+          PageIdContaining((void*)real_ptr));
+      if (span == nullptr) {
+        span_start = span_bytes = 0;
+        continue;
+      }
+      span_start = (uintptr_t)span->start_address();
+      span_bytes = span->bytes_in_span();
+    }
+    if (EscapeObjectUnits(span) != OBJ_SIZE_RAW(e.ptr)) continue;
+    unsigned obj_idx = (real_ptr - span_start) / obj_size;
+    if (obj_idx >= EscapeTableSize(EscapeObjects(span))) continue;
+    commit_escape(span, e.loc, (void*)real_ptr, obj_idx);
+#ifdef ENABLE_STATISTIC
+    flush->committed++;
+#endif
+#ifdef ESCAPE_CACHE_L2
+    tc_globals.escape_filter().Insert((size_t)e.loc, obj_start);
+#endif
+  }
+}
+#endif
+
+// Commits the escapes staged in `buffer`, which must belong to the calling
+// thread (or to a thread that is exiting).
+//
+// Only the caller's buffer is drained.  An object freed by another thread may
+// still have records staged here; they are filtered below because *loc no
+// longer points into a live object of the recorded size, or, if the slot was
+// reused, they are committed against the new object and poisoned when it is
+// freed.
+static inline void flush_escape(EscapeBuffer* buffer) {
+  TCMALLOC_TIME_PROTECTION(kFlushEscapes);
+#ifdef PROTECTION_DEBUG
+  printf("flushing caches\n");
+#endif
+#ifdef ENABLE_STATISTIC
+  EscapeFlushTracker<>::Flush flush;
+  flush.records = buffer->size();
+  const int64_t start = absl::base_internal::CycleClock::Now();
+#endif
+#ifdef SORTED_ESCAPE_FLUSH
+  // Records still to commit after the filters below, by position.
+  uint16_t* order = buffer->flush_order();
+  size_t ordered = 0;
+#endif
+  for (const escape_cache& e : *buffer) {
+#ifdef PIPELINED_ESCAPE_PREFETCH
+    // Sorted commits come after this loop and prefetch spans themselves, so
+    // only the locations and filter sets are prefetched for it.
+#ifdef SORTED_ESCAPE_FLUSH
+    const size_t stages = 1;
+#else
+    const size_t stages = kEscapePrefetchStages;
+#endif
+    prefetch_escape_pipeline(buffer->begin(), &e - buffer->begin(),
+                             buffer->size(), stages);
+#endif
+    size_t loc = (size_t)e.loc;
+    size_t ptr_info = e.ptr;
+    size_t real_ptr = *(size_t *)loc;
+    size_t obj_start = OBJ_START(ptr_info);
+    uint32_t obj_size = OBJ_SIZE(ptr_info);
+
+    // might have collision here
+    // but it doesn't matter
+    if (SMALL_PTR(real_ptr) >= obj_start && SMALL_PTR(real_ptr) < (obj_start+obj_size)) {
+#ifdef ESCAPE_CACHE_L2
+      if (tc_globals.escape_filter().Contains(loc, obj_start)) {
+#ifdef ENABLE_STATISTIC
+          tc_globals.escape_l2_cache_optimized.Add(1);
+          flush.filtered++;
+#endif
+#ifdef OUTGOING_ESCAPE_INDEX
+          // The record is committed, but its location may have been freed
+          // and reused since, which cleared its mark.
+          mark_escape_slot((void **)loc);
+#endif
+          continue;
+      }
+#ifdef ENABLE_STATISTIC
+      tc_globals.escape_l2_cache_miss.Add(1);
+#endif
+#endif
+#ifdef SORTED_ESCAPE_FLUSH
+      order[ordered++] = &e - buffer->begin();
+      continue;
+#endif
+      Span *span = tc_globals.pagemap().GetDescriptor(PageIdContaining((void*)real_ptr));
+      if (!span || EscapeObjectUnits(span) != OBJ_SIZE_RAW(ptr_info))
+        continue;
+      unsigned obj_idx = ((size_t)real_ptr - (size_t)span->start_address()) / obj_size;
+      if (obj_idx >= EscapeTableSize(EscapeObjects(span)))
+        continue;
+      commit_escape(span, (void **)loc, (void *)real_ptr, obj_idx);
+#ifdef ENABLE_STATISTIC
+      flush.committed++;
+#endif
+
+#ifdef ESCAPE_CACHE_L2
+      tc_globals.escape_filter().Insert(loc, obj_start);
+#endif
+    } else {
+      // removing old records is heavy
+      // we leave it for free to do it
+#ifdef ENABLE_STATISTIC
+      tc_globals.escape_cache_optimized.Add(1);
+#endif
+    }
+  }
+#ifdef SORTED_ESCAPE_FLUSH
+  commit_sorted_escapes(buffer, ordered
+#ifdef ENABLE_STATISTIC
+                        , &flush
+#endif
+  );
+#endif
+  buffer->Clear();
+#ifdef ENABLE_STATISTIC
+  // Whatever was neither committed nor already known to the filter pointed
+  // elsewhere by now.
+  flush.stale = flush.records - flush.committed - flush.filtered;
+  flush.cycles = absl::base_internal::CycleClock::Now() - start;
+  if (flush.records > 0) tc_globals.escape_flush_tracker().Report(flush);
+#endif
+}
+
+ABSL_CONST_INIT static pthread_key_t escape_buffer_key;
+ABSL_CONST_INIT static bool escape_buffer_tsd_inited = false;
+
+// Runs at thread exit: commits whatever the thread still has staged and
+// returns the buffer to the allocator.
+static void DestroyEscapeBuffer(void* ptr) {
+  if (ptr == nullptr) return;
+  EscapeBuffer* buffer = reinterpret_cast<EscapeBuffer*>(ptr);
+  thread_state_.escape_buffer = nullptr;
+#ifdef ESCAPE_LOCATION_CLASSES
+  // the thread is exiting, so none of its frames are live
+  thread_stack_escapes_.Clear();
+#endif
+  flush_escape(buffer);
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  tc_globals.escape_buffer_allocator().Delete(buffer);
+}
+
+// Returns an empty buffer of `capacity` records, which is kCapacity unless
+// under ADAPTIVE_ESCAPE_BUFFER.
+static EscapeBuffer* NewEscapeBuffer(size_t capacity) {
+  EscapeBuffer* buffer;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+    buffer = tc_globals.escape_buffer_allocator().New(capacity);
+#else
+    ASSERT(capacity == EscapeBuffer::kCapacity);
+    buffer = tc_globals.escape_buffer_allocator().New();
+#endif
+  }
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+  buffer->Init(capacity);
+#else
+  (void)capacity;
+  buffer->Init();
+#endif
+  return buffer;
+}
+
+static void InitEscapeBufferTSD() {
+  ASSERT(!escape_buffer_tsd_inited);
+  pthread_key_create(&escape_buffer_key, DestroyEscapeBuffer);
+  escape_buffer_tsd_inited = true;
+}
+
+static ABSL_ATTRIBUTE_NOINLINE EscapeBuffer* CreateEscapeBuffer() {
+  tc_globals.InitIfNecessary();
+  EscapeBuffer* buffer = NewEscapeBuffer(EscapeBuffer::kCapacity);
+  thread_state_.escape_buffer = buffer;
+  // Threads that escape before InitEscapeBufferTSD() has run (static
+  // initializers) keep their buffer for the lifetime of the process.
+  if (escape_buffer_tsd_inited) {
+    pthread_setspecific(escape_buffer_key, buffer);
+  }
+  return buffer;
+}
+
+static inline EscapeBuffer* ABSL_ATTRIBUTE_ALWAYS_INLINE GetEscapeBuffer() {
+  EscapeBuffer* buffer = thread_state_.escape_buffer;
+  if (ABSL_PREDICT_FALSE(buffer == nullptr)) {
+    buffer = CreateEscapeBuffer();
+  }
+  return buffer;
+}
+
+#ifdef ESCAPE_LOCATION_CLASSES
+static ABSL_ATTRIBUTE_NOINLINE void lookup_thread_stack() {
+  thread_state_.stack_looked_up = true;
+  uintptr_t lo, hi;
+  if (LookupThreadStack(tc_globals.global_ranges(), &lo, &hi)) {
+    thread_state_.stack_lo = lo;
+    thread_state_.stack_hi = hi;
+  }
+}
+
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE on_thread_stack(void** loc) {
+  if (ABSL_PREDICT_FALSE(!thread_state_.stack_looked_up)) lookup_thread_stack();
+  return (uintptr_t)loc - thread_state_.stack_lo <
+         thread_state_.stack_hi - thread_state_.stack_lo;
+}
+
+// Where loc lives.  The caller's thread stack is checked first, from cached
+// bounds; the heap through the page map; globals through the ranges read at
+// startup.
+static inline EscapeLocation classify_escape_location(void** loc) {
+  if (on_thread_stack(loc)) return EscapeLocation::kStack;
+  if (tc_globals.pagemap().GetDescriptor(PageIdContaining(loc)) != nullptr) {
+    return EscapeLocation::kHeap;
+  }
+  if (tc_globals.global_ranges().Contains((uintptr_t)loc)) {
+    return EscapeLocation::kGlobal;
+  }
+  return EscapeLocation::kOther;
+}
+
+// Stack pointer of the caller, near enough: the slots of frames that have
+// returned are below it.
+static inline uintptr_t ABSL_ATTRIBUTE_ALWAYS_INLINE current_stack_pointer() {
+  return (uintptr_t)__builtin_frame_address(0);
+}
+
+static inline void truncate_stack_escapes() {
+  const size_t dropped =
+      thread_stack_escapes_.Truncate(current_stack_pointer());
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_stack_truncated.Add(dropped);
+#else
+  (void)dropped;
+#endif
+}
+
+// Stages the escape of ptr_info through loc if loc is a slot of the calling
+// thread's stack.  Heap, global and other locations go to the EscapeBuffer
+// and from there to the escape chains; a stack slot usually dies with its
+// frame long before that, so it waits in the thread's StackEscapeBuffer,
+// whose dead records are dropped when it fills up.  Returns false if loc is
+// not on the stack, or the buffer is full of live records.
+static inline bool stage_stack_escape(void** loc, size_t ptr_info) {
+#ifdef ENABLE_STATISTIC
+  const EscapeLocation where = classify_escape_location(loc);
+  tc_globals.escape_location_cnt[static_cast<int>(where)].Add(1);
+  if (where != EscapeLocation::kStack) return false;
+#else
+  if (!on_thread_stack(loc)) return false;
+#endif
+  StackEscapeBuffer& frames = thread_stack_escapes_;
+  if (ABSL_PREDICT_TRUE(frames.Push(loc, ptr_info))) return true;
+  truncate_stack_escapes();
+  return frames.Push(loc, ptr_info);
+}
+
+// Moves the stack escapes of the calling thread whose frames are live into
+// `buffer`, so they are committed with it.  Called whenever the thread
+// commits its own escapes, which bounds how long a live stack slot stays
+// invisible to frees by other threads.
+static void spill_stack_escapes(EscapeBuffer* buffer) {
+  StackEscapeBuffer& frames = thread_stack_escapes_;
+  if (ABSL_PREDICT_TRUE(frames.empty())) return;
+  truncate_stack_escapes();
+  frames.RemoveIf([&](const StackEscapeBuffer::Record& r) {
+    if (buffer->full()) flush_escape(buffer);
+    buffer->Push(r.loc, r.ptr);
+    return true;
+  });
+}
+#endif
+
+// Bumped by RequestEscapeFlush().  A thread that sees it move commits its
+// buffer, so escapes it staged become visible to frees by other threads.
+ABSL_CONST_INIT static std::atomic<uint32_t> escape_flush_epoch{0};
+
+// Whether a flush was requested since this thread last looked.
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE escape_flush_due() {
+  const uint32_t epoch = escape_flush_epoch.load(std::memory_order_relaxed);
+  if (ABSL_PREDICT_TRUE(epoch == thread_state_.escape_flush_epoch)) {
+    return false;
+  }
+  thread_state_.escape_flush_epoch = epoch;
+  return true;
+}
+
+// Full buffers handed off by HandoffEscapeBuffer() and not yet committed.
+// Producers push with a CAS; the consumer detaches the whole stack with an
+// exchange, so there is no ABA problem on pop.
+ABSL_CONST_INIT static std::atomic<EscapeBuffer*> pending_escapes{nullptr};
+ABSL_CONST_INIT static std::atomic<size_t> pending_escapes_len{0};
+// Number of callers currently committing a detached batch.
+ABSL_CONST_INIT static std::atomic<int> escape_commits_in_flight{0};
+
+// Past this many queued buffers the flusher is not keeping up (or is not
+// running at all), and the owner commits its buffer inline instead.
+static constexpr size_t kMaxPendingEscapeBuffers = 64;
+
+static size_t commit_pending_escapes() {
+  escape_commits_in_flight.fetch_add(1, std::memory_order_acq_rel);
+  EscapeBuffer* list =
+      pending_escapes.exchange(nullptr, std::memory_order_acquire);
+  size_t n = 0;
+  for (EscapeBuffer* b = list; b != nullptr; b = b->next()) {
+    flush_escape(b);
+    n++;
+  }
+  // Every escape of the batch is in its table now, which is all that
+  // sync_pending_escapes() waits for.
+  escape_commits_in_flight.fetch_sub(1, std::memory_order_release);
+  if (n == 0) return 0;
+  pending_escapes_len.fetch_sub(n, std::memory_order_relaxed);
+  // The buffer allocator carves from an Arena, which pageheap_lock guards
+  // and which it shares with the escape table allocator and, without
+  // ESCAPE_HUGEPAGE_METADATA, the span allocator.  The lock is taken once
+  // for the whole batch, after the commits, which take none.
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  while (list != nullptr) {
+    EscapeBuffer* next = list->next();
+    tc_globals.escape_buffer_allocator().Delete(list);
+    list = next;
+  }
+  return n;
+}
+
+// Called by free() before it poisons: makes sure no escape that was handed
+// off before the free is still queued or half-committed by the flusher, so
+// the poisoning walk cannot miss it.
+static inline void sync_pending_escapes() {
+  if (ABSL_PREDICT_TRUE(
+          pending_escapes.load(std::memory_order_relaxed) == nullptr &&
+          escape_commits_in_flight.load(std::memory_order_acquire) == 0)) {
+    return;
+  }
+  commit_pending_escapes();
+  while (escape_commits_in_flight.load(std::memory_order_acquire) != 0) {
+    sched_yield();
+  }
+}
+
+// Replaces the calling thread's full buffer with an empty one and queues the
+// full one for the background flusher.  Falls back to committing inline when
+// the queue is already long.
+static ABSL_ATTRIBUTE_NOINLINE EscapeBuffer* HandoffEscapeBuffer(
+    EscapeBuffer* buffer) {
+  if (pending_escapes_len.load(std::memory_order_relaxed) >=
+      kMaxPendingEscapeBuffers) {
+    flush_escape(buffer);
+    return buffer;
+  }
+  EscapeBuffer* fresh = NewEscapeBuffer(buffer->NextCapacity());
+  thread_state_.escape_buffer = fresh;
+  if (escape_buffer_tsd_inited) {
+    pthread_setspecific(escape_buffer_key, fresh);
+  }
+
+  pending_escapes_len.fetch_add(1, std::memory_order_relaxed);
+  EscapeBuffer* head = pending_escapes.load(std::memory_order_relaxed);
+  do {
+    buffer->set_next(head);
+  } while (!pending_escapes.compare_exchange_weak(
+      head, buffer, std::memory_order_release, std::memory_order_relaxed));
+  return fresh;
+}
+
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+// Replaces the calling thread's buffer, just committed and so empty, with one
+// of `capacity` records.
+static ABSL_ATTRIBUTE_NOINLINE EscapeBuffer* ResizeEscapeBuffer(
+    EscapeBuffer* buffer, size_t capacity) {
+  ASSERT(buffer->empty());
+  EscapeBuffer* fresh = NewEscapeBuffer(capacity);
+  thread_state_.escape_buffer = fresh;
+  if (escape_buffer_tsd_inited) {
+    pthread_setspecific(escape_buffer_key, fresh);
+  }
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  tc_globals.escape_buffer_allocator().Delete(buffer);
+  return fresh;
+}
+#endif
+
+// Current generation of each object start, hashed, see poison.h.  Only
+// frees that actually poison something advance it.  Counters are bumped
+// with plain loads and stores: a lost update merely repeats a generation.
+ABSL_CONST_INIT static std::atomic<uint8_t>
+    poison_generations[kPoisonGenerations];
+
+static inline uintptr_t current_poison_generation(uintptr_t obj_start) {
+  return poison_generations[PoisonGenerationIndex(obj_start)].load(
+      std::memory_order_relaxed);
+}
+
+// Value written into the escaped locations of one freed object.  The
+// object's generation is advanced when the first location is poisoned, so a
+// free that finds no escapes never writes the shared counters.
+class PoisonValue {
+ public:
+  explicit PoisonValue(uintptr_t obj_start)
+      : obj_start_(obj_start), generation_(kUnset) {}
+  PoisonValue(uintptr_t obj_start, uintptr_t generation)
+      : obj_start_(obj_start), generation_(generation) {}
+
+  uintptr_t generation() {
+    if (generation_ == kUnset) {
+      std::atomic<uint8_t>& counter =
+          poison_generations[PoisonGenerationIndex(obj_start_)];
+      generation_ =
+          NextPoisonGeneration(counter.load(std::memory_order_relaxed));
+      counter.store(generation_, std::memory_order_relaxed);
+    }
+    return generation_;
+  }
+
+  // Poisoned form of cur, an address inside the object.
+  uintptr_t operator()(uintptr_t cur) {
+    return PoisonPointer(cur, generation());
+  }
+
+ private:
+  static constexpr uintptr_t kUnset = ~uintptr_t{0};
+
+  uintptr_t obj_start_;
+  uintptr_t generation_;
+};
+
+// Detaches the escape chain of object idx of span and returns it, or
+// nullptr if it has none.  Escapes committed concurrently land on the now
+// empty head and are filtered when the slot is freed again.
+static inline struct escape* detach_escapes(Span* span, int idx) {
+  EscapeHead* escape_list = span->escape_list.load(std::memory_order_acquire);
+  if (!escape_list || idx >= (int)kMaxEscapeTableSize) return nullptr;
+  EscapeHead* escape_head = FindEscapeHead(escape_list, idx);
+  if (escape_head == nullptr ||
+      escape_head->load(std::memory_order_relaxed) == nullptr)
+    return nullptr;
+  struct escape* head = lock_escape_head(escape_head);
+  escape_head->store(nullptr, std::memory_order_release);
+  return head;
+}
+
+// Poisons the locations recorded in the first `max_chunks` chunks of the
+// detached chain `head` that still point into [ptr, end), frees those chunks
+// and returns the rest of the chain.
+static struct escape* poison_escape_chunks(struct escape* head, void* ptr,
+                                           void* end, PoisonValue& poison,
+                                           size_t max_chunks) {
+  struct escape* last = nullptr;
+  struct escape* cur = head;
+  for (size_t n = 0; cur && n < max_chunks; last = cur, cur = cur->next, n++) {
+    const size_t chunk_size = EscapeChunkSize(cur);
+#ifdef PIPELINED_ESCAPE_PREFETCH
+    // Start on the next chunk and on every location of this one, with
+    // their filter sets, before the first of them is read.
+    if (cur->next) __builtin_prefetch(cur->next, 0, 3);
+    for (size_t i = 0; i < chunk_size; i++) {
+      void* loc = EscapeChunkLoc(cur, i);
+      __builtin_prefetch(loc, 1, 3);
+#ifdef ESCAPE_CACHE_L2
+      tc_globals.escape_filter().Prefetch((uintptr_t)loc);
+#endif
+    }
+#endif
+    for (size_t i = 0; i < chunk_size; i++) {
+      void* loc = EscapeChunkLoc(cur, i);
+#ifdef ESCAPE_CACHE_L2
+      // the slot is reused at the same address, see EscapeFilter
+      tc_globals.escape_filter().Erase((uintptr_t)loc, (uintptr_t)ptr);
+#endif
+#ifdef OUTGOING_ESCAPE_INDEX
+      if (!escape_slot_live(loc)) {
+#ifdef ENABLE_STATISTIC
+        tc_globals.escape_dead_cnt.Add(1);
+#endif
+        continue;
+      }
+#endif
+      void* cur_addr = *(reinterpret_cast<void**>(loc));
+      if (ptr <= cur_addr && cur_addr < end) {
+        if (CrashOnCorruption()) {
+          *(reinterpret_cast<uintptr_t*>(loc)) = poison((uintptr_t)cur_addr);
+        }
+#ifdef PROTECTION_DEBUG
+        printf("poison escape: loc (%p) -> ptr (%p)\n", loc, cur_addr);
+#endif
+      }
+    }
+  }
+  if (last == nullptr) return head;
+  last->next = nullptr;
+  delete_escape_chain(head);
+  return cur;
+}
+
+static inline void poison_escapes(Span *span, int idx,
+    void *ptr, void *end, PoisonValue& poison) {
+  TCMALLOC_TIME_PROTECTION(kPoisonEscapes);
+  struct escape* head = detach_escapes(span, idx);
+  if (head == nullptr) return;
+  poison_escape_chunks(head, ptr, end, poison, ~size_t{0});
+}
+
+#ifdef ESCAPE_LOCATION_CLASSES
+// Poisons the stack escapes of the calling thread to the object
+// [ptr, ptr + obj_size), as poison_staged_escapes() does for its
+// EscapeBuffer.
+static void poison_stack_escapes(void* ptr, size_t obj_size,
+                                 PoisonValue& poison) {
+  truncate_stack_escapes();
+  const size_t obj = SMALL_PTR(ptr);
+  thread_stack_escapes_.RemoveIf([&](const StackEscapeBuffer::Record& r) {
+    if (OBJ_START(r.ptr) != obj) return false;
+    const uintptr_t real_ptr = (uintptr_t)*r.loc;
+    if (real_ptr - (uintptr_t)ptr >= obj_size) return false;
+    if (CrashOnCorruption()) {
+      *(uintptr_t*)r.loc = poison(real_ptr);
+    }
+    return true;
+  });
+}
+#endif
+
+// Poisons the escapes to the object [ptr, ptr + obj_size) that the calling
+// thread staged but has not committed yet.  Only this thread's staged escapes
+// are visible here, see flush_escape().
+static inline void poison_staged_escapes(void* ptr, size_t obj_size,
+                                         PoisonValue& poison) {
+#ifdef ESCAPE_LOCATION_CLASSES
+  if (!thread_stack_escapes_.empty()) {
+    poison_stack_escapes(ptr, obj_size, poison);
+  }
+#endif
+  EscapeBuffer* buffer = thread_state_.escape_buffer;
+  if (!buffer) return;
+  buffer->ForEachOfObject(SMALL_PTR(ptr), [&](escape_cache* e) {
+    void **loc = e->loc;
+    void *real_ptr = *loc;
+    if ((size_t)ptr <= (size_t)real_ptr && (size_t)real_ptr < ((size_t)ptr + obj_size)) {
+#ifdef PROTECTION_DEBUG
+      printf("poison escape: loc (%p) -> ptr (%p)\n", loc, real_ptr);
+#endif
+
+      if (CrashOnCorruption()) {
+        *(uintptr_t *)loc = poison((uintptr_t)real_ptr);
+      }
+      // need to make sure flush will skip this entry
+      buffer->Poison(e);
+    }
+  });
+}
+
+#ifdef FREE_QUARANTINE
+ABSL_CONST_INIT static QuarantineShard quarantine_shards[kQuarantineShards];
+#endif
+#ifdef LIFETIME_PROTECTION
+// Sampled objects predicted short-lived, see quarantine_short_lived().
+// Sampling makes them rare enough for a single shard.
+ABSL_CONST_INIT static QuarantineShard short_lived_quarantine;
+#endif
+#ifdef REMOTE_FREE_QUEUE
+// Objects freed away from the CPU that installed their span's escape table,
+// queued by the shard of that CPU, see remote_escape_free().
+ABSL_CONST_INIT static QuarantineShard remote_free_queues[kQuarantineShards];
+#endif
+#ifdef ESCAPE_REFCOUNTS
+// Objects freed with a nonzero escape count, see quarantine_referenced().
+ABSL_CONST_INIT static QuarantineShard referenced_quarantine[kQuarantineShards];
+#endif
+#ifdef DEFERRED_ESCAPE_POISON
+// Objects with more escapes than one free() poisons, see
+// poison_escapes_bounded().  They are rare enough for a single queue.
+ABSL_CONST_INIT static DeferredPoisonQueue deferred_poison_queue;
+
+static bool poison_escapes_bounded(Span* span, int idx, void* ptr,
+                                   size_t obj_size, PoisonValue& poison);
+#endif
+
+#if defined(FREE_QUARANTINE) || defined(REMOTE_FREE_QUEUE) || \
+    defined(LIFETIME_PROTECTION) || defined(DEFERRED_ESCAPE_POISON) || \
+    defined(ESCAPE_REFCOUNTS)
+static bool is_quarantined(const void* ptr) {
+#ifdef FREE_QUARANTINE
+  for (QuarantineShard& shard : quarantine_shards) {
+    if (shard.Contains(ptr)) return true;
+  }
+#endif
+#ifdef ESCAPE_REFCOUNTS
+  for (QuarantineShard& shard : referenced_quarantine) {
+    if (shard.Contains(ptr)) return true;
+  }
+#endif
+#ifdef REMOTE_FREE_QUEUE
+  for (QuarantineShard& queue : remote_free_queues) {
+    if (queue.Contains(ptr)) return true;
+  }
+#endif
+#ifdef LIFETIME_PROTECTION
+  if (short_lived_quarantine.Contains(ptr)) return true;
+#endif
+#ifdef DEFERRED_ESCAPE_POISON
+  if (!deferred_poison_queue.MaybeEmpty() &&
+      deferred_poison_queue.Contains(ptr)) {
+    return true;
+  }
+#endif
+  return false;
+}
+#endif
+
+#if defined(FREE_QUARANTINE) || defined(REMOTE_FREE_QUEUE)
+
+// Poisons the committed escapes of a batch taken from the quarantine and hands
+// its objects back to the caches.
+static ABSL_ATTRIBUTE_NOINLINE void release_quarantined(
+    const QuarantineEntry* batch, size_t n) {
+  sync_pending_escapes();
+#ifdef DEFERRED_ESCAPE_POISON
+  // objects left to the deferred queue are released from there
+  bool deferred[QuarantineShard::kCapacity] = {};
+#endif
+  for (size_t i = 0; i < n; ++i) {
+    void* ptr = batch[i].ptr;
+    const size_t obj_size = batch[i].obj_size;
+    Span* span = tc_globals.pagemap().GetExistingDescriptor(PageIdContaining(ptr));
+    int idx = ((size_t)ptr - (size_t)span->start_address()) / obj_size;
+    PoisonValue poison((uintptr_t)ptr, batch[i].generation);
+#ifdef DEFERRED_ESCAPE_POISON
+    deferred[i] = !poison_escapes_bounded(span, idx, ptr, obj_size, poison);
+#else
+    poison_escapes(span, idx, ptr, (char*)ptr + obj_size, poison);
+#endif
+  }
+  for (size_t i = 0; i < n; ++i) {
+#ifdef DEFERRED_ESCAPE_POISON
+    if (deferred[i]) continue;
+#endif
+    // the hooks ran when the object was queued
+    FreeSmall<Hooks::NO>(batch[i].ptr, batch[i].size_class);
+  }
+}
+#endif
+
+#ifdef FREE_QUARANTINE
+// Parks the small object at ptr instead of freeing it.  Returns false if the
+// object has no size class (large or sampled objects are freed right away).
+static inline bool quarantine_free(void* ptr, size_t obj_size,
+                                   PoisonValue& poison) {
+  const size_t size_class =
+      tc_globals.pagemap().sizeclass(PageIdContaining(ptr));
+  if (size_class == 0) return false;
+  *(uintptr_t*)ptr = QuarantineShard::kMagic;
+  invoke_deferred_delete_hooks();
+  QuarantineEntry batch[QuarantineShard::kCapacity];
+  const size_t n = quarantine_shards[QuarantineShardIndex()].Push(
+      {ptr, (uint16_t)size_class, (uint16_t)poison.generation(),
+       (uint32_t)obj_size},
+      batch);
+  if (n != 0) {
+    release_quarantined(batch, n);
+#ifdef ENABLE_STATISTIC
+    tc_globals.quarantine_released_cnt.Add(n);
+#endif
+  }
+  return true;
+}
+#endif
+
+#ifdef ESCAPE_REFCOUNTS
+// Hands a batch of referenced objects taken from the quarantine back to the
+// caches.  Nothing wrote to them while they were parked unless a pointer
+// outlived them, so an object whose first word lost kMagic is reported as
+// used after free.
+static ABSL_ATTRIBUTE_NOINLINE void release_referenced(
+    const QuarantineEntry* batch, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    void* ptr = batch[i].ptr;
+    if (ABSL_PREDICT_FALSE(*(uintptr_t*)ptr != QuarantineShard::kMagic)) {
+#ifdef ENABLE_STATISTIC
+      tc_globals.escape_ref_overwritten.Add(1);
+#endif
+#ifdef ENABLE_ERROR_REPORT
+      TCMALLOC_REPORT_PROTECTION_ERROR(kUseAfterFree,
+          __builtin_return_address(0),
+          "write to a freed referenced object detected (address)", ptr);
+#endif
+      MaybeCrashOnCorruption();
+    }
+    FreeSmall<Hooks::RUN>(ptr, batch[i].size_class);
+  }
+#ifdef ENABLE_STATISTIC
+  tc_globals.quarantine_released_cnt.Add(n);
+#endif
+}
+
+// Parks the small object [ptr, ptr + obj_size) instead of freeing it if it
+// escaped since its count was last halved, so that pointers still holding
+// it do not see the next object in its slot for a while.  Returns false if
+// the object must be freed right away: it has no escapes counted, or no
+// size class (large or sampled objects are not quarantined).
+static inline bool quarantine_referenced(void* ptr, size_t obj_size,
+                                         PageId page) {
+  if (take_escape_refs(page, (uintptr_t)ptr, obj_size) == 0) return false;
+  const size_t size_class = tc_globals.pagemap().sizeclass(page);
+  if (size_class == 0) return false;
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_ref_quarantined.Add(1);
+#endif
+  *(uintptr_t*)ptr = QuarantineShard::kMagic;
+  QuarantineEntry batch[QuarantineShard::kCapacity];
+  const size_t n = referenced_quarantine[QuarantineShardIndex()].Push(
+      {ptr, (uint16_t)size_class, 0, (uint32_t)obj_size}, batch);
+  if (n != 0) release_referenced(batch, n);
+  return true;
+}
+#endif
+
+#ifdef REMOTE_FREE_QUEUE
+// Poisons and releases the objects remote CPUs queued for shard, and returns
+// their number.
+static ABSL_ATTRIBUTE_NOINLINE size_t drain_remote_frees(size_t shard) {
+  QuarantineEntry batch[QuarantineShard::kCapacity];
+  const size_t n = remote_free_queues[shard].Take(batch);
+  if (n == 0) return 0;
+  release_quarantined(batch, n);
+#ifdef ENABLE_STATISTIC
+  tc_globals.remote_free_drained_cnt.Add(n);
+#endif
+  return n;
+}
+#endif
+
+#if defined(ENABLE_STATISTIC) || defined(REMOTE_FREE_QUEUE)
+// Called by free() of the object [ptr, ptr + obj_size) before it looks at the
+// escape table.  Counts frees of objects with escapes on a CPU other than
+// the one that installed the table, whose chains and escaped locations were
+// last written over there.  With REMOTE_FREE_QUEUE such a small object is
+// queued for that CPU rather than poisoned here, and returns true; the home
+// CPU drains its queue in one batch on its next free with escapes, and
+// MallocExtension::ProcessBackgroundEscapes() drains all queues.  A full
+// queue is released by the freeing CPU.
+static inline bool remote_escape_free(void* ptr, size_t obj_size,
+                                      PoisonValue& poison) {
+  const PageId page = PageIdContaining(ptr);
+  if (ABSL_PREDICT_TRUE(!tc_globals.pagemap().HasEscapes(page))) return false;
+  const Span* span = tc_globals.pagemap().GetExistingDescriptor(page);
+  const size_t home =
+      escape_home_shard(span).load(std::memory_order_relaxed);
+  if (home == 0) return false;
+  const size_t shard = QuarantineShardIndex();
+  if (home - 1 == shard) {
+#ifdef REMOTE_FREE_QUEUE
+    if (!remote_free_queues[shard].MaybeEmpty()) drain_remote_frees(shard);
+#endif
+    return false;
+  }
+#ifdef ENABLE_STATISTIC
+  tc_globals.remote_escape_free_cnt.Add(1);
+#endif
+#ifdef REMOTE_FREE_QUEUE
+  const size_t size_class = tc_globals.pagemap().sizeclass(page);
+  if (size_class == 0) return false;
+  *(uintptr_t*)ptr = QuarantineShard::kMagic;
+  invoke_deferred_delete_hooks();
+  QuarantineEntry batch[QuarantineShard::kCapacity];
+  const size_t n = remote_free_queues[home - 1].Push(
+      {ptr, (uint16_t)size_class, (uint16_t)poison.generation(),
+       (uint32_t)obj_size},
+      batch);
+  if (n != 0) release_quarantined(batch, n);
+  return true;
+#else
+  return false;
+#endif
+}
+#endif
+
+// realloc() support: moves the escapes of the object at old_ptr to the object
+// at new_ptr, which received the first `moved` bytes of it.  Escaped
+// locations that still point into the moved bytes are rewritten to the same
+// offset of new_ptr; locations pointing past them are poisoned as free()
+// would.  Freeing old_ptr afterwards poisons nothing.
+static void migrate_escapes(void* old_ptr, size_t old_size, void* new_ptr,
+                            size_t moved) {
+  Span* old_span = tc_globals.pagemap().GetDescriptor(PageIdContaining(old_ptr));
+  Span* new_span = tc_globals.pagemap().GetDescriptor(PageIdContaining(new_ptr));
+  if (!old_span || !new_span || !old_span->obj_size || !new_span->obj_size)
     return;
+  const uintptr_t old_start = (uintptr_t)old_ptr;
+  const uintptr_t old_end = old_start + old_size;
+  const uintptr_t delta = (uintptr_t)new_ptr - old_start;
+  // Escapes are moved one part of the old object (see EscapeObjectBytes())
+  // at a time.  What is left of a part after the move lies in a single part
+  // of the new object.
+  const size_t old_obj_size = EscapeObjectBytes(old_span);
+  const size_t new_obj_size = EscapeObjectBytes(new_span);
+  const uintptr_t old_base = (uintptr_t)old_span->start_address();
+  const uintptr_t new_base = (uintptr_t)new_span->start_address();
+  auto new_part = [&](uintptr_t addr) {
+    return (addr + delta - new_base) / new_obj_size;
+  };
+
+  sync_pending_escapes();
+  // locations past the moved bytes are poisoned as a free of old_ptr would
+  PoisonValue poison(old_start);
+
+#ifdef ESCAPE_LOCATION_CLASSES
+  // the stack escapes are retargeted with the other staged ones
+  if (!thread_stack_escapes_.empty()) spill_stack_escapes(GetEscapeBuffer());
+#endif
+  // escapes staged by this thread now refer to the new object
+  if (EscapeBuffer* buffer = thread_state_.escape_buffer) {
+    for (uintptr_t run = old_start; run < old_end; run += old_obj_size) {
+      const size_t new_info =
+          ((new_base + new_part(run) * new_obj_size) << 24) |
+          EscapeObjectUnits(new_span);
+      buffer->ForEachOfObject(SMALL_PTR(run), [&](escape_cache* e) {
+        uintptr_t cur = (uintptr_t)*e->loc;
+        if (cur - old_start < moved) {
+          *e->loc = (void *)(cur + delta);
+          buffer->Retarget(e, new_info);
+        } else if (cur - old_start < old_size) {
+          if (CrashOnCorruption()) {
+            *(uintptr_t *)e->loc = poison(cur);
+          }
+          buffer->Poison(e);
+        }
+      });
+    }
+  }
 
-  struct escape* cur = escape_list[idx];
-  while (cur) {
-    struct escape *next = cur->next;
-    void* cur_addr = *(reinterpret_cast<void**>(cur->loc));
-    if (ptr <= cur_addr && cur_addr < end) {
-#ifdef CRASH_ON_CORRUPTION
-      *(reinterpret_cast<size_t*>(cur->loc)) |= (size_t) 0xdeadbeef00000000;
+  if (old_span->escape_list.load(std::memory_order_acquire) == nullptr)
+    return;
+  const size_t old_heads = EscapeTableSize(EscapeObjects(old_span));
+  const size_t new_heads = EscapeTableSize(EscapeObjects(new_span));
+  for (uintptr_t run = old_start; run < old_end; run += old_obj_size) {
+    const size_t old_idx = (run - old_base) / old_obj_size;
+    if (old_idx >= old_heads) break;
+    struct escape* head = detach_escapes(old_span, old_idx);
+    if (!head)
+      continue;
+
+    struct escape* tail = nullptr;
+    for (struct escape* cur = head; cur; tail = cur, cur = cur->next) {
+      const size_t chunk_size = EscapeChunkSize(cur);
+      for (size_t i = 0; i < chunk_size; i++) {
+        void** loc = (void**)EscapeChunkLoc(cur, i);
+#ifdef ESCAPE_CACHE_L2
+        tc_globals.escape_filter().Erase((uintptr_t)loc, run);
 #endif
-#ifdef PROTECTION_DEBUG
-      printf("poison escape: loc (%p) -> ptr (%p)\n", cur->loc, cur_addr);
+#ifdef OUTGOING_ESCAPE_INDEX
+        if (!escape_slot_live(loc)) continue;
 #endif
+        uintptr_t cur_addr = (uintptr_t)*loc;
+        if (cur_addr - old_start < moved) {
+          *loc = (void *)(cur_addr + delta);
+        } else if (cur_addr - old_start < old_size) {
+          if (CrashOnCorruption()) {
+            *(uintptr_t *)loc = poison(cur_addr);
+          }
+        }
+      }
+    }
+
+    const size_t new_idx = new_part(run);
+    if (run - old_start >= moved || new_idx >= new_heads) {
+      delete_escape_chain(head);
+      continue;
     }
-    delete_escape(cur);
-    cur = next;
+    // splice the whole chain in front of the new part's (normally empty) one
+    EscapeHead* new_head = get_or_install_escape_head(new_span, new_idx);
+    tail->next = lock_escape_head(new_head);
+    new_head->store(head, std::memory_order_release);
   }
-  escape_list[idx] = nullptr;
 }
 
+// If known_zero is given, sets it if the pages are known to read as zeroes.
 template <typename Policy, typename CapacityPtr = std::nullptr_t>
 inline void* do_malloc_pages(Policy policy, size_t size, int num_objects,
-                             CapacityPtr capacity = nullptr) {
+                             CapacityPtr capacity = nullptr,
+                             bool* known_zero = nullptr) {
   // Page allocator does not deal well with num_pages = 0.
   Length num_pages = std::max<Length>(BytesToLengthCeil(size), Length(1));
+#ifdef HEAP_PARTITIONS
+  const uint16_t partition = thread_state_.heap_partition;
+  if (!heap_partitions_.Charge(partition, num_pages.in_bytes())) {
+    SetPagesCapacity(nullptr, Length(0), capacity);
+    return nullptr;
+  }
+#endif
 
   MemoryTag tag = MemoryTag::kNormal;
   if (IsColdHint(policy.access())) {
@@ -1010,13 +3088,26 @@ inline void* do_malloc_pages(Policy policy, size_t size, int num_objects,
   } else if (tc_globals.numa_topology().numa_aware()) {
     tag = NumaNormalTag(policy.numa_partition());
   }
-  Span* span = tc_globals.page_allocator().NewAligned(
-      num_pages, BytesToLengthCeil(policy.align()), num_objects, tag);
+  Span* span;
+  if (known_zero != nullptr) {
+    span = tc_globals.page_allocator().NewAlignedKnownZero(
+        num_pages, BytesToLengthCeil(policy.align()), num_objects, tag,
+        known_zero);
+  } else {
+    span = tc_globals.page_allocator().NewAligned(
+        num_pages, BytesToLengthCeil(policy.align()), num_objects, tag);
+  }
 
   if (span == nullptr) {
+#ifdef HEAP_PARTITIONS
+    heap_partitions_.Uncharge(partition, num_pages.in_bytes());
+#endif
     SetPagesCapacity(nullptr, Length(0), capacity);
     return nullptr;
   }
+#ifdef HEAP_PARTITIONS
+  span->set_heap_partition(partition + 1);
+#endif
 
   void* result = span->start_address();
   ASSERT(!ColdFeatureActive() || tag == GetMemoryTag(span->start_address()));
@@ -1032,10 +3123,196 @@ inline void* do_malloc_pages(Policy policy, size_t size, int num_objects,
   }
 
   span->objects_per_span = (uint32_t)num_objects;
-  span->obj_size = (uint32_t) (GetSize(result) / 8);
+  span->set_object_bytes(GetSize(result));
+  tc_globals.pagemap().RegisterObjectSize(span);
   return result;
 }
 
+// Whether the hardware checks every access through ptr, so that a bounds
+// check of it has nothing left to do.
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE
+hardware_checked(const void* ptr) {
+#ifdef MEMORY_TAGGING
+  return PointerTags::hardware() &&
+         PointerTagOf(reinterpret_cast<uintptr_t>(ptr)) != 0;
+#else
+  (void)ptr;
+  return false;
+#endif
+}
+
+#ifdef REALLOC_MREMAP
+// Below this many bytes, copying costs less than remapping the pages and the
+// TLB shootdowns it takes.
+constexpr size_t kMinMovedBytes = 8 * kHugePageSize;
+
+// Moves the first `moved` bytes of the object at old_ptr to the one at
+// new_ptr.  If both are page allocations starting on a hugepage, their whole
+// hugepages are moved with SystemMovePages() and only the rest is copied;
+// the moved pages of old_ptr read as zeroes after.
+static void move_object(void* old_ptr, void* new_ptr, size_t moved) {
+  size_t remapped = 0;
+  void* const from = StripPointerTag(old_ptr);
+  void* const to = StripPointerTag(new_ptr);
+  // Remapped pages would keep the memory tags of old_ptr.
+  if (moved >= kMinMovedBytes && !hardware_checked(new_ptr) &&
+      reinterpret_cast<uintptr_t>(from) % kHugePageSize == 0 &&
+      reinterpret_cast<uintptr_t>(to) % kHugePageSize == 0 &&
+      IsNormalMemory(from) && GetMemoryTag(from) == GetMemoryTag(to) &&
+      tc_globals.pagemap().sizeclass(PageIdContaining(from)) == 0 &&
+      tc_globals.pagemap().sizeclass(PageIdContaining(to)) == 0) {
+    const size_t length = moved & ~(kHugePageSize - 1);
+    if (SystemMovePages(from, to, length)) remapped = length;
+  }
+  memcpy(static_cast<char*>(new_ptr) + remapped,
+         static_cast<char*>(old_ptr) + remapped, moved - remapped);
+}
+#endif
+
+#ifdef REALLOC_IN_PLACE
+#ifdef ENABLE_PROTECTION
+// Poisons the escapes into [new_end, old_end), the pages the page allocation
+// of span loses by shrinking in place, as a free of them would.  Only the
+// chains of the parts of the object (see EscapeObjectBytes()) the pages are
+// in are walked; those of the parts lost whole go with them.
+static void poison_trimmed_escapes(Span* span, uintptr_t new_end,
+                                   uintptr_t old_end) {
+  const uintptr_t base = (uintptr_t)span->start_address();
+  const size_t part_size = EscapeObjectBytes(span);
+  PoisonValue poison(base);
+  sync_pending_escapes();
+#ifdef ESCAPE_LOCATION_CLASSES
+  if (!thread_stack_escapes_.empty()) spill_stack_escapes(GetEscapeBuffer());
+#endif
+  EscapeBuffer* buffer = thread_state_.escape_buffer;
+  EscapeHead* list = span->escape_list.load(std::memory_order_acquire);
+  const size_t heads = EscapeTableSize(EscapeObjects(span));
+  for (size_t idx = (new_end - base) / part_size;; ++idx) {
+    const uintptr_t part = base + idx * part_size;
+    if (part >= old_end) break;
+    const uintptr_t lo = std::max(part, new_end);
+    const uintptr_t hi = std::min(part + part_size, old_end);
+    if (buffer != nullptr) {
+      buffer->ForEachOfObject(SMALL_PTR(part), [&](escape_cache* e) {
+        const uintptr_t cur = (uintptr_t)*e->loc;
+        if (cur - lo >= hi - lo) return;
+        if (CrashOnCorruption()) {
+          *(uintptr_t*)e->loc = poison(cur);
+        }
+        buffer->Poison(e);
+      });
+    }
+    if (list == nullptr || idx >= heads) continue;
+    if (lo == part) {
+      poison_escapes(span, idx, (void*)part, (void*)hi, poison);
+      continue;
+    }
+    // The part keeps its first pages, and its chain the escapes into them.
+    EscapeHead* escape_head = FindEscapeHead(list, idx);
+    if (escape_head == nullptr) continue;
+    struct escape* head = lock_escape_head(escape_head);
+    for (struct escape* cur = head; cur; cur = cur->next) {
+      const size_t chunk_size = EscapeChunkSize(cur);
+      for (size_t i = 0; i < chunk_size; i++) {
+        void** loc = (void**)EscapeChunkLoc(cur, i);
+        const uintptr_t cur_addr = (uintptr_t)*loc;
+        if (cur_addr - lo < hi - lo && CrashOnCorruption()) {
+          *(uintptr_t*)loc = poison(cur_addr);
+        }
+      }
+    }
+    escape_head->store(head, std::memory_order_release);
+  }
+}
+#endif
+
+// Grows or shrinks the page allocation at ptr to size bytes without moving
+// it, if the page allocator can resize its span.  The object keeps its
+// escapes and escape tables, so nothing is copied or migrated.  Returns
+// false for small and sampled objects, and when size would fit a size class.
+static bool do_resize_pages(void* ptr, size_t size) {
+  if (size <= kMaxSize) return false;
+  const PageId p = PageIdContaining(ptr);
+  if (tc_globals.pagemap().sizeclass(p) != 0) return false;
+  Span* span = tc_globals.pagemap().GetExistingDescriptor(p);
+  if (span == nullptr || span->sampled()) return false;
+  ASSERT(ptr == span->start_address());
+#ifdef OUTGOING_ESCAPE_INDEX
+  // Its outgoing escape index is sized for the pages it has now.
+  if (span->escape_slots.load(std::memory_order_acquire) != nullptr) {
+    return false;
+  }
+#endif
+
+  const size_t old_bytes = span->bytes_in_span();
+  const Length old_pages = span->num_pages();
+  const Length new_pages = BytesToLengthCeil(size);
+#ifdef PAGE_ESCAPE_CHAINS
+  // The escape table, if one is installed meanwhile, is sized for the page
+  // escape chains the object has now; it can take more or fewer only within
+  // the heads of its class (see alloc_escape_list()).
+  const size_t old_chains = EscapeObjects(span);
+  if (EscapeTableClass(old_chains) !=
+      EscapeTableClass(PageEscapeChains(new_pages.in_bytes()))) {
+    return false;
+  }
+#endif
+#ifdef ENABLE_PROTECTION
+  // The escapes into the pages it would lose are past the size asked for,
+  // so realloc() poisons them as well if the object has to move instead.
+  if (new_pages < old_pages) {
+    const uintptr_t start = (uintptr_t)ptr;
+    poison_trimmed_escapes(span, start + new_pages.in_bytes(),
+                           start + old_bytes);
+  }
+#endif
+#ifdef HEAP_PARTITIONS
+  // Growing is charged up front, so that it fails at the limit.
+  ASSERT(span->heap_partition() != 0);
+  const int partition = span->heap_partition() - 1;
+  const size_t new_bytes = new_pages.in_bytes();
+  if (new_bytes > old_bytes &&
+      !heap_partitions_.Charge(partition, new_bytes - old_bytes)) {
+    return false;
+  }
+#endif
+  if (!tc_globals.page_allocator().ResizeInPlace(
+          span, new_pages, span->objects_per_span, GetMemoryTag(ptr))) {
+#ifdef HEAP_PARTITIONS
+    if (new_bytes > old_bytes) {
+      heap_partitions_.Uncharge(partition, new_bytes - old_bytes);
+    }
+#endif
+    return false;
+  }
+#ifdef HEAP_PARTITIONS
+  if (new_bytes < old_bytes) {
+    heap_partitions_.Uncharge(partition, old_bytes - new_bytes);
+  }
+#endif
+  span->set_object_bytes(span->bytes_in_span());
+  tc_globals.pagemap().ResizeObject(span, old_pages);
+#ifdef PAGE_ESCAPE_CHAINS
+  // Chains of the parts lost may have had escapes committed to them since
+  // they were poisoned, by a flush that still saw the old size.
+  for (size_t idx = EscapeObjects(span); idx < EscapeTableSize(old_chains);
+       ++idx) {
+    delete_escape_chain(detach_escapes(span, idx));
+  }
+#endif
+#ifdef THREAD_ALLOCATION_STATS
+  if (span->bytes_in_span() > old_bytes) {
+    TCMALLOC_COUNT_THREAD(allocated_bytes, span->bytes_in_span() - old_bytes);
+  } else {
+    TCMALLOC_COUNT_THREAD(freed_bytes, old_bytes - span->bytes_in_span());
+  }
+#else
+  (void)old_bytes;
+#endif
+  return true;
+}
+#endif
+
 template <typename Policy, typename CapacityPtr>
 inline void* ABSL_ATTRIBUTE_ALWAYS_INLINE AllocSmall(Policy policy,
                                                      size_t size_class,
@@ -1067,6 +3344,87 @@ inline void* ABSL_ATTRIBUTE_ALWAYS_INLINE AllocSmall(Policy policy,
   return result;
 }
 
+#if defined(LARGE_FREE_OFFLOAD) || defined(SCRUB_ON_FREE)
+// Spans of large objects whose free() is completed by
+// MallocExtension::ProcessBackgroundEscapes(), see offload_free_pages().
+// Producers push with a CAS; the consumer detaches the whole stack with an
+// exchange, as for pending_escapes.
+ABSL_CONST_INIT static std::atomic<Span*> offloaded_frees{nullptr};
+ABSL_CONST_INIT static std::atomic<size_t> offloaded_frees_len{0};
+
+#ifdef SCRUB_ON_FREE
+// Every large object is scrubbed, which takes longer the larger it is, so
+// the background thread takes all of them.
+static constexpr size_t kOffloadFreeMinBytes = 0;
+#else
+// Frees of page allocations of at least this many bytes are offloaded.
+static constexpr size_t kOffloadFreeMinBytes = size_t{1} << 20;
+#endif
+
+// Past this many queued spans the background thread is not keeping up, and
+// free() does the work inline instead.
+static constexpr size_t kMaxOffloadedFrees = 64;
+
+// Queues the free of span, which holds a large object of normal memory, for
+// the background thread, unless it is smaller than kOffloadFreeMinBytes or
+// the thread is not running or not keeping up.  The span is unpublished
+// first, as sampled spans are in do_free_pages(): its page info is cleared,
+// so that checks against the object fail, and so is the pagemap entry of
+// every page, so that no escape flush can resolve a pointer into it to the
+// span while the background thread destroys its escapes, and a second free
+// of it is caught.  Both take time linear in the pages of the span, but are
+// stores to the page map only; the escapes, the scrubbing and the page heap
+// are left to the background thread.
+// Returns false if the caller is to free it itself.
+static bool offload_free_pages(Span* span) {
+  if (span->bytes_in_span() < kOffloadFreeMinBytes ||
+      !Parameters::background_escape_flush() ||
+      offloaded_frees_len.load(std::memory_order_relaxed) >=
+          kMaxOffloadedFrees) {
+    return false;
+  }
+  tc_globals.pagemap().UnregisterObjectSize(span);
+  for (PageId p = span->first_page(); p <= span->last_page(); ++p) {
+    tc_globals.pagemap().Set(p, nullptr);
+  }
+  offloaded_frees_len.fetch_add(1, std::memory_order_relaxed);
+  Span* head = offloaded_frees.load(std::memory_order_relaxed);
+  do {
+    span->set_offloaded_next(head);
+  } while (!offloaded_frees.compare_exchange_weak(head, span,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed));
+  return true;
+}
+
+// Destroys the escapes of the queued spans, with SCRUB_ON_FREE zeroes them,
+// and returns them to the page heap.  Returns how many there were.
+static size_t complete_offloaded_frees() {
+  Span* list = offloaded_frees.exchange(nullptr, std::memory_order_acquire);
+  size_t n = 0;
+  while (list != nullptr) {
+    Span* span = list;
+    list = span->offloaded_next();
+#ifdef SCRUB_ON_FREE
+    ScrubNonTemporal(span->start_address(), span->bytes_in_span());
+#endif
+    span->DestroyEscape();
+    const MemoryTag tag = kNumaPartitions != 1
+                              ? GetMemoryTag(span->start_address())
+                              : MemoryTag::kNormal;
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    // The page heap finds the spans to coalesce with through the pagemap
+    // entries of their first and last pages.
+    tc_globals.pagemap().Set(span->first_page(), span);
+    tc_globals.pagemap().Set(span->last_page(), span);
+    tc_globals.page_allocator().Delete(span, 1, tag);
+    n++;
+  }
+  offloaded_frees_len.fetch_sub(n, std::memory_order_relaxed);
+  return n;
+}
+#endif
+
 // Handles freeing object that doesn't have size class, i.e. which
 // is either large or sampled. We explicitly prevent inlining it to
 // keep it out of fast-path. This helps avoid expensive
@@ -1082,6 +3440,10 @@ static void do_free_pages(void* ptr, const PageId p) {
   // state cleared only once. External synchronization when freeing is required;
   // otherwise, concurrent writes here would likely report a double-free.
   if (SampledAllocation* sampled_allocation = span->Unsample()) {
+#ifdef LIFETIME_PROTECTION
+    // Objects quarantined by protect_free() are recorded already.
+    record_lifetime(sampled_allocation);
+#endif
     void* const proxy = sampled_allocation->sampled_stack.proxy;
     const size_t weight = sampled_allocation->sampled_stack.weight;
     const size_t requested_size =
@@ -1094,6 +3456,10 @@ static void do_free_pages(void* ptr, const PageId p) {
     // frequency (weight) and its size.
     const double allocation_estimate =
         static_cast<double>(weight) / (requested_size + 1);
+#ifdef CONTINUOUS_PROFILE
+    ContinuousProfiler::RecordFree(sampled_allocation->sampled_stack,
+                                   allocation_estimate);
+#endif
     tc_globals.sampled_allocation_recorder().Unregister(sampled_allocation);
 
     // Adjust our estimate of internal fragmentation.
@@ -1124,21 +3490,49 @@ static void do_free_pages(void* ptr, const PageId p) {
     }
   }
 
+  if (IsSampledMemory(ptr) &&
+      tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
+    // The span is unpublished before anything else, so that no lookup can
+    // reach it and record an escape into it once its escapes are destroyed,
+    // and before Deallocate(), after which the slot may be handed out again
+    // and published under a new span.  None of this needs pageheap_lock.
+    ASSERT(span->first_page() == p);
+    tc_globals.pagemap().UnregisterObjectSize(span);
+    for (PageId p = span->first_page(); p <= span->last_page(); ++p) {
+      tc_globals.pagemap().Set(p, nullptr);
+    }
+    span->DestroyEscape();
+#ifdef SCRUB_ON_FREE
+    Scrub(ptr, tc_globals.guardedpage_allocator().GetRequestedSize(ptr));
+#endif
+    tc_globals.guardedpage_allocator().Deallocate(ptr);
+#ifdef SPAN_CACHE
+    Span::DeleteCached(span);
+#else
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    Span::Delete(span);
+#endif
+    return;
+  }
+
+#ifdef HEAP_PARTITIONS
+  if (const uint16_t charged = span->heap_partition(); charged != 0) {
+    heap_partitions_.Uncharge(charged - 1, span->bytes_in_span());
+  }
+#endif
+#if defined(LARGE_FREE_OFFLOAD) || defined(SCRUB_ON_FREE)
+  if (!IsSampledMemory(ptr) && offload_free_pages(span)) return;
+#endif
+#ifdef SCRUB_ON_FREE
+  ScrubNonTemporal(span->start_address(), span->bytes_in_span());
+#endif
+  span->DestroyEscape();
   {
     absl::base_internal::SpinLockHolder h(&pageheap_lock);
     ASSERT(span->first_page() == p);
+    tc_globals.pagemap().UnregisterObjectSize(span);
     if (IsSampledMemory(ptr)) {
-      if (tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
-        // Release lock while calling Deallocate() since it does a system call.
-        pageheap_lock.Unlock();
-        tc_globals.guardedpage_allocator().Deallocate(ptr);
-        pageheap_lock.Lock();
-        span->DestroyEscape();
-        for (PageId p = span->first_page(); p <= span->last_page(); ++p) {
-          tc_globals.pagemap().Set(p, nullptr);
-        }
-        Span::Delete(span);
-      } else if (IsColdMemory(ptr)) {
+      if (IsColdMemory(ptr)) {
         ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
         tc_globals.page_allocator().Delete(span, 1, MemoryTag::kCold);
     } else {
@@ -1155,12 +3549,366 @@ static void do_free_pages(void* ptr, const PageId p) {
   }
 }
 
-#ifndef NDEBUG
-static size_t GetSizeClass(void* ptr) {
-  const PageId p = PageIdContaining(ptr);
-  return tc_globals.pagemap().sizeclass(p);
+#ifndef NDEBUG
+static size_t GetSizeClass(void* ptr) {
+  const PageId p = PageIdContaining(ptr);
+  return tc_globals.pagemap().sizeclass(p);
+}
+#endif
+
+#ifdef LIFETIME_PROTECTION
+// Hands a batch of short-lived objects taken from the quarantine back to the
+// page heap.  They have no escapes to poison.
+static ABSL_ATTRIBUTE_NOINLINE void release_short_lived(
+    const QuarantineEntry* batch, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    void* ptr = batch[i].ptr;
+    invoke_delete_hooks_and_free<do_free_pages, Hooks::RUN>(
+        ptr, PageIdContaining(ptr));
+  }
+}
+
+// Records the lifetime of the sampled object at ptr, and parks it if it was
+// predicted short-lived.  Escapes into such an object are never tracked, so
+// keeping it out of reuse for a while is what protects the pointers to it.
+// Returns false if the object is to be freed as usual.
+static bool quarantine_short_lived(void* ptr, size_t obj_size) {
+  Span* span = tc_globals.pagemap().GetExistingDescriptor(PageIdContaining(ptr));
+  if (!span->sampled()) return false;
+  SampledAllocation* sampled_allocation = span->sampled_allocation();
+  record_lifetime(sampled_allocation);
+  if (!sampled_allocation->short_lived) return false;
+  *(uintptr_t*)ptr = QuarantineShard::kMagic;
+  QuarantineEntry batch[QuarantineShard::kCapacity];
+  const size_t n = short_lived_quarantine.Push(
+      {ptr, 0, 0, (uint32_t)obj_size}, batch);
+  if (n != 0) {
+    release_short_lived(batch, n);
+#ifdef ENABLE_STATISTIC
+    tc_globals.quarantine_released_cnt.Add(n);
+#endif
+  }
+  return true;
+}
+#endif
+
+#ifdef DEFERRED_ESCAPE_POISON
+// Poisons the rest of the chain of a deferred object and hands the object
+// back to the caches or the page heap.
+static ABSL_ATTRIBUTE_NOINLINE void finish_deferred_poison(
+    const DeferredPoisonEntry& e) {
+  void* ptr = e.object.ptr;
+  PoisonValue poison((uintptr_t)ptr, e.object.generation);
+  poison_escape_chunks(e.rest, ptr, (char*)ptr + e.object.obj_size, poison,
+                       ~size_t{0});
+  if (e.object.size_class != 0) {
+    FreeSmall<Hooks::RUN>(ptr, e.object.size_class);
+  } else {
+    invoke_delete_hooks_and_free<do_free_pages, Hooks::RUN>(
+        ptr, PageIdContaining(ptr));
+  }
+}
+
+// Poisons the committed escapes to the object [ptr, ptr + obj_size) of
+// span, but no more than Parameters::escape_poison_chunk_limit() chunks of
+// them, so a free() of an object with a huge fan-in (a shared config, an
+// intern table) takes bounded time.  The chain is its own counter: the
+// chunks are counted as they are poisoned.  If some are left, the object is
+// queued with them instead of being released, and false is returned; the
+// caller must not release it.
+static bool poison_escapes_bounded(Span* span, int idx, void* ptr,
+                                   size_t obj_size, PoisonValue& poison) {
+  TCMALLOC_TIME_PROTECTION(kPoisonEscapes);
+  struct escape* head = detach_escapes(span, idx);
+  if (head == nullptr) return true;
+  void* end = (char*)ptr + obj_size;
+  const int64_t limit = Parameters::escape_poison_chunk_limit();
+  if (limit <= 0 || obj_size > UINT32_MAX) {
+    poison_escape_chunks(head, ptr, end, poison, ~size_t{0});
+    return true;
+  }
+  struct escape* rest = poison_escape_chunks(head, ptr, end, poison, limit);
+  if (ABSL_PREDICT_TRUE(rest == nullptr)) return true;
+
+  const size_t size_class =
+      tc_globals.pagemap().sizeclass(PageIdContaining(ptr));
+  *(uintptr_t*)ptr = QuarantineShard::kMagic;
+  DeferredPoisonEntry evicted;
+  const bool full = deferred_poison_queue.Push(
+      {{ptr, (uint16_t)size_class, (uint16_t)poison.generation(),
+        (uint32_t)obj_size},
+       rest},
+      &evicted);
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_deferred_cnt.Add(1);
+  if (full) tc_globals.escape_deferred_evicted.Add(1);
+#endif
+  if (full) finish_deferred_poison(evicted);
+  return false;
+}
+#endif
+
+#ifdef PAGE_ESCAPE_CHAINS
+// Poisons the escapes, staged and committed, to the object [start, start +
+// obj_size) at page, a page allocation with page escape chains: each run of
+// its pages is poisoned as protect_free() poisons an object.
+static ABSL_ATTRIBUTE_NOINLINE void poison_page_escape_chains(
+    PageId page, uintptr_t start, size_t obj_size, PoisonValue& poison) {
+  const uintptr_t end = start + obj_size;
+  for (uintptr_t run = start; run < end; run += kPageEscapeChainBytes) {
+    poison_staged_escapes((void*)run,
+                          std::min(kPageEscapeChainBytes, end - run), poison);
+  }
+  sync_pending_escapes();
+  if (ABSL_PREDICT_TRUE(!tc_globals.pagemap().HasEscapes(page))) return;
+  Span* span = tc_globals.pagemap().GetExistingDescriptor(page);
+  if (span->escape_list.load(std::memory_order_acquire) == nullptr) return;
+  const size_t chains = EscapeTableSize(PageEscapeChains(obj_size));
+  for (size_t idx = 0; idx < chains; ++idx) {
+    const uintptr_t run = start + idx * kPageEscapeChainBytes;
+    poison_escapes(span, idx, (void*)run,
+                   (void*)std::min(run + kPageEscapeChainBytes, end), poison);
+  }
+}
+#endif
+
+#ifdef ENABLE_PROTECTION
+// Validates a free of ptr and poisons the escapes to its object.  Returns
+// false if the object must not be released now: the free was invalid (and
+// reported), or the object went into the quarantine.
+//
+// The chunk is validated from the page info word alone, without GetSize()
+// or a modulo.  The Span is only read for its escape table, and only if the
+// page info says the span ever got one.  Without track_escapes, the free is
+// only validated.
+template <bool track_escapes = true>
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE protect_free(void* ptr) {
+  uintptr_t start, end;
+  if (ABSL_PREDICT_FALSE(!InlineChunkRange((uintptr_t)ptr, &start, &end))) {
+    if (IsPoisoned(reinterpret_cast<uintptr_t>(ptr))) {
+#ifdef ENABLE_ERROR_REPORT
+      TCMALLOC_REPORT_PROTECTION_ERROR(
+        kInvalidFree, __builtin_return_address(0),
+        "double/invalid free detected (address, generation)",
+        reinterpret_cast<void*>(PoisonedAddress((uintptr_t)ptr)),
+        PoisonGeneration((uintptr_t)ptr));
+#endif
+    } else {
+#ifdef ENABLE_ERROR_REPORT
+      TCMALLOC_REPORT_PROTECTION_ERROR(
+        kInvalidFree, __builtin_return_address(0),
+        "freeing a pointer with no span", ptr);
+#endif
+    }
+    MaybeCrashOnCorruption();
+    return false;
+  }
+  if (ABSL_PREDICT_FALSE(start != (uintptr_t)ptr)) {
+#ifdef ENABLE_ERROR_REPORT
+    TCMALLOC_REPORT_PROTECTION_ERROR(kInvalidFree, __builtin_return_address(0),
+        "double/invalid free detected");
+#endif
+    MaybeCrashOnCorruption();
+    return false;
+  }
+#ifdef CLASS_REGIONS
+  // The address bits place ptr at an object of its region's class, but only
+  // the page map knows whether a span of that class holds the slot now.
+  // The free path reads the same word next.
+  if (const size_t size_class = ClassRegions::SizeClass(start);
+      ABSL_PREDICT_FALSE(size_class != 0 &&
+                         tc_globals.pagemap().sizeclass(PageIdContaining(
+                             ptr)) != size_class)) {
+#ifdef ENABLE_ERROR_REPORT
+    TCMALLOC_REPORT_PROTECTION_ERROR(kInvalidFree, __builtin_return_address(0),
+        "freeing a pointer with no span", ptr);
+#endif
+    MaybeCrashOnCorruption();
+    return false;
+  }
+#endif
+  const size_t obj_size = end - start;
+  ASSERT(obj_size == GetSize(ptr));
+#ifdef COLD_SKIP_ESCAPES
+  // Cold objects are validated like the others but have no escapes to
+  // poison, and skip the quarantine.
+  if (ABSL_PREDICT_FALSE(IsColdMemory(ptr))) return true;
+#endif
+  const PageId page = PageIdContaining(ptr);
+  // The escape list of a span that has one is a cold miss by the time its
+  // objects are freed.  Start loading it now so the miss overlaps with
+  // flushing the staged escapes and the quarantine below.
+  if (tc_globals.pagemap().HasEscapes(page)) {
+    tc_globals.pagemap().GetExistingDescriptor(page)->Prefetch();
+  }
+#if defined(FREE_QUARANTINE) || defined(REMOTE_FREE_QUEUE) || \
+    defined(LIFETIME_PROTECTION) || defined(DEFERRED_ESCAPE_POISON) || \
+    defined(ESCAPE_REFCOUNTS)
+  if (ABSL_PREDICT_FALSE(*(uintptr_t*)ptr == QuarantineShard::kMagic) &&
+      is_quarantined(ptr)) {
+#ifdef ENABLE_ERROR_REPORT
+    TCMALLOC_REPORT_PROTECTION_ERROR(kInvalidFree, __builtin_return_address(0),
+        "double/invalid free detected");
+#endif
+    MaybeCrashOnCorruption();
+    return false;
+  }
+#endif
+  if (!track_escapes) return true;
+#ifdef OUTGOING_ESCAPE_INDEX
+  // Prune the escapes held in the object while it is intact, before it is
+  // quarantined below and its first word overwritten.
+  if (tc_globals.pagemap().HasEscapes(page)) {
+    prune_outgoing_escapes(tc_globals.pagemap().GetExistingDescriptor(page),
+                           ptr, obj_size);
+  }
+#endif
+#ifdef LIFETIME_PROTECTION
+  if (ABSL_PREDICT_FALSE(IsSampledMemory(ptr)) &&
+      quarantine_short_lived(ptr, obj_size)) {
+    return false;
+  }
+#endif
+#ifdef ESCAPE_REFCOUNTS
+  // There are no escape lists to poison; the count decides.
+  return !quarantine_referenced(ptr, obj_size, page);
+#endif
+  // free all escapes to p
+  PoisonValue poison(start);
+#ifdef PAGE_ESCAPE_CHAINS
+  // Not quarantined or queued remotely either, having no size class.
+  if (ABSL_PREDICT_FALSE(obj_size > kPageEscapeChainBytes)) {
+    poison_page_escape_chains(page, start, obj_size, poison);
+    return true;
+  }
+#endif
+  poison_staged_escapes(ptr, obj_size, poison);
+#ifdef FREE_QUARANTINE
+  if (quarantine_free(ptr, obj_size, poison)) return false;
+#endif
+#if defined(ENABLE_STATISTIC) || defined(REMOTE_FREE_QUEUE)
+  if (remote_escape_free(ptr, obj_size, poison)) return false;
+#endif
+  // Handed-off escapes may still create the escape table, so commit them
+  // before looking at it.
+  sync_pending_escapes();
+  if (ABSL_PREDICT_TRUE(!tc_globals.pagemap().HasEscapes(page))) return true;
+  Span* span = tc_globals.pagemap().GetExistingDescriptor(page);
+  if (span->escape_list.load(std::memory_order_acquire) != nullptr) {
+    int idx = (start - (uintptr_t)span->start_address()) / obj_size;
+#ifdef DEFERRED_ESCAPE_POISON
+    return poison_escapes_bounded(span, idx, ptr, obj_size, poison);
+#else
+    poison_escapes(span, idx, ptr, (char*)ptr + obj_size, poison);
+#endif
+  }
+  return true;
+}
+#endif  // ENABLE_PROTECTION
+
+#ifdef POINTER_TAGGING
+#ifdef MEMORY_TAGGING
+// Bytes of the object at the untagged address addr if the hardware can tag
+// it: it has a size class that is a multiple of kMemoryTagGranule or pages
+// of its own.  0 for objects sharing granules with their neighbours and for
+// memory outside the page heap.
+static inline size_t memory_tagged_size(uintptr_t addr) {
+  const PageId p = PageIdContaining(reinterpret_cast<void*>(addr));
+  const size_t size_class = tc_globals.pagemap().sizeclass(p);
+  if (size_class != 0) {
+    const size_t size = tc_globals.sizemap().class_to_size(size_class);
+    return size % kMemoryTagGranule == 0 ? size : 0;
+  }
+  const Span* span = tc_globals.pagemap().GetDescriptor(p);
+  return span != nullptr && span->start_address() ==
+                                reinterpret_cast<void*>(addr)
+             ? span->bytes_in_span()
+             : 0;
+}
+#endif
+
+// Tags a pointer returned by the allocator with the current tag of its
+// object, handing out the first tag to objects that never had one.  With
+// MEMORY_TAGGING the object's granules take the tag as well, and objects the
+// hardware cannot tag are returned untagged.
+static inline void* ABSL_ATTRIBUTE_ALWAYS_INLINE tag_alloc(void* ptr) {
+  if (!PointerTags::enabled() || ABSL_PREDICT_FALSE(ptr == nullptr)) {
+    return ptr;
+  }
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+  uint8_t* slot = tc_globals.pagemap().TagSlot(addr);
+  if (ABSL_PREDICT_FALSE(slot == nullptr)) return ptr;
+  uint8_t tag = __atomic_load_n(slot, __ATOMIC_RELAXED);
+#ifdef MEMORY_TAGGING
+  if (PointerTags::hardware()) {
+    const size_t size = memory_tagged_size(addr);
+    if (size == 0) return ptr;
+    if (ABSL_PREDICT_FALSE(tag == 0)) {
+      tag = NextMemoryTag(0, addr, size);
+      __atomic_store_n(slot, tag, __ATOMIC_RELAXED);
+    }
+    const uintptr_t tagged = ApplyPointerTag(addr, tag);
+    SetMemoryTags(tagged, size);
+    return reinterpret_cast<void*>(tagged);
+  }
+#endif
+  if (ABSL_PREDICT_FALSE(tag == 0)) {
+    tag = NextPointerTag(0);
+    __atomic_store_n(slot, tag, __ATOMIC_RELAXED);
+  }
+  return reinterpret_cast<void*>(ApplyPointerTag(addr, tag));
+}
+
+// Strips the tag off a pointer being freed and moves its object to the next
+// tag, so every pointer still holding the old one fails its next check.  A
+// pointer whose tag is already stale is a double free; it is reported and
+// nullptr is returned.
+static inline void* ABSL_ATTRIBUTE_ALWAYS_INLINE retag_free(void* ptr) {
+  if (!PointerTags::enabled() || ABSL_PREDICT_FALSE(ptr == nullptr)) {
+    return ptr;
+  }
+  const uintptr_t tagged = reinterpret_cast<uintptr_t>(ptr);
+  const uintptr_t addr = StripPointerTag(tagged);
+  uint8_t* slot = tc_globals.pagemap().TagSlot(addr);
+  if (ABSL_PREDICT_FALSE(slot == nullptr)) {
+    return reinterpret_cast<void*>(addr);
+  }
+  const uint8_t tag = __atomic_load_n(slot, __ATOMIC_RELAXED);
+  const uint8_t ptr_tag = PointerTagOf(tagged);
+  if (ABSL_PREDICT_FALSE(ptr_tag != 0 && ptr_tag != tag)) {
+#ifdef ENABLE_ERROR_REPORT
+    TCMALLOC_REPORT_PROTECTION_ERROR(kInvalidFree, __builtin_return_address(0),
+        "double/invalid free detected (address, tag, current tag)",
+        reinterpret_cast<void*>(addr), ptr_tag, tag);
+#endif
+    MaybeCrashOnCorruption();
+    return nullptr;
+  }
+#ifdef MEMORY_TAGGING
+  if (PointerTags::hardware()) {
+    // Only objects handed out tagged have tagged granules.  They go back to
+    // tag 0 before the allocator writes its free lists into them.
+    const size_t size = ptr_tag != 0 ? memory_tagged_size(addr) : 0;
+    if (size != 0) {
+      __atomic_store_n(slot, NextMemoryTag(tag, addr, size), __ATOMIC_RELAXED);
+      SetMemoryTags(addr, size);
+    }
+    return reinterpret_cast<void*>(addr);
+  }
+#endif
+  __atomic_store_n(slot, NextPointerTag(tag), __ATOMIC_RELAXED);
+  return reinterpret_cast<void*>(addr);
+}
+
+// Whether the tags, rather than the escape lists, protect the object ptr
+// points to.  With MEMORY_TAGGING, objects handed out untagged do not
+// have their pointers checked and keep being tracked.
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE tags_protect(const void* ptr) {
+  if (!PointerTags::enabled()) return false;
+  return !PointerTags::hardware() ||
+         PointerTagOf(reinterpret_cast<uintptr_t>(ptr)) != 0;
 }
-#endif
+#endif  // POINTER_TAGGING
 
 // Helper for the object deletion (free, delete, etc.).  Inputs:
 //   ptr is object to be freed
@@ -1173,12 +3921,20 @@ static size_t GetSizeClass(void* ptr) {
 // would know that places that call this function with explicit 0 is
 // "have_size_class-case" and others are "!have_size_class-case". But we
 // certainly don't have such compiler. See also do_free_with_size below.
-template <bool have_size_class, Hooks hooks_state>
+//
+// ProtectionPolicy is that of the allocation; see tcmalloc_policy.h.
+template <bool have_size_class, Hooks hooks_state,
+          typename ProtectionPolicy = FullProtectionPolicy>
 inline ABSL_ATTRIBUTE_ALWAYS_INLINE void do_free_with_size_class(
     void* ptr, size_t size_class) {
   // !have_size_class -> size_class == 0
   ASSERT(have_size_class || size_class == 0);
 
+#ifdef POINTER_TAGGING
+  // do_free_with_size() has already retagged sized frees.  A stale tag turns
+  // ptr into nullptr, which is dropped below.
+  if (!have_size_class) ptr = retag_free(ptr);
+#endif
   const PageId p = PageIdContaining(ptr);
 
   // if we have_size_class, then we've excluded ptr == nullptr case. See
@@ -1196,69 +3952,12 @@ inline ABSL_ATTRIBUTE_ALWAYS_INLINE void do_free_with_size_class(
   ASSERT(tc_globals.IsInited());
 
 #ifdef ENABLE_STATISTIC
-  tc_globals.free_cnt++;
+  tc_globals.free_cnt.Add(1);
 #endif
+  TCMALLOC_COUNT_THREAD(frees, 1);
 
 #ifdef ENABLE_PROTECTION
-  Span* span_ = tc_globals.pagemap().GetDescriptor(p);
-  if (span_) {
-    // check if is invalid free
-    // if sizeclass is 0, then the span is dedicated to the page
-    // the check is done in the following.
-    // fixme
-    size_t obj_size = GetSize(ptr);
-    CHECK_CONDITION(obj_size == span_->obj_size * 8ULL);
-    CHECK_CONDITION(obj_size != 0);
-    size_t start_addr = (size_t)span_->start_address();
-    if (((size_t)ptr - start_addr) % obj_size != 0) {
-#ifdef ENABLE_ERROR_REPORT
-      Log(kLogWithStack, __FILE__, __LINE__,
-          "double/invalid free detected");
-#endif
-#ifdef CRASH_ON_CORRUPTION
-      fflush(stdout);
-      abort();
-#endif
-      return;
-    }
-    // free all escapes to p
-    int idx = ((size_t)ptr - start_addr) / obj_size;
-    poison_escapes(span_, idx, ptr, (char*)ptr + obj_size);
-    for (int i=0; i<tc_globals.escape_pos; i++) {
-      if (OBJ_START(tc_globals.escape_caches[i].ptr) != SMALL_PTR(ptr))
-        continue;
-      void **loc = tc_globals.escape_caches[i].loc;
-      void *real_ptr = *loc;
-      if ((size_t)ptr <= (size_t)real_ptr && (size_t)real_ptr < ((size_t)ptr + obj_size)) {
-#ifdef PROTECTION_DEBUG
-        printf("poison escape: loc (%p) -> ptr (%p)\n", loc, real_ptr);
-#endif
-
-#ifdef CRASH_ON_CORRUPTION
-        *(size_t *)loc = (size_t)real_ptr | 0xdeadbeef00000000;
-#endif
-        // need to make sure flush will skip this entry
-        tc_globals.escape_caches[i].ptr = -1;
-      }
-    }
-  } else {
-    if ((reinterpret_cast<uintptr_t>(ptr) & 0xdeadbeef00000000) == 0xdeadbeef00000000) {
-#ifdef ENABLE_ERROR_REPORT
-      Log(kLogWithStack, __FILE__, __LINE__,
-        "double/invalid free detected");
-#endif
-    } else {
-#ifdef ENABLE_ERROR_REPORT
-      Log(kLogWithStack, __FILE__, __LINE__,
-        "freeing a pointer with no span", ptr);
-#endif
-    }
-#ifdef CRASH_ON_CORRUPTION
-    fflush(stdout);
-    abort();
-#endif
-    return;
-  }
+  if (!protect_free<ProtectionPolicy::track_escapes()>(ptr)) return;
 #endif // END of ENABLE_PROTECTION
 
   if (!have_size_class) {
@@ -1268,13 +3967,18 @@ inline ABSL_ATTRIBUTE_ALWAYS_INLINE void do_free_with_size_class(
     ASSERT(size_class == GetSizeClass(ptr));
     ASSERT(ptr != nullptr);
     ASSERT(!tc_globals.pagemap().GetExistingDescriptor(p)->sampled());
+    TCMALLOC_COUNT_THREAD(freed_bytes,
+                          tc_globals.sizemap().class_to_size(size_class));
     FreeSmall<hooks_state>(ptr, size_class);
   } else {
+    TCMALLOC_COUNT_THREAD(freed_bytes, GetSize(ptr));
     invoke_delete_hooks_and_free<do_free_pages, hooks_state>(ptr, p);
   }
 }
 
 inline ABSL_ATTRIBUTE_ALWAYS_INLINE void do_free(void* ptr) {
+  TCMALLOC_TRACE_EVENT(kFree, ptr, nullptr, 0);
+  TCMALLOC_CAPTURE_EVENT(kFree, ptr, nullptr, 0);
   return do_free_with_size_class<false, Hooks::RUN>(ptr, 0);
 }
 
@@ -1282,12 +3986,129 @@ void do_free_no_hooks(void* ptr) {
   return do_free_with_size_class<false, Hooks::NO>(ptr, 0);
 }
 
+// Like do_free(), for an object allocated under `policy`: the protection
+// work its policy compiles out is skipped here too.
+template <typename Policy>
+inline ABSL_ATTRIBUTE_ALWAYS_INLINE void do_free_with_policy(void* ptr,
+                                                             Policy policy) {
+  TCMALLOC_TRACE_EVENT(kFree, ptr, nullptr, 0);
+  TCMALLOC_CAPTURE_EVENT(kFree, ptr, nullptr, 0);
+  return do_free_with_size_class<false, Hooks::RUN, Policy>(ptr, 0);
+}
+
+// Returns a run of objects of one size class, already validated, to the
+// per-CPU cache together.
+static inline void FreeSmallRun(void** run, size_t n, size_t size_class) {
+#ifndef TCMALLOC_DEPRECATED_PERTHREAD
+  if (ABSL_PREDICT_TRUE(GetThreadSampler()->IsOnFastPath())) {
+    ASSERT(tc_globals.CpuCacheActive());
+    tc_globals.cpu_cache().DeallocateBatch(size_class, run, n);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; ++i) {
+    FreeSmall<Hooks::RUN>(run[i], size_class);
+  }
+}
+
+// Frees ptrs[0, n) like n calls to do_free().  Every pointer is validated
+// and its escapes poisoned first, in one pass over the batch, and runs of
+// small objects of the same size class then go back to the per-CPU cache in
+// one restartable sequence per run.
+void do_free_batch(void* const* ptrs, size_t n) {
+  void* run[kMaxObjectsToMove];
+  size_t run_length = 0;
+  size_t run_class = 0;
+  for (size_t i = 0; i < n; ++i) {
+    void* ptr = ptrs[i];
+    TCMALLOC_TRACE_EVENT(kFree, ptr, nullptr, 0);
+    TCMALLOC_CAPTURE_EVENT(kFree, ptr, nullptr, 0);
+#ifdef POINTER_TAGGING
+    ptr = retag_free(ptr);
+#endif
+    if (ABSL_PREDICT_FALSE(ptr == nullptr)) continue;
+#ifdef ENABLE_STATISTIC
+    tc_globals.free_cnt.Add(1);
+#endif
+    TCMALLOC_COUNT_THREAD(frees, 1);
+#ifdef ENABLE_PROTECTION
+    if (!protect_free(ptr)) continue;
+#endif
+    const PageId p = PageIdContaining(ptr);
+    const size_t size_class = tc_globals.pagemap().sizeclass(p);
+    if (ABSL_PREDICT_FALSE(size_class == 0)) {
+      TCMALLOC_COUNT_THREAD(freed_bytes, GetSize(ptr));
+      invoke_delete_hooks_and_free<do_free_pages, Hooks::RUN>(ptr, p);
+      continue;
+    }
+    TCMALLOC_COUNT_THREAD(freed_bytes,
+                          tc_globals.sizemap().class_to_size(size_class));
+    if (size_class != run_class || run_length == kMaxObjectsToMove) {
+      if (run_length != 0) FreeSmallRun(run, run_length, run_class);
+      run_length = 0;
+      run_class = size_class;
+    }
+    run[run_length++] = ptr;
+  }
+  if (run_length != 0) FreeSmallRun(run, run_length, run_class);
+}
+
+// Objects of a size class tcmalloc_prefetch_alloc() prefetches: the start of
+// a burst, without pushing the rest of the cache out of L1.
+constexpr size_t kPrefetchAllocObjects = 4;
+
+// Prefetches for write the objects the next allocations of size would get
+// from the current cpu's cache and, with ENABLE_PROTECTION, the heads of
+// their escape chains, which the first __escape() of each object takes.
+void do_prefetch_alloc(size_t size) {
+#ifndef TCMALLOC_DEPRECATED_PERTHREAD
+  if (ABSL_PREDICT_FALSE(!tc_globals.IsInited()) || !UsePerCpuCache()) return;
+  // the same padding byte as fast_alloc_untraced()
+#ifdef ENABLE_PROTECTION
+  const size_t padded = MallocPolicy::pad_requests() ? size + 1 : size;
+#else
+  const size_t padded = size;
+#endif
+  uint32_t size_class;
+  if (!tc_globals.sizemap().GetSizeClass(MallocPolicy(), padded, &size_class)) {
+    return;
+  }
+  void* objects[kPrefetchAllocObjects];
+  const size_t n = tc_globals.cpu_cache().PeekAllocations(
+      size_class, objects, kPrefetchAllocObjects);
+  for (size_t i = 0; i < n; ++i) {
+    __builtin_prefetch(objects[i], 1, 3);
+  }
+#ifdef ENABLE_PROTECTION
+  // Sparse tables are probed, so only per-object tables are prefetched.
+  for (size_t i = 0; i < n; ++i) {
+    Span* span =
+        tc_globals.pagemap().GetDescriptor(PageIdContaining(objects[i]));
+    if (span == nullptr) continue;
+    EscapeHead* list = span->escape_list.load(std::memory_order_acquire);
+    const size_t obj_size = span->object_bytes();
+    if (list == nullptr || obj_size == 0) continue;
+#ifdef SPARSE_ESCAPE_TABLES
+    if (IsSparseEscapeTable(list)) continue;
+#endif
+    const size_t idx =
+        ((uintptr_t)objects[i] - (uintptr_t)span->start_address()) / obj_size;
+    if (idx < EscapeTableSize(span->objects_per_span)) {
+      __builtin_prefetch(&list[idx], 1, 3);
+    }
+  }
+#endif
+#endif  // TCMALLOC_DEPRECATED_PERTHREAD
+}
+
 template <typename AlignPolicy>
 bool CorrectSize(void* ptr, size_t size, AlignPolicy align);
 
 bool CorrectAlignment(void* ptr, std::align_val_t alignment);
 
 inline ABSL_ATTRIBUTE_ALWAYS_INLINE void FreePages(void* ptr) {
+  TCMALLOC_COUNT_THREAD(frees, 1);
+  TCMALLOC_COUNT_THREAD(freed_bytes, GetSize(ptr));
   const PageId p = PageIdContaining(ptr);
   invoke_delete_hooks_and_free<do_free_pages, Hooks::RUN>(ptr, p);
 }
@@ -1296,74 +4117,28 @@ template <typename AlignPolicy>
 inline ABSL_ATTRIBUTE_ALWAYS_INLINE void do_free_with_size(void* ptr,
                                                            size_t size,
                                                            AlignPolicy align) {
+  TCMALLOC_TRACE_EVENT(kFree, ptr, nullptr, size);
+  TCMALLOC_CAPTURE_EVENT(kFree, ptr, nullptr, size);
+#ifdef POINTER_TAGGING
+  ptr = retag_free(ptr);
+  if (ABSL_PREDICT_FALSE(ptr == nullptr)) return;
+#endif
   ASSERT(CorrectSize(ptr, size, align));
   ASSERT(CorrectAlignment(ptr, static_cast<std::align_val_t>(align.align())));
+  // The object took the class of its padded size.
+  size += kPaddingBytes;
 
 #ifdef ENABLE_STATISTIC
-  tc_globals.free_cnt++;
+  tc_globals.free_cnt.Add(1);
 #endif
 
 #ifdef ENABLE_PROTECTION
-  PageId p = PageIdContaining(ptr);
-  Span* span_ = tc_globals.pagemap().GetDescriptor(p);
-  if (span_) {
-    // check if is invalid free
-    // if sizeclass is 0, then the span is dedicated to the page
-    // the check is done in the following.
-    // fixme
-    size_t obj_size = GetSize(ptr);
-    CHECK_CONDITION(obj_size == span_->obj_size * 8ULL);
-    CHECK_CONDITION(obj_size != 0);
-    size_t start_addr = (size_t)span_->start_address();
-    if (((size_t)ptr - start_addr) % obj_size != 0) {
-#ifdef ENABLE_ERROR_REPORT
-      Log(kLogWithStack, __FILE__, __LINE__,
-          "double/invalid free detected");
-#endif
-#ifdef CRASH_ON_CORRUPTION
-      fflush(stdout);
-      abort();
-#endif
-      return;
-    }
-    // free all escapes to p
-    int idx = ((size_t)ptr - start_addr) / obj_size;
-    poison_escapes(span_, idx, ptr, (char*)ptr + obj_size);
-    for (int i=0; i<tc_globals.escape_pos; i++) {
-      if (OBJ_START(tc_globals.escape_caches[i].ptr) != SMALL_PTR(ptr))
-        continue;
-      void **loc = tc_globals.escape_caches[i].loc;
-      void *real_ptr = *loc;
-      if ((size_t)ptr <= (size_t)real_ptr && (size_t)real_ptr < ((size_t)ptr + obj_size)) {
-#ifdef PROTECTION_DEBUG
-        printf("poison escape: loc (%p) -> ptr (%p)\n", loc, real_ptr);
-#endif
-
-#ifdef CRASH_ON_CORRUPTION
-        *(size_t *)loc = (size_t)real_ptr | 0xdeadbeef00000000;
-#endif
-        // need to make sure flush will skip this entry
-        tc_globals.escape_caches[i].ptr = -1;
-      }
-    }
-  } else {
-    if ((reinterpret_cast<uintptr_t>(ptr) & 0xdeadbeef00000000) == 0xdeadbeef00000000) {
-#ifdef ENABLE_ERROR_REPORT
-      Log(kLogWithStack, __FILE__, __LINE__,
-        "double/invalid free detected");
-#endif
-    } else {
-#ifdef ENABLE_ERROR_REPORT
-      Log(kLogWithStack, __FILE__, __LINE__,
-        "freeing a pointer with no span", ptr);
-#endif
-    }
-#ifdef CRASH_ON_CORRUPTION
-    fflush(stdout);
-    abort();
+  if (!protect_free(ptr)) return;
 #endif
-    return;
-  }
+#ifdef POINTER_FREE_CLASSES
+  // The size does not tell a pointer-free class from the ordinary one, so
+  // take the size class from the page map.
+  return do_free_with_size_class<false, Hooks::RUN>(ptr, 0);
 #endif
 
   // This is an optimized path that may be taken if the binary is compiled
@@ -1426,6 +4201,7 @@ bool CorrectSize(void* ptr, size_t size, AlignPolicy align) {
   // have an incorrect one.
   if (size == 0) return true;
   if (ptr == nullptr) return true;
+  size += kPaddingBytes;
   uint32_t size_class = 0;
   // Round-up passed in size to how much tcmalloc allocates for that size.
   if (tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
@@ -1501,261 +4277,573 @@ inline struct mallinfo do_mallinfo() {
 }
 #endif  // TCMALLOC_HAVE_STRUCT_MALLINFO
 
-static inline size_t do_get_chunk_end(void* base) noexcept {
-  const PageId p = PageIdContaining(base);
-  size_t start_addr, obj_size;
-  Span* span;
+static inline void do_report_error() noexcept {
+#ifdef ENABLE_ERROR_REPORT
+  TCMALLOC_REPORT_PROTECTION_ERROR(kOutOfBounds, __builtin_return_address(0),
+                                   "OOB detected");
+#endif
+  MaybeCrashOnCorruption();
+}
 
-  size_t page_info = tc_globals.pagemap().get_page_info(p);
-  size_t size_class = page_info & (CompactSizeClass)(-1);
-  if (size_class != 0) {
-    obj_size = tc_globals.sizemap().class_to_size(size_class);
-    start_addr = (size_t)PageId(page_info >> (sizeof(CompactSizeClass) * 8))
-                     .start_addr();
-  } else {
-    span = tc_globals.pagemap().GetDescriptor(p);
-    if (!span) {
-      return 0x1000000000000;
-    }
-    obj_size = span->obj_size * 8ULL;
-    start_addr = (size_t)span->start_address();
+// InlineChunkRange() behind the per-thread chunk cache.
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE
+UntaggedChunkRange(uintptr_t addr, uintptr_t* start, uintptr_t* end) noexcept {
+#ifdef CHUNK_CACHE
+  if (thread_chunk_cache_.Lookup(addr, start, end)) {
+#ifdef ENABLE_STATISTIC
+    tc_globals.chunk_cache_hit.Add(1);
+#endif
+    return true;
   }
+  const uint64_t epoch = ChunkCache::Epoch(addr);
+  if (!InlineChunkRange(addr, start, end)) return false;
+  thread_chunk_cache_.Insert(addr, *start, *end, epoch);
+  return true;
+#else
+  return InlineChunkRange(addr, start, end);
+#endif
+}
 
-  size_t chunk_start =
-      (size_t)(start_addr) +
-      (((size_t)base - (size_t)(start_addr)) / obj_size) * obj_size;
-  size_t chunk_end = chunk_start + obj_size;
-
-  return chunk_end;
+#ifdef POINTER_TAGGING
+// Whether tag is still the tag of the object starting at the untagged
+// address start.
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE
+tag_is_current(uintptr_t start, uint8_t tag) noexcept {
+  const uint8_t* slot = tc_globals.pagemap().TagSlot(start);
+  return slot == nullptr || __atomic_load_n(slot, __ATOMIC_RELAXED) == tag;
 }
+#endif
 
-static inline void* do_strncpy_check(void* _dst, void* _src, size_t maxlen) noexcept {
-  char* dst_end = (char*)do_get_chunk_end(_dst);
-  char* src_end = (char*)do_get_chunk_end(_src);
+// Sets [*start, *end) to the chunk addr points into.  The bounds of a tagged
+// pointer's chunk carry its tag, so they compare with pointers derived from
+// it; a pointer whose tag is stale has no chunk (see is_dangling()).
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE
+CachedChunkRange(uintptr_t addr, uintptr_t* start, uintptr_t* end) noexcept {
+#ifdef POINTER_TAGGING
+  const uintptr_t tag = addr & kPointerTagMask;
+  if (ABSL_PREDICT_TRUE(tag == 0)) return UntaggedChunkRange(addr, start, end);
+  if (!UntaggedChunkRange(addr ^ tag, start, end) ||
+      ABSL_PREDICT_FALSE(!tag_is_current(*start, PointerTagOf(addr)))) {
+    return false;
+  }
+  *start |= tag;
+  *end |= tag;
+  return true;
+#else
+  return UntaggedChunkRange(addr, start, end);
+#endif
+}
 
-  char* dst = (char*)_dst;
-  char* src = (char*)_src;
-  size_t i = 0;
+// Whether v, which has no chunk, points to a freed object: it was poisoned
+// or, with POINTER_TAGGING, still carries the tag of an object since freed.
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE
+is_dangling(uintptr_t v) noexcept {
+  if (IsPoisoned(v)) return true;
+#ifdef POINTER_TAGGING
+  uintptr_t start, end;
+  if (PointerTagOf(v) != 0 &&
+      UntaggedChunkRange(StripPointerTag(v), &start, &end)) {
+    return true;
+  }
+#endif
+  return false;
+}
 
-  while (*src && i++ < maxlen) {
-    if (src < src_end && dst < dst_end) {
-      *dst++ = *src++;
-    } else {
+// Reports a check on a dangling pointer: the object it pointed to was freed.
+// The generation tells whether an object at that address was freed again
+// since.  pc is the call site of the check.
+static ABSL_ATTRIBUTE_NOINLINE int report_dangling(uintptr_t v,
+                                                   const void* pc) noexcept {
 #ifdef ENABLE_ERROR_REPORT
-      Log(kLogWithStack, __FILE__, __LINE__, "OOB detected");
+  uintptr_t start, end;
+  if (IsPoisoned(v)) {
+    const uintptr_t addr = PoisonedAddress(v);
+    const uintptr_t now = CachedChunkRange(addr, &start, &end)
+                              ? current_poison_generation(start)
+                              : PoisonGeneration(v);
+    TCMALLOC_REPORT_PROTECTION_ERROR(kUseAfterFree, pc,
+        "use after free detected (address, generation, current generation)",
+        reinterpret_cast<void*>(addr), PoisonGeneration(v), now);
+  }
+#ifdef POINTER_TAGGING
+  if (!IsPoisoned(v)) {
+    const uintptr_t addr = StripPointerTag(v);
+    const uint8_t* slot = UntaggedChunkRange(addr, &start, &end)
+                              ? tc_globals.pagemap().TagSlot(start)
+                              : nullptr;
+    TCMALLOC_REPORT_PROTECTION_ERROR(kUseAfterFree, pc,
+        "use after free detected (address, tag, current tag)",
+        reinterpret_cast<void*>(addr), PointerTagOf(v),
+        slot != nullptr ? *slot : 0);
+  }
 #endif
-#ifdef CRASH_ON_CORRUPTION
-      fflush(stdout);
-      abort();
 #endif
-    }
+  MaybeCrashOnCorruption();
+  return -1;
+}
+
+static inline size_t do_get_chunk_end(void* base) noexcept {
+  uintptr_t chunk_start, chunk_end;
+
+  if (!CachedChunkRange((uintptr_t)base, &chunk_start, &chunk_end)) {
+    return uintptr_t{1} << kAddressBits;
   }
 
-  *dst = 0;
-  return _dst;
+  return chunk_end;
 }
 
-static inline void* do_strcpy_check(void* _dst, void* _src) noexcept {
-  char* dst_end = (char*)do_get_chunk_end(_dst);
-  char* src_end = (char*)do_get_chunk_end(_src);
+// Returns the number of bytes from p to the end of its chunk, or SIZE_MAX for
+// non-heap memory.
+static inline size_t do_get_chunk_room(const void* p) noexcept {
+  uintptr_t chunk_start, chunk_end;
 
-  char* dst = (char*)_dst;
-  char* src = (char*)_src;
+  if (!CachedChunkRange((uintptr_t)p, &chunk_start, &chunk_end)) {
+    return SIZE_MAX;
+  }
 
-  while (*src) {
-    if (src < src_end && dst < dst_end) {
-      *dst++ = *src++;
-    } else {
-#ifdef ENABLE_ERROR_REPORT
-      Log(kLogWithStack, __FILE__, __LINE__, "OOB detected");
-#endif
-#ifdef CRASH_ON_CORRUPTION
-      fflush(stdout);
-      abort();
-#endif
+  return chunk_end - (uintptr_t)p;
+}
+
+#ifdef EXTERNAL_REGIONS
+// Whether [base, base + len) can be a region: page aligned, not empty and
+// not wrapping around.
+static inline bool valid_region(void* base, size_t len) noexcept {
+  const uintptr_t start = reinterpret_cast<uintptr_t>(base);
+  return start % kPageSize == 0 && len != 0 && len <= UINTPTR_MAX - start;
+}
+
+// return 0 if [base, base + len) now holds element_size byte objects for
+// the checks
+// return -1 if nothing changed
+static int do_register_region(void* base, size_t len,
+                              size_t element_size) noexcept {
+  if (!valid_region(base, len)) return -1;
+  const Length n = BytesToLengthCeil(len);
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    if (!tc_globals.pagemap().RegisterExternalRegion(PageIdContaining(base),
+                                                     n, element_size)) {
+      return -1;
     }
   }
+#ifdef HEAP_RANGE_FILTER
+  HeapRangeFilter::Add(reinterpret_cast<uintptr_t>(base), n.in_bytes());
+#endif
+  return 0;
+}
+
+// return 0 if the region [base, base + len) is non-heap memory again
+// return -1 if it was not registered as one
+static int do_unregister_region(void* base, size_t len) noexcept {
+  if (!valid_region(base, len)) return -1;
+  absl::base_internal::SpinLockHolder h(&pageheap_lock);
+  return tc_globals.pagemap().UnregisterExternalRegion(
+             PageIdContaining(base), BytesToLengthCeil(len))
+             ? 0
+             : -1;
+}
+#endif  // EXTERNAL_REGIONS
+
+// Clamps an n byte access to room bytes, reporting the overflow if it does
+// not fit.
+static inline size_t bounded_len(size_t n, size_t room) noexcept {
+  if (ABSL_PREDICT_FALSE(n > room)) {
+    do_report_error();
+    return room;
+  }
+  return n;
+}
+
+// The mem* and str*len checks resolve each chunk once and then hand the whole
+// (clamped) range to libc, so a checked call costs one lookup per pointer
+// plus the native routine.
+static inline void* do_memcpy_check(void* dst, const void* src,
+                                    size_t n) noexcept {
+  TCMALLOC_TIME_PROTECTION(kStringCheck);
+  n = bounded_len(n, std::min(do_get_chunk_room(dst), do_get_chunk_room(src)));
+  return memcpy(dst, src, n);
+}
+
+static inline void* do_memmove_check(void* dst, const void* src,
+                                     size_t n) noexcept {
+  TCMALLOC_TIME_PROTECTION(kStringCheck);
+  n = bounded_len(n, std::min(do_get_chunk_room(dst), do_get_chunk_room(src)));
+  return memmove(dst, src, n);
+}
+
+static inline void* do_memset_check(void* dst, int c, size_t n) noexcept {
+  TCMALLOC_TIME_PROTECTION(kStringCheck);
+  n = bounded_len(n, do_get_chunk_room(dst));
+  return memset(dst, c, n);
+}
+
+static inline size_t do_strnlen_check(const void* s, size_t maxlen) noexcept {
+  TCMALLOC_TIME_PROTECTION(kStringCheck);
+  const size_t room = do_get_chunk_room(s);
+  const size_t len = strnlen((const char*)s, std::min(maxlen, room));
+  // Unterminated within its chunk, and the limit lies beyond it.
+  if (ABSL_PREDICT_FALSE(len == room && room < maxlen)) {
+    do_report_error();
+  }
+  return len;
+}
+
+static inline size_t do_strlen_check(const void* s) noexcept {
+  return do_strnlen_check(s, SIZE_MAX);
+}
+
+// Copies at most maxlen characters of the string at src to dst and appends a
+// NUL, touching nothing at or past src_end and dst_end.  The terminator is
+// found with strnlen() bounded by the source chunk and the string is moved
+// with one memcpy(), both of which libc implements a vector at a time.
+// If the source string runs past its chunk or the copy does not fit, reports
+// the overflow and, when that returns, copies and terminates what fits.
+static inline void bounded_str_copy(char* dst, const char* dst_end,
+                                    const char* src, const char* src_end,
+                                    size_t maxlen) noexcept {
+  const size_t src_room = src < src_end ? src_end - src : 0;
+  const size_t dst_room = dst < dst_end ? dst_end - dst : 0;
+  size_t len = strnlen(src, std::min(maxlen, src_room));
+  bool ok = len < src_room || maxlen <= src_room;
+
+  if (ABSL_PREDICT_FALSE(len >= dst_room)) {
+    ok = false;
+    len = dst_room != 0 ? dst_room - 1 : 0;
+  }
+  if (ABSL_PREDICT_FALSE(!ok)) {
+    do_report_error();
+    if (dst_room == 0) return;
+  }
+
+  memcpy(dst, src, len);
+  dst[len] = 0;
+}
+
+// Returns the end of the string at dst, or nullptr after reporting the
+// overflow if it is not terminated within its chunk.
+static inline char* bounded_str_end(char* dst, const char* dst_end) noexcept {
+  const size_t dst_room = dst < dst_end ? dst_end - dst : 0;
+  const size_t len = strnlen(dst, dst_room);
+  if (ABSL_PREDICT_FALSE(len == dst_room)) {
+    do_report_error();
+    return nullptr;
+  }
+  return dst + len;
+}
 
-  *dst = 0;
+static inline void* do_strncpy_check(void* _dst, void* _src, size_t maxlen) noexcept {
+  TCMALLOC_TIME_PROTECTION(kStringCheck);
+  char* dst_end = (char*)do_get_chunk_end(_dst);
+  char* src_end = (char*)do_get_chunk_end(_src);
+
+  bounded_str_copy((char*)_dst, dst_end, (const char*)_src, src_end, maxlen);
   return _dst;
 }
 
-static inline void* do_strncat_check(void* _dst, void* _src, size_t maxlen) noexcept {
+static inline void* do_strcpy_check(void* _dst, void* _src) noexcept {
+  TCMALLOC_TIME_PROTECTION(kStringCheck);
   char* dst_end = (char*)do_get_chunk_end(_dst);
   char* src_end = (char*)do_get_chunk_end(_src);
 
-  char* dst = (char*)_dst;
-  char* src = (char*)_src;
-  size_t i = 0;
+  bounded_str_copy((char*)_dst, dst_end, (const char*)_src, src_end,
+                   SIZE_MAX);
+  return _dst;
+}
 
-  while (*dst) {
-    if (dst < dst_end) dst++;
-    else {
-#ifdef ENABLE_ERROR_REPORT
-      Log(kLogWithStack, __FILE__, __LINE__, "OOB detected");
-#endif
-#ifdef CRASH_ON_CORRUPTION
-      fflush(stdout);
-      abort();
-#endif
-    }
-  }
+static inline void* do_strncat_check(void* _dst, void* _src, size_t maxlen) noexcept {
+  TCMALLOC_TIME_PROTECTION(kStringCheck);
+  char* dst_end = (char*)do_get_chunk_end(_dst);
+  char* src_end = (char*)do_get_chunk_end(_src);
 
-  while (*src && i++ < maxlen) {
-    if (src < src_end && dst < dst_end) {
-      *dst++ = *src++;
-    } else {
-#ifdef ENABLE_ERROR_REPORT
-    Log(kLogWithStack, __FILE__, __LINE__, "OOB detected");
-#endif
-#ifdef CRASH_ON_CORRUPTION
-    fflush(stdout);
-    abort();
-#endif
-    }
+  char* dst = bounded_str_end((char*)_dst, dst_end);
+  if (dst != nullptr) {
+    bounded_str_copy(dst, dst_end, (const char*)_src, src_end, maxlen);
   }
-
-  *dst = 0;
   return _dst;
 }
 
 static inline void* do_strcat_check(void* _dst, void* _src) noexcept {
+  TCMALLOC_TIME_PROTECTION(kStringCheck);
   char* dst_end = (char*)do_get_chunk_end(_dst);
   char* src_end = (char*)do_get_chunk_end(_src);
 
-  char* dst = (char*)_dst;
-  char* src = (char*)_src;
+  char* dst = bounded_str_end((char*)_dst, dst_end);
+  if (dst != nullptr) {
+    bounded_str_copy(dst, dst_end, (const char*)_src, src_end, SIZE_MAX);
+  }
+  return _dst;
+}
+
+#ifdef FORTIFY_CHK
+// The glibc __*_chk entry points take the size of the destination as far as
+// the compiler knows it, SIZE_MAX if it does not, and call __chk_fail() if
+// the access exceeds it, as glibc's own do.  Within that, the access is
+// bounded by the end of the heap object at dst as the mem* and str* checks
+// above bound it, so a fortified call the compiler could not size still
+// stays in its object.  Only the destination is checked, as by FORTIFY.
+extern "C" ABSL_ATTRIBUTE_NORETURN void __chk_fail(void);
+
+// Bytes from dst to the end of its heap object, SIZE_MAX if it is none or
+// the protection policy skips this check.
+static inline size_t fortify_room(const void* dst) noexcept {
+  if (protection_check_weight() == 0) return SIZE_MAX;
+  TCMALLOC_TIME_PROTECTION(kStringCheck);
+  return do_get_chunk_room(dst);
+}
+
+static inline size_t fortify_len(size_t n, const void* dst,
+                                 size_t destlen) noexcept {
+  if (ABSL_PREDICT_FALSE(n > destlen)) __chk_fail();
+  return bounded_len(n, fortify_room(dst));
+}
+
+// Copies the len characters at src and a NUL to dst, which has room bytes
+// left in its object.  If they do not fit, reports the overflow and, when
+// that returns, copies and terminates what fits.  Returns the end of the
+// copy.
+static inline char* fortify_str_copy(char* dst, const char* src, size_t len,
+                                     size_t room) noexcept {
+  if (ABSL_PREDICT_FALSE(len >= room)) {
+    do_report_error();
+    if (room == 0) return dst;
+    len = room - 1;
+  }
+  memcpy(dst, src, len);
+  dst[len] = 0;
+  return dst + len;
+}
+
+static inline char* do_stpcpy_chk(char* dst, const char* src,
+                                  size_t destlen) noexcept {
+  const size_t len = strlen(src);
+  if (ABSL_PREDICT_FALSE(len >= destlen)) __chk_fail();
+  return fortify_str_copy(dst, src, len, fortify_room(dst));
+}
 
-  while (*dst) {
-    if (dst < dst_end) dst++;
-    else {
-#ifdef ENABLE_ERROR_REPORT
-      Log(kLogWithStack, __FILE__, __LINE__, "OOB detected");
-#endif
-#ifdef CRASH_ON_CORRUPTION
-      fflush(stdout);
-      abort();
+static inline char* do_strcat_chk(char* dst, const char* src, size_t n,
+                                  size_t destlen) noexcept {
+  const size_t dst_len = strlen(dst);
+  const size_t len = strnlen(src, n);
+  if (ABSL_PREDICT_FALSE(dst_len >= destlen || len >= destlen - dst_len)) {
+    __chk_fail();
+  }
+  const size_t room = fortify_room(dst);
+  if (ABSL_PREDICT_FALSE(dst_len >= room)) {
+    do_report_error();
+    return dst;
+  }
+  fortify_str_copy(dst + dst_len, src, len, room - dst_len);
+  return dst;
+}
+#endif  // FORTIFY_CHK
+
+// If we consult the span then retrieve the obj_size and start address, it will
+// invoke 4 memory access: first find span from the map (2 accesses), then obj_size
+// and start address in the span. This is expensive because the span is not hot thus
+// the two access to span invokes ~50% of overhead.
+
+// we will use the page info words of the page map instead, which also hold the
+// start page of the span and the object size.  Their layout is PageInfo in
+// pagemap.h.
+
+// return 0 for valid access
+// return -1 for invalid access
+// return 1 for non-heap memory
+static inline int do_gep_check_boundary(void *base, void *ptr, size_t size) noexcept {
+  TCMALLOC_TIME_PROTECTION(kGepCheck);
+  uintptr_t _chunk_start, _chunk_end;
+
+  if (!CachedChunkRange((uintptr_t)base, &_chunk_start, &_chunk_end)) {
+#ifdef ENABLE_STATISTIC
+  tc_globals.gep_check_invalid_cnt.Add(1);
 #endif
-    }
+    if (ABSL_PREDICT_FALSE(is_dangling((uintptr_t)base)))
+      return report_dangling((uintptr_t)base, __builtin_return_address(0));
+    return 0;
   }
+  if (ptr >= (void*) _chunk_start && ptr < (void*) _chunk_end)
+    return 0;
 
-  while (*src) {
-    if (src < src_end && dst < dst_end) {
-      *dst++ = *src++;
-    } else {
 #ifdef ENABLE_ERROR_REPORT
-    Log(kLogWithStack, __FILE__, __LINE__, "OOB detected");
+  TCMALLOC_REPORT_PROTECTION_ERROR(kOutOfBounds, __builtin_return_address(0),
+                                   "OOB detected");
 #endif
-#ifdef CRASH_ON_CORRUPTION
-    fflush(stdout);
-    abort();
+  MaybeCrashOnCorruption();
+
+  return -1;
+}
+
+// Checks that all of [ptr, ptr + size) lies in the chunk of base, so a loop
+// whose accesses through a loop-invariant base cover that range needs a
+// single check rather than one per iteration.
+// return 0 for valid access (or non-heap memory)
+// return -1 for invalid access
+static inline int do_gep_check_boundary_range(void *base, void *ptr,
+                                              size_t size) noexcept {
+  uintptr_t chunk_start, chunk_end;
+
+  if (!CachedChunkRange((uintptr_t)base, &chunk_start, &chunk_end)) {
+#ifdef ENABLE_STATISTIC
+  tc_globals.gep_check_invalid_cnt.Add(1);
 #endif
-    }
+    if (ABSL_PREDICT_FALSE(is_dangling((uintptr_t)base)))
+      return report_dangling((uintptr_t)base, __builtin_return_address(0));
+    return 0;
   }
+  const uintptr_t p = (uintptr_t)ptr;
+  if (p >= chunk_start && p <= chunk_end && size <= chunk_end - p)
+    return 0;
 
-  *dst = 0;
-  return _dst;
+  do_report_error();
+  return -1;
 }
 
-// If we consult the span then retrieve the obj_size and start address, it will
-// invoke 4 memory access: first find span from the map (2 accesses), then obj_size
-// and start address in the span. This is expensive because the span is not hot thus
-// the two access to span invokes ~50% of overhead.
+// Checks n (bases[i], ptrs[i]) pairs, with the same result as n calls to
+// do_gep_check_boundary().  Consecutive bases in one chunk share a single
+// lookup, and each block of pairs is compared without branches so that the
+// compiler can vectorize the comparisons.
+// return 0 if every access is valid
+// return -1 if any is invalid
+static inline int do_gep_check_boundary_batch(void* const* bases,
+                                              void* const* ptrs,
+                                              size_t n) noexcept {
+  static constexpr size_t kBlock = 16;
+  uintptr_t starts[kBlock], ends[kBlock];
+  // Chunk of the previous base; empty until the first heap base is seen.
+  uintptr_t start = 0, end = 0;
+
+  for (size_t i = 0; i < n; i += kBlock) {
+    const size_t m = std::min(kBlock, n - i);
+    for (size_t j = 0; j < m; ++j) {
+      const uintptr_t b = (uintptr_t)bases[i + j];
+      if (b - start >= end - start &&
+          !CachedChunkRange(b, &start, &end)) {
+#ifdef ENABLE_STATISTIC
+        tc_globals.gep_check_invalid_cnt.Add(1);
+#endif
+        // Non-heap memory is always valid, but must not be reused for the
+        // next base.
+        start = end = 0;
+        starts[j] = 0;
+        ends[j] = ~uintptr_t{0};
+        continue;
+      }
+      starts[j] = start;
+      ends[j] = end;
+    }
+
+    uintptr_t bad = 0;
+    for (size_t j = 0; j < m; ++j) {
+      const uintptr_t p = (uintptr_t)ptrs[i + j];
+      bad |= (p < starts[j]) | (p >= ends[j]);
+    }
+    if (ABSL_PREDICT_FALSE(bad)) {
+      do_report_error();
+      return -1;
+    }
+  }
+  return 0;
+}
 
-// we will use sizeclass instead, with some tweaks on the page table. Now the
-// sizeclass page table also contains the start page of the span.
+// Returns the chunk of base by value, so it can stay in registers while a
+// loop checks its accesses inline.  Non-heap memory yields the whole address
+// space.  Unlike do_get_chunk_range() this keeps no statistics.
+static inline TCMallocChunkRange do_chunk_range(const void* base) noexcept {
+  TCMallocChunkRange range;
+  if (!CachedChunkRange((uintptr_t)base, &range.start, &range.end)) {
+    range.start = 0;
+    range.end = uintptr_t{1} << kAddressBits;
+  }
+  return range;
+}
 
-// return 0 for valid access
-// return -1 for invalid access
-// return 1 for non-heap memory
-static inline int do_gep_check_boundary(void *base, void *ptr, size_t size) noexcept {
-   size_t** pagemap_ = (size_t**) &tcmalloc::tcmalloc_internal::Static::pagemap_;
-  unsigned int* sizemap_ = (unsigned int*) &tcmalloc::tcmalloc_internal::Static::sizemap_;
-  
-  size_t _chunk_start, _chunk_end;
-  size_t _base = (size_t) base;
-  size_t mask = (_base >> 13) & 0x7fff;
-  size_t* pagemap = pagemap_[_base >> 28];
-  size_t pageid, start_addr, obj_size;
-
-  if (pagemap && (pageid = pagemap[mask], (unsigned char) pageid)) {
-      start_addr = pageid >> 8 << 13;
-      obj_size = sizemap_[(unsigned char) pageid + 1171];
-      _chunk_start = start_addr + (obj_size * ((_base - start_addr) / obj_size));
-      _chunk_end = _chunk_start + obj_size;
-      if (ptr >= (void*) _chunk_start && ptr < (void*) _chunk_end)
-        return 0;
-  } else {
-      size_t* span = pagemap_[mask + 0x8000];
-      if (span == nullptr) {
-#ifdef ENABLE_STATISTIC
-  tc_globals.gep_check_invalid_cnt++;
+// Whether addr may be heap memory, for screening candidates ahead of
+// CachedChunkRange().  Reads no more than one bit of the HeapRangeFilter, so
+// a block of addresses is screened without branches.
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE
+may_be_heap(uintptr_t addr) noexcept {
+#ifdef POINTER_TAGGING
+  addr = StripPointerTag(addr);
+#endif
+#ifdef HEAP_RANGE_FILTER
+  return HeapRangeFilter::MayContain(addr);
+#else
+  return (addr >> kAddressBits) == 0;
+#endif
+}
+
+// Sets out[i] to the chunk of ptrs[i], or to {0, 0} for non-heap memory, and
+// returns how many are heap.  Each block of words is screened first and the
+// page info of those that pass is prefetched before any is looked up, so a
+// block costs about one miss rather than one per word.
+static inline size_t do_chunk_range_batch(const void* const* ptrs, size_t n,
+                                          TCMallocChunkRange* out) noexcept {
+  static constexpr size_t kBlock = 16;
+  uint8_t candidates[kBlock];
+  size_t found = 0;
+
+  for (size_t i = 0; i < n; i += kBlock) {
+    const size_t m = std::min(kBlock, n - i);
+    size_t k = 0;
+    for (size_t j = 0; j < m; ++j) {
+      candidates[k] = j;
+      k += may_be_heap((uintptr_t)ptrs[i + j]);
+      out[i + j] = {0, 0};
+    }
+    for (size_t c = 0; c < k; ++c) {
+      uintptr_t addr = (uintptr_t)ptrs[i + candidates[c]];
+#ifdef POINTER_TAGGING
+      addr = StripPointerTag(addr);
 #endif
-          return 0;
+      PrefetchChunkRange(addr);
+    }
+    for (size_t c = 0; c < k; ++c) {
+      TCMallocChunkRange& range = out[i + candidates[c]];
+      if (CachedChunkRange((uintptr_t)ptrs[i + candidates[c]], &range.start,
+                           &range.end)) {
+        ++found;
       } else {
-          obj_size = 8LL * *((unsigned int*) span + 6);
-          start_addr = span[6] << 13;
-          _chunk_start = start_addr + (obj_size * ((_base - start_addr) / obj_size));
-          _chunk_end = _chunk_start + obj_size;
-          if (ptr >= (void*) _chunk_start && ptr < (void*) _chunk_end)
-            return 0;
+        range = {0, 0};
       }
+    }
   }
-
-#ifdef ENABLE_ERROR_REPORT
-  Log(kLogWithStack, __FILE__, __LINE__, "OOB detected");
-#endif
-#ifdef CRASH_ON_CORRUPTION
-  fflush(stdout);
-  abort();
+#ifdef ENABLE_STATISTIC
+  tc_globals.get_range_cnt.Add(n);
+  tc_globals.get_range_invalid_cnt.Add(n - found);
 #endif
-
-  return -1;
+  return found;
 }
 
 // return 0 for valid access
 // return -1 for invalid access
 // return 1 for non-heap memory
 static inline int do_bc_check_boundary(void *base, size_t size) noexcept {
-  const PageId p = PageIdContaining(base);
-  size_t start_addr, obj_size;
-  Span *span;
-
 // #define OBJ_SIZE_DEBUG
 #ifdef OBJ_SIZE_DEBUG
-  span = tc_globals.pagemap().GetExistingDescriptor(p);
+  const PageId p = PageIdContaining(base);
+  Span* span = tc_globals.pagemap().GetExistingDescriptor(p);
   CHECK_CONDITION(span->obj_size != 0);
-  CHECK_CONDITION(span->obj_size * 8ULL = GetSize(base));
+  CHECK_CONDITION(span->object_bytes() == GetSize(base));
 
-  size_t raw_data = tc_globals.pagemap().get_page_info(p);
-  if (raw_data) {
-    CHECK_CONDITION((raw_data >> 8) == span->first_page().index());
+  uintptr_t debug_start, debug_end;
+  if (InlineChunkRange((uintptr_t)base, &debug_start, &debug_end)) {
+    CHECK_CONDITION(debug_end - debug_start == span->object_bytes());
   }
 #endif
 
-  size_t page_info = tc_globals.pagemap().get_page_info(p);
-  size_t size_class = page_info & (CompactSizeClass)(-1);
-  if (size_class != 0) {
-    obj_size = tc_globals.sizemap().class_to_size(size_class);
-    start_addr = (size_t)PageId(page_info >> (sizeof(CompactSizeClass) * 8)).start_addr();
-  } else {
-    span = tc_globals.pagemap().GetDescriptor(p);
-    if (!span) {
+  uintptr_t chunk_start, chunk_end;
+  if (!CachedChunkRange((uintptr_t)base, &chunk_start, &chunk_end)) {
 #ifdef ENABLE_STATISTIC
-  tc_globals.bc_check_invalid_cnt++;
+  tc_globals.bc_check_invalid_cnt.Add(1);
 #endif
-      return 1;
-    }
-    obj_size = span->obj_size * 8ULL;
-    start_addr = (size_t)span->start_address();
+    if (ABSL_PREDICT_FALSE(is_dangling((uintptr_t)base)))
+      return report_dangling((uintptr_t)base, __builtin_return_address(0));
+    return 1;
   }
 
-  size_t chunk_start = start_addr + (((size_t)base - start_addr) / obj_size) * obj_size;
-  size_t chunk_end = chunk_start + obj_size;
-
 #ifdef PROTECTION_DEBUG
-  printf("start_addr 0x%lx, objsize %ld, chunk range [%lx-%lx], base %p, access range [%p-0x%lx]\n",
-          start_addr, obj_size, chunk_start, chunk_end, base, base, size+(size_t)base);
+  printf("chunk range [%lx-%lx], base %p, access range [%p-0x%lx]\n",
+          chunk_start, chunk_end, base, base, size+(size_t)base);
 #endif
 
   if ((size_t)base >= chunk_start && ((size_t)base + size) <= chunk_end) {
@@ -1763,111 +4851,163 @@ static inline int do_bc_check_boundary(void *base, size_t size) noexcept {
   }
 
 #ifdef ENABLE_ERROR_REPORT
-  Log(kLogWithStack, __FILE__, __LINE__, "OOB detected");
-#endif
-#ifdef CRASH_ON_CORRUPTION
-  fflush(stdout);
-  abort();
+  TCMALLOC_REPORT_PROTECTION_ERROR(kOutOfBounds, __builtin_return_address(0),
+                                   "OOB detected");
 #endif
+  MaybeCrashOnCorruption();
 
   return -1;
 }
 
 static inline size_t do_get_chunk_start(void* base) noexcept {
-  const PageId p = PageIdContaining(base);
-  size_t start_addr, obj_size;
-  Span *span;
+  uintptr_t chunk_start, chunk_end;
 
-  size_t page_info = tc_globals.pagemap().get_page_info(p);
-  size_t size_class = page_info & (CompactSizeClass)(-1);
-  if (size_class != 0) {
-    obj_size = tc_globals.sizemap().class_to_size(size_class);
-    start_addr = (size_t)PageId(page_info >> (sizeof(CompactSizeClass) * 8)).start_addr();
-  } else {
-    span = tc_globals.pagemap().GetDescriptor(p);
-    if (!span) {
-      return 0;
-    }
-    obj_size = span->obj_size * 8ULL;
-    start_addr = (size_t)span->start_address();
+  if (!CachedChunkRange((uintptr_t)base, &chunk_start, &chunk_end)) {
+    return 0;
   }
 
-  size_t chunk_start = (size_t)(start_addr) + (((size_t)base - (size_t)(start_addr)) / obj_size) * obj_size;
-
   return chunk_start;
 }
 
-static inline int do_escape(
-    void **loc, void* ptr) noexcept {
-  // store pointer new into loc
-  // so loc will point to new
-  // find span of new and then add to the list
-
-  // for (size_t size_class=1; size_class <100; size_class++) {
-  //   size_t span_size =
-  //         Length(tc_globals.sizemap().class_to_pages(size_class)).in_bytes();
-  //   size_t allocated_size = tc_globals.sizemap().class_to_size(size_class);
-  //   size_t objects_per_span = span_size / allocated_size;
-  //   printf("[%ld] alloc size %ld object per span %ld\n", size_class, allocated_size, objects_per_span);
-  // }
+#ifdef SAMPLED_ESCAPE_SPANS
+// Whether ptr points into a span registered without escape tracking, from
+// its page info word alone.
+static inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE escape_untracked(
+    const void* ptr) {
+  if (ABSL_PREDICT_TRUE(
+          !tc_globals.pagemap().get_page_info(PageIdContaining(ptr))
+               .untracked())) {
+    return false;
+  }
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_untracked_cnt.Add(1);
+#endif
+  return true;
+}
+#endif
 
-  // this is cheap but optimizes a lot for perl
-  // Span* loc_span = tc_globals.pagemap().GetDescriptor(PageIdContaining((void*)loc));
-  // if (!loc_span) {
-  //   return -1;
-  // }
+// Stages the escape of `ptr`, an address inside `span`, through `loc`,
+// which holds `old_ptr` until the caller stores `ptr` into it.
+static inline int do_escape_in_span(Span* span, void **loc, void* ptr,
+                                    void* old_ptr) noexcept {
+#ifdef POINTER_FREE_CLASSES
+  // nothing is tracked into pointer-free objects
+  if (ABSL_PREDICT_FALSE(span->pointer_free())) return -1;
+#endif
+#ifdef COLD_SKIP_ESCAPES
+  // nor into memory allocated as cold, whose frees do not poison
+  if (ABSL_PREDICT_FALSE(IsColdMemory(span->start_address()))) return -1;
+#endif
+#ifdef LIFETIME_PROTECTION
+  // nor into objects predicted short-lived, which are quarantined instead
+  if (ABSL_PREDICT_FALSE(span->sampled()) && span->short_lived()) {
 #ifdef ENABLE_STATISTIC
-  tc_globals.escape_heap_cnt++;
+    tc_globals.short_lived_escape_skipped.Add(1);
 #endif
-  Span* span = tc_globals.pagemap().GetDescriptor(PageIdContaining(ptr));
-  if (!span) {
     return -1;
   }
-  span->Prefetch();
-#ifdef ENABLE_STATISTIC
-  tc_globals.escape_valid_cnt++;
 #endif
   // FIXME: obj_size shouldn't be 0
-  size_t obj_size = span->obj_size * 8ULL;
+  size_t obj_size = span->object_bytes();
   if (ABSL_PREDICT_FALSE(obj_size == 0)) {
     printf("span %p obj size is 0\n", span);
     return -1;
   }
 
+  // Staged escapes keep the object size in OBJ_SIZE_RAW's 24 bits, so
+  // escapes into objects of 128 MiB and more could never be committed.
+  const size_t units = EscapeObjectUnits(span);
+  if (ABSL_PREDICT_FALSE(units > OBJ_SIZE_RAW(~size_t{0})))
+    return -1;
+#ifdef PAGE_ESCAPE_CHAINS
+  // Escapes into an object with page escape chains are tracked into the run
+  // of its pages they point to; loc still has to be outside all of it.
+  const size_t obj_bytes = obj_size;
+  obj_size = EscapeObjectBytes(span);
+#endif
+
   size_t idx = ((size_t)ptr - (size_t)span->start_address()) / obj_size;
-  if (idx >= escapeListSize)
+  if (ABSL_PREDICT_FALSE(idx >= kMaxEscapeTableSize))
     return -1;
 
   size_t obj_start = (size_t)span->start_address() + obj_size * idx;
-  void *old_ptr = *loc;
+  // A location inside the object itself, as of a self-referential node or
+  // a short string's data pointer, is freed together with the object, so
+  // there is nothing for its free to poison.
+#ifdef PAGE_ESCAPE_CHAINS
+  if (obj_bytes != obj_size &&
+      (size_t)loc - (size_t)span->start_address() < obj_bytes) {
+#ifdef ENABLE_STATISTIC
+    tc_globals.escape_intra_object.Add(1);
+#endif
+    return 0;
+  }
+#endif
+  if ((size_t)loc - obj_start < obj_size) {
+#ifdef ENABLE_STATISTIC
+    tc_globals.escape_intra_object.Add(1);
+#endif
+    return 0;
+  }
 
   if (obj_start <= (size_t)old_ptr && (size_t)old_ptr < (obj_start + obj_size)) {
     // same loc, optimize this
 #ifdef ENABLE_STATISTIC
-    tc_globals.escape_loc_optimized++;
+    tc_globals.escape_loc_optimized.Add(1);
 #endif
+    TCMALLOC_CALLSITE_SKIPPED();
     return 0;
   }
 #ifdef ENABLE_STATISTIC
-  tc_globals.escape_final_cnt++;
+  tc_globals.escape_final_cnt.Add(1);
 #endif
 
   // FIXME
   // CHECK_CONDITION(idx < span->objects_per_span);
-  if (ABSL_PREDICT_FALSE(idx >= span->objects_per_span)) {
+  if (ABSL_PREDICT_FALSE(idx >= EscapeObjects(span))) {
     // this is a bug
     // printf("span %p obj_per_span %d idx %d, ptr %p start addr %p span size %lx obj size %x\n", span, span->objects_per_span, idx, ptr, span->start_address(), span->bytes_in_span(), span->obj_size);
     return -1;
   }
 
-  if (tc_globals.escape_pos == CACHE_SIZE) {
+#ifdef ESCAPE_REFCOUNTS
+  count_escape_ref(span, idx);
+  return 0;
+#endif
+
+  size_t ptr_info = (obj_start << 24) | ((uint32_t)units);
+#ifdef ESCAPE_LOCATION_CLASSES
+  if (stage_stack_escape(loc, ptr_info)) return 0;
+#endif
+
+  EscapeBuffer* buffer = GetEscapeBuffer();
+  if (buffer->full() ||
+      (ABSL_PREDICT_FALSE(escape_flush_due()) && !buffer->empty())) {
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+    // Committing clears what the buffer measured.
+    const size_t capacity = buffer->NextCapacity();
+#endif
     // do commit
-    flush_escape();
+    if (Parameters::background_escape_flush()) {
+      buffer = HandoffEscapeBuffer(buffer);
+    } else {
+      flush_escape(buffer);
+    }
+#ifdef ADAPTIVE_ESCAPE_BUFFER
+    if (buffer->capacity() != capacity) {
+      buffer = ResizeEscapeBuffer(buffer, capacity);
+    }
+#endif
+#ifdef ESCAPE_LOCATION_CLASSES
+    spill_stack_escapes(buffer);
+#endif
   }
 
-  size_t ptr_info = (obj_start << 24) | ((uint32_t)span->obj_size);
-  tc_globals.escape_caches[tc_globals.escape_pos].loc = loc;
-  tc_globals.escape_caches[tc_globals.escape_pos++].ptr = ptr_info;
+  if (!buffer->Push(loc, ptr_info)) {
+#ifdef ENABLE_STATISTIC
+    tc_globals.escape_buffer_dedup.Add(1);
+#endif
+  }
 
 #ifdef PROTECTION_DEBUG
   CHECK_CONDITION(OBJ_START(ptr_info) == SMALL_PTR(obj_start));
@@ -1877,75 +5017,624 @@ static inline int do_escape(
   return 0;
 }
 
-static inline void do_report_error() noexcept {
-#ifdef ENABLE_ERROR_REPORT
-  Log(kLogWithStack, __FILE__, __LINE__, "OOB detected");
+static inline int do_escape(
+    void **loc, void* ptr, void* old_ptr) noexcept {
+  TCMALLOC_TIME_PROTECTION(kEscape);
+  // store pointer new into loc
+  // so loc will point to new
+  // find span of new and then add to the list
+
+  // for (size_t size_class=1; size_class <100; size_class++) {
+  //   size_t span_size =
+  //         Length(tc_globals.sizemap().class_to_pages(size_class)).in_bytes();
+  //   size_t allocated_size = tc_globals.sizemap().class_to_size(size_class);
+  //   size_t objects_per_span = span_size / allocated_size;
+  //   printf("[%ld] alloc size %ld object per span %ld\n", size_class, allocated_size, objects_per_span);
+  // }
+
+  // this is cheap but optimizes a lot for perl
+  // Span* loc_span = tc_globals.pagemap().GetDescriptor(PageIdContaining((void*)loc));
+  // if (!loc_span) {
+  //   return -1;
+  // }
+#ifdef POINTER_TAGGING
+  // Stale pointers are caught by their tags; nothing needs to be tracked.
+  if (tags_protect(ptr)) return 0;
+#endif
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_heap_cnt.Add(1);
+#endif
+  // a stale pointer has nothing left to track
+  if (ABSL_PREDICT_FALSE(IsPoisoned((uintptr_t)ptr))) return -1;
+#ifdef SAMPLED_ESCAPE_SPANS
+  if (escape_untracked(ptr)) return -1;
+#endif
+#ifdef ESCAPE_SPAN_CACHE
+  // A span found here was used by an escape a moment ago, so it needs
+  // neither the page map walk nor a prefetch.
+  if (Span* span = thread_escape_spans_.Lookup((uintptr_t)ptr)) {
+#ifdef ENABLE_STATISTIC
+    tc_globals.escape_span_cache_hit.Add(1);
+    tc_globals.escape_valid_cnt.Add(1);
+#endif
+    return do_escape_in_span(span, loc, ptr, old_ptr);
+  }
+#endif
+  Span* span = tc_globals.pagemap().GetDescriptor(PageIdContaining(ptr));
+  if (!span) {
+    return -1;
+  }
+  span->Prefetch();
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_valid_cnt.Add(1);
 #endif
-#ifdef CRASH_ON_CORRUPTION
-  fflush(stdout);
-  abort();
+#ifdef ESCAPE_SPAN_CACHE
+  const int ret = do_escape_in_span(span, loc, ptr, old_ptr);
+  // The span is in cache by now.  One without an object size is being
+  // freed, or was, and is not worth keeping.
+  if (span->obj_size != 0) {
+    thread_escape_spans_.Insert((uintptr_t)span->start_address(),
+                                span->bytes_in_span(), span);
+  }
+  return ret;
+#else
+  return do_escape_in_span(span, loc, ptr, old_ptr);
+#endif
+}
+
+// Escapes ptrs[i] through locs[i] for every i < n.  Runs of pointers into the
+// same span, as produced by filling an array or copying a struct, resolve
+// the span once, and the descriptors of later entries are prefetched while
+// earlier ones are staged.  Returns -1 if any entry was not tracked.
+static inline int do_escape_batch(void*** locs, void** ptrs,
+                                  size_t n) noexcept {
+#ifdef POINTER_TAGGING
+  if (PointerTags::enabled() && !PointerTags::hardware()) return 0;
+#endif
+  constexpr size_t kPrefetchDistance = 8;
+  int ret = 0;
+  Span* span = nullptr;
+  uintptr_t span_start = 0;
+  uintptr_t span_len = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (i + kPrefetchDistance < n) {
+      tc_globals.pagemap().PrefetchDescriptor(
+          PageIdContaining(ptrs[i + kPrefetchDistance]));
+    }
+    void* ptr = ptrs[i];
+#ifdef POINTER_TAGGING
+    if (tags_protect(ptr)) continue;
+#endif
+#ifdef ENABLE_STATISTIC
+    tc_globals.escape_heap_cnt.Add(1);
+#endif
+    if ((uintptr_t)ptr - span_start >= span_len) {
+      span = tc_globals.pagemap().GetDescriptor(PageIdContaining(ptr));
+      if (!span) {
+        span_start = span_len = 0;
+        ret = -1;
+        continue;
+      }
+      span->Prefetch();
+      span_start = (uintptr_t)span->start_address();
+      span_len = span->bytes_in_span();
+    }
+#ifdef ENABLE_STATISTIC
+    tc_globals.escape_valid_cnt.Add(1);
+#endif
+#ifdef SAMPLED_ESCAPE_SPANS
+    if (escape_untracked(ptr)) {
+      ret = -1;
+      continue;
+    }
+#endif
+    if (do_escape_in_span(span, locs[i], ptr, *locs[i]) != 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+// Escapes every word of src[0, len) that points into the heap through the
+// word at the same offset of dst, for a caller about to copy src to dst.
+// Words of dst that are not pointer aligned cannot hold a tracked pointer and
+// are skipped.  When the ranges overlap (a memmove), the source slots are
+// about to be overwritten, so their committed escapes are moved to the
+// destination slots instead of being recorded again.
+static inline int do_escape_range(void* dst, const void* src,
+                                  size_t len) noexcept {
+#ifdef POINTER_TAGGING
+  // Tagged words are skipped by the filter below.
+  if (PointerTags::enabled() && !PointerTags::hardware()) return 0;
+#endif
+  const uintptr_t dst_start = (uintptr_t)dst;
+  const uintptr_t dst_end = dst_start + len;
+  const uintptr_t delta = (uintptr_t)src - dst_start;
+  const bool move = (uintptr_t)src < dst_end &&
+                    dst_start < (uintptr_t)src + len;
+
+  Span* span = nullptr;
+  uintptr_t span_start = 0;
+  uintptr_t span_len = 0;
+  for (uintptr_t d = (dst_start + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+       d + sizeof(void*) <= dst_end; d += sizeof(void*)) {
+    const uintptr_t s = d + delta;
+    uintptr_t v;
+    memcpy(&v, (const void*)s, sizeof(v));
+    // Cheap filter before the pagemap walk: null, small integers and poisoned
+    // or tagged words are never heap addresses.
+    if (v < kPageSize || (v >> kAddressBits) != 0)
+      continue;
+#ifdef ENABLE_STATISTIC
+    tc_globals.escape_heap_cnt.Add(1);
+#endif
+    if (v - span_start >= span_len) {
+      span = tc_globals.pagemap().GetDescriptor(PageIdContaining((void*)v));
+      if (!span) {
+        span_start = span_len = 0;
+        continue;
+      }
+      span->Prefetch();
+      span_start = (uintptr_t)span->start_address();
+      span_len = span->bytes_in_span();
+    }
+#ifdef ENABLE_STATISTIC
+    tc_globals.escape_valid_cnt.Add(1);
 #endif
+#ifdef SAMPLED_ESCAPE_SPANS
+    // an untracked span has no committed escapes to transfer either
+    if (escape_untracked((void*)v)) continue;
+#endif
+    if (move && (s & (sizeof(void*) - 1)) == 0 &&
+        transfer_escape(span, (void**)s, (void**)d, (void*)v))
+      continue;
+    do_escape_in_span(span, (void**)d, (void*)v, *(void**)d);
+  }
+  return 0;
 }
 
 static inline size_t do_get_chunk_range(void* base, size_t* start) noexcept {
 #ifdef ENABLE_STATISTIC
-  tc_globals.get_range_cnt++;
+  tc_globals.get_range_cnt.Add(1);
+#endif
+#ifdef ENABLE_PROTECTION
+  TCMALLOC_COUNT_THREAD(checks, 1);
+#endif
+
+  uintptr_t _chunk_start, _chunk_end;
+
+  if (!CachedChunkRange((uintptr_t)base, &_chunk_start, &_chunk_end)) {
+#ifdef ENABLE_STATISTIC
+    tc_globals.get_range_invalid_cnt.Add(1);
+#endif
+    // Non-heap memory: the whole address space is fair game.
+    _chunk_start = 0;
+    _chunk_end = uintptr_t{1} << kAddressBits;
+  }
+
+  *start = _chunk_start;
+  return _chunk_end;
+}
+
+static inline void do_report_statistic() {
+#ifdef ENABLE_STATISTIC
+  fprintf(stderr, "\nmalloc count\t\t: %ld\n", tc_globals.malloc_cnt.value());
+  fprintf(stderr, "free count\t\t: %ld\n", tc_globals.free_cnt.value());
+  fprintf(stderr, "escape count\t\t: %ld\n", tc_globals.escape_cnt.value());
+  fprintf(stderr, "escape valid count\t: %ld\n", tc_globals.escape_valid_cnt.value());
+  fprintf(stderr, "escape heap count\t: %ld\n", tc_globals.escape_heap_cnt.value());
+  fprintf(stderr, "escape optimized count\t: %ld\n", tc_globals.escape_loc_optimized.value());
+  fprintf(stderr, "escape intra object\t: %ld\n", tc_globals.escape_intra_object.value());
+  fprintf(stderr, "escape final count\t: %ld\n", tc_globals.escape_final_cnt.value());
+  fprintf(stderr, "escape cache optimized\t: %ld\n", tc_globals.escape_cache_optimized.value());
+  fprintf(stderr, "escape buffer dedup\t: %ld\n", tc_globals.escape_buffer_dedup.value());
+#ifdef ESCAPE_CACHE_L2
+  {
+    size_t hits = tc_globals.escape_l2_cache_optimized.value();
+    size_t misses = tc_globals.escape_l2_cache_miss.value();
+    size_t lookups = hits + misses;
+    fprintf(stderr, "escape l2 cache entries\t: %ld\n",
+            tc_globals.escape_filter().entries());
+    fprintf(stderr, "escape l2 cache hit\t: %ld (%.2f%%)\n", hits,
+            lookups ? 100.0 * hits / lookups : 0.0);
+    fprintf(stderr, "escape l2 cache miss\t: %ld (%.2f%%)\n", misses,
+            lookups ? 100.0 * misses / lookups : 0.0);
+  }
+#endif
+  fprintf(stderr, "get range count\t: %ld\n", tc_globals.get_range_cnt.value());
+  fprintf(stderr, "get range invalid count\t: %ld\n", tc_globals.get_range_invalid_cnt.value());
+  fprintf(stderr, "gep check count\t: %ld\n", tc_globals.gep_check_cnt.value());
+  fprintf(stderr, "gep check invalid count\t: %ld\n", tc_globals.gep_check_invalid_cnt.value());
+  fprintf(stderr, "bc check count\t: %ld\n", tc_globals.bc_check_cnt.value());
+  fprintf(stderr, "bc check invalid count\t: %ld\n", tc_globals.bc_check_invalid_cnt.value());
+  fprintf(stderr, "invalid check estimate\t: %ld\n", tc_globals.check_invalid_estimate.value());
+#ifdef CHUNK_CACHE
+  fprintf(stderr, "chunk cache hit\t: %ld\n", tc_globals.chunk_cache_hit.value());
+#endif
+#ifdef ESCAPE_SPAN_CACHE
+  fprintf(stderr, "escape span cache hit\t: %ld\n",
+          tc_globals.escape_span_cache_hit.value());
+#endif
+#if defined(FREE_QUARANTINE) || defined(LIFETIME_PROTECTION)
+  fprintf(stderr, "quarantine released\t: %ld\n", tc_globals.quarantine_released_cnt.value());
+#endif
+  fprintf(stderr, "remote escape free count\t: %ld\n", tc_globals.remote_escape_free_cnt.value());
+#ifdef REMOTE_FREE_QUEUE
+  fprintf(stderr, "remote free drained\t: %ld\n", tc_globals.remote_free_drained_cnt.value());
+#endif
+#ifdef LIFETIME_PROTECTION
+  fprintf(stderr, "short lived sampled\t: %ld\n", tc_globals.short_lived_sampled_cnt.value());
+  fprintf(stderr, "short lived escape skipped\t: %ld\n", tc_globals.short_lived_escape_skipped.value());
+#endif
+#ifdef OUTGOING_ESCAPE_INDEX
+  fprintf(stderr, "escape pruned count\t: %ld\n", tc_globals.escape_pruned_cnt.value());
+  fprintf(stderr, "escape dead count\t: %ld\n", tc_globals.escape_dead_cnt.value());
+#endif
+#ifdef ESCAPE_CHAIN_SWEEP
+  fprintf(stderr, "escape swept count\t: %ld\n", tc_globals.escape_swept_cnt.value());
+#endif
+#ifdef ESCAPE_LOCATION_CLASSES
+  fprintf(stderr, "escape location heap\t: %ld\n", tc_globals.escape_location_cnt[0].value());
+  fprintf(stderr, "escape location stack\t: %ld\n", tc_globals.escape_location_cnt[1].value());
+  fprintf(stderr, "escape location global\t: %ld\n", tc_globals.escape_location_cnt[2].value());
+  fprintf(stderr, "escape location other\t: %ld\n", tc_globals.escape_location_cnt[3].value());
+  fprintf(stderr, "stack escape truncated\t: %ld\n", tc_globals.escape_stack_truncated.value());
+#endif
+#ifdef DEFERRED_ESCAPE_POISON
+  fprintf(stderr, "escape poison deferred\t: %ld\n", tc_globals.escape_deferred_cnt.value());
+  fprintf(stderr, "escape poison evicted\t: %ld\n", tc_globals.escape_deferred_evicted.value());
+#endif
+#ifdef SAMPLED_ESCAPE_SPANS
+  fprintf(stderr, "escape untracked count\t: %ld\n", tc_globals.escape_untracked_cnt.value());
+#endif
+#ifdef ESCAPE_REFCOUNTS
+  fprintf(stderr, "escape ref quarantined\t: %ld\n", tc_globals.escape_ref_quarantined.value());
+  fprintf(stderr, "escape ref overwritten\t: %ld\n", tc_globals.escape_ref_overwritten.value());
+#endif
+  // The experiments this run is in, so runs can be grouped by arm.
+  fprintf(stderr, "active experiments\t:");
+  WalkExperiments([](absl::string_view name, bool active) {
+    if (active) {
+      fprintf(stderr, " %.*s", static_cast<int>(name.size()), name.data());
+    }
+  });
+  fprintf(stderr, "\n");
+#endif
+}
+
+}  // namespace
+
+size_t CommitPendingEscapes() { return commit_pending_escapes(); }
+
+void RequestEscapeFlush() {
+  escape_flush_epoch.fetch_add(1, std::memory_order_relaxed);
+}
+
+void FlushThreadEscapes() {
+  EscapeBuffer* buffer = thread_state_.escape_buffer;
+#ifdef ESCAPE_LOCATION_CLASSES
+  if (!thread_stack_escapes_.empty()) {
+    if (buffer == nullptr) buffer = GetEscapeBuffer();
+    spill_stack_escapes(buffer);
+  }
+#endif
+  if (buffer != nullptr && buffer->size() != 0) {
+    flush_escape(buffer);
+  }
+}
+
+#ifdef FORK_AWARE_PROTECTION
+// pthread_atfork() handlers.  Before fork() the parent commits the escapes
+// queued for the background flusher and those of the forking thread, so
+// that its children do not each commit them again into the metadata they
+// share with it, and locks the escape chunk allocators.  The child then
+// carves chunks from slabs of its own only, see
+// EscapeChunkAllocator::FreezeForChild().
+static void PrepareForkEscapes() {
+  sync_pending_escapes();
+  FlushThreadEscapes();
+  for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+    tc_globals.escape_allocator(partition).LockForFork();
+  }
+}
+
+static void ParentForkEscapes() {
+  for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+    tc_globals.escape_allocator(partition).UnlockForFork();
+  }
+}
+
+static void ChildForkEscapes() {
+  // A batch the flusher was committing is lost with its thread; every free
+  // would wait for it otherwise.
+  escape_commits_in_flight.store(0, std::memory_order_relaxed);
+  for (size_t partition = 0; partition < kNumaPartitions; ++partition) {
+    EscapeChunkAllocator& allocator = tc_globals.escape_allocator(partition);
+    allocator.FreezeForChild();
+    allocator.UnlockForFork();
+  }
+}
+#endif
+
+size_t DrainQuarantine() {
+  size_t total = 0;
+#ifdef FREE_QUARANTINE
+  QuarantineEntry batch[QuarantineShard::kCapacity];
+  for (QuarantineShard& shard : quarantine_shards) {
+    const size_t n = shard.Take(batch);
+    if (n != 0) {
+      release_quarantined(batch, n);
+#ifdef ENABLE_STATISTIC
+      tc_globals.quarantine_released_cnt.Add(n);
+#endif
+    }
+    total += n;
+  }
+#endif
+#ifdef REMOTE_FREE_QUEUE
+  for (size_t shard = 0; shard < kQuarantineShards; ++shard) {
+    if (!remote_free_queues[shard].MaybeEmpty()) {
+      total += drain_remote_frees(shard);
+    }
+  }
+#endif
+#ifdef LIFETIME_PROTECTION
+  {
+    QuarantineEntry batch[QuarantineShard::kCapacity];
+    const size_t n = short_lived_quarantine.Take(batch);
+    if (n != 0) {
+      release_short_lived(batch, n);
+#ifdef ENABLE_STATISTIC
+      tc_globals.quarantine_released_cnt.Add(n);
+#endif
+    }
+    total += n;
+  }
+#endif
+#ifdef ESCAPE_REFCOUNTS
+  for (QuarantineShard& shard : referenced_quarantine) {
+    QuarantineEntry batch[QuarantineShard::kCapacity];
+    const size_t n = shard.Take(batch);
+    if (n != 0) release_referenced(batch, n);
+    total += n;
+  }
+#endif
+#ifdef DEFERRED_ESCAPE_POISON
+  if (!deferred_poison_queue.MaybeEmpty()) {
+    DeferredPoisonEntry batch[DeferredPoisonQueue::kCapacity];
+    const size_t n = deferred_poison_queue.Take(batch);
+    for (size_t i = 0; i < n; ++i) {
+      finish_deferred_poison(batch[i]);
+    }
+    total += n;
+  }
+#endif
+#if defined(LARGE_FREE_OFFLOAD) || defined(SCRUB_ON_FREE)
+  if (offloaded_frees_len.load(std::memory_order_relaxed) != 0) {
+    total += complete_offloaded_frees();
+  }
+#endif
+  return total;
+}
+
+#if defined(HEAP_COMPACTION) && !defined(TCMALLOC_SMALL_BUT_SLOW)
+#if defined(POINTER_TAGGING) || defined(ESCAPE_REFCOUNTS) || \
+    defined(OUTGOING_ESCAPE_INDEX)
+#error "HEAP_COMPACTION does not move tags, escape counts or outgoing escapes"
+#endif
+
+// Serializes MallocExtension::CompactHeap().  compaction_free marks the free
+// objects of the span being compacted by index.
+ABSL_CONST_INIT static absl::base_internal::SpinLock compaction_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+inline constexpr size_t kMaxCompactionObjects = kMaxEscapeTableSize;
+ABSL_CONST_INIT static uint64_t compaction_free[kMaxCompactionObjects / 64];
+// Spans a pass over one size class keeps aside because one of their objects
+// cannot move.  It holds their free objects until it ends, so that it does
+// not take them again.
+inline constexpr size_t kMaxCompactionAside = 64;
+
+// Rewrites the record of old_loc in the escape chain of the object that
+// *new_loc points into to new_loc, which took over the value of old_loc.
+// A compressed chunk without room for new_loc drops the record and new_loc
+// is escaped anew.  Returns false if the chain has no record of old_loc.
+static bool retarget_escape(void** old_loc, void** new_loc) {
+  const uintptr_t ptr = SMALL_PTR(*new_loc);
+  if (IsPoisoned(ptr)) return false;
+  Span* span = tc_globals.pagemap().GetDescriptor(PageIdContaining(*new_loc));
+  if (span == nullptr || span->obj_size == 0) return false;
+  EscapeHead* list = span->escape_list.load(std::memory_order_acquire);
+  const uintptr_t start = reinterpret_cast<uintptr_t>(span->start_address());
+  const size_t idx = (ptr - SMALL_PTR(start)) / span->object_bytes();
+  if (list == nullptr || idx >= EscapeTableSize(span->objects_per_span)) {
+    return false;
+  }
+  EscapeHead* head = FindEscapeHead(list, idx);
+  if (head == nullptr || head->load(std::memory_order_relaxed) == nullptr) {
+    return false;
+  }
+
+  bool found = false;
+  bool stored = false;
+  struct escape* first = lock_escape_head(head);
+  for (struct escape* cur = first; cur && !found; cur = cur->next) {
+    const size_t n = EscapeChunkSize(cur);
+    for (size_t i = 0; i < n; i++) {
+      if (EscapeChunkLoc(cur, i) != old_loc) continue;
+      found = true;
+      stored = SetEscapeChunkLoc(cur, i, new_loc);
+      if (!stored) {
+        MoveEscapeChunkLoc(cur, i, n - 1);
+        TruncateEscapeChunk(cur, n - 1);
+      }
+      break;
+    }
+  }
+  head->store(first, std::memory_order_release);
+#ifdef ESCAPE_CACHE_L2
+  if (found) {
+    tc_globals.escape_filter().Erase((uintptr_t)old_loc,
+                                     start + idx * span->object_bytes());
+  }
+#endif
+  // new_loc already points into the object, which must not skip it.
+  if (found && !stored) do_escape(new_loc, *new_loc, nullptr);
+  return found;
+}
+
+// Whether the live object ptr, object idx of span, may move: escapes into it
+// are recorded, and no queue of the allocator still holds it.
+static bool compaction_movable(Span* span, size_t idx, void* ptr) {
+  if (idx >= EscapeTableSize(span->objects_per_span)) return false;
+#if defined(FREE_QUARANTINE) || defined(REMOTE_FREE_QUEUE) || \
+    defined(LIFETIME_PROTECTION) || defined(DEFERRED_ESCAPE_POISON)
+  if (is_quarantined(ptr)) return false;
 #endif
+  (void)ptr;
+  return true;
+}
+
+// Returns the objects of chain, linked through their first words, to
+// central.
+static void release_compaction_chain(CentralFreeList& central, void* chain) {
+  void* batch[kMaxObjectsToMove];
+  size_t n = 0;
+  while (chain != nullptr) {
+    void* next = *static_cast<void**>(chain);
+#ifdef SCRUB_ON_FREE
+    *static_cast<void**>(chain) = nullptr;
+#endif
+    batch[n++] = chain;
+    chain = next;
+    if (n == kMaxObjectsToMove || chain == nullptr) {
+      central.InsertRange({batch, n});
+      n = 0;
+    }
+  }
+}
 
-  size_t** pagemap_ = (size_t**) &tcmalloc::tcmalloc_internal::Static::pagemap_;
-  unsigned int* sizemap_ = (unsigned int*) &tcmalloc::tcmalloc_internal::Static::sizemap_;
-  
-  size_t _chunk_start, _chunk_end;
-  size_t _base = (size_t) base;
-  size_t mask = (_base >> 13) & 0x7fff;
-  size_t* pagemap = pagemap_[_base >> 28];
-  size_t pageid, start_addr, obj_size;
+// Moves the live objects of the sparsest spans of size_class into the free
+// objects of its other spans while *moved stays within budget, adding the
+// bytes of each object moved to *moved.  Returns the bytes of the spans
+// freed.
+static size_t compact_size_class(int size_class, size_t budget, size_t* moved)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(compaction_lock) {
+  CentralFreeList& central =
+      tc_globals.transfer_cache().central_freelist(size_class);
+  const size_t size = tc_globals.sizemap().class_to_size(size_class);
+  void* aside[kMaxCompactionAside];
+  size_t num_aside = 0;
+  size_t freed = 0;
+  while (num_aside < kMaxCompactionAside && *moved + size <= budget) {
+    void* chain = nullptr;
+    Span* span = central.TakeSparsestSpan(
+        (budget - *moved) / size, [&](void* object) {
+          *static_cast<void**>(object) = chain;
+          chain = object;
+        });
+    if (span == nullptr) break;
+
+    const uintptr_t start = reinterpret_cast<uintptr_t>(span->start_address());
+    const size_t objects = span->objects_per_span;
+    CHECK_CONDITION(objects <= kMaxCompactionObjects);
+    memset(compaction_free, 0, (objects + 63) / 64 * sizeof(uint64_t));
+    for (void* p = chain; p != nullptr; p = *static_cast<void**>(p)) {
+      const size_t idx = (reinterpret_cast<uintptr_t>(p) - start) / size;
+      compaction_free[idx / 64] |= uint64_t{1} << (idx % 64);
+    }
+    auto live = [&](size_t idx) {
+      return !(compaction_free[idx / 64] & (uint64_t{1} << (idx % 64)));
+    };
+    bool movable = true;
+    for (size_t idx = 0; idx < objects && movable; ++idx) {
+      movable = !live(idx) ||
+                compaction_movable(span, idx,
+                                   reinterpret_cast<void*>(start + idx * size));
+    }
+    if (!movable) {
+      aside[num_aside++] = chain;
+      continue;
+    }
 
-  if (pagemap && (pageid = pagemap[mask], (unsigned char) pageid)) {
-      start_addr = pageid >> 8 << 13;
-      obj_size = sizemap_[(unsigned char) pageid + 1171];
-      _chunk_start = start_addr + (obj_size * ((_base - start_addr) / obj_size));
-      _chunk_end = _chunk_start + obj_size;
-  } else {
-      size_t* span = pagemap_[mask + 0x8000];
-      if (span == nullptr) {
-#ifdef ENABLE_STATISTIC
-        tc_globals.get_range_invalid_cnt++;
-#endif
-          _chunk_start = 0;
-          _chunk_end = 0x1000000000000;
-      } else {
-          obj_size = 8LL * *((unsigned int*) span + 6);
-          start_addr = span[6] << 13;
-          _chunk_start = start_addr + (obj_size * ((_base - start_addr) / obj_size));
-          _chunk_end = _chunk_start + obj_size;
+    const size_t span_bytes = span->bytes_in_span();
+    bool emptied = true;
+    for (size_t idx = 0; idx < objects; ++idx) {
+      if (!live(idx)) continue;
+      void* dst;
+      if (central.RemoveRange(&dst, 1) != 1) {
+        emptied = false;
+        break;
       }
+      void* old = reinterpret_cast<void*>(start + idx * size);
+      memcpy(dst, old, size);
+      // The escapes the object made move with its words, then those into
+      // it are rewritten; a pointer into itself is then both.
+      if (!span->pointer_free()) {
+        void** from = static_cast<void**>(old);
+        void** to = static_cast<void**>(dst);
+        for (size_t k = 0; k < size / sizeof(void*); ++k) {
+          if (to[k] != nullptr) retarget_escape(&from[k], &to[k]);
+        }
+      }
+      migrate_escapes(old, size, dst, size);
+#ifdef SCRUB_ON_FREE
+      Scrub(old, size);
+#endif
+      *static_cast<void**>(old) = chain;
+      chain = old;
+      *moved += size;
+    }
+    release_compaction_chain(central, chain);
+    if (!emptied) break;
+    freed += span_bytes;
   }
-
-  *start = _chunk_start;
-  return _chunk_end;
+  for (size_t i = 0; i < num_aside; ++i) {
+    release_compaction_chain(central, aside[i]);
+  }
+  return freed;
 }
 
-static inline void do_report_statistic() {
-#ifdef ENABLE_STATISTIC
-  fprintf(stderr, "\nmalloc count\t\t: %ld\n", tc_globals.malloc_cnt);
-  fprintf(stderr, "free count\t\t: %ld\n", tc_globals.free_cnt);
-  fprintf(stderr, "escape count\t\t: %ld\n", tc_globals.escape_cnt);
-  fprintf(stderr, "escape valid count\t: %ld\n", tc_globals.escape_valid_cnt);
-  fprintf(stderr, "escape heap count\t: %ld\n", tc_globals.escape_heap_cnt);
-  fprintf(stderr, "escape optimized count\t: %ld\n", tc_globals.escape_loc_optimized);
-  fprintf(stderr, "escape final count\t: %ld\n", tc_globals.escape_final_cnt);
-  fprintf(stderr, "escape cache optimized\t: %ld\n", tc_globals.escape_cache_optimized);
-  fprintf(stderr, "get range count\t: %ld\n", tc_globals.get_range_cnt);
-  fprintf(stderr, "get range invalid count\t: %ld\n", tc_globals.get_range_invalid_cnt);
-  fprintf(stderr, "gep check count\t: %ld\n", tc_globals.gep_check_cnt);
-  fprintf(stderr, "gep check invalid count\t: %ld\n", tc_globals.gep_check_invalid_cnt);
-  fprintf(stderr, "bc check count\t: %ld\n", tc_globals.bc_check_cnt);
-  fprintf(stderr, "bc check invalid count\t: %ld\n", tc_globals.bc_check_invalid_cnt);
-#endif
+static size_t do_compact_heap(size_t budget) {
+  absl::base_internal::SpinLockHolder l(&compaction_lock);
+  // A span tells its live objects apart only once every free object is back
+  // in the central free lists, and escapes into them are committed.
+  DrainQuarantine();
+  FlushThreadEscapes();
+  sync_pending_escapes();
+  if (tc_globals.CpuCacheActive()) {
+    const int num_cpus = absl::base_internal::NumCPUs();
+    for (int cpu = 0; cpu < num_cpus; ++cpu) {
+      tc_globals.cpu_cache().Reclaim(cpu);
+    }
+  }
+  // A shard is plundered once it has been left alone for a pass.
+  tc_globals.sharded_transfer_cache().Plunder();
+  tc_globals.sharded_transfer_cache().Plunder();
+
+  size_t moved = 0;
+  size_t freed = 0;
+  void* batch[kMaxObjectsToMove];
+  for (int size_class = 1; size_class < kNumClasses && moved < budget;
+       ++size_class) {
+    if (tc_globals.sizemap().class_to_size(size_class) == 0) continue;
+    auto& transfer_cache = tc_globals.transfer_cache();
+    CentralFreeList& central = transfer_cache.central_freelist(size_class);
+    const size_t batch_size = static_cast<size_t>(
+        tc_globals.sizemap().num_objects_to_move(size_class));
+    while (size_t n =
+               std::min(transfer_cache.tc_length(size_class), batch_size)) {
+      const int got = transfer_cache.RemoveRange(size_class, batch, n);
+      if (got <= 0) break;
+      central.InsertRange({batch, static_cast<size_t>(got)});
+    }
+    freed += compact_size_class(size_class, budget, &moved);
+  }
+  // Escapes that did not fit their chunks were staged.
+  FlushThreadEscapes();
+  return freed;
 }
+#endif
 
-}  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
@@ -1953,33 +5642,91 @@ GOOGLE_MALLOC_SECTION_END
 using tcmalloc::tcmalloc_internal::AllocSmall;
 using tcmalloc::tcmalloc_internal::CppPolicy;
 using tcmalloc::tcmalloc_internal::do_free_no_hooks;
+#if defined(HEAP_COMPACTION) && !defined(TCMALLOC_SMALL_BUT_SLOW)
+using tcmalloc::tcmalloc_internal::do_compact_heap;
+#endif
 #ifdef TCMALLOC_HAVE_STRUCT_MALLINFO
 using tcmalloc::tcmalloc_internal::do_mallinfo;
 #endif
 using tcmalloc::tcmalloc_internal::do_malloc_pages;
 using tcmalloc::tcmalloc_internal::do_malloc_stats;
+#ifdef REALLOC_MREMAP
+using tcmalloc::tcmalloc_internal::move_object;
+#endif
+#ifdef REALLOC_IN_PLACE
+using tcmalloc::tcmalloc_internal::do_resize_pages;
+#endif
 #ifdef TCMALLOC_HAVE_MALLOC_TRIM
 using tcmalloc::tcmalloc_internal::do_malloc_trim;
 #endif
 using tcmalloc::tcmalloc_internal::do_mallopt;
+#ifdef DETERMINISTIC_MODE
+using tcmalloc::tcmalloc_internal::DeterministicMode;
+#endif
+using tcmalloc::tcmalloc_internal::GetSize;
 using tcmalloc::tcmalloc_internal::GetThreadSampler;
+using tcmalloc::tcmalloc_internal::GetUsableSize;
 using tcmalloc::tcmalloc_internal::MallocPolicy;
 using tcmalloc::tcmalloc_internal::SetClassCapacity;
 using tcmalloc::tcmalloc_internal::SetPagesCapacity;
+using tcmalloc::tcmalloc_internal::StripPointerTag;
+#ifdef POINTER_TAGGING
+using tcmalloc::tcmalloc_internal::tag_alloc;
+#endif
 using tcmalloc::tcmalloc_internal::tc_globals;
+#ifdef THREAD_ALLOCATION_STATS
+using tcmalloc::tcmalloc_internal::thread_allocation_stats_;
+#endif
+#ifdef HEAP_PARTITIONS
+using tcmalloc::tcmalloc_internal::heap_partitions_;
+using tcmalloc::tcmalloc_internal::HeapPartitions;
+using tcmalloc::tcmalloc_internal::thread_state_;
+#endif
 using tcmalloc::tcmalloc_internal::UsePerCpuCache;
 
 // export safe function
 using tcmalloc::tcmalloc_internal::do_gep_check_boundary;
+using tcmalloc::tcmalloc_internal::do_gep_check_boundary_batch;
+using tcmalloc::tcmalloc_internal::do_gep_check_boundary_range;
+using tcmalloc::tcmalloc_internal::do_chunk_range;
+using tcmalloc::tcmalloc_internal::do_chunk_range_batch;
 using tcmalloc::tcmalloc_internal::do_bc_check_boundary;
+using tcmalloc::tcmalloc_internal::hardware_checked;
 using tcmalloc::tcmalloc_internal::do_escape;
+using tcmalloc::tcmalloc_internal::do_escape_batch;
+using tcmalloc::tcmalloc_internal::do_escape_range;
+using tcmalloc::tcmalloc_internal::migrate_escapes;
+using tcmalloc::tcmalloc_internal::Parameters;
 using tcmalloc::tcmalloc_internal::do_get_chunk_range;
 using tcmalloc::tcmalloc_internal::do_report_error;
+using tcmalloc::tcmalloc_internal::protection_check_weight;
+using tcmalloc::tcmalloc_internal::count_invalid_check;
+using tcmalloc::tcmalloc_internal::protection_escapes_enabled;
 using tcmalloc::tcmalloc_internal::do_report_statistic;
 using tcmalloc::tcmalloc_internal::do_strcat_check;
 using tcmalloc::tcmalloc_internal::do_strncat_check;
 using tcmalloc::tcmalloc_internal::do_strcpy_check;
 using tcmalloc::tcmalloc_internal::do_strncpy_check;
+using tcmalloc::tcmalloc_internal::do_memcpy_check;
+using tcmalloc::tcmalloc_internal::do_memmove_check;
+using tcmalloc::tcmalloc_internal::do_memset_check;
+using tcmalloc::tcmalloc_internal::do_strlen_check;
+using tcmalloc::tcmalloc_internal::do_strnlen_check;
+using tcmalloc::tcmalloc_internal::do_get_chunk_room;
+#ifdef EXTERNAL_REGIONS
+using tcmalloc::tcmalloc_internal::do_register_region;
+using tcmalloc::tcmalloc_internal::do_unregister_region;
+#endif
+#ifdef FORTIFY_CHK
+using tcmalloc::tcmalloc_internal::do_stpcpy_chk;
+using tcmalloc::tcmalloc_internal::do_strcat_chk;
+using tcmalloc::tcmalloc_internal::fortify_len;
+#endif
+using tcmalloc::tcmalloc_internal::kMaxSize;
+#ifdef POINTER_FREE_CLASSES
+using tcmalloc::tcmalloc_internal::kNumPointerFreeClasses;
+using tcmalloc::tcmalloc_internal::kPointerFreeClassesStart;
+#endif
 
 #ifdef TCMALLOC_DEPRECATED_PERTHREAD
 using tcmalloc::tcmalloc_internal::ThreadCache;
@@ -1994,7 +5741,8 @@ using tcmalloc::tcmalloc_internal::ThreadCache;
 // in the anonymous namespace, to workaround incomplete heapz filtering.
 template <typename Policy, typename CapacityPtr = std::nullptr_t>
 static void* ABSL_ATTRIBUTE_SECTION(google_malloc)
-    slow_alloc(Policy policy, size_t size, CapacityPtr capacity = nullptr) {
+    slow_alloc(Policy policy, size_t size, CapacityPtr capacity = nullptr,
+               bool* known_zero = nullptr) {
   tc_globals.InitIfNecessary();
   GetThreadSampler()->UpdateFastPathState();
   void* p;
@@ -2003,26 +5751,36 @@ static void* ABSL_ATTRIBUTE_SECTION(google_malloc)
   if (ABSL_PREDICT_TRUE(is_small)) {
     p = AllocSmall(policy, size_class, size, capacity);
   } else {
-    p = do_malloc_pages(policy, size, 1, capacity);
+    p = do_malloc_pages(policy, size, 1, capacity, known_zero);
     if (ABSL_PREDICT_FALSE(p == nullptr)) {
       return Policy::handle_oom(size);
     }
   }
   if (Policy::invoke_hooks()) {
   }
+#ifdef THREAD_ALLOCATION_STATS
+  if (ABSL_PREDICT_TRUE(p != nullptr)) {
+    TCMALLOC_COUNT_THREAD(allocations, 1);
+    TCMALLOC_COUNT_THREAD(allocated_bytes, GetSize(p));
+  }
+#endif
+#ifdef POINTER_TAGGING
+  p = tag_alloc(p);
+#endif
   return p;
 }
 
 template <typename Policy, typename CapacityPtr = std::nullptr_t>
 static inline void* ABSL_ATTRIBUTE_ALWAYS_INLINE
-fast_alloc(Policy policy, size_t size, CapacityPtr capacity = nullptr) {
+fast_alloc_untraced(Policy policy, size_t size, CapacityPtr capacity,
+                    bool* known_zero = nullptr) {
   // If size is larger than kMaxSize, it's not fast-path anymore. In
   // such case, GetSizeClass will return false, and we'll delegate to the slow
   // path. If malloc is not yet initialized, we may end up with size_class == 0
   // (regardless of size), but in this case should also delegate to the slow
   // path by the fast path check further down.
 #ifdef ENABLE_STATISTIC
-  tc_globals.malloc_cnt++;
+  tc_globals.malloc_cnt.Add(1);
 #endif
 
 #ifdef ENABLE_PROTECTION
@@ -2034,13 +5792,18 @@ fast_alloc(Policy policy, size_t size, CapacityPtr capacity = nullptr) {
   //            /|\
   //             |
   //            ptr
-  size = size + 1;
+  // Page allocations are padded too.  Only a request of whole pages pays a
+  // page for the byte, and the end of such an allocation is the start of the
+  // next span: an escaped location holding that address may point to either,
+  // and nothing recorded at __escape() time tells which.
+  // Policies without escapes to confuse compile it out.
+  if (Policy::pad_requests()) size = size + 1;
 #endif
 
   uint32_t size_class;
   bool is_small = tc_globals.sizemap().GetSizeClass(policy, size, &size_class);
   if (ABSL_PREDICT_FALSE(!is_small)) {
-    return slow_alloc(policy, size, capacity);
+    return slow_alloc(policy, size, capacity, known_zero);
   }
 
   // When using per-thread caches, we have to check for the presence of the
@@ -2081,16 +5844,176 @@ fast_alloc(Policy policy, size_t size, CapacityPtr capacity = nullptr) {
     ASSUME(ret != nullptr);
   }
   SetClassCapacity(ret, size_class, capacity);
+#ifdef THREAD_ALLOCATION_STATS
+  if (ABSL_PREDICT_TRUE(ret != nullptr)) {
+    TCMALLOC_COUNT_THREAD(allocations, 1);
+    TCMALLOC_COUNT_THREAD(allocated_bytes,
+                          tc_globals.sizemap().class_to_size(size_class));
+  }
+#endif
+#ifdef POINTER_TAGGING
+  ret = tag_alloc(ret);
+#endif
+  return ret;
+}
+
+template <typename Policy, typename CapacityPtr = std::nullptr_t>
+static inline void* ABSL_ATTRIBUTE_ALWAYS_INLINE
+fast_alloc(Policy policy, size_t size, CapacityPtr capacity = nullptr,
+           bool* known_zero = nullptr) {
+  void* ret = fast_alloc_untraced(policy, size, capacity, known_zero);
+  TCMALLOC_TRACE_EVENT(kMalloc, ret, nullptr, size);
+  TCMALLOC_CAPTURE_EVENT(kAlloc, ret, nullptr, size);
   return ret;
 }
 
+// Allocates n objects of size bytes into out like n calls to
+// fast_alloc(policy, size), and returns how many it allocated; fewer than n
+// only if the allocator ran out of memory.  If none of the batch has to be
+// sampled, the objects come from the per-CPU cache with one restartable
+// sequence for as many as it holds.  Otherwise, and for batches of more than
+// kMaxSize bytes, every object takes fast_alloc().
+template <typename Policy>
+static inline size_t do_malloc_batch(Policy policy, size_t size, void** out,
+                                     size_t n) {
+  if (n == 0) return 0;
+  size_t got = 0;
+#ifndef TCMALLOC_DEPRECATED_PERTHREAD
+  // the same padding byte as fast_alloc_untraced()
+#ifdef ENABLE_PROTECTION
+  const size_t padded = Policy::pad_requests() ? size + 1 : size;
+#else
+  const size_t padded = size;
+#endif
+  uint32_t size_class;
+  if (tc_globals.sizemap().GetSizeClass(policy, padded, &size_class) &&
+      padded <= kMaxSize / n &&
+      GetThreadSampler()->TryRecordAllocationFast(padded * n)) {
+    ASSERT(size_class != 0);
+    got = tc_globals.cpu_cache().AllocateBatch<Policy::handle_oom>(size_class,
+                                                                  out, n);
+#ifdef ENABLE_STATISTIC
+    tc_globals.malloc_cnt.Add(got);
+#endif
+    TCMALLOC_COUNT_THREAD(allocations, got);
+    TCMALLOC_COUNT_THREAD(allocated_bytes,
+                          got * tc_globals.sizemap().class_to_size(size_class));
+    for (size_t i = 0; i < got; ++i) {
+#ifdef POINTER_TAGGING
+      out[i] = tag_alloc(out[i]);
+#endif
+      TCMALLOC_TRACE_EVENT(kMalloc, out[i], nullptr, size);
+      TCMALLOC_CAPTURE_EVENT(kAlloc, out[i], nullptr, size);
+    }
+    if (got == n || !Policy::can_return_nullptr()) return got;
+  }
+#endif  // TCMALLOC_DEPRECATED_PERTHREAD
+  for (; got < n; ++got) {
+    out[got] = fast_alloc(policy, size);
+    if (ABSL_PREDICT_FALSE(out[got] == nullptr)) break;
+  }
+  return got;
+}
+
+#ifdef POINTER_FREE_CLASSES
+// Allocates from the pointer-free copy of the size class, so the object lives
+// in a span whose escapes do_escape_in_span() turns away.  The per-CPU caches
+// hold none of these classes, so objects come straight from the transfer
+// cache.  Allocations that are sampled, too large for a pointer-free class
+// or made before initialization get ordinary memory from fast_alloc().
+template <typename Policy>
+static inline void* ABSL_ATTRIBUTE_ALWAYS_INLINE
+pointer_free_alloc(Policy policy, size_t size) {
+  // the same padding byte as fast_alloc_untraced()
+  const size_t padded = Policy::pad_requests() ? size + 1 : size;
+  uint32_t size_class;
+  if (ABSL_PREDICT_TRUE(tc_globals.IsInited()) &&
+      tc_globals.sizemap().GetSizeClass(CppPolicy(), padded, &size_class) &&
+      size_class < kNumPointerFreeClasses &&
+      GetThreadSampler()->TryRecordAllocationFast(padded)) {
+    void* ret;
+    if (ABSL_PREDICT_TRUE(tc_globals.transfer_cache().RemoveRange(
+            kPointerFreeClassesStart + size_class, &ret, 1) == 1)) {
+#ifdef ENABLE_STATISTIC
+      tc_globals.malloc_cnt.Add(1);
+#endif
+      TCMALLOC_COUNT_THREAD(allocations, 1);
+      TCMALLOC_COUNT_THREAD(allocated_bytes,
+                            tc_globals.sizemap().class_to_size(size_class));
+      TCMALLOC_TRACE_EVENT(kMalloc, ret, nullptr, size);
+      TCMALLOC_CAPTURE_EVENT(kAlloc, ret, nullptr, size);
+      return ret;
+    }
+  }
+  return fast_alloc(policy, size, nullptr);
+}
+#endif  // POINTER_FREE_CLASSES
+
 using tcmalloc::tcmalloc_internal::GetOwnership;
-using tcmalloc::tcmalloc_internal::GetSize;
 
 extern "C" size_t MallocExtension_Internal_GetAllocatedSize(const void* ptr) {
   ASSERT(!ptr ||
          GetOwnership(ptr) != tcmalloc::MallocExtension::Ownership::kNotOwned);
-  return GetSize(ptr);
+  return GetUsableSize(ptr);
+}
+
+extern "C" void MallocExtension_Internal_GetThreadAllocationStats(
+    tcmalloc::MallocExtension::ThreadAllocationStats* stats) {
+#ifdef THREAD_ALLOCATION_STATS
+  *stats = thread_allocation_stats_;
+#endif
+}
+
+extern "C" void MallocExtension_Internal_GetHeapPartitionStats(
+    int partition, tcmalloc::MallocExtension::HeapPartitionStats* stats) {
+#ifdef HEAP_PARTITIONS
+  if (HeapPartitions::IsValid(partition)) {
+    *stats = heap_partitions_.Stats(partition);
+  }
+#endif
+}
+
+extern "C" void MallocExtension_Internal_SetHeapPartitionLimit(int partition,
+                                                               size_t bytes) {
+#ifdef HEAP_PARTITIONS
+  if (HeapPartitions::IsValid(partition)) {
+    heap_partitions_.SetLimit(partition, bytes);
+  }
+#endif
+}
+
+extern "C" int MallocExtension_Internal_SetHeapPartition(int partition) {
+#ifdef HEAP_PARTITIONS
+  const int previous = thread_state_.heap_partition;
+  thread_state_.heap_partition =
+      HeapPartitions::IsValid(partition) ? partition : 0;
+  return previous;
+#else
+  return 0;
+#endif
+}
+
+extern "C" void MallocExtension_Internal_SetDeterministicMode(bool enabled) {
+#ifdef DETERMINISTIC_MODE
+  tc_globals.InitIfNecessary();
+  if (enabled) {
+    DeterministicMode::Enable();
+    // The calling thread's sampler is usually the one being measured.
+    GetThreadSampler()->Reseed(DeterministicMode::NextSamplerSeed());
+  } else {
+    DeterministicMode::Disable();
+  }
+#endif
+  (void)enabled;
+}
+
+extern "C" size_t MallocExtension_Internal_CompactHeap(size_t budget) {
+#if defined(HEAP_COMPACTION) && !defined(TCMALLOC_SMALL_BUT_SLOW)
+  return do_compact_heap(budget);
+#else
+  (void)budget;
+  return 0;
+#endif
 }
 
 extern "C" void MallocExtension_Internal_MarkThreadBusy() {
@@ -2135,6 +6058,77 @@ MallocTracingExtension_Internal_GetAllocatedAddressRanges() {
       "output vector.");
 }
 
+absl::Status MallocTracingExtension_Internal_StartAllocationTrace(
+    const char* path, size_t max_events) {
+#ifdef ALLOCATION_TRACE
+  const int err =
+      tcmalloc::tcmalloc_internal::AllocationTrace::Start(path, max_events);
+  if (err != 0) {
+    return absl::Status(absl::ErrnoToStatusCode(err),
+                        "could not start the allocation trace");
+  }
+  return absl::OkStatus();
+#else
+  return absl::UnimplementedError("built without ALLOCATION_TRACE");
+#endif
+}
+
+absl::StatusOr<size_t> MallocTracingExtension_Internal_StopAllocationTrace() {
+#ifdef ALLOCATION_TRACE
+  size_t events = 0;
+  const int err = tcmalloc::tcmalloc_internal::AllocationTrace::Stop(&events);
+  if (err != 0) {
+    return absl::Status(absl::ErrnoToStatusCode(err),
+                        "could not stop the allocation trace");
+  }
+  return events;
+#else
+  return absl::UnimplementedError("built without ALLOCATION_TRACE");
+#endif
+}
+
+absl::Status MallocTracingExtension_Internal_StartTraceCapture(int fd) {
+#ifdef TRACE_CAPTURE
+  const int err = tcmalloc::tcmalloc_internal::TraceCapture::Start(fd);
+  if (err != 0) {
+    return absl::Status(absl::ErrnoToStatusCode(err),
+                        "could not start the trace capture");
+  }
+  return absl::OkStatus();
+#else
+  return absl::UnimplementedError("built without TRACE_CAPTURE");
+#endif
+}
+
+absl::StatusOr<tcmalloc::malloc_tracing_extension::TraceCaptureStats>
+MallocTracingExtension_Internal_StopTraceCapture() {
+#ifdef TRACE_CAPTURE
+  tcmalloc::malloc_tracing_extension::TraceCaptureStats stats = {};
+  const int err = tcmalloc::tcmalloc_internal::TraceCapture::Stop(&stats);
+  if (err != 0) {
+    return absl::Status(absl::ErrnoToStatusCode(err),
+                        "could not stop the trace capture");
+  }
+  return stats;
+#else
+  return absl::UnimplementedError("built without TRACE_CAPTURE");
+#endif
+}
+
+absl::Status MallocTracingExtension_Internal_WriteCallSiteProfile(
+    const char* path) {
+#ifdef CALLSITE_PROFILE
+  const int err = tcmalloc::tcmalloc_internal::CallSiteProfile::Write(path);
+  if (err != 0) {
+    return absl::Status(absl::ErrnoToStatusCode(err),
+                        "could not write the call site profile");
+  }
+  return absl::OkStatus();
+#else
+  return absl::UnimplementedError("built without CALLSITE_PROFILE");
+#endif
+}
+
 //-------------------------------------------------------------------
 // Exported routines
 //-------------------------------------------------------------------
@@ -2231,6 +6225,19 @@ extern "C" ABSL_CACHELINE_ALIGNED void TCMallocInternalFree(
   do_free(ptr);
 }
 
+extern "C" size_t tcmalloc_malloc_batch(size_t size, void** out,
+                                        size_t n) noexcept {
+  return do_malloc_batch(MallocPolicy(), size, out, n);
+}
+
+extern "C" void tcmalloc_free_batch(void* const* ptrs, size_t n) noexcept {
+  tcmalloc::tcmalloc_internal::do_free_batch(ptrs, n);
+}
+
+extern "C" void tcmalloc_prefetch_alloc(size_t size) noexcept {
+  tcmalloc::tcmalloc_internal::do_prefetch_alloc(size);
+}
+
 extern "C" void TCMallocInternalSdallocx(void* ptr, size_t size,
                                          int flags) noexcept {
   size_t alignment = alignof(std::max_align_t);
@@ -2249,10 +6256,20 @@ extern "C" void* TCMallocInternalCalloc(size_t n, size_t elem_size) noexcept {
   if (elem_size != 0 && size / elem_size != n) {
     return MallocPolicy::handle_oom(std::numeric_limits<size_t>::max());
   }
+#ifdef CALLOC_KNOWN_ZERO
+  // Pages fresh from the system need no memset, which would only fault
+  // them in early.
+  bool known_zero = false;
+  void* result = fast_alloc(MallocPolicy(), size, nullptr, &known_zero);
+  if (result != nullptr && !known_zero) {
+    memset(result, 0, size);
+  }
+#else
   void* result = fast_alloc(MallocPolicy(), size);
   if (result != nullptr) {
     memset(result, 0, size);
   }
+#endif
   return result;
 }
 
@@ -2291,6 +6308,23 @@ static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* do_realloc(void* old_ptr,
   const size_t lower_bound_to_grow = old_size + min_growth;
   const size_t upper_bound_to_shrink = old_size / 2;
   if ((new_size > old_size) || (new_size < upper_bound_to_shrink)) {
+#ifdef REALLOC_IN_PLACE
+    // A page allocation may have the room to grow, or give back its tail,
+    // where it is.  One the hardware checks would need its granules
+    // retagged, so it moves.
+    void* const span_ptr = StripPointerTag(old_ptr);
+    if (!hardware_checked(old_ptr) &&
+        ((new_size > old_size && new_size < lower_bound_to_grow &&
+          do_resize_pages(span_ptr, lower_bound_to_grow)) ||
+         do_resize_pages(span_ptr, new_size))) {
+      TCMALLOC_TRACE_EVENT(kFree, old_ptr, nullptr, 0);
+      TCMALLOC_CAPTURE_EVENT(kFree, old_ptr, nullptr, 0);
+      TCMALLOC_TRACE_EVENT(kMalloc, old_ptr, nullptr, new_size);
+      TCMALLOC_CAPTURE_EVENT(kAlloc, old_ptr, nullptr, new_size);
+      TCMALLOC_CAPTURE_EVENT(kRealloc, old_ptr, old_ptr, new_size);
+      return old_ptr;
+    }
+#endif
     // Need to reallocate.
     void* new_ptr = nullptr;
 
@@ -2310,11 +6344,25 @@ static inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* do_realloc(void* old_ptr,
     if (new_ptr == nullptr) {
       return nullptr;
     }
-    memcpy(new_ptr, old_ptr, ((old_size < new_size) ? old_size : new_size));
+    const size_t moved = (old_size < new_size) ? old_size : new_size;
+#ifdef REALLOC_MREMAP
+    move_object(old_ptr, new_ptr, moved);
+#else
+    memcpy(new_ptr, old_ptr, moved);
+#endif
+#ifdef ENABLE_PROTECTION
+    // Instead of poisoning every escape to old_ptr and having the program
+    // re-register them, hand them over to new_ptr.
+    if (Parameters::realloc_migrate_escapes()) {
+      migrate_escapes(StripPointerTag(old_ptr), old_size,
+                      StripPointerTag(new_ptr), moved);
+    }
+#endif
     // We could use a variant of do_free() that leverages the fact
     // that we already know the sizeclass of old_ptr.  The benefit
     // would be small, so don't bother.
     do_free(old_ptr);
+    TCMALLOC_CAPTURE_EVENT(kRealloc, new_ptr, old_ptr, new_size);
     return new_ptr;
   } else {
     return old_ptr;
@@ -2335,50 +6383,184 @@ extern "C" void* TCMallocInternalRealloc(void* old_ptr,
 
 extern "C" ABSL_CACHELINE_ALIGNED void* TCMallocInternalStrcatCheck(
     void* dst, void* src) noexcept {
+  if (protection_check_weight() == 0) return strcat((char*)dst, (char*)src);
   return do_strcat_check(dst, src);
 }
 
 extern "C" ABSL_CACHELINE_ALIGNED void* TCMallocInternalStrncatCheck(
     void* dst, void* src, size_t maxlen) noexcept {
+  if (protection_check_weight() == 0) {
+    return strncat((char*)dst, (char*)src, maxlen);
+  }
   return do_strncat_check(dst, src, maxlen);
 }
 
 extern "C" ABSL_CACHELINE_ALIGNED void* TCMallocInternalStrcpyCheck(
     void* dst, void* src) noexcept {
+  if (protection_check_weight() == 0) return strcpy((char*)dst, (char*)src);
   return do_strcpy_check(dst, src);
 }
 
 extern "C" ABSL_CACHELINE_ALIGNED void* TCMallocInternalStrncpyCheck(
     void* dst, void* src, size_t maxlen) noexcept {
+  if (protection_check_weight() == 0) {
+    return strncpy((char*)dst, (char*)src, maxlen);
+  }
   return do_strncpy_check(dst, src, maxlen);
 }
 
+extern "C" ABSL_CACHELINE_ALIGNED void* TCMallocInternalMemcpyCheck(
+    void* dst, const void* src, size_t n) noexcept {
+  if (protection_check_weight() == 0) return memcpy(dst, src, n);
+  return do_memcpy_check(dst, src, n);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED void* TCMallocInternalMemmoveCheck(
+    void* dst, const void* src, size_t n) noexcept {
+  if (protection_check_weight() == 0) return memmove(dst, src, n);
+  return do_memmove_check(dst, src, n);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED void* TCMallocInternalMemsetCheck(
+    void* dst, int c, size_t n) noexcept {
+  if (protection_check_weight() == 0) return memset(dst, c, n);
+  return do_memset_check(dst, c, n);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED size_t TCMallocInternalStrlenCheck(
+    const void* s) noexcept {
+  if (protection_check_weight() == 0) return strlen((const char*)s);
+  return do_strlen_check(s);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED size_t TCMallocInternalStrnlenCheck(
+    const void* s, size_t maxlen) noexcept {
+  if (protection_check_weight() == 0) return strnlen((const char*)s, maxlen);
+  return do_strnlen_check(s, maxlen);
+}
+
+#ifdef FORTIFY_CHK
+extern "C" void* TCMallocInternalMemcpyChk(void* dst, const void* src,
+                                           size_t n, size_t destlen) noexcept {
+  return memcpy(dst, src, fortify_len(n, dst, destlen));
+}
+
+extern "C" void* TCMallocInternalMempcpyChk(void* dst, const void* src,
+                                            size_t n, size_t destlen) noexcept {
+  n = fortify_len(n, dst, destlen);
+  return static_cast<char*>(memcpy(dst, src, n)) + n;
+}
+
+extern "C" void* TCMallocInternalMemmoveChk(void* dst, const void* src,
+                                            size_t n, size_t destlen) noexcept {
+  return memmove(dst, src, fortify_len(n, dst, destlen));
+}
+
+extern "C" void* TCMallocInternalMemsetChk(void* dst, int c, size_t n,
+                                           size_t destlen) noexcept {
+  return memset(dst, c, fortify_len(n, dst, destlen));
+}
+
+extern "C" char* TCMallocInternalStrcpyChk(char* dst, const char* src,
+                                           size_t destlen) noexcept {
+  do_stpcpy_chk(dst, src, destlen);
+  return dst;
+}
+
+extern "C" char* TCMallocInternalStpcpyChk(char* dst, const char* src,
+                                           size_t destlen) noexcept {
+  return do_stpcpy_chk(dst, src, destlen);
+}
+
+extern "C" char* TCMallocInternalStrncpyChk(char* dst, const char* src,
+                                            size_t n, size_t destlen) noexcept {
+  return strncpy(dst, src, fortify_len(n, dst, destlen));
+}
+
+extern "C" char* TCMallocInternalStrcatChk(char* dst, const char* src,
+                                           size_t destlen) noexcept {
+  return do_strcat_chk(dst, src, SIZE_MAX, destlen);
+}
+
+extern "C" char* TCMallocInternalStrncatChk(char* dst, const char* src,
+                                            size_t n, size_t destlen) noexcept {
+  return do_strcat_chk(dst, src, n, destlen);
+}
+#endif  // FORTIFY_CHK
+
+extern "C" size_t TCMallocInternalRemainingBytes(const void* p) noexcept {
+  return do_get_chunk_room(p);
+}
+
+#ifdef EXTERNAL_REGIONS
+extern "C" int TCMallocInternalRegisterRegion(void* base, size_t len,
+                                              size_t element_size) noexcept {
+  return do_register_region(base, len, element_size);
+}
+
+extern "C" int TCMallocInternalUnregisterRegion(void* base,
+                                                size_t len) noexcept {
+  return do_unregister_region(base, len);
+}
+#endif
+
 extern "C" ABSL_CACHELINE_ALIGNED int TCMallocInternalGepCheckBoundary(
     void *base, void *ptr, size_t size) noexcept {
 #ifdef ENABLE_STATISTIC
-  tc_globals.gep_check_cnt++;
+  tc_globals.gep_check_cnt.Add(1);
 #endif
+  TCMALLOC_RECORD_CALLSITE(kGepCheck);
+  TCMALLOC_TRACE_EVENT(kGepCheck, base, ptr, size);
 
 #ifdef ENABLE_PROTECTION
-  return do_gep_check_boundary(base, ptr, size);
+  TCMALLOC_COUNT_THREAD(checks, 1);
+  if (hardware_checked(base)) return 0;
+  const int64_t weight = protection_check_weight();
+  if (weight == 0) return 0;
+  return TCMALLOC_CALLSITE_CHECKED(
+      kGepCheck,
+      count_invalid_check(do_gep_check_boundary(base, ptr, size), weight, base,
+                          ptr, size));
 #else
   return 0;
 #endif
 }
 
+// Superseded by TCMallocInternalInlineCheckLayout(), which also reports the
+// offsets to use with these two pointers and the per-class records of
+// TCMallocInlineCheckLayout::class_info, which do not depend on the layout of
+// SizeMap.  Kept unchanged for checks compiled against it.
 extern "C" ABSL_CACHELINE_ALIGNED void TCMallocInternalInlineHook(
   size_t ***pagemap, unsigned int **sizemap) noexcept {
     *pagemap = (size_t**) (&tcmalloc::tcmalloc_internal::Static::pagemap_);
     *sizemap = (unsigned int*) (&tcmalloc::tcmalloc_internal::Static::sizemap_); 
 }
 
+extern "C" ABSL_CACHELINE_ALIGNED int TCMallocInternalInlineCheckLayout(
+    TCMallocInlineCheckLayout* layout) noexcept {
+#ifndef TCMALLOC_USE_PAGEMAP3
+  tcmalloc::tcmalloc_internal::InlineCheckLayout::Fill(layout);
+  return TCMALLOC_INLINE_CHECK_VERSION;
+#else
+  return 0;
+#endif
+}
+
 extern "C" ABSL_CACHELINE_ALIGNED int TCMallocInternalBcCheckBoundary(
     void *base, size_t size) noexcept {
 #ifdef ENABLE_STATISTIC
-  tc_globals.bc_check_cnt++;
+  tc_globals.bc_check_cnt.Add(1);
 #endif
+  TCMALLOC_RECORD_CALLSITE(kBcCheck);
+  TCMALLOC_TRACE_EVENT(kBcCheck, base, nullptr, size);
 #ifdef ENABLE_PROTECTION
-  return do_bc_check_boundary(base, size);
+  TCMALLOC_COUNT_THREAD(checks, 1);
+  if (hardware_checked(base)) return 0;
+  const int64_t weight = protection_check_weight();
+  if (weight == 0) return 0;
+  return TCMALLOC_CALLSITE_CHECKED(
+      kBcCheck, count_invalid_check(do_bc_check_boundary(base, size), weight,
+                                    base, nullptr, size));
 #else
   return 0;
 #endif
@@ -2394,13 +6576,147 @@ extern "C" ABSL_CACHELINE_ALIGNED size_t TCGetChunkRange(void* base, size_t* sta
   return do_get_chunk_range(base, start);
 }
 
+extern "C" ABSL_CACHELINE_ALIGNED TCMallocChunkRange
+TCMallocInternalChunkRange(const void* base) noexcept {
+  return do_chunk_range(base);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED size_t TCMallocInternalChunkRangeBatch(
+    const void* const* ptrs, size_t n, TCMallocChunkRange* out) noexcept {
+  return do_chunk_range_batch(ptrs, n, out);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED int TCMallocInternalGepCheckBoundaryRange(
+    void *base, void *ptr, size_t size) noexcept {
+#ifdef ENABLE_STATISTIC
+  tc_globals.gep_check_cnt.Add(1);
+#endif
+
+#ifdef ENABLE_PROTECTION
+  TCMALLOC_COUNT_THREAD(checks, 1);
+  if (hardware_checked(base)) return 0;
+  const int64_t weight = protection_check_weight();
+  if (weight == 0) return 0;
+  return count_invalid_check(do_gep_check_boundary_range(base, ptr, size),
+                             weight, base, ptr, size);
+#else
+  return 0;
+#endif
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED int TCMallocInternalGepCheckBoundaryBatch(
+    void* const* bases, void* const* ptrs, size_t n) noexcept {
+#ifdef ENABLE_STATISTIC
+  tc_globals.gep_check_cnt.Add(n);
+#endif
+#ifdef ALLOCATION_TRACE
+  for (size_t i = 0; i < n; ++i) {
+    TCMALLOC_TRACE_EVENT(kGepCheck, bases[i], ptrs[i], 0);
+  }
+#endif
+
+#ifdef ENABLE_PROTECTION
+  TCMALLOC_COUNT_THREAD(checks, n);
+  const int64_t weight = protection_check_weight();
+  if (weight == 0) return 0;
+  return count_invalid_check(do_gep_check_boundary_batch(bases, ptrs, n),
+                             weight);
+#else
+  return 0;
+#endif
+}
+
 extern "C" ABSL_CACHELINE_ALIGNED int TCMallocInternalEscape(
     void** loc, void* ptr) noexcept {
 #ifdef ENABLE_STATISTIC
-  tc_globals.escape_cnt++;
+  tc_globals.escape_cnt.Add(1);
+#endif
+  TCMALLOC_RECORD_CALLSITE(kEscape);
+  TCMALLOC_TRACE_EVENT(kEscape, loc, ptr, 0);
+  TCMALLOC_CAPTURE_EVENT(kEscape, loc, ptr, 0);
+#ifdef ENABLE_PROTECTION
+  TCMALLOC_COUNT_THREAD(escapes, 1);
+  if (!protection_escapes_enabled()) return TCMALLOC_CALLSITE_ESCAPED(0);
+  return TCMALLOC_CALLSITE_ESCAPED(do_escape(loc, ptr, *loc));
+#endif
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED int TCMallocInternalEscapeStoreRelease(
+    void** loc, void* ptr) noexcept {
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_cnt.Add(1);
+#endif
+  TCMALLOC_RECORD_CALLSITE(kEscape);
+  TCMALLOC_TRACE_EVENT(kEscape, loc, ptr, 0);
+  TCMALLOC_CAPTURE_EVENT(kEscape, loc, ptr, 0);
+  int ret = 0;
+#ifdef ENABLE_PROTECTION
+  TCMALLOC_COUNT_THREAD(escapes, 1);
+  // Staged before the store publishes ptr, as __escape() is.  A racing
+  // store may replace the old value read here; skipping the escape because
+  // it pointed into the same object is still right, since that object then
+  // already has loc recorded.
+  if (protection_escapes_enabled()) {
+    ret = do_escape(loc, ptr, __atomic_load_n(loc, __ATOMIC_RELAXED));
+  }
+#endif
+  __atomic_store_n(loc, ptr, __ATOMIC_RELEASE);
+  return TCMALLOC_CALLSITE_ESCAPED(ret);
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED void* TCMallocInternalEscapeCAS(
+    void** loc, void* expected, void* desired) noexcept {
+  void* old = expected;
+  if (!__atomic_compare_exchange_n(loc, &old, desired, /*weak=*/false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    // Nothing was stored, so there is nothing to track.
+    return old;
+  }
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_cnt.Add(1);
+#endif
+  TCMALLOC_RECORD_CALLSITE(kEscape);
+  TCMALLOC_TRACE_EVENT(kEscape, loc, desired, 0);
+  TCMALLOC_CAPTURE_EVENT(kEscape, loc, desired, 0);
+#ifdef ENABLE_PROTECTION
+  TCMALLOC_COUNT_THREAD(escapes, 1);
+  // The exchange tells what loc held, which no other thread can have
+  // replaced in between.  Staged escapes only take effect when the buffer
+  // is committed, so staging just after the store is as good as before.
+  if (protection_escapes_enabled()) {
+    TCMALLOC_CALLSITE_ESCAPED(do_escape(loc, desired, expected));
+  }
+#endif
+  return old;
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED int TCMallocInternalEscapeBatch(
+    void*** locs, void** ptrs, size_t n) noexcept {
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_cnt.Add(n);
+#endif
+#if defined(ALLOCATION_TRACE) || defined(TRACE_CAPTURE)
+  for (size_t i = 0; i < n; ++i) {
+    TCMALLOC_TRACE_EVENT(kEscape, locs[i], ptrs[i], 0);
+    TCMALLOC_CAPTURE_EVENT(kEscape, locs[i], ptrs[i], 0);
+  }
+#endif
+#ifdef ENABLE_PROTECTION
+  TCMALLOC_COUNT_THREAD(escapes, n);
+  if (!protection_escapes_enabled()) return 0;
+  return do_escape_batch(locs, ptrs, n);
+#endif
+}
+
+extern "C" ABSL_CACHELINE_ALIGNED int TCMallocInternalEscapeRange(
+    void* dst, const void* src, size_t len) noexcept {
+#ifdef ENABLE_STATISTIC
+  tc_globals.escape_cnt.Add(1);
 #endif
 #ifdef ENABLE_PROTECTION
-  return do_escape(loc, ptr);
+  TCMALLOC_COUNT_THREAD(escapes, 1);
+  if (!protection_escapes_enabled()) return 0;
+  return do_escape_range(dst, src, len);
 #endif
 }
 
@@ -2704,7 +7020,7 @@ extern "C" struct mallinfo TCMallocInternalMallocInfo(void) noexcept {
 
 extern "C" size_t TCMallocInternalMallocSize(void* ptr) noexcept {
   ASSERT(GetOwnership(ptr) != tcmalloc::MallocExtension::Ownership::kNotOwned);
-  return GetSize(ptr) - 1;
+  return GetUsableSize(ptr);
 }
 
 GOOGLE_MALLOC_SECTION_BEGIN
@@ -2724,8 +7040,21 @@ class TCMallocGuard {
   TCMallocGuard() {
     TCMallocInternalFree(TCMallocInternalMalloc(1));
     ThreadCache::InitTSD();
+    InitEscapeBufferTSD();
+#ifdef FORK_AWARE_PROTECTION
+    pthread_atfork(PrepareForkEscapes, ParentForkEscapes, ChildForkEscapes);
+#endif
     TCMallocInternalFree(TCMallocInternalMalloc(1));
   }
+
+#ifdef CALLSITE_PROFILE
+  ~TCMallocGuard() {
+    const char* path = thread_safe_getenv("TCMALLOC_CALLSITE_PROFILE_FILE");
+    if (path != nullptr && CallSiteProfile::Write(path) != 0) {
+      Log(kLog, __FILE__, __LINE__, "could not write call site profile", path);
+    }
+  }
+#endif
 };
 
 static TCMallocGuard module_enter_exit_hook;
@@ -2809,3 +7138,23 @@ void* operator new[](size_t size, std::align_val_t align, std::nothrow_t,
                       nullptr);
   }
 }
+
+#ifdef POINTER_FREE_CLASSES
+void* operator new(size_t size, tcmalloc::pointer_free_t) noexcept(false) {
+  return pointer_free_alloc(CppPolicy(), size);
+}
+
+void* operator new(size_t size, std::nothrow_t,
+                   tcmalloc::pointer_free_t) noexcept {
+  return pointer_free_alloc(CppPolicy().Nothrow(), size);
+}
+
+void* operator new[](size_t size, tcmalloc::pointer_free_t) noexcept(false) {
+  return pointer_free_alloc(CppPolicy(), size);
+}
+
+void* operator new[](size_t size, std::nothrow_t,
+                     tcmalloc::pointer_free_t) noexcept {
+  return pointer_free_alloc(CppPolicy().Nothrow(), size);
+}
+#endif  // POINTER_FREE_CLASSES
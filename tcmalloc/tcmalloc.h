@@ -29,6 +29,9 @@
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/declarations.h"
 
+struct TCMallocInlineCheckLayout;
+struct TCMallocChunkRange;
+
 #ifdef __cplusplus
 
 extern "C" {
@@ -46,15 +49,82 @@ void* TCMallocInternalStrcpyCheck(void* dst, void* src) noexcept
 void* TCMallocInternalStrncpyCheck(void* dst, void* src, size_t maxlen) noexcept
     ABSL_ATTRIBUTE_SECTION(google_malloc);
 
+void* TCMallocInternalMemcpyCheck(void* dst, const void* src, size_t n) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
+void* TCMallocInternalMemmoveCheck(void* dst, const void* src, size_t n) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
+void* TCMallocInternalMemsetCheck(void* dst, int c, size_t n) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
+size_t TCMallocInternalStrlenCheck(const void* s) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
+size_t TCMallocInternalStrnlenCheck(const void* s, size_t maxlen) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
+void* TCMallocInternalMemcpyChk(void* dst, const void* src, size_t n,
+                                size_t destlen) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+void* TCMallocInternalMempcpyChk(void* dst, const void* src, size_t n,
+                                 size_t destlen) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+void* TCMallocInternalMemmoveChk(void* dst, const void* src, size_t n,
+                                 size_t destlen) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+void* TCMallocInternalMemsetChk(void* dst, int c, size_t n,
+                                size_t destlen) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+char* TCMallocInternalStrcpyChk(char* dst, const char* src,
+                                size_t destlen) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+char* TCMallocInternalStpcpyChk(char* dst, const char* src,
+                                size_t destlen) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+char* TCMallocInternalStrncpyChk(char* dst, const char* src, size_t n,
+                                 size_t destlen) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+char* TCMallocInternalStrcatChk(char* dst, const char* src,
+                                size_t destlen) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+char* TCMallocInternalStrncatChk(char* dst, const char* src, size_t n,
+                                 size_t destlen) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+size_t TCMallocInternalRemainingBytes(const void* p) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+int TCMallocInternalRegisterRegion(void* base, size_t len,
+                                   size_t element_size) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+int TCMallocInternalUnregisterRegion(void* base, size_t len) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
 int TCMallocInternalGepCheckBoundary(void *base, void* ptr, size_t size) noexcept
     ABSL_ATTRIBUTE_SECTION(google_malloc);
 
 void TCMallocInternalInlineHook(size_t ***pagemap, unsigned int** sizemap) noexcept
     ABSL_ATTRIBUTE_SECTION(google_malloc);
 
+int TCMallocInternalInlineCheckLayout(
+    struct TCMallocInlineCheckLayout* layout) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
 int TCMallocInternalEscape(void **loc, void* ptr) noexcept
     ABSL_ATTRIBUTE_SECTION(google_malloc);
 
+int TCMallocInternalEscapeBatch(void*** locs, void** ptrs, size_t n) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
+int TCMallocInternalEscapeRange(void* dst, const void* src, size_t len) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
+int TCMallocInternalEscapeStoreRelease(void** loc, void* ptr) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
+void* TCMallocInternalEscapeCAS(void** loc, void* expected,
+                                void* desired) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+
 int TCMallocInternalBcCheckBoundary(void *base, size_t size) noexcept
     ABSL_ATTRIBUTE_SECTION(google_malloc);
 void TCReportStatistic() noexcept
@@ -63,6 +133,17 @@ void TCReportError() noexcept
     ABSL_ATTRIBUTE_SECTION(google_malloc);
 size_t TCGetChunkRange(void*, size_t* start) noexcept
     ABSL_ATTRIBUTE_SECTION(google_malloc);
+struct TCMallocChunkRange TCMallocInternalChunkRange(const void* base) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+size_t TCMallocInternalChunkRangeBatch(const void* const* ptrs, size_t n,
+                                       struct TCMallocChunkRange* out) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+int TCMallocInternalGepCheckBoundaryRange(void* base, void* ptr,
+                                          size_t size) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
+int TCMallocInternalGepCheckBoundaryBatch(void* const* bases,
+                                          void* const* ptrs, size_t n) noexcept
+    ABSL_ATTRIBUTE_SECTION(google_malloc);
 
 
 void* TCMallocInternalMalloc(size_t size) noexcept
@@ -14,7 +14,7 @@
 //
 // This file defines policies used when allocation memory.
 //
-// An allocation policy encapsulates four policies:
+// An allocation policy encapsulates five policies:
 //
 // - Out of memory policy.
 //   Dictates how to handle OOM conditions.
@@ -57,6 +57,22 @@
 //     // NUMA partition to allocate from.
 //     size_t scaled_partition() const;
 //   };
+//
+// - Protection policy
+//   Dictates the work ENABLE_PROTECTION does for an allocation and its free.
+//   Call sites that allocate memory no instrumented store ever points into,
+//   such as pointer-free objects or the allocator's own metadata, can compile
+//   it out.
+//
+//   struct ProtectionPolicyTemplate {
+//     // Returns true if the request is padded by one byte, so a pointer to
+//     // the end of the object does not point into its neighbour.
+//     static constexpr bool pad_requests();
+//
+//     // Returns true if the free poisons the escapes to the object.  The
+//     // free is validated either way.
+//     static constexpr bool track_escapes();
+//   };
 
 #ifndef TCMALLOC_TCMALLOC_POLICY_H_
 #define TCMALLOC_TCMALLOC_POLICY_H_
@@ -171,6 +187,17 @@ struct NoHooksPolicy {
   static constexpr bool invoke_hooks() { return false; }
 };
 
+// ProtectAsPolicy: pad the request and track the escapes of the object as
+// given.
+template <bool kPad, bool kTrackEscapes>
+struct ProtectAsPolicy {
+  static constexpr bool pad_requests() { return kPad; }
+  static constexpr bool track_escapes() { return kTrackEscapes; }
+};
+
+// FullProtectionPolicy: the protection every allocation gets by default
+using FullProtectionPolicy = ProtectAsPolicy<true, true>;
+
 // Use a fixed NUMA partition.
 class FixedNumaPartitionPolicy {
  public:
@@ -201,13 +228,14 @@ struct LocalNumaPartitionPolicy {
 };
 
 // TCMallocPolicy defines the compound policy object containing
-// the OOM, alignment and hooks policies.
+// the OOM, alignment, hooks and protection policies.
 // Is trivially constructible, copyable and destructible.
 template <typename OomPolicy = CppOomPolicy,
           typename AlignPolicy = DefaultAlignPolicy,
           typename AccessPolicy = DefaultAllocationAccessPolicy,
           typename HooksPolicy = InvokeHooksPolicy,
-          typename NumaPolicy = LocalNumaPartitionPolicy>
+          typename NumaPolicy = LocalNumaPartitionPolicy,
+          typename ProtectionPolicy = FullProtectionPolicy>
 class TCMallocPolicy {
  public:
   constexpr TCMallocPolicy() = default;
@@ -233,61 +261,73 @@ class TCMallocPolicy {
   // Hooks policy
   static constexpr bool invoke_hooks() { return HooksPolicy::invoke_hooks(); }
 
+  // Protection policy
+  static constexpr bool pad_requests() {
+    return ProtectionPolicy::pad_requests();
+  }
+  static constexpr bool track_escapes() {
+    return ProtectionPolicy::track_escapes();
+  }
+
   // Returns this policy aligned as 'align'
   template <typename align_t>
   constexpr TCMallocPolicy<OomPolicy, AlignAsPolicy, AccessPolicy, HooksPolicy,
-                           NumaPolicy>
+                           NumaPolicy, ProtectionPolicy>
   AlignAs(align_t align) const {
     return TCMallocPolicy<OomPolicy, AlignAsPolicy, AccessPolicy, HooksPolicy,
-                          NumaPolicy>(AlignAsPolicy{align}, numa_);
+                          NumaPolicy, ProtectionPolicy>(AlignAsPolicy{align},
+                                                        numa_);
   }
 
   // Returns this policy with access hit
   constexpr TCMallocPolicy<OomPolicy, AlignPolicy, AllocationAccessAsPolicy,
-                           HooksPolicy, NumaPolicy>
+                           HooksPolicy, NumaPolicy, ProtectionPolicy>
   AccessAs(hot_cold_t access) const {
     return TCMallocPolicy<OomPolicy, AlignPolicy, AllocationAccessAsPolicy,
-                          HooksPolicy, NumaPolicy>(align_, access, numa_);
+                          HooksPolicy, NumaPolicy, ProtectionPolicy>(
+        align_, access, numa_);
   }
 
   // Returns this policy for frequent access
   constexpr TCMallocPolicy<OomPolicy, AlignPolicy, AllocationAccessHotPolicy,
-                           HooksPolicy, NumaPolicy>
+                           HooksPolicy, NumaPolicy, ProtectionPolicy>
   AccessAsHot() const {
     return TCMallocPolicy<OomPolicy, AlignPolicy, AllocationAccessHotPolicy,
-                          HooksPolicy, NumaPolicy>(align_, numa_);
+                          HooksPolicy, NumaPolicy, ProtectionPolicy>(align_,
+                                                                     numa_);
   }
 
   // Returns this policy for infrequent access
   constexpr TCMallocPolicy<OomPolicy, AlignPolicy, AllocationAccessColdPolicy,
-                           HooksPolicy, NumaPolicy>
+                           HooksPolicy, NumaPolicy, ProtectionPolicy>
   AccessAsCold() const {
     return TCMallocPolicy<OomPolicy, AlignPolicy, AllocationAccessColdPolicy,
-                          HooksPolicy, NumaPolicy>(align_, numa_);
+                          HooksPolicy, NumaPolicy, ProtectionPolicy>(align_,
+                                                                     numa_);
   }
 
   // Returns this policy with a nullptr OOM policy.
   constexpr TCMallocPolicy<NullOomPolicy, AlignPolicy, AccessPolicy,
-                           HooksPolicy, NumaPolicy>
+                           HooksPolicy, NumaPolicy, ProtectionPolicy>
   Nothrow() const {
     return TCMallocPolicy<NullOomPolicy, AlignPolicy, AccessPolicy, HooksPolicy,
-                          NumaPolicy>(align_, numa_);
+                          NumaPolicy, ProtectionPolicy>(align_, numa_);
   }
 
   // Returns this policy with NewAllocHook invocations disabled.
   constexpr TCMallocPolicy<OomPolicy, AlignPolicy, AccessPolicy, NoHooksPolicy,
-                           NumaPolicy>
+                           NumaPolicy, ProtectionPolicy>
   WithoutHooks() const {
     return TCMallocPolicy<OomPolicy, AlignPolicy, AccessPolicy, NoHooksPolicy,
-                          NumaPolicy>(align_, numa_);
+                          NumaPolicy, ProtectionPolicy>(align_, numa_);
   }
 
   // Returns this policy with a fixed NUMA partition.
   constexpr TCMallocPolicy<OomPolicy, AlignPolicy, AccessPolicy, NoHooksPolicy,
-                           FixedNumaPartitionPolicy>
+                           FixedNumaPartitionPolicy, ProtectionPolicy>
   InNumaPartition(size_t partition) const {
     return TCMallocPolicy<OomPolicy, AlignPolicy, AccessPolicy, NoHooksPolicy,
-                          FixedNumaPartitionPolicy>(
+                          FixedNumaPartitionPolicy, ProtectionPolicy>(
         align_, FixedNumaPartitionPolicy{partition});
   }
 
@@ -297,6 +337,33 @@ class TCMallocPolicy {
     return InNumaPartition(NumaPartitionFromPointer(ptr));
   }
 
+  // Returns this policy without the padding byte.  The object is allocated
+  // from the class of its exact size, so a pointer to its end may point into
+  // the next object; only for memory whose pointers are never recorded as
+  // escapes.
+  constexpr TCMallocPolicy<
+      OomPolicy, AlignPolicy, AccessPolicy, HooksPolicy, NumaPolicy,
+      ProtectAsPolicy<false, ProtectionPolicy::track_escapes()>>
+  WithoutPadding() const {
+    return TCMallocPolicy<
+        OomPolicy, AlignPolicy, AccessPolicy, HooksPolicy, NumaPolicy,
+        ProtectAsPolicy<false, ProtectionPolicy::track_escapes()>>(align_,
+                                                                   numa_);
+  }
+
+  // Returns this policy without escape tracking: a free made with it is
+  // validated, but leaves the escapes to the object unpoisoned.  Only for
+  // memory no instrumented store points into.
+  constexpr TCMallocPolicy<
+      OomPolicy, AlignPolicy, AccessPolicy, HooksPolicy, NumaPolicy,
+      ProtectAsPolicy<ProtectionPolicy::pad_requests(), false>>
+  WithoutEscapeTracking() const {
+    return TCMallocPolicy<
+        OomPolicy, AlignPolicy, AccessPolicy, HooksPolicy, NumaPolicy,
+        ProtectAsPolicy<ProtectionPolicy::pad_requests(), false>>(align_,
+                                                                  numa_);
+  }
+
   static constexpr bool can_return_nullptr() {
     return OomPolicy::can_return_nullptr();
   }
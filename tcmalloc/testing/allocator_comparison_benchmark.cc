@@ -0,0 +1,479 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Runs the same allocation-heavy workloads against tcmalloc with protection
+// disabled, tcmalloc with protection and, in builds that link jemalloc
+// (JEMALLOC), jemalloc, and prints one CSV row per allocator and workload:
+//
+//   allocator,workload,size,threads,ops_per_second,peak_rss_bytes,p99_ns
+//
+// The workloads are
+//   size_sweep         malloc() and free() of one size, for sizes from 16
+//                      bytes to 256 KiB;
+//   producer_consumer  half of the threads allocate objects and hand them
+//                      through escaped slots to the other half, which free
+//                      them;
+//   linked_churn       threads replace random nodes of a linked structure,
+//                      escaping the links into and out of each new node,
+//                      checking it and freeing the node it replaces.
+//
+// The tcmalloc configurations call __escape and __gep_check_boundary as
+// instrumented code would; with protection disabled those return at once,
+// which is what code built without the instrumentation saves on top.  The
+// jemalloc configuration makes no protection calls.  Each row runs in a
+// child process of its own so the peak RSS is that of the workload alone.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/internal/cycleclock.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/random/random.h"
+#include "absl/strings/str_split.h"
+#include "absl/synchronization/barrier.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/testing/thread_manager.h"
+
+#ifdef JEMALLOC
+#include "tcmalloc/jemalloc.h"
+#endif
+
+ABSL_FLAG(std::string, allocators, "tcmalloc,safe_tcmalloc,jemalloc",
+          "Comma-separated allocators to run: tcmalloc (protection "
+          "disabled), safe_tcmalloc and jemalloc");
+
+ABSL_FLAG(int, threads, 4, "Number of threads to run each workload with");
+
+ABSL_FLAG(absl::Duration, duration, absl::Seconds(1),
+          "How long to run each workload");
+
+ABSL_FLAG(size_t, live_objects, 4096,
+          "Number of objects each thread keeps allocated in linked_churn");
+
+extern "C" {
+int TCMallocInternalEscape(void** loc, void* ptr) noexcept;
+int TCMallocInternalGepCheckBoundary(void* base, void* ptr,
+                                     size_t size) noexcept;
+}
+
+namespace tcmalloc {
+namespace {
+
+struct Allocator {
+  const char* name;
+  void* (*alloc)(size_t);
+  void (*dealloc)(void*);
+  // Whether the workloads make the calls of instrumented code.
+  bool instrumented;
+  MallocExtension::ProtectionPolicy policy;
+};
+
+void* TCMalloc(size_t size) { return malloc(size); }
+void TCFree(void* ptr) { free(ptr); }
+
+#ifdef JEMALLOC
+void* JeMalloc(size_t size) { return je_malloc(size); }
+void JeFree(void* ptr) { je_free(ptr); }
+#endif
+
+const Allocator kAllocators[] = {
+    {"tcmalloc", TCMalloc, TCFree, true,
+     MallocExtension::ProtectionPolicy::kDisabled},
+    {"safe_tcmalloc", TCMalloc, TCFree, true,
+     MallocExtension::ProtectionPolicy::kCrash},
+#ifdef JEMALLOC
+    {"jemalloc", JeMalloc, JeFree, false,
+     MallocExtension::ProtectionPolicy::kDisabled},
+#endif
+};
+
+// Operations a thread runs between two looks at the shutdown flag.
+constexpr int kOpsPerCall = 64;
+// Every kSampleEvery-th operation is timed, and each thread keeps the last
+// kMaxSamples of these.
+constexpr int kSampleEvery = 8;
+constexpr size_t kMaxSamples = 1 << 16;
+
+int64_t Now() { return absl::base_internal::CycleClock::Now(); }
+
+struct alignas(ABSL_CACHELINE_SIZE) Worker {
+  std::atomic<int64_t> ops{0};
+  bool started = false;
+  absl::BitGen rng;
+  std::vector<int64_t> samples;
+  size_t sampled = 0;
+  std::vector<void*> live;
+  size_t next = 0;
+
+  void Sample(int64_t cycles) {
+    if (samples.size() < kMaxSamples) {
+      samples.push_back(cycles);
+    } else {
+      samples[sampled % kMaxSamples] = cycles;
+    }
+    sampled++;
+  }
+};
+
+// A single-producer single-consumer ring of escaped slots.
+struct alignas(ABSL_CACHELINE_SIZE) Channel {
+  static constexpr size_t kSlots = 1024;
+
+  std::atomic<size_t> head{0};
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<size_t> tail{0};
+  void* slots[kSlots] = {};
+};
+
+class Workload {
+ public:
+  Workload(const Allocator& allocator, int threads)
+      : allocator_(allocator), barrier_(threads + 1), workers_(threads) {}
+  virtual ~Workload() = default;
+
+  // Body of thread `id` for ThreadManager.
+  void Step(int id) {
+    Worker& w = workers_[id];
+    if (!w.started) {
+      w.started = true;
+      barrier_.Block();
+    }
+    Run(id, w);
+  }
+
+  // Releases the threads, which are blocked on their first Step().
+  void Go() { barrier_.Block(); }
+
+  int64_t ops() const {
+    int64_t total = 0;
+    for (const Worker& w : workers_) {
+      total += w.ops.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  // The 99th percentile of the sampled operations, in cycles.
+  int64_t P99() {
+    std::vector<int64_t> all;
+    for (const Worker& w : workers_) {
+      all.insert(all.end(), w.samples.begin(), w.samples.end());
+    }
+    if (all.empty()) return 0;
+    auto p99 = all.begin() + (all.size() - 1) * 99 / 100;
+    std::nth_element(all.begin(), p99, all.end());
+    return *p99;
+  }
+
+ protected:
+  // Runs kOpsPerCall operations of thread `id`.
+  virtual void Run(int id, Worker& w) = 0;
+
+  int threads() const { return workers_.size(); }
+
+  void* Alloc(size_t size) { return allocator_.alloc(size); }
+  void Free(void* ptr) { allocator_.dealloc(ptr); }
+
+  void Store(void** loc, void* ptr) {
+    if (allocator_.instrumented) TCMallocInternalEscape(loc, ptr);
+    *loc = ptr;
+  }
+
+  void Check(void* base, void* ptr, size_t size) {
+    if (allocator_.instrumented) {
+      TCMallocInternalGepCheckBoundary(base, ptr, size);
+    }
+  }
+
+  void FreeLive() {
+    for (Worker& w : workers_) {
+      for (void* p : w.live) Free(p);
+      w.live.clear();
+    }
+  }
+
+  std::vector<Worker>& workers() { return workers_; }
+
+ private:
+  const Allocator& allocator_;
+  absl::Barrier barrier_;
+  std::vector<Worker> workers_;
+};
+
+// Each operation allocates an object of size_ bytes and frees the one
+// allocated kLive operations before.
+class SizeSweep : public Workload {
+ public:
+  static constexpr size_t kLive = 64;
+
+  SizeSweep(const Allocator& allocator, int threads, size_t size)
+      : Workload(allocator, threads), size_(size) {
+    for (Worker& w : workers()) w.live.assign(kLive, nullptr);
+  }
+  ~SizeSweep() override { FreeLive(); }
+
+ protected:
+  void Run(int id, Worker& w) override {
+    for (int i = 0; i < kOpsPerCall; ++i) {
+      const bool sample = i % kSampleEvery == 0;
+      const int64_t start = sample ? Now() : 0;
+      void* p = Alloc(size_);
+      Free(w.live[w.next]);
+      if (sample) w.Sample(Now() - start);
+      w.live[w.next] = p;
+      w.next = (w.next + 1) % kLive;
+    }
+    w.ops.fetch_add(kOpsPerCall, std::memory_order_relaxed);
+  }
+
+ private:
+  const size_t size_;
+};
+
+// Even threads produce into the channel they share with the next odd
+// thread, which consumes from it; an operation is an object passed.  A
+// producer with a full channel and a consumer with an empty one move on to
+// their next call.
+class ProducerConsumer : public Workload {
+ public:
+  ProducerConsumer(const Allocator& allocator, int threads)
+      : Workload(allocator, threads),
+        channels_(std::make_unique<Channel[]>(threads / 2)) {}
+
+  ~ProducerConsumer() override {
+    for (int i = 0; i < threads() / 2; ++i) {
+      Channel& c = channels_[i];
+      for (size_t t = c.tail; t != c.head; ++t) {
+        Free(c.slots[t % Channel::kSlots]);
+      }
+    }
+  }
+
+ protected:
+  void Run(int id, Worker& w) override {
+    if (id / 2 >= threads() / 2) return;  // An odd one out.
+    Channel& c = channels_[id / 2];
+    if (id % 2 == 0) {
+      Produce(c, w);
+    } else {
+      Consume(c, w);
+    }
+  }
+
+ private:
+  void Produce(Channel& c, Worker& w) {
+    size_t head = c.head.load(std::memory_order_relaxed);
+    for (int i = 0; i < kOpsPerCall; ++i) {
+      if (head - c.tail.load(std::memory_order_acquire) == Channel::kSlots) {
+        return;
+      }
+      const size_t size = absl::Uniform<size_t>(w.rng, 8, 1024);
+      const bool sample = i % kSampleEvery == 0;
+      const int64_t start = sample ? Now() : 0;
+      void* p = Alloc(size);
+      Store(&c.slots[head % Channel::kSlots], p);
+      if (sample) w.Sample(Now() - start);
+      c.head.store(++head, std::memory_order_release);
+    }
+  }
+
+  void Consume(Channel& c, Worker& w) {
+    size_t tail = c.tail.load(std::memory_order_relaxed);
+    int consumed = 0;
+    for (; consumed < kOpsPerCall; ++consumed) {
+      if (tail == c.head.load(std::memory_order_acquire)) break;
+      const bool sample = consumed % kSampleEvery == 0;
+      const int64_t start = sample ? Now() : 0;
+      Free(c.slots[tail % Channel::kSlots]);
+      if (sample) w.Sample(Now() - start);
+      c.tail.store(++tail, std::memory_order_release);
+    }
+    w.ops.fetch_add(consumed, std::memory_order_relaxed);
+  }
+
+  std::unique_ptr<Channel[]> channels_;
+};
+
+// Each thread owns a table of --live_objects nodes, each linked to another
+// node of the table.  An operation replaces a random node with a new one of
+// random size, links it to a random node, checks an access to its payload
+// and frees the node it replaced, leaving the links into that node to
+// protection.  Links are never followed.
+class LinkedChurn : public Workload {
+ public:
+  // Followed by its payload.
+  struct Node {
+    Node* next;
+  };
+
+  LinkedChurn(const Allocator& allocator, int threads)
+      : Workload(allocator, threads) {
+    const size_t n = std::max<size_t>(absl::GetFlag(FLAGS_live_objects), 1);
+    for (Worker& w : workers()) {
+      w.live.assign(n, nullptr);
+      for (void*& slot : w.live) {
+        Store(&slot, NewNode(w));
+      }
+      for (void* node : w.live) {
+        LinkToRandom(w, static_cast<Node*>(node));
+      }
+    }
+  }
+  ~LinkedChurn() override { FreeLive(); }
+
+ protected:
+  void Run(int id, Worker& w) override {
+    for (int i = 0; i < kOpsPerCall; ++i) {
+      const size_t victim = absl::Uniform<size_t>(w.rng, 0, w.live.size());
+      const bool sample = i % kSampleEvery == 0;
+      const int64_t start = sample ? Now() : 0;
+      Node* node = NewNode(w);
+      LinkToRandom(w, node);
+      void* old = w.live[victim];
+      Store(&w.live[victim], node);
+      Free(old);
+      if (sample) w.Sample(Now() - start);
+    }
+    w.ops.fetch_add(kOpsPerCall, std::memory_order_relaxed);
+  }
+
+ private:
+  Node* NewNode(Worker& w) {
+    const size_t payload = absl::Uniform<size_t>(w.rng, 24, 512);
+    Node* node = static_cast<Node*>(Alloc(sizeof(Node) + payload));
+    char* last = reinterpret_cast<char*>(node + 1) + payload - 1;
+    Check(node, last, 1);
+    *last = 0;
+    node->next = nullptr;
+    return node;
+  }
+
+  void LinkToRandom(Worker& w, Node* node) {
+    void* to = w.live[absl::Uniform<size_t>(w.rng, 0, w.live.size())];
+    Store(reinterpret_cast<void**>(&node->next), to);
+  }
+};
+
+size_t ResidentBytes() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == nullptr) return 0;
+  unsigned long size = 0, resident = 0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * getpagesize();
+}
+
+void RunWorkload(const Allocator& allocator, const char* name, size_t size,
+                 std::unique_ptr<Workload> workload) {
+  const int threads = absl::GetFlag(FLAGS_threads);
+  const absl::Duration duration = absl::GetFlag(FLAGS_duration);
+  ThreadManager manager;
+  manager.Start(threads, [&](int id) { workload->Step(id); });
+
+  workload->Go();
+  const int64_t before = workload->ops();
+  const absl::Time start = absl::Now();
+  const absl::Time deadline = start + duration;
+  size_t peak_rss = ResidentBytes();
+  while (absl::Now() < deadline) {
+    absl::SleepFor(std::min(absl::Milliseconds(10), deadline - absl::Now()));
+    peak_rss = std::max(peak_rss, ResidentBytes());
+  }
+  const int64_t after = workload->ops();
+  const double seconds = absl::ToDoubleSeconds(absl::Now() - start);
+  manager.Stop();
+
+  const double ns_per_cycle =
+      1e9 / absl::base_internal::CycleClock::Frequency();
+  printf("%s,%s,%zu,%d,%.0f,%zu,%.1f\n", allocator.name, name, size, threads,
+         (after - before) / seconds, peak_rss,
+         workload->P99() * ns_per_cycle);
+  fflush(stdout);
+}
+
+// Runs fn() in a child process and waits for it.
+template <typename F>
+void RunInChild(F fn) {
+  fflush(stdout);
+  const pid_t pid = fork();
+  CHECK_CONDITION(pid >= 0);
+  if (pid == 0) {
+    fn();
+    fflush(stdout);
+    _exit(0);
+  }
+  int status;
+  CHECK_CONDITION(waitpid(pid, &status, 0) == pid);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "workload failed with status %d\n", status);
+  }
+}
+
+void RunAllocator(const Allocator& allocator) {
+  const int threads = absl::GetFlag(FLAGS_threads);
+  auto run = [&](const char* name, size_t size, auto make) {
+    RunInChild([&] {
+      MallocExtension::SetProtectionPolicy(allocator.policy);
+      RunWorkload(allocator, name, size, make());
+    });
+  };
+  for (size_t size = 16; size <= (256 << 10); size *= 4) {
+    run("size_sweep", size, [&] {
+      return std::make_unique<SizeSweep>(allocator, threads, size);
+    });
+  }
+  run("producer_consumer", 0, [&] {
+    return std::make_unique<ProducerConsumer>(allocator, threads);
+  });
+  run("linked_churn", 0, [&] {
+    return std::make_unique<LinkedChurn>(allocator, threads);
+  });
+}
+
+}  // namespace
+}  // namespace tcmalloc
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  CHECK_CONDITION(absl::GetFlag(FLAGS_threads) > 0);
+
+  printf("allocator,workload,size,threads,ops_per_second,peak_rss_bytes,"
+         "p99_ns\n");
+  for (absl::string_view name :
+       absl::StrSplit(absl::GetFlag(FLAGS_allocators), ',')) {
+    bool found = false;
+    for (const tcmalloc::Allocator& allocator : tcmalloc::kAllocators) {
+      if (name != allocator.name) continue;
+      found = true;
+      tcmalloc::RunAllocator(allocator);
+    }
+    if (!found) {
+      fprintf(stderr, "skipping allocator %s, not in this build\n",
+              std::string(name).c_str());
+    }
+  }
+  return 0;
+}
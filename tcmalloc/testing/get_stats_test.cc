@@ -82,6 +82,21 @@ TEST_F(GetStatsTest, Pbtxt) {
               HasSubstr("tcmalloc_skip_subrelease_interval_ns: 60000000000"));
 }
 
+TEST_F(GetStatsTest, PbtxtFromExtension) {
+  const std::string buf = MallocExtension::GetStatsInPbtxt();
+
+  EXPECT_THAT(buf, ContainsRegex(R"(in_use_by_app: [0-9]+)"));
+  EXPECT_THAT(buf, HasSubstr("protection {"));
+  EXPECT_THAT(buf, ContainsRegex(R"(escape_metadata_bytes: [0-9]+)"));
+  EXPECT_THAT(buf, ContainsRegex(R"(num_escape_tables: [0-9]+)"));
+#ifdef ENABLE_STATISTIC
+  EXPECT_THAT(buf, ContainsRegex(R"(malloc_count: [1-9][0-9]*)"));
+  EXPECT_THAT(buf, ContainsRegex(R"(remote_escape_free_count: [0-9]+)"));
+#endif
+  // The whole report fits, down to the region factory's stats at its end.
+  EXPECT_THAT(buf, ContainsRegex(R"(mmap_sys_allocator: [0-9]*)"));
+}
+
 TEST_F(GetStatsTest, Parameters) {
 #ifdef __x86_64__
   // HPAA is not enabled by default for non-x86 platforms, so we do not print
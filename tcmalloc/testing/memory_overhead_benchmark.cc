@@ -0,0 +1,264 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Measures the memory protection costs for pointer graphs.  It builds a
+// binary tree, a chained hash map and a doubly-linked list of --objects
+// nodes, storing every link with __escape().  On top of those links each
+// node points to --fan_in random nodes.  For each graph it prints:
+//   * the growth of safe_tcmalloc.escape_metadata_bytes, per live object
+//     and per escape;
+//   * the growth of the RSS with protection and with protection disabled,
+//     and the difference between the two.
+//
+// Protection is disabled at run time with the kDisabled policy rather than
+// by a separate build.  Escapes are then not recorded, so the graph and
+// the allocator's own structures are all that is left.  Each graph is
+// built in a child process of its own, so the RSS of one does not carry
+// over to the next.  The metadata includes the escape buffers of the
+// building thread, which may still hold escapes that are not committed.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/random/random.h"
+#include "absl/strings/str_split.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+ABSL_FLAG(size_t, objects, 1 << 20, "Number of nodes in each graph");
+
+ABSL_FLAG(size_t, fan_in, 2,
+          "Pointers to each node from random other nodes, on top of the "
+          "links of the graph");
+
+ABSL_FLAG(std::string, graphs, "tree,hash_map,list",
+          "Comma-separated graphs to build: tree, hash_map and list");
+
+extern "C" int TCMallocInternalEscape(void** loc, void* ptr) noexcept;
+
+namespace tcmalloc {
+namespace {
+
+// What building a graph added, measured in the child that built it.
+struct Growth {
+  size_t objects = 0;
+  size_t escapes = 0;
+  int64_t metadata_bytes = 0;
+  int64_t rss_bytes = 0;
+};
+
+int64_t ResidentBytes() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == nullptr) return 0;
+  unsigned long size = 0, resident = 0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+  fclose(f);
+  return static_cast<int64_t>(resident) * getpagesize();
+}
+
+int64_t MetadataBytes() {
+  return MallocExtension::GetNumericProperty(
+             "safe_tcmalloc.escape_metadata_bytes")
+      .value_or(0);
+}
+
+// A graph of nodes that each hold an array of links: `links` for the
+// structure, then --fan_in to random nodes.
+class Graph {
+ public:
+  explicit Graph(size_t links)
+      : links_(links), fan_in_(absl::GetFlag(FLAGS_fan_in)) {}
+
+  void** NewNode() {
+    const size_t n = links_ + fan_in_;
+    void** node = static_cast<void**>(calloc(n == 0 ? 1 : n, sizeof(void*)));
+    nodes_.push_back(node);
+    objects_++;
+    return node;
+  }
+
+  // An allocation that is not a node of the graph.
+  void** NewArray(size_t n) {
+    objects_++;
+    return static_cast<void**>(calloc(n, sizeof(void*)));
+  }
+
+  void Link(void** loc, void* to) {
+    TCMallocInternalEscape(loc, to);
+    *loc = to;
+    escapes_++;
+  }
+
+  // Points the extra links of every node to random nodes.
+  void LinkRandomly() {
+    absl::BitGen rng;
+    for (void** node : nodes_) {
+      for (size_t i = 0; i < fan_in_; ++i) {
+        Link(&node[links_ + i],
+             nodes_[absl::Uniform<size_t>(rng, 0, nodes_.size())]);
+      }
+    }
+  }
+
+  size_t objects() const { return objects_; }
+  size_t escapes() const { return escapes_; }
+
+ private:
+  const size_t links_;
+  const size_t fan_in_;
+  std::vector<void**> nodes_;
+  size_t objects_ = 0;
+  size_t escapes_ = 0;
+};
+
+// A complete binary tree with left, right and parent links.
+void BuildTree(Graph& g, size_t n) {
+  std::vector<void**> nodes;
+  nodes.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    void** node = g.NewNode();
+    nodes.push_back(node);
+    if (i == 0) continue;
+    void** parent = nodes[(i - 1) / 2];
+    g.Link(&parent[i % 2 == 1 ? 0 : 1], node);
+    g.Link(&node[2], parent);
+  }
+}
+
+// n / 2 entries chained in n / 2 + 1 buckets, each entry linking to the
+// next one of its chain and to a value node of its own.
+void BuildHashMap(Graph& g, size_t n) {
+  const size_t buckets = n / 2 + 1;
+  void** table = g.NewArray(buckets);
+  absl::BitGen rng;
+  for (size_t i = 0; i < n / 2; ++i) {
+    void** entry = g.NewNode();
+    void** value = g.NewNode();
+    g.Link(&entry[1], value);
+    void** head = &table[absl::Uniform<size_t>(rng, 0, buckets)];
+    if (*head != nullptr) g.Link(&entry[0], *head);
+    g.Link(head, entry);
+  }
+}
+
+// A list with next and prev links.
+void BuildList(Graph& g, size_t n) {
+  void** prev = nullptr;
+  for (size_t i = 0; i < n; ++i) {
+    void** node = g.NewNode();
+    if (prev != nullptr) {
+      g.Link(&prev[0], node);
+      g.Link(&node[1], prev);
+    }
+    prev = node;
+  }
+}
+
+Growth Build(absl::string_view graph) {
+  const size_t n = absl::GetFlag(FLAGS_objects);
+  const int64_t rss = ResidentBytes();
+  const int64_t metadata = MetadataBytes();
+
+  // Nodes of the tree have three links, those of the others two.
+  Graph g(graph == "tree" ? 3 : 2);
+  if (graph == "tree") {
+    BuildTree(g, n);
+  } else if (graph == "hash_map") {
+    BuildHashMap(g, n);
+  } else {
+    BuildList(g, n);
+  }
+  g.LinkRandomly();
+
+  Growth growth;
+  growth.objects = g.objects();
+  growth.escapes = g.escapes();
+  growth.metadata_bytes = MetadataBytes() - metadata;
+  growth.rss_bytes = ResidentBytes() - rss;
+  return growth;
+}
+
+// Builds `graph` under `policy` in a child process.
+Growth BuildInChild(absl::string_view graph,
+                    MallocExtension::ProtectionPolicy policy) {
+  int fds[2];
+  CHECK_CONDITION(pipe(fds) == 0);
+  fflush(stdout);
+  const pid_t pid = fork();
+  CHECK_CONDITION(pid >= 0);
+  if (pid == 0) {
+    close(fds[0]);
+    MallocExtension::SetProtectionPolicy(policy);
+    const Growth growth = Build(graph);
+    const bool written =
+        write(fds[1], &growth, sizeof(growth)) == sizeof(growth);
+    _exit(written ? 0 : 1);
+  }
+  close(fds[1]);
+  Growth growth;
+  const bool read_all = read(fds[0], &growth, sizeof(growth)) ==
+                        static_cast<ssize_t>(sizeof(growth));
+  close(fds[0]);
+  int status;
+  CHECK_CONDITION(waitpid(pid, &status, 0) == pid);
+  CHECK_CONDITION(read_all && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  return growth;
+}
+
+void Report(absl::string_view graph) {
+  using Policy = MallocExtension::ProtectionPolicy;
+  const Growth on = BuildInChild(graph, Policy::kCrash);
+  const Growth off = BuildInChild(graph, Policy::kDisabled);
+
+  const double MiB = 1024.0 * 1024.0;
+  printf("%-8s %10zu objects %10zu escapes | metadata %8.1f MiB, "
+         "%6.1f B/object, %6.1f B/escape | RSS %8.1f MiB on, %8.1f MiB off, "
+         "%8.1f MiB (%+.1f B/object) for protection\n",
+         std::string(graph).c_str(), on.objects, on.escapes,
+         on.metadata_bytes / MiB,
+         static_cast<double>(on.metadata_bytes) / on.objects,
+         on.escapes ? static_cast<double>(on.metadata_bytes) / on.escapes
+                    : 0.0,
+         on.rss_bytes / MiB, off.rss_bytes / MiB,
+         (on.rss_bytes - off.rss_bytes) / MiB,
+         static_cast<double>(on.rss_bytes - off.rss_bytes) / on.objects);
+  fflush(stdout);
+}
+
+}  // namespace
+}  // namespace tcmalloc
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  CHECK_CONDITION(absl::GetFlag(FLAGS_objects) > 0);
+
+  for (absl::string_view graph :
+       absl::StrSplit(absl::GetFlag(FLAGS_graphs), ',')) {
+    if (graph != "tree" && graph != "hash_map" && graph != "list") {
+      fprintf(stderr, "unknown graph %s\n", std::string(graph).c_str());
+      return 1;
+    }
+    tcmalloc::Report(graph);
+  }
+  return 0;
+}
@@ -0,0 +1,234 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Measures how escape tracking and bounds checks scale with the number of
+// threads.  For 1, 2, 4, ... --max_threads threads, every thread allocates
+// objects, escapes them into slots of its own and into slots shared by all
+// threads, checks them and frees the oldest one for --duration.  Prints the
+// operations per second, the escape buffer flushes and the SpinLock
+// contention seen during each run.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/internal/cycleclock.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/random/random.h"
+#include "absl/synchronization/barrier.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/testing/thread_manager.h"
+
+ABSL_FLAG(int, max_threads, 128, "Largest number of threads to run with");
+
+ABSL_FLAG(absl::Duration, duration, absl::Seconds(2),
+          "How long to run with each number of threads");
+
+ABSL_FLAG(size_t, shared_slots, 4096,
+          "Number of slots all threads escape pointers into");
+
+ABSL_FLAG(size_t, private_slots, 1024,
+          "Number of slots each thread escapes pointers into");
+
+ABSL_FLAG(size_t, live_objects, 256,
+          "Number of objects each thread keeps allocated");
+
+extern "C" {
+int TCMallocInternalEscape(void** loc, void* ptr) noexcept;
+int TCMallocInternalGepCheckBoundary(void* base, void* ptr,
+                                     size_t size) noexcept;
+int TCMallocInternalBcCheckBoundary(void* base, size_t size) noexcept;
+}
+
+namespace tcmalloc {
+namespace {
+
+// Operations a thread runs between two looks at the shutdown flag, each a
+// malloc(), two escapes, two checks and a free().
+constexpr int kOpsPerCall = 64;
+
+std::atomic<int64_t> lock_contentions{0};
+std::atomic<int64_t> lock_wait_cycles{0};
+
+// Called by absl::base_internal::SpinLock whenever a contended lock is
+// released, which includes pageheap_lock and the escape flush locks.
+void RecordContention(const void*, int64_t wait_cycles) {
+  lock_contentions.fetch_add(1, std::memory_order_relaxed);
+  lock_wait_cycles.fetch_add(wait_cycles, std::memory_order_relaxed);
+}
+
+struct alignas(ABSL_CACHELINE_SIZE) Worker {
+  std::atomic<int64_t> ops{0};
+  bool started = false;
+  absl::BitGen rng;
+  std::vector<void*> slots;
+  std::vector<void*> live;
+  size_t next = 0;
+};
+
+class Run {
+ public:
+  explicit Run(int threads)
+      : barrier_(threads + 1),
+        shared_(absl::GetFlag(FLAGS_shared_slots), nullptr),
+        workers_(threads) {
+    for (Worker& w : workers_) {
+      w.slots.assign(absl::GetFlag(FLAGS_private_slots), nullptr);
+      w.live.assign(absl::GetFlag(FLAGS_live_objects), nullptr);
+    }
+  }
+
+  ~Run() {
+    for (Worker& w : workers_) {
+      for (void* p : w.live) free(p);
+    }
+  }
+
+  // Body of thread `id` for ThreadManager.
+  void Step(int id) {
+    Worker& w = workers_[id];
+    if (!w.started) {
+      w.started = true;
+      barrier_.Block();
+    }
+    for (int i = 0; i < kOpsPerCall; ++i) {
+      const size_t size = absl::Uniform<size_t>(w.rng, 8, 1024);
+      char* obj = static_cast<char*>(malloc(size));
+
+      void** mine = &w.slots[absl::Uniform<size_t>(w.rng, 0, w.slots.size())];
+      TCMallocInternalEscape(mine, obj);
+      *mine = obj;
+
+      void** shared = &shared_[absl::Uniform<size_t>(w.rng, 0, shared_.size())];
+      TCMallocInternalEscape(shared, obj);
+      __atomic_store_n(shared, obj, __ATOMIC_RELAXED);
+
+      TCMallocInternalGepCheckBoundary(obj, obj + size / 2, 1);
+      TCMallocInternalBcCheckBoundary(obj, size);
+
+      free(w.live[w.next]);
+      w.live[w.next] = obj;
+      w.next = (w.next + 1) % w.live.size();
+    }
+    w.ops.fetch_add(kOpsPerCall, std::memory_order_relaxed);
+  }
+
+  // Releases the threads, which are blocked on their first Step().
+  void Go() { barrier_.Block(); }
+
+  int64_t ops() const {
+    int64_t total = 0;
+    for (const Worker& w : workers_) {
+      total += w.ops.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+ private:
+  absl::Barrier barrier_;
+  std::vector<void*> shared_;
+  std::vector<Worker> workers_;
+};
+
+// The counters of the run reported next to its throughput.
+struct Snapshot {
+  int64_t ops = 0;
+  int64_t flushes = 0;
+  int64_t flush_records = 0;
+  int64_t flush_stale = 0;
+  int64_t flush_cycles = 0;
+  int64_t contentions = 0;
+  int64_t wait_cycles = 0;
+
+  static Snapshot Take(const Run& run) {
+    Snapshot s;
+    s.ops = run.ops();
+    std::map<std::string, MallocExtension::Property> properties =
+        MallocExtension::GetProperties();
+    auto get = [&](const char* name) -> int64_t {
+      auto it = properties.find(name);
+      return it == properties.end() ? 0 : it->second.value;
+    };
+    s.flushes = get("safe_tcmalloc.escape_flushes");
+    s.flush_records = get("safe_tcmalloc.escape_flush_records");
+    s.flush_stale = get("safe_tcmalloc.escape_flush_stale");
+    s.flush_cycles = get("safe_tcmalloc.escape_flush_cycles");
+    s.contentions = lock_contentions.load(std::memory_order_relaxed);
+    s.wait_cycles = lock_wait_cycles.load(std::memory_order_relaxed);
+    return s;
+  }
+};
+
+void RunWithThreads(int threads, absl::Duration duration) {
+  auto run = std::make_unique<Run>(threads);
+  ThreadManager manager;
+  manager.Start(threads, [&](int id) { run->Step(id); });
+
+  run->Go();
+  const Snapshot before = Snapshot::Take(*run);
+  const absl::Time start = absl::Now();
+  absl::SleepFor(duration);
+  const Snapshot after = Snapshot::Take(*run);
+  const double seconds = absl::ToDoubleSeconds(absl::Now() - start);
+  manager.Stop();
+
+  const double us_per_cycle =
+      1e6 / absl::base_internal::CycleClock::Frequency();
+  const double ops = (after.ops - before.ops) / seconds;
+  const int64_t flushes = after.flushes - before.flushes;
+  printf("%4d threads: %12.0f ops/s %10.0f ops/s/thread | %8lld flushes, "
+         "%10lld records, %9lld stale, %8.1f us/flush | %8lld contended, "
+         "%10.0f us waited\n",
+         threads, ops, ops / threads, static_cast<long long>(flushes),
+         static_cast<long long>(after.flush_records - before.flush_records),
+         static_cast<long long>(after.flush_stale - before.flush_stale),
+         flushes ? (after.flush_cycles - before.flush_cycles) * us_per_cycle /
+                       flushes
+                 : 0.0,
+         static_cast<long long>(after.contentions - before.contentions),
+         (after.wait_cycles - before.wait_cycles) * us_per_cycle);
+  fflush(stdout);
+}
+
+}  // namespace
+}  // namespace tcmalloc
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  absl::base_internal::RegisterSpinLockProfiler(
+      &tcmalloc::RecordContention);
+
+  const int max_threads = absl::GetFlag(FLAGS_max_threads);
+  CHECK_CONDITION(max_threads > 0);
+  const absl::Duration duration = absl::GetFlag(FLAGS_duration);
+  for (int threads = 1;; threads *= 2) {
+    threads = std::min(threads, max_threads);
+    tcmalloc::RunWithThreads(threads, duration);
+    if (threads == max_threads) break;
+  }
+  return 0;
+}
@@ -0,0 +1,291 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Replays a trace written by malloc_tracing_extension::StartAllocationTrace()
+// against the allocator it is linked with and prints how long each kind of
+// event took.  Run it once per protection mode (TCMALLOC_PROTECTION_POLICY,
+// or binaries built with different options) to compare them on the same
+// workload.
+//
+// The trace is mapped and replayed on one thread in the order it was
+// recorded.  Traced objects are reallocated with their traced sizes, and
+// addresses inside them (escaped locations, stored pointers, check bases)
+// are moved to the same offset of the replayed object.  Addresses outside
+// any traced object stand for memory the allocator does not own: locations
+// become slots of a static table and pointers a static buffer, so those
+// calls still take the path for non-heap memory.  Only the allocator calls
+// are timed, not the translation between them.
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "absl/base/internal/cycleclock.h"
+#include "absl/container/btree_map.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_tracing_extension.h"
+
+ABSL_FLAG(std::string, trace, "", "Trace file to replay");
+
+ABSL_FLAG(int, repeat, 1, "Number of times to replay the trace");
+
+extern "C" {
+int TCMallocInternalEscape(void** loc, void* ptr) noexcept;
+int TCMallocInternalGepCheckBoundary(void* base, void* ptr,
+                                     size_t size) noexcept;
+int TCMallocInternalBcCheckBoundary(void* base, size_t size) noexcept;
+}
+
+namespace tcmalloc {
+namespace {
+
+using malloc_tracing_extension::TraceEvent;
+using malloc_tracing_extension::TraceEventType;
+using malloc_tracing_extension::TraceHeader;
+
+constexpr int kNumTypes = static_cast<int>(TraceEventType::kBcCheck) + 1;
+
+const char* TypeName(int type) {
+  switch (static_cast<TraceEventType>(type)) {
+    case TraceEventType::kNone:
+      return "unwritten";
+    case TraceEventType::kMalloc:
+      return "malloc";
+    case TraceEventType::kFree:
+      return "free";
+    case TraceEventType::kEscape:
+      return "escape";
+    case TraceEventType::kGepCheck:
+      return "gep check";
+    case TraceEventType::kBcCheck:
+      return "bc check";
+  }
+  return "unknown";
+}
+
+// Stand-ins for memory outside the traced objects.
+constexpr size_t kOutsideSlots = 4096;
+void* outside_slots[kOutsideSlots];
+char outside_buffer[4096];
+
+class Replayer {
+ public:
+  ~Replayer() {
+    for (const auto& [start, obj] : objects_) free(obj.ptr);
+  }
+
+  void Replay(const TraceEvent& e) {
+    const int type = static_cast<int>(e.type);
+    if (type >= kNumTypes) {
+      counts_[0]++;
+      return;
+    }
+    counts_[type]++;
+    int64_t start, end;
+    switch (e.type) {
+      case TraceEventType::kNone:
+        return;
+      case TraceEventType::kMalloc: {
+        Release(e.address);
+        start = Now();
+        void* p = malloc(e.size);
+        end = Now();
+        objects_[e.address] = {p, e.size};
+        break;
+      }
+      case TraceEventType::kFree: {
+        auto it = objects_.find(e.address);
+        if (it == objects_.end()) {
+          // Allocated before the trace started.
+          skipped_++;
+          return;
+        }
+        void* p = it->second.ptr;
+        objects_.erase(it);
+        start = Now();
+        free(p);
+        end = Now();
+        break;
+      }
+      case TraceEventType::kEscape: {
+        void** loc = TranslateLocation(e.address);
+        void* ptr = TranslatePointer(e.value);
+        start = Now();
+        TCMallocInternalEscape(loc, ptr);
+        end = Now();
+        *loc = ptr;
+        break;
+      }
+      case TraceEventType::kGepCheck: {
+        char* base = static_cast<char*>(TranslatePointer(e.address));
+        char* ptr = base + (e.value - e.address);
+        start = Now();
+        TCMallocInternalGepCheckBoundary(base, ptr, e.size);
+        end = Now();
+        break;
+      }
+      case TraceEventType::kBcCheck: {
+        void* base = TranslatePointer(e.address);
+        start = Now();
+        TCMallocInternalBcCheckBoundary(base, e.size);
+        end = Now();
+        break;
+      }
+    }
+    cycles_[type] += end - start;
+  }
+
+  void Print(double cycles_per_second) const {
+    int64_t total_cycles = 0;
+    for (int type = 1; type < kNumTypes; ++type) {
+      total_cycles += cycles_[type];
+      if (counts_[type] == 0) continue;
+      printf("%-10s %12lld events %10.1f ns/event %10.3f s\n", TypeName(type),
+             static_cast<long long>(counts_[type]),
+             cycles_[type] * 1e9 / cycles_per_second / counts_[type],
+             cycles_[type] / cycles_per_second);
+    }
+    printf("%-10s %12lld events %10.3f s in the allocator\n", "total",
+           static_cast<long long>(Events()),
+           total_cycles / cycles_per_second);
+    if (counts_[0] != 0 || skipped_ != 0) {
+      printf("%lld unwritten or unknown events, %lld frees of objects "
+             "allocated before the trace\n",
+             static_cast<long long>(counts_[0]),
+             static_cast<long long>(skipped_));
+    }
+  }
+
+ private:
+  struct Object {
+    void* ptr;
+    size_t size;
+  };
+
+  static int64_t Now() { return absl::base_internal::CycleClock::Now(); }
+
+  int64_t Events() const {
+    int64_t n = 0;
+    for (int type = 1; type < kNumTypes; ++type) n += counts_[type];
+    return n;
+  }
+
+  // Traced address a at the same offset of its replayed object, or nullptr
+  // if no traced object holds it.  Sets *end to the end of the object.
+  char* Translate(uint64_t a, char** end) const {
+    auto it = objects_.upper_bound(a);
+    if (it == objects_.begin()) return nullptr;
+    --it;
+    const uint64_t offset = a - it->first;
+    if (offset >= it->second.size) return nullptr;
+    char* start = static_cast<char*>(it->second.ptr);
+    *end = start + it->second.size;
+    return start + offset;
+  }
+
+  void** TranslateLocation(uint64_t a) const {
+    char* end;
+    char* p = Translate(a, &end);
+    if (p != nullptr && p + sizeof(void*) <= end) {
+      return reinterpret_cast<void**>(p);
+    }
+    return &outside_slots[(a / sizeof(void*)) % kOutsideSlots];
+  }
+
+  void* TranslatePointer(uint64_t a) const {
+    char* end;
+    char* p = Translate(a, &end);
+    return p != nullptr ? p : outside_buffer + a % sizeof(outside_buffer);
+  }
+
+  void Release(uint64_t a) {
+    auto it = objects_.find(a);
+    if (it == objects_.end()) return;
+    // A new object at the address of one whose free was not traced.
+    free(it->second.ptr);
+    objects_.erase(it);
+  }
+
+  absl::btree_map<uint64_t, Object> objects_;
+  int64_t counts_[kNumTypes] = {};
+  int64_t cycles_[kNumTypes] = {};
+  int64_t skipped_ = 0;
+};
+
+}  // namespace
+}  // namespace tcmalloc
+
+int main(int argc, char** argv) {
+  using tcmalloc::malloc_tracing_extension::TraceEvent;
+  using tcmalloc::malloc_tracing_extension::TraceHeader;
+
+  absl::ParseCommandLine(argc, argv);
+  const std::string path = absl::GetFlag(FLAGS_trace);
+  if (path.empty()) {
+    fprintf(stderr, "--trace is required\n");
+    return 1;
+  }
+
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror(path.c_str());
+    return 1;
+  }
+  struct stat st;
+  CHECK_CONDITION(fstat(fd, &st) == 0);
+  const size_t bytes = st.st_size;
+  if (bytes < sizeof(TraceHeader)) {
+    fprintf(stderr, "%s: too short for a trace\n", path.c_str());
+    return 1;
+  }
+  void* mem = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  CHECK_CONDITION(mem != MAP_FAILED);
+  close(fd);
+
+  const auto* header = static_cast<const TraceHeader*>(mem);
+  if (header->magic != TraceHeader::kMagic ||
+      header->version != TraceHeader::kVersion ||
+      header->event_size != sizeof(TraceEvent)) {
+    fprintf(stderr, "%s: not a version %u allocation trace\n", path.c_str(),
+            TraceHeader::kVersion);
+    return 1;
+  }
+  const size_t events = std::min<size_t>(
+      header->events,
+      (bytes - sizeof(*header)) / sizeof(TraceEvent));
+  const auto* event = reinterpret_cast<const TraceEvent*>(header + 1);
+  // Cycles are counted on this machine, which need not be the traced one.
+  const double cycles_per_second =
+      absl::base_internal::CycleClock::Frequency();
+
+  const int repeat = absl::GetFlag(FLAGS_repeat);
+  for (int i = 0; i < repeat; ++i) {
+    tcmalloc::Replayer replayer;
+    for (size_t j = 0; j < events; ++j) replayer.Replay(event[j]);
+    printf("replay %d of %zu events:\n", i + 1, events);
+    replayer.Print(cycles_per_second);
+  }
+  munmap(mem, bytes);
+  return 0;
+}
@@ -198,6 +198,34 @@ static void BM_random_new_delete(benchmark::State& state) {
 }
 BENCHMARK(BM_random_new_delete);
 
+// Allocates and writes a burst of objects whose memory is cold, with or
+// without a tcmalloc_prefetch_alloc() hint ahead of it.
+static void BM_burst_new_delete(benchmark::State& state, bool hint) {
+  const size_t size = state.range(0);
+  constexpr int kBurst = 4;
+  std::vector<char> evict(32 << 20);
+  void* ptrs[kBurst];
+  for (auto s : state) {
+    state.PauseTiming();
+    // Push the objects the burst gets, and the slab, out of the caches.
+    for (size_t i = 0; i < evict.size(); i += 64) {
+      evict[i]++;
+    }
+    state.ResumeTiming();
+    if (hint) tcmalloc_prefetch_alloc(size);
+    for (int i = 0; i < kBurst; ++i) {
+      ptrs[i] = ::operator new(size);
+      *static_cast<char*>(ptrs[i]) = 0;
+      benchmark::DoNotOptimize(ptrs[i]);
+    }
+    for (int i = 0; i < kBurst; ++i) {
+      ::operator delete(ptrs[i], size);
+    }
+  }
+}
+BENCHMARK_CAPTURE(BM_burst_new_delete, cold, false)->Range(8, 4096);
+BENCHMARK_CAPTURE(BM_burst_new_delete, prefetched, true)->Range(8, 4096);
+
 static void BM_get_stats(benchmark::State& state) {
   std::vector<std::unique_ptr<char[]>> allocations;
   const int num_allocations = state.range(0);
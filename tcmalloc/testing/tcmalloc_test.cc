@@ -71,12 +71,16 @@
 #include "absl/random/random.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_format.h"
+#include "absl/synchronization/notification.h"
+#include "tcmalloc/class_regions.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/escape_buffer.h"
 #include "tcmalloc/internal/declarations.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/parameter_accessors.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/new_extension.h"
+#include "tcmalloc/poison.h"
 #include "tcmalloc/testing/test_allocator_harness.h"
 #include "tcmalloc/testing/testutil.h"
 #include "tcmalloc/testing/thread_manager.h"
@@ -723,6 +727,158 @@ TEST(TCMallocTest, nallocx) {
   }
 }
 
+extern "C" size_t tcmalloc_remaining_bytes(const void* p) noexcept;
+
+TEST(TCMallocTest, RemainingBytes) {
+  ScopedGuardedSamplingRate gs(-1);
+
+  for (size_t size : {size_t{1}, size_t{100}, size_t{4096}, size_t{1} << 20}) {
+    char* ptr = static_cast<char*>(operator new(size));
+    const size_t remaining = tcmalloc_remaining_bytes(ptr);
+    EXPECT_GE(remaining, size);
+    EXPECT_EQ(tcmalloc_remaining_bytes(ptr + size - 1), remaining - size + 1);
+    operator delete(ptr);
+  }
+
+  static char global[16];
+  EXPECT_EQ(tcmalloc_remaining_bytes(global), SIZE_MAX);
+}
+
+#ifdef EXTERNAL_REGIONS
+extern "C" int tcmalloc_register_region(void* base, size_t len,
+                                        size_t element_size) noexcept;
+extern "C" int tcmalloc_unregister_region(void* base, size_t len) noexcept;
+
+TEST(TCMallocTest, ExternalRegion) {
+  using tcmalloc_internal::kPageSize;
+  constexpr size_t kElement = 2176;
+  constexpr size_t kLen = 16 * kPageSize;
+  const size_t mapped = kLen + kPageSize;
+  void* map = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(map, MAP_FAILED);
+  char* base = reinterpret_cast<char*>(
+      (reinterpret_cast<uintptr_t>(map) + kPageSize - 1) & ~(kPageSize - 1));
+
+  EXPECT_EQ(tcmalloc_register_region(base + 8, kLen, kElement), -1);
+  EXPECT_EQ(tcmalloc_register_region(base, kLen, kElement + 1), -1);
+  ASSERT_EQ(tcmalloc_register_region(base, kLen, kElement), 0);
+  EXPECT_EQ(tcmalloc_register_region(base, kLen, kElement), -1);
+
+  EXPECT_EQ(tcmalloc_remaining_bytes(base), kElement);
+  EXPECT_EQ(tcmalloc_remaining_bytes(base + kElement - 1), 1);
+  EXPECT_EQ(tcmalloc_remaining_bytes(base + 5 * kElement + 10), kElement - 10);
+
+  // Heap memory cannot be registered.
+  void* heap = operator new(4 * kPageSize);
+  const uintptr_t page =
+      (reinterpret_cast<uintptr_t>(heap) + kPageSize - 1) & ~(kPageSize - 1);
+  EXPECT_EQ(tcmalloc_register_region(reinterpret_cast<void*>(page), kPageSize,
+                                     kElement),
+            -1);
+  operator delete(heap);
+
+  // Only the whole region can be unregistered.
+  EXPECT_EQ(tcmalloc_unregister_region(base, kPageSize), -1);
+  EXPECT_EQ(tcmalloc_unregister_region(base + kPageSize, kLen - kPageSize),
+            -1);
+  ASSERT_EQ(tcmalloc_unregister_region(base, kLen), 0);
+  EXPECT_EQ(tcmalloc_remaining_bytes(base), SIZE_MAX);
+  EXPECT_EQ(tcmalloc_unregister_region(base, kLen), -1);
+  munmap(map, mapped);
+}
+#endif
+
+#ifdef ENABLE_PROTECTION
+extern "C" int __escape(void** loc, void* ptr) noexcept;
+
+TEST(TCMallocTest, EscapeStagedByAnotherThread) {
+  ScopedNeverSample never_sample;
+  static void* staged_slot;
+  static void* later_slot;
+  void* obj = ::operator new(80);
+  void* other = ::operator new(80);
+
+  // The thread stays alive throughout, so it does not commit its buffer on
+  // exit; only the flush request makes its staged escape visible.
+  absl::Notification staged, requested, escaped_again, freed;
+  std::thread t([&] {
+    __escape(&staged_slot, obj);
+    staged_slot = obj;
+    staged.Notify();
+    requested.WaitForNotification();
+    __escape(&later_slot, other);
+    later_slot = other;
+    escaped_again.Notify();
+    freed.WaitForNotification();
+  });
+  staged.WaitForNotification();
+  tcmalloc_internal::RequestEscapeFlush();
+  requested.Notify();
+  escaped_again.WaitForNotification();
+
+  ::operator delete(obj);
+  EXPECT_TRUE(TCMALLOC_IS_POISONED(staged_slot));
+  freed.Notify();
+  t.join();
+  ::operator delete(other);
+  EXPECT_TRUE(TCMALLOC_IS_POISONED(later_slot));
+}
+
+// Freeing the same slot over and over wraps its generation counter.
+TEST(TCMallocTest, PoisonGenerationSkipsZero) {
+  ScopedNeverSample never_sample;
+  static void* slot;
+  for (int i = 0; i < 3 * tcmalloc_internal::kPoisonGenerationMask; ++i) {
+    void* obj = ::operator new(48);
+    __escape(&slot, obj);
+    slot = obj;
+    ::operator delete(obj);
+    ASSERT_TRUE(TCMALLOC_IS_POISONED(slot));
+    ASSERT_NE(TCMALLOC_POISON_GENERATION(slot), 0) << i;
+  }
+}
+#endif
+
+#ifdef CLASS_REGIONS
+TEST(TCMallocTest, ClassRegions) {
+  using tcmalloc_internal::ClassRegions;
+  // Sampled objects get spans of their own, outside the regions.
+  ScopedNeverSample never_sample;
+
+  // Objects of the largest class are carved from the slots of its region
+  // until the region runs out, and come from the filler after that.
+  constexpr size_t kSize = tcmalloc_internal::kMaxSize;
+  std::vector<void*> ptrs;
+  ptrs.push_back(::operator new(kSize));
+  const uintptr_t first = reinterpret_cast<uintptr_t>(ptrs[0]);
+  const size_t size_class = ClassRegions::SizeClass(first);
+  ASSERT_NE(size_class, 0) << "no region for the class of " << kSize;
+  const ClassRegions::Layout& l = ClassRegions::layout(size_class);
+  const size_t capacity =
+      ClassRegions::kHugePagesPerRegion * l.spans * l.objects;
+
+  void* outside = nullptr;
+  for (uintptr_t p = first; outside == nullptr;) {
+    uintptr_t start, end;
+    ASSERT_TRUE(ClassRegions::ChunkRange(p, size_class, &start, &end));
+    EXPECT_EQ(start, p);
+    EXPECT_EQ(end - start, kSize);
+    ASSERT_LE(ptrs.size(), capacity);
+
+    void* next = ::operator new(kSize);
+    ptrs.push_back(next);
+    p = reinterpret_cast<uintptr_t>(next);
+    if (ClassRegions::Region(p) != size_class) outside = next;
+  }
+  EXPECT_EQ(ClassRegions::SizeClass(reinterpret_cast<uintptr_t>(outside)), 0);
+  EXPECT_GE(MallocExtension::GetAllocatedSize(outside), kSize);
+  memset(outside, 0xa5, kSize);
+
+  for (void* p : ptrs) ::operator delete(p);
+}
+#endif
+
 TEST(TCMallocTest, nallocx_alignment) {
   // Guarded allocations may have a smaller allocated size than nallocx
   // predicts.  So we disable guarded allocations.
@@ -1142,5 +1298,52 @@ TEST(MallocExtension, SizeReturningNewAndSizedDelete) {
 #endif
 }
 
+TEST(MallocExtension, MallocBatch) {
+  constexpr size_t kBatch = 32;
+  void* ptrs[kBatch];
+  for (size_t size : {0, 1, 64, 1500, 9000, 300000}) {
+    ASSERT_EQ(tcmalloc_malloc_batch(size, ptrs, kBatch), kBatch) << size;
+    absl::flat_hash_set<void*> distinct;
+    for (void* p : ptrs) {
+      ASSERT_NE(p, nullptr) << size;
+      EXPECT_GE(MallocExtension::GetAllocatedSize(p), size);
+      memset(p, 0xBF, size);
+      distinct.insert(p);
+    }
+    EXPECT_EQ(distinct.size(), kBatch) << size;
+    tcmalloc_free_batch(ptrs, kBatch);
+  }
+  EXPECT_EQ(tcmalloc_malloc_batch(8, ptrs, 0), 0);
+}
+
+TEST(MallocExtension, PrefetchAlloc) {
+  // The hint is safe for any size, and leaves the objects it prefetched to
+  // the allocations that follow.
+  for (size_t size : {size_t{0}, size_t{1}, size_t{64}, size_t{1500},
+                      size_t{300000}, std::numeric_limits<size_t>::max()}) {
+    tcmalloc_prefetch_alloc(size);
+  }
+  for (size_t size : {size_t{1}, size_t{64}, size_t{1500}}) {
+    void* ptr = malloc(size);
+    free(ptr);
+    tcmalloc_prefetch_alloc(size);
+    void* again = malloc(size);
+    ASSERT_NE(again, nullptr) << size;
+    memset(again, 0xBF, size);
+    free(again);
+  }
+}
+
+TEST(MallocExtension, FreeBatchMixedSizes) {
+  constexpr size_t kBatch = 200;
+  std::vector<void*> ptrs;
+  for (size_t i = 0; i < kBatch; ++i) {
+    // Runs of the same size and single objects of others, with some null
+    // pointers, which are skipped like free(nullptr).
+    ptrs.push_back(i % 17 == 0 ? nullptr : malloc(i < 100 ? 48 : i * 64));
+  }
+  tcmalloc_free_batch(ptrs.data(), ptrs.size());
+}
+
 }  // namespace
 }  // namespace tcmalloc
@@ -184,7 +184,9 @@ class ScopedFakeCpuId {
     // modifying __rseq_abi, we can inject our own CPU ID.
     tcmalloc_internal::subtle::percpu::__rseq_abi.cpu_id = cpu_id;
 
-    if (tcmalloc_internal::subtle::percpu::UsingFlatVirtualCpus()) {
+    if (tcmalloc_internal::subtle::percpu::UsingMmCid()) {
+      tcmalloc_internal::subtle::percpu::__rseq_abi.mm_cid = cpu_id;
+    } else if (tcmalloc_internal::subtle::percpu::UsingFlatVirtualCpus()) {
       tcmalloc_internal::subtle::percpu::__rseq_abi.vcpu_id = cpu_id;
     }
 #endif
@@ -197,7 +199,10 @@ class ScopedFakeCpuId {
     tcmalloc_internal::subtle::percpu::__rseq_abi.cpu_id =
         tcmalloc_internal::subtle::percpu::kCpuIdUninitialized;
 
-    if (tcmalloc_internal::subtle::percpu::UsingFlatVirtualCpus()) {
+    if (tcmalloc_internal::subtle::percpu::UsingMmCid()) {
+      tcmalloc_internal::subtle::percpu::__rseq_abi.mm_cid =
+          tcmalloc_internal::subtle::percpu::kCpuIdUninitialized;
+    } else if (tcmalloc_internal::subtle::percpu::UsingFlatVirtualCpus()) {
       tcmalloc_internal::subtle::percpu::__rseq_abi.vcpu_id =
           tcmalloc_internal::subtle::percpu::kCpuIdUninitialized;
     }
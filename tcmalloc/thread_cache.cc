@@ -18,6 +18,7 @@
 
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/macros.h"
+#include "tcmalloc/escape_buffer.h"
 #include "tcmalloc/transfer_cache.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
@@ -344,6 +345,11 @@ void ThreadCache::DestroyThreadCache(void* ptr) {
 }
 
 void ThreadCache::DeleteCache(ThreadCache* heap) {
+  // The heap is only deleted by its own thread, which is going away or idle:
+  // commit its staged escapes now rather than leave them to thread exit, so
+  // that frees by other threads find them in the span escape lists.
+  FlushThreadEscapes();
+
   // Remove all memory from heap
   heap->Cleanup();
 
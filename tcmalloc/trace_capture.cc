@@ -0,0 +1,295 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/trace_capture.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/internal/sysinfo.h"
+#include "absl/base/optimization.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/pointer_tag.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+using malloc_tracing_extension::CaptureEvent;
+using malloc_tracing_extension::CaptureHeader;
+using malloc_tracing_extension::TraceCaptureStats;
+
+namespace {
+
+// A CaptureEvent whose type publishes it.
+struct Slot {
+  uint64_t cycles;
+  uint64_t address;
+  uint64_t value;
+  uint32_t size;
+  std::atomic<TraceCapture::EventType> type;
+  uint8_t size_class;
+  uint16_t cpu;
+};
+static_assert(sizeof(Slot) == sizeof(CaptureEvent), "Slot mirrors the format");
+
+// Set in a ring's head once the capture stops, so no slot is claimed after.
+constexpr uint64_t kClosed = uint64_t{1} << 63;
+
+// Events copied out per write().
+constexpr size_t kStagingEvents = 256;
+
+}  // namespace
+
+struct TraceCapture::Ring {
+  // Slots claimed, with kClosed once the capture stops.
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<uint64_t> head;
+  std::atomic<uint64_t> dropped;
+  // First slot not yet drained.  Only the drainer writes it.
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<uint64_t> tail;
+  Slot* slots;
+};
+
+namespace {
+
+// Serializes Start(), Stop() and Drain().
+ABSL_CONST_INIT absl::base_internal::SpinLock capture_lock(
+    absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY);
+int capture_fd ABSL_GUARDED_BY(capture_lock) = -1;
+int capture_error ABSL_GUARDED_BY(capture_lock) = 0;
+uint64_t capture_written ABSL_GUARDED_BY(capture_lock) = 0;
+uint64_t capture_lost ABSL_GUARDED_BY(capture_lock) = 0;
+CaptureEvent staging[kStagingEvents] ABSL_GUARDED_BY(capture_lock);
+
+// Mapped by the first Start() and kept: a thread that loaded the rings just
+// before a Stop() may still read a head, and finds it closed.
+TraceCapture::Ring* ring_memory ABSL_GUARDED_BY(capture_lock) = nullptr;
+Slot* slot_memory ABSL_GUARDED_BY(capture_lock) = nullptr;
+ABSL_CONST_INIT std::atomic<size_t> num_rings{0};
+
+size_t SlotBytes(size_t rings) {
+  return rings * TraceCapture::kRingEvents * sizeof(Slot);
+}
+
+// Writes all of [data, data + bytes) to the fd.  Returns 0 or an errno value.
+int WriteAll(int fd, const void* data, size_t bytes) {
+  const char* p = static_cast<const char*>(data);
+  while (bytes > 0) {
+    const ssize_t n = write(fd, p, bytes);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    p += n;
+    bytes -= n;
+  }
+  return 0;
+}
+
+void Flush(size_t n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(capture_lock) {
+  if (n == 0) return;
+  if (capture_error == 0) {
+    capture_error = WriteAll(capture_fd, staging, n * sizeof(CaptureEvent));
+  }
+  if (capture_error == 0) {
+    capture_written += n;
+  } else {
+    capture_lost += n;
+  }
+}
+
+// Copies the published slots of r from its tail on out to the fd.  Returns
+// false if it stopped at a slot that is claimed but not yet published.
+bool DrainRing(TraceCapture::Ring& r)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(capture_lock) {
+  const uint64_t head = r.head.load(std::memory_order_acquire) & ~kClosed;
+  uint64_t tail = r.tail.load(std::memory_order_relaxed);
+  size_t n = 0;
+  bool complete = true;
+  for (; tail < head; ++tail) {
+    Slot& s = r.slots[tail & (TraceCapture::kRingEvents - 1)];
+    const TraceCapture::EventType type =
+        s.type.load(std::memory_order_acquire);
+    if (type == TraceCapture::EventType::kNone) {
+      complete = false;
+      break;
+    }
+    CaptureEvent& e = staging[n];
+    e.cycles = s.cycles;
+    e.address = s.address;
+    e.value = s.value;
+    e.size = s.size;
+    e.type = type;
+    e.size_class = s.size_class;
+    e.cpu = s.cpu;
+    s.type.store(TraceCapture::EventType::kNone, std::memory_order_relaxed);
+    if (++n == kStagingEvents) {
+      Flush(n);
+      n = 0;
+    }
+  }
+  Flush(n);
+  // Hands the slots back; pairs with the acquire load of RecordSlow().
+  r.tail.store(tail, std::memory_order_release);
+  return complete;
+}
+
+}  // namespace
+
+ABSL_CONST_INIT std::atomic<TraceCapture::Ring*> TraceCapture::rings_{
+    nullptr};
+
+int TraceCapture::Start(int fd) {
+  if (fd < 0) return EBADF;
+  absl::base_internal::SpinLockHolder h(&capture_lock);
+  if (capture_fd >= 0) return EBUSY;
+
+  if (ring_memory == nullptr) {
+    const size_t rings = absl::base_internal::NumCPUs();
+    void* mem = mmap(nullptr, rings * sizeof(Ring), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return errno;
+    // The slots are only backed as the rings fill.
+    void* slots = mmap(nullptr, SlotBytes(rings), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slots == MAP_FAILED) {
+      const int err = errno;
+      munmap(mem, rings * sizeof(Ring));
+      return err;
+    }
+    ring_memory = static_cast<Ring*>(mem);
+    slot_memory = static_cast<Slot*>(slots);
+    for (size_t i = 0; i < rings; ++i) {
+      Ring* r = new (&ring_memory[i]) Ring();
+      r->slots = slot_memory + i * kRingEvents;
+    }
+    num_rings.store(rings, std::memory_order_relaxed);
+  }
+
+  CaptureHeader header = {};
+  header.magic = CaptureHeader::kMagic;
+  header.version = CaptureHeader::kVersion;
+  header.event_size = sizeof(CaptureEvent);
+  header.cycles_per_second = absl::base_internal::CycleClock::Frequency();
+  const int err = WriteAll(fd, &header, sizeof(header));
+  if (err != 0) return err;
+
+  capture_fd = fd;
+  capture_error = 0;
+  capture_written = 0;
+  capture_lost = 0;
+  const size_t rings = num_rings.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < rings; ++i) {
+    Ring& r = ring_memory[i];
+    r.tail.store(0, std::memory_order_relaxed);
+    r.dropped.store(0, std::memory_order_relaxed);
+    r.head.store(0, std::memory_order_relaxed);
+  }
+  // Pairs with the acquire load of RecordSlow().
+  rings_.store(ring_memory, std::memory_order_release);
+  return 0;
+}
+
+int TraceCapture::Stop(TraceCaptureStats* stats) {
+  absl::base_internal::SpinLockHolder h(&capture_lock);
+  if (capture_fd < 0) return ENOENT;
+
+  rings_.store(nullptr, std::memory_order_relaxed);
+  const size_t rings = num_rings.load(std::memory_order_relaxed);
+  uint64_t dropped = 0;
+  for (size_t i = 0; i < rings; ++i) {
+    Ring& r = ring_memory[i];
+    r.head.fetch_or(kClosed, std::memory_order_acq_rel);
+    // Threads that claimed a slot before the close may still be filling it.
+    while (!DrainRing(r)) {
+      sched_yield();
+    }
+    dropped += r.dropped.load(std::memory_order_relaxed);
+  }
+  // Every slot is drained, so its type is kNone again in the zero pages.
+  madvise(slot_memory, SlotBytes(rings), MADV_DONTNEED);
+
+  stats->events = capture_written;
+  stats->dropped = dropped + capture_lost;
+  const int err = capture_error;
+  capture_fd = -1;
+  return err;
+}
+
+void TraceCapture::Drain() {
+  if (rings_.load(std::memory_order_relaxed) == nullptr) return;
+  absl::base_internal::SpinLockHolder h(&capture_lock);
+  if (capture_fd < 0) return;
+  const size_t rings = num_rings.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < rings; ++i) {
+    // Slots still being filled are left for the next drain.
+    DrainRing(ring_memory[i]);
+  }
+}
+
+void TraceCapture::RecordSlow(EventType type, const void* address,
+                              const void* value, size_t size) {
+  Ring* rings = rings_.load(std::memory_order_acquire);
+  if (rings == nullptr) return;
+  const size_t count = num_rings.load(std::memory_order_relaxed);
+  int id = subtle::percpu::GetCurrentConcurrencyId();
+  size_t index = id < 0 ? 0 : static_cast<size_t>(id);
+  if (ABSL_PREDICT_FALSE(index >= count)) index %= count;
+  Ring& r = rings[index];
+
+  uint64_t head = r.head.load(std::memory_order_relaxed);
+  do {
+    if (ABSL_PREDICT_FALSE(head & kClosed)) return;
+    if (ABSL_PREDICT_FALSE(head - r.tail.load(std::memory_order_acquire) >=
+                           kRingEvents)) {
+      r.dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  } while (!r.head.compare_exchange_weak(head, head + 1,
+                                         std::memory_order_relaxed));
+
+  uint8_t size_class = 0;
+  if (address != nullptr &&
+      (type == EventType::kAlloc || type == EventType::kFree ||
+       type == EventType::kRealloc)) {
+    size_class = tc_globals.pagemap()
+                     .get_page_info(PageIdContaining(StripPointerTag(address)))
+                     .size_class();
+  }
+  Slot& s = r.slots[head & (kRingEvents - 1)];
+  s.cycles = absl::base_internal::CycleClock::Now();
+  s.address = reinterpret_cast<uintptr_t>(address);
+  s.value = reinterpret_cast<uintptr_t>(value);
+  s.size = static_cast<uint32_t>(std::min<size_t>(size, UINT32_MAX));
+  s.size_class = size_class;
+  s.cpu = static_cast<uint16_t>(index);
+  // Publishes the slot; pairs with the acquire load of DrainRing().
+  s.type.store(type, std::memory_order_release);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
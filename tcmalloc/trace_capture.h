@@ -0,0 +1,95 @@
+// Copyright 2019 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Per-cpu capture of allocation events (TRACE_CAPTURE).
+//
+// Unlike ALLOCATION_TRACE, whose threads all take their slots from one
+// counter, each event goes to the ring of the concurrency id it runs on, so
+// recording touches only lines that id's threads share.  A thread claims the
+// next slot of its ring with a compare-and-swap of the ring's head, fills
+// it, and publishes it with a release store of its type; the drainer copies
+// published slots out from the tail and hands them back by advancing it.  A
+// ring whose unread events fill it drops new ones rather than overwrite.
+// Without a running capture recording an event is one load of a global.
+
+#ifndef TCMALLOC_TRACE_CAPTURE_H_
+#define TCMALLOC_TRACE_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/malloc_tracing_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+class TraceCapture {
+ public:
+  using EventType = malloc_tracing_extension::CaptureEventType;
+
+  // Events per ring; a second's worth for a busy CPU.
+  static constexpr size_t kRingEvents = size_t{1} << 16;
+
+  // Writes the header to fd and starts recording.  Returns 0 or an errno
+  // value; EBUSY if a capture is already running.
+  static int Start(int fd);
+
+  // Stops recording, waits for the threads still filling slots, and writes
+  // everything left to the fd.  Returns 0 or an errno value; ENOENT if no
+  // capture is running.
+  static int Stop(malloc_tracing_extension::TraceCaptureStats* stats);
+
+  // Writes the published events of every ring to the fd.  Called by the
+  // background thread once a tick.
+  static void Drain();
+
+  static void Record(EventType type, const void* address, const void* value,
+                     size_t size) {
+    if (ABSL_PREDICT_TRUE(rings_.load(std::memory_order_relaxed) ==
+                          nullptr)) {
+      return;
+    }
+    RecordSlow(type, address, value, size);
+  }
+
+  struct Ring;
+
+ private:
+  static void RecordSlow(EventType type, const void* address,
+                         const void* value, size_t size);
+
+  // Rings of the running capture, or nullptr.
+  ABSL_CONST_INIT static std::atomic<Ring*> rings_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#ifdef TRACE_CAPTURE
+#define TCMALLOC_CAPTURE_EVENT(type, address, value, size)         \
+  ::tcmalloc::tcmalloc_internal::TraceCapture::Record(             \
+      ::tcmalloc::tcmalloc_internal::TraceCapture::EventType::type, \
+      (address), (value), (size))
+#else
+#define TCMALLOC_CAPTURE_EVENT(type, address, value, size)
+#endif
+
+#endif  // TCMALLOC_TRACE_CAPTURE_H_
@@ -17,12 +17,15 @@
 #include <fcntl.h>
 #include <string.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <optional>
 
 #include "absl/base/attributes.h"
 #include "absl/base/optimization.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/string_view.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/guarded_page_allocator.h"
@@ -96,6 +99,35 @@ TransferCacheImplementation TransferCacheManager::ChooseImplementation() {
   return TransferCacheImplementation::Legacy;
 }
 
+void TransferCacheManager::ChooseLockFreeClasses(bool lock_free[kNumClasses]) {
+  const char *e =
+      thread_safe_getenv("TCMALLOC_INTERNAL_LOCK_FREE_TRANSFER_CACHE");
+  if (e == nullptr) return;
+  const absl::string_view classes(e);
+  if (classes == "all") {
+    std::fill(lock_free, lock_free + kNumClasses, true);
+    return;
+  }
+  absl::string_view::size_type pos = 0;
+  while (pos <= classes.size()) {
+    auto end = classes.find(',', pos);
+    if (end == absl::string_view::npos) end = classes.size();
+    const absl::string_view token = classes.substr(pos, end - pos);
+    pos = end + 1;
+
+    const auto dash = token.find('-');
+    int first, last;
+    if (!absl::SimpleAtoi(token.substr(0, dash), &first) ||
+        !absl::SimpleAtoi(
+            dash == absl::string_view::npos ? token : token.substr(dash + 1),
+            &last) ||
+        first < 0 || first > last || last >= kNumClasses) {
+      Crash(kCrash, __FILE__, __LINE__, "bad env var", e);
+    }
+    std::fill(lock_free + first, lock_free + last + 1, true);
+  }
+}
+
 #endif
 
 }  // namespace tcmalloc_internal
@@ -101,7 +101,10 @@ class ShardedTransferCacheManagerBase {
                                             CpuLayout *cpu_layout)
       : owner_(owner), cpu_layout_(cpu_layout) {}
 
-  void Init() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  // With large_classes, objects of 4KiB and more bypass the per-CPU caches
+  // for the shard of their L3 cache, see should_use().
+  void Init(bool large_classes = true)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
     num_shards_ = CpuLayout::BuildCacheMap(l3_cache_index_);
     shards_ = reinterpret_cast<Shard *>(
         owner_->Alloc(sizeof(Shard) * num_shards_, ABSL_CACHELINE_SIZE));
@@ -112,7 +115,12 @@ class ShardedTransferCacheManagerBase {
     for (int size_class = 0; size_class < kNumClasses; ++size_class) {
       const int size_per_object = Manager::class_to_size(size_class);
       static constexpr int min_size = 4096;
-      active_for_class_[size_class] = size_per_object >= min_size;
+      active_for_class_[size_class] =
+          large_classes && size_per_object >= min_size;
+#ifdef LLC_SHARED_REFILL
+      shares_batches_[size_class] =
+          size_per_object > 0 && size_per_object < min_size;
+#endif
     }
   }
 
@@ -120,6 +128,26 @@ class ShardedTransferCacheManagerBase {
     return active_for_class_[size_class];
   }
 
+  // Whether the per-CPU caches refill size_class from, and overflow it to,
+  // the shard of their L3 cache in batches rather than the global transfer
+  // cache.  Only the classes should_use() leaves in the per-CPU caches are
+  // shared this way, and only with LLC_SHARED_REFILL.
+  bool shares_batches(int size_class) const {
+#ifdef LLC_SHARED_REFILL
+    return shares_batches_[size_class];
+#else
+    return false;
+#endif
+  }
+
+  ABSL_MUST_USE_RESULT int RemoveRange(int size_class, void **batch, int n) {
+    return RemoveFromShard(size_class, batch, n);
+  }
+
+  void InsertRange(int size_class, absl::Span<void *> batch) {
+    get_insert_cache(size_class).InsertRange(size_class, batch);
+  }
+
   size_t TotalBytes() {
     if (shards_ == nullptr) return 0;
     size_t out = 0;
@@ -137,18 +165,39 @@ class ShardedTransferCacheManagerBase {
 
   void *Pop(int size_class) {
     void *batch[1];
-    const int got = get_cache(size_class).RemoveRange(size_class, batch, 1);
+    const int got = RemoveFromShard(size_class, batch, 1);
     return got == 1 ? batch[0] : nullptr;
   }
 
   void Push(int size_class, void *ptr) {
-    get_cache(size_class).InsertRange(size_class, {&ptr, 1});
+    get_insert_cache(size_class).InsertRange(size_class, {&ptr, 1});
+  }
+
+#ifdef LLC_REMOTE_FREES
+  // Frees of batches, or of single objects by Push(), that went to the shard
+  // refilling their size class rather than that of the freeing CPU.
+  size_t remote_inserts() const {
+    size_t n = 0;
+    for (int shard = 0; shard < num_shards_; ++shard) {
+      n += shards_[shard].remote_inserts.load(std::memory_order_relaxed);
+    }
+    return n;
   }
+#endif
 
   // All caches not touched since last attempt will return all objects
   // to the non-sharded TransferCache.
   void Plunder() {
     if (shards_ == nullptr || num_shards_ == 0) return;
+#ifdef LLC_REMOTE_FREES
+    // A shard refilling a size class is only sent its frees until the next
+    // pass; it has to miss again to keep them.
+    for (std::atomic<int> &consumer : consumer_) {
+      if (consumer.load(std::memory_order_relaxed) != 0) {
+        consumer.store(0, std::memory_order_relaxed);
+      }
+    }
+#endif
     for (int shard = 0; shard < num_shards_; ++shard) {
       if (!shard_initialized(shard)) continue;
       for (int size_class = 0; size_class < kNumClasses; ++size_class) {
@@ -181,12 +230,21 @@ class ShardedTransferCacheManagerBase {
       // The constructor of atomic values is not atomic. Set the value
       // explicitly and atomically here.
       initialized.store(false, std::memory_order_release);
+#ifdef LLC_REMOTE_FREES
+      remote_inserts.store(0, std::memory_order_relaxed);
+#endif
     }
     TransferCache *transfer_caches = nullptr;
     absl::once_flag once_flag;
     // We need to be able to tell whether a given shard is initialized, which
     // the `once_flag` API doesn't offer.
     std::atomic<bool> initialized;
+#ifdef LLC_REMOTE_FREES
+    // Frees on this shard sent to another one, see get_insert_cache().  Each
+    // shard counts its own on a line of its own, so the CPUs of different
+    // L3 caches do not contend on it.
+    alignas(ABSL_CACHELINE_SIZE) std::atomic<size_t> remote_inserts;
+#endif
   };
 
   // Initializes all transfer caches in the given shard.
@@ -198,7 +256,15 @@ class ShardedTransferCacheManagerBase {
     for (int size_class = 0; size_class < kNumClasses; ++size_class) {
       const int size_per_object = Manager::class_to_size(size_class);
       static constexpr int k12MB = 12 << 20;
-      const int capacity = should_use(size_class) ? k12MB / size_per_object : 0;
+      int capacity = should_use(size_class) ? k12MB / size_per_object : 0;
+#ifdef LLC_SHARED_REFILL
+      // A few batches are enough for the CPUs of one L3 cache to take over
+      // what a sibling overflowed; the rest goes to the central free list.
+      static constexpr int kSharedBatches = 8;
+      if (shares_batches(size_class)) {
+        capacity = kSharedBatches * Manager::num_objects_to_move(size_class);
+      }
+#endif
       new (&new_caches[size_class]) TransferCache(
           owner_, capacity > 0 ? size_class : 0, {capacity, capacity});
       new_caches[size_class].freelist().Init(size_class);
@@ -207,25 +273,82 @@ class ShardedTransferCacheManagerBase {
     shard.initialized.store(true, std::memory_order_release);
   }
 
-  // Returns the cache shard corresponding to the given size class and the
-  // current cpu's L3 node. The cache will be initialized if required.
-  TransferCache &get_cache(int size_class) {
+  // Returns the shard of the current cpu's L3 node.
+  int current_shard() {
     const int cpu = cpu_layout_->CurrentCpu();
     ASSERT(cpu < ABSL_ARRAYSIZE(l3_cache_index_));
     ASSERT(cpu >= 0);
     const uint8_t shard_index = l3_cache_index_[cpu];
     ASSERT(shard_index < num_shards_);
+    return shard_index;
+  }
+
+  // Returns the cache of the given size class in the given shard. The cache
+  // will be initialized if required.
+  TransferCache &get_cache(int shard_index, int size_class) {
     Shard &shard = shards_[shard_index];
     absl::call_once(shard.once_flag, [this, &shard]() { InitShard(shard); });
     return shard.transfer_caches[size_class];
   }
 
+  // Returns the cache shard corresponding to the given size class and the
+  // current cpu's L3 node. The cache will be initialized if required.
+  TransferCache &get_cache(int size_class) {
+    return get_cache(current_shard(), size_class);
+  }
+
+  // Takes objects from the cache of the current cpu's L3 node.  With
+  // LLC_REMOTE_FREES, a shard that finds the cache empty becomes the one
+  // frees of the size class go to.
+  int RemoveFromShard(int size_class, void **batch, int n) {
+#ifdef LLC_REMOTE_FREES
+    const int shard = current_shard();
+    bool missed;
+    const int got =
+        get_cache(shard, size_class).RemoveRange(size_class, batch, n, &missed);
+    if (missed &&
+        consumer_[size_class].load(std::memory_order_relaxed) != shard + 1) {
+      consumer_[size_class].store(shard + 1, std::memory_order_relaxed);
+    }
+    return got;
+#else
+    return get_cache(size_class).RemoveRange(size_class, batch, n);
+#endif
+  }
+
+  // Returns the cache frees of the size class go to: with
+  // LLC_REMOTE_FREES, that of the shard which last ran out of it, if any,
+  // so that objects a pipeline frees on one L3 node go back to the node
+  // allocating them instead of through the central free list.
+  TransferCache &get_insert_cache(int size_class) {
+#ifdef LLC_REMOTE_FREES
+    const int shard = current_shard();
+    const int consumer =
+        consumer_[size_class].load(std::memory_order_relaxed) - 1;
+    if (consumer >= 0 && consumer != shard) {
+      shards_[shard].remote_inserts.fetch_add(1, std::memory_order_relaxed);
+      return get_cache(consumer, size_class);
+    }
+    return get_cache(shard, size_class);
+#else
+    return get_cache(size_class);
+#endif
+  }
+
   // Mapping from cpu to the L3 cache used.
   uint8_t l3_cache_index_[CPU_SETSIZE] = {0};
 
   Shard *shards_ = nullptr;
   int num_shards_ = 0;
   bool active_for_class_[kNumClasses] = {false};
+#ifdef LLC_SHARED_REFILL
+  bool shares_batches_[kNumClasses] = {false};
+#endif
+#ifdef LLC_REMOTE_FREES
+  // One more than the shard that last missed in the cache of each size
+  // class since the last Plunder(), 0 if none has.
+  std::atomic<int> consumer_[kNumClasses] = {};
+#endif
   Manager *const owner_;
   CpuLayout *const cpu_layout_;
 };
@@ -247,6 +370,11 @@ class TransferCacheManager : public StaticForwarder {
       internal_transfer_cache::RingBufferTransferCache<
           tcmalloc_internal::CentralFreeList, TransferCacheManager>;
 
+  template <typename CentralFreeList, typename Manager>
+  friend class internal_transfer_cache::LockFreeTransferCache;
+  using LockFreeTransferCache = internal_transfer_cache::LockFreeTransferCache<
+      tcmalloc_internal::CentralFreeList, TransferCacheManager>;
+
   friend class FakeMultiClassRingBufferManager;
   friend class FakeMultiClassTransferCacheManager;
 
@@ -258,11 +386,14 @@ class TransferCacheManager : public StaticForwarder {
 
   void Init() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
     implementation_ = ChooseImplementation();
+    ChooseLockFreeClasses(lock_free_);
     InitCaches();
   }
 
   void InsertRange(int size_class, absl::Span<void *> batch) {
-    if (implementation_ == TransferCacheImplementation::Ring) {
+    if (lock_free_[size_class]) {
+      cache_[size_class].lftc.InsertRange(size_class, batch);
+    } else if (implementation_ == TransferCacheImplementation::Ring) {
       cache_[size_class].rbtc.InsertRange(size_class, batch);
     } else {
       cache_[size_class].tc.InsertRange(size_class, batch);
@@ -270,7 +401,9 @@ class TransferCacheManager : public StaticForwarder {
   }
 
   ABSL_MUST_USE_RESULT int RemoveRange(int size_class, void **batch, int n) {
-    if (implementation_ == TransferCacheImplementation::Ring) {
+    if (lock_free_[size_class]) {
+      return cache_[size_class].lftc.RemoveRange(size_class, batch, n);
+    } else if (implementation_ == TransferCacheImplementation::Ring) {
       return cache_[size_class].rbtc.RemoveRange(size_class, batch, n);
     } else {
       return cache_[size_class].tc.RemoveRange(size_class, batch, n);
@@ -280,7 +413,9 @@ class TransferCacheManager : public StaticForwarder {
   // This is not const because the underlying ring-buffer transfer cache
   // function requires acquiring a lock.
   size_t tc_length(int size_class) {
-    if (implementation_ == TransferCacheImplementation::Ring) {
+    if (lock_free_[size_class]) {
+      return cache_[size_class].lftc.tc_length();
+    } else if (implementation_ == TransferCacheImplementation::Ring) {
       return cache_[size_class].rbtc.tc_length();
     } else {
       return cache_[size_class].tc.tc_length();
@@ -288,7 +423,9 @@ class TransferCacheManager : public StaticForwarder {
   }
 
   bool HasSpareCapacity(int size_class) {
-    if (implementation_ == TransferCacheImplementation::Ring) {
+    if (lock_free_[size_class]) {
+      return cache_[size_class].lftc.HasSpareCapacity(size_class);
+    } else if (implementation_ == TransferCacheImplementation::Ring) {
       return cache_[size_class].rbtc.HasSpareCapacity(size_class);
     } else {
       return cache_[size_class].tc.HasSpareCapacity(size_class);
@@ -296,7 +433,9 @@ class TransferCacheManager : public StaticForwarder {
   }
 
   TransferCacheStats GetStats(int size_class) {
-    if (implementation_ == TransferCacheImplementation::Ring) {
+    if (lock_free_[size_class]) {
+      return cache_[size_class].lftc.GetStats();
+    } else if (implementation_ == TransferCacheImplementation::Ring) {
       return cache_[size_class].rbtc.GetStats();
     } else {
       return cache_[size_class].tc.GetStats();
@@ -304,7 +443,9 @@ class TransferCacheManager : public StaticForwarder {
   }
 
   CentralFreeList &central_freelist(int size_class) {
-    if (implementation_ == TransferCacheImplementation::Ring) {
+    if (lock_free_[size_class]) {
+      return cache_[size_class].lftc.freelist();
+    } else if (implementation_ == TransferCacheImplementation::Ring) {
       return cache_[size_class].rbtc.freelist();
     } else {
       return cache_[size_class].tc.freelist();
@@ -314,7 +455,9 @@ class TransferCacheManager : public StaticForwarder {
   TransferCacheImplementation implementation() const { return implementation_; }
 
   bool CanIncreaseCapacity(int size_class) {
-    if (implementation_ == TransferCacheImplementation::Ring) {
+    if (lock_free_[size_class]) {
+      return cache_[size_class].lftc.CanIncreaseCapacity(size_class);
+    } else if (implementation_ == TransferCacheImplementation::Ring) {
       return cache_[size_class].rbtc.CanIncreaseCapacity(size_class);
     } else {
       return cache_[size_class].tc.CanIncreaseCapacity(size_class);
@@ -335,9 +478,20 @@ class TransferCacheManager : public StaticForwarder {
 
   static TransferCacheImplementation ChooseImplementation();
 
+  // Sets lock_free[size_class] for the size classes that use the lock-free
+  // transfer cache in place of the implementation chosen above, as listed by
+  // TCMALLOC_INTERNAL_LOCK_FREE_TRANSFER_CACHE: "all", or size classes and
+  // ranges of them separated by commas, e.g. "1-16,24".
+  static void ChooseLockFreeClasses(bool lock_free[kNumClasses]);
+
+  // Whether size_class uses the lock-free transfer cache.
+  bool lock_free(int size_class) const { return lock_free_[size_class]; }
+
   void InitCaches() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
     for (int i = 0; i < kNumClasses; ++i) {
-      if (implementation_ == TransferCacheImplementation::Ring) {
+      if (lock_free_[i]) {
+        new (&cache_[i].lftc) LockFreeTransferCache(this, i);
+      } else if (implementation_ == TransferCacheImplementation::Ring) {
         new (&cache_[i].rbtc) RingBufferTransferCache(this, i);
       } else {
         new (&cache_[i].tc) TransferCache(this, i);
@@ -346,7 +500,9 @@ class TransferCacheManager : public StaticForwarder {
   }
 
   bool ShrinkCache(int size_class) {
-    if (implementation_ == TransferCacheImplementation::Ring) {
+    if (lock_free_[size_class]) {
+      return cache_[size_class].lftc.ShrinkCache(size_class);
+    } else if (implementation_ == TransferCacheImplementation::Ring) {
       return cache_[size_class].rbtc.ShrinkCache(size_class);
     } else {
       return cache_[size_class].tc.ShrinkCache(size_class);
@@ -354,7 +510,9 @@ class TransferCacheManager : public StaticForwarder {
   }
 
   bool IncreaseCacheCapacity(int size_class) {
-    if (implementation_ == TransferCacheImplementation::Ring) {
+    if (lock_free_[size_class]) {
+      return cache_[size_class].lftc.IncreaseCacheCapacity(size_class);
+    } else if (implementation_ == TransferCacheImplementation::Ring) {
       return cache_[size_class].rbtc.IncreaseCacheCapacity(size_class);
     } else {
       return cache_[size_class].tc.IncreaseCacheCapacity(size_class);
@@ -362,7 +520,9 @@ class TransferCacheManager : public StaticForwarder {
   }
 
   size_t FetchCommitIntervalMisses(int size_class) {
-    if (implementation_ == TransferCacheImplementation::Ring) {
+    if (lock_free_[size_class]) {
+      return cache_[size_class].lftc.FetchCommitIntervalMisses();
+    } else if (implementation_ == TransferCacheImplementation::Ring) {
       return cache_[size_class].rbtc.FetchCommitIntervalMisses();
     } else {
       return cache_[size_class].tc.FetchCommitIntervalMisses();
@@ -372,12 +532,14 @@ class TransferCacheManager : public StaticForwarder {
  private:
   TransferCacheImplementation implementation_ =
       TransferCacheImplementation::Legacy;
+  bool lock_free_[kNumClasses] = {};
   union Cache {
     constexpr Cache() : dummy(false) {}
     ~Cache() {}
 
     TransferCache tc;
     RingBufferTransferCache rbtc;
+    LockFreeTransferCache lftc;
     bool dummy;
   };
   Cache cache_[kNumClasses];
@@ -422,6 +584,8 @@ class TransferCacheManager {
     return TransferCacheImplementation::None;
   }
 
+  bool lock_free(int size_class) const { return false; }
+
  private:
   CentralFreeList freelist_[kNumClasses];
 } ABSL_CACHELINE_ALIGNED;
@@ -429,8 +593,13 @@ class TransferCacheManager {
 // A trivial no-op implementation.
 struct ShardedTransferCacheManager {
   constexpr ShardedTransferCacheManager(std::nullptr_t, std::nullptr_t) {}
-  static constexpr void Init() {}
+  static constexpr void Init(bool large_classes = true) {}
   static constexpr bool should_use(int size_class) { return false; }
+  static constexpr bool shares_batches(int size_class) { return false; }
+  static constexpr int RemoveRange(int size_class, void** batch, int n) {
+    return 0;
+  }
+  static constexpr void InsertRange(int size_class, absl::Span<void*> batch) {}
   static constexpr void* Pop(int size_class) { return nullptr; }
   static constexpr void Push(int size_class, void* ptr) {}
   static constexpr size_t TotalBytes() { return 0; }
@@ -37,6 +37,9 @@ using TransferCacheEnv =
 using RingBufferTransferCacheEnv = FakeTransferCacheEnvironment<
     internal_transfer_cache::RingBufferTransferCache<MinimalFakeCentralFreeList,
                                                      FakeTransferCacheManager>>;
+using LockFreeTransferCacheEnv = FakeTransferCacheEnvironment<
+    internal_transfer_cache::LockFreeTransferCache<MinimalFakeCentralFreeList,
+                                                   FakeTransferCacheManager>>;
 static constexpr int kSizeClass = 0;
 
 template <typename Env>
@@ -237,16 +240,22 @@ void BM_RealisticHitRate(benchmark::State& state) {
       static_cast<double>(stats.remove_non_batch_misses) / total_removes;
 }
 
-BENCHMARK_TEMPLATE(BM_CrossThread, TransferCacheEnv)->ThreadRange(2, 64);
+BENCHMARK_TEMPLATE(BM_CrossThread, TransferCacheEnv)->ThreadRange(2, 128);
 BENCHMARK_TEMPLATE(BM_CrossThread, RingBufferTransferCacheEnv)
-    ->ThreadRange(2, 64);
+    ->ThreadRange(2, 128);
+BENCHMARK_TEMPLATE(BM_CrossThread, LockFreeTransferCacheEnv)
+    ->ThreadRange(2, 128);
 BENCHMARK_TEMPLATE(BM_InsertRange, TransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_InsertRange, RingBufferTransferCacheEnv);
+BENCHMARK_TEMPLATE(BM_InsertRange, LockFreeTransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_RemoveRange, TransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_RemoveRange, RingBufferTransferCacheEnv);
+BENCHMARK_TEMPLATE(BM_RemoveRange, LockFreeTransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_RealisticBatchNonBatchMutations, TransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_RealisticBatchNonBatchMutations,
                    RingBufferTransferCacheEnv);
+BENCHMARK_TEMPLATE(BM_RealisticBatchNonBatchMutations,
+                   LockFreeTransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_RealisticHitRate, TransferCacheEnv);
 BENCHMARK_TEMPLATE(BM_RealisticHitRate, TransferCacheWithRealCFLEnv);
 
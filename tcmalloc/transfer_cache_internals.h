@@ -563,8 +563,10 @@ class RingBufferTransferCache {
   // Returns the actual number of fetched elements and stores elements in the
   // batch. This might return less than N if the transfercache is non-empty but
   // contains fewer elements than N. It is guaranteed to return at least 1 as
-  // long as either the transfercache or the free list are not empty.
-  ABSL_MUST_USE_RESULT int RemoveRange(int size_class, void **batch, int N)
+  // long as either the transfercache or the free list are not empty.  If
+  // missed is not null, it is set to whether the cache was empty.
+  ABSL_MUST_USE_RESULT int RemoveRange(int size_class, void **batch, int N,
+                                       bool *missed = nullptr)
       ABSL_LOCKS_EXCLUDED(lock_) {
     ASSERT(N > 0);
 
@@ -579,12 +581,14 @@ class RingBufferTransferCache {
         remove_hits_.LossyAdd(1);
         low_water_mark_ = std::min(low_water_mark_, info.used);
         ASSERT(low_water_mark_ <= slot_info_.used);
+        if (missed != nullptr) *missed = false;
         return copied;
       }
       ASSERT(low_water_mark_ == 0);
     }
 
     remove_misses_.Inc();
+    if (missed != nullptr) *missed = true;
     return freelist().RemoveRange(batch, N);
   }
 
@@ -870,6 +874,225 @@ class RingBufferTransferCache {
   Manager *const owner_do_not_access_directly_;
 } ABSL_CACHELINE_ALIGNED;
 
+// LockFreeTransferCache is a transfer cache for size classes whose lock is
+// contended by many CPUs.  It is a bounded multi-producer multi-consumer ring
+// of single objects, each slot with a sequence number that tells which lap of
+// the ring it is ready for: a producer at position p may fill the slot of p
+// when its sequence is p, and publishes it with p + 1; a consumer of p takes
+// it at p + 1 and frees it for the next lap with p + slots.  Batches claim a
+// run of ready slots with one compare-and-swap of the position, so an
+// InsertRange() or RemoveRange() of a batch that fits costs two atomic
+// read-modify-writes at most in the absence of contention, and no lock.
+//
+// A batch that finds fewer ready slots than it needs moves the rest to or
+// from the central free list.  The capacity is fixed when the cache is
+// constructed, so this cache neither grows nor shrinks.
+template <typename CentralFreeList, typename TransferCacheManager>
+class LockFreeTransferCache {
+ public:
+  using Manager = TransferCacheManager;
+  using FreeList = CentralFreeList;
+
+  LockFreeTransferCache(Manager *owner, int size_class)
+      : LockFreeTransferCache(owner, size_class, CapacityNeeded(size_class)) {}
+
+  LockFreeTransferCache(
+      Manager *owner, int size_class,
+      typename TransferCache<CentralFreeList, TransferCacheManager>::Capacity
+          capacity)
+      : freelist_do_not_access_directly_() {
+    freelist().Init(size_class);
+    if (capacity.max_capacity > 0) {
+      num_slots_ = absl::bit_floor<size_t>(capacity.max_capacity);
+      slots_ = reinterpret_cast<Slot *>(
+          owner->Alloc(num_slots_ * sizeof(Slot), ABSL_CACHELINE_SIZE));
+      ASSERT(slots_ != nullptr);
+      for (size_t i = 0; i < num_slots_; ++i) {
+        new (&slots_[i]) Slot;
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+    enqueue_pos_.store(0, std::memory_order_relaxed);
+    dequeue_pos_.store(0, std::memory_order_relaxed);
+  }
+
+  LockFreeTransferCache(const LockFreeTransferCache &) = delete;
+  LockFreeTransferCache &operator=(const LockFreeTransferCache &) = delete;
+
+  // This transfercache implementation handles non-batch sized
+  // inserts and removes efficiently.
+  static constexpr bool IsFlexible() { return true; }
+
+  // The ring has no room to grow into, so it starts at the largest capacity
+  // the locked caches may grow to, rounded down to a power of two.
+  static typename TransferCache<CentralFreeList, TransferCacheManager>::Capacity
+  CapacityNeeded(int size_class) {
+    const int max_capacity =
+        TransferCache<CentralFreeList, TransferCacheManager>::CapacityNeeded(
+            size_class)
+            .max_capacity;
+    const int capacity =
+        max_capacity > 0 ? absl::bit_floor<uint32_t>(max_capacity) : 0;
+    return {.capacity = capacity, .max_capacity = capacity};
+  }
+
+  // Insert the specified batch into the transfer cache.  N is the number of
+  // elements in the range.  RemoveRange() is the opposite operation.
+  void InsertRange(int size_class, absl::Span<void *> batch) {
+    const int N = batch.size();
+    ASSERT(0 < N && N <= Manager::num_objects_to_move(size_class));
+    uint64_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    const int claimed = Claim(enqueue_pos_, pos, N, 0);
+    for (int i = 0; i < claimed; ++i) {
+      Slot &slot = slots_[(pos + i) & (num_slots_ - 1)];
+      slot.object = batch[i];
+      slot.sequence.store(pos + i + 1, std::memory_order_release);
+    }
+    if (ABSL_PREDICT_TRUE(claimed == N)) {
+      insert_hits_.Add(1);
+      return;
+    }
+    insert_misses_.Inc();
+    freelist().InsertRange(batch.subspan(claimed));
+  }
+
+  // Returns the actual number of fetched elements and stores elements in the
+  // batch. This might return less than N if the transfercache is non-empty but
+  // contains fewer elements than N. It is guaranteed to return at least 1 as
+  // long as either the transfercache or the free list are not empty.
+  ABSL_MUST_USE_RESULT int RemoveRange(int size_class, void **batch, int N) {
+    ASSERT(N > 0);
+    uint64_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    const int claimed = Claim(dequeue_pos_, pos, N, 1);
+    for (int i = 0; i < claimed; ++i) {
+      Slot &slot = slots_[(pos + i) & (num_slots_ - 1)];
+      batch[i] = slot.object;
+      slot.sequence.store(pos + i + num_slots_, std::memory_order_release);
+    }
+    if (ABSL_PREDICT_TRUE(claimed > 0)) {
+      remove_hits_.Add(1);
+      return claimed;
+    }
+    remove_misses_.Inc();
+    return freelist().RemoveRange(batch, N);
+  }
+
+  // Nothing is plundered: objects do not age in the ring, and only the
+  // sharded transfer caches, which keep the locked ring, are plundered.
+  void TryPlunder(int size_class) {}
+
+  // Returns the number of free objects in the transfer cache.  Objects of
+  // batches in flight may or may not be counted.
+  size_t tc_length() const {
+    const uint64_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+    const uint64_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+    const int64_t used = static_cast<int64_t>(enqueued - dequeued);
+    return std::clamp<int64_t>(used, 0, num_slots_);
+  }
+
+  // Fetches the misses for the latest interval and commits them to the total.
+  size_t FetchCommitIntervalMisses() {
+    return insert_misses_.Commit() + remove_misses_.Commit();
+  }
+
+  // Returns the number of transfer cache insert/remove hits/misses.
+  TransferCacheStats GetStats() {
+    TransferCacheStats stats;
+
+    stats.insert_hits = insert_hits_.value();
+    stats.remove_hits = remove_hits_.value();
+    stats.insert_misses = insert_misses_.Total();
+    stats.insert_non_batch_misses = 0;
+    stats.remove_misses = remove_misses_.Total();
+    stats.remove_non_batch_misses = 0;
+    stats.used = tc_length();
+    stats.capacity = num_slots_;
+    stats.max_capacity = num_slots_;
+
+    return stats;
+  }
+
+  // The capacity is fixed, see the class comment.
+  bool IncreaseCacheCapacity(int size_class) { return false; }
+  bool CanIncreaseCapacity(int size_class) { return false; }
+  bool ShrinkCache(int size_class) { return false; }
+
+  // Checks if the cache has at least batch size number of free slots. Returns
+  // false if (capacity - used) slots is less than batch size.
+  bool HasSpareCapacity(int size_class) const {
+    const size_t n = Manager::num_objects_to_move(size_class);
+    return num_slots_ - tc_length() >= n;
+  }
+
+  ABSL_ATTRIBUTE_ALWAYS_INLINE FreeList &freelist() {
+    return freelist_do_not_access_directly_;
+  }
+
+  ABSL_ATTRIBUTE_ALWAYS_INLINE const FreeList &freelist() const {
+    return freelist_do_not_access_directly_;
+  }
+
+  int32_t max_capacity() const { return num_slots_; }
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    void *object;
+  };
+
+  // Claims up to N slots from position `*pos` of `position`: the run of
+  // consecutive slots whose sequence is their position plus `ready`, 0 for
+  // producers and 1 for consumers.  Returns how many were claimed, starting
+  // at the `*pos` it returns; 0 if the ring is full for producers or empty
+  // for consumers.  A slot a producer has claimed but not yet filled ends
+  // the run of a consumer, which takes the published slots before it.
+  int Claim(std::atomic<uint64_t> &position, uint64_t &pos, int N,
+            uint64_t ready) {
+    if (num_slots_ == 0) return 0;
+    while (true) {
+      int n = 0;
+      while (n < N) {
+        const uint64_t sequence =
+            slots_[(pos + n) & (num_slots_ - 1)].sequence.load(
+                std::memory_order_acquire);
+        if (sequence != pos + n + ready) break;
+        ++n;
+      }
+      if (n == 0) {
+        const uint64_t sequence = slots_[pos & (num_slots_ - 1)].sequence.load(
+            std::memory_order_acquire);
+        // Behind the slot's lap: the ring is full, or empty, at pos.
+        if (static_cast<int64_t>(sequence - (pos + ready)) < 0) return 0;
+        // Another thread claimed pos since we read it.
+        pos = position.load(std::memory_order_relaxed);
+        continue;
+      }
+      // Nobody else claims a slot between pos and pos + n while position is
+      // still pos, so the sequences read above stay valid once this succeeds.
+      if (position.compare_exchange_weak(pos, pos + n,
+                                         std::memory_order_relaxed)) {
+        return n;
+      }
+    }
+  }
+
+  // Producers and consumers each keep their position on a cache line of
+  // their own.
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<uint64_t> enqueue_pos_;
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<uint64_t> dequeue_pos_;
+
+  alignas(ABSL_CACHELINE_SIZE) Slot *slots_ = nullptr;
+  // A power of two, or 0 for a size class without a cache.
+  size_t num_slots_ = 0;
+
+  StatsCounter insert_hits_;
+  StatsCounter remove_hits_;
+  MissCounts insert_misses_;
+  MissCounts remove_misses_;
+
+  FreeList freelist_do_not_access_directly_;
+} ABSL_CACHELINE_ALIGNED;
+
 template <typename Manager>
 void TryResizingCaches(Manager &manager) {
   // Tracks misses per size class.
@@ -619,6 +619,44 @@ TEST(ShardedTransferCacheManagerTest, ShardsOnDemand) {
   }
 }
 
+#ifdef LLC_REMOTE_FREES
+TEST(ShardedTransferCacheManagerTest, FreesGoToTheRefillingShard) {
+  FakeShardedTransferCacheEnvironment env;
+  FakeShardedTransferCacheEnvironment::ShardedManager& manager =
+      env.sharded_manager();
+
+  // cpu 0 (shard 0) finds its cache empty, so it refills from the central
+  // free list and becomes the shard the size class is freed to.
+  env.SetCurrentCpu(0);
+  void* ptr = manager.Pop(kSizeClass);
+  ASSERT_NE(ptr, nullptr);
+
+  // A free on cpu 2 (shard 1) goes to shard 0.
+  env.SetCurrentCpu(2);
+  manager.Push(kSizeClass, ptr);
+  EXPECT_EQ(manager.tc_length(0, kSizeClass), 1);
+  EXPECT_EQ(manager.tc_length(2, kSizeClass), 0);
+  EXPECT_EQ(manager.remote_inserts(), 1);
+
+  // Frees on shard 0 stay there.
+  env.SetCurrentCpu(1);
+  ptr = manager.Pop(kSizeClass);
+  ASSERT_NE(ptr, nullptr);
+  manager.Push(kSizeClass, ptr);
+  EXPECT_EQ(manager.tc_length(0, kSizeClass), 1);
+  EXPECT_EQ(manager.remote_inserts(), 1);
+
+  // After a background pass the freeing shard keeps its frees.
+  manager.Plunder();
+  env.SetCurrentCpu(2);
+  void* other;
+  env.central_freelist().AllocateBatch(&other, 1);
+  manager.Push(kSizeClass, other);
+  EXPECT_EQ(manager.tc_length(2, kSizeClass), 1);
+  EXPECT_EQ(manager.remote_inserts(), 1);
+}
+#endif
+
 namespace unit_tests {
 using Env = FakeTransferCacheEnvironment<internal_transfer_cache::TransferCache<
     MockCentralFreeList, FakeTransferCacheManager>>;
@@ -637,6 +675,12 @@ using RingBufferEnv = FakeTransferCacheEnvironment<
 INSTANTIATE_TYPED_TEST_SUITE_P(RingBuffer, TransferCacheTest,
                                ::testing::Types<RingBufferEnv>);
 
+using LockFreeEnv = FakeTransferCacheEnvironment<
+    internal_transfer_cache::LockFreeTransferCache<MockCentralFreeList,
+                                                   FakeTransferCacheManager>>;
+INSTANTIATE_TYPED_TEST_SUITE_P(LockFree, TransferCacheTest,
+                               ::testing::Types<LockFreeEnv>);
+
 }  // namespace unit_tests
 
 namespace fuzz_tests {
@@ -659,6 +703,12 @@ using RingBufferEnv = FakeTransferCacheEnvironment<
                                                      FakeTransferCacheManager>>;
 INSTANTIATE_TYPED_TEST_SUITE_P(RingBuffer, FuzzTest,
                                ::testing::Types<RingBufferEnv>);
+
+using LockFreeEnv = FakeTransferCacheEnvironment<
+    internal_transfer_cache::LockFreeTransferCache<MockCentralFreeList,
+                                                   FakeTransferCacheManager>>;
+INSTANTIATE_TYPED_TEST_SUITE_P(LockFree, FuzzTest,
+                               ::testing::Types<LockFreeEnv>);
 }  // namespace fuzz_tests
 
 namespace resize_tests {
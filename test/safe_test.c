@@ -1,15 +1,36 @@
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 
-#define MEM_SIZE 0x1
+#include "tcmalloc/inline_check.h"
+#include "tcmalloc/poison.h"
+
+#define MEM_SIZE 0x3
 
 void *ptr[MEM_SIZE];
 void *ptr_escape[MEM_SIZE];
 
 int __gep_check_boundary(void *, void *, size_t);
+int __bc_check_boundary(void *, size_t);
+int __escape_batch(void ***, void **, size_t);
+int __escape_range(void *, const void *, size_t);
+int __escape_store_release(void **, void *);
+void *__escape_cas(void **, void *, void *);
+void *__strcpy_check(void *, void *);
+void *__strncpy_check(void *, void *, size_t);
+void *__strcat_check(void *, void *);
+void *__strncat_check(void *, void *, size_t);
+void *__memcpy_check(void *, const void *, size_t);
+void *__memmove_check(void *, const void *, size_t);
+void *__memset_check(void *, int, size_t);
+size_t __strlen_check(const void *);
+size_t __strnlen_check(const void *, size_t);
 
 void test_invalid_free() {
   void *p;
@@ -40,16 +61,60 @@ void test_check_boundary() {
   assert(__gep_check_boundary(p, p-1, 1) == -1);
   // p[-1] = 0;
 
-  assert(__gep_check_boundary(p, p, 81) == -1);
+  // the size is not checked, only the pointer: the first byte past the chunk
+  assert(__gep_check_boundary(p, (char *)__chunk_range(p).end, 1) == -1);
   // p[80] = 1;
   free(p);
 
   p = malloc(0x2000);
-  assert(__gep_check_boundary(p, p, 0x2001) == -1);
+  assert(__gep_check_boundary(p, (char *)__chunk_range(p).end, 1) == -1);
   // p[0x2000] = 1;
   free(p);
 }
 
+void test_str_check() {
+  char *src = malloc(64);
+  char *dst = malloc(64);
+
+  memset(src, 'a', 40);
+  src[40] = 0;
+  assert(__strcpy_check(dst, src) == dst);
+  assert(strcmp(dst, src) == 0);
+
+  assert(__strncpy_check(dst, src, 10) == dst);
+  assert(strlen(dst) == 10);
+
+  // 10 + 40 characters and the terminator still fit in 64 bytes
+  assert(__strcat_check(dst, src) == dst);
+  assert(strlen(dst) == 50);
+
+  dst[0] = 0;
+  assert(__strncat_check(dst, "hello", 3) == dst);
+  assert(strcmp(dst, "hel") == 0);
+
+  free(src);
+  free(dst);
+}
+
+void test_mem_check() {
+  char *a = malloc(64);
+  char *b = malloc(64);
+  char stack[16] = "on the stack";
+
+  assert(__memset_check(a, 'x', 63) == a);
+  a[63] = 0;
+  assert(__memcpy_check(b, a, 64) == b);
+  assert(memcmp(a, b, 64) == 0);
+  assert(__memmove_check(b + 1, b, 32) == b + 1);
+  assert(b[0] == 'x' && b[32] == 'x');
+  assert(__strlen_check(a) == 63);
+  assert(__strnlen_check(a, 10) == 10);
+  assert(__strlen_check(stack) == strlen(stack));
+
+  free(a);
+  free(b);
+}
+
 // escape stored on stack
 // then stack being reused
 void test_escape_0() {
@@ -68,7 +133,8 @@ void test_escape_0() {
   __escape(&p, tmp);
   p = tmp;
   free(p);
-  assert(p == 0xdeadbeefdeadbeef);
+  assert(TCMALLOC_IS_POISONED(p));
+  assert(TCMALLOC_POISONED_ADDRESS(p) == (uintptr_t)tmp);
 }
 
 // escape being overwritten
@@ -92,6 +158,76 @@ void test_escape_1() {
   free(ptr[0]);
 }
 
+// a staged escape moved to another object is poisoned with that object
+void test_escape_moved() {
+  void *a = malloc(80), *b = malloc(80);
+
+  __escape(&ptr[1], a);
+  ptr[1] = a;
+  __escape(&ptr[2], a);
+  ptr[2] = a;
+  __escape(&ptr[1], b);
+  ptr[1] = b;
+
+  free(b);
+  assert(TCMALLOC_IS_POISONED(ptr[1]));
+  assert(ptr[2] == a);
+  free(a);
+  assert(TCMALLOC_IS_POISONED(ptr[2]));
+}
+
+// a later free of an object at the same address poisons a newer generation
+void test_poison_generation() {
+  void *a = malloc(48);
+  __escape(&ptr[0], a);
+  ptr[0] = a;
+  free(a);
+  void *stale = ptr[0];
+  assert(TCMALLOC_IS_POISONED(stale));
+  // storing a stale pointer elsewhere is not tracked
+  assert(__escape(&ptr_escape[0], stale) == -1);
+
+  void *b = malloc(48);
+  __escape(&ptr[0], b);
+  ptr[0] = b;
+  free(b);
+  assert(TCMALLOC_IS_POISONED(ptr[0]));
+  if (b == a)
+    assert(TCMALLOC_POISON_GENERATION(ptr[0]) !=
+           TCMALLOC_POISON_GENERATION(stale));
+
+  // past the 8 bit counter the generation wraps to 1, never to 0
+  for (int i = 0; i < 300; i++) {
+    void *c = malloc(48);
+    __escape(&ptr[0], c);
+    ptr[0] = c;
+    free(c);
+    assert(TCMALLOC_IS_POISONED(ptr[0]));
+    assert(TCMALLOC_POISON_GENERATION(ptr[0]) != 0);
+  }
+}
+
+// with pointer tags, a freed object moves on to a new tag
+void test_pointer_tags() {
+  struct TCMallocInlineCheckLayout layout;
+  assert(__inline_check_layout(&layout) == TCMALLOC_INLINE_CHECK_VERSION);
+  const uintptr_t mask = layout.pointer_tag_mask;
+  if (mask == 0)
+    return;
+
+  char *a = malloc(48);
+  assert(((uintptr_t)a & mask) != 0);
+  assert(__gep_check_boundary(a, a + 8, 1) == 0);
+  free(a);
+  assert(__gep_check_boundary(a, a + 8, 1) == -1);
+
+  char *b = malloc(48);
+  if (((uintptr_t)b & ~mask) == ((uintptr_t)a & ~mask))
+    assert(((uintptr_t)b & mask) != ((uintptr_t)a & mask));
+  assert(__gep_check_boundary(b, b + 8, 1) == 0);
+  free(b);
+}
+
 void test_escape_2() {
   void **mem = malloc(80);
 
@@ -129,6 +265,178 @@ void test_escape_3() {
   free(tmp_2);
 }
 
+// escape recorded by a thread that exits before flushing its buffer
+static void *escape_thread(void *arg) {
+  void *tmp = arg;
+  __escape(&ptr_escape[0], tmp);
+  ptr_escape[0] = tmp;
+  return NULL;
+}
+
+void test_escape_thread_exit() {
+  pthread_t t;
+  void *tmp = malloc(80);
+
+  pthread_create(&t, NULL, escape_thread, tmp);
+  pthread_join(t, NULL);
+
+  // the exiting thread committed its escapes, so free will poison
+  free(tmp);
+  assert(TCMALLOC_IS_POISONED(ptr_escape[0]));
+  assert(TCMALLOC_POISONED_ADDRESS(ptr_escape[0]) == (uintptr_t)tmp);
+}
+
+#define BATCH_SIZE 16
+
+void test_escape_batch() {
+  void **slots = malloc(BATCH_SIZE*sizeof(void *));
+  void **locs[BATCH_SIZE];
+  void *objs[BATCH_SIZE];
+
+  for (int i=0; i<BATCH_SIZE; i++) {
+    objs[i] = malloc(64);
+    locs[i] = &slots[i];
+  }
+  assert(__escape_batch(locs, objs, BATCH_SIZE) == 0);
+  for (int i=0; i<BATCH_SIZE; i++)
+    slots[i] = objs[i];
+
+  // every slot was tracked, so each free poisons its own slot only
+  for (int i=0; i<BATCH_SIZE; i++) {
+    free(objs[i]);
+    assert(TCMALLOC_IS_POISONED(slots[i]));
+    assert(TCMALLOC_POISONED_ADDRESS(slots[i]) == (uintptr_t)objs[i]);
+  }
+  free(slots);
+}
+
+void test_escape_atomic() {
+  void **slot = malloc(sizeof(void *));
+  void *a = malloc(64), *b = malloc(64), *c = malloc(64);
+
+  // the store and the escape are one call
+  __escape_store_release(slot, a);
+  assert(*slot == a);
+  // a failed exchange stores nothing and tracks nothing
+  assert(__escape_cas(slot, b, c) == a);
+  assert(*slot == a);
+  free(c);
+  assert(*slot == a);
+  // a successful one tracks what it stored
+  assert(__escape_cas(slot, a, b) == a);
+  assert(*slot == b);
+  free(b);
+  assert(TCMALLOC_IS_POISONED(*slot));
+  assert(TCMALLOC_POISONED_ADDRESS(*slot) == (uintptr_t)b);
+  free(a);
+  free(slot);
+}
+
+struct range_node {
+  long id;
+  void *a;
+  void *b;
+};
+
+// escapes into a page allocation are poisoned with the pages they point to
+void test_escape_large() {
+  const size_t size = 3 << 19;
+  char *a = malloc(size);
+  void *head, *tail;
+
+  __escape(&head, a + 16);
+  head = a + 16;
+  __escape(&tail, a + size - 16);
+  tail = a + size - 16;
+
+  // shrinking gives back the pages tail points into
+  a = realloc(a, size / 4);
+  assert(TCMALLOC_IS_POISONED(tail));
+  free(a);
+  assert(TCMALLOC_IS_POISONED(head));
+}
+
+// an escape into a span that reuses the pages of a freed one is tracked
+// into the new span
+void test_escape_span_reuse() {
+  const size_t size = 1 << 20;
+  char *a = malloc(size);
+  void *p, *q;
+
+  __escape(&p, a);
+  p = a;
+  free(a);
+  assert(TCMALLOC_IS_POISONED(p));
+
+  char *b = malloc(size);
+  __escape(&q, b + 8);
+  q = b + 8;
+  free(b);
+  assert(TCMALLOC_IS_POISONED(q));
+}
+
+#ifdef FREE_QUARANTINE
+// A freed object stays poisoned and out of the caches until a full shard of
+// the quarantine releases it.  Shards are per CPU, so the test stays on one.
+void test_free_quarantine() {
+  enum { kObjects = 256 };  // two shards' worth
+  static void *objs[kObjects];
+  cpu_set_t cpus, one;
+  int err = sched_getaffinity(0, sizeof(cpus), &cpus);
+  CPU_ZERO(&one);
+  CPU_SET(sched_getcpu(), &one);
+  err |= sched_setaffinity(0, sizeof(one), &one);
+  assert(err == 0);
+
+  void *a = malloc(48);
+  __escape(&ptr[0], a);
+  ptr[0] = a;
+  free(a);
+  assert(TCMALLOC_IS_POISONED(ptr[0]));
+  for (int i = 0; i < kObjects; i++) {
+    objs[i] = malloc(48);
+    assert(objs[i] != a);
+  }
+
+  // fills the shard, which releases its batch with a in it
+  for (int i = 0; i < kObjects; i++)
+    free(objs[i]);
+  assert(TCMALLOC_IS_POISONED(ptr[0]));
+  int reused = 0;
+  for (int i = 0; i < kObjects; i++) {
+    objs[i] = malloc(48);
+    reused |= objs[i] == a;
+  }
+  assert(reused);
+  for (int i = 0; i < kObjects; i++)
+    free(objs[i]);
+  sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+#endif
+
+void test_escape_range() {
+  struct range_node *src = malloc(sizeof(*src));
+  struct range_node *dst = malloc(sizeof(*dst));
+  void *a = malloc(32), *b = malloc(32);
+
+  src->id = 1;
+  src->a = a;
+  src->b = b;
+  // struct copy: both pointer fields of dst are tracked, the id is not
+  __escape_range(dst, src, sizeof(*src));
+  memcpy(dst, src, sizeof(*src));
+
+  free(a);
+  assert(TCMALLOC_IS_POISONED(dst->a));
+  assert(TCMALLOC_POISONED_ADDRESS(dst->a) == (uintptr_t)a);
+  assert(dst->id == 1);
+  free(b);
+  assert(TCMALLOC_IS_POISONED(dst->b));
+  assert(TCMALLOC_POISONED_ADDRESS(dst->b) == (uintptr_t)b);
+  free(src);
+  free(dst);
+}
+
 
 #define ALLOC_SIZE 0x1000
 #define ROUND 0x1000
@@ -167,18 +475,179 @@ void test_escape_fuzz() {
   printf("FINISHING test_escape_fuzz\n");
 }
 
+#define CHECK_BATCH 40
+
+void test_check_boundary_range() {
+  char *p = malloc(80);
+  char *q = malloc(0x2000);
+  void *bases[CHECK_BATCH], *ptrs[CHECK_BATCH];
+  struct TCMallocChunkRange range = __chunk_range(p + 8);
+
+  assert(range.start == (uintptr_t)p && range.end >= (uintptr_t)(p + 80));
+  assert(__gep_check_boundary_range(p, p, 80) == 0);
+  assert(__gep_check_boundary_range(p, p + 8, 0) == 0);
+  assert(__gep_check_boundary_range(p, p - 1, 2) == -1);
+  // the padding byte puts q in a larger class, so take the bound from it
+  range = __chunk_range(q);
+  assert(__gep_check_boundary_range(q, q, range.end - (uintptr_t)q) == 0);
+  assert(__gep_check_boundary_range(q, q, range.end - (uintptr_t)q + 1) == -1);
+
+  // alternate between two chunks, with a run of the same base in between
+  for (int i = 0; i < CHECK_BATCH; i++) {
+    char *base = (i < 10 || i % 2) ? p : q;
+    bases[i] = base;
+    ptrs[i] = base + i;
+  }
+  assert(__gep_check_boundary_batch(bases, ptrs, CHECK_BATCH) == 0);
+  ptrs[CHECK_BATCH - 1] = (char *)bases[CHECK_BATCH - 1] - 1;
+  assert(__gep_check_boundary_batch(bases, ptrs, CHECK_BATCH) == -1);
+
+  free(p);
+  free(q);
+
+  // too large for the page info word to hold its size in bytes
+  p = malloc(32 << 20);
+  range = __chunk_range(p + (20 << 20));
+  assert(range.start == (uintptr_t)p && range.end >= (uintptr_t)(p + (32 << 20)));
+  assert(__gep_check_boundary_range(p, p + (16 << 20), 16 << 20) == 0);
+  assert(__gep_check_boundary_range(p, p, range.end - range.start + 1) == -1);
+  free(p);
+}
+
+void test_chunk_range_batch() {
+  char *p = malloc(80);
+  char *q = malloc(0x2000);
+  int local = 0;
+  const void *words[CHECK_BATCH];
+  struct TCMallocChunkRange ranges[CHECK_BATCH];
+
+  // heap words between stack words, small integers and NULL, across blocks
+  for (int i = 0; i < CHECK_BATCH; i++) {
+    switch (i % 4) {
+      case 0: words[i] = p + i; break;
+      case 1: words[i] = &local; break;
+      case 2: words[i] = (void *)(uintptr_t)i; break;
+      case 3: words[i] = q + 0x1000; break;
+    }
+  }
+  assert(__chunk_range_batch(words, CHECK_BATCH, ranges) == CHECK_BATCH / 2);
+  for (int i = 0; i < CHECK_BATCH; i++) {
+    struct TCMallocChunkRange range = __chunk_range(words[i]);
+    if (i % 4 == 0 || i % 4 == 3) {
+      assert(ranges[i].start == range.start && ranges[i].end == range.end);
+      assert(ranges[i].start == (uintptr_t)(i % 4 ? q : p));
+    } else {
+      assert(ranges[i].start == 0 && ranges[i].end == 0);
+    }
+  }
+  assert(__chunk_range_batch(words, 0, ranges) == 0);
+
+  free(p);
+  free(q);
+}
+
+// page allocations are padded like class sized objects: the end pointer of
+// one lies in its own chunk, so a pointer to the start of the allocation
+// after it, wherever that is, is poisoned when that one is freed
+void test_page_allocation() {
+  const size_t size = 1 << 20;
+  char *a = malloc(size);
+  char *b = malloc(size);
+  void *end, *start;
+
+  assert(malloc_usable_size(a) >= size);
+  assert(__chunk_range(a + size).start == (uintptr_t)a);
+  assert(__gep_check_boundary(a, a + size, 0) == 0);
+
+  __escape(&end, a + size);
+  end = a + size;
+  __escape(&start, b);
+  start = b;
+  free(b);
+  assert(TCMALLOC_IS_POISONED(start));
+  assert(end == a + size);
+  free(a);
+  assert(TCMALLOC_IS_POISONED(end));
+}
+
+// Chunks cached by earlier checks must not outlive their span.
+void test_chunk_cache() {
+  for (int i = 0; i < 16; i++) {
+    char *p = malloc(0x100000);
+    assert(__gep_check_boundary(p, p + 0xfffff, 1) == 0);
+    free(p);
+
+    char *q = malloc(0x10000);
+    struct TCMallocChunkRange range = __chunk_range(q);
+    assert(range.start == (uintptr_t)q);
+    assert(range.end - range.start < 0x100000);
+    assert(__gep_check_boundary(q, q + 0xfffff, 1) == -1);
+    free(q);
+  }
+}
+
+void test_inline_check_layout() {
+  struct TCMallocInlineCheckLayout layout;
+  uintptr_t start, end;
+  char *small = malloc(75);
+  char *large = malloc(0x200000);
+
+  assert(__inline_check_layout(&layout) == TCMALLOC_INLINE_CHECK_VERSION);
+  assert(TCMallocInlineChunkRange(&layout, (uintptr_t)(small + 10), &start,
+                                  &end));
+  assert(start == (uintptr_t)small && end >= (uintptr_t)(small + 75));
+  assert(__gep_check_boundary(small, (void *)(end - 1), 1) == 0);
+  assert(TCMallocInlineChunkRange(&layout, (uintptr_t)(large + 0x100000),
+                                  &start, &end));
+  assert(start == (uintptr_t)large && end >= (uintptr_t)(large + 0x200000));
+  assert(!TCMallocInlineChunkRange(&layout, (uintptr_t)&layout, &start, &end));
+  assert(((uintptr_t)layout.class_info & 63) == 0);
+  for (int sc = 1; layout.class_to_size[sc] != 0; sc++) {
+    assert(layout.class_info[sc].size == layout.class_to_size[sc]);
+    assert(layout.class_info[sc].reciprocal == layout.class_to_magic[sc]);
+  }
+  free(small);
+  free(large);
+}
+
+static char non_heap_global[0x100];
+
+// gep checks pass non-heap memory as valid, bounds checks tell it apart
 void test_non_heap() {
   char data[0x100];
-  assert(1 == __gep_check_boundary(data, data+0x10, 0x10));
+  assert(0 == __gep_check_boundary(data, data+0x10, 0x10));
+  assert(0 == __gep_check_boundary(non_heap_global, non_heap_global + 0x10,
+                                   0x10));
+  assert(1 == __bc_check_boundary(data, 0x10));
+  assert(1 == __bc_check_boundary(non_heap_global, 0x10));
 }
 
 int main () {
   test_non_heap();
   test_check_boundary();
+  test_inline_check_layout();
+  test_check_boundary_range();
+  test_chunk_range_batch();
+  test_page_allocation();
+  test_chunk_cache();
+  test_str_check();
+  test_mem_check();
   test_escape_0();
   test_escape_1();
+  test_escape_moved();
+  test_poison_generation();
+  test_pointer_tags();
   test_escape_2();
   test_escape_3();
+  test_escape_thread_exit();
+  test_escape_batch();
+  test_escape_range();
+  test_escape_atomic();
+  test_escape_large();
+  test_escape_span_reuse();
+#ifdef FREE_QUARANTINE
+  test_free_quarantine();
+#endif
   test_escape_fuzz();
   test_invalid_free();
 